@@ -33,16 +33,29 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/session.hpp"
 #include "libtorrent/magnet_uri.hpp"
 #include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/alert_types.hpp"
 #include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <cstring>
 
 #include <libtorrent.h>
 
 namespace
 {
+	// the torrent ids are indices into handles. The info-hashes
+	// are kept alongside to map the results of batch status
+	// queries back to ids. The mutex is held while they are
+	// accessed, since the alert callback looks up torrent ids
+	// from the network thread
 	std::vector<libtorrent::torrent_handle> handles;
+	std::vector<libtorrent::sha1_hash> handle_hashes;
+	std::map<libtorrent::sha1_hash, int> handle_index;
+	boost::mutex handles_mutex;
 
 	int find_handle(libtorrent::torrent_handle h)
 	{
+		boost::mutex::scoped_lock l(handles_mutex);
 		std::vector<libtorrent::torrent_handle>::const_iterator i
 			= std::find(handles.begin(), handles.end(), h);
 		if (i == handles.end()) return -1;
@@ -51,24 +64,118 @@ namespace
 
 	libtorrent::torrent_handle get_handle(int i)
 	{
+		boost::mutex::scoped_lock l(handles_mutex);
 		if (i < 0 || i >= int(handles.size())) return libtorrent::torrent_handle();
 		return handles[i];
 	}
 
 	int add_handle(libtorrent::torrent_handle const& h)
 	{
+		libtorrent::sha1_hash ih = h.info_hash();
+
+		boost::mutex::scoped_lock l(handles_mutex);
 		std::vector<libtorrent::torrent_handle>::iterator i = std::find_if(handles.begin()
 			, handles.end(), !boost::bind(&libtorrent::torrent_handle::is_valid, _1));
 		if (i != handles.end())
 		{
+			int index = i - handles.begin();
+			std::map<libtorrent::sha1_hash, int>::iterator k
+				= handle_index.find(handle_hashes[index]);
+			if (k != handle_index.end() && k->second == index) handle_index.erase(k);
 			*i = h;
-			return i - handles.begin();
+			handle_hashes[index] = ih;
+			handle_index[ih] = index;
+			return index;
 		}
 
 		handles.push_back(h);
+		handle_hashes.push_back(ih);
+		handle_index[ih] = handles.size() - 1;
 		return handles.size() - 1;
 	}
 
+	int find_handle(libtorrent::sha1_hash const& ih)
+	{
+		boost::mutex::scoped_lock l(handles_mutex);
+		std::map<libtorrent::sha1_hash, int>::const_iterator i = handle_index.find(ih);
+		if (i == handle_index.end()) return -1;
+		return i->second;
+	}
+
+	bool accept_all(libtorrent::torrent_status const&) { return true; }
+
+	void copy_status(libtorrent::torrent_status const& ts, torrent_status* s)
+	{
+		s->state = (state_t)ts.state;
+		s->paused = ts.paused;
+		s->progress = ts.progress;
+		strncpy(s->error, ts.error.c_str(), sizeof(s->error) - 1);
+		s->error[sizeof(s->error) - 1] = 0;
+		s->next_announce = ts.next_announce.total_seconds();
+		s->announce_interval = ts.announce_interval.total_seconds();
+		strncpy(s->current_tracker, ts.current_tracker.c_str(), sizeof(s->current_tracker) - 1);
+		s->current_tracker[sizeof(s->current_tracker) - 1] = 0;
+		s->total_download = ts.total_download;
+		s->total_upload = ts.total_upload;
+		s->total_payload_download = ts.total_payload_download;
+		s->total_payload_upload = ts.total_payload_upload;
+		s->total_failed_bytes = ts.total_failed_bytes;
+		s->total_redundant_bytes = ts.total_redundant_bytes;
+		s->download_rate = ts.download_rate;
+		s->upload_rate = ts.upload_rate;
+		s->download_payload_rate = ts.download_payload_rate;
+		s->upload_payload_rate = ts.upload_payload_rate;
+		s->num_seeds = ts.num_seeds;
+		s->num_peers = ts.num_peers;
+		s->num_complete = ts.num_complete;
+		s->num_incomplete = ts.num_incomplete;
+		s->list_seeds = ts.list_seeds;
+		s->list_peers = ts.list_peers;
+		s->connect_candidates = ts.connect_candidates;
+		s->num_pieces = ts.num_pieces;
+		s->total_done = ts.total_done;
+		s->total_wanted_done = ts.total_wanted_done;
+		s->total_wanted = ts.total_wanted;
+		s->distributed_copies = ts.distributed_copies;
+		s->block_size = ts.block_size;
+		s->num_uploads = ts.num_uploads;
+		s->num_connections = ts.num_connections;
+		s->uploads_limit = ts.uploads_limit;
+		s->connections_limit = ts.connections_limit;
+//		s->storage_mode = (storage_mode_t)ts.storage_mode;
+		s->up_bandwidth_queue = ts.up_bandwidth_queue;
+		s->down_bandwidth_queue = ts.down_bandwidth_queue;
+		s->all_time_upload = ts.all_time_upload;
+		s->all_time_download = ts.all_time_download;
+		s->active_time = ts.active_time;
+		s->seeding_time = ts.seeding_time;
+		s->seed_rank = ts.seed_rank;
+		s->last_scrape = ts.last_scrape;
+		s->has_incoming = ts.has_incoming;
+		s->sparse_regions = ts.sparse_regions;
+		s->seed_mode = ts.seed_mode;
+	}
+
+	void copy_alert(libtorrent::alert const& a, alert_info* info)
+	{
+		info->category = a.category();
+		strncpy(info->what, a.what(), sizeof(info->what) - 1);
+		info->what[sizeof(info->what) - 1] = 0;
+		strncpy(info->message, a.message().c_str(), sizeof(info->message) - 1);
+		info->message[sizeof(info->message) - 1] = 0;
+		libtorrent::torrent_alert const* ta
+			= dynamic_cast<libtorrent::torrent_alert const*>(&a);
+		info->torrent = ta ? find_handle(ta->handle) : -1;
+	}
+
+	void invoke_alert_callback(alert_callback_t fun, void* userdata
+		, libtorrent::alert const& a)
+	{
+		alert_info info;
+		copy_alert(a, &info);
+		fun(userdata, &info);
+	}
+
 	int set_int_value(void* dst, int* size, int val)
 	{
 		if (*size < sizeof(int)) return -2;
@@ -462,59 +569,66 @@ int torrent_get_status(int tor, torrent_status* s, int struct_size)
 	libtorrent::torrent_handle h = get_handle(tor);
 	if (!h.is_valid()) return -1;
 
-	libtorrent::torrent_status ts = h.status();
+	if (struct_size != sizeof(torrent_status)) return -1;
+
+	copy_status(h.status(), s);
+	return 0;
+}
+
+int session_get_torrent_status(void* sesptr, int* tors, torrent_status* s
+	, int num, int struct_size, int flags)
+{
+	libtorrent::session* ses = (libtorrent::session*)sesptr;
 
 	if (struct_size != sizeof(torrent_status)) return -1;
+	if (num < 0) return -1;
+
+	// the session is locked once for all torrents
+	std::vector<libtorrent::torrent_status> st;
+	ses->get_torrent_status(&st, &accept_all, flags
+		& (libtorrent::torrent_handle::query_distributed_copies
+		| libtorrent::torrent_handle::query_pieces));
+
+	int ret = 0;
+	for (std::vector<libtorrent::torrent_status>::const_iterator i = st.begin()
+		, end(st.end()); i != end && ret < num; ++i)
+	{
+		int tor = find_handle(i->info_hash);
+		// torrents that weren't added through this
+		// interface don't have an id
+		if (tor == -1) continue;
+		tors[ret] = tor;
+		copy_status(*i, &s[ret]);
+		++ret;
+	}
+	return ret;
+}
+
+int session_pop_alert(void* sesptr, alert_info* a, int struct_size)
+{
+	libtorrent::session* ses = (libtorrent::session*)sesptr;
 
-	s->state = (state_t)ts.state;
-	s->paused = ts.paused;
-	s->progress = ts.progress;
-	strncpy(s->error, ts.error.c_str(), 1025);
-	s->next_announce = ts.next_announce.total_seconds();
-	s->announce_interval = ts.announce_interval.total_seconds();
-	strncpy(s->current_tracker, ts.current_tracker.c_str(), 512);
-	s->total_download = ts.total_download = ts.total_download = ts.total_download;
-	s->total_upload = ts.total_upload = ts.total_upload = ts.total_upload;
-	s->total_payload_download = ts.total_payload_download;
-	s->total_payload_upload = ts.total_payload_upload;
-	s->total_failed_bytes = ts.total_failed_bytes;
-	s->total_redundant_bytes = ts.total_redundant_bytes;
-	s->download_rate = ts.download_rate;
-	s->upload_rate = ts.upload_rate;
-	s->download_payload_rate = ts.download_payload_rate;
-	s->upload_payload_rate = ts.upload_payload_rate;
-	s->num_seeds = ts.num_seeds;
-	s->num_peers = ts.num_peers;
-	s->num_complete = ts.num_complete;
-	s->num_incomplete = ts.num_incomplete;
-	s->list_seeds = ts.list_seeds;
-	s->list_peers = ts.list_peers;
-	s->connect_candidates = ts.connect_candidates;
-	s->num_pieces = ts.num_pieces;
-	s->total_done = ts.total_done;
-	s->total_wanted_done = ts.total_wanted_done;
-	s->total_wanted = ts.total_wanted;
-	s->distributed_copies = ts.distributed_copies;
-	s->block_size = ts.block_size;
-	s->num_uploads = ts.num_uploads;
-	s->num_connections = ts.num_connections;
-	s->uploads_limit = ts.uploads_limit;
-	s->connections_limit = ts.connections_limit;
-//	s->storage_mode = (storage_mode_t)ts.storage_mode;
-	s->up_bandwidth_queue = ts.up_bandwidth_queue;
-	s->down_bandwidth_queue = ts.down_bandwidth_queue;
-	s->all_time_upload = ts.all_time_upload;
-	s->all_time_download = ts.all_time_download;
-	s->active_time = ts.active_time;
-	s->seeding_time = ts.seeding_time;
-	s->seed_rank = ts.seed_rank;
-	s->last_scrape = ts.last_scrape;
-	s->has_incoming = ts.has_incoming;
-	s->sparse_regions = ts.sparse_regions;
-	s->seed_mode = ts.seed_mode;
+	if (struct_size != sizeof(alert_info)) return -1;
+
+	std::auto_ptr<libtorrent::alert> al = ses->pop_alert();
+	if (!al.get()) return 1;
+
+	copy_alert(*al, a);
 	return 0;
 }
 
+void session_set_alert_callback(void* sesptr, alert_callback_t fun, void* userdata)
+{
+	libtorrent::session* ses = (libtorrent::session*)sesptr;
+
+	if (fun == 0)
+	{
+		ses->set_alert_dispatch(boost::function<void(libtorrent::alert const&)>());
+		return;
+	}
+	ses->set_alert_dispatch(boost::bind(&invoke_alert_callback, fun, userdata, _1));
+}
+
 int torrent_set_settings(int tor, int tag, ...)
 {
 	using namespace libtorrent;
@@ -233,6 +233,32 @@ struct session_status
 //	std::vector<dht_lookup> active_requests;
 };
 
+enum status_flags_t
+{
+	// fill in distributed_copies, otherwise it's -1
+	query_distributed_copies = 1,
+	// fill in sparse_regions
+	query_pieces = 2
+};
+
+struct alert_info
+{
+	// the alert category, see the alert mask
+	int category;
+	// the type of the alert, e.g. "torrent finished"
+	char what[64];
+	char message[1024];
+	// the torrent the alert is about, or -1 if it's not
+	// about a torrent or the torrent wasn't added through
+	// this interface
+	int torrent;
+};
+
+// called from the session's network thread when an alert is
+// posted. It must not call back into the session, but it may for
+// instance write to a pipe to wake up the thread driving the session
+typedef void (*alert_callback_t)(void* userdata, struct alert_info const* a);
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -264,6 +290,24 @@ int session_get_setting(void* ses, int tag, void* value, int* value_size);
 
 int torrent_get_status(int tor, struct torrent_status* s, int struct_size);
 
+// fills in the status of up to num torrents in a single query to
+// the session. The status structs are written to s and the
+// corresponding torrent ids to tors, both arrays must hold num
+// elements. flags is a combination of status_flags_t. Returns the
+// number of torrents written, or -1 on error
+int session_get_torrent_status(void* ses, int* tors, struct torrent_status* s
+	, int num, int struct_size, int flags);
+
+// pops the oldest pending alert into a. Returns 0 when an alert
+// was popped, 1 if there are no alerts and -1 on error. It never blocks
+// waiting for an alert
+int session_pop_alert(void* ses, struct alert_info* a, int struct_size);
+
+// instead of being queued for session_pop_alert(), alerts are
+// passed to fun as they are posted. Passing 0 as fun goes back
+// to queuing the alerts
+void session_set_alert_callback(void* ses, alert_callback_t fun, void* userdata);
+
 // use SET_* tags in tag list
 int torrent_set_settings(int tor, int first_tag, ...);
 int torrent_get_setting(int tor, int tag, void* value, int* value_size);
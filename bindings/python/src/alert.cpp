@@ -15,6 +15,23 @@ std::string get_buffer(read_piece_alert const& rpa)
        : std::string();
 }
 
+std::string get_range_buffer(read_range_alert const& rra)
+{
+    return rra.data() ? std::string(rra.data(), rra.size)
+       : std::string();
+}
+
+list get_status_from_update_alert(state_update_alert const& alert)
+{
+    list result;
+
+    for (std::vector<torrent_status>::const_iterator i = alert.status.begin()
+        , end(alert.status.end()); i != end; ++i)
+        result.append(*i);
+
+    return result;
+}
+
 void bind_alert()
 {
     using boost::noncopyable;
@@ -77,6 +94,15 @@ void bind_alert()
         .def_readonly("size", &read_piece_alert::size)
         ;
 
+    class_<read_range_alert, bases<torrent_alert>, noncopyable>(
+        "read_range_alert", 0, no_init
+    )
+        .add_property("buffer", get_range_buffer)
+        .def_readonly("offset", &read_range_alert::offset)
+        .def_readonly("size", &read_range_alert::size)
+        .def_readonly("error", &read_range_alert::error)
+        ;
+
     class_<peer_alert, bases<torrent_alert>, noncopyable>(
         "peer_alert", no_init
     )
@@ -287,6 +313,12 @@ void bind_alert()
 	    .def_readonly("state", &state_changed_alert::state)
 	    ;
 
+	class_<state_update_alert, bases<alert>, noncopyable>(
+	    "state_update_alert", no_init
+	)
+	    .add_property("status", &get_status_from_update_alert)
+	    ;
+
 	class_<dht_reply_alert, bases<tracker_alert>, noncopyable>(
 	    "dht_reply_alert", no_init
 	)
@@ -110,6 +110,8 @@ namespace
        p.seed_mode = params["seed_mode"];
     if (params.has_key("override_resume_data"))
        p.override_resume_data = params["override_resume_data"];
+    if (params.has_key("share_mode"))
+       p.share_mode = params["share_mode"];
 
     return s.add_torrent(p);
   }
@@ -131,7 +133,11 @@ namespace
   list get_torrents(session& s)
   {
      list ret;
-     std::vector<torrent_handle> torrents = s.get_torrents();
+     std::vector<torrent_handle> torrents;
+     {
+        allow_threading_guard guard;
+        torrents = s.get_torrents();
+     }
 
      for (std::vector<torrent_handle>::iterator i = torrents.begin(); i != torrents.end(); ++i)
      {
@@ -140,6 +146,65 @@ namespace
      return ret;
   }
 
+  // calls a python predicate from get_torrent_status(). The
+  // predicate is called with the session locked and the GIL
+  // released, it has to be reacquired for every call
+  struct invoke_status_predicate
+  {
+      invoke_status_predicate(object const& callback)
+        : cb(callback)
+      {}
+
+      bool operator()(torrent_status const& st) const
+      {
+          lock_gil lock;
+          return cb(boost::ref(st));
+      }
+
+      object cb;
+  };
+
+  bool accept_all_torrents(torrent_status const&) { return true; }
+
+  // the status of all torrents pred returns true for, fetched
+  // in a single call into the session. Without a predicate,
+  // every torrent is returned without calling back into python
+  list get_torrent_status(session& s, object pred, boost::uint32_t flags)
+  {
+      std::vector<torrent_status> torrents;
+      {
+          allow_threading_guard guard;
+          if (pred.ptr() == Py_None)
+              s.get_torrent_status(&torrents, &accept_all_torrents, flags);
+          else
+              s.get_torrent_status(&torrents, invoke_status_predicate(pred), flags);
+      }
+
+      list ret;
+      for (std::vector<torrent_status>::iterator i = torrents.begin()
+          , end(torrents.end()); i != end; ++i)
+          ret.append(*i);
+      return ret;
+  }
+
+  // all pending alerts, popped with the alert queue locked once.
+  // The returned python objects own the alerts
+  list pop_alerts(session& s)
+  {
+      std::deque<alert*> alerts;
+      {
+          allow_threading_guard guard;
+          s.pop_alerts(&alerts);
+      }
+
+      list ret;
+      manage_new_object::apply<alert*>::type convert;
+      for (std::deque<alert*>::iterator i = alerts.begin()
+          , end(alerts.end()); i != end; ++i)
+          ret.append(handle<>(convert(*i)));
+      return ret;
+  }
+
 #ifndef TORRENT_DISABLE_GEO_IP
   bool load_asnum_db(session& s, std::string file)
   {
@@ -262,6 +327,7 @@ void bind_session()
 #endif
         .def("set_alert_mask", allow_threads(&session::set_alert_mask))
         .def("pop_alert", allow_threads(&session::pop_alert))
+        .def("pop_alerts", &pop_alerts)
         .def("add_extension", &add_extension)
         .def("set_peer_proxy", allow_threads(&session::set_peer_proxy))
         .def("set_tracker_proxy", allow_threads(&session::set_tracker_proxy))
@@ -278,6 +344,11 @@ void bind_session()
         .def("set_ip_filter", allow_threads(&session::set_ip_filter))
         .def("find_torrent", allow_threads(&session::find_torrent))
         .def("get_torrents", &get_torrents)
+        .def(
+            "get_torrent_status", &get_torrent_status
+          , (arg("pred") = object(), arg("flags") = 0)
+        )
+        .def("post_torrent_updates", allow_threads(&session::post_torrent_updates))
         .def("pause", allow_threads(&session::pause))
         .def("resume", allow_threads(&session::resume))
         .def("is_paused", allow_threads(&session::is_paused))
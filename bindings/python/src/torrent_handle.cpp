@@ -271,9 +271,9 @@ void bind_torrent_handle()
 
 #define _ allow_threads
 
-    class_<torrent_handle>("torrent_handle")
+    scope handle = class_<torrent_handle>("torrent_handle")
         .def("get_peer_info", get_peer_info)
-        .def("status", _(&torrent_handle::status))
+        .def("status", _(&torrent_handle::status), arg("flags") = 0xffffffff)
         .def("get_download_queue", get_download_queue)
         .def("file_progress", file_progress)
         .def("trackers", range(begin_trackers, end_trackers))
@@ -311,6 +311,8 @@ void bind_torrent_handle()
 #endif
         .def("add_piece", add_piece)
         .def("read_piece", _(&torrent_handle::read_piece))
+        .def("read_range", _(&torrent_handle::read_range)
+            , (arg("offset"), arg("size"), arg("deadline") = 0))
         .def("piece_availability", piece_availability)
         .def("piece_priority", _(piece_priority0))
         .def("piece_priority", _(piece_priority1))
@@ -344,4 +346,10 @@ void bind_torrent_handle()
         .def("rename_file", _(rename_file0))
         .def("rename_file", _(rename_file1))
         ;
+
+    enum_<torrent_handle::status_flags_t>("status_flags_t")
+        .value("query_distributed_copies", torrent_handle::query_distributed_copies)
+        .value("query_pieces", torrent_handle::query_pieces)
+        .value("query_cache_blocks", torrent_handle::query_cache_blocks)
+        ;
 }
@@ -31,6 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <iterator>
+#include <deque>
 
 #include "libtorrent/config.hpp"
 
@@ -1165,11 +1166,13 @@ int main(int argc, char* argv[])
 #endif
 
 		// loop through the alert queue to see if anything has happened.
-		std::auto_ptr<alert> a;
-		a = ses.pop_alert();
+		std::deque<alert*> alerts;
+		ses.pop_alerts(&alerts);
 		std::string now = time_now_string();
-		while (a.get())
+		for (std::deque<alert*>::iterator i = alerts.begin()
+			, end(alerts.end()); i != end; ++i)
 		{
+			std::auto_ptr<alert> a(*i);
 			std::string event_string;
 
 			::print_alert(a.get(), event_string);
@@ -1177,8 +1180,6 @@ int main(int argc, char* argv[])
 
 			events.push_back(event_string);
 			if (events.size() >= 20) events.pop_front();
-
-			a = ses.pop_alert();
 		}
 
 		session_status sess_stat = ses.status();
@@ -1486,7 +1487,7 @@ int main(int argc, char* argv[])
 					if (i->kind != cached_piece_info::read_cache) continue;
 					snprintf(str, sizeof(str), "%5d: [", i->piece);
 					out += str;
-					for (std::vector<bool>::iterator k = i->blocks.begin()
+					for (bitfield::const_iterator k = i->blocks.begin()
 						, end(i->blocks.end()); k != end; ++k)
 					{
 						char const* color = "";
@@ -34,7 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_ALERT_HPP_INCLUDED
 
 #include <memory>
-#include <queue>
+#include <deque>
 #include <string>
 #include <typeinfo>
 
@@ -86,6 +86,7 @@ namespace libtorrent {
 			ip_block_notification = 0x100,
 			performance_warning = 0x200,
 			dht_notification = 0x400,
+			stats_notification = 0x800,
 
 			all_categories = 0xffffffff
 		};
@@ -119,14 +120,25 @@ namespace libtorrent {
 		~alert_manager();
 
 		void post_alert(const alert& alert_);
+		// takes ownership of the alert, which saves the copy
+		// post_alert() makes
+		void post_alert_ptr(alert* alert_);
 		bool pending() const;
 		std::auto_ptr<alert> get();
-
+		// returns 0 if there are no alerts
+		std::auto_ptr<alert> pop();
+		// moves all queued alerts to the end of alerts in a single
+		// lock acquisition. The caller owns them afterwards
+		void get_all(std::deque<alert*>& alerts);
+
+		// this is called for every alert that might be posted, so it
+		// doesn't take the mutex. Reading the mask and the queue size
+		// while another thread changes them may give a stale answer,
+		// which is harmless. post_alert() checks the size again
 		template <class T>
 		bool should_post() const
 		{
-			boost::mutex::scoped_lock lock(m_mutex);
-			if (m_alerts.size() >= m_queue_size_limit) return false;
+			if (m_queue_size >= m_queue_size_limit) return false;
 			return (m_alert_mask & T::static_category) != 0;
 		}
 
@@ -144,7 +156,10 @@ namespace libtorrent {
 		void set_dispatch_function(boost::function<void(alert const&)> const&);
 
 	private:
-		std::queue<alert*> m_alerts;
+		std::deque<alert*> m_alerts;
+		// the size of m_alerts, for should_post(). Only
+		// changed while holding m_mutex
+		size_t m_queue_size;
 		mutable boost::mutex m_mutex;
 		boost::condition m_condition;
 		int m_alert_mask;
@@ -40,6 +40,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/config.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/identify_client.hpp"
+#include "libtorrent/disk_buffer_holder.hpp"
 
 #include <boost/lexical_cast.hpp>
 
@@ -125,6 +126,48 @@ namespace libtorrent
 		int size;
 	};
 
+	// one block sized chunk of a range requested with
+	// torrent_handle::read_range(). The buffer is shared with the
+	// disk cache, and the cache block is held for as long as any
+	// copy of this alert is alive
+	struct TORRENT_EXPORT read_range_alert: torrent_alert
+	{
+		read_range_alert(torrent_handle const& h, size_type o, int s
+			, boost::shared_ptr<disk_buffer_holder> b, int bo
+			, error_code const& e)
+			: torrent_alert(h)
+			, buffer(b)
+			, buffer_offset(bo)
+			, offset(o)
+			, size(s)
+			, error(e)
+		{}
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new read_range_alert(*this)); }
+		const static int static_category = alert::storage_notification;
+		virtual int category() const { return static_category; }
+		virtual char const* what() const { return "read range"; }
+		virtual std::string message() const
+		{
+			char msg[200];
+			snprintf(msg, 200, "%s: read range %lld (%d bytes) %s"
+				, torrent_alert::message().c_str(), offset, size
+				, error ? error.message().c_str() : "successful");
+			return msg;
+		}
+
+		// the data of this chunk, or 0 if the read failed
+		char const* data() const
+		{ return buffer && buffer->get() ? buffer->get() + buffer_offset : 0; }
+
+		boost::shared_ptr<disk_buffer_holder> buffer;
+		int buffer_offset;
+		size_type offset;
+		int size;
+		error_code error;
+	};
+
 	struct TORRENT_EXPORT file_renamed_alert: torrent_alert
 	{
 		file_renamed_alert(torrent_handle const& h
@@ -773,6 +816,31 @@ namespace libtorrent
 		}
 	};
 
+	struct TORRENT_EXPORT storage_move_progress_alert: torrent_alert
+	{
+		storage_move_progress_alert(torrent_handle const& h, std::string const& path_
+			, float progress_)
+			: torrent_alert(h)
+			, path(path_)
+			, progress(progress_)
+		{}
+	
+		std::string path;
+		float progress;
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new storage_move_progress_alert(*this)); }
+		virtual char const* what() const { return "storage move progress"; }
+		const static int static_category = alert::progress_notification;
+		virtual int category() const { return static_category; }
+		virtual std::string message() const
+		{
+			char msg[100];
+			snprintf(msg, sizeof(msg), " moving storage: %d%%", int(progress * 100));
+			return torrent_alert::message() + msg + " to: " + path;
+		}
+	};
+
 	struct TORRENT_EXPORT storage_moved_failed_alert: torrent_alert
 	{
 		storage_moved_failed_alert(torrent_handle const& h, error_code const& ec_)
@@ -1274,6 +1342,91 @@ namespace libtorrent
 			return msg;
 		}
 	};
+
+	struct TORRENT_EXPORT state_update_alert: alert
+	{
+		state_update_alert() {}
+
+		// the torrents that changed since the last
+		// session::post_torrent_updates()
+		std::vector<torrent_status> status;
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new state_update_alert(*this)); }
+		virtual char const* what() const { return "state updates"; }
+		const static int static_category = alert::status_notification;
+		virtual int category() const { return static_category; }
+		virtual std::string message() const
+		{
+			char msg[100];
+			snprintf(msg, 100, "state updates for %d torrents", int(status.size()));
+			return msg;
+		}
+	};
+
+	struct TORRENT_EXPORT session_stats_alert: alert
+	{
+		session_stats_alert() {}
+
+		// one value per counter and gauge, indexed by
+		// counters::stats_counter_t. session_stats_metrics()
+		// lists their names
+		std::vector<boost::int64_t> values;
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new session_stats_alert(*this)); }
+		virtual char const* what() const { return "session stats"; }
+		const static int static_category = alert::stats_notification;
+		virtual int category() const { return static_category; }
+		virtual std::string message() const
+		{
+			char msg[100];
+			snprintf(msg, 100, "session stats (%d values)", int(values.size()));
+			return msg;
+		}
+	};
+
+	struct TORRENT_EXPORT session_paused_alert: alert
+	{
+		session_paused_alert(int num)
+			: num_torrents(num) {}
+
+		// the number of torrents that were paused
+		int num_torrents;
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new session_paused_alert(*this)); }
+		virtual char const* what() const { return "session paused"; }
+		const static int static_category = alert::status_notification;
+		virtual int category() const { return static_category; }
+		virtual std::string message() const
+		{
+			char msg[100];
+			snprintf(msg, 100, "session paused (%d torrents)", num_torrents);
+			return msg;
+		}
+	};
+
+	struct TORRENT_EXPORT session_resumed_alert: alert
+	{
+		session_resumed_alert(int num)
+			: num_torrents(num) {}
+
+		// the number of torrents that were resumed
+		int num_torrents;
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new session_resumed_alert(*this)); }
+		virtual char const* what() const { return "session resumed"; }
+		const static int static_category = alert::status_notification;
+		virtual int category() const { return static_category; }
+		virtual std::string message() const
+		{
+			char msg[100];
+			snprintf(msg, 100, "session resumed (%d torrents)", num_torrents);
+			return msg;
+		}
+	};
 }
 
 
@@ -0,0 +1,122 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_ALLOCATING_HANDLER_HPP_INCLUDED
+#define TORRENT_ALLOCATING_HANDLER_HPP_INCLUDED
+
+#include <cstddef>
+#include <new>
+#include <boost/aligned_storage.hpp>
+#include "libtorrent/config.hpp"
+#include "libtorrent/assert.hpp"
+
+namespace libtorrent
+{
+	// memory for the operation of one outstanding async call. Objects
+	// that always have at most one read (or write) outstanding keep one
+	// of these per operation, so that the steady state doesn't allocate
+	template <std::size_t Size>
+	struct handler_storage
+	{
+		handler_storage(): used(false) {}
+		bool used;
+		boost::aligned_storage<Size> bytes;
+	};
+
+	// wraps a completion handler, and makes asio allocate the operation
+	// from the handler_storage through the asio_handler_allocate() hook.
+	// If the storage is already in use, for instance when an aborted
+	// operation hasn't completed yet when the next one is started, or if
+	// the operation is too big, it falls back to the heap
+	template <class Handler, std::size_t Size>
+	struct allocating_handler
+	{
+		allocating_handler(
+			Handler const& handler, handler_storage<Size>& storage
+		)
+		  : handler(handler)
+		  , storage(storage)
+		{}
+
+		template <class A0>
+		void operator()(A0 const& a0) const
+		{
+			handler(a0);
+		}
+
+		template <class A0, class A1>
+		void operator()(A0 const& a0, A1 const& a1) const
+		{
+			handler(a0, a1);
+		}
+
+		template <class A0, class A1, class A2>
+		void operator()(A0 const& a0, A1 const& a1, A2 const& a2) const
+		{
+			handler(a0, a1, a2);
+		}
+
+		friend void* asio_handler_allocate(
+			std::size_t size, allocating_handler<Handler, Size>* ctx)
+		{
+			if (size > Size || ctx->storage.used)
+				return ::operator new(size);
+			ctx->storage.used = true;
+			return &ctx->storage.bytes;
+		}
+
+		friend void asio_handler_deallocate(
+			void* p, std::size_t, allocating_handler<Handler, Size>* ctx)
+		{
+			if (p != &ctx->storage.bytes)
+			{
+				::operator delete(p);
+				return;
+			}
+			TORRENT_ASSERT(ctx->storage.used);
+			ctx->storage.used = false;
+		}
+
+		Handler handler;
+		handler_storage<Size>& storage;
+	};
+
+	template <class Handler, std::size_t Size>
+	allocating_handler<Handler, Size> make_allocating_handler(
+		Handler const& handler, handler_storage<Size>& storage)
+	{
+		return allocating_handler<Handler, Size>(handler, storage);
+	}
+}
+
+#endif // TORRENT_ALLOCATING_HANDLER_HPP_INCLUDED
+
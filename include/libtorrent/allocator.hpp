@@ -38,8 +38,16 @@ POSSIBILITY OF SUCH DAMAGE.
 namespace libtorrent
 {
 
+	// allocations of at least huge_page_size bytes are aligned to
+	// huge pages, and (where supported) the kernel is asked to back
+	// them with transparent huge pages. This is what makes the disk
+	// buffer pool use huge pages when cache_buffer_chunk_size is
+	// large enough. When built with TORRENT_USE_NUMA, the memory is
+	// placed on the NUMA node of the calling thread
 	struct page_aligned_allocator
 	{
+		enum { huge_page_size = 2 * 1024 * 1024 };
+
 		typedef std::size_t size_type;
 		typedef std::ptrdiff_t difference_type;
 
@@ -36,7 +36,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <vector>
 #include <set>
+#include <map>
 #include <list>
+#include <deque>
 
 #ifndef TORRENT_DISABLE_GEO_IP
 #include "libtorrent/GeoIP.h"
@@ -68,15 +70,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/session_status.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/stat.hpp"
+#include "libtorrent/buffer.hpp"
 #include "libtorrent/file_pool.hpp"
 #include "libtorrent/bandwidth_manager.hpp"
 #include "libtorrent/socket_type.hpp"
 #include "libtorrent/connection_queue.hpp"
+#include "libtorrent/resolver.hpp"
+#include "libtorrent/pe_crypto.hpp"
 #include "libtorrent/disk_io_thread.hpp"
 #include "libtorrent/udp_socket.hpp"
+#include "libtorrent/utp_socket_manager.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/policy.hpp" // for policy::peer
 #include "libtorrent/alert.hpp" // for alert_manager
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/trace.hpp"
 
 namespace libtorrent
 {
@@ -165,6 +173,11 @@ namespace libtorrent
 			mutable mutex_t m_mutex;
 
 			boost::weak_ptr<torrent> find_torrent(const sha1_hash& info_hash);
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			// finds the torrent by hash('req2', info-hash), the
+			// way the encrypted handshake identifies it
+			boost::weak_ptr<torrent> find_encrypted_torrent(sha1_hash const& obfuscated_hash);
+#endif
 			peer_id const& get_peer_id() const { return m_peer_id; }
 
 			void close_connection(peer_connection const* p
@@ -201,8 +214,13 @@ namespace libtorrent
 
 			void pause();
 			void resume();
+			// queues all torrents to be paused or resumed, to
+			// match m_paused
+			void queue_state_change();
+			void on_state_queue();
 
-			void set_ip_filter(ip_filter const& f);
+			// takes the rules out of f
+			void set_ip_filter(ip_filter& f);
 			void set_port_filter(port_filter const& f);
 
 			bool listen_on(
@@ -211,17 +229,46 @@ namespace libtorrent
 			bool is_listening() const;
 
 			torrent_handle add_torrent(add_torrent_params const&, error_code& ec);
+			std::vector<torrent_handle> add_torrents(
+				std::vector<add_torrent_params> const& params
+				, std::vector<error_code>& ec);
+			// queue_pos is the queue position to give the torrent.
+			// It's incremented if it was used
+			torrent_handle add_torrent_impl(add_torrent_params const& params
+				, error_code& ec, int& queue_pos);
+			int next_queue_position() const;
 
 			void remove_torrent(torrent_handle const& h, int options);
 
 			std::vector<torrent_handle> get_torrents();
+			int save_modified_resume_data();
+			void get_torrent_status(std::vector<torrent_status>* ret
+				, boost::function<bool(torrent_status const&)> const& pred
+				, boost::uint32_t flags, session_impl::mutex_t::scoped_lock& l) const;
+			void on_torrent_status_callback(boost::condition& c
+				, std::vector<torrent_status>* ret
+				, boost::function<bool(torrent_status const&)> const& pred
+				, boost::uint32_t flags, bool& done) const;
 			
 			void check_torrent(boost::shared_ptr<torrent> const& t);
 			void done_checking(boost::shared_ptr<torrent> const& t);
+			// starts checking the queued torrents whose devices
+			// have fewer than checking_torrents_per_device torrents
+			// checking
+			void start_device_checks();
 
 			void set_alert_mask(int m);
 			size_t set_alert_queue_size_limit(size_t queue_size_limit_);
 			std::auto_ptr<alert> pop_alert();
+			void pop_alerts(std::deque<alert*>* alerts);
+			void post_torrent_updates();
+			void post_session_stats();
+			void get_latency_stats(latency_stats& s) const;
+			void get_trace(std::vector<trace_event>& events) const
+			{ m_trace.get_events(events); }
+			// queues the torrent to be included in the next
+			// state_update_alert, see torrent::state_updated()
+			void add_state_update(torrent& t);
 			void set_alert_dispatch(boost::function<void(alert const&)> const&);
 
 			alert const* wait_for_alert(time_duration max_wait);
@@ -240,6 +287,10 @@ namespace libtorrent
 			void set_max_connections(int limit);
 			void set_max_uploads(int limit);
 
+			int create_bandwidth_class(int parent);
+			void set_bandwidth_class_limits(int c, int upload_limit, int download_limit);
+			bandwidth_channel* bandwidth_class_channel(int c, int channel);
+
 			int max_connections() const { return m_max_connections; }
 			int max_uploads() const { return m_max_uploads; }
 			int max_half_open_connections() const { return m_half_open.limit(); }
@@ -248,6 +299,20 @@ namespace libtorrent
 			int num_connections() const
 			{ return m_connections.size(); }
 
+			// how close the session is to its memory budget.
+			// Consumers shrink at increasing levels, in this order
+			enum memory_pressure_t
+			{
+				no_memory_pressure,
+				// the read cache is cleared
+				read_cache_pressure,
+				// peer lists are cut to half their size limit
+				peer_list_pressure,
+				// request pipelines are kept short
+				pipeline_pressure
+			};
+			int memory_pressure() const { return m_memory_pressure; }
+
 			void unchoke_peer(peer_connection& c);
 
 			session_status status() const;
@@ -261,6 +326,13 @@ namespace libtorrent
 
 			void announce_lsd(sha1_hash const& ih);
 
+#ifndef TORRENT_DISABLE_DHT
+			// queues a torrent to be announced to the DHT
+			// before the regular round robin gets to it
+			void prioritize_dht(boost::weak_ptr<torrent> t);
+			void announce_dht();
+#endif
+
 			void set_peer_proxy(proxy_settings const& s)
 			{
 				m_peer_proxy = s;
@@ -294,8 +366,19 @@ namespace libtorrent
 			std::string as_name_for_ip(address const& a);
 			int as_for_ip(address const& a);
 			std::pair<const int, int>* lookup_as(int as);
+			void set_cheap_as(std::vector<int> const& as);
+			// true if peers in this AS should be preferred, see
+			// session::set_cheap_as() and prefer_own_as
+			bool is_cheap_as(int as) const
+			{
+				if (as == 0) return false;
+				if (m_settings.prefer_own_as && as == m_own_as) return true;
+				return m_cheap_as.find(as) != m_cheap_as.end();
+			}
+			// recalculates policy::peer::cheap_as for every peer
+			void update_cheap_as();
 			bool load_asnum_db(char const* file);
-			bool has_asnum_db() const { return m_asnum_db; }
+			bool has_asnum_db() const { return !m_as_range_start.empty(); }
 
 			bool load_country_db(char const* file);
 			bool has_country_db() const { return m_country_db; }
@@ -305,6 +388,9 @@ namespace libtorrent
 			bool load_asnum_db(wchar_t const* file);
 			bool load_country_db(wchar_t const* file);
 #endif
+			// reads every range out of the AS database into
+			// m_as_range_start, m_as_range_num and m_as_names
+			void load_as_ranges(GeoIP* db);
 #endif
 
 			void load_state(entry const& ses_state);
@@ -332,11 +418,39 @@ namespace libtorrent
 				m_total_failed_bytes += b;
 			}
 
+			void add_duplicate_request_bytes(size_type b)
+			{
+				TORRENT_ASSERT(b > 0);
+				m_total_duplicate_request_bytes += b;
+			}
+
+			void add_cancelled_bytes(size_type b)
+			{
+				TORRENT_ASSERT(b > 0);
+				m_total_cancelled_bytes += b;
+			}
+
 			std::pair<char*, int> allocate_buffer(int size);
 			void free_buffer(char* buf, int size);
 
+			// receive buffers are handed out in size classes. When
+			// a connection goes idle or closes, its receive buffer
+			// is kept here to be handed out to another connection.
+			// grow_recv_buffer() makes b at least size bytes and
+			// keeps its content, release_recv_buffer() leaves b empty
+			void grow_recv_buffer(buffer& b, int size);
+			void release_recv_buffer(buffer& b);
+
 			char* allocate_disk_buffer(char const* category);
 			void free_disk_buffer(char* buf);
+			void reclaim_disk_buffer(char* buf);
+
+			// destructors for buffers in the peers' send buffers,
+			// see chained_buffer::free_buffer_fun. userdata is the
+			// session_impl
+			static void free_send_buffer(char* buf, void* userdata, int size);
+			static void free_disk_send_buffer(char* buf, void* userdata, int);
+			static void reclaim_disk_send_buffer(char* buf, void* userdata, int);
 
 			void set_external_address(address const& ip);
 			address const& external_address() const { return m_external_address; }
@@ -387,18 +501,71 @@ namespace libtorrent
 # endif
 #endif
 
+			// when share_peer_reputation is set, the failcount
+			// and banned state of peers are remembered here
+			// across torrents. Only peers with a bad reputation
+			// have an entry
+			struct peer_reputation
+			{
+				boost::uint8_t failcount;
+				bool banned;
+			};
+			std::map<address, peer_reputation> m_peer_reputation;
+
+			// records the state of p, for the other torrents
+			void update_peer_reputation(policy::peer const& p);
+			// copies what other torrents know about p to it
+			void apply_peer_reputation(policy::peer& p) const;
+
 			// this vector is used to store the block_info
 			// objects pointed to by partial_piece_info returned
 			// by torrent::get_download_queue.
 			std::vector<block_info> m_block_info_storage;
 
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
-			// this pool is used to allocate and recycle send
-			// buffers from.
-			boost::pool<> m_send_buffers;
+			// free send buffers, by size class. Class i holds
+			// buffers of send_buffer_size << i bytes. Allocations
+			// are rounded up to the nearest class, so allocating
+			// and freeing is a push or pop on one of these lists.
+			// Bigger send buffers are allocated and freed as
+			// they're needed
+			enum
+			{
+				num_send_buffer_classes = 9,
+				max_free_send_buffers = 64
+			};
+			std::vector<char*> m_free_send_buffers[num_send_buffer_classes];
 #endif
 			boost::mutex m_send_buffer_mutex;
 
+			// the number of bytes of send buffers handed out by
+			// allocate_buffer(). Protected by m_send_buffer_mutex
+			int m_send_buffer_bytes;
+
+			// one of memory_pressure_t. Updated once a second by
+			// update_memory_pressure()
+			int m_memory_pressure;
+			void update_memory_pressure();
+
+			// set while device_write_cache_share is in effect. Then
+			// torrents on devices with too many bytes waiting to be
+			// written are throttled, see torrent::write_throttled()
+			bool m_write_throttling;
+			void update_write_throttling();
+
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+			// free receive buffers, by size class. Class i holds
+			// buffers of min_recv_buffer << i bytes. Bigger receive
+			// buffers are allocated and freed as they're needed
+			enum
+			{
+				min_recv_buffer = 128,
+				num_recv_buffer_classes = 9,
+				max_free_recv_buffers = 64
+			};
+			std::vector<buffer> m_free_recv_buffers[num_recv_buffer_classes];
+#endif
+
 			// the file pool that all storages in this session's
 			// torrents uses. It sets a limit on the number of
 			// open files by this session.
@@ -412,6 +579,11 @@ namespace libtorrent
 			// them
 			mutable io_service m_io_service;
 
+			// the events recorded while trace_buffer_size is
+			// set. The disk threads record into it, so it has
+			// to outlive m_disk_thread
+			trace_buffer m_trace;
+
 			// handles delayed alerts
 			alert_manager m_alerts;
 
@@ -431,6 +603,16 @@ namespace libtorrent
 			// members to be destructed
 			connection_queue m_half_open;
 
+			// caches host name lookups for trackers and
+			// web seeds
+			resolver m_host_resolver;
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			// DH key pairs for encrypted handshakes, generated
+			// ahead of time by a separate thread
+			dh_key_pool m_dh_keys;
+#endif
+
 			// the bandwidth manager is responsible for
 			// handing out bandwidth to connections that
 			// asks for it, it can also throttle the
@@ -452,10 +634,29 @@ namespace libtorrent
 
 			bandwidth_channel* m_bandwidth_channel[2];
 
+			// the bandwidth classes torrents can be put in.
+			// Classes are never removed, and the torrents'
+			// channels point into this, so it only ever grows
+			// at the end
+			struct bandwidth_class
+			{
+				int parent;
+				bandwidth_channel channel[2];
+			};
+			std::deque<bandwidth_class> m_bandwidth_classes;
+
 			tracker_manager m_tracker_manager;
 			torrent_map m_torrents;
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			// the same torrents as m_torrents, keyed by their
+			// obfuscated info-hash
+			torrent_map m_obfuscated_torrents;
+#endif
 			typedef std::list<boost::shared_ptr<torrent> > check_queue_t;
 			check_queue_t m_queued_for_checking;
+			// the device each torrent in m_queued_for_checking saves
+			// to, when checking_torrents_per_device is enabled
+			std::map<torrent const*, std::string> m_checking_devices;
 
 			// this maps sockets to their peer_connection
 			// object. It is the complete list of all connected
@@ -465,6 +666,13 @@ namespace libtorrent
 			// filters incoming connections
 			ip_filter m_ip_filter;
 
+			// the ranges blocked by ip filter updates that haven't
+			// been applied to all torrents yet, and the info-hash of
+			// the next torrent to apply them to. The torrents are
+			// updated a few at a time by update_ip_filter_step()
+			std::vector<ip_range<address> > m_ip_filter_delta;
+			sha1_hash m_ip_filter_cursor;
+
 			// filters outgoing connections
 			port_filter m_port_filter;
 			
@@ -530,6 +738,14 @@ namespace libtorrent
 			proxy_settings m_tracker_proxy;
 #ifndef TORRENT_DISABLE_DHT
 			proxy_settings m_dht_proxy;
+
+			// torrents that were just started and should be
+			// announced to the DHT as soon as possible
+			std::deque<boost::weak_ptr<torrent> > m_dht_torrents;
+
+			// the info-hash of the next torrent to announce to
+			// the DHT in the round robin over all torrents
+			sha1_hash m_next_dht_torrent;
 #endif
 
 			// set to true when the session object
@@ -540,6 +756,19 @@ namespace libtorrent
 			// is true if the session is paused
 			bool m_paused;
 
+			// the torrents a session pause() or resume() still has to
+			// pause or resume. They're handled in batches from the io
+			// service, so that sessions with many torrents don't block
+			// the network thread. m_paused is set right away, which
+			// already makes every torrent count as paused
+			std::vector<boost::weak_ptr<torrent> > m_state_queue;
+			// the index of the next torrent in m_state_queue
+			int m_state_queue_pos;
+			// the number of torrents paused or resumed so far
+			int m_num_state_changed;
+			// true while a batch is posted to the io service
+			bool m_state_queue_posted;
+
 			// the max number of unchoked peers as set by the user
 			int m_max_uploads;
 
@@ -553,6 +782,14 @@ namespace libtorrent
 			// the number of unchoked peers
 			int m_num_unchoked;
 
+			// used to size the upload slots with the rate based
+			// seed choker. The upload rate when the last slot was
+			// added while probing for the upload capacity, 0 when
+			// not probing, and the rate the last probe found the
+			// upload to be saturated at
+			float m_upload_slot_probe_rate;
+			float m_saturated_upload_rate;
+
 			// this is initialized to the unchoke_interval
 			// session_setting and decreased every second.
 			// when it reaches zero, it is reset to the
@@ -581,6 +818,26 @@ namespace libtorrent
 			// torrents.
 			int m_auto_scrape_time_scaler;
 
+			// counts down the seconds to the next
+			// auto_tune_settings()
+			int m_auto_tune_time_scaler;
+
+			// the values of the auto tuned settings as they were
+			// set by set_settings(). They're the lower bounds
+			struct tuned_settings
+			{
+				int cache_size;
+				int read_cache_line_size;
+				int send_buffer_watermark;
+				int max_outstanding_disk_bytes_per_connection;
+			};
+			tuned_settings m_tune_base;
+
+			// the cache and counter values at the last
+			// auto_tune_settings(), to tell what happened since
+			cache_status m_tune_last_cache;
+			counters m_tune_last_counters;
+
 			// statistics gathered from all torrents.
 			stat m_stat;
 
@@ -592,10 +849,29 @@ namespace libtorrent
 			
 			void on_tick(error_code const& e);
 
+			// torrents are only ticked once a second while they
+			// have something to do, see torrent::wants_tick()
+			void add_ticking_torrent(torrent& t);
+			void remove_ticking_torrent(torrent& t);
+
+			// called by the tracker exchange plugin before it adds a
+			// tracker it learned from a peer. Returns false if the
+			// session has added max_tex_trackers_per_minute trackers
+			// that way in the last minute already
+			bool allow_tex_tracker();
+			void on_bandwidth_tick(error_code const& e);
+			void start_bandwidth_timer();
+
 			void recalculate_auto_managed_torrents();
 			void recalculate_unchoke_slots(int congested_torrents
 				, int uncongested_torrents);
 			void recalculate_optimistic_unchoke_slot();
+			// adjusts the settings session_settings::auto_tune
+			// covers, called every auto_tune_interval seconds
+			void auto_tune_settings();
+			// applies m_ip_filter_delta to the next batch of
+			// torrents, called every tick while it's not empty
+			void update_ip_filter_step();
 
 			ptime m_created;
 			int session_time() const { return total_seconds(time_now() - m_created); }
@@ -607,6 +883,11 @@ namespace libtorrent
 			// to decide which ones to choke/unchoke
 			ptime m_last_choke;
 
+			// the number of trackers added from tracker exchange,
+			// across all torrents, since m_tex_interval_start
+			int m_tex_trackers_added;
+			ptime m_tex_interval_start;
+
 			// when outgoing_ports is configured, this is the
 			// port we'll bind the next outgoing socket to
 			int m_next_port;
@@ -626,6 +907,9 @@ namespace libtorrent
 
 			rate_limited_udp_socket m_dht_socket;
 
+			// the uTP sockets share the udp socket with the DHT
+			utp_socket_manager m_utp_socket_manager;
+
 			// these are used when starting the DHT
 			// (and bootstrapping it), and then erased
 			std::list<std::pair<std::string, int> > m_dht_router_nodes;
@@ -649,10 +933,52 @@ namespace libtorrent
 			// the timer used to fire the tick
 			deadline_timer m_timer;
 
-			// the index of the torrent that will be offered to
-			// connect to a peer next time on_tick is called.
-			// This implements a round robin.
+			// when bandwidth_refill_interval is set, the
+			// rate limiters are updated by this timer instead
+			// of the tick. m_last_quota_update is the last time
+			// they were updated, either way
+			deadline_timer m_bandwidth_timer;
+			ptime m_last_quota_update;
+
+			// the torrents that are ticked every second. The
+			// order is not significant, torrents are removed by
+			// moving the last one into their place
+			std::vector<torrent*> m_ticking_torrents;
+
+			// the torrents whose status changed since the last
+			// post_torrent_updates(). A torrent's m_in_state_updates
+			// is set while it's in here
+			std::vector<torrent*> m_state_updates;
+
+			// the counters reported by post_session_stats()
+			counters m_stats_counters;
+
+			// the latencies measured on the network thread,
+			// reported by get_latency_stats(). The disk and DHT
+			// histograms live with the disk and DHT threads
+			latency_stats m_latency;
+
+			// the index of the torrent in m_ticking_torrents that
+			// will be offered to connect to a peer next time on_tick
+			// is called. This implements a round robin.
 			int m_next_connect_torrent;
+
+			// the number of connection attempts on_tick makes per
+			// second. It's connection_speed unless
+			// adaptive_connection_speed is set, in which case
+			// update_connect_rate() adjusts it
+			int m_connect_rate;
+
+			// the outcomes of the connection attempts since the
+			// rate was last adjusted
+			connection_queue::connect_stats m_connect_window;
+
+			// the typical time, in milliseconds, a connection
+			// attempt takes to succeed when the connect rate isn't
+			// causing congestion. 0 until the first sample
+			int m_connect_time_base;
+
+			void update_connect_rate();
 #ifdef TORRENT_DEBUG
 			void check_invariant() const;
 #endif
@@ -696,9 +1022,24 @@ namespace libtorrent
 #endif
 
 #ifndef TORRENT_DISABLE_GEO_IP
-			GeoIP* m_asnum_db;
 			GeoIP* m_country_db;
 
+			// the AS database, read into memory by load_asnum_db().
+			// m_as_range_start holds the first IPv4 address of each
+			// range, sorted, and m_as_range_num the AS number of the
+			// range at the same index. A range runs up to the start
+			// of the next one, and 0 means the AS is unknown
+			std::vector<boost::uint32_t> m_as_range_start;
+			std::vector<int> m_as_range_num;
+
+			// AS number to AS name
+			std::map<int, std::string> m_as_names;
+
+			// the ASes set by session::set_cheap_as() and the AS of
+			// our external address
+			std::set<int> m_cheap_as;
+			int m_own_as;
+
 			// maps AS number to the peak download rate
 			// we've seen from it. Entries are never removed
 			// from this map. Pointers to its elements
@@ -710,6 +1051,12 @@ namespace libtorrent
 			size_type m_total_failed_bytes;
 			size_type m_total_redundant_bytes;
 
+			// bytes requested from more than one peer in
+			// end-game mode, and bytes cancelled because
+			// another peer sent the block first
+			size_type m_total_duplicate_request_bytes;
+			size_type m_total_cancelled_bytes;
+
 			// the main working thread
 			boost::scoped_ptr<boost::thread> m_thread;
 		};
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_BANDWIDTH_CHANNEL_HPP_INCLUDED
 
 #include <boost/integer_traits.hpp>
+#include <boost/cstdint.hpp>
 
 #include "libtorrent/assert.hpp"
 
@@ -45,8 +46,12 @@ struct bandwidth_channel
 	static const int inf = boost::integer_traits<int>::const_max;
 
 	bandwidth_channel()
-		: m_quota_left(0)
+		: parent(0)
+		, queued_priority(0)
+		, distribute_quota(0)
+		, m_quota_left(0)
 		, m_limit(0)
+		, m_total_used(0)
 	{}
 
 	// 0 means infinite
@@ -91,13 +96,25 @@ struct bandwidth_channel
 	void use_quota(int amount)
 	{
 		TORRENT_ASSERT(amount >= 0);
+		m_total_used += amount;
 		if (m_limit == 0) return;
 		m_quota_left -= amount;
 	}
 
-	// used as temporary storage while distributing
-	// bandwidth
-	int tmp;
+	// the number of bytes assigned to requests that were
+	// limited by this channel
+	boost::int64_t total_used() const { return m_total_used; }
+
+	// channels form a tree. Requests on a channel are
+	// limited by all of its parents as well, which lets
+	// the children share the parent's quota
+	bandwidth_channel* parent;
+
+	// the sum of the priorities of the requests queued
+	// on this channel. Kept up to date by the
+	// bandwidth_manager, and used to split the quota
+	// between the requests
+	int queued_priority;
 
 	// this is the number of bytes to distribute this round
 	int distribute_quota;
@@ -111,6 +128,8 @@ private:
 	// the limit is the number of bytes
 	// per second we are allowed to use.
 	int m_limit;
+
+	boost::int64_t m_total_used;
 };
 
 }
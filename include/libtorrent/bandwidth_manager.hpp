@@ -34,6 +34,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
 
 #include <boost/intrusive_ptr.hpp>
+#include <vector>
+#include <algorithm>
+#ifdef TORRENT_DEBUG
+#include <map>
+#endif
 
 #ifdef TORRENT_VERBOSE_BANDWIDTH_LIMIT
 #include <fstream>
@@ -44,6 +49,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/bandwidth_limit.hpp"
 #include "libtorrent/bandwidth_queue_entry.hpp"
+#include "libtorrent/trace.hpp"
 
 using boost::intrusive_ptr;
 
@@ -61,6 +67,7 @@ struct bandwidth_manager
 		: m_queued_bytes(0)
 		, m_channel(channel)
 		, m_abort(false)
+		, m_trace(0)
 	{
 #ifdef TORRENT_VERBOSE_BANDWIDTH_LIMIT
 		if (log)
@@ -74,6 +81,10 @@ struct bandwidth_manager
 		m_abort = true;
 		m_queue.clear();
 		m_queued_bytes = 0;
+		for (std::vector<bandwidth_channel*>::iterator i = m_channels.begin()
+			, end(m_channels.end()); i != end; ++i)
+			(*i)->queued_priority = 0;
+		m_channels.clear();
 		error_code ec;
 	}
 
@@ -89,6 +100,9 @@ struct bandwidth_manager
 	}
 #endif
 
+	// grants are recorded in t while tracing is on
+	void set_trace(trace_buffer* t) { m_trace = t; }
+
 	int queue_size() const
 	{
 		return m_queue.size();
@@ -119,13 +133,12 @@ struct bandwidth_manager
 		TORRENT_ASSERT(!is_queued(peer.get()));
 
 		bw_request<PeerConnection> bwr(peer, blk, priority);
-		int i = 0;
-		if (chan1 && chan1->throttle() > 0) bwr.channel[i++] = chan1;
-		if (chan2 && chan2->throttle() > 0) bwr.channel[i++] = chan2;
-		if (chan3 && chan3->throttle() > 0) bwr.channel[i++] = chan3;
-		if (chan4 && chan4->throttle() > 0) bwr.channel[i++] = chan4;
-		if (chan5 && chan5->throttle() > 0) bwr.channel[i++] = chan5;
-		if (i == 0)
+		add_channel(bwr, chan1);
+		add_channel(bwr, chan2);
+		add_channel(bwr, chan3);
+		add_channel(bwr, chan4);
+		add_channel(bwr, chan5);
+		if (bwr.channel.empty())
 		{
 			// the connection is not rate limited by any of its
 			// bandwidth channels, or it doesn't belong to any
@@ -135,6 +148,12 @@ struct bandwidth_manager
 			return;
 		}
 		m_queued_bytes += blk;
+		for (int j = 0; j < int(bwr.channel.size()); ++j)
+		{
+			bandwidth_channel* bwc = bwr.channel[j];
+			if (bwc->queued_priority == 0) m_channels.push_back(bwc);
+			bwc->queued_priority += priority;
+		}
 		m_queue.push_back(bwr);
 	}
 
@@ -148,6 +167,22 @@ struct bandwidth_manager
 			queued += i->request_size - i->assigned;
 		}
 		TORRENT_ASSERT(queued == m_queued_bytes);
+
+		// the channels are listed exactly when there are
+		// requests queued on them
+		std::map<bandwidth_channel const*, int> prio;
+		for (typename queue_t::const_iterator i = m_queue.begin()
+			, end(m_queue.end()); i != end; ++i)
+		{
+			for (int j = 0; j < int(i->channel.size()); ++j)
+				prio[i->channel[j]] += i->priority;
+		}
+		TORRENT_ASSERT(prio.size() == m_channels.size());
+		for (std::vector<bandwidth_channel*>::const_iterator i = m_channels.begin()
+			, end(m_channels.end()); i != end; ++i)
+		{
+			TORRENT_ASSERT(prio[*i] == (*i)->queued_priority);
+		}
 	}
 #endif
 
@@ -161,73 +196,86 @@ struct bandwidth_manager
 		int dt_milliseconds = total_milliseconds(dt);
 		if (dt_milliseconds > 3000) dt_milliseconds = 3000;
 
-		// for each bandwidth channel, call update_quota(dt)
+		// only the channels with requests queued on them
+		// need their quota updated
+		for (std::vector<bandwidth_channel*>::iterator i = m_channels.begin()
+			, end(m_channels.end()); i != end; ++i)
+		{
+			(*i)->update_quota(dt_milliseconds);
+		}
 
-		std::vector<bandwidth_channel*> channels;
+		// requests are removed by moving the last one into
+		// their place, to keep this a single pass. The order
+		// of the queue doesn't affect the shares. The
+		// channels' queued priorities are left alone until
+		// the pass is done, since they're what the shares
+		// of the remaining requests are based on
+		queue_t tm;
+		queue_t dropped;
 
-		for (typename queue_t::iterator i = m_queue.begin();
-			i != m_queue.end();)
+		for (int i = 0; i < int(m_queue.size());)
 		{
-			if (i->peer->is_disconnecting())
+			bw_request<PeerConnection>& r = m_queue[i];
+			if (r.peer->is_disconnecting())
 			{
-				m_queued_bytes -= i->request_size - i->assigned;
+				m_queued_bytes -= r.request_size - r.assigned;
 
 				// return all assigned quota to all the
 				// bandwidth channels this peer belongs to
-				for (int j = 0; j < 5 && i->channel[j]; ++j)
-				{
-					bandwidth_channel* bwc = i->channel[j];
-					bwc->return_quota(i->assigned);
-				}
+				for (int j = 0; j < int(r.channel.size()); ++j)
+					r.channel[j]->return_quota(r.assigned);
 
-				i = m_queue.erase(i);
+				dropped.push_back(r);
+				remove_request(i);
 				continue;
 			}
-			for (int j = 0; j < 5 && i->channel[j]; ++j)
+
+			int a = r.assign_bandwidth();
+			if (r.assigned == r.request_size
+				|| (r.ttl <= 0 && r.assigned > 0))
 			{
-				bandwidth_channel* bwc = i->channel[j];
-				bwc->tmp = 0;
+				a += r.request_size - r.assigned;
+				TORRENT_ASSERT(r.assigned <= r.request_size);
+				tm.push_back(r);
+				remove_request(i);
 			}
-			++i;
-		}
-
-		for (typename queue_t::iterator i = m_queue.begin()
-			, end(m_queue.end()); i != end; ++i)
-		{
-			for (int j = 0; j < 5 && i->channel[j]; ++j)
+			else
 			{
-				bandwidth_channel* bwc = i->channel[j];
-				if (bwc->tmp == 0) channels.push_back(bwc);
-				bwc->tmp += i->priority;
-				TORRENT_ASSERT(i->priority > 0);
+				++i;
 			}
+			m_queued_bytes -= a;
 		}
 
-		for (std::vector<bandwidth_channel*>::iterator i = channels.begin()
-			, end(channels.end()); i != end; ++i)
-		{
-			(*i)->update_quota(dt_milliseconds);
-		}
-
-		queue_t tm;
-
-		for (typename queue_t::iterator i = m_queue.begin();
-			i != m_queue.end();)
+		for (typename queue_t::iterator i = tm.begin()
+			, end(tm.end()); i != end; ++i)
+			release_channels(*i);
+		for (typename queue_t::iterator i = dropped.begin()
+			, end(dropped.end()); i != end; ++i)
+			release_channels(*i);
+
+		// channels without any requests left are unlisted
+		// before the handlers run, since the handlers may
+		// request more bandwidth
+		for (int i = 0; i < int(m_channels.size());)
 		{
-			int a = i->assign_bandwidth();
-			if (i->assigned == i->request_size
-				|| (i->ttl <= 0 && i->assigned > 0))
-			{
-				a += i->request_size - i->assigned;
-				TORRENT_ASSERT(i->assigned <= i->request_size);
-				tm.push_back(*i);
-				i = m_queue.erase(i);
-			}
-			else
+			if (m_channels[i]->queued_priority > 0)
 			{
 				++i;
+				continue;
 			}
-			m_queued_bytes -= a;
+			m_channels[i] = m_channels.back();
+			m_channels.pop_back();
+		}
+
+		if (m_trace && m_trace->enabled() && !tm.empty())
+		{
+			int granted = 0;
+			for (typename queue_t::iterator i = tm.begin()
+				, end(tm.end()); i != end; ++i)
+				granted += i->assigned;
+			m_trace->instant("bandwidth", m_channel == 0 ? "upload grant" : "download grant"
+				, 0, "requests", int(tm.size()), "bytes", granted
+				, "queued", int(m_queue.size()));
 		}
 
 		while (!tm.empty())
@@ -238,10 +286,42 @@ struct bandwidth_manager
 		}
 	}
 
+	void remove_request(int i)
+	{
+		if (i != int(m_queue.size()) - 1) m_queue[i] = m_queue.back();
+		m_queue.pop_back();
+	}
+
+	// adds the channel and its parents to the request. Only
+	// the rate limited ones matter, and each one is only added
+	// once, even if it's reached through more than one path
+	static void add_channel(bw_request<PeerConnection>& bwr, bandwidth_channel* c)
+	{
+		for (; c; c = c->parent)
+		{
+			if (c->throttle() == 0) continue;
+			if (std::find(bwr.channel.begin(), bwr.channel.end(), c)
+				!= bwr.channel.end()) continue;
+			bwr.channel.push_back(c);
+		}
+	}
+
+	void release_channels(bw_request<PeerConnection> const& r)
+	{
+		for (int j = 0; j < int(r.channel.size()); ++j)
+		{
+			r.channel[j]->queued_priority -= r.priority;
+			TORRENT_ASSERT(r.channel[j]->queued_priority >= 0);
+		}
+	}
 
 	// these are the consumers that want bandwidth
 	typedef std::vector<bw_request<PeerConnection> > queue_t;
 	queue_t m_queue;
+
+	// the channels that have requests queued on them
+	std::vector<bandwidth_channel*> m_channels;
+
 	// the number of bytes all the requests in queue are for
 	int m_queued_bytes;
 
@@ -251,6 +331,9 @@ struct bandwidth_manager
 
 	bool m_abort;
 
+	// may be 0
+	trace_buffer* m_trace;
+
 #ifdef TORRENT_VERBOSE_BANDWIDTH_LIMIT
 	std::ofstream m_log;
 	ptime m_start;
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_BANDWIDTH_QUEUE_ENTRY_HPP_INCLUDED
 
 #include <boost/intrusive_ptr.hpp>
+#include <vector>
 #include "libtorrent/bandwidth_limit.hpp"
 
 namespace libtorrent {
@@ -50,7 +51,6 @@ struct bw_request
 		, ttl(20)
 	{
 		TORRENT_ASSERT(priority > 0);
-		std::memset(channel, 0, sizeof(channel));
 	}
 
 	boost::intrusive_ptr<PeerConnection> peer;
@@ -74,13 +74,13 @@ struct bw_request
 		TORRENT_ASSERT(assigned < request_size);
 		int quota = request_size - assigned;
 		TORRENT_ASSERT(quota >= 0);
-		for (int j = 0; j < 5 && channel[j]; ++j)
+		for (int j = 0; j < int(channel.size()); ++j)
 		{
 			if (channel[j]->throttle() == 0) continue;
-			quota = (std::min)(channel[j]->distribute_quota * priority / channel[j]->tmp, quota);
+			quota = (std::min)(channel[j]->distribute_quota * priority / channel[j]->queued_priority, quota);
 		}
 		assigned += quota;
-		for (int j = 0; j < 5 && channel[j]; ++j)
+		for (int j = 0; j < int(channel.size()); ++j)
 			channel[j]->use_quota(quota);
 		TORRENT_ASSERT(assigned <= request_size);
 		--ttl;
@@ -88,7 +88,9 @@ struct bw_request
 		return quota;
 	}
 
-	bandwidth_channel* channel[5];
+	// the rate limited channels this request is limited
+	// by, including the parents of the ones it was made on
+	std::vector<bandwidth_channel*> channel;
 };
 
 }
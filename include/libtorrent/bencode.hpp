@@ -64,6 +64,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -384,6 +388,98 @@ namespace libtorrent
 		return detail::bencode_recursive(out, e);
 	}
 
+	// writes bencoded data straight to the output iterator, without
+	// building an entry tree first. Containers are opened with
+	// begin_dict() or begin_list() and closed with end(). Inside a
+	// dictionary every value must be preceded by write_key(), and the
+	// keys must be written in sorted order, since that's what the
+	// encoding requires. That's asserted in debug builds.
+	template <class OutIt>
+	class bencode_writer
+	{
+	public:
+		bencode_writer(OutIt out): m_out(out), m_bytes(0) {}
+
+		void begin_dict()
+		{
+			detail::write_char(m_out, 'd');
+			++m_bytes;
+#ifdef TORRENT_DEBUG
+			m_stack.push_back(std::make_pair(true, std::string()));
+#endif
+		}
+
+		void begin_list()
+		{
+			detail::write_char(m_out, 'l');
+			++m_bytes;
+#ifdef TORRENT_DEBUG
+			m_stack.push_back(std::make_pair(false, std::string()));
+#endif
+		}
+
+		void end()
+		{
+#ifdef TORRENT_DEBUG
+			TORRENT_ASSERT(!m_stack.empty());
+			m_stack.pop_back();
+#endif
+			detail::write_char(m_out, 'e');
+			++m_bytes;
+		}
+
+		void write_key(char const* key, int len)
+		{
+#ifdef TORRENT_DEBUG
+			TORRENT_ASSERT(!m_stack.empty() && m_stack.back().first);
+			std::string k(key, len);
+			// the first key compares greater than the empty string
+			TORRENT_ASSERT(m_stack.back().second < k || (len == 0
+				&& m_stack.back().second.empty()));
+			m_stack.back().second.swap(k);
+#endif
+			write_string(key, len);
+		}
+
+		void write_key(char const* key) { write_key(key, std::strlen(key)); }
+
+		void write_string(char const* str, int len)
+		{
+			m_bytes += detail::write_integer(m_out, len);
+			detail::write_char(m_out, ':');
+			for (int i = 0; i < len; ++i)
+				*m_out++ = str[i];
+			m_bytes += len + 1;
+		}
+
+		void write_string(std::string const& str)
+		{ write_string(str.c_str(), str.size()); }
+
+		void write_int(entry::integer_type val)
+		{
+			detail::write_char(m_out, 'i');
+			m_bytes += detail::write_integer(m_out, val);
+			detail::write_char(m_out, 'e');
+			m_bytes += 2;
+		}
+
+		// for mixing in values that already are entry trees
+		void write_entry(entry const& e)
+		{ m_bytes += detail::bencode_recursive(m_out, e); }
+
+		// the number of bytes written so far
+		int bytes_written() const { return m_bytes; }
+
+	private:
+		OutIt m_out;
+		int m_bytes;
+#ifdef TORRENT_DEBUG
+		// one entry per open container, whether it's a dictionary
+		// and the last key written to it
+		std::vector<std::pair<bool, std::string> > m_stack;
+#endif
+	};
+
 	template<class InIt>
 	entry bdecode(InIt start, InIt end)
 	{
@@ -36,17 +36,22 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/config.hpp"
 #include <cstring> // for memset and memcpy
+#include <boost/cstdint.hpp>
 
 namespace libtorrent
 {
 	struct TORRENT_EXPORT bitfield
 	{
+		// bitfields of up to this many bits keep their bits inside
+		// the object, and don't allocate memory
+		enum { inline_bits = 256 };
+
 		bitfield(): m_bytes(0), m_size(0), m_own(false) {}
-		bitfield(int bits): m_bytes(0), m_size(0)
+		bitfield(int bits): m_bytes(0), m_size(0), m_own(false)
 		{ resize(bits); }
-		bitfield(int bits, bool val): m_bytes(0), m_size(0)
+		bitfield(int bits, bool val): m_bytes(0), m_size(0), m_own(false)
 		{ resize(bits, val); }
-		bitfield(char const* bytes, int bits): m_bytes(0), m_size(0)
+		bitfield(char const* bytes, int bits): m_bytes(0), m_size(0), m_own(false)
 		{ assign(bytes, bits); }
 		bitfield(bitfield const& rhs): m_bytes(0), m_size(0), m_own(false)
 		{ assign(rhs.bytes(), rhs.size()); }
@@ -98,6 +103,32 @@ namespace libtorrent
 			return *this;
 		}
 
+		// the operations on two bitfields require them
+		// to be the same size
+		bitfield& operator&=(bitfield const& rhs)
+		{ combine(rhs, and_op()); return *this; }
+
+		bitfield& operator|=(bitfield const& rhs)
+		{ combine(rhs, or_op()); return *this; }
+
+		// clears the bits that are set in rhs
+		bitfield& andnot(bitfield const& rhs)
+		{ combine(rhs, andnot_op()); return *this; }
+
+		bool operator==(bitfield const& rhs) const
+		{
+			if (m_size != rhs.m_size) return false;
+			const int num_bytes = m_size / 8;
+			if (std::memcmp(m_bytes, rhs.m_bytes, num_bytes) != 0) return false;
+			if ((m_size & 7) == 0) return true;
+			// borrowed bytes may have bits set past the end
+			unsigned char mask = 0xff << (8 - (m_size & 7));
+			return (m_bytes[num_bytes] & mask) == (rhs.m_bytes[num_bytes] & mask);
+		}
+
+		bool operator!=(bitfield const& rhs) const
+		{ return !(*this == rhs); }
+
 		int count() const
 		{
 			// 0000, 0001, 0010, 0011, 0100, 0101, 0110, 0111,
@@ -110,7 +141,22 @@ namespace libtorrent
 
 			int ret = 0;
 			const int num_bytes = m_size / 8;
-			for (int i = 0; i < num_bytes; ++i)
+			int i = 0;
+			// count 64 bits at a time
+			for (; i + 8 <= num_bytes; i += 8)
+			{
+				boost::uint64_t v;
+				std::memcpy(&v, m_bytes + i, 8);
+#ifdef __GNUC__
+				ret += __builtin_popcountll(v);
+#else
+				v = v - ((v >> 1) & 0x5555555555555555ULL);
+				v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+				ret += int((((v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL)
+					* 0x0101010101010101ULL) >> 56);
+#endif
+			}
+			for (; i < num_bytes; ++i)
 			{
 				ret += num_bits[m_bytes[i] & 0xf] + num_bits[m_bytes[i] >> 4];
 			}
@@ -125,6 +171,65 @@ namespace libtorrent
 			return ret;
 		}
 
+		// returns the index of the first set bit at or after
+		// start, or -1 if there is none. Runs of clear bits are
+		// skipped 64 bits at a time
+		int find_first_set(int start) const
+		{
+			TORRENT_ASSERT(start >= 0);
+			if (start >= m_size) return -1;
+			const int num_bytes = (m_size + 7) / 8;
+			int byte = start / 8;
+			unsigned char b = m_bytes[byte] & (0xff >> (start & 7));
+			while (b == 0)
+			{
+				++byte;
+				while (byte + 8 <= num_bytes)
+				{
+					boost::uint64_t w;
+					std::memcpy(&w, m_bytes + byte, 8);
+					if (w != 0) break;
+					byte += 8;
+				}
+				if (byte >= num_bytes) return -1;
+				b = m_bytes[byte];
+			}
+			int bit = 0;
+			while ((b & (0x80 >> bit)) == 0) ++bit;
+			int ret = byte * 8 + bit;
+			// borrowed bytes may have bits set past the end
+			return ret < m_size ? ret : -1;
+		}
+
+		// returns the index of the first clear bit at or after start,
+		// or -1 if all of them are set
+		int find_first_clear(int start) const
+		{
+			TORRENT_ASSERT(start >= 0);
+			if (start >= m_size) return -1;
+			const int num_bytes = (m_size + 7) / 8;
+			int byte = start / 8;
+			unsigned char b = ~m_bytes[byte] & (0xff >> (start & 7));
+			while (b == 0)
+			{
+				++byte;
+				while (byte + 8 <= num_bytes)
+				{
+					boost::uint64_t w;
+					std::memcpy(&w, m_bytes + byte, 8);
+					if (w != ~boost::uint64_t(0)) break;
+					byte += 8;
+				}
+				if (byte >= num_bytes) return -1;
+				b = ~m_bytes[byte];
+			}
+			int bit = 0;
+			while ((b & (0x80 >> bit)) == 0) ++bit;
+			int ret = byte * 8 + bit;
+			// the bits past the end are not part of the field
+			return ret < m_size ? ret : -1;
+		}
+
 		struct const_iterator
 		{
 		friend struct bitfield;
@@ -222,25 +327,32 @@ namespace libtorrent
 		void resize(int bits)
 		{
 			const int bytes = (bits + 7) / 8;
-			if (m_bytes)
+			if (m_own)
 			{
-				if (m_own)
-				{
-					m_bytes = (unsigned char*)std::realloc(m_bytes, bytes);
-					m_own = true;
-				}
-				else if (bits > m_size)
+				m_bytes = (unsigned char*)std::realloc(m_bytes, bytes);
+			}
+			else if (m_bytes == m_inline)
+			{
+				if (bytes > int(inline_bits / 8))
 				{
 					unsigned char* tmp = (unsigned char*)std::malloc(bytes);
-					std::memcpy(tmp, m_bytes, (std::min)((m_size + 7)/ 8, bytes));
+					std::memcpy(tmp, m_inline, (m_size + 7) / 8);
 					m_bytes = tmp;
 					m_own = true;
 				}
 			}
-			else
+			else if (m_bytes == 0 || bits > m_size)
 			{
-				m_bytes = (unsigned char*)std::malloc(bytes);
-				m_own = true;
+				// we either don't have any bytes yet, or they're
+				// borrowed and we need more of them
+				unsigned char* tmp = m_inline;
+				if (bytes > int(inline_bits / 8))
+				{
+					tmp = (unsigned char*)std::malloc(bytes);
+					m_own = true;
+				}
+				if (m_bytes) std::memcpy(tmp, m_bytes, (m_size + 7) / 8);
+				m_bytes = tmp;
 			}
 			m_size = bits;
 			clear_trailing_bits();
@@ -256,10 +368,41 @@ namespace libtorrent
 			if (m_size & 7) m_bytes[(m_size + 7) / 8 - 1] &= 0xff << (8 - (m_size & 7));
 		}
 
-		void dealloc() { if (m_own) std::free(m_bytes); m_bytes = 0; }
+		struct and_op
+		{ boost::uint64_t operator()(boost::uint64_t a, boost::uint64_t b) const { return a & b; } };
+		struct or_op
+		{ boost::uint64_t operator()(boost::uint64_t a, boost::uint64_t b) const { return a | b; } };
+		struct andnot_op
+		{ boost::uint64_t operator()(boost::uint64_t a, boost::uint64_t b) const { return a & ~b; } };
+
+		// applies op to the bits of this and rhs, 64 bits at a time
+		template <class Op>
+		void combine(bitfield const& rhs, Op op)
+		{
+			TORRENT_ASSERT(rhs.m_size == m_size);
+			const int num_bytes = (m_size + 7) / 8;
+			int i = 0;
+			for (; i + 8 <= num_bytes; i += 8)
+			{
+				boost::uint64_t a;
+				boost::uint64_t b;
+				std::memcpy(&a, m_bytes + i, 8);
+				std::memcpy(&b, rhs.m_bytes + i, 8);
+				a = op(a, b);
+				std::memcpy(m_bytes + i, &a, 8);
+			}
+			for (; i < num_bytes; ++i)
+				m_bytes[i] = (unsigned char)op(m_bytes[i], rhs.m_bytes[i]);
+			clear_trailing_bits();
+		}
+
+		void dealloc() { if (m_own) std::free(m_bytes); m_bytes = 0; m_own = false; }
+		// points to m_inline, to memory we own (if m_own is set)
+		// or to borrowed memory
 		unsigned char* m_bytes;
 		int m_size:31; // in bits
 		bool m_own:1;
+		unsigned char m_inline[inline_bits / 8];
 	};
 
 }
@@ -0,0 +1,111 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BLOCK_MATH_HPP_INCLUDED
+#define TORRENT_BLOCK_MATH_HPP_INCLUDED
+
+#include "libtorrent/assert.hpp"
+#include "libtorrent/size_type.hpp"
+
+namespace libtorrent
+{
+	// divides offsets and sizes into blocks (or pieces) of a fixed
+	// size. When the size is a power of two, which it is for the
+	// default 16 kiB block size and nearly every piece size, this is
+	// done with shifts and masks instead of divisions. Other sizes,
+	// like the block size of a torrent with an odd piece size
+	// smaller than 16 kiB, fall back to dividing
+	class block_math
+	{
+	public:
+		explicit block_math(int size = 16 * 1024) { set_size(size); }
+
+		void set_size(int size)
+		{
+			TORRENT_ASSERT(size > 0);
+			m_size = size;
+			m_shift = -1;
+			if ((size & (size - 1)) != 0) return;
+			m_shift = 0;
+			while ((1 << m_shift) < size) ++m_shift;
+		}
+
+		int size() const { return m_size; }
+
+		// the index of the block the byte at offset is in
+		int index(int offset) const
+		{
+			TORRENT_ASSERT(offset >= 0);
+			return m_shift >= 0 ? offset >> m_shift : offset / m_size;
+		}
+		int index(size_type offset) const
+		{
+			TORRENT_ASSERT(offset >= 0);
+			return int(m_shift >= 0 ? offset >> m_shift : offset / m_size);
+		}
+
+		// the offset into its block of the byte at offset
+		int remainder(int offset) const
+		{
+			TORRENT_ASSERT(offset >= 0);
+			return m_shift >= 0 ? offset & (m_size - 1) : offset % m_size;
+		}
+
+		// the number of blocks needed to hold bytes
+		int count(int bytes) const
+		{
+			TORRENT_ASSERT(bytes >= 0);
+			return m_shift >= 0 ? (bytes + m_size - 1) >> m_shift
+				: (bytes + m_size - 1) / m_size;
+		}
+		int count(size_type bytes) const
+		{
+			TORRENT_ASSERT(bytes >= 0);
+			return int(m_shift >= 0 ? (bytes + m_size - 1) >> m_shift
+				: (bytes + m_size - 1) / m_size);
+		}
+
+		// the offset of the first byte of block
+		int start(int block) const
+		{ return m_shift >= 0 ? block << m_shift : block * m_size; }
+
+		bool aligned(int offset) const { return remainder(offset) == 0; }
+
+	private:
+		int m_size;
+		// log2 of m_size, or -1 if it's not a power of two
+		int m_shift;
+	};
+}
+
+#endif
+
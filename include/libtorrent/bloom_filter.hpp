@@ -0,0 +1,127 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BLOOM_FILTER_HPP_INCLUDED
+#define TORRENT_BLOOM_FILTER_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cmath>
+
+namespace libtorrent
+{
+	// a bloom filter of N bytes, with two bits set per item. The two
+	// bit indices are taken from the first four bytes of the item's
+	// SHA-1 hash, the way BEP 33 (DHT scrape) lays it out, so filters
+	// from other nodes can be merged and their size estimated
+	template <int N>
+	struct bloom_filter
+	{
+		enum { num_bits = N * 8 };
+
+		bloom_filter() { clear(); }
+
+		void set(sha1_hash const& k)
+		{
+			int i1, i2;
+			bit_indices(k, i1, i2);
+			m_bits[i1 / 8] |= 1 << (i1 & 7);
+			m_bits[i2 / 8] |= 1 << (i2 & 7);
+		}
+
+		bool find(sha1_hash const& k) const
+		{
+			int i1, i2;
+			bit_indices(k, i1, i2);
+			return (m_bits[i1 / 8] & (1 << (i1 & 7)))
+				&& (m_bits[i2 / 8] & (1 << (i2 & 7)));
+		}
+
+		// adds all the items in f to this filter
+		bloom_filter& operator|=(bloom_filter const& f)
+		{
+			for (int i = 0; i < N; ++i) m_bits[i] |= f.m_bits[i];
+			return *this;
+		}
+
+		void clear() { std::memset(m_bits, 0, N); }
+
+		bool empty() const
+		{ return std::find_if(m_bits, m_bits + N, nonzero) == m_bits + N; }
+
+		// an estimate of the number of items that have been
+		// added. It gets less accurate as the filter fills up
+		int size() const
+		{
+			int zeros = 0;
+			for (int i = 0; i < N; ++i)
+			{
+				for (unsigned char b = ~m_bits[i]; b; b &= b - 1)
+					++zeros;
+			}
+			if (zeros == num_bits) return 0;
+			// a full filter means more items than it can tell
+			if (zeros == 0) zeros = 1;
+			double const m = num_bits;
+			return int(std::log(zeros / m) / (2 * std::log(1 - 1 / m)) + 0.5);
+		}
+
+		std::string to_string() const
+		{ return std::string((char const*)m_bits, N); }
+
+		// returns false if s isn't exactly N bytes
+		bool from_string(char const* s, int len)
+		{
+			if (len != N) return false;
+			std::memcpy(m_bits, s, N);
+			return true;
+		}
+
+	private:
+
+		static void bit_indices(sha1_hash const& k, int& i1, int& i2)
+		{
+			i1 = (k[0] | (k[1] << 8)) % num_bits;
+			i2 = (k[2] | (k[3] << 8)) % num_bits;
+		}
+
+		static bool nonzero(unsigned char b) { return b != 0; }
+
+		unsigned char m_bits[N];
+	};
+}
+
+#endif // TORRENT_BLOOM_FILTER_HPP_INCLUDED
@@ -109,6 +109,11 @@ namespace libtorrent
 #ifndef TORRENT_DISABLE_ENCRYPTION
 		bool supports_encryption() const
 		{ return m_encrypted; }
+
+		// true if the send buffer is RC4 encrypted in place, so
+		// buffers that are shared can't be appended to it
+		bool rc4_encrypted() const
+		{ return m_encrypted && m_rc4_encrypted; }
 #endif
 
 		enum message_type
@@ -148,6 +153,8 @@ namespace libtorrent
 		
 		virtual void get_specific_peer_info(peer_info& p) const;
 		virtual bool in_handshake() const;
+		virtual int read_ahead_size() const;
+		virtual int memory_usage() const;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		bool support_extensions() const { return m_supports_extensions; }
@@ -211,6 +218,7 @@ namespace libtorrent
 		void write_bitfield();
 		void write_have(int index);
 		void write_piece(peer_request const& r, disk_buffer_holder& buffer);
+		bool write_piece_from_file(peer_request const& r);
 		void write_handshake();
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		void write_extensions();
@@ -228,6 +236,7 @@ namespace libtorrent
 		void write_have_none();
 		void write_reject_request(peer_request const&);
 		void write_allow_fast(int piece);
+		void write_suggest(int piece);
 		
 		void on_connected();
 		void on_metadata();
@@ -239,6 +248,8 @@ namespace libtorrent
 
 	private:
 
+		void on_receive_packet(boost::shared_ptr<torrent> const& t
+			, std::size_t bytes_transferred);
 		bool dispatch_message(int received);
 		// returns the block currently being
 		// downloaded. And the progress of that
@@ -276,21 +287,14 @@ public:
 		// peer_connection functions of the same names
 		void send_buffer(char const* buf, int size, int flags = 0);
 		buffer::interval allocate_send_buffer(int size);
-		template <class Destructor>
-		void append_send_buffer(char* buffer, int size, Destructor const& destructor)
+		void append_send_buffer(char* buffer, int size
+			, chained_buffer::free_buffer_fun destructor, void* userdata)
 		{
 #ifndef TORRENT_DISABLE_ENCRYPTION
-			if (m_rc4_encrypted)
-			{
-				TORRENT_ASSERT(send_buffer_size() == m_encrypted_bytes);
-				m_RC4_handler->encrypt(buffer, size);
-#ifdef TORRENT_DEBUG
-				m_encrypted_bytes += size;
-				TORRENT_ASSERT(m_encrypted_bytes == send_buffer_size() + size);
-#endif
-			}
+			// encrypted in place by the next setup_send()
+			if (m_encrypted && m_rc4_encrypted) m_rc4_pending += size;
 #endif
-			peer_connection::append_send_buffer(buffer, size, destructor);
+			peer_connection::append_send_buffer(buffer, size, destructor, userdata);
 		}
 		void setup_send();
 
@@ -387,9 +391,10 @@ private:
 		// the maximum number of bytes
 		int m_sync_bytes_read;
 
-		// hold information about latest allocated send buffer
-		// need to check for non zero (begin, end) for operations with this
-		buffer::interval m_enc_send_buffer;
+		// the number of bytes at the end of the send buffer that
+		// still are plaintext. They're all encrypted in one pass
+		// by encrypt_pending_buffer() right before they're sent
+		int m_rc4_pending;
 		
 		// initialized during write_pe1_2_dhkey, and destroyed on
 		// creation of m_RC4_handler. Cannot reinitialize once
@@ -33,15 +33,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef TORRENT_CHAINED_BUFFER_HPP_INCLUDED
 #define TORRENT_CHAINED_BUFFER_HPP_INCLUDED
 
-#include <boost/function.hpp>
 #include <boost/version.hpp>
 #if BOOST_VERSION < 103500
 #include <asio/buffer.hpp>
 #else
 #include <boost/asio/buffer.hpp>
 #endif
-#include <list>
+#include <vector>
+#include <algorithm>
 #include <cstring>
+#include "libtorrent/assert.hpp"
 
 namespace libtorrent
 {
@@ -50,11 +51,22 @@ namespace libtorrent
 #endif
 	struct chained_buffer
 	{
-		chained_buffer(): m_bytes(0), m_capacity(0) {}
+		chained_buffer(): m_first(0), m_num(0), m_bytes(0), m_capacity(0)
+			, m_inline_used(false) {}
+
+		// the size of the buffer inside the chained_buffer
+		// itself, that small messages are put in
+		enum { inline_size = 64 };
+
+		// frees a buffer when the chain is done with it. userdata is
+		// the pointer passed to append_buffer() and size is the total
+		// size of the buffer
+		typedef void (*free_buffer_fun)(char* buf, void* userdata, int size);
 
 		struct buffer_t
 		{
-			boost::function<void(char*)> free; // destructs the buffer
+			free_buffer_fun free; // destructs the buffer
+			void* userdata; // passed on to free
 			char* buf; // the first byte of the buffer
 			int size; // the total size of the buffer
 
@@ -69,9 +81,9 @@ namespace libtorrent
 		void pop_front(int bytes_to_pop)
 		{
 			TORRENT_ASSERT(bytes_to_pop <= m_bytes);
-			while (bytes_to_pop > 0 && !m_vec.empty())
+			while (bytes_to_pop > 0 && m_num > 0)
 			{
-				buffer_t& b = m_vec.front();
+				buffer_t& b = at(0);
 				if (b.used_size > bytes_to_pop)
 				{
 					b.start += bytes_to_pop;
@@ -83,28 +95,32 @@ namespace libtorrent
 					break;
 				}
 
-				b.free(b.buf);
+				b.free(b.buf, b.userdata, b.size);
 				m_bytes -= b.used_size;
 				m_capacity -= b.size;
 				bytes_to_pop -= b.used_size;
 				TORRENT_ASSERT(m_bytes >= 0);
 				TORRENT_ASSERT(m_capacity >= 0);
 				TORRENT_ASSERT(m_bytes <= m_capacity);
-				m_vec.pop_front();
+				m_first = (m_first + 1) & (int(m_vec.size()) - 1);
+				--m_num;
 			}
 		}
 
-		template <class D>
-		void append_buffer(char* buffer, int size, int used_size, D const& destructor)
+		void append_buffer(char* buffer, int size, int used_size
+			, free_buffer_fun destructor, void* userdata)
 		{
 			TORRENT_ASSERT(size >= used_size);
-			buffer_t b;
+			TORRENT_ASSERT(destructor);
+			if (m_num == int(m_vec.size())) grow();
+			buffer_t& b = at(m_num);
 			b.buf = buffer;
 			b.size = size;
 			b.start = buffer;
 			b.used_size = used_size;
 			b.free = destructor;
-			m_vec.push_back(b);
+			b.userdata = userdata;
+			++m_num;
 
 			m_bytes += used_size;
 			m_capacity += size;
@@ -115,8 +131,8 @@ namespace libtorrent
 		// end of the last chained buffer.
 		int space_in_last_buffer()
 		{
-			if (m_vec.empty()) return 0;
-			buffer_t& b = m_vec.back();
+			if (m_num == 0) return 0;
+			buffer_t& b = at(m_num - 1);
 			return b.size - b.used_size - (b.start - b.buf);
 		}
 
@@ -136,8 +152,8 @@ namespace libtorrent
 		// enough room, returns 0
 		char* allocate_appendix(int size)
 		{
-			if (m_vec.empty()) return 0;
-			buffer_t& b = m_vec.back();
+			if (m_num == 0) return 0;
+			buffer_t& b = at(m_num - 1);
 			char* insert = b.start + b.used_size;
 			if (insert + size > b.buf + b.size) return 0;
 			b.used_size += size;
@@ -146,40 +162,106 @@ namespace libtorrent
 			return insert;
 		}
 
-		std::list<asio::const_buffer> const& build_iovec(int to_send)
+		// appends the buffer inside this object to the chain,
+		// with size bytes used. This avoids allocating memory
+		// for small messages when the chain is empty. Returns 0
+		// if the inline buffer is already in the chain or if
+		// it's too small
+		char* allocate_inline(int size)
+		{
+			if (m_inline_used || size > int(inline_size)) return 0;
+			m_inline_used = true;
+			append_buffer(m_inline, inline_size, size, &free_inline, this);
+			return m_inline;
+		}
+
+		// calls f(char* buf, int size) for each of the ranges making
+		// up the last bytes bytes of the chain, front to back
+		template <class Fun>
+		void for_each_tail(int bytes, Fun f)
+		{
+			TORRENT_ASSERT(bytes <= m_bytes);
+			if (bytes <= 0) return;
+			int i = m_num;
+			int skip = bytes;
+			while (skip > 0)
+			{
+				TORRENT_ASSERT(i > 0);
+				--i;
+				skip -= at(i).used_size;
+			}
+			// skip is now the negative number of bytes at the
+			// beginning of i that aren't part of the tail
+			f(at(i).start - skip, at(i).used_size + skip);
+			for (++i; i < m_num; ++i)
+			{
+				buffer_t& b = at(i);
+				if (b.used_size == 0) continue;
+				f(b.start, b.used_size);
+			}
+		}
+
+		// the returned vector is reused by the next call, it's
+		// valid until then
+		std::vector<asio::const_buffer> const& build_iovec(int to_send)
 		{
 			m_tmp_vec.clear();
 
-			for (std::list<buffer_t>::iterator i = m_vec.begin()
-				, end(m_vec.end()); to_send > 0 && i != end; ++i)
+			for (int i = 0; to_send > 0 && i < m_num; ++i)
 			{
-				if (i->used_size > to_send)
+				buffer_t& b = at(i);
+				if (b.used_size > to_send)
 				{
 					TORRENT_ASSERT(to_send > 0);
-					m_tmp_vec.push_back(asio::const_buffer(i->start, to_send));
+					m_tmp_vec.push_back(asio::const_buffer(b.start, to_send));
 					break;
 				}
-				TORRENT_ASSERT(i->used_size > 0);
-				m_tmp_vec.push_back(asio::const_buffer(i->start, i->used_size));
-				to_send -= i->used_size;
+				TORRENT_ASSERT(b.used_size > 0);
+				m_tmp_vec.push_back(asio::const_buffer(b.start, b.used_size));
+				to_send -= b.used_size;
 			}
 			return m_tmp_vec;
 		}
 
 		~chained_buffer()
 		{
-			for (std::list<buffer_t>::iterator i = m_vec.begin()
-				, end(m_vec.end()); i != end; ++i)
+			for (int i = 0; i < m_num; ++i)
 			{
-				i->free(i->buf);
+				buffer_t& b = at(i);
+				b.free(b.buf, b.userdata, b.size);
 			}
 		}
 
 	private:
 
-		// this is the list of all the buffers we want to
-		// send
-		std::list<buffer_t> m_vec;
+		static void free_inline(char*, void* self, int)
+		{ static_cast<chained_buffer*>(self)->m_inline_used = false; }
+
+		// the i:th buffer of the chain
+		buffer_t& at(int i)
+		{
+			TORRENT_ASSERT(i >= 0 && i < int(m_vec.size()));
+			return m_vec[(m_first + i) & (int(m_vec.size()) - 1)];
+		}
+
+		// doubles the size of the ring, with the first buffer
+		// moved to the beginning
+		void grow()
+		{
+			std::vector<buffer_t> v((std::max)(int(m_vec.size()) * 2, 8));
+			for (int i = 0; i < m_num; ++i) v[i] = at(i);
+			m_vec.swap(v);
+			m_first = 0;
+		}
+
+		// this is the ring of all the buffers we want to send.
+		// Its size is always a power of 2, and it only grows,
+		// so that queuing buffers doesn't allocate memory once
+		// it's large enough. The chain is the m_num buffers
+		// starting at m_first
+		std::vector<buffer_t> m_vec;
+		int m_first;
+		int m_num;
 
 		// this is the number of bytes in the send buf.
 		// this will always be equal to the sum of the
@@ -191,8 +273,14 @@ namespace libtorrent
 		int m_capacity;
 
 		// this is the vector of buffers used when
-		// invoking the async write call
-		std::list<asio::const_buffer> m_tmp_vec;
+		// invoking the async write call. It's kept
+		// around to reuse its memory
+		std::vector<asio::const_buffer> m_tmp_vec;
+
+		// small messages are put here when the chain is
+		// empty, see allocate_inline()
+		char m_inline[inline_size];
+		bool m_inline_used;
 	};	
 }
 
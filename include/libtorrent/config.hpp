@@ -106,6 +106,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_USE_WRITEV 1
 #define TORRENT_USE_IOSTREAM 1
 
+// sendfile() can send piece data from
+// files straight to sockets
+#ifdef TORRENT_LINUX
+#define TORRENT_USE_SENDFILE 1
+#else
+#define TORRENT_USE_SENDFILE 0
+#endif
+
 // should wpath or path be used?
 #if defined UNICODE && !defined BOOST_FILESYSTEM_NARROW_ONLY \
 	&& BOOST_VERSION >= 103400 && !defined __APPLE__
@@ -33,12 +33,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef TORRENT_CONNECTION_QUEUE
 #define TORRENT_CONNECTION_QUEUE
 
-#include <list>
+#include <map>
+#include <deque>
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/cstdint.hpp>
 #include "libtorrent/socket.hpp"
 #include "libtorrent/time.hpp"
+#include "libtorrent/session_stats.hpp"
 
 #ifdef TORRENT_CONNECTION_LOGGING
 #include <fstream>
@@ -56,14 +60,49 @@ public:
 	// number of queued up connections
 	int free_slots() const;
 
+	// owner identifies what the connection is for, typically
+	// the torrent. The half-open slots are handed out round-robin
+	// between owners, so one torrent with thousands of peers to
+	// try can't keep the others from connecting. Connections with
+	// priority 1 are started before all connections with priority 0
 	void enqueue(boost::function<void(int)> const& on_connect
 		, boost::function<void()> const& on_timeout
-		, time_duration timeout, int priority = 0);
-	void done(int ticket);
+		, time_duration timeout, int priority = 0
+		, void const* owner = 0);
+	// how a connection attempt ended, passed to done(). Attempts
+	// that time out are counted by the queue itself
+	enum connect_result_t
+	{
+		connect_aborted,
+		connect_succeeded,
+		connect_failed
+	};
+
+	void done(int ticket, int result = connect_aborted);
 	void limit(int limit);
 	int limit() const;
 	void close();
-	int size() const { return m_queue.size(); }
+	int size() const { return m_entries.size(); }
+
+	// the time connections waited in the queue before
+	// they were started
+	void get_wait_time(latency_histogram& h) const;
+
+	// the outcomes of the connection attempts that ended
+	// since the last call to get_connect_stats()
+	struct connect_stats
+	{
+		connect_stats(): succeeded(0), failed(0), timed_out(0), total_time(0) {}
+		int succeeded;
+		int failed;
+		int timed_out;
+		// the sum of the time the successful attempts took to
+		// connect, in milliseconds
+		boost::int64_t total_time;
+	};
+
+	// adds the counters to st and resets them
+	void get_connect_stats(connect_stats& st);
 
 #ifdef TORRENT_DEBUG
 	void check_invariant() const;
@@ -86,12 +125,49 @@ private:
 		boost::function<void()> on_timeout;
 		bool connecting;
 		int ticket;
+		// when the entry was queued
+		ptime queued;
 		ptime expires;
 		time_duration timeout;
 		int priority;
 	};
 
-	std::list<entry> m_queue;
+	// all entries, the ones waiting as well as the ones
+	// connecting, indexed by ticket
+	typedef std::map<int, entry> entries_t;
+	entries_t m_entries;
+
+	// the tickets waiting for a slot, for one priority. Each
+	// owner has its own queue, and owners holds the owners with
+	// tickets in round-robin order. Tickets that are removed
+	// while waiting stay in here and are skipped
+	struct waiting_queue
+	{
+		std::map<void const*, std::deque<int> > tickets;
+		std::deque<void const*> owners;
+	};
+	waiting_queue m_waiting[2];
+
+	// returns the next entry to start, or m_entries.end()
+	entries_t::iterator next_waiting();
+
+	// a min-heap of the expiry times of connecting entries. Entries
+	// that are done stay in it until they reach the top, where they
+	// are skipped
+	typedef std::pair<ptime, int> timeout_entry;
+	std::vector<timeout_entry> m_timeouts;
+	void pop_timeout();
+
+	// sets the timer to the first timeout in m_timeouts
+	void update_timer();
+
+	// the time m_timer is set to expire at, max_time()
+	// if it isn't waiting
+	ptime m_next_timeout;
+
+	latency_histogram m_wait_time;
+
+	connect_stats m_connect_stats;
 
 	// the next ticket id a connection will be given
 	int m_next_ticket;
@@ -46,6 +46,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <string>
 #include <utility>
+#include <ctime>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -56,6 +57,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/optional.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
 #include <boost/config.hpp>
 
 #ifdef _MSC_VER
@@ -87,6 +89,19 @@ namespace libtorrent
 		void add_tracker(std::string const& url, int tier = 0);
 		void set_priv(bool p) { m_private = p; }
 
+		// copies the piece hashes from a previous version of this
+		// torrent, for all pieces that lie entirely within files
+		// that are unchanged and at the same offsets. prev_sizes
+		// and sizes are the file sizes and modification times
+		// (as returned by get_filesizes()) of prev's files when it
+		// was created and of the current files. Returns the number
+		// of reused hashes. set_piece_hashes() skips those pieces
+		int reuse_piece_hashes(torrent_info const& prev
+			, std::vector<std::pair<size_type, std::time_t> > const& prev_sizes
+			, std::vector<std::pair<size_type, std::time_t> > const& sizes);
+		bool hash_reused(int index) const
+		{ return index < int(m_hash_reused.size()) && m_hash_reused[index]; }
+
 		int num_pieces() const { return m_files.num_pieces(); }
 		int piece_length() const { return m_files.piece_length(); }
 		int piece_size(int i) const { return m_files.piece_size(i); }
@@ -108,6 +123,10 @@ namespace libtorrent
 
 		std::vector<sha1_hash> m_piece_hash;
 
+		// pieces whose hash was copied by reuse_piece_hashes().
+		// Empty unless it has been called
+		std::vector<bool> m_hash_reused;
+
 		// dht nodes to add to the routing table/bootstrap from
 		typedef std::vector<std::pair<std::string, int> > nodes_t;
 		nodes_t m_nodes;
@@ -145,6 +164,15 @@ namespace libtorrent
 		bool m_merkle_torrent:1;
 	};
 
+	// flags for set_piece_hashes()
+	enum
+	{
+		// read the files with the page cache disabled (O_DIRECT
+		// where it's supported), to not evict everything else
+		// from it when hashing large data sets
+		hash_disable_os_cache = 1
+	};
+
 	namespace detail
 	{
 		inline bool default_pred(boost::filesystem::path const&) { return true; }
@@ -161,6 +189,15 @@ namespace libtorrent
 		int TORRENT_EXPORT get_file_attributes(boost::filesystem::path const& p);
 		int TORRENT_EXPORT get_file_attributes(boost::filesystem::wpath const& p);
 
+		// reads the pieces of t from st sequentially on the calling
+		// thread and hashes them on num_threads threads (0 means
+		// one per core). f is called on the calling thread, in
+		// piece order, as the hashes are set. Pieces whose hashes
+		// were reused from a previous torrent are not read
+		void TORRENT_EXPORT hash_pieces(create_torrent& t, storage_interface& st
+			, boost::function<void(int)> const& f, int flags, int num_threads
+			, error_code& ec);
+
 		template <class Pred, class Str, class PathTraits>
 		void add_files_impl(file_storage& fs, boost::filesystem::basic_path<Str, PathTraits> const& p
 			, boost::filesystem::basic_path<Str, PathTraits> const& l, Pred pred)
@@ -226,29 +263,12 @@ namespace libtorrent
 
 	template <class Fun>
 	void set_piece_hashes(create_torrent& t, boost::filesystem::path const& p, Fun f
-		, error_code& ec)
+		, error_code& ec, int flags = 0, int num_threads = 0)
 	{
 		file_pool fp;
 		boost::scoped_ptr<storage_interface> st(
 			default_storage_constructor(const_cast<file_storage&>(t.files()), p, fp));
-
-		// calculate the hash for all pieces
-		int num = t.num_pieces();
-		piece_holder buf(t.piece_length());
-		for (int i = 0; i < num; ++i)
-		{
-			// read hits the disk and will block. Progress should
-			// be updated in between reads
-			st->read(buf.bytes(), i, 0, t.piece_size(i));
-			if (st->error())
-			{
-				ec = st->error();
-				return;
-			}
-			hasher h(buf.bytes(), t.piece_size(i));
-			t.set_hash(i, h.final());
-			f(i);
-		}
+		detail::hash_pieces(t, *st, f, flags, num_threads, ec);
 	}
 
 #ifndef BOOST_NO_EXCEPTIONS
@@ -298,31 +318,14 @@ namespace libtorrent
 	
 	template <class Fun>
 	void set_piece_hashes(create_torrent& t, boost::filesystem::wpath const& p, Fun f
-		, error_code& ec)
+		, error_code& ec, int flags = 0, int num_threads = 0)
 	{
 		file_pool fp;
 		std::string utf8;
 		wchar_utf8(p.string(), utf8);
 		boost::scoped_ptr<storage_interface> st(
 			default_storage_constructor(const_cast<file_storage&>(t.files()), utf8, fp));
-
-		// calculate the hash for all pieces
-		int num = t.num_pieces();
-		std::vector<char> buf(t.piece_length());
-		for (int i = 0; i < num; ++i)
-		{
-			// read hits the disk and will block. Progress should
-			// be updated in between reads
-			st->read(&buf[0], i, 0, t.piece_size(i));
-			if (st->error())
-			{
-				ec = st->error();
-				return;
-			}
-			hasher h(&buf[0], t.piece_size(i));
-			t.set_hash(i, h.final());
-			f(i);
-		}
+		detail::hash_pieces(t, *st, f, flags, num_threads, ec);
 	}
 
 #ifndef BOOST_NO_EXCEPTIONS
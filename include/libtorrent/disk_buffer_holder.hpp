@@ -42,20 +42,28 @@ namespace libtorrent
 
 	namespace aux { struct session_impl; }
 	struct disk_buffer_pool;
+	struct disk_io_job;
 
 	struct TORRENT_EXPORT disk_buffer_holder
 	{
 		disk_buffer_holder(aux::session_impl& ses, char* buf);
 		disk_buffer_holder(disk_buffer_pool& disk_pool, char* buf);
 		disk_buffer_holder(disk_buffer_pool& disk_pool, char* buf, int num_blocks);
+		// holds the buffer of a completed read job, which may be
+		// a reference to a read cache block
+		disk_buffer_holder(aux::session_impl& ses, disk_io_job const& j);
 		~disk_buffer_holder();
 		char* release();
 		char* get() const { return m_buf; }
+		// true if the buffer is a reference to a cache block. It
+		// has to be released with disk_buffer_pool::reclaim_buffer()
+		bool is_reference() const { return m_ref; }
 		void reset(char* buf = 0, int num_blocks = 1);
 		void swap(disk_buffer_holder& h)
 		{
 			TORRENT_ASSERT(&h.m_disk_pool == &m_disk_pool);
 			std::swap(h.m_buf, m_buf);
+			std::swap(h.m_ref, m_ref);
 		}
 
 		typedef char* (disk_buffer_holder::*unspecified_bool_type)();
@@ -66,6 +74,7 @@ namespace libtorrent
 		disk_buffer_pool& m_disk_pool;
 		char* m_buf;
 		int m_num_blocks;
+		bool m_ref;
 	};
 
 }
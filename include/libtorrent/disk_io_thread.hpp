@@ -42,23 +42,40 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/identity.hpp>
 #include <list>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include "libtorrent/config.hpp"
+#include "libtorrent/bitfield.hpp"
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
 #include <boost/pool/pool.hpp>
 #endif
 #include "libtorrent/session_settings.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/trace.hpp"
+#include "libtorrent/block_math.hpp"
 
 namespace libtorrent
 {
 	struct cached_piece_info
 	{
 		int piece;
-		std::vector<bool> blocks;
+		bitfield blocks;
 		ptime last_use;
 		enum kind_t { read_cache = 0, write_cache = 1 };
 		kind_t kind;
@@ -73,6 +90,10 @@ namespace libtorrent
 			, piece(0)
 			, offset(0)
 			, priority(0)
+			, io_class(normal_io_class)
+			, read_ahead(-1)
+			, cached_buffer(false)
+			, read_hinted(false)
 		{}
 
 		enum action_t
@@ -92,14 +113,21 @@ namespace libtorrent
 			, abort_torrent
 			, update_settings
 			, read_and_hash
+			, relocate_pieces
+			, discard_piece
 		};
 
+		// the number of action types
+		enum { num_actions = discard_piece + 1 };
+
 		action_t action;
 
 		char* buffer;
 		int buffer_size;
 		boost::intrusive_ptr<piece_manager> storage;
-		// arguments used for read and write
+		// arguments used for read and write. For move_storage,
+		// offset is set to the progress of the move, in parts
+		// per million
 		int piece, offset;
 		// used for move_storage and rename_file. On errors, this is set
 		// to the error message
@@ -115,11 +143,34 @@ namespace libtorrent
 		// with lower priority
 		int priority;
 
+		// the disk_io_class_t of the storage when the job was
+		// queued. It's set by add_job()
+		int io_class;
+
+		// for reads, the number of bytes following this block in
+		// the piece the requester expects to read next. On a cache
+		// miss, exactly that range is read into the cache. -1 means
+		// there's no hint, and read_cache_line_size blocks are read
+		int read_ahead;
+
 		boost::shared_ptr<entry> resume_data;
 
 		// the error code from the file operation
 		error_code error;
 
+		// the time when this job was queued
+		ptime start_time;
+
+		// set by read jobs that were served straight from a
+		// read cache block. buffer then points into the cache
+		// and has to be released with reclaim_buffer() rather
+		// than free_buffer()
+		bool cached_buffer;
+
+		// set on queued read jobs once the storage has been told
+		// to start reading their data in the background
+		bool read_hinted;
+
 		// this is called when operation completes
 		boost::function<void(int, disk_io_job const&)> callback;
 	};
@@ -135,6 +186,7 @@ namespace libtorrent
 			, cache_size(0)
 			, read_cache_size(0)
 			, total_used_buffers(0)
+			, ghost_hits(0)
 		{}
 
 		// the number of 16kB blocks written
@@ -161,6 +213,11 @@ namespace libtorrent
 		// the total number of blocks that are currently in use
 		// this includes send and receive buffers
 		mutable int total_used_buffers;
+
+		// the number of read cache misses on pieces that had
+		// recently been evicted from the read cache. These pieces
+		// are considered hot. Only used by the two_queue algorithm
+		size_type ghost_hits;
 	};
 	
 	struct disk_buffer_pool : boost::noncopyable
@@ -182,11 +239,19 @@ namespace libtorrent
 		char* allocate_buffers(int blocks, char const* category);
 		void free_buffers(char* buf, int blocks);
 
+		// adds a reference to a buffer owned by someone else,
+		// such as a read cache block that's sent to a peer
+		// without being copied. The owner and every reference
+		// drop their share with reclaim_buffer(), the last one
+		// to do so frees the buffer
+		void ref_buffer(char* buf);
+		void reclaim_buffer(char* buf);
+
 		int block_size() const { return m_block_size; }
 
 #ifdef TORRENT_STATS
 		int disk_allocations() const
-		{ return m_allocations; }
+		{ return m_in_use; }
 #endif
 
 		void release_memory();
@@ -199,13 +264,33 @@ namespace libtorrent
 		// protocol defines the block size to 16 KiB.
 		const int m_block_size;
 
-		// number of disk buffers currently allocated
-		int m_in_use;
+		// number of disk buffers currently allocated. This
+		// is updated without holding the pool mutex
+		boost::detail::atomic_count m_in_use;
 
 		session_settings m_settings;
 
 	private:
 
+		// single blocks are handed out from, and returned to, a
+		// small free-list private to the calling thread. It's
+		// refilled from, and drained into, the pool in batches, so
+		// most allocations and frees don't lock m_pool_mutex.
+		// Every thread that uses the pool, except for the one
+		// destructing it, has to exit before it's destructed
+		struct thread_cache
+		{
+			thread_cache(disk_buffer_pool* p): pool(p) {}
+			disk_buffer_pool* pool;
+			std::vector<char*> blocks;
+		};
+		enum { thread_cache_batch = 16, thread_cache_max = 64 };
+
+		thread_cache& local_cache();
+		void refill_thread_cache(thread_cache& c);
+		void drain_thread_cache(thread_cache& c, int num_blocks);
+		static void release_thread_cache(thread_cache* c);
+
 		// this only protects the pool allocator
 		typedef boost::mutex mutex_t;
 		mutable mutex_t m_pool_mutex;
@@ -215,9 +300,15 @@ namespace libtorrent
 		boost::pool<page_aligned_allocator> m_pool;
 #endif
 
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		int m_allocations;
-#endif
+		// this is destructed before m_pool, which lets the
+		// destructing thread return its blocks
+		boost::thread_specific_ptr<thread_cache> m_thread_cache;
+
+		// the number of references to buffers, not counting
+		// the owner's. Buffers without any are not in here.
+		// Protected by m_pool_mutex
+		std::map<char*, int> m_buffer_refs;
+
 #ifdef TORRENT_DISK_STATS
 	protected:
 		void rename_buffer(char* buf, char const* category);
@@ -231,11 +322,12 @@ namespace libtorrent
 #endif
 	};
 
-	// this is a singleton consisting of the thread and a queue
-	// of disk io jobs
+	// this is a singleton consisting of the disk threads and
+	// their queues of disk io jobs
 	struct disk_io_thread : disk_buffer_pool
 	{
-		disk_io_thread(io_service& ios, int block_size = 16 * 1024);
+		disk_io_thread(io_service& ios, int block_size = 16 * 1024
+			, int num_threads = 1);
 		~disk_io_thread();
 
 		void join();
@@ -253,12 +345,48 @@ namespace libtorrent
 		size_type queue_buffer_size() const
 		{ return m_queue_buffer_size; }
 
+		// the number of jobs waiting in all the queues, not
+		// counting the ones currently being executed
+		int queued_jobs() const;
+
+		// fills in the disk job histograms of s
+		void get_latency_stats(latency_stats& s) const;
+
+		// the buffer every job is recorded in while tracing is
+		// on. It has to be set before any jobs are added
+		void set_trace(trace_buffer* t) { m_trace = t; }
+
 		void get_cache_info(sha1_hash const& ih
 			, std::vector<cached_piece_info>& ret) const;
 
 		cache_status status() const;
 
-		void operator()();
+		// sets the maximum number of blocks the storage may have
+		// in the cache (-1 means no limit), and the number of
+		// read cache blocks it gets to keep when other torrents
+		// need room in the cache
+		void set_cache_limits(piece_manager* s, int limit, int reservation);
+
+		// the number of blocks the storage has in the cache
+		int cached_blocks(piece_manager const* s) const;
+
+		// puts the storage's future jobs in the disk_io_class_t c
+		void set_io_class(piece_manager* s, int c);
+
+		// adds the bytes each storage has queued to be written or
+		// in the write cache to ret
+		typedef std::map<piece_manager const*, size_type> dirty_bytes_t;
+		void dirty_bytes(dirty_bytes_t& ret) const;
+
+		// the number of disk threads (and job queues)
+		int num_threads() const;
+
+		// runs f on one of the hash threads. Returns false, without
+		// running it, if there are no hash threads
+		bool async_hash(boost::function<void()> const& f);
+
+		void thread_fun(int queue);
+		void hash_thread_fun();
 
 #ifdef TORRENT_DEBUG
 		void check_invariant() const;
@@ -268,6 +396,10 @@ namespace libtorrent
 		std::ofstream m_disk_access_log;
 #endif
 
+		// the entries in the cache are const, the members that
+		// aren't part of any index key are mutable, to be able to
+		// update them in place. last_use has to be updated through
+		// cache_t::modify()
 		struct cached_piece_entry
 		{
 			int piece;
@@ -276,16 +408,161 @@ namespace libtorrent
 			// the last time a block was writting to this piece
 			ptime last_use;
 			// the number of blocks in the cache for this piece
-			int num_blocks;
+			mutable int num_blocks;
 			// the pointers to the block data
 			boost::shared_array<char*> blocks;
+			// for write cache pieces, the hash of the blocks
+			// at the start of the piece, up to the first one
+			// that hasn't been received yet. It's taken from
+			// the storage when the piece enters the cache and
+			// handed back to it when the piece is evicted
+			boost::shared_ptr<partial_hash> hash;
+			// this is true while a disk thread is reading
+			// into or flushing this piece, or a hash thread is
+			// hashing it, with m_piece_mutex released. No other
+			// thread may evict or modify the piece until it's
+			// cleared
+			mutable bool busy;
+			// with the two_queue algorithm, read pieces are hot
+			// if they were requested again shortly after being
+			// evicted. Hot pieces are evicted after all others
+			bool hot;
+
+			std::pair<void*, int> storage_piece_pair() const
+			{ return std::pair<void*, int>(storage.get(), piece); }
+
+			std::pair<bool, ptime> eviction_order() const
+			{ return std::pair<bool, ptime>(hot, last_use); }
 		};
 
 		typedef boost::recursive_mutex mutex_t;
-		typedef std::list<cached_piece_entry> cache_t;
+
+		// the cache is indexed by (storage, piece) for lookups
+		// and ordered by eviction priority (cold pieces first,
+		// then by last use), to find the next piece to evict
+		// without scanning the whole cache
+		typedef boost::multi_index::multi_index_container<
+			cached_piece_entry, boost::multi_index::indexed_by<
+				boost::multi_index::hashed_unique<
+					boost::multi_index::const_mem_fun<cached_piece_entry
+					, std::pair<void*, int>, &cached_piece_entry::storage_piece_pair> >
+				, boost::multi_index::ordered_non_unique<
+					boost::multi_index::const_mem_fun<cached_piece_entry
+					, std::pair<bool, ptime>, &cached_piece_entry::eviction_order> >
+				>
+			> cache_t;
+
+		typedef cache_t::nth_index<1>::type cache_lru_index_t;
+
+		// (storage, piece) pairs, oldest first, that can be
+		// looked up by value
+		typedef boost::multi_index::multi_index_container<
+			std::pair<void*, int>, boost::multi_index::indexed_by<
+				boost::multi_index::sequenced<>
+				, boost::multi_index::hashed_unique<
+					boost::multi_index::identity<std::pair<void*, int> > >
+				>
+			> ghost_list_t;
 
 	private:
 
+		struct job_queue
+		{
+			job_queue(): abort(false), elevator_storage(0), elevator_pos(0), io_time(0)
+			{
+				std::fill(class_jobs, class_jobs + num_io_classes, 0);
+				std::fill(class_time, class_time + num_io_classes, 0);
+			}
+			std::list<disk_io_job> jobs;
+			// set once this queue's thread has processed
+			// the abort_thread job. The thread exits as soon
+			// as the queue is drained
+			bool abort;
+			// the position of the last read issued from this
+			// queue, used by the read elevator
+			piece_manager const* elevator_storage;
+			size_type elevator_pos;
+			// the number of queued jobs in each io class, and the
+			// virtual time each class has been given. The class
+			// that's furthest behind runs next, and every job it
+			// runs moves it ahead by io_class_stride
+			int class_jobs[num_io_classes];
+			boost::uint64_t class_time[num_io_classes];
+			boost::uint64_t io_time;
+		};
+
+		// how far a job moves its class ahead, the inverse of the
+		// class' share of the disk threads. Latency sensitive jobs
+		// get 8 times as many turns as bulk jobs when both are queued
+		static const int io_class_stride[num_io_classes];
+
+		// removes i from the queue q and returns the job after it
+		std::list<disk_io_job>::iterator erase_job(job_queue& q
+			, std::list<disk_io_job>::iterator i);
+
+		// the io class pick_job() takes the next job from
+		int pick_io_class(job_queue& q);
+
+		// a piece handed off from a disk thread to a hash thread.
+		// The first ph.offset bytes of the piece are already
+		// hashed, the rest of it is in blocks
+		struct hash_job
+		{
+			hash_job(): num_blocks(0), cached(false), hit(false) {}
+			disk_io_job job;
+			boost::function<void(int, disk_io_job const&)> callback;
+			partial_hash ph;
+			boost::shared_array<char*> blocks;
+			int num_blocks;
+			// true if the blocks belong to a piece in the read
+			// cache (which is kept busy until the hash thread is
+			// done with it). Otherwise the blocks are disk buffers
+			// owned by this job
+			bool cached;
+			// for read cache pieces, whether it was a cache hit
+			bool hit;
+			// if set, the hash thread just calls this instead
+			boost::function<void()> work;
+		};
+
+		// picks the next job to run from the queue. This is the
+		// front job, unless the read elevator is enabled
+		std::list<disk_io_job>::iterator pick_job(job_queue& q, ptime now);
+
+		// a read that's queued up, for the storage to start on
+		// ahead of time
+		struct read_hint
+		{
+			boost::intrusive_ptr<piece_manager> storage;
+			int piece;
+			int offset;
+			int size;
+		};
+		void collect_read_hints(job_queue& q, std::vector<read_hint>& hints);
+
+		// the number of blocks a read cache miss on j reads, starting
+		// with the block j is in
+		int read_cache_line(disk_io_job const& j) const;
+
+		// completes the reads queued up for exactly the same block as
+		// j with the data j read, instead of reading it again. ret is
+		// j's return value. Must be called before j's handler is posted
+		void complete_duplicate_reads(int queue, disk_io_job const& j, int ret);
+
+		// returns the index of the queue the job should go
+		// in. Jobs belonging to the same storage always end
+		// up in the same queue
+		int queue_for(disk_io_job const& j);
+		void add_threads(int num_threads);
+
+		// hash thread operations
+		int num_hash_threads() const;
+		void add_hash_threads(int num_threads);
+		void stop_hash_threads();
+		void add_hash_job(hash_job const& hj);
+		int read_unhashed(hash_job& hj);
+		void free_hash_blocks(hash_job& hj);
+
 		bool test_error(disk_io_job& j);
 		void post_callback(boost::function<void(int, disk_io_job const&)> const& handler
 			, disk_io_job const& j, int ret);
@@ -294,8 +571,14 @@ namespace libtorrent
 		cache_t::iterator find_cached_piece(
 			cache_t& cache, disk_io_job const& j
 			, mutex_t::scoped_lock& l);
+		cache_t::iterator oldest_idle_piece(cache_t& cache
+			, piece_manager const* s = 0, bool keep_reserved = false);
+		void enforce_cache_limit(piece_manager* s, cache_t::iterator ignore
+			, mutex_t::scoped_lock& l);
+		void wait_for_storage(piece_manager const* s
+			, mutex_t::scoped_lock& l);
 		int copy_from_piece(cache_t::iterator p, bool& hit
-			, disk_io_job const& j, mutex_t::scoped_lock& l);
+			, disk_io_job const& j, mutex_t::scoped_lock& l, char** ref = 0);
 
 		// write cache operations
 		enum options_t { dont_flush_write_blocks = 1, ignore_cache_size = 2 };
@@ -306,37 +589,74 @@ namespace libtorrent
 			, mutex_t::scoped_lock& l, int lower_limit = 0);
 		int flush_range(cache_t::iterator i, int start, int end, mutex_t::scoped_lock& l);
 		int cache_block(disk_io_job& j, mutex_t::scoped_lock& l);
+		void hash_contiguous_blocks(cached_piece_entry const& p);
+		void remove_write_piece(cache_t::iterator i);
 
 		// read cache operations
 		int clear_oldest_read_piece(int num_blocks, cache_t::iterator ignore
 			, mutex_t::scoped_lock& l);
-		int read_into_piece(cached_piece_entry& p, int start_block
+		int read_into_piece(cached_piece_entry const& p, int start_block
 			, int options, int num_blocks, mutex_t::scoped_lock& l);
 		int cache_read_block(disk_io_job const& j, mutex_t::scoped_lock& l);
 		int cache_read_piece(disk_io_job const& j, mutex_t::scoped_lock& l);
-		int free_piece(cached_piece_entry& p, mutex_t::scoped_lock& l);
-		int try_read_from_cache(disk_io_job const& j);
+		int free_piece(cached_piece_entry const& p, mutex_t::scoped_lock& l);
+		void evict_read_piece(cache_t::iterator i);
+		void admit_read_piece(cached_piece_entry& p);
+		int try_read_from_cache(disk_io_job const& j, char** ref = 0);
 		int read_piece_from_cache_and_hash(disk_io_job const& j, sha1_hash& h);
+		int cache_piece_for_hash(disk_io_job const& j, cache_t::iterator& p
+			, bool& hit, mutex_t::scoped_lock& l);
+		int copy_from_hashed_piece(cache_t::iterator p, bool hit
+			, disk_io_job const& j, mutex_t::scoped_lock& l);
 
-		// this mutex only protects m_jobs, m_queue_buffer_size
-		// and m_abort
+		// this mutex only protects m_queues, m_queue_buffer_size,
+		// m_next_queue, m_num_running, m_abort and the latency
+		// histograms
 		mutable mutex_t m_queue_mutex;
 		boost::condition m_signal;
 		bool m_abort;
 		bool m_waiting_to_shutdown;
-		std::list<disk_io_job> m_jobs;
+
+		// one queue per disk thread. Each storage is assigned
+		// to a queue the first time it posts a job, so a slow
+		// drive only stalls the torrents sharing its queue
+		// and jobs for one storage are still executed in order
+		std::vector<job_queue> m_queues;
 		size_type m_queue_buffer_size;
 
+		// the queue the next new storage will be assigned to
+		int m_next_queue;
+
+		// the number of disk threads that haven't exited yet.
+		// The last one to exit flushes the cache
+		int m_num_running;
+
+		// the time jobs took to run, by action, and the time
+		// they waited in the queue
+		latency_histogram m_job_time[disk_io_job::num_actions];
+		latency_histogram m_queue_time;
+		latency_histogram m_class_queue_time[num_io_classes];
+
+		// may be 0
+		trace_buffer* m_trace;
+
 		ptime m_last_file_check;
 
 		// this protects the piece cache and related members
 		mutable mutex_t m_piece_mutex;
+		// signalled every time a cached piece stops being busy
+		boost::condition m_piece_signal;
 		// write cache
 		cache_t m_pieces;
 		
 		// read cache
 		cache_t m_read_pieces;
 
+		// the pieces most recently evicted from the read cache
+		// without having been hot. A read cache miss on one of
+		// them makes it hot. Only used by the two_queue algorithm
+		ghost_list_t m_ghost_pieces;
+
 		// total number of blocks in use by both the read
 		// and the write cache. This is not supposed to
 		// exceed m_cache_size
@@ -360,8 +680,28 @@ namespace libtorrent
 		// exist anymore, and crash. This prevents that.
 		boost::optional<asio::io_service::work> m_work;
 
-		// thread for performing blocking disk io operations
-		boost::thread m_disk_io_thread;
+		// threads for performing blocking disk io operations.
+		// m_threads[i] drains m_queues[i]
+		std::vector<boost::shared_ptr<boost::thread> > m_threads;
+
+		// this protects m_hash_jobs, m_hash_abort and m_hash_threads.
+		// If m_queue_mutex is held as well, it has to be locked first
+		mutable mutex_t m_hash_mutex;
+		boost::condition m_hash_signal;
+		std::list<hash_job> m_hash_jobs;
+		// set when the hash threads should exit once their
+		// queue is drained
+		bool m_hash_abort;
+
+		// threads for computing piece hashes, to not stall disk
+		// io while hashing. When there are none, pieces are hashed
+		// in the disk threads
+		std::vector<boost::shared_ptr<boost::thread> > m_hash_threads;
+
+		// divides offsets and piece sizes by m_block_size. The cache
+		// relies on the block size being a power of two, so this is
+		// always done with shifts and masks
+		block_math m_block_math;
 	};
 
 }
@@ -142,6 +142,24 @@ namespace libtorrent
 		entry(entry const& e);
 		~entry();
 
+#if !defined BOOST_NO_RVALUE_REFERENCES && !defined BOOST_NO_CXX11_RVALUE_REFERENCES
+		entry(entry&& e): m_type(undefined_t)
+		{
+#ifdef TORRENT_DEBUG
+			m_type_queried = true;
+#endif
+			take(e);
+		}
+		void operator=(entry&& e)
+		{
+			if (&e == this) return;
+			entry tmp;
+			tmp.take(e);
+			destruct();
+			take(tmp);
+		}
+#endif
+
 		bool operator==(entry const& e) const;
 		
 		void operator=(entry const&);
@@ -159,6 +177,8 @@ namespace libtorrent
 		dictionary_type& dict();
 		const dictionary_type& dict() const;
 
+		// exchanges the contents of the entries without
+		// copying any strings, lists or dictionaries
 		void swap(entry& e);
 
 		// these functions requires that the entry
@@ -184,6 +204,10 @@ namespace libtorrent
 		void copy(const entry& e);
 		void destruct();
 
+		// moves the content of e to this entry, which must be
+		// undefined. e is left undefined
+		void take(entry& e);
+
 	private:
 
 		data_type m_type;
@@ -252,8 +276,11 @@ namespace libtorrent
 
 	inline void entry::operator=(const entry& e)
 	{
-		destruct();
-		copy(e);
+		// e may be part of this entry, so it's copied
+		// before this entry is destructed
+		if (&e == this) return;
+		entry tmp(e);
+		swap(tmp);
 	}
 
 	inline entry::integer_type& entry::integer()
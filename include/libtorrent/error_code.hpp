@@ -75,6 +75,9 @@ namespace libtorrent
 			invalid_entry_type,
 			missing_info_hash_in_uri,
 			file_too_short,
+			invalid_resume_journal,
+			piece_evicted,
+			invalid_range,
 		};
 	}
 
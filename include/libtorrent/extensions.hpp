@@ -40,12 +40,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
 
 #include <vector>
+#include <algorithm>
 #include "libtorrent/config.hpp"
 #include "libtorrent/buffer.hpp"
 
@@ -63,6 +65,28 @@ namespace libtorrent
 	struct TORRENT_EXPORT torrent_plugin
 	{
 		virtual ~torrent_plugin() {}
+
+		// the handlers the torrent dispatches to through its
+		// per-hook lists. See implemented_hooks()
+		enum hook_t
+		{
+			new_connection_hook,
+			piece_pass_hook,
+			piece_failed_hook,
+			tick_hook,
+			pause_hook,
+			resume_hook,
+			files_checked_hook,
+			num_hooks
+		};
+
+		// returns a bitmask with the bit (1 << hook) set for each
+		// of the hooks above this plugin overrides. The handlers
+		// of hooks that aren't in the mask are never called. It's
+		// called once, when the plugin is added to the torrent
+		virtual boost::uint32_t implemented_hooks() const
+		{ return ~boost::uint32_t(0); }
+
 		// throwing an exception closes the connection
 		// returning a 0 pointer is valid and will not add
 		// the peer_plugin to the peer_connection
@@ -90,6 +114,46 @@ namespace libtorrent
 	{
 		virtual ~peer_plugin() {}
 
+		// the handlers the peer connection dispatches to through
+		// its per-hook lists. The handshake handlers are called
+		// for every plugin and are not in this list.
+		// See implemented_hooks()
+		enum hook_t
+		{
+			choke_hook,
+			unchoke_hook,
+			interested_hook,
+			not_interested_hook,
+			have_hook,
+			bitfield_hook,
+			have_all_hook,
+			have_none_hook,
+			allowed_fast_hook,
+			request_hook,
+			piece_hook,
+			cancel_hook,
+			reject_hook,
+			suggest_hook,
+			extended_hook,
+			unknown_message_hook,
+			piece_pass_hook,
+			piece_failed_hook,
+			tick_hook,
+			disconnect_hook,
+			write_request_hook,
+			write_have_hook,
+			num_hooks
+		};
+
+		// returns a bitmask with the bit (1 << hook) set for each
+		// of the hooks above this plugin overrides. The handlers
+		// of hooks that aren't in the mask are never called. It's
+		// called when the plugin is added to the connection, and
+		// whenever the set of plugins changes
+		virtual boost::uint32_t implemented_hooks() const
+		{ return ~boost::uint32_t(0); }
+
+
 		// can add entries to the extension handshake
 		// this is not called for web seeds
 		virtual void add_handshake(entry&) {}
@@ -180,10 +244,67 @@ namespace libtorrent
 		// called aproximately once every second
 		virtual void tick() {}
 
+		// called when the connection is closed, while it's still
+		// attached to its torrent
+		virtual void on_disconnect() {}
+
 		// called each time a request message is to be sent. If true
 		// is returned, the original request message won't be sent and
 		// no other plugin will have this function called.
 		virtual bool write_request(peer_request const& r) { return false; }
+
+		// called each time a have message is to be sent. If true
+		// is returned, the original have message won't be sent and
+		// no other plugin will have this function called.
+		virtual bool write_have(int index) { return false; }
+	};
+
+	// the dispatch lists of a torrent or a peer connection. For
+	// every hook it holds the plugins implementing it, in the
+	// order they were added, so that an event is only dispatched
+	// to the plugins that care about it. The plugins are owned
+	// by the extension list the lists are built from.
+	template <class Plugin>
+	struct extension_hooks
+	{
+		extension_hooks()
+		{
+			std::fill(m_start, m_start + Plugin::num_hooks + 1, 0);
+		}
+
+		// rebuilds the lists from the plugins in the range
+		// [begin, end), which holds shared_ptrs to Plugin
+		template <class Iter>
+		void update(Iter begin, Iter end)
+		{
+			std::vector<boost::uint32_t> masks;
+			for (Iter i = begin; i != end; ++i)
+				masks.push_back((*i)->implemented_hooks());
+
+			m_list.clear();
+			for (int h = 0; h < Plugin::num_hooks; ++h)
+			{
+				m_start[h] = m_list.size();
+				int k = 0;
+				for (Iter i = begin; i != end; ++i, ++k)
+				{
+					if (masks[k] & (boost::uint32_t(1) << h))
+						m_list.push_back(i->get());
+				}
+			}
+			m_start[Plugin::num_hooks] = m_list.size();
+		}
+
+		// the plugins implementing hook h are at the
+		// indices [begin(h), end(h))
+		int begin(int h) const { return m_start[h]; }
+		int end(int h) const { return m_start[h + 1]; }
+		Plugin* operator[](int i) const { return m_list[i]; }
+
+	private:
+
+		std::vector<Plugin*> m_list;
+		boost::uint16_t m_start[Plugin::num_hooks + 1];
 	};
 
 }
@@ -124,6 +124,16 @@ namespace libtorrent
 		bool is_open() const;
 		void close();
 		bool set_size(size_type size, error_code& ec);
+		// allocates disk space for the given range, without changing
+		// the size of the file. Returns false, with ec set, if the
+		// file system doesn't support it. It's a no-op where there's
+		// no way to do this
+		bool allocate(size_type file_offset, size_type len, error_code& ec);
+		// frees the disk space the range takes, without changing
+		// the size of the file. The range reads back as zeros. Only
+		// sparse files can give space back, on other files and
+		// where it's not supported, it's a no-op
+		bool discard(size_type file_offset, size_type len, error_code& ec);
 
 		int open_mode() const { return m_open_mode; }
 
@@ -146,6 +156,25 @@ namespace libtorrent
 
 		size_type get_size(error_code& ec) const;
 
+		// maps size bytes of the file, starting at file_offset, into
+		// memory. file_offset has to be a multiple of 64 kiB. The
+		// mapping stays valid after the file is closed, until it's
+		// passed to unmap(). Returns 0 on error
+		char* map(size_type file_offset, int size, bool write, error_code& ec);
+		static void unmap(char* p, int size);
+
+		// lets the operating system know that the given range
+		// will be read soon, so it can start reading it in the
+		// background
+		void hint_read(size_type file_offset, int len);
+
+#if TORRENT_USE_SENDFILE
+		// sends up to size bytes, starting at file_offset, to
+		// the socket sock without copying them to user space.
+		// Returns the number of bytes sent, or -1 on error
+		int sendfile(int sock, size_type file_offset, int size, error_code& ec);
+#endif
+
 		// return the offset of the first byte that
 		// belongs to a data-region
 		size_type sparse_end(size_type start) const;
@@ -40,47 +40,115 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/filesystem/path.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <map>
+#include <string>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
 
 #include "libtorrent/file.hpp"
-#include "libtorrent/time.hpp"
+#include "libtorrent/size_type.hpp"
 
 namespace libtorrent
 {
 	namespace fs = boost::filesystem;
 
+	// the open files, identified by the storage they belong to and
+	// their index in it. The files are spread over several shards,
+	// each with its own mutex, so disk threads opening files of
+	// different storages rarely wait for each other
 	struct TORRENT_EXPORT file_pool : boost::noncopyable
 	{
-		file_pool(int size = 40): m_size(size) {}
+		file_pool(int size = 40);
 
 		boost::shared_ptr<file> open_file(void* st, fs::path const& p
-			, int m, error_code& ec);
+			, int file_index, int m, error_code& ec);
+		// closes all files of the storage st
 		void release(void* st);
-		void release(fs::path const& p);
+		// closes the file with index file_index of the storage st
+		void release(void* st, int file_index);
 		void resize(int size);
+		int size_limit() const { return m_size; }
 
-	private:
+		// the number of files currently open
+		int num_open() const { return m_num_open; }
+		// the number of opens served by an already open file, the
+		// number of files that had to be opened and the number of
+		// files closed to stay within the limit
+		void get_stats(size_type& hits, size_type& misses
+			, size_type& evictions) const;
 
-		void remove_oldest();
+	private:
 
-		int m_size;
+		typedef std::pair<void*, int> file_key;
 
 		struct lru_file_entry
 		{
-			lru_file_entry(): last_use(time_now()) {}
+			file_key key;
 			mutable boost::shared_ptr<file> file_ptr;
-			void* key;
-			ptime last_use;
+			// the path is only used to detect storages
+			// sharing a file, see m_open_paths
+			std::string path;
+			mutable int mode;
+		};
+
+		// files are looked up by key, the sequenced index is
+		// the LRU list, with the least recently used file first
+		typedef boost::multi_index::multi_index_container<
+			lru_file_entry, boost::multi_index::indexed_by<
+				boost::multi_index::hashed_unique<
+					boost::multi_index::member<lru_file_entry
+					, file_key, &lru_file_entry::key> >
+				, boost::multi_index::sequenced<>
+			>
+		> file_set;
+		typedef file_set::nth_index<1>::type lru_list;
+
+		struct shard
+		{
+			shard(): hits(0), misses(0), evictions(0) {}
+			mutable boost::mutex mutex;
+			file_set files;
+			size_type hits;
+			size_type misses;
+			size_type evictions;
+		};
+
+		enum { num_shards = 16 };
+
+		shard& shard_for(file_key const& k);
+		bool remove_oldest(shard& s, bool keep_newest);
+		void close_file(shard& s, file_set::iterator i);
+		void make_room(shard& s);
+
+		bool register_path(void* st, int file_index
+			, std::string const& p, int mode, error_code& ec);
+		void unregister_path(void* st, int file_index, std::string const& p);
+
+		int m_size;
+		boost::detail::atomic_count m_num_open;
+
+		shard m_shards[num_shards];
+
+		struct path_owner
+		{
+			void* st;
+			int file_index;
 			int mode;
 		};
 
-		typedef std::map<std::string, lru_file_entry> file_set;
-		
-		file_set m_files;
-		boost::mutex m_mutex;
+		// the storages that have each path open. It's only touched
+		// when files are opened and closed, to fail with
+		// file_collision when two storages would write to the same
+		// file. Locked after a shard mutex, never before
+		std::multimap<std::string, path_owner> m_open_paths;
+		boost::mutex m_path_mutex;
 	};
 }
 
@@ -108,6 +108,44 @@ namespace libtorrent
 		std::vector<file_slice> map_block(int piece, size_type offset
 			, int size) const;
 		peer_request map_file(int file, size_type offset, int size) const;
+
+		// walks the same file slices map_block() returns, one at a
+		// time and without allocating. The first file is found by
+		// binary search. Use it like this:
+		//
+		//   for (file_storage::slice_iterator i(fs, piece, offset, size);
+		//     !i.done(); ++i) { i->file_index ... }
+		class TORRENT_EXPORT slice_iterator
+		{
+		public:
+			slice_iterator(file_storage const& fs, int piece
+				, size_type offset, int size);
+
+			bool done() const { return m_left == 0; }
+			file_slice const& operator*() const
+			{ TORRENT_ASSERT(!done()); return m_slice; }
+			file_slice const* operator->() const
+			{ TORRENT_ASSERT(!done()); return &m_slice; }
+			slice_iterator& operator++();
+
+		private:
+			// fills in m_slice from the file at m_index, skipping
+			// past files that end at or before m_file_offset
+			void fill();
+
+			file_storage const* m_files;
+			file_slice m_slice;
+			int m_index;
+			// the offset into the file at m_index, not counting file_base
+			size_type m_file_offset;
+			// the number of bytes left, including m_slice
+			size_type m_left;
+		};
+
+		// returns the index of the last file starting at or
+		// before offset. Zero sized files are never returned
+		// unless they're at the very end
+		int file_index_at_offset(size_type offset) const;
 		
 		typedef std::vector<file_entry>::const_iterator iterator;
 		typedef std::vector<file_entry>::const_reverse_iterator reverse_iterator;
@@ -141,6 +179,7 @@ namespace libtorrent
 			using std::swap;
 			swap(ti.m_piece_length, m_piece_length);
 			swap(ti.m_files, m_files);
+			swap(ti.m_file_offsets, m_file_offsets);
 			swap(ti.m_total_size, m_total_size);
 			swap(ti.m_num_pieces, m_num_pieces);
 			swap(ti.m_name, m_name);
@@ -152,11 +191,17 @@ namespace libtorrent
 		void optimize(int pad_file_limit = -1);
 
 	private:
+
 		int m_piece_length;
 
 		// the list of files that this torrent consists of
 		std::vector<file_entry> m_files;
 
+		// the offset of each file in m_files, kept in a
+		// separate flat array since every disk read and write
+		// maps its block to files by binary searching this
+		std::vector<size_type> m_file_offsets;
+
 		// the sum of all filesizes
 		size_type m_total_size;
 
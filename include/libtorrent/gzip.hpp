@@ -36,6 +36,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/config.hpp"
 #include <string>
 #include <vector>
+#include <boost/noncopyable.hpp>
+
+struct z_stream_s;
 
 namespace libtorrent
 {
@@ -46,6 +49,30 @@ namespace libtorrent
 		, int maximum_size
 		, std::string& error);
 
+	// inflates a gzip stream incrementally, as it's received. The
+	// input can be passed in pieces of any size, only the zlib
+	// state is kept between them
+	struct TORRENT_EXPORT gzip_inflater : boost::noncopyable
+	{
+		gzip_inflater();
+		~gzip_inflater();
+
+		// inflates the next 'size' bytes of the stream and
+		// appends the output to 'out'. Returns true on error, like
+		// inflate_gzip(). 'out' may not grow past maximum_size
+		bool decode(char const* in, int size
+			, std::vector<char>& out
+			, int maximum_size
+			, std::string& error);
+
+		// true once the end of the stream has been inflated
+		bool finished() const { return m_finished; }
+
+	private:
+		z_stream_s* m_stream;
+		bool m_finished;
+	};
+
 }
 
 #endif
@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <vector>
 #include <list>
 #include <string>
@@ -48,6 +49,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/socket_type.hpp"
 #include "libtorrent/session_settings.hpp"
+#include "libtorrent/gzip.hpp"
+#include "libtorrent/allocating_handler.hpp"
 
 #ifdef TORRENT_USE_OPENSSL
 #include "libtorrent/ssl_stream.hpp"
@@ -59,6 +62,7 @@ namespace libtorrent
 
 struct http_connection;
 class connection_queue;
+class resolver;
 	
 typedef boost::function<void(error_code const&
 	, http_parser const&, char const* data, int size, http_connection&)> http_handler;
@@ -74,7 +78,8 @@ struct http_connection : boost::enable_shared_from_this<http_connection>, boost:
 	http_connection(io_service& ios, connection_queue& cc
 		, http_handler const& handler, bool bottled = true
 		, http_connect_handler const& ch = http_connect_handler()
-		, http_filter_handler const& fh = http_filter_handler())
+		, http_filter_handler const& fh = http_filter_handler()
+		, resolver* dns_cache = 0)
 		: m_sock(ios)
 		, m_read_pos(0)
 		, m_resolver(ios)
@@ -95,6 +100,15 @@ struct http_connection : boost::enable_shared_from_this<http_connection>, boost:
 		, m_ssl(false)
 		, m_priority(0)
 		, m_abort(false)
+		, m_keep_alive(false)
+		, m_reused(false)
+		, m_dns_cache(dns_cache)
+		, m_decoding(false)
+		, m_body_finished(false)
+		, m_chunked(false)
+		, m_chunk_state(chunk_header)
+		, m_chunk_left(0)
+		, m_body_left(-1)
 	{
 		TORRENT_ASSERT(!m_handler.empty());
 	}
@@ -106,9 +120,12 @@ struct http_connection : boost::enable_shared_from_this<http_connection>, boost:
 
 	std::string sendbuffer;
 
+	// if keep_alive is true, the server is asked to keep the
+	// connection open after the response. See keep_alive()
 	void get(std::string const& url, time_duration timeout = seconds(30)
 		, int prio = 0, proxy_settings const* ps = 0, int handle_redirects = 5
-		, std::string const& user_agent = "", address const& bind_addr = address_v4::any());
+		, std::string const& user_agent = "", address const& bind_addr = address_v4::any()
+		, bool keep_alive = false);
 
 	void start(std::string const& hostname, std::string const& port
 		, time_duration timeout, int prio = 0, proxy_settings const* ps = 0
@@ -117,6 +134,22 @@ struct http_connection : boost::enable_shared_from_this<http_connection>, boost:
 
 	void close();
 
+	// returns true if the last response was complete and
+	// the server agreed to keep the connection open. It can
+	// then be reused by calling get() again, to the same host
+	bool keep_alive() const { return m_keep_alive && m_sock.is_open(); }
+
+	// replaces the handlers, used when an idle keep-alive
+	// connection is handed to a new owner
+	void set_handlers(http_handler const& h
+		, http_connect_handler const& ch = http_connect_handler()
+		, http_filter_handler const& fh = http_filter_handler())
+	{
+		m_handler = h;
+		m_connect_handler = ch;
+		m_filter_handler = fh;
+	}
+
 #ifdef TORRENT_USE_OPENSSL
 	variant_stream<socket_type, ssl_stream<socket_type> > const& socket() const { return m_sock; }
 #else
@@ -129,6 +162,9 @@ private:
 
 	void on_resolve(error_code const& e
 		, tcp::resolver::iterator i);
+	void on_cached_resolve(error_code const& e
+		, std::vector<address> const& addresses);
+	void on_endpoints();
 	void queue_connect();
 	void connect(int ticket, tcp::endpoint target_address);
 	void on_connect_timeout();
@@ -140,6 +176,12 @@ private:
 	void on_assign_bandwidth(error_code const& e);
 
 	void callback(error_code const& e, char const* data = 0, int size = 0);
+	bool reconnect();
+
+	void start_decoding();
+	bool decode_body(char const* buf, int size);
+	bool on_payload(char const* buf, int size);
+	void on_body_finished();
 
 	std::vector<char> m_recvbuffer;
 #ifdef TORRENT_USE_OPENSSL
@@ -148,6 +190,8 @@ private:
 	socket_type m_sock;
 #endif
 	int m_read_pos;
+	// the memory for the outstanding read operation
+	handler_storage<TORRENT_READ_HANDLER_MAX_SIZE> m_read_handler_storage;
 	tcp::resolver m_resolver;
 	http_parser m_parser;
 	http_handler m_handler;
@@ -207,6 +251,50 @@ private:
 	int m_priority;
 
 	bool m_abort;
+
+	// true if we asked for the connection to be kept open. Once
+	// the response is in, it's only left set if the server agreed
+	bool m_keep_alive;
+
+	// true if the current request was sent on a connection kept
+	// open from an earlier request. If the server closed it in
+	// the meantime, we reconnect and send the request again
+	bool m_reused;
+
+	// if set, host names are looked up through this cache
+	// instead of m_resolver
+	resolver* m_dns_cache;
+
+	// true when the body is chunked or gzipped. It's then decoded
+	// as it's received, instead of being buffered and passed through
+	// m_parser, and the receive buffer only holds the latest read
+	bool m_decoding;
+
+	// set once the whole decoded body has been received
+	bool m_body_finished;
+
+	// true if the transfer-encoding is chunked
+	bool m_chunked;
+
+	// where in the chunked encoding the next byte is
+	enum { chunk_header, chunk_data, chunk_end, chunk_trailer } m_chunk_state;
+
+	// the number of bytes left of the current chunk
+	size_type m_chunk_left;
+
+	// the part of a chunk header, or of the line following a chunk,
+	// received so far
+	std::string m_chunk_line;
+
+	// the number of bytes left of the body, when it's not chunked.
+	// -1 if the length is not known
+	size_type m_body_left;
+
+	// inflates the body if it's gzipped
+	boost::scoped_ptr<gzip_inflater> m_inflater;
+
+	// the decoded body, when bottled
+	std::vector<char> m_body;
 };
 
 }
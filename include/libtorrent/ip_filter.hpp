@@ -34,6 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_IP_FILTER_HPP
 
 #include <set>
+#include <vector>
+#include <queue>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -155,6 +158,7 @@ namespace detail
 			using boost::next;
 			using boost::prior;
 
+			if (!m_compiled.empty()) decompile();
 			TORRENT_ASSERT(!m_access_list.empty());
 			TORRENT_ASSERT(first < last || first == last);
 			
@@ -208,8 +212,88 @@ namespace detail
 			TORRENT_ASSERT(!m_access_list.empty());
 		}
 
+		// adds all the rules at once, with the same result as
+		// calling add_rule() for each of them in order. It sorts
+		// the rules instead of inserting them one at a time into
+		// the tree, and leaves the filter compiled
+		void add_rules(std::vector<ip_range<Addr> > const& rules)
+		{
+			// the existing ranges go first, so the new rules
+			// override them
+			std::vector<ip_range<Addr> > all;
+			export_ranges(all, true);
+			all.insert(all.end(), rules.begin(), rules.end());
+
+			std::vector<event> events;
+			events.reserve(all.size() * 2);
+			for (int i = 0; i < int(all.size()); ++i)
+			{
+				TORRENT_ASSERT(all[i].first <= all[i].last);
+				event e = { all[i].first, i };
+				events.push_back(e);
+				if (all[i].last == max_addr<Addr>()) continue;
+				event end = { plus_one(all[i].last), ~i };
+				events.push_back(end);
+			}
+			std::sort(events.begin(), events.end());
+
+			// the rule that applies to an address is the last one
+			// added of the ones covering it, i.e. the one with the
+			// highest index. Rules that ended are popped lazily
+			std::priority_queue<int> active;
+			std::vector<bool> alive(all.size(), false);
+			std::vector<range> out;
+			out.push_back(range(zero<Addr>(), 0));
+			for (int i = 0; i < int(events.size());)
+			{
+				Addr const a = events[i].addr;
+				for (; i < int(events.size()) && events[i].addr == a; ++i)
+				{
+					int r = events[i].rule;
+					if (r >= 0)
+					{
+						alive[r] = true;
+						active.push(r);
+					}
+					else alive[~r] = false;
+				}
+				while (!active.empty() && !alive[active.top()]) active.pop();
+				int flags = active.empty() ? 0 : all[active.top()].flags;
+				if (flags == out.back().access) continue;
+				if (a == zero<Addr>()) out.back().access = flags;
+				else out.push_back(range(a, flags));
+			}
+			m_compiled.swap(out);
+			m_access_list.clear();
+		}
+
+		// turns the filter into a sorted array, which is smaller
+		// and faster to look up in. The next add_rule() turns it
+		// back into a tree
+		void compile()
+		{
+			if (!m_compiled.empty()) return;
+			m_compiled.assign(m_access_list.begin(), m_access_list.end());
+			m_access_list.clear();
+		}
+
+		bool compiled() const { return !m_compiled.empty(); }
+
+		void swap(filter_impl& f)
+		{
+			m_access_list.swap(f.m_access_list);
+			m_compiled.swap(f.m_compiled);
+		}
+
 		int access(Addr const& addr) const
 		{
+			if (!m_compiled.empty())
+			{
+				typename std::vector<range>::const_iterator i = std::upper_bound(
+					m_compiled.begin(), m_compiled.end(), addr, addr_less());
+				TORRENT_ASSERT(i != m_compiled.begin());
+				return (i - 1)->access;
+			}
 			TORRENT_ASSERT(!m_access_list.empty());
 			typename range_t::const_iterator i = m_access_list.upper_bound(addr);
 			if (i != m_access_list.begin()) --i;
@@ -222,28 +306,116 @@ namespace detail
 		template <class ExternalAddressType>
 		std::vector<ip_range<ExternalAddressType> > export_filter() const
 		{
-			std::vector<ip_range<ExternalAddressType> > ret;
-			ret.reserve(m_access_list.size());
+			std::vector<ip_range<Addr> > ranges;
+			export_ranges(ranges, false);
+			return convert_ranges<ExternalAddressType>(ranges);
+		}
 
-			for (typename range_t::const_iterator i = m_access_list.begin()
-				, end(m_access_list.end()); i != end;)
+		// returns the ranges where this filter sets flags that
+		// aren't set in old, merged where they're adjacent. When
+		// going from old to this filter, only addresses in these
+		// ranges can become blocked
+		template <class ExternalAddressType>
+		std::vector<ip_range<ExternalAddressType> > diff(filter_impl const& old) const
+		{
+			std::vector<ip_range<Addr> > n;
+			std::vector<ip_range<Addr> > o;
+			export_ranges(n, false);
+			old.export_ranges(o, false);
+
+			// both lists cover the entire address space, so
+			// step through them together one overlap at a time
+			std::vector<ip_range<Addr> > ret;
+			typename std::vector<ip_range<Addr> >::const_iterator i = n.begin();
+			typename std::vector<ip_range<Addr> >::const_iterator j = o.begin();
+			while (i != n.end() && j != o.end())
+			{
+				Addr first = i->first < j->first ? j->first : i->first;
+				Addr last = i->last < j->last ? i->last : j->last;
+				if (i->flags & ~j->flags)
+				{
+					if (!ret.empty() && ret.back().flags == i->flags
+						&& plus_one(ret.back().last) == first)
+					{
+						ret.back().last = last;
+					}
+					else
+					{
+						ip_range<Addr> r = { first, last, i->flags };
+						ret.push_back(r);
+					}
+				}
+				if (i->last == last) ++i;
+				if (j->last == last) ++j;
+			}
+			return convert_ranges<ExternalAddressType>(ret);
+		}
+
+	private:
+
+		template <class ExternalAddressType>
+		static std::vector<ip_range<ExternalAddressType> > convert_ranges(
+			std::vector<ip_range<Addr> > const& ranges)
+		{
+			std::vector<ip_range<ExternalAddressType> > ret;
+			ret.reserve(ranges.size());
+			for (typename std::vector<ip_range<Addr> >::const_iterator i
+				= ranges.begin(), end(ranges.end()); i != end; ++i)
 			{
 				ip_range<ExternalAddressType> r;
-				r.first = ExternalAddressType(i->start);
+				r.first = ExternalAddressType(i->first);
+				r.last = ExternalAddressType(i->last);
+				r.flags = i->flags;
+				ret.push_back(r);
+			}
+			return ret;
+		}
+
+		template <class Iter>
+		static void export_ranges(Iter i, Iter end
+			, std::vector<ip_range<Addr> >& ret, bool skip_unflagged)
+		{
+			while (i != end)
+			{
+				ip_range<Addr> r;
+				r.first = i->start;
 				r.flags = i->access;
 
 				++i;
 				if (i == end)
-					r.last = ExternalAddressType(max_addr<Addr>());
+					r.last = max_addr<Addr>();
 				else
-					r.last = ExternalAddressType(minus_one(i->start));
-			
+					r.last = minus_one(i->start);
+
+				if (skip_unflagged && r.flags == 0) continue;
 				ret.push_back(r);
 			}
-			return ret;
 		}
 
-	private:
+		void export_ranges(std::vector<ip_range<Addr> >& ret
+			, bool skip_unflagged) const
+		{
+			if (!m_compiled.empty())
+			{
+				ret.reserve(ret.size() + m_compiled.size());
+				export_ranges(m_compiled.begin(), m_compiled.end(), ret, skip_unflagged);
+			}
+			else
+			{
+				ret.reserve(ret.size() + m_access_list.size());
+				export_ranges(m_access_list.begin(), m_access_list.end(), ret, skip_unflagged);
+			}
+		}
+
+		void decompile()
+		{
+			TORRENT_ASSERT(m_access_list.empty());
+			// the array is sorted, so every insert is at the end
+			for (typename std::vector<range>::const_iterator i = m_compiled.begin()
+				, end(m_compiled.end()); i != end; ++i)
+				m_access_list.insert(m_access_list.end(), *i);
+			std::vector<range>().swap(m_compiled);
+		}
 	
 		struct range
 		{
@@ -258,9 +430,27 @@ namespace detail
 			int access;
 		};
 
+		// a rule starts at its first address and ends at the
+		// one after its last. rule is the index of the rule
+		// for a start, and ~index for an end
+		struct event
+		{
+			Addr addr;
+			int rule;
+			bool operator<(event const& e) const { return addr < e.addr; }
+		};
+
+		struct addr_less
+		{
+			bool operator()(Addr const& a, range const& r) const
+			{ return a < r.start; }
+		};
+
+		// exactly one of these holds the ranges. The set while
+		// rules are being added, the sorted array once compiled
 		typedef std::set<range> range_t;
 		range_t m_access_list;
-	
+		std::vector<range> m_compiled;
 	};
 
 }
@@ -279,11 +469,31 @@ public:
 	void add_rule(address first, address last, int flags);
 	int access(address const& addr) const;
 
+	// adds a large number of rules at once, like calling add_rule()
+	// for each of them in order but without building the tree one
+	// rule at a time. This is the way to load a big blocklist
+	void add_rules(std::vector<ip_range<address_v4> > const& rules);
+#if TORRENT_USE_IPV6
+	void add_rules(std::vector<ip_range<address_v6> > const& rules);
+#endif
+
+	// turns the rules into sorted arrays, which use less memory
+	// and are faster to look up in. session::set_ip_filter()
+	// compiles the filter it's given
+	void compile();
+
+	void swap(ip_filter& f);
+
 	typedef boost::tuple<std::vector<ip_range<address_v4> >
 		, std::vector<ip_range<address_v6> > > filter_tuple_t;
 	
 	filter_tuple_t export_filter() const;
 
+	// the ranges where this filter has flags set that ``old``
+	// doesn't have. Peers outside of them aren't affected by
+	// replacing ``old`` with this filter
+	filter_tuple_t diff(ip_filter const& old) const;
+
 //	void print() const;
 	
 private:
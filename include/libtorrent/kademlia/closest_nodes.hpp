@@ -90,6 +90,7 @@ public:
 	}
 
 	void timeout();
+	void short_timeout();
 	void reply(msg const&);
 	void abort() { m_algorithm = 0; }
 
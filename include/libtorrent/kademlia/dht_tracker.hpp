@@ -89,11 +89,14 @@ namespace libtorrent { namespace dht
 
 		entry state() const;
 
-		void announce(sha1_hash const& ih, int listen_port
-			, boost::function<void(std::vector<tcp::endpoint> const&)> f);
+		void announce(sha1_hash const& ih, int listen_port, bool seed
+			, boost::function<void(std::vector<tcp::endpoint> const&)> f
+			, boost::function<void(int, int)> scrape_f
+			= boost::function<void(int, int)>());
 
 		void dht_status(session_status& s);
 		void network_stats(int& sent, int& received);
+		void round_trip_times(latency_histogram& h) const;
 
 		// translate bittorrent kademlia message into the generic kademlia message
 		// used by the library
@@ -153,7 +156,10 @@ namespace libtorrent { namespace dht
 			int count;
 		};
 
-		enum { num_ban_nodes = 20 };
+		// the source addresses are hashed into this table.
+		// each address maps to a pair of slots, on a miss the
+		// one with the fewest messages is replaced
+		enum { num_ban_nodes = 2048 };
 
 		node_ban_entry m_ban_nodes[num_ban_nodes];
 
@@ -42,6 +42,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libtorrent/kademlia/rpc_manager.hpp>
 #include <libtorrent/kademlia/observer.hpp>
 #include <libtorrent/kademlia/msg.hpp>
+#include <libtorrent/bloom_filter.hpp>
 
 #include <boost/optional.hpp>
 #include <boost/function.hpp>
@@ -61,17 +62,24 @@ class find_data : public traversal_algorithm
 public:
 	typedef boost::function<void(std::vector<tcp::endpoint> const&)> data_callback;
 	typedef boost::function<void(std::vector<std::pair<node_entry, std::string> > const&)> nodes_callback;
+	typedef boost::function<void(int, int)> scrape_callback;
 
 	void got_data(msg const* m);
+	// merges the BEP 33 bloom filters of a reply
+	void got_scrape(msg const& m);
 	void got_write_token(node_id const& n, std::string const& write_token)
 	{ m_write_tokens[n] = write_token; }
 
 	find_data(node_impl& node, node_id target
 		, data_callback const& dcallback
-		, nodes_callback const& ncallback);
+		, nodes_callback const& ncallback
+		, scrape_callback const& scallback = scrape_callback()
+		, bool noseed = false);
 
 	virtual char const* name() const { return "get_peers"; }
 	node_id const target() const { return m_target; }
+	bool scrape() const { return !m_scrape_callback.empty(); }
+	bool noseed() const { return m_noseed; }
 
 private:
 
@@ -80,9 +88,18 @@ private:
 
 	data_callback m_data_callback;
 	nodes_callback m_nodes_callback;
+	scrape_callback m_scrape_callback;
 	std::map<node_id, std::string> m_write_tokens;
+	// the union of the filters received from the nodes
+	// that replied with a scrape
+	bloom_filter<256> m_seeds;
+	bloom_filter<256> m_downloaders;
 	node_id const m_target;
 	bool m_done;
+	// true if any node replied with bloom filters
+	bool m_got_scrape;
+	// we're a seed, don't ask for other seeds
+	bool m_noseed;
 };
 
 class find_data_observer : public observer
@@ -102,9 +119,12 @@ public:
 		m.reply = false;
 		m.message_id = messages::get_peers;
 		m.info_hash = m_algorithm->target();
+		m.scrape = m_algorithm->scrape();
+		m.noseed = m_algorithm->noseed();
 	}
 
 	void timeout();
+	void short_timeout();
 	void reply(msg const&);
 	void abort() { m_algorithm = 0; }
 
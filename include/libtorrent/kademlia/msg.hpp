@@ -58,6 +58,10 @@ struct msg
 		: reply(false)
 		, message_id(-1)
 		, port(0)
+		, seed(false)
+		, scrape(false)
+		, noseed(false)
+		, read_only(false)
 	{}
 
 	// true if this message is a reply
@@ -89,6 +93,22 @@ struct msg
 	
 	// port for announce_peer messages
 	int port;
+
+	// BEP 33. Set in announce_peer when the peer is a seed
+	bool seed;
+	// set in get_peers to ask for the bloom filters of the
+	// seeds and downloaders of the torrent
+	bool scrape;
+	// set in get_peers to not be sent any seeds
+	bool noseed;
+	// BEP 43. Set in queries from nodes that don't answer
+	// queries themselves, and shouldn't be put in the
+	// routing table
+	bool read_only;
+	// the bloom filters in get_peers replies, empty if
+	// they weren't asked for or the node doesn't support it
+	std::string bloom_seeds;
+	std::string bloom_downloaders;
 	
 	// ERROR MESSAGES
 	int error_code;
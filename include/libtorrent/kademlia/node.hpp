@@ -78,12 +78,16 @@ struct peer_entry
 {
 	tcp::endpoint addr;
 	ptime added;
+	// set if the peer announced itself as a seed
+	bool seed;
 };
 
-// this is a group. It contains a set of group members
+// this is a group. It contains the group members
+// sorted by endpoint, in a flat array to keep the
+// overhead per peer low
 struct torrent_entry
 {
-	std::set<peer_entry> peers;
+	std::vector<peer_entry> peers;
 };
 
 inline bool operator<(peer_entry const& lhs, peer_entry const& rhs)
@@ -101,11 +105,13 @@ public:
 	announce_observer(boost::pool<>& allocator
 		, sha1_hash const& info_hash
 		, int listen_port
-		, std::string const& write_token)
+		, std::string const& write_token
+		, bool seed)
 		: observer(allocator)
 		, m_info_hash(info_hash)
 		, m_listen_port(listen_port)
 		, m_token(write_token)
+		, m_seed(seed)
 	{}
 
 	void send(msg& m)
@@ -113,6 +119,7 @@ public:
 		m.port = m_listen_port;
 		m.info_hash = m_info_hash;
 		m.write_token = m_token;
+		m.seed = m_seed;
 	}
 
 	void timeout() {}
@@ -123,6 +130,30 @@ private:
 	sha1_hash m_info_hash;
 	int m_listen_port;
 	std::string m_token;
+	bool m_seed;
+};
+
+// verifies a node restored from a previous session. A reply
+// confirms the node in the routing table (the rpc_manager
+// takes care of that), a timeout removes it
+class verify_observer : public observer
+{
+public:
+	verify_observer(boost::pool<>& allocator, routing_table& table
+		, node_id const& id)
+		: observer(allocator)
+		, m_table(table)
+		, m_id(id)
+	{}
+
+	void send(msg&) {}
+	void timeout() { m_table.node_failed(m_id); }
+	void reply(msg const&) {}
+	void abort() {}
+
+private:
+	routing_table& m_table;
+	node_id m_id;
 };
 
 class node_impl : boost::noncopyable
@@ -170,8 +201,14 @@ public:
 	{ m_table.print_state(os); }
 #endif
 
-	void announce(sha1_hash const& info_hash, int listen_port
-		, boost::function<void(std::vector<tcp::endpoint> const&)> f);
+	// seed is sent along with the announce, and seeds aren't sent
+	// back to seeds. If scrape_f is set, it's called with the
+	// estimated number of seeds and downloaders in the swarm,
+	// merged from the bloom filters of the nodes that reply
+	void announce(sha1_hash const& info_hash, int listen_port, bool seed
+		, boost::function<void(std::vector<tcp::endpoint> const&)> f
+		, boost::function<void(int, int)> scrape_f
+		= boost::function<void(int, int)>());
 
 	bool verify_token(msg const& m);
 	std::string generate_token(msg const& m);
@@ -189,6 +226,11 @@ public:
 	// bucket is not full.
 	void add_node(udp::endpoint node);
 
+	// adds a node saved from a previous session to the
+	// routing table right away, so lookups can use it,
+	// and pings it. If it doesn't respond, it's removed
+	void restore_node(node_id const& id, udp::endpoint const& ep, int rtt);
+
 	void replacement_cache(bucket_t& nodes) const
 	{ m_table.replacement_cache(nodes); }
 
@@ -212,7 +254,9 @@ protected:
 	// is called when a find data request is received. Should
 	// return false if the data is not stored on this node. If
 	// the data is stored, it should be serialized into 'data'.
-	bool on_find(msg const& m, std::vector<tcp::endpoint>& peers) const;
+	// If the request asks for a scrape, the bloom filters of the
+	// seeds and downloaders are added to the reply
+	bool on_find(msg const& m, msg& reply) const;
 
 	// this is called when a store request is received. The data
 	// is store-parameters and the data to be stored.
@@ -242,7 +286,21 @@ public:
 	rpc_manager m_rpc;
 
 private:
+	// makes room for one more peer by removing the
+	// oldest peer of the torrent with the most peers
+	void evict_peer();
+
+	// removes the torrent with the fewest peers
+	void evict_torrent();
+
 	table_t m_map;
+
+	// the total number of peers in m_map
+	int m_num_peers;
+
+	// expired peers are purged a few torrents at a time.
+	// this is the info-hash to continue from
+	node_id m_purge_cursor;
 	
 	ptime m_last_tracker_tick;
 
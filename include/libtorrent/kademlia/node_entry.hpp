@@ -45,6 +45,7 @@ struct node_entry
 		: addr(ep.address())
 		, port(ep.port())
 		, timeout_count(pinged ? 0 : 0xffff)
+		, rtt(0xffff)
 		, id(id_)
 	{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -55,6 +56,7 @@ struct node_entry
 		: addr(ep.address())
 		, port(ep.port())
 		, timeout_count(0xffff)
+		, rtt(0xffff)
 		, id(0)
 	{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -64,6 +66,7 @@ struct node_entry
 
 	node_entry()
 		: timeout_count(0xffff)
+		, rtt(0xffff)
 		, id(0)
 	{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -78,12 +81,21 @@ struct node_entry
 	void reset_fail_count() { if (pinged()) timeout_count = 0; }
 	udp::endpoint ep() const { return udp::endpoint(addr, port); }
 	bool confirmed() const { return timeout_count == 0; }
+	void update_rtt(int new_rtt)
+	{
+		if (new_rtt < 0 || new_rtt >= 0xffff) return;
+		if (rtt == 0xffff) rtt = new_rtt;
+		else rtt = (int(rtt) * 2 + new_rtt) / 3;
+	}
 
 	address addr;
 	boost::uint16_t port;
 	// the number of times this node has failed to
 	// respond in a row
 	boost::uint16_t timeout_count;
+	// the smoothed round trip time to this node in
+	// milliseconds, 0xffff if unknown
+	boost::uint16_t rtt;
 	node_id id;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 	ptime first_seen;
@@ -55,6 +55,7 @@ struct observer : boost::noncopyable
 
 	observer(boost::pool<>& p)
 		: sent(time_now())
+		, short_timed_out(false)
 		, pool_allocator(p)
 		, m_refs(0)
 	{
@@ -78,6 +79,11 @@ struct observer : boost::noncopyable
 	// this is called when no reply has been received within
 	// some timeout
 	virtual void timeout() = 0;
+
+	// this is called when no reply has been received within
+	// a few round trip times. The request may still get a
+	// reply or time out later
+	virtual void short_timeout() {}
 	
 	// if this is called the destructor should
 	// not invoke any new messages, and should
@@ -93,6 +99,8 @@ struct observer : boost::noncopyable
 	boost::uint16_t port;
 	udp::endpoint target_ep() const { return udp::endpoint(target_addr, port); }
 	ptime sent;
+	// set once short_timeout() has been called
+	bool short_timed_out;
 #ifdef TORRENT_DEBUG
 	bool m_in_constructor;
 #endif
@@ -99,6 +99,7 @@ public:
 	}
 
 	void timeout();
+	void short_timeout();
 	void reply(msg const& m);
 	void abort() { m_algorithm = 0; }
 
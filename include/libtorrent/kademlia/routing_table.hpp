@@ -66,11 +66,21 @@ TORRENT_DECLARE_LOG(table);
 	
 typedef std::vector<node_entry> bucket_t;
 
+struct routing_table_node
+{
+	bucket_t replacements;
+	bucket_t live_nodes;
+	ptime last_active;
+};
+
 // differences in the implementation from the description in
 // the paper:
 //
-// * The routing table tree is not allocated dynamically, there
-// 	are always 160 buckets.
+// * The routing table tree is a vector of buckets where bucket
+// 	i covers the nodes whose id shares exactly i bits of prefix
+// 	with ours. The last bucket covers all nodes closer than that.
+// 	When the last bucket is full, it's split in two. This keeps
+// 	more nodes close to our own id in the table.
 // * Nodes are not marked as being stale, they keep a counter
 // 	that tells how many times in a row they have failed. When
 // 	a new node is to be inserted, the node that has failed
@@ -100,7 +110,7 @@ namespace aux
 		friend class libtorrent::dht::routing_table;
 		friend class boost::iterator_core_access;
 
-		typedef boost::array<std::pair<bucket_t, bucket_t>, 160>::const_iterator
+		typedef std::vector<routing_table_node>::const_iterator
 			bucket_iterator_t;
 
 		routing_table_iterator(
@@ -110,12 +120,12 @@ namespace aux
 			, m_bucket_end(end)
 		{
 			if (m_bucket_iterator == m_bucket_end) return;
-			m_iterator = begin->first.begin();
-			while (m_iterator == m_bucket_iterator->first.end())
+			m_iterator = begin->live_nodes.begin();
+			while (m_iterator == m_bucket_iterator->live_nodes.end())
 			{
 				if (++m_bucket_iterator == m_bucket_end)
 					break;
-				m_iterator = m_bucket_iterator->first.begin();
+				m_iterator = m_bucket_iterator->live_nodes.begin();
 			}
 		}
 
@@ -130,11 +140,11 @@ namespace aux
 		{
 			TORRENT_ASSERT(m_bucket_iterator != m_bucket_end);
 			++*m_iterator;
-			while (*m_iterator == m_bucket_iterator->first.end())
+			while (*m_iterator == m_bucket_iterator->live_nodes.end())
 			{
 				if (++m_bucket_iterator == m_bucket_end)
 					break;
-				m_iterator = m_bucket_iterator->first.begin();
+				m_iterator = m_bucket_iterator->live_nodes.begin();
 			}
 		}
 
@@ -180,17 +190,20 @@ public:
 	// this function is called every time the node sees
 	// a sign of a node being alive. This node will either
 	// be inserted in the k-buckets or be moved to the top
-	// of its bucket.
-	bool node_seen(node_id const& id, udp::endpoint addr);
+	// of its bucket. rtt is the round trip time of the
+	// message, if it was a reply
+	bool node_seen(node_id const& id, udp::endpoint addr, int rtt = 0xffff);
 	
 	// returns time when the given bucket needs another refresh.
-	// if the given bucket is empty but there are nodes
-	// in a bucket closer to us, or if the bucket is non-empty and
-	// the time from the last activity is more than 15 minutes
+	// that is 15 minutes after the last activity in it.
+	// buckets are indexed by the number of bits of prefix
+	// they share with our id, [0, num_active_buckets())
 	ptime next_refresh(int bucket);
 
 	enum
 	{
+		// our own node is never in the buckets, this
+		// includes it if we've seen a message from ourself
 		include_self = 1,
 		include_failed = 2
 	};
@@ -201,8 +214,10 @@ public:
 	
 	// this may add a node to the routing table and mark it as
 	// not pinged. If the bucket the node falls into is full,
-	// the node will be ignored.
-	void heard_about(node_id const& id, udp::endpoint const& ep);
+	// the node will be ignored. rtt is the round trip time
+	// to the node, if it's known from an earlier session
+	void heard_about(node_id const& id, udp::endpoint const& ep
+		, int rtt = 0xffff);
 	
 	// this will set the given bucket's latest activity
 	// to the current time
@@ -210,8 +225,8 @@ public:
 	
 	int bucket_size(int bucket)
 	{
-		TORRENT_ASSERT(bucket >= 0 && bucket < 160);
-		return (int)m_buckets[bucket].first.size();
+		TORRENT_ASSERT(bucket >= 0 && bucket < int(m_buckets.size()));
+		return (int)m_buckets[bucket].live_nodes.size();
 	}
 	int bucket_size() const { return m_bucket_size; }
 
@@ -225,7 +240,7 @@ public:
 	// in the routing table
 	bool need_bootstrap() const;
 	int num_active_buckets() const
-	{ return 160 - m_lowest_active_bucket + 1; }
+	{ return int(m_buckets.size()); }
 	
 	void replacement_cache(bucket_t& nodes) const;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -236,27 +251,37 @@ public:
 
 private:
 
+	typedef std::vector<routing_table_node> table_t;
+
+	// returns the index of the bucket the given node id
+	// belongs in
+	int find_bucket(node_id const& id) const;
+
+	// moves the nodes that are closer to us than the last
+	// bucket covers into a new last bucket
+	void split_bucket();
+
 	// constant called k in paper
 	int m_bucket_size;
 	
 	dht_settings const& m_settings;
 
-	// 160 (k-bucket, replacement cache) pairs
-	typedef boost::array<std::pair<bucket_t, bucket_t>, 160> table_t;
+	// (k-bucket, replacement cache) pairs. Bucket i holds
+	// the nodes sharing i bits of prefix with our id, the
+	// last one holds every node closer than that. It
+	// grows as the last bucket is split, up to 160 buckets
 	table_t m_buckets;
-	// timestamps of the last activity in each bucket
-	typedef boost::array<ptime, 160> table_activity_t;
-	table_activity_t m_bucket_activity;
+
 	node_id m_id; // our own node id
+
+	// set if node_seen() has been called with our own id
+	boost::optional<node_entry> m_self;
 	
 	// this is a set of all the endpoints that have
 	// been identified as router nodes. They will
 	// be used in searches, but they will never
 	// be added to the routing table.
 	std::set<udp::endpoint> m_router_nodes;
-	
-	// this is the lowest bucket index with nodes in it
-	int m_lowest_active_bucket;
 };
 
 } } // namespace libtorrent::dht
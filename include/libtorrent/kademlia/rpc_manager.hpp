@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 #include <map>
+#include <deque>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
@@ -50,6 +51,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libtorrent/kademlia/observer.hpp>
 
 #include "libtorrent/time.hpp"
+#include "libtorrent/session_stats.hpp"
+
+namespace libtorrent
+{
+	struct dht_settings;
+}
 
 namespace libtorrent { namespace dht
 {
@@ -78,7 +85,8 @@ public:
 	typedef boost::function1<void, msg const&> send_fun;
 
 	rpc_manager(fun const& incoming_fun, node_id const& our_id
-		, routing_table& table, send_fun const& sf);
+		, routing_table& table, send_fun const& sf
+		, dht_settings const& settings);
 	~rpc_manager();
 
 	void unreachable(udp::endpoint const& ep);
@@ -100,12 +108,23 @@ public:
 	boost::pool<>& allocator() const
 	{ return m_pool_allocator; }
 
+	latency_histogram const& round_trip_times() const
+	{ return m_rtt; }
+
 private:
 
 	enum { max_transactions = 2048 };
 
 	unsigned int new_transaction_id(observer_ptr o);
 	void update_oldest_transaction_id();
+
+	// returns true if another request can be sent
+	// without exceeding the limit of outstanding requests
+	bool can_send() const;
+	// sends queued requests while there's room for them
+	void send_deferred();
+	void send_rpc(int message_id, udp::endpoint target
+		, observer_ptr o);
 	
 	boost::uint32_t calc_connection_id(udp::endpoint addr);
 
@@ -115,6 +134,20 @@ private:
 		transactions_t;
 	transactions_t m_transactions;
 	std::vector<observer_ptr> m_aborted_transactions;
+
+	// requests that were invoked while the maximum number
+	// of requests were outstanding. They are sent, in order,
+	// as the outstanding ones get replies or time out
+	struct deferred_rpc
+	{
+		int message_id;
+		udp::endpoint target;
+		observer_ptr o;
+	};
+	std::deque<deferred_rpc> m_deferred;
+
+	// the number of non-empty slots in m_transactions
+	int m_outstanding;
 	
 	// this is the next transaction id to be used
 	int m_next_transaction_id;
@@ -130,7 +163,16 @@ private:
 	routing_table& m_table;
 	ptime m_timer;
 	node_id m_random_number;
+	dht_settings const& m_settings;
 	bool m_destructing;
+
+	// the smoothed round trip time of replies, in
+	// milliseconds. Requests outstanding for a few times
+	// this are reported as short timeouts
+	int m_avg_rtt;
+
+	// the round trip times of all replies
+	latency_histogram m_rtt;
 };
 
 } } // namespace libtorrent::dht
@@ -62,6 +62,11 @@ public:
 	void traverse(node_id const& id, udp::endpoint addr);
 	void finished(node_id const& id);
 	void failed(node_id const& id, bool prevent_request = false);
+	// called when a request has been outstanding for longer
+	// than the nodes usually take to respond. The request is
+	// still waiting for a reply, but it no longer holds up
+	// the lookup
+	void short_timeout(node_id const& id);
 	virtual ~traversal_algorithm();
 	boost::pool<>& allocator() const;
 	void status(dht_lookup& l);
@@ -80,6 +85,12 @@ protected:
 	void add_router_entries();
 	void init();
 
+	// calls done() once, either when there are no more
+	// outstanding requests or once the closest nodes
+	// have all responded
+	void finish();
+	bool closest_nodes_responded();
+
 	virtual void done() = 0;
 	virtual void invoke(node_id const& id, udp::endpoint addr) = 0;
 
@@ -90,7 +101,7 @@ protected:
 
 		node_id id;
 		udp::endpoint addr;
-		enum { queried = 1, initial = 2, no_id = 4 };
+		enum { queried = 1, initial = 2, no_id = 4, short_timeout = 8, alive = 16 };
 		unsigned char flags;
 	};
 
@@ -117,6 +128,7 @@ protected:
 	int m_branch_factor;
 	int m_responses;
 	int m_timeouts;
+	bool m_done;
 };
 
 template<class InIt>
@@ -132,6 +144,7 @@ traversal_algorithm::traversal_algorithm(
 	, m_branch_factor(3)
 	, m_responses(0)
 	, m_timeouts(0)
+	, m_done(false)
 {
 	using boost::bind;
 
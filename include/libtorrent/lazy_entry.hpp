@@ -48,10 +48,47 @@ namespace libtorrent
 {
 	struct lazy_entry;
 
+	// a bump allocator that lazy_bdecode() can build the dictionaries
+	// and lists of a decoded tree in, instead of allocating each of them
+	// separately on the heap. The memory is only released by reset() or
+	// when the arena is destructed, so every tree decoded into it must
+	// be gone (or at least not used anymore) by then. The first block is
+	// kept across reset(), so an arena reused for decoding one message
+	// after another stops allocating once it's big enough
+	class TORRENT_EXPORT lazy_entry_arena
+	{
+	public:
+		lazy_entry_arena(int block_size = 16 * 1024);
+		~lazy_entry_arena();
+
+		// returns 0 if out of memory
+		void* allocate(int bytes);
+		void reset();
+
+	private:
+		// not copyable
+		lazy_entry_arena(lazy_entry_arena const&);
+		lazy_entry_arena& operator=(lazy_entry_arena const&);
+
+		std::vector<char*> m_blocks;
+		int m_block_size;
+		// the free range in the last block
+		char* m_ptr;
+		char* m_end;
+	};
+
 	TORRENT_EXPORT char const* parse_int(char const* start, char const* end
 		, char delimiter, boost::int64_t& val);
 	// return 0 = success
 	TORRENT_EXPORT int lazy_bdecode(char const* start, char const* end, lazy_entry& ret, int depth_limit = 1000);
+	// decodes into the arena, see lazy_entry_arena
+	TORRENT_EXPORT int lazy_bdecode(char const* start, char const* end, lazy_entry& ret
+		, lazy_entry_arena& arena, int depth_limit = 1000);
+	// checks that the buffer starts with a well formed bencoded item
+	// without building the tree. Integers must be made up of digits
+	// and dictionary keys must be strings. return 0 = valid
+	TORRENT_EXPORT int lazy_bdecode_validate(char const* start, char const* end
+		, int depth_limit = 1000);
 
 	struct TORRENT_EXPORT lazy_entry
 	{
@@ -60,7 +97,7 @@ namespace libtorrent
 			none_t, dict_t, list_t, string_t, int_t
 		};
 
-		lazy_entry() : m_type(none_t), m_begin(0), m_end(0)
+		lazy_entry() : m_type(none_t), m_in_arena(false), m_begin(0), m_end(0)
 		{ m_data.start = 0; }
 
 		entry_type_t type() const { return m_type; }
@@ -121,7 +158,8 @@ namespace libtorrent
 			m_begin = begin;
 		}
 
-		lazy_entry* dict_append(char const* name);
+		// if arena is set, the items are allocated in it
+		lazy_entry* dict_append(char const* name, lazy_entry_arena* arena = 0);
 		lazy_entry* dict_find(char const* name);
 		lazy_entry const* dict_find(char const* name) const
 		{ return const_cast<lazy_entry*>(this)->dict_find(name); }
@@ -158,7 +196,7 @@ namespace libtorrent
 			m_begin = begin;
 		}
 
-		lazy_entry* list_append();
+		lazy_entry* list_append(lazy_entry_arena* arena = 0);
 		lazy_entry* list_at(int i)
 		{
 			TORRENT_ASSERT(m_type == list_t);
@@ -193,6 +231,7 @@ namespace libtorrent
 			m_size = 0;
 			m_capacity = 0;
 			m_type = none_t;
+			m_in_arena = false;
 		}
 
 		~lazy_entry()
@@ -206,6 +245,7 @@ namespace libtorrent
 		{
 			using std::swap;
 			swap(m_type, e.m_type);
+			swap(m_in_arena, e.m_in_arena);
 			swap(m_data.start, e.m_data.start);
 			swap(m_size, e.m_size);
 			swap(m_capacity, e.m_capacity);
@@ -216,6 +256,10 @@ namespace libtorrent
 	private:
 
 		entry_type_t m_type;
+		// true if the items of this list or dictionary are
+		// allocated in a lazy_entry_arena. They're not freed
+		// by clear() then, and neither is anything below them
+		bool m_in_arena;
 		union data_t
 		{
 			std::pair<char const*, lazy_entry>* dict;
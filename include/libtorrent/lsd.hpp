@@ -62,12 +62,14 @@ public:
 
 //	void rebind(address const& listen_interface);
 
+	// queues ih to be announced. The queued info-hashes are
+	// sent together, several per message
 	void announce(sha1_hash const& ih, int listen_port);
 	void close();
 
 private:
 
-	void resend_announce(error_code const& e, std::string msg);
+	void on_announce_timer(error_code const& e);
 	void on_announce(udp::endpoint const& from, char* buffer
 		, std::size_t bytes_transferred);
 //	void setup_receive();
@@ -77,6 +79,20 @@ private:
 	// current retry count
 	int m_retry_count;
 
+	// the info-hashes waiting to be announced and the
+	// port to announce them with
+	std::vector<sha1_hash> m_pending;
+	int m_listen_port;
+
+	// the last message that was sent. It's sent again a few
+	// times once there's nothing more to announce, in case
+	// it was lost
+	std::string m_last_msg;
+
+	// true while m_broadcast_timer is waiting to send the
+	// next message
+	bool m_timer_armed;
+
 	// the udp socket used to send and receive
 	// multicast messages on
 	broadcast_socket m_socket;
@@ -39,6 +39,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <openssl/engine.h>
 #include <openssl/rc4.h>
 
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/scoped_ptr.hpp>
+
 #include "libtorrent/peer_id.hpp" // For sha1_hash
 #include "libtorrent/assert.hpp"
 
@@ -76,6 +82,47 @@ namespace libtorrent
 		sha1_hash m_xor_mask;
 	};
 	
+	// generating a DH key pair is a modular exponentiation, which is
+	// too expensive to do on the network thread for every encrypted
+	// handshake when many connections come in at once. This keeps a
+	// number of key pairs generated ahead of time, and refills them
+	// from its own thread. That thread is the only one generating
+	// keys, since OpenSSL's random number generator isn't safe to use
+	// from several threads without locking callbacks
+	class dh_key_pool
+	{
+	public:
+		dh_key_pool(int size = 20);
+		~dh_key_pool();
+
+		// the caller owns the returned object. If the pool is empty,
+		// this blocks until the next key pair is generated. Returns
+		// 0 if the pool is stopped or out of memory
+		dh_key_exchange* get();
+
+		// stops and joins the refill thread
+		void stop();
+
+	private:
+		// not copyable
+		dh_key_pool(dh_key_pool const&);
+		dh_key_pool& operator=(dh_key_pool const&);
+
+		void thread_fun();
+
+		boost::mutex m_mutex;
+		// signalled when a key is taken, or one is generated
+		boost::condition m_signal;
+		std::vector<dh_key_exchange*> m_keys;
+		int m_size;
+		// set when generating a key failed
+		bool m_failed;
+		bool m_abort;
+		// started by the first call to get(), so sessions that
+		// never make encrypted connections don't generate any keys
+		boost::scoped_ptr<boost::thread> m_thread;
+	};
+
 	class RC4_handler // Non copyable
 	{
 	public:
@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <ctime>
 #include <algorithm>
 #include <vector>
+#include <deque>
 #include <string>
 
 #include "libtorrent/debug.hpp"
@@ -67,6 +68,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/peer_request.hpp"
 #include "libtorrent/piece_block_progress.hpp"
 #include "libtorrent/config.hpp"
+#include "libtorrent/allocating_handler.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/bandwidth_limit.hpp"
 #include "libtorrent/policy.hpp"
@@ -76,6 +78,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/chained_buffer.hpp"
 #include "libtorrent/disk_buffer_holder.hpp"
 #include "libtorrent/bitfield.hpp"
+#include "libtorrent/extensions.hpp"
 
 #ifdef TORRENT_STATS
 #include "libtorrent/aux_/session_impl.hpp"
@@ -94,7 +97,8 @@ namespace libtorrent
 	struct pending_block
 	{
 		pending_block(piece_block const& b)
-			: skipped(0), not_wanted(false), timed_out(false), block(b) {}
+			: skipped(0), not_wanted(false), timed_out(false), block(b)
+			, send_time(min_time()), bytes_ahead(0) {}
 
 		// the number of times the request
 		// has been skipped by out of order blocks
@@ -111,6 +115,12 @@ namespace libtorrent
 
 		piece_block block;
 
+		// when the request was sent and the number of
+		// bytes requested before it that hadn't arrived
+		// yet. Used to estimate the round trip time
+		ptime send_time;
+		int bytes_ahead;
+
 		bool operator==(pending_block const& b)
 		{
 			return b.skipped == skipped && b.block == block
@@ -177,8 +187,16 @@ namespace libtorrent
 
 		void send_allowed_set();
 
+		// sends SUGGEST_PIECE for piece, unless the peer has it or
+		// it has been suggested to this peer before
+		void send_suggest(int piece);
+
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		void add_extension(boost::shared_ptr<peer_plugin>);
+
+		// rebuilds the per-hook dispatch lists. This must be
+		// called whenever m_extensions is modified
+		void update_extension_hooks();
 #endif
 
 		// this function is called once the torrent associated
@@ -280,7 +298,19 @@ namespace libtorrent
 
 		void update_interest();
 
-		virtual void get_peer_info(peer_info& p) const;
+		// flags are torrent_handle::peer_info_flags_t
+		virtual void get_peer_info(peer_info& p
+			, boost::uint32_t flags = 0xffffffff) const;
+
+		// the number of bytes of memory this connection
+		// uses, including its buffers and queues
+		virtual int memory_usage() const;
+
+		// frees the memory held by the queues once neither
+		// side is interested in the other
+		void release_idle_memory();
+
+		void update_rtt(pending_block const& b, int length, ptime now);
 
 		// returns the torrent this connection is a part of
 		// may be zero if the connection is an incoming connection
@@ -352,6 +382,11 @@ namespace libtorrent
 		bool is_local() const { return m_active; }
 
 		bool on_local_network() const;
+		// true for peers on the local network and peers in one
+		// of the preferred ASes. These are the peers
+		// ignore_limits_on_local_network applies to
+		bool in_local_rate_class() const;
+		bool in_cheap_as() const;
 		bool ignore_bandwidth_limits() const
 		{ return m_ignore_bandwidth_limits; }
 		void ignore_bandwidth_limits(bool i)
@@ -371,6 +406,11 @@ namespace libtorrent
 		bool unchoke_compare(boost::intrusive_ptr<peer_connection const> const& p) const;
 		bool upload_rate_compare(peer_connection const* p) const;
 
+		// the unchoke order for peers of seeding torrents, with
+		// the rate_based seed_choking_algorithm
+		bool seed_unchoke_compare(peer_connection const& rhs
+			, torrent const& t1, torrent const& t2) const;
+
 		// resets the byte counters that are used to measure
 		// the number of bytes transferred within unchoke cycles
 		void reset_choke_counters();
@@ -417,6 +457,9 @@ namespace libtorrent
 		// to the send buffer
 		void send_choke();
 		bool send_unchoke();
+		// rejects the queued requests for a piece we don't
+		// have anymore
+		void reject_piece(int index);
 		void send_interested();
 		void send_not_interested();
 
@@ -471,16 +514,32 @@ namespace libtorrent
 		virtual buffer::interval allocate_send_buffer(int size);
 		virtual void setup_send();
 
-		template <class Destructor>
-		void append_send_buffer(char* buffer, int size, Destructor const& destructor)
+		// starts receiving, unless can_read() says not to. It's called
+		// whenever something that can_read() looks at changes
+		void setup_receive();
+
+		// destructor is called with userdata when the buffer has been sent
+		void append_send_buffer(char* buffer, int size
+			, chained_buffer::free_buffer_fun destructor, void* userdata)
 		{
-			m_send_buffer.append_buffer(buffer, size, size, destructor);
+			m_send_buffer.append_buffer(buffer, size, size, destructor, userdata);
 #ifdef TORRENT_STATS
 			m_ses.m_buffer_usage_logger << log_time() << " append_send_buffer: " << size << std::endl;
 			m_ses.log_buffer_usage();
 #endif
 		}
 
+		// see chained_buffer::for_each_tail()
+		template <class Fun>
+		void for_each_send_buffer_tail(int bytes, Fun f)
+		{ m_send_buffer.for_each_tail(bytes, f); }
+
+		// queues size bytes at offset in f to be sent after what's
+		// in the send buffer so far, straight from the file to the
+		// socket with sendfile()
+		void append_send_file(boost::shared_ptr<file> const& f
+			, size_type offset, int size);
+
 #ifndef TORRENT_DISABLE_RESOLVE_COUNTRIES	
 		void set_country(char const* c)
 		{
@@ -491,12 +550,16 @@ namespace libtorrent
 		bool has_country() const { return m_country[0] != 0; }
 #endif
 
+		// this includes the file ranges queued by append_send_file()
 		int send_buffer_size() const
-		{ return m_send_buffer.size(); }
+		{ return m_send_buffer.size() + m_file_send_bytes; }
 
 		int send_buffer_capacity() const
 		{ return m_send_buffer.capacity(); }
 
+		int receive_buffer_capacity() const
+		{ return m_recv_buffer.capacity() + m_disk_recv_buffer_size; }
+
 		int packet_size() const { return m_packet_size; }
 
 		bool packet_finished() const
@@ -529,9 +592,18 @@ namespace libtorrent
 		virtual void write_have(int index) = 0;
 		virtual void write_keepalive() = 0;
 		virtual void write_piece(peer_request const& r, disk_buffer_holder& buffer) = 0;
+		// sends the piece message for r with the payload taken
+		// straight from its file. Returns false if the payload
+		// has to be read from disk and passed to write_piece()
+		virtual bool write_piece_from_file(peer_request const& r) { return false; }
+
+		// the number of bytes following r in its piece this peer is
+		// expected to request next. See disk_io_job::read_ahead
+		int read_ahead_hint(peer_request const& r);
 		
 		virtual void write_reject_request(peer_request const& r) = 0;
 		virtual void write_allow_fast(int piece) = 0;
+		virtual void write_suggest(int piece) = 0;
 
 		virtual void on_connected() = 0;
 		virtual void on_tick() {}
@@ -562,13 +634,17 @@ namespace libtorrent
 		}
 
 		bool allocate_disk_receive_buffer(int disk_buffer_size);
+		bool move_to_disk_receive_buffer();
 		char* release_disk_receive_buffer();
 		bool has_disk_receive_buffer() const { return m_disk_recv_buffer; }
 		void cut_receive_buffer(int size, int packet_size);
 		void reset_recv_buffer(int packet_size);
 		void set_soft_packet_size(int size) { m_soft_packet_size = size; }
 
-		void setup_receive();
+		// the number of bytes at the start of the next message
+		// that are received into m_read_ahead_header when the
+		// end of a block is received. 0 turns reading ahead off
+		virtual int read_ahead_size() const { return 0; }
 
 		void attach_to_torrent(sha1_hash const& ih);
 
@@ -594,8 +670,24 @@ namespace libtorrent
 		// work to do.
 		void on_send_data(error_code const& error
 			, std::size_t bytes_transferred);
+		void on_sendfile_ready(error_code const& error
+			, std::size_t bytes_transferred);
+		void pop_send_buffer(int bytes);
 		void on_receive_data(error_code const& error
 			, std::size_t bytes_transferred);
+		void on_receive_ready(error_code const& error);
+		void on_send_ready(error_code const& error);
+		int unsent_kernel_bytes() const;
+		void setup_receive_buffers(int max_receive
+			, boost::array<asio::mutable_buffer, 4>& vec);
+		void consume_read_ahead(int bytes);
+		void on_uncork();
+
+		// when the send buffer holds less than this many bytes,
+		// the write is held back until the current handler
+		// returns, to send all the small messages it writes
+		// at once
+		enum { send_coalesce_limit = 1024 };
 
 		// this is the limit on the number of outstanding requests
 		// we have to this peer. This is initialized to the settings
@@ -610,6 +702,10 @@ namespace libtorrent
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		typedef std::list<boost::shared_ptr<peer_plugin> > extension_list_t;
 		extension_list_t m_extensions;
+
+		// the plugins in m_extensions, grouped by the
+		// hooks they implement
+		extension_hooks<peer_plugin> m_hooks;
 #endif
 
 #ifndef TORRENT_DISABLE_RESOLVE_COUNTRIES	
@@ -720,8 +816,28 @@ namespace libtorrent
 		// the receive buffer into the disk buffer
 		disk_buffer_holder m_disk_recv_buffer;
 
+		// when the end of a block is received, the header
+		// of the next message and the start of the next
+		// block are received in the same read, into
+		// m_read_ahead_header and this buffer. When the
+		// next message turns out to be the next block, this
+		// buffer is swapped with its disk buffer
+		disk_buffer_holder m_read_ahead_buffer;
+
 		chained_buffer m_send_buffer;
 
+		// payloads that are sent straight from their files.
+		// position is the number of bytes in m_send_buffer
+		// that go out before the range does
+		struct file_send
+		{
+			boost::shared_ptr<file> f;
+			size_type offset;
+			int size;
+			int position;
+		};
+		std::deque<file_send> m_file_sends;
+
 		boost::shared_ptr<socket_type> m_socket;
 		// this is the peer we're actually talking to
 		// it may not necessarily be the peer we're
@@ -765,6 +881,10 @@ namespace libtorrent
 		// downloaded from this peer
 		std::vector<int> m_suggested_pieces;
 
+		// the pieces we have suggested to this peer. It's
+		// empty until the first suggestion is sent
+		bitfield m_sent_suggested_pieces;
+
 		// a list of byte offsets inside the send buffer
 		// the piece requests
 		std::vector<int> m_requests_in_buffer;
@@ -810,10 +930,18 @@ namespace libtorrent
 
 		int m_disk_recv_buffer_size;
 
+		// the number of bytes of m_read_ahead_header
+		// the current read receives into
+		int m_read_ahead_header_size;
+		char m_read_ahead_header[16];
+
 		// the number of bytes we are currently reading
 		// from disk, that will be added to the send
 		// buffer as soon as they complete
 		int m_reading_bytes;
+
+		// the sum of the sizes of m_file_sends
+		int m_file_send_bytes;
 		
 		// the number of invalid piece-requests
 		// we have got from this peer. If the request
@@ -824,6 +952,12 @@ namespace libtorrent
 		// by sending choke, unchoke.
 		int m_num_invalid_requests;
 
+		// the piece and the end offset of the last block
+		// read from disk for this peer. Used to tell whether
+		// it requests blocks in order
+		int m_last_read_piece;
+		int m_last_read_end;
+
 		// this is the priority with which this peer gets
 		// download bandwidth quota assigned to it.
 		int m_priority;
@@ -896,6 +1030,10 @@ namespace libtorrent
 		// requesting too many pieces while being choked
 		boost::uint8_t m_choke_rejects;
 
+		// the number of disk reads in a row for this peer that
+		// started where the previous one ended
+		boost::uint8_t m_sequential_reads;
+
 		// if this is true, the disconnection
 		// timestamp is not updated when the connection
 		// is closed. This means the time until we can
@@ -984,73 +1122,26 @@ namespace libtorrent
 		// if this is set to true, the client will not
 		// pick any pieces from this peer
 		bool m_no_download:1;
-		
-		template <std::size_t Size>
-		struct handler_storage
-		{
-#ifdef TORRENT_DEBUG
-			handler_storage()
-			  : used(false)
-			{}
 
-			bool used;
-#endif
-			boost::aligned_storage<Size> bytes;
-		};
-
-		handler_storage<TORRENT_READ_HANDLER_MAX_SIZE> m_read_handler_storage;
-		handler_storage<TORRENT_WRITE_HANDLER_MAX_SIZE> m_write_handler_storage;
+		// idle connections give their receive buffer back to the
+		// session and only wait for the socket to become readable.
+		// This is set when it has, so that the next read is made
+		// into a buffer again
+		bool m_readable:1;
 
-		template <class Handler, std::size_t Size>
-		struct allocating_handler
-		{
-			allocating_handler(
-				Handler const& handler, handler_storage<Size>& storage
-			)
-			  : handler(handler)
-			  , storage(storage)
-			{}
-
-			template <class A0>
-			void operator()(A0 const& a0) const
-			{
-				handler(a0);
-			}
-
-			template <class A0, class A1>
-			void operator()(A0 const& a0, A1 const& a1) const
-			{
-				handler(a0, a1);
-			}
-
-			template <class A0, class A1, class A2>
-			void operator()(A0 const& a0, A1 const& a1, A2 const& a2) const
-			{
-				handler(a0, a1, a2);
-			}
-
-			friend void* asio_handler_allocate(
-			    std::size_t size, allocating_handler<Handler, Size>* ctx)
-			{
-				assert(size <= Size);
-#ifdef TORRENT_DEBUG
-				assert(!ctx->storage.used);
-				ctx->storage.used = true;
-#endif
-				return &ctx->storage.bytes;
-			}
+		// set while a call to on_uncork() is posted, small
+		// messages are collected in the send buffer until then
+		bool m_corked:1;
 
-			friend void asio_handler_deallocate(
-				void*, std::size_t, allocating_handler<Handler, Size>* ctx)
-			{
-#ifdef TORRENT_DEBUG
-				ctx->storage.used = false;
-#endif
-			}
+		// set while on_uncork() sends the collected messages
+		bool m_uncorking:1;
 
-			Handler handler;
-			handler_storage<Size>& storage;
-		};
+		// set when the current read may receive bytes past
+		// the end of the current packet
+		bool m_reading_ahead:1;
+		
+		handler_storage<TORRENT_READ_HANDLER_MAX_SIZE> m_read_handler_storage;
+		handler_storage<TORRENT_WRITE_HANDLER_MAX_SIZE> m_write_handler_storage;
 
 		template <class Handler>
 		allocating_handler<Handler, TORRENT_READ_HANDLER_MAX_SIZE>
@@ -42,6 +42,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <boost/static_assert.hpp>
+#include <boost/cstdint.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -133,7 +134,11 @@ namespace libtorrent
 			// have affinity to pieces with the same speed category
 			speed_affinity = 32,
 			// ignore the prefer_whole_pieces parameter
-			ignore_whole_pieces = 64
+			ignore_whole_pieces = 64,
+			// add blocks of downloading pieces that are requested
+			// from other peers to the backup blocks, so that
+			// late time critical blocks can be requested twice
+			time_critical_mode = 128
 		};
 
 		struct downloading_piece
@@ -160,10 +165,17 @@ namespace libtorrent
 		void get_availability(std::vector<int>& avail) const;
 
 		// increases the peer count for the given piece
-		// (is used when a HAVE message is received)
+		// (is used when a HAVE message is received). The change
+		// is queued and applied by update_refcounts(), so that
+		// changes that cancel out don't move the piece around
 		void inc_refcount(int index);
 		void dec_refcount(int index);
 
+		// applies the queued peer count changes. This is done
+		// before pieces are picked and when the availability is
+		// asked for, but can also be done periodically
+		void update_refcounts() const;
+
 		// increases the peer count for the given piece
 		// (is used when a BITFIELD message is received)
 		void inc_refcount(bitfield const& bitmask);
@@ -204,6 +216,13 @@ namespace libtorrent
 		// or vice versa
 		bool set_piece_priority(int index, int prio);
 
+		// sets the priorities of the pieces starting at 'first'. If
+		// many pieces change, the piece list is rebuilt once instead
+		// of moving every piece between buckets.
+		// returns true if any priority was changed from 0 to non-0
+		// or vice versa
+		bool set_piece_priorities(int first, std::vector<int> const& prio);
+
 		// returns the priority for the piece at 'index'
 		int piece_priority(int index) const;
 
@@ -247,6 +266,25 @@ namespace libtorrent
 			, void* peer, std::vector<int> const& ignore
 			, piece_state_t speed, int options) const;
 
+		// picks the blocks of a piece that isn't being downloaded,
+		// and of its neighbours if prefer_whole_pieces is set
+		int add_blocks_free(int piece, bitfield const& pieces
+			, std::vector<piece_block>& interesting_blocks
+			, int num_blocks, int prefer_whole_pieces) const;
+
+		// picks from the pieces in priority bucket prio of m_pieces.
+		// The bucket tells whether its pieces are being downloaded,
+		// and pieces in m_pieces are neither had nor filtered, so
+		// the walk only touches m_pieces and the peer's bitfield,
+		// not m_piece_map
+		int add_blocks_bucket(int prio, bitfield const& pieces
+			, std::vector<piece_block>& interesting_blocks
+			, std::vector<piece_block>& backup_blocks
+			, std::vector<piece_block>& backup_blocks2
+			, int num_blocks, int prefer_whole_pieces
+			, void* peer, std::vector<int> const& ignore
+			, piece_state_t speed, int options) const;
+
 		// picks blocks only from downloading pieces
 		int add_blocks_downloading(downloading_piece const& dp
 			, bitfield const& pieces
@@ -313,6 +351,16 @@ namespace libtorrent
 
 		int num_have() const { return m_num_have; }
 
+		// we're in end-game mode when every piece we want
+		// and don't have yet is already being downloaded.
+		// At that point the only blocks left to request are
+		// ones that have been requested from other peers
+		bool is_end_game() const
+		{
+			return int(m_piece_map.size()) - m_num_have - m_num_filtered
+				<= int(m_downloads.size());
+		}
+
 #ifdef TORRENT_DEBUG
 		// used in debug mode
 		void verify_priority(int start, int end, int prio) const;
@@ -444,28 +492,51 @@ namespace libtorrent
 
 		void update_pieces() const;
 
+		// a peer that has almost all pieces is counted as one
+		// more seed, and the pieces it doesn't have are taken
+		// off their peer counts. This only touches the missing
+		// pieces. These return false if a peer count would go
+		// out of range, in which case nothing is changed
+		bool inc_refcount_near_seed(bitfield const& bitmask);
+		bool dec_refcount_near_seed(bitfield const& bitmask);
+
+		// turns one of the seeds back into a peer count on
+		// every piece. This is needed when a peer count that
+		// has been taken off by a near-seed is decremented
+		void expand_seed();
+
 		// fills in the range [start, end) of pieces in
 		// m_pieces that have priority 'prio'
-		void priority_range(int prio, int* start, int* end);
+		void priority_range(int prio, int* start, int* end) const;
+
+		// these only touch the mutable members, so that
+		// update_refcounts() can be called from const functions
 
 		// adds the piece 'index' to m_pieces
-		void add(int index);
+		void add(int index) const;
 		// removes the piece with the given priority and the
 		// elem_index in the m_pieces vector
-		void remove(int priority, int elem_index);
+		void remove(int priority, int elem_index) const;
 		// updates the position of the piece with the given
 		// priority and the elem_index in the m_pieces vector
-		void update(int priority, int elem_index);
+		void update(int priority, int elem_index) const;
 		// shuffles the given piece inside it's priority range
-		void shuffle(int priority, int elem_index);
+		void shuffle(int priority, int elem_index) const;
 
 		void sort_piece(std::vector<downloading_piece>::iterator dp);
 
-		downloading_piece& add_download_piece();
+		// returns the entry in m_downloads for the piece, or
+		// m_downloads.end() if it isn't being downloaded
+		std::vector<downloading_piece>::iterator find_download(int piece);
+		std::vector<downloading_piece>::const_iterator find_download(int piece) const;
+
+		downloading_piece& add_download_piece(int piece);
 		void erase_download_piece(std::vector<downloading_piece>::iterator i);
 
 		// the number of seeds. These are not added to
-		// the availability counters of the pieces
+		// the availability counters of the pieces. Peers
+		// that have almost all pieces are counted here too,
+		// see inc_refcount_near_seed()
 		int m_seeds;
 
 		// the following vectors are mutable because they sometimes may
@@ -489,6 +560,15 @@ namespace libtorrent
 		// the m_piece_info buckets either
 		mutable std::vector<piece_pos> m_piece_map;
 
+		// the peer count changes queued by inc_refcount() and
+		// dec_refcount(), indexed by piece. It's allocated the
+		// first time it's needed
+		mutable std::vector<boost::int16_t> m_refcount_delta;
+
+		// the pieces that have had an entry in m_refcount_delta
+		// changed from 0 since the last update_refcounts()
+		mutable std::vector<int> m_refcount_pending;
+
 		// each piece that's currently being downloaded
 		// has an entry in this list with block allocations.
 		// i.e. it says wich parts of the piece that
@@ -497,13 +577,21 @@ namespace libtorrent
 
 		// this holds the information of the
 		// blocks in partially downloaded pieces.
-		// the first m_blocks_per_piece entries
-		// in the vector belongs to the first
-		// entry in m_downloads, the second
-		// m_blocks_per_piece entries to the
-		// second entry in m_downloads and so on.
+		// it's split into slots of m_blocks_per_piece
+		// entries, and each entry in m_downloads
+		// points to one of them with its info field
 		std::vector<block_info> m_block_info;
 
+		// for each piece that's being downloaded, its position
+		// in m_downloads. Entries for other pieces are stale, see
+		// find_download()
+		std::vector<int> m_download_index;
+
+		// the slots in m_block_info, in units of m_blocks_per_piece,
+		// that no downloading piece uses. They're reused before
+		// m_block_info grows
+		std::vector<int> m_free_block_info;
+
 		int m_blocks_per_piece;
 		int m_blocks_in_last_piece;
 
@@ -35,6 +35,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <set>
+#include <vector>
+#include <deque>
 
 #include "libtorrent/peer.hpp"
 #include "libtorrent/piece_picker.hpp"
@@ -43,6 +45,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/invariant_check.hpp"
 #include "libtorrent/config.hpp"
 #include "libtorrent/time.hpp"
+#include "libtorrent/ip_filter.hpp"
 
 namespace libtorrent
 {
@@ -78,6 +81,15 @@ namespace libtorrent
 		policy::peer* add_peer(const tcp::endpoint& remote, const peer_id& pid
 			, int source, char flags);
 
+		// an endpoint and its flags, as passed to add_peer()
+		typedef std::pair<tcp::endpoint, char> peer_entry_t;
+
+		// adds a batch of peers from one tracker response, pex message
+		// or dht reply. The batch is sorted and filtered in place and
+		// merged into the peer list in a single pass. Returns the number
+		// of peers that were added to the list
+		int add_peers(std::vector<peer_entry_t>& peers, int source);
+
 		// false means duplicate connection
 		bool update_peer_port(int port, policy::peer* p, int src);
 
@@ -102,6 +114,11 @@ namespace libtorrent
 
 		void ip_filter_updated();
 
+		// only looks at the peers within the given ranges, which
+		// is what changed in the filter. Returns an estimate of
+		// the work done, in number of peers or ranges looked at
+		int ip_filter_updated(std::vector<ip_range<address> > const& ranges);
+
 #ifdef TORRENT_DEBUG
 		bool has_connection(const peer_connection* p);
 
@@ -120,7 +137,7 @@ namespace libtorrent
 // 39     1     1         failcount, connectable, optimistically_unchoked, seed
 // 40     1     1         fast_reconnects, trust_points
 // 41     1     1         source, pe_support, is_v6_addr
-// 42     1     1         on_parole, banned, added_to_dht
+// 42     1     1         on_parole, banned, added_to_dht, supports_utp
 // 43     1     1         <padding>
 // 44
 		struct peer
@@ -254,6 +271,18 @@ namespace libtorrent
 			// pinged by the DHT
 			bool added_to_dht:1;
 #endif
+
+			// this is set to false if connecting to this
+			// peer over uTP failed. The next attempt will
+			// use TCP
+			bool supports_utp:1;
+
+#ifndef TORRENT_DISABLE_GEO_IP
+			// true if the peer's AS is one we prefer, see
+			// session_impl::is_cheap_as(). Kept up to date by
+			// session_impl::update_cheap_as()
+			bool cheap_as:1;
+#endif
 		};
 
 		struct ipv4_peer : peer
@@ -276,6 +305,10 @@ namespace libtorrent
 
 		int num_peers() const { return m_peers.size(); }
 
+		// erases peers from the list until it's within its
+		// size limit
+		void erase_peers();
+
 		struct peer_address_compare
 		{
 			bool operator()(
@@ -289,9 +322,32 @@ namespace libtorrent
 			{
 				return lhs < rhs->address();
 			}
+
+			// comparing against a v4 address doesn't need an
+			// address object built for every peer. All v4
+			// addresses sort before the v6 ones
+			bool operator()(
+				peer const* lhs, address_v4 const& rhs) const
+			{
+#if TORRENT_USE_IPV6
+				if (lhs->is_v6_addr) return false;
+#endif
+				return static_cast<ipv4_peer const*>(lhs)->addr < rhs;
+			}
+
+			bool operator()(
+				address_v4 const& lhs, peer const* rhs) const
+			{
+#if TORRENT_USE_IPV6
+				if (rhs->is_v6_addr) return true;
+#endif
+				return lhs < static_cast<ipv4_peer const*>(rhs)->addr;
+			}
 		};
 
-		typedef std::deque<peer*> peers_t;
+		// sorted by address. The peer entries themselves are
+		// allocated from the session's peer pools
+		typedef std::vector<peer*> peers_t;
 
 		typedef peers_t::iterator iterator;
 		typedef peers_t::const_iterator const_iterator;
@@ -302,16 +358,32 @@ namespace libtorrent
 
 		std::pair<iterator, iterator> find_peers(address const& a)
 		{
+			if (a.is_v4())
+				return std::equal_range(m_peers.begin(), m_peers.end()
+					, a.to_v4(), peer_address_compare());
 			return std::equal_range(
 				m_peers.begin(), m_peers.end(), a, peer_address_compare());
 		}
 
 		std::pair<const_iterator, const_iterator> find_peers(address const& a) const
 		{
+			if (a.is_v4())
+				return std::equal_range(m_peers.begin(), m_peers.end()
+					, a.to_v4(), peer_address_compare());
 			return std::equal_range(
 				m_peers.begin(), m_peers.end(), a, peer_address_compare());
 		}
 
+		// the first peer whose address is not less than a
+		iterator lower_bound_peer(address const& a)
+		{
+			if (a.is_v4())
+				return std::lower_bound(m_peers.begin(), m_peers.end()
+					, a.to_v4(), peer_address_compare());
+			return std::lower_bound(
+				m_peers.begin(), m_peers.end(), a, peer_address_compare());
+		}
+
 		bool connect_one_peer(int session_time);
 
 		bool has_peer(policy::peer const* p) const;
@@ -325,17 +397,39 @@ namespace libtorrent
 
 	private:
 
+		// disconnects and removes a peer blocked by the ip filter
+		void erase_filtered_peer(iterator i);
+
 		bool compare_peer_erase(policy::peer const& lhs, policy::peer const& rhs) const;
 		bool compare_peer(policy::peer const& lhs, policy::peer const& rhs
 			, address const& external_ip) const;
 
-		iterator find_connect_candidate(int session_time);
+		peer* find_connect_candidate(int session_time);
+		void update_candidate_cache(int session_time);
+
+		// allocates a new peer entry, without adding it to the list
+		peer* create_peer(tcp::endpoint const& remote, int src, char flags);
+		// updates a peer that is already in the list with new information
+		// about it. Returns the change in the number of connect candidates
+		int update_peer(peer* p, tcp::endpoint const& remote, int src, char flags);
 
 		bool is_connect_candidate(peer const& p, bool finished) const;
+		// a connect candidate that's also past its reconnect delay
+		bool is_reconnect_candidate(peer const& p, int session_time) const;
 		bool is_erase_candidate(peer const& p, bool finished) const;
 		bool should_erase_immediately(peer const& p) const;
 
-		void erase_peers();
+		// the erase bucket a candidate goes in, higher buckets
+		// are erased first
+		int erase_bucket(peer const& p) const;
+		void add_erase_candidate(peer const& p);
+		// returns the worst erase candidate that's still in the
+		// peer list, or end_peer() if there is none
+		iterator pop_erase_candidate();
+
+		// the size limit of the peer list. It depends on whether
+		// the torrent is paused and on the session's memory pressure
+		int max_peerlist_size() const;
 
 		peers_t m_peers;
 
@@ -343,6 +437,20 @@ namespace libtorrent
 		// to scan all of it, start at this iterator
 		int m_round_robin;
 
+		// the best connect candidates found by the last
+		// scan of the peer list, the best one last. Peers
+		// are removed from here when they're erased
+		std::vector<peer*> m_candidate_cache;
+
+		// peers that became erase candidates when they disconnected,
+		// by erase_bucket(), the ones that disconnected first at the
+		// front. The entries refer to peers by endpoint and are checked
+		// again when they're popped, since the peers may have been
+		// erased or reconnected since
+		enum { num_erase_buckets = 33 };
+		std::deque<tcp::endpoint> m_erase_buckets[num_erase_buckets];
+		int m_num_erase_entries;
+
 		torrent* m_torrent;
 
 		// free download we have got that hasn't
@@ -0,0 +1,100 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_RESOLVER_HPP_INCLUDED
+#define TORRENT_RESOLVER_HPP_INCLUDED
+
+#include <map>
+#include <vector>
+#include <string>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "libtorrent/socket.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+
+// a host name lookup cache shared by everything in the session that
+// resolves host names. Successful lookups are cached for a while and
+// so are failures, so a tracker that doesn't resolve isn't looked up
+// again for every torrent. Lookups of a name that's already being
+// resolved are joined with the outstanding one.
+class TORRENT_EXPORT resolver : boost::noncopyable
+{
+public:
+	typedef boost::function<void(error_code const&
+		, std::vector<address> const&)> callback_t;
+
+	resolver(io_service& ios);
+
+	// the handler is always called through the io_service,
+	// never from within async_resolve()
+	void async_resolve(std::string const& host, callback_t const& h);
+
+	// cancels the outstanding lookups and clears the cache
+	void abort();
+
+private:
+
+	void on_lookup(error_code const& ec, tcp::resolver::iterator i
+		, std::string hostname);
+
+	struct dns_cache_entry
+	{
+		ptime last_seen;
+		error_code error;
+		std::vector<address> addresses;
+	};
+
+	typedef std::map<std::string, dns_cache_entry> cache_t;
+	cache_t m_cache;
+
+	// the handlers waiting for lookups that are in progress,
+	// by host name
+	typedef std::map<std::string, std::vector<callback_t> > pending_t;
+	pending_t m_pending;
+
+	io_service& m_ios;
+	tcp::resolver m_resolver;
+
+	mutable boost::mutex m_mutex;
+	typedef boost::mutex::scoped_lock mutex_t;
+};
+
+}
+
+#endif // TORRENT_RESOLVER_HPP_INCLUDED
+
@@ -0,0 +1,117 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_RESUME_JOURNAL_HPP_INCLUDED
+#define TORRENT_RESUME_JOURNAL_HPP_INCLUDED
+
+#include <map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include "libtorrent/file.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/size_type.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+	namespace fs = boost::filesystem;
+
+	// a single append-only file holding the resume data of many
+	// torrents. Saving a torrent appends a record, and the last
+	// record of a torrent is its current resume data. This keeps a
+	// checkpoint of thousands of torrents to one file and one write
+	// per changed torrent. The file is rewritten with only the
+	// current records once the outdated ones take up most of it
+	class TORRENT_EXPORT resume_journal : boost::noncopyable
+	{
+	public:
+		resume_journal(fs::path const& p);
+
+		// opens the journal, creating it if it doesn't exist, and
+		// indexes its records. A partially written record at the
+		// end, left by a crash in the middle of an append, is dropped
+		bool open(error_code& ec);
+		void close();
+
+		// appends the resume data of a torrent, replacing
+		// the previous one. May compact the journal
+		bool append(sha1_hash const& ih, entry const& rd, error_code& ec);
+
+		// removes the torrent from the journal
+		bool remove(sha1_hash const& ih, error_code& ec);
+
+		// reads the current bencoded resume data of the torrent
+		// into buf. Returns false, without setting ec, if the torrent
+		// isn't in the journal
+		bool read(sha1_hash const& ih, std::vector<char>& buf, error_code& ec);
+
+		// the info-hashes of all torrents in the journal
+		void torrents(std::vector<sha1_hash>& ret) const;
+
+		// rewrites the journal with only the current records. If
+		// this fails, the journal has to be opened again
+		bool compact(error_code& ec);
+
+		int num_torrents() const { return int(m_index.size()); }
+		size_type size() const { return m_size; }
+
+	private:
+
+		bool append_record(sha1_hash const& ih, char const* buf, int size
+			, error_code& ec);
+
+		struct record
+		{
+			// the offset of the bencoded resume data
+			size_type offset;
+			int size;
+		};
+
+		fs::path m_path;
+		file m_file;
+
+		std::map<sha1_hash, record> m_index;
+
+		// the end of the last complete record
+		size_type m_size;
+
+		// the number of bytes taken up by current records,
+		// including their headers
+		size_type m_live_size;
+	};
+}
+
+#endif // TORRENT_RESUME_JOURNAL_HPP_INCLUDED
+
@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <vector>
+#include <deque>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -43,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/limits.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/thread.hpp>
+#include <boost/function.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -57,6 +59,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/disk_io_thread.hpp"
 #include "libtorrent/peer_id.hpp"
 #include "libtorrent/alert.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/trace.hpp"
 
 #include "libtorrent/storage.hpp"
 #include <boost/preprocessor/cat.hpp>
@@ -174,6 +178,7 @@ namespace libtorrent
 			, userdata(0)
 			, seed_mode(false)
 			, override_resume_data(false)
+			, share_mode(false)
 		{}
 
 		boost::intrusive_ptr<torrent_info> ti;
@@ -190,6 +195,7 @@ namespace libtorrent
 		void* userdata;
 		bool seed_mode;
 		bool override_resume_data;
+		bool share_mode;
 	};
 	
 	class TORRENT_EXPORT session: public boost::noncopyable, aux::eh_initializer
@@ -219,6 +225,19 @@ namespace libtorrent
 
 		// returns a list of all torrents in this session
 		std::vector<torrent_handle> get_torrents() const;
+
+		// calls save_resume_data() on every torrent whose resume
+		// data has changed since it was last saved. Returns the
+		// number of save_resume_data_alert and
+		// save_resume_data_failed_alert to expect
+		int save_modified_resume_data();
+
+		// appends the status of every torrent for which pred returns
+		// true to ret. flags are torrent_handle::status_flags_t and
+		// select which of the expensive fields are filled in
+		void get_torrent_status(std::vector<torrent_status>* ret
+			, boost::function<bool(torrent_status const&)> const& pred
+			, boost::uint32_t flags = 0) const;
 		
 		io_service& get_io_service();
 
@@ -228,6 +247,13 @@ namespace libtorrent
 		// all torrent_handles must be destructed before the session is destructed!
 		torrent_handle add_torrent(add_torrent_params const& params);
 		torrent_handle add_torrent(add_torrent_params const& params, error_code& ec);
+
+		// adds many torrents at once. The returned handles and
+		// the errors correspond to params by index. A torrent
+		// that fails to be added gets an invalid handle
+		std::vector<torrent_handle> add_torrents(
+			std::vector<add_torrent_params> const& params
+			, std::vector<error_code>& ec);
 		
 #ifndef TORRENT_NO_DEPRECATE
 		// deprecated in 0.14
@@ -294,6 +320,7 @@ namespace libtorrent
 
 #ifndef TORRENT_DISABLE_GEO_IP
 		int as_for_ip(address const& addr);
+		void set_cheap_as(std::vector<int> const& as);
 		bool load_asnum_db(char const* file);
 		bool load_country_db(char const* file);
 #ifndef BOOST_FILESYSTEM_NARROW_ONLY
@@ -382,10 +409,20 @@ namespace libtorrent
 		void set_max_connections(int limit);
 		void set_max_half_open_connections(int limit);
 
+		// bandwidth classes are rate limits that can be
+		// nested. A torrent in a class is limited by it and all
+		// its parents. parent is -1 for a top level class.
+		// Returns the new class' id
+		int create_bandwidth_class(int parent = -1);
+		void set_bandwidth_class_limits(int c, int upload_limit, int download_limit);
+
 		int max_connections() const;
 		int max_uploads() const;
 
 		std::auto_ptr<alert> pop_alert();
+		// moves all pending alerts to the end of alerts. The
+		// caller is responsible for deleting them
+		void pop_alerts(std::deque<alert*>* alerts);
 #ifndef TORRENT_NO_DEPRECATE
 		void set_severity_level(alert::severity_t s) TORRENT_DEPRECATED;
 #endif
@@ -393,6 +430,19 @@ namespace libtorrent
 		size_t set_alert_queue_size_limit(size_t queue_size_limit_);
 
 		alert const* wait_for_alert(time_duration max_wait);
+		// posts a state_update_alert with the status of the
+		// torrents that changed since the last call
+		void post_torrent_updates();
+		// posts a session_stats_alert with a snapshot of the
+		// session's counters. See session_stats_metrics()
+		void post_session_stats();
+		// returns the latency histograms of the disk threads, the
+		// network handlers and tracker and DHT requests
+		latency_stats get_latency_stats() const;
+		// returns the events in the trace buffer, oldest first.
+		// Tracing is turned on by session_settings::trace_buffer_size
+		// and chrome_trace() formats the events for chrome://tracing
+		std::vector<trace_event> get_trace() const;
 		void set_alert_dispatch(boost::function<void(alert const&)> const& fun);
 
 		connection_queue& get_connection_queue();
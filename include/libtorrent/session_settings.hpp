@@ -97,6 +97,7 @@ namespace libtorrent
 			, urlseed_timeout(20)
 			, urlseed_pipeline_size(5)
 			, urlseed_wait_retry(30)
+			, urlseed_max_connections(1)
 			, file_pool_size(40)
 			, allow_multiple_connections_per_ip(false)
 			, max_failcount(3)
@@ -172,6 +173,52 @@ namespace libtorrent
 			, disk_cache_algorithm(largest_contiguous)
 			, read_cache_line_size(16)
 			, write_cache_line_size(32)
+			, disk_io_threads(1)
+			, elevator_disk_reads(false)
+			, max_disk_read_delay(2000)
+			, hashing_threads(0)
+			, use_sendfile(false)
+			, read_hint_depth(0)
+			, request_queue_read_ahead(false)
+			, file_checks_read_ahead(0)
+			, checking_torrents_per_device(0)
+			, fastresume_spot_checks(0)
+			, preallocate_chunk_size(0)
+			, move_storage_chunk_size(0)
+			, max_whole_piece_stripe(1)
+			, max_end_game_requests(3)
+			, request_queue_rtt_factor(3.f)
+			, send_socket_notsent_lowat(0)
+			, enable_incoming_utp(true)
+			, enable_outgoing_utp(false)
+			, bandwidth_refill_interval(0)
+			, share_peer_reputation(false)
+			, tracker_requests_per_second(20)
+			, auto_tune(false)
+			, auto_tune_interval(10)
+			, auto_tune_max_cache_size(8192)
+			, auto_tune_max_read_cache_line_size(64)
+			, auto_tune_max_send_buffer_watermark(1024 * 1024)
+			, auto_tune_max_outstanding_disk_bytes(1024 * 1024)
+			, auto_tune_memory_limit(0)
+			, prefer_own_as(false)
+			, max_tex_trackers_per_minute(20)
+			, seed_mode_background_hashes(4)
+			, packed_resume_data(false)
+			, listen_queue_size(5)
+			, memory_budget(0)
+			, suggest_mode(no_piece_suggestions)
+			, tiered_cache_size(0)
+			, tiered_cache_admission(2)
+			, ram_storage_size(64)
+			, device_write_cache_share(0)
+			, adaptive_connection_speed(false)
+			, min_connection_speed(2)
+			, max_connection_speed(100)
+			, seed_choking_algorithm(round_robin)
+			, share_mode_size(256)
+			, trace_buffer_size(0)
+			, piece_hash_cache_pages(16)
 		{}
 
 		// this is the user agent that will be sent to the tracker
@@ -249,6 +296,10 @@ namespace libtorrent
 
 		// time to wait until a new retry takes place
 		int urlseed_wait_retry;
+
+		// the number of connections to open to each web seed.
+		// They're opened one per second until there are this many
+		int urlseed_max_connections;
 		
 		// sets the upper limit on the total number of files this
 		// session will keep open. The reason why files are
@@ -406,6 +457,10 @@ namespace libtorrent
 		// cache for caching blocks read from disk too
 		bool use_read_cache;
 
+		// with disable_os_cache, files that don't start at an aligned
+		// offset in the torrent are read and written through scratch
+		// buffers widened to the sector size. The sectors a write only
+		// partly covers are read first and written back with it
 		enum io_buffer_mode_t
 		{
 			enable_os_cache = 0,
@@ -415,6 +470,11 @@ namespace libtorrent
 		int disk_io_write_mode:4;
 		int disk_io_read_mode:4;
 
+		// when true, contiguous blocks are copied into a single
+		// buffer before they're read or written, instead of
+		// passing one buffer per block to readv() and writev().
+		// Writes are never coalesced on systems with a native
+		// writev(), since they wouldn't be any faster
 		bool coalesce_reads;
 		bool coalesce_writes;
 
@@ -576,8 +636,13 @@ namespace libtorrent
 		// the checking rate to 1.6 MiB per second
 		int file_checks_delay_per_block;
 
+		// lru and largest_contiguous decide which write cache
+		// blocks are flushed first. two_queue flushes the write
+		// cache like largest_contiguous, and makes the read cache
+		// scan resistant, by evicting pieces that have only been
+		// requested once before frequently requested ones
 		enum disk_cache_algo_t
-		{ lru, largest_contiguous };
+		{ lru, largest_contiguous, two_queue };
 
 		disk_cache_algo_t disk_cache_algorithm;
 
@@ -589,6 +654,252 @@ namespace libtorrent
 		// blocks is found in the write cache, it
 		// is flushed immediately
 		int write_cache_line_size;
+
+		// the number of disk I/O threads. Every torrent's
+		// disk jobs are handled by one of them, so torrents
+		// on a slow drive don't stall the other torrents.
+		// This can only be increased at run-time
+		int disk_io_threads;
+
+		// when this is true, the disk threads don't issue
+		// queued reads in the order they were requested.
+		// Instead they are issued in order of their location
+		// on disk, sweeping in one direction (C-SCAN). This
+		// saves seeks on rotating disks when seeding to
+		// many peers
+		bool elevator_disk_reads;
+
+		// the maximum number of milliseconds a read job may be
+		// delayed by the elevator. Once a job has been waiting
+		// this long, it's issued next
+		int max_disk_read_delay;
+
+		// the number of threads computing piece hashes. When
+		// this is 0, pieces are hashed by the disk threads,
+		// which then can't perform any disk I/O in the mean
+		// time. This can only be increased at run-time
+		int hashing_threads;
+
+		// when true, piece payloads for unencrypted peers are sent
+		// from the files to the sockets with sendfile(), without
+		// going through the disk cache. Only supported on linux
+		bool use_sendfile;
+
+		// the number of queued reads the disk threads ask the
+		// operating system to start reading in the background,
+		// to keep the drives busy with more than one read at a time
+		int read_hint_depth;
+
+		// when true, a read cache miss reads the blocks the peer
+		// has requested right after the missing one, instead of
+		// read_cache_line_size blocks. Peers requesting blocks in
+		// order still get a full cache line
+		bool request_queue_read_ahead;
+
+		// the number of pieces the full check reads ahead of the
+		// one it's checking. They're hashed by the hashing threads
+		// while the disk thread reads the following ones. 0 reads
+		// and hashes one piece at a time
+		int file_checks_read_ahead;
+
+		// when > 0, torrents saving to different devices check
+		// their files at the same time, with at most this many
+		// checking per device. 0 checks one torrent at a time
+		int checking_torrents_per_device;
+
+		// when > 0, resume data is not rejected just because the
+		// modification times of some files don't match it. Instead,
+		// this many random pieces in those files are hashed, and
+		// only if one of them fails are the files fully checked
+		int fastresume_spot_checks;
+
+		// when > 0, sparse files are allocated in chunks of this
+		// many bytes, as they're first written to. This keeps the
+		// files from being fragmented without allocating all of
+		// them up front. Only supported on linux
+		int preallocate_chunk_size;
+
+		// when > 0, moving the storage of a torrent to another file
+		// system copies this many bytes per disk job, and reports the
+		// progress in storage_move_progress_alerts. The torrent keeps
+		// reading and writing the files in the old location until
+		// they've all been copied. 0 copies everything in one job
+		int move_storage_chunk_size;
+
+		// peers that prefer whole pieces (see whole_pieces_threshold)
+		// are given runs of up to this many adjacent pieces at a time,
+		// as many as fit in their request queue. This keeps the blocks
+		// each peer delivers together on disk
+		int max_whole_piece_stripe;
+
+		// in end-game mode, this is the max number of peers a
+		// single block is requested from at the same time. 0
+		// means there's no limit
+		int max_end_game_requests;
+
+		// once a peer's round trip time is known, the request
+		// queue covers this many round trips at the current
+		// download rate, but no more than request_queue_time.
+		// 0 always uses request_queue_time
+		float request_queue_rtt_factor;
+
+		// if set, TCP_NOTSENT_LOWAT is set to this on peer
+		// sockets, and the unsent bytes in the kernel send
+		// buffer above it count towards the send buffer
+		// watermark. Only supported on linux
+		int send_socket_notsent_lowat;
+
+		// uTP connections are made over the DHT's udp
+		// socket. When incoming uTP is disabled, connection
+		// attempts are reset. Outgoing uTP connections fall
+		// back to TCP for peers that don't respond
+		bool enable_incoming_utp;
+		bool enable_outgoing_utp;
+
+		// the number of milliseconds between handing out
+		// bandwidth quota to rate limited peers. 0 means it's
+		// done on the 100 ms session tick. Shorter intervals
+		// spread the sending out more evenly. It's clamped
+		// to 10 ms
+		int bandwidth_refill_interval;
+
+		// when set, peers banned or failing to connect in
+		// one torrent start out banned, or with that
+		// failcount, when they're added to other torrents
+		bool share_peer_reputation;
+
+		// the max number of tracker requests to start per
+		// second, across all torrents. Requests beyond that
+		// are queued, started and completed events first.
+		// Stopped events are never held back. 0 means
+		// unlimited
+		int tracker_requests_per_second;
+
+		// when true, the session adjusts cache_size,
+		// read_cache_line_size, send_buffer_watermark and
+		// max_outstanding_disk_bytes_per_connection every
+		// auto_tune_interval seconds, from the cache hit ratio,
+		// how often peers wait for the disk and the memory used.
+		// The values set here are the lower bounds and the
+		// auto_tune_max_* settings the upper bounds
+		bool auto_tune;
+		int auto_tune_interval;
+		int auto_tune_max_cache_size;
+		int auto_tune_max_read_cache_line_size;
+		int auto_tune_max_send_buffer_watermark;
+		int auto_tune_max_outstanding_disk_bytes;
+
+		// when the number of disk buffers in use (16 kiB blocks,
+		// like cache_size) exceeds this, the tuned settings are
+		// moved back towards the lower bounds. 0 means no limit
+		int auto_tune_memory_limit;
+
+		// when true, peers in the same AS as our external
+		// address are treated like the ones in the ASes passed
+		// to session::set_cheap_as(). They're tried and unchoked
+		// first, and they're in the local peers' rate class when
+		// ignore_limits_on_local_network is set
+		bool prefer_own_as;
+
+		// the max number of trackers learned from peers through
+		// tracker exchange that are added to torrents per minute,
+		// across the whole session. The trackers beyond this are
+		// ignored. 0 means no limit
+		int max_tex_trackers_per_minute;
+
+		// the number of pieces a torrent in seed mode hashes
+		// in the background at a time, to verify the files
+		// before peers request them. 0 disables it
+		int seed_mode_background_hashes;
+
+		// when true, the resume data is saved in version 2 of the
+		// resume file format, where the file sizes, the slot map and
+		// the unfinished pieces are packed binary strings instead of
+		// lists. It's smaller and faster to parse, but can't be read
+		// by older versions of libtorrent
+		bool packed_resume_data;
+
+		// the backlog of the listen sockets, i.e. the number of
+		// incoming connections the kernel queues up for us to
+		// accept
+		int listen_queue_size;
+
+		// the total number of kiB the disk cache, send and receive
+		// buffers and peer lists may use. As the budget is approached
+		// the read cache is cleared first, then peer lists are trimmed
+		// and last the request pipelines are shortened. 0 means no limit
+		int memory_budget;
+
+		// when set to suggest_read_cache, torrents send SUGGEST_PIECE
+		// for the pieces in the read cache that were used most
+		// recently, and pick allowed fast pieces among them, to
+		// steer peers towards data that's already in memory
+		enum suggest_mode_t { no_piece_suggestions = 0, suggest_read_cache = 1 };
+		int suggest_mode;
+
+		// used by tiered_storage_constructor. Pieces that are read
+		// often are copied to a directory under tiered_cache_path,
+		// typically on a faster drive, and read from there. Each
+		// torrent keeps up to tiered_cache_size MiB of pieces in it.
+		// A piece is copied once tiered_cache_admission times its
+		// size has been read from it
+		std::string tiered_cache_path;
+		int tiered_cache_size;
+		int tiered_cache_admission;
+
+		// the number of MiB of piece data each torrent using
+		// ram_storage_constructor keeps in memory. Once it's full,
+		// the least recently used complete pieces are dropped and
+		// the torrent stops having them
+		int ram_storage_size;
+
+		// the percentage of cache_size the torrents saved on one
+		// device may have waiting to be written, in the write cache
+		// or the disk queue. Past it, their peers stop receiving
+		// until the device has caught up, so one slow drive doesn't
+		// take the write cache from all the others. 0 means no limit
+		int device_write_cache_share;
+
+		// when true, the number of connection attempts made per
+		// second follows how well they go, starting at
+		// connection_speed. It's halved when too many attempts time
+		// out or take much longer than they used to, and grows
+		// slowly otherwise, staying between min_connection_speed and
+		// max_connection_speed
+		bool adaptive_connection_speed;
+		int min_connection_speed;
+		int max_connection_speed;
+
+		// how the upload slots are handed out to the peers of
+		// seeding torrents. round_robin rotates them after
+		// seeding_piece_quota pieces. rate_based keeps the peers we
+		// upload the fastest to, favouring the ones that have the
+		// least of the torrent, and hands the rotated slots to the
+		// choked peers with the least of the torrent first. With
+		// auto_upload_slots and no upload limit, it also sizes the
+		// number of slots by adding them as long as they raise the
+		// upload rate
+		enum seed_choking_algorithm_t { round_robin = 0, rate_based = 1 };
+		int seed_choking_algorithm;
+
+		// the number of MiB of pieces each torrent in share mode
+		// may have. Once it's reached, a rare piece is only
+		// downloaded in place of one that isn't rare anymore
+		int share_mode_size;
+
+		// the number of events the trace buffer keeps, 0 turns
+		// tracing off. Disk jobs, block requests, received and
+		// written blocks, piece hash checks, bandwidth grants and
+		// unchoke rounds are recorded. See session::get_trace()
+		int trace_buffer_size;
+
+		// when set, torrents move their info section, which holds
+		// the piece hashes, to a file in this directory when they're
+		// started, and read the hashes back from it as they need them.
+		// Each torrent keeps piece_hash_cache_pages pages of 512
+		// hashes in memory. See torrent_info::page_out_piece_hashes()
+		std::string piece_hash_path;
+		int piece_hash_cache_pages;
 	};
 
 #ifndef TORRENT_DISABLE_DHT
@@ -599,6 +910,10 @@ namespace libtorrent
 			, search_branching(5)
 			, service_port(0)
 			, max_fail_count(20)
+			, max_torrents(3000)
+			, max_peers(100000)
+			, max_outstanding_requests(1000)
+			, read_only(false)
 		{}
 		
 		// the maximum number of peers to send in a
@@ -616,6 +931,21 @@ namespace libtorrent
 		// the maximum number of times a node can fail
 		// in a row before it is removed from the table.
 		int max_fail_count;
+
+		// the maximum number of torrents and the total
+		// number of peers the node will store announces for
+		int max_torrents;
+		int max_peers;
+
+		// the maximum number of requests the node will have
+		// outstanding at any time. Requests beyond this are
+		// queued and sent as replies come in or time out
+		int max_outstanding_requests;
+
+		// when set, the node only issues queries, flagged as
+		// read-only. It doesn't answer queries, so it doesn't
+		// store announces, and it doesn't refresh its buckets
+		bool read_only;
 	};
 #endif
 
@@ -0,0 +1,266 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_SESSION_STATS_HPP_INCLUDED
+#define TORRENT_SESSION_STATS_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/assert.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	// counters and gauges that the session keeps up to date as
+	// things happen. They're plain integers in a flat array, only
+	// touched from the network thread, so updating one is an add
+	// and taking a snapshot is a copy. The gauges are filled in when
+	// the snapshot is taken
+	struct TORRENT_EXPORT counters
+	{
+		enum stats_counter_t
+		{
+			// the number of times the socket read and write
+			// handlers were called, i.e. the number of completed
+			// receive and send calls
+			on_read_counter,
+			on_write_counter,
+			// the number of times the session's tick ran
+			on_tick_counter,
+
+			// the number of times the piece picker was asked
+			// for blocks, and the total time spent in it
+			piece_picks,
+			piece_picker_time_us,
+
+			// the number of bittorrent messages received, by type
+			num_incoming_choke,
+			num_incoming_unchoke,
+			num_incoming_interested,
+			num_incoming_not_interested,
+			num_incoming_have,
+			num_incoming_bitfield,
+			num_incoming_request,
+			num_incoming_piece,
+			num_incoming_cancel,
+			num_incoming_dht_port,
+			num_incoming_suggest,
+			num_incoming_have_all,
+			num_incoming_have_none,
+			num_incoming_reject,
+			num_incoming_allowed_fast,
+			num_incoming_extended,
+
+			// the number of times a peer's send buffer ran empty
+			// while it was waiting for blocks from the disk
+			num_send_buffer_drained,
+			// the number of times a peer stopped reading from its
+			// socket because of max_outstanding_disk_bytes_per_connection
+			num_disk_write_limit_hits,
+
+			// the disk cache. These are totals since the
+			// session started
+			disk_blocks_read,
+			disk_blocks_read_hit,
+			disk_blocks_written,
+			disk_writes,
+
+			num_stats_counters,
+
+			// gauges, set when the snapshot is taken
+			num_torrents = num_stats_counters,
+			num_ticking_torrents,
+			num_peers_connected,
+			num_peers_half_open,
+			num_peers_unchoked,
+			disk_queue_depth,
+			disk_queued_bytes,
+			disk_buffers_in_use,
+			disk_cache_size,
+			up_bandwidth_queue,
+			down_bandwidth_queue,
+			up_bandwidth_bytes_queue,
+			down_bandwidth_bytes_queue,
+
+			num_counters
+		};
+
+		counters()
+		{
+			for (int i = 0; i < num_counters; ++i) m_stats_counter[i] = 0;
+		}
+
+		boost::int64_t inc_stats_counter(int c, boost::int64_t value = 1)
+		{
+			TORRENT_ASSERT(c >= 0 && c < num_stats_counters);
+			return m_stats_counter[c] += value;
+		}
+
+		void set_value(int c, boost::int64_t value)
+		{
+			TORRENT_ASSERT(c >= 0 && c < num_counters);
+			m_stats_counter[c] = value;
+		}
+
+		boost::int64_t operator[](int c) const
+		{
+			TORRENT_ASSERT(c >= 0 && c < num_counters);
+			return m_stats_counter[c];
+		}
+
+	private:
+		boost::int64_t m_stats_counter[num_counters];
+	};
+
+	struct TORRENT_EXPORT stats_metric
+	{
+		enum metric_type_t { type_counter, type_gauge };
+		char const* name;
+		// the index into session_stats_alert::values
+		int value_index;
+		metric_type_t type;
+	};
+
+	// describes every value in a session_stats_alert
+	TORRENT_EXPORT std::vector<stats_metric> session_stats_metrics();
+
+	// a histogram of latencies, in microseconds. Every power of two
+	// range is split into 4 linear buckets, so a sample is off by
+	// at most 25% and the histogram is a small fixed size array
+	// that's cheap to add to and to copy. Samples above 2^32 us
+	// (about 71 minutes) end up in the last bucket
+	struct TORRENT_EXPORT latency_histogram
+	{
+		enum
+		{
+			sub_bucket_bits = 2,
+			sub_buckets = 1 << sub_bucket_bits,
+			num_buckets = sub_buckets * 31
+		};
+
+		latency_histogram() { clear(); }
+
+		void add(boost::int64_t us)
+		{
+			if (us < 0) us = 0;
+			++buckets[bucket_index(us)];
+			++samples;
+			total += us;
+			if (us > max_value) max_value = us;
+		}
+
+		void add(time_duration d)
+		{ add(boost::int64_t(total_microseconds(d))); }
+
+		void clear();
+		void merge(latency_histogram const& h);
+
+		// the upper bound of the bucket the value at p
+		// (0 - 1) falls in, i.e. percentile(0.99) is the
+		// 99th percentile. Returns 0 if there are no samples
+		boost::int64_t percentile(double p) const;
+		boost::int64_t mean() const
+		{ return samples == 0 ? 0 : total / samples; }
+
+		static int bucket_index(boost::int64_t us)
+		{
+			if (us < sub_buckets) return int(us);
+			if (us > 0xffffffffLL) return num_buckets - 1;
+			boost::uint32_t v = boost::uint32_t(us);
+			int msb = 0;
+			for (boost::uint32_t i = v >> 1; i != 0; i >>= 1) ++msb;
+			int shift = msb - sub_bucket_bits;
+			return (shift + 1) * sub_buckets
+				+ int((v >> shift) & (sub_buckets - 1));
+		}
+
+		// the smallest value that goes in bucket i
+		static boost::int64_t bucket_start(int i);
+
+		boost::int64_t buckets[num_buckets];
+		boost::int64_t samples;
+		boost::int64_t total;
+		boost::int64_t max_value;
+	};
+
+	// adds the time it's alive to a histogram. Used to time
+	// handlers that have many ways to return
+	struct latency_timer : boost::noncopyable
+	{
+		latency_timer(latency_histogram& h)
+			: m_hist(h), m_start(time_now_hires()) {}
+		~latency_timer() { m_hist.add(time_now_hires() - m_start); }
+	private:
+		latency_histogram& m_hist;
+		ptime m_start;
+	};
+
+	// returned by session::get_latency_stats()
+	struct TORRENT_EXPORT latency_stats
+	{
+		// the time disk jobs took to run, indexed by
+		// disk_io_job::action_t. Hash jobs handed to the
+		// hash threads are not included
+		std::vector<latency_histogram> disk_job_time;
+		// the time disk jobs spent in the queue before a
+		// disk thread picked them up
+		latency_histogram disk_queue_time;
+		// the same as disk_queue_time, and the number of jobs
+		// waiting in the queues right now, indexed by
+		// disk_io_class_t
+		std::vector<latency_histogram> disk_class_queue_time;
+		std::vector<int> disk_class_queued_jobs;
+
+		// the time spent in the socket receive handler,
+		// including parsing and dispatching the messages
+		latency_histogram peer_receive_time;
+		// the time spent in the piece picker per request
+		latency_histogram piece_pick_time;
+		// the time the session tick took
+		latency_histogram tick_time;
+
+		// the time from starting a tracker request until
+		// its response was received
+		latency_histogram tracker_round_trip;
+		// the round trip times of DHT requests
+		latency_histogram dht_round_trip;
+
+		// the time connection attempts waited in the
+		// connection queue for a half-open slot
+		latency_histogram connect_queue_time;
+	};
+}
+
+#endif // TORRENT_SESSION_STATS_HPP_INCLUDED
+
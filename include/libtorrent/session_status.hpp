@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/config.hpp"
 #include "libtorrent/size_type.hpp"
+#include <vector>
 
 namespace libtorrent
 {
@@ -52,6 +53,18 @@ namespace libtorrent
 
 #endif
 
+	struct bandwidth_class_status
+	{
+		// the class this one is nested in, -1 for top level classes
+		int parent;
+		int upload_limit;
+		int download_limit;
+		// the number of bytes assigned to peers while they
+		// were limited by this class
+		size_type total_upload;
+		size_type total_download;
+	};
+
 	struct TORRENT_EXPORT session_status
 	{
 		bool has_incoming_connections;
@@ -83,20 +96,34 @@ namespace libtorrent
 
 		size_type total_redundant_bytes;
 		size_type total_failed_bytes;
+		size_type total_duplicate_request_bytes;
+		size_type total_cancelled_bytes;
 
 		int num_peers;
 		int num_unchoked;
 		int allowed_upload_slots;
 
+		// the number of connection attempts made per second
+		int connection_speed;
+		size_type peers_memory;
+
 		int up_bandwidth_queue;
 		int down_bandwidth_queue;
 
 		int up_bandwidth_bytes_queue;
 		int down_bandwidth_bytes_queue;
 
+		// indexed by bandwidth class id
+		std::vector<bandwidth_class_status> bandwidth_classes;
+
 		int optimistic_unchoke_counter;
 		int unchoke_counter;
 
+		int open_files;
+		size_type file_pool_hits;
+		size_type file_pool_misses;
+		size_type file_pool_evictions;
+
 #ifndef TORRENT_DISABLE_DHT
 		int dht_nodes;
 		int dht_node_cache;
@@ -75,6 +75,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/time.hpp"
 #include "libtorrent/error_code.hpp"
 #include "libtorrent/escape_string.hpp" // for to_string
+#include "libtorrent/config.hpp"
+
+#ifdef TORRENT_LINUX
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#endif
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -266,6 +272,40 @@ namespace libtorrent
 		size_t size(Protocol const&) const { return sizeof(m_value); }
 		char m_value;
 	};
+
+#if defined TCP_NOTSENT_LOWAT && defined SIOCOUTQNSD
+#define TORRENT_USE_NOTSENT_LOWAT 1
+
+	// the socket only reports being writable when there
+	// are fewer than this many bytes in the send buffer
+	// that haven't been sent yet
+	struct tcp_notsent_lowat
+	{
+		tcp_notsent_lowat(int val): m_value(val) {}
+		template<class Protocol>
+		int level(Protocol const&) const { return IPPROTO_TCP; }
+		template<class Protocol>
+		int name(Protocol const&) const { return TCP_NOTSENT_LOWAT; }
+		template<class Protocol>
+		int const* data(Protocol const&) const { return &m_value; }
+		template<class Protocol>
+		size_t size(Protocol const&) const { return sizeof(m_value); }
+		int m_value;
+	};
+
+	// io_control command that returns the number of bytes
+	// in the send buffer that haven't been sent yet
+	struct unsent_bytes
+	{
+		unsent_bytes(): m_value(0) {}
+		int name() const { return SIOCOUTQNSD; }
+		void* data() { return &m_value; }
+		int get() const { return m_value; }
+		int m_value;
+	};
+#else
+#define TORRENT_USE_NOTSENT_LOWAT 0
+#endif
 }
 
 #endif // TORRENT_SOCKET_HPP_INCLUDED
@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/socks5_stream.hpp"
 #include "libtorrent/http_stream.hpp"
+#include "libtorrent/utp_stream.hpp"
 #include "libtorrent/variant_stream.hpp"
 
 namespace libtorrent
@@ -42,7 +43,8 @@ namespace libtorrent
 	typedef variant_stream<
 		stream_socket
 		, socks5_stream
-		, http_stream> socket_type;
+		, http_stream
+		, utp_stream> socket_type;
 }
 
 #endif
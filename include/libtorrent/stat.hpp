@@ -55,6 +55,7 @@ namespace libtorrent
 			: m_counter(0)
 			, m_total_counter(0)
 			, m_rate_sum(0)
+			, m_oldest(0)
 		{
 			std::memset(m_rate_history, 0, sizeof(m_rate_history));
 		}
@@ -87,12 +88,17 @@ namespace libtorrent
 
 		size_type counter() const { return m_counter; }
 
+		// true when nothing was transferred for the last
+		// history seconds, so ticking it wouldn't change it
+		bool is_idle() const { return m_counter == 0 && m_rate_sum == 0; }
+
 		void clear()
 		{
 			std::memset(m_rate_history, 0, sizeof(m_rate_history));
 			m_counter = 0;
 			m_total_counter = 0;
 			m_rate_sum = 0;
+			m_oldest = 0;
 		}
 
 	private:
@@ -107,7 +113,9 @@ namespace libtorrent
 		}
 #endif
 
-		// history of rates a few seconds back
+		// history of rates a few seconds back. It's a ring
+		// buffer, m_oldest is the index of the oldest sample,
+		// which is the one the next sample replaces
 		int m_rate_history[history];
 
 		// the accumulator for this second.
@@ -118,6 +126,8 @@ namespace libtorrent
 
 		// sum of all elements in m_rate_history
 		size_type m_rate_sum;
+
+		int m_oldest;
 	};
 
 	class TORRENT_EXPORT stat
@@ -214,6 +224,13 @@ namespace libtorrent
 				m_stat[i].second_tick(tick_interval);
 		}
 
+		bool is_idle() const
+		{
+			for (int i = 0; i < num_channels; ++i)
+				if (!m_stat[i].is_idle()) return false;
+			return true;
+		}
+
 		float upload_rate() const
 		{
 			return (m_stat[upload_payload].rate_sum()
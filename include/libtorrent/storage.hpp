@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_STORAGE_HPP_INCLUDE
 
 #include <vector>
+#include <deque>
 #include <bitset>
 
 #ifdef _MSC_VER
@@ -42,6 +43,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/limits.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/filesystem/path.hpp>
@@ -59,6 +61,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/config.hpp"
 #include "libtorrent/file.hpp"
 #include "libtorrent/disk_buffer_holder.hpp"
+#include "libtorrent/session_stats.hpp"
 
 namespace libtorrent
 {
@@ -80,17 +83,72 @@ namespace libtorrent
 		storage_mode_sparse,
 		storage_mode_compact
 	};
+
+	// the disk I/O classes torrents can be put in. The disk threads
+	// share their time between the classes that have jobs queued,
+	// by the weights in disk_io_thread
+	enum disk_io_class_t
+	{
+		latency_io_class = 0,
+		normal_io_class,
+		bulk_io_class,
+		num_io_classes
+	};
 	
 	TORRENT_EXPORT std::vector<std::pair<size_type, std::time_t> > get_filesizes(
 		file_storage const& t
 		, fs::path p);
 
+	// identifies the device the file or directory p is on, or the
+	// closest of its parents that exists. 0 means it's unknown
+	TORRENT_EXPORT size_type device_id(fs::path p);
+
 	TORRENT_EXPORT bool match_filesizes(
 		file_storage const& t
 		, fs::path p
 		, std::vector<std::pair<size_type, std::time_t> > const& sizes
 		, bool compact_mode
-		, std::string* error = 0);
+		, std::string* error = 0
+		, std::vector<int>* touched_files = 0);
+
+	// the disk activity of a single torrent, returned by
+	// torrent_handle::get_io_stats(). It counts the same things as
+	// cache_status does for the whole session
+	struct TORRENT_EXPORT torrent_io_stats
+	{
+		torrent_io_stats()
+			: bytes_read(0)
+			, bytes_written(0)
+			, reads(0)
+			, writes(0)
+			, blocks_read(0)
+			, blocks_read_hit(0)
+		{}
+
+		// the number of bytes read from and written to the files,
+		// and the number of read and write operations it took.
+		// This includes reads for hashing and checking the files
+		size_type bytes_read;
+		size_type bytes_written;
+		size_type reads;
+		size_type writes;
+
+		// the number of blocks passed back to the bittorrent engine,
+		// and the number of those that were in the read cache.
+		// The difference is the number of cache misses
+		size_type blocks_read;
+		size_type blocks_read_hit;
+
+		// the time the torrent's disk jobs took to run, and the
+		// time they waited in the queue before that
+		latency_histogram job_time;
+		latency_histogram queue_time;
+
+		// the number of bytes read from each file, in the order of
+		// the torrent's file_storage. Only filled in when
+		// torrent_handle::get_io_stats() is passed query_file_reads
+		std::vector<size_type> file_bytes_read;
+	};
 
 	struct TORRENT_EXPORT file_allocation_failed: std::exception
 	{
@@ -131,13 +189,51 @@ namespace libtorrent
 		virtual int write(const char* buf, int slot, int offset, int size) = 0;
 
 		// returns the end of the sparse region the slot 'start'
-		// resides in i.e. the next slot with content. If start
-		// is not in a sparse region, start itself is returned
+		// resides in i.e. the first slot with content. Only slots
+		// entirely in holes are skipped. If start is not in a
+		// sparse region, start itself is returned
 		virtual int sparse_end(int start) const { return start; }
 
+		// if the size bytes at offset in slot are all in one file,
+		// as they are on disk, returns that file and sets file_offset
+		// to where they start in it. This is used to send them to a
+		// socket without reading them first. An empty pointer means
+		// they have to be read. It's called from the network thread
+		virtual boost::shared_ptr<file> file_for_range(int slot, int offset
+			, int size, size_type& file_offset)
+		{ return boost::shared_ptr<file>(); }
+
+		// tells the storage that size bytes at offset in slot will
+		// be read soon. Storages that can start reading them in the
+		// background should, it's only a hint
+		virtual void hint_read(int slot, int offset, int size) {}
+
+		// appends the slots the storage has dropped on its own since
+		// the last call to slots, and forgets them. Storages that
+		// keep everything they're given never drop any. It's called
+		// from the network thread
+		virtual void dropped_slots(std::vector<int>& slots) {}
+
+		// tells the storage the piece in slot isn't wanted anymore,
+		// so it can free the space it takes. The slot may be written
+		// again later. Storages that can't give space back ignore it
+		virtual void discard_slot(int slot) {}
+
 		// non-zero return value indicates an error
 		virtual bool move_storage(fs::path save_path) = 0;
 
+		// moves the files to save_path one step at a time, so that
+		// other disk jobs can run in between. Returns 1 while there's
+		// more left to do, 0 once the files are in their new place
+		// and -1 on errors. progress is set to how much of the move
+		// is done, in parts per million. The default moves everything
+		// in one go with move_storage()
+		virtual int move_storage_chunk(fs::path save_path, int& progress)
+		{
+			progress = 1000000;
+			return move_storage(save_path) ? 0 : -1;
+		}
+
 		// verify storage dependent fast resume entries
 		virtual bool verify_resume_data(lazy_entry const& rd, std::string& error) = 0;
 
@@ -167,6 +263,17 @@ namespace libtorrent
 		// non-zero return value indicates an error
 		virtual bool delete_files() = 0;
 
+		// deletes the files a few at a time, so that other disk jobs
+		// can run in between. Returns 1 while there are more files left,
+		// 0 once they're all deleted and -1 on errors. progress is kept
+		// between the calls, it's 0 on the first one. The default
+		// deletes everything in one go with delete_files()
+		virtual int delete_files_chunk(int& progress)
+		{
+			progress = 1;
+			return delete_files() ? -1 : 0;
+		}
+
 		disk_buffer_pool* disk_pool() { return m_disk_pool; }
 		session_settings const& settings() const { return *m_settings; }
 
@@ -183,6 +290,13 @@ namespace libtorrent
 		mutable error_code m_error;
 		mutable std::string m_error_file;
 
+		// the files verify_resume_data() let through even though their
+		// modification times don't match the resume data. This is only
+		// filled in when fastresume_spot_checks is enabled, and the
+		// pieces in these files are spot checked before the resume
+		// data is trusted
+		std::vector<int> m_touched_files;
+
 		virtual ~storage_interface() {}
 
 		disk_buffer_pool* m_disk_pool;
@@ -195,6 +309,23 @@ namespace libtorrent
 	TORRENT_EXPORT storage_interface* default_storage_constructor(
 		file_storage const&, fs::path const&, file_pool&);
 
+	// a storage that maps the files into memory and copies to
+	// and from the mappings, instead of reading and writing them
+	TORRENT_EXPORT storage_interface* mmap_storage_constructor(
+		file_storage const&, fs::path const&, file_pool&);
+
+	// a storage that keeps copies of the most read pieces in
+	// session_settings::tiered_cache_path and reads them from there.
+	// Writes go to the regular files
+	TORRENT_EXPORT storage_interface* tiered_storage_constructor(
+		file_storage const&, fs::path const&, file_pool&);
+
+	// a storage that keeps the pieces in disk buffers instead of
+	// files, up to session_settings::ram_storage_size. Nothing is
+	// written to disk and nothing is left once the torrent is removed
+	TORRENT_EXPORT storage_interface* ram_storage_constructor(
+		file_storage const&, fs::path const&, file_pool&);
+
 	struct disk_io_thread;
 
 	class TORRENT_EXPORT piece_manager
@@ -227,10 +358,13 @@ namespace libtorrent
 		void async_rename_file(int index, std::string const& name
 			, boost::function<void(int, disk_io_job const&)> const& handler);
 
+		// read_ahead is the number of bytes following r in the
+		// piece that are expected to be read next, or -1 if unknown.
+		// See disk_io_job::read_ahead
 		void async_read(
 			peer_request const& r
 			, boost::function<void(int, disk_io_job const&)> const& handler
-			, int priority = 0);
+			, int priority = 0, int read_ahead = -1);
 
 		void async_read_and_hash(
 			peer_request const& r
@@ -242,7 +376,19 @@ namespace libtorrent
 			, disk_buffer_holder& buffer
 			, boost::function<void(int, disk_io_job const&)> const& f);
 
-		void async_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f);
+		void async_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f
+			, int priority = 0);
+
+		// returns the file that r can be sent from directly, and
+		// sets file_offset to where it starts in the file. If r has
+		// to be read through the disk thread, an empty pointer is
+		// returned. See storage_interface::file_for_range()
+		boost::shared_ptr<file> file_for_request(peer_request const& r
+			, size_type& file_offset);
+
+		// appends the pieces the storage has dropped since the
+		// last call. See storage_interface::dropped_slots()
+		void dropped_pieces(std::vector<int>& pieces);
 
 		void async_release_files(
 			boost::function<void(int, disk_io_job const&)> const& handler
@@ -254,6 +400,12 @@ namespace libtorrent
 			boost::function<void(int, disk_io_job const&)> const& handler
 			= boost::function<void(int, disk_io_job const&)>());
 
+		// frees the space a piece we no longer have takes, where
+		// the storage supports it. See storage_interface::discard_slot()
+		void async_discard_piece(int piece
+			, boost::function<void(int, disk_io_job const&)> const& handler
+			= boost::function<void(int, disk_io_job const&)>());
+
 		void async_delete_files(
 			boost::function<void(int, disk_io_job const&)> const& handler
 			= boost::function<void(int, disk_io_job const&)>());
@@ -275,8 +427,21 @@ namespace libtorrent
 
 		storage_interface* get_storage_impl() { return m_storage.get(); }
 
+		// copies the disk counters of this storage to st. The per
+		// file counters are only copied if file_reads is true
+		void get_io_stats(torrent_io_stats& st, bool file_reads) const;
+
 	private:
 
+		// add to m_io_stats. The reads are counted against the
+		// files the range starting at offset in slot maps to
+		void count_read(int slot, int offset, int size);
+		void count_write(int size);
+		// called by the disk thread for every block it passes
+		// back to the bittorrent engine, and every job it runs
+		void count_block_read(int blocks, bool hit);
+		void count_job(time_duration queued, time_duration run);
+
 		fs::path save_path() const;
 
 		bool verify_resume_data(lazy_entry const& rd, std::string& error)
@@ -304,6 +469,11 @@ namespace libtorrent
 		// when wrong in the disk access
 		int check_fastresume(lazy_entry const& rd, std::string& error);
 
+		// hashes a random sample of the pieces the resume data says
+		// we have, in the files the storage reported as touched.
+		// Returns false, with error set, if any of them fails
+		bool spot_check_pieces(lazy_entry const& rd, std::string& error);
+
 		// this function returns true if the checking is complete
 		int check_files(int& current_slot, int& have_piece, std::string& error);
 
@@ -328,15 +498,57 @@ namespace libtorrent
 			, int offset
 			, int num_bufs);
 
+		// if update_hash is false, the data isn't added to the
+		// partial hash of the piece. This is used by the write
+		// cache, which hashes blocks as soon as they're in order
 		int write_impl(
 			file::iovec_t* bufs
 			, int piece_index
 			, int offset
-			, int num_bufs);
+			, int num_bufs
+			, bool update_hash = true);
+
+		// a slot read ahead of the one being checked, and its
+		// hashes once they're computed
+		struct check_slot
+		{
+			check_slot(): slot(0), piece_size(0), small_piece_size(0)
+				, num_read(0), done(false) {}
+			int slot;
+			int piece_size;
+			int small_piece_size;
+			// the number of bytes read from the slot. If it's less
+			// than piece_size, the slot isn't hashed and error holds
+			// the storage error the read failed with, if any
+			int num_read;
+			std::vector<char*> blocks;
+			error_code error;
+			std::string error_file;
+			sha1_hash large_hash;
+			sha1_hash small_hash;
+			// set once blocks have been hashed and freed.
+			// Protected by m_check_mutex
+			bool done;
+		};
+
+		// the full check's counterpart to hash_for_slot(). It keeps
+		// file_checks_read_ahead slots past this one read and being
+		// hashed by the hash threads. Returns false if no disk
+		// buffers could be allocated for the slot
+		bool hash_for_check(int slot, int& num_read, sha1_hash& large_hash
+			, sha1_hash& small_hash);
+		void read_ahead_for_check(int slot);
+		void hash_check_slot(boost::shared_ptr<check_slot> s);
+		// waits for the outstanding read-ahead slots to be hashed
+		// and forgets them
+		void clear_check_queue();
 
 		// returns the number of pieces left in the
 		// file currently being checked
 		int skip_file() const;
+		// returns the first slot from the current one that isn't
+		// entirely in a hole of a sparse file
+		int skip_holes();
 		// -1=error 0=ok >0=skip this many pieces
 		int check_one_piece(int& have_piece);
 		int identify_data(
@@ -347,14 +559,33 @@ namespace libtorrent
 		void switch_to_full_mode();
 		sha1_hash hash_for_piece_impl(int piece);
 
+		// removes and returns the hash state of the part of the
+		// piece that has been written in order so far
+		partial_hash take_partial_hash(int piece);
+		// hands back the hash state taken by take_partial_hash()
+		// once the hashed part of the piece has been written
+		void put_partial_hash(int piece, partial_hash const& ph);
+
 		int release_files_impl() { return m_storage->release_files(); }
-		int delete_files_impl() { return m_storage->delete_files(); }
-		int rename_file_impl(int index, std::string const& new_filename)
-		{ return m_storage->rename_file(index, new_filename); }
+		// returns 1 while there are files left to delete, 0 when
+		// done and -1 on errors. See delete_files_chunk()
+		int delete_files_impl(int& progress);
+		int rename_file_impl(int index, std::string const& new_filename);
+
+		int move_storage_impl(fs::path const& save_path, int& progress);
 
-		int move_storage_impl(fs::path const& save_path);
+		void hint_read_impl(int piece, int offset, int size);
+
+		void discard_piece_impl(int piece);
 
 		int allocate_slot_for_piece(int piece_index);
+
+		// queues a job to move the pieces in m_pending_relocations
+		// into their slots, unless there's one already
+		void queue_relocation();
+		// moves one piece from m_pending_relocations into its slot.
+		// Returns the number of pieces left to move
+		int relocate_piece_impl();
 #ifdef TORRENT_DEBUG
 		void check_invariant() const;
 #ifdef TORRENT_STORAGE_DEBUG
@@ -373,6 +604,15 @@ namespace libtorrent
 		// slots that have file storage, but isn't assigned to a piece
 		std::vector<int> m_free_slots;
 
+		// pieces that are stored in another slot than their own, and
+		// should be moved there by a relocate_pieces job. Moving a
+		// piece means reading and writing all of it, which is too slow
+		// to do while writing a block. The storage can't switch to full
+		// allocation mode until they're all moved
+		std::vector<int> m_pending_relocations;
+		// true while there's a relocate_pieces job in the disk queue
+		bool m_relocation_queued;
+
 		enum
 		{
 			has_no_slot = -3 // the piece has no storage
@@ -411,6 +651,11 @@ namespace libtorrent
 		// that is not in its final position, this
 		// is set to true
 		bool m_out_of_place;
+		// set once the torrent has been searched for pieces of
+		// all zeros. Those may be stored in holes, so if there
+		// is one, holes are checked like any other slot
+		bool m_zero_piece_checked;
+		bool m_has_zero_piece;
 		// used to move pieces while expanding
 		// the storage from compact allocation
 		// to full allocation
@@ -427,6 +672,12 @@ namespace libtorrent
 		// build the first time it is used (to save time if it
 		// isn't needed) 				
 		std::multimap<sha1_hash, int> m_hash_to_piece;
+
+		// the slots read ahead by the full check, in slot order.
+		// Only touched by the disk thread checking the storage
+		std::deque<boost::shared_ptr<check_slot> > m_check_queue;
+		boost::mutex m_check_mutex;
+		boost::condition m_check_signal;
 	
 		// this map contains partial hashes for downloading
 		// pieces. This is only accessed from within the
@@ -435,6 +686,31 @@ namespace libtorrent
 
 		disk_io_thread& m_io_thread;
 
+		// the disk thread job queue this storage's jobs are
+		// posted to. It's assigned by the disk_io_thread the
+		// first time a job is added, -1 means unassigned.
+		// Protected by the disk_io_thread's queue mutex
+		int m_disk_queue;
+
+		// the disk_io_class_t of this storage's jobs. Protected
+		// by the disk_io_thread's queue mutex
+		int m_io_class;
+
+		// the number of this storage's blocks in the disk cache,
+		// the most it may have in the cache (-1 means no limit)
+		// and the number of read cache blocks it may keep when
+		// other storages need room. Protected by the
+		// disk_io_thread's piece mutex
+		int m_cached_blocks;
+		int m_cache_limit;
+		int m_cache_reservation;
+
+		// this storage's disk activity. file_bytes_read has one
+		// entry per file. Updated by the disk threads and read by
+		// the network thread, so it has its own mutex
+		torrent_io_stats m_io_stats;
+		mutable boost::mutex m_io_stats_mutex;
+
 		// the reason for this to be a void pointer
 		// is to avoid creating a dependency on the
 		// torrent. This shared_ptr is here only
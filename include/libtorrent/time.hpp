@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_TIME_HPP_INCLUDED
 
 #include <ctime>
+#include <string>
 #include <boost/version.hpp>
 #include "libtorrent/config.hpp"
 
@@ -66,6 +67,7 @@ namespace libtorrent
 	typedef boost::posix_time::time_duration time_duration;
 	inline ptime time_now_hires()
 	{ return boost::posix_time::microsec_clock::universal_time(); }
+	inline ptime time_now_coarse() { return time_now_hires(); }
 	inline ptime min_time()
 	{ return boost::posix_time::ptime(boost::posix_time::min_date_time); }
 	inline ptime max_time()
@@ -158,6 +160,7 @@ namespace libtorrent
 	{ return ptime(lhs.time - rhs.diff); }
 
 	ptime time_now_hires();
+	ptime time_now_coarse();
 	inline ptime min_time() { return ptime(0); }
 	inline ptime max_time() { return ptime((std::numeric_limits<boost::uint64_t>::max)()); }
 	int total_seconds(time_duration td);
@@ -228,6 +231,8 @@ namespace libtorrent
 		return ptime(at / 1000 * timebase_info.numer / timebase_info.denom);
 	}
 
+	inline ptime time_now_coarse() { return time_now_hires(); }
+
 	inline time_duration microsec(boost::int64_t s)
 	{
 		return time_duration(s);
@@ -313,6 +318,8 @@ namespace libtorrent
 		return ptime(now.QuadPart);
 	}
 
+	inline ptime time_now_coarse() { return time_now_hires(); }
+
 	inline time_duration microsec(boost::int64_t s)
 	{
 		return time_duration(aux::microseconds_to_performance_counter(s));
@@ -367,6 +374,21 @@ namespace libtorrent
 		return ptime(boost::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
 	}
 
+	// the coarse clock has the same origin as the monotonic clock,
+	// but is only as precise as the kernel tick (a few milliseconds).
+	// It's a lot cheaper to read, since it doesn't need to read the
+	// hardware clock
+	inline ptime time_now_coarse()
+	{
+#ifdef CLOCK_MONOTONIC_COARSE
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ptime(boost::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+#else
+		return time_now_hires();
+#endif
+	}
+
 	inline time_duration microsec(boost::int64_t s)
 	{
 		return time_duration(s);
@@ -399,6 +421,18 @@ namespace libtorrent
 	namespace aux
 	{
 		extern ptime g_current_time;
+
+		// refreshes the time returned by time_now() from the coarse
+		// clock. The network thread calls this at the start of handlers
+		// that look at the time, so that all the time_now() calls made
+		// while handling the event are cheap and reasonably current. The
+		// cached time never moves backwards
+		inline ptime const& update_time_now()
+		{
+			ptime now = time_now_coarse();
+			if (now > g_current_time) g_current_time = now;
+			return g_current_time;
+		}
 	}
 
 	inline ptime const& time_now() { return aux::g_current_time; }
@@ -70,6 +70,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/bitfield.hpp"
+#include "libtorrent/block_math.hpp"
+#include "libtorrent/extensions.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 
 namespace libtorrent
@@ -159,7 +161,19 @@ namespace libtorrent
 		void start_announcing();
 		void stop_announcing();
 
+#ifndef TORRENT_DISABLE_DHT
+		// announces this torrent to the DHT, unless it's not
+		// supposed to be announced or it was announced recently.
+		// This is driven by the session, which spreads the
+		// announces of all torrents out over time. Returns true
+		// if an announce was issued
+		bool dht_announce();
+#endif
+
+		// the rank is cached until one of its inputs changes, see
+		// m_seed_rank_expires
 		int seed_rank(session_settings const& s) const;
+		void invalidate_seed_rank() { m_seed_rank_valid = false; }
 
 		enum flags_t { overwrite_existing = 1 };
 		void add_piece(int piece, char const* data, int flags = 0);
@@ -175,6 +189,17 @@ namespace libtorrent
 		void read_piece(int piece);
 		void on_disk_read_complete(int ret, disk_io_job const& j, peer_request r, read_piece_struct* rp);
 
+		// posts a read_range_alert for every block of the range,
+		// as the pieces it covers become available. Missing pieces
+		// are requested with the given deadline (in milliseconds)
+		void read_range(size_type offset, int size, int deadline);
+		void read_piece_range(int piece, int start, int size);
+		void on_range_read_complete(int ret, disk_io_job const& j
+			, peer_request r, int skip, int size);
+		// starts the pending range reads of piece, or of every
+		// piece we have if it's -1
+		void service_range_reads(int piece = -1);
+
 		storage_mode_t storage_mode() const { return m_storage_mode; }
 		storage_interface* get_storage()
 		{
@@ -205,6 +230,25 @@ namespace libtorrent
 
 		void second_tick(stat& accumulator, float tick_interval);
 
+		// paused torrents without peers stop being ticked once
+		// their rates have faded out. They're added back to the
+		// session's ticking list when they're resumed
+		bool wants_tick() const
+		{ return !is_paused() || !m_connections.empty() || !m_stat.is_idle(); }
+
+		// the position of this torrent in the session's list
+		// of torrents to tick, -1 if it's not in it
+		int m_tick_index;
+
+		// called when something that's part of torrent_status
+		// changes, to have the torrent included in the next
+		// state_update_alert
+		void state_updated();
+
+		// true while the torrent is in the session's list of
+		// torrents to post state updates for
+		bool m_in_state_updates;
+
 		std::string name() const;
 
 		stat statistics() const { return m_stat; }
@@ -215,6 +259,8 @@ namespace libtorrent
 		size_type quantized_bytes_done() const;
 
 		void ip_filter_updated() { m_policy.ip_filter_updated(); }
+		int ip_filter_updated(std::vector<ip_range<address> > const& ranges)
+		{ return m_policy.ip_filter_updated(ranges); }
 
 		void clear_error();
 		void set_error(error_code const& ec, std::string const& file);
@@ -223,13 +269,22 @@ namespace libtorrent
 		void resume();
 
 		ptime started() const { return m_started; }
-		void do_pause();
-		void do_resume();
+		// post_alert is false when the session pauses or resumes
+		// all torrents, it posts a single alert for all of them
+		void do_pause(bool post_alert = true);
+		void do_resume(bool post_alert = true);
 
 		bool is_paused() const;
 		bool is_torrent_paused() const { return m_paused; }
 		void force_recheck();
+
+		// drops this torrent's pieces from the read cache. Used
+		// by the session when it runs short of memory
+		void clear_read_cache();
 		void save_resume_data();
+		// true if anything that's saved in the resume data has
+		// changed since save_resume_data() was last called
+		bool need_save_resume_data() const { return m_need_save_resume_data; }
 
 		bool is_auto_managed() const { return m_auto_managed; }
 		void auto_managed(bool a);
@@ -263,11 +318,20 @@ namespace libtorrent
 
 		void set_piece_deadline(int piece, time_duration t, int flags);
 		void update_piece_priorities();
+		// recomputes the priorities of the pieces overlapping the
+		// files first_file to last_file (inclusive)
+		void update_piece_priorities(int first_file, int last_file);
+		// sets the priorities of the pieces starting at 'first'
+		void prioritize_piece_range(int first, std::vector<int> const& pieces);
 
-		torrent_status status() const;
+		// flags are torrent_handle::status_flags_t
+		torrent_status status(boost::uint32_t flags = 0xffffffff) const;
 
 		void file_progress(std::vector<size_type>& fp) const;
 
+		// flags are torrent_handle::io_stats_flags_t
+		void get_io_stats(torrent_io_stats& st, int flags) const;
+
 		void use_interface(const char* net_interface);
 		tcp::endpoint const& get_interface() const { return m_net_interface; }
 		
@@ -275,7 +339,11 @@ namespace libtorrent
 		bool connect_to_peer(policy::peer* peerinfo);
 
 		void set_ratio(float ratio)
-		{ TORRENT_ASSERT(ratio >= 0.0f); m_ratio = ratio; }
+		{
+			TORRENT_ASSERT(ratio >= 0.0f);
+			m_ratio = ratio;
+			m_need_save_resume_data = true;
+		}
 
 		float ratio() const
 		{ return m_ratio; }
@@ -300,10 +368,16 @@ namespace libtorrent
 		// add or remove a url that will be attempted for
 		// finding the file(s) in this torrent.
 		void add_web_seed(std::string const& url, web_seed_entry::type_t type)
-		{ m_web_seeds.insert(web_seed_entry(url, type)); }
+		{
+			m_web_seeds.insert(web_seed_entry(url, type));
+			m_need_save_resume_data = true;
+		}
 	
 		void remove_web_seed(std::string const& url, web_seed_entry::type_t type)
-		{ m_web_seeds.erase(web_seed_entry(url, type)); }
+		{
+			m_web_seeds.erase(web_seed_entry(url, type));
+			m_need_save_resume_data = true;
+		}
 
 		void retry_web_seed(std::string const& url, web_seed_entry::type_t type, int retry = 0);
 
@@ -351,8 +425,10 @@ namespace libtorrent
 		void resolve_peer_country(boost::intrusive_ptr<peer_connection> const& p) const;
 
 		void get_full_peer_list(std::vector<peer_list_entry>& v) const;
-		void get_peer_info(std::vector<peer_info>& v);
+		// flags are torrent_handle::peer_info_flags_t
+		void get_peer_info(std::vector<peer_info>& v, boost::uint32_t flags);
 		void get_download_queue(std::vector<partial_piece_info>& queue);
+		void get_download_queue_snapshot(download_queue_snapshot& queue);
 
 // --------------------------------------------
 		// TRACKER MANAGEMENT
@@ -375,6 +451,7 @@ namespace libtorrent
 			, std::string const& msg);
 		virtual void tracker_scrape_response(tracker_request const& req
 			, int complete, int incomplete, int downloaded);
+		virtual int tracker_request_priority() const;
 
 		// if no password and username is set
 		// this will return an empty string, otherwise
@@ -411,12 +488,40 @@ namespace libtorrent
 
 		void update_sparse_piece_prio(int piece, int cursor, int reverse_cursor);
 
+		// the read cache pieces peers are steered towards when
+		// suggest_mode is suggest_read_cache, most recently used first
+		std::vector<int> const& suggested_pieces() const
+		{ return m_suggested_pieces; }
+
 		bool super_seeding() const
 		{ return m_super_seeding; }
+
+		// in share mode, the torrent only downloads the pieces that
+		// are rare among its peers and wanted by them, up to
+		// share_mode_size, to upload them. It never completes
+		bool share_mode() const { return m_share_mode; }
+		void set_share_mode(bool s);
 		
 		void super_seeding(bool on);
 		int get_piece_to_super_seed(bitfield const&);
 
+		// called by the peer connections when the piece they
+		// super seed changes. -1 means none
+		void superseed_piece_changed(int old_piece, int new_piece)
+		{
+			if (m_superseed_assigned.empty()) return;
+			if (old_piece >= 0 && m_superseed_assigned[old_piece] > 0)
+				--m_superseed_assigned[old_piece];
+			if (new_piece >= 0) ++m_superseed_assigned[new_piece];
+		}
+
+		// returns false if no peer is super seeded this piece
+		bool superseeding_piece(int piece) const
+		{
+			return m_superseed_assigned.empty()
+				|| m_superseed_assigned[piece] > 0;
+		}
+
 		// returns true if we have downloaded the given piece
 		bool have_piece(int index) const
 		{
@@ -438,12 +543,11 @@ namespace libtorrent
 				TORRENT_ASSERT(!is_seed());
 				m_picker->inc_refcount(index);
 			}
-#ifdef TORRENT_DEBUG
 			else
 			{
 				TORRENT_ASSERT(is_seed());
+				if (!m_superseed_avail.empty()) ++m_superseed_avail[index];
 			}
-#endif
 		}
 		
 		// when we get a bitfield message, this is called for that piece
@@ -454,12 +558,14 @@ namespace libtorrent
 				TORRENT_ASSERT(!is_seed());
 				m_picker->inc_refcount(bits);
 			}
-#ifdef TORRENT_DEBUG
 			else
 			{
 				TORRENT_ASSERT(is_seed());
+				if (m_superseed_avail.empty()) return;
+				for (int i = bits.find_first_set(0); i >= 0
+					; i = bits.find_first_set(i + 1))
+					++m_superseed_avail[i];
 			}
-#endif
 		}
 
 		void peer_has_all()
@@ -469,12 +575,13 @@ namespace libtorrent
 				TORRENT_ASSERT(!is_seed());
 				m_picker->inc_refcount_all();
 			}
-#ifdef TORRENT_DEBUG
 			else
 			{
 				TORRENT_ASSERT(is_seed());
+				for (std::vector<boost::uint16_t>::iterator i = m_superseed_avail.begin()
+					, end(m_superseed_avail.end()); i != end; ++i)
+					++*i;
 			}
-#endif
 		}
 
 		void peer_lost(int index)
@@ -484,15 +591,17 @@ namespace libtorrent
 				TORRENT_ASSERT(!is_seed());
 				m_picker->dec_refcount(index);
 			}
-#ifdef TORRENT_DEBUG
 			else
 			{
 				TORRENT_ASSERT(is_seed());
+				if (!m_superseed_avail.empty() && m_superseed_avail[index] > 0)
+					--m_superseed_avail[index];
 			}
-#endif
 		}
 
 		int block_size() const { TORRENT_ASSERT(m_block_size > 0); return m_block_size; }
+		// divides offsets into blocks of block_size()
+		block_math const& block_arithmetic() const { return m_block_math; }
 		peer_request to_req(piece_block const& p);
 
 		void disconnect_all();
@@ -508,14 +617,14 @@ namespace libtorrent
 		void on_peer_name_lookup(error_code const& e, tcp::resolver::iterator i
 			, peer_id pid);
 
-		// this is the asio callback that is called when a name
+		// this is the callback that is called when a name
 		// lookup for a WEB SEED is completed.
-		void on_name_lookup(error_code const& e, tcp::resolver::iterator i
-			, web_seed_entry url, tcp::endpoint proxy);
+		void on_name_lookup(error_code const& e, std::vector<address> const& addresses
+			, web_seed_entry url, int port, tcp::endpoint proxy);
 
-		// this is the asio callback that is called when a name
+		// this is the callback that is called when a name
 		// lookup for a proxy for a web seed is completed.
-		void on_proxy_name_lookup(error_code const& e, tcp::resolver::iterator i
+		void on_proxy_name_lookup(error_code const& e, std::vector<address> const& addresses
 			, web_seed_entry url);
 
 		// this is called when the torrent has finished. i.e.
@@ -551,6 +660,19 @@ namespace libtorrent
 		// this is done when a piece fails
 		void restore_piece_state(int index);
 
+		// piece_evicted is called when the storage has dropped a
+		// piece we have, like ram_storage does when it's full. The
+		// piece is downloaded again if it's wanted
+		void piece_evicted(int index);
+
+		// drops a piece we have to make room for a rarer one in
+		// share mode, and frees the space it takes in the storage
+		void discard_piece(int index);
+
+		// picks the next piece to download in share mode, and
+		// makes room for it if we're at share_mode_size
+		void recalc_share_mode();
+
 		void add_redundant_bytes(int b);
 		void add_failed_bytes(int b);
 
@@ -582,8 +704,13 @@ namespace libtorrent
 		{
 			return m_picker.get() != 0;
 		}
+		bool is_end_game() const
+		{
+			return has_picker() && m_picker->is_end_game();
+		}
 		policy& get_policy() { return m_policy; }
 		piece_manager& filesystem();
+		bool has_storage() const { return m_owning_storage.get() != 0; }
 		torrent_info const& torrent_file() const
 		{ return *m_torrent_file; }
 
@@ -619,11 +746,25 @@ namespace libtorrent
 		void set_download_limit(int limit);
 		int download_limit() const;
 
+		// -1 takes the torrent out of its bandwidth class
+		void set_bandwidth_class(int c);
+
 		void set_max_uploads(int limit);
 		int max_uploads() const { return m_max_uploads; }
 		void set_max_connections(int limit);
 		int max_connections() const { return m_max_connections; }
 
+		void set_cache_limit(int blocks);
+		int cache_limit() const { return m_cache_limit; }
+		void set_cache_reservation(int blocks);
+		int cache_reservation() const { return m_cache_reservation; }
+		void set_io_class(int c);
+		int io_class() const { return m_io_class; }
+
+		size_type device_id() const { return m_device_id; }
+		bool write_throttled() const { return m_write_throttled; }
+		void set_write_throttled(bool t);
+
 		void move_storage(fs::path const& save_path);
 
 		// renames the file with the given index to the new name
@@ -662,6 +803,11 @@ namespace libtorrent
 		}
 		bool all_verified() const
 		{ return m_num_verified == m_torrent_file->num_pieces(); }
+
+		// hashes the unverified pieces in seed mode in the background,
+		// keeping seed_mode_background_hashes jobs in the disk queue
+		void verify_seed_pieces();
+		void on_seed_piece_verified(int ret, disk_io_job const& j);
 		bool verified_piece(int piece) const
 		{
 			TORRENT_ASSERT(piece < int(m_verified.size()));
@@ -677,19 +823,22 @@ namespace libtorrent
 			m_verified.set_bit(piece);
 		}
 
-		bool add_merkle_nodes(std::map<int, sha1_hash> const& n, int piece);
+		bool add_merkle_nodes(merkle_node_list const& n, int piece);
 
 	private:
 
 		void on_files_deleted(int ret, disk_io_job const& j);
 		void on_files_released(int ret, disk_io_job const& j);
-		void on_torrent_paused(int ret, disk_io_job const& j);
+		void on_torrent_paused(int ret, disk_io_job const& j, bool post_alert);
 		void on_storage_moved(int ret, disk_io_job const& j);
 		void on_save_resume_data(int ret, disk_io_job const& j);
 		void on_file_renamed(int ret, disk_io_job const& j);
 
 		void on_piece_verified(int ret, disk_io_job const& j
 			, boost::function<void(int)> f);
+
+		void resume_unfinished_piece(int piece, char const* bitmask
+			, int num_bitmask_bytes);
 	
 		int prioritize_tracker(int tracker_index);
 		int deprioritize_tracker(int tracker_index);
@@ -725,6 +874,17 @@ namespace libtorrent
 		// recently was started, to avoid oscillation
 		ptime m_started;
 
+		// the cached result of seed_rank(). It's computed again once
+		// m_seed_rank_expires passes, which is the first time one of
+		// its time based terms (the seed time limits and the bias
+		// towards recently started torrents) may change, or once
+		// m_total_uploaded reaches m_seed_rank_upload_limit, where
+		// the share ratio limit is met. Scrapes, state changes and
+		// settings changes invalidate it
+		mutable ptime m_seed_rank_expires;
+		mutable size_type m_seed_rank_upload_limit;
+		mutable int m_seed_rank;
+
 		// the last time we initiated a scrape request to
 		// one of the trackers in this torrent
 		ptime m_last_scrape;
@@ -781,6 +941,10 @@ namespace libtorrent
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		typedef std::list<boost::shared_ptr<torrent_plugin> > extension_list_t;
 		extension_list_t m_extensions;
+
+		// the plugins in m_extensions, grouped by the
+		// hooks they implement
+		extension_hooks<torrent_plugin> m_hooks;
 #endif
 
 		// used to resolve the names of web seeds
@@ -812,6 +976,9 @@ namespace libtorrent
 		static void on_dht_announce_response_disp(boost::weak_ptr<torrent> t
 			, std::vector<tcp::endpoint> const& peers);
 		void on_dht_announce_response(std::vector<tcp::endpoint> const& peers);
+		static void on_dht_scrape_disp(boost::weak_ptr<torrent> t
+			, int seeds, int downloaders);
+		void on_dht_scrape(int seeds, int downloaders);
 		bool should_announce_dht() const;
 
 		// the time when the DHT was last announced of our
@@ -855,12 +1022,22 @@ namespace libtorrent
 		};
 
 		void remove_time_critical_piece(int piece, bool finished = false);
-		void remove_time_critical_pieces(std::vector<int> const& priority);
+		void remove_time_critical_pieces(int first, std::vector<int> const& priority);
 		void request_time_critical_pieces();
 
 		// this list is sorted by time_critical_piece::deadline
 		std::list<time_critical_piece> m_time_critical_pieces;
 
+		// the parts of read_range() requests that are waiting for
+		// their piece to be downloaded. start is relative to the piece
+		struct pending_range_read
+		{
+			int piece;
+			int start;
+			int size;
+		};
+		std::list<pending_range_read> m_pending_range_reads;
+
 		// the average time it takes to download one time critical piece
 		time_duration m_average_piece_time;
 		// the average piece download time deviation
@@ -891,6 +1068,33 @@ namespace libtorrent
 		// m_num_verified = m_verified.count()
 		int m_num_verified;
 
+		// while super seeding as a seed, the number of connected
+		// peers that have each piece (the piece picker that
+		// normally keeps track of this is gone by then) and the
+		// number of peers each piece is super seeded to. They're
+		// built the first time a piece is picked and are empty
+		// when not super seeding
+		std::vector<boost::uint16_t> m_superseed_avail;
+		std::vector<boost::uint16_t> m_superseed_assigned;
+		void init_superseed_state();
+
+		// refreshed from the read cache every 10 seconds when
+		// suggest_mode is suggest_read_cache. No more than peers keep
+		// (see peer_connection::incoming_suggest)
+		enum { max_suggested_pieces = 10 };
+		std::vector<int> m_suggested_pieces;
+		void update_suggested_pieces();
+
+		// asks the storage for the pieces it has dropped on its own
+		// since the last tick, see piece_manager::dropped_pieces()
+		void update_evicted_pieces();
+
+		// in seed mode, the next piece the background
+		// verification will hash, and the number of its
+		// hash jobs in the disk queue
+		int m_verify_cursor;
+		int m_outstanding_verify;
+
 		// determines the storage state for this torrent.
 		storage_mode_t m_storage_mode;
 
@@ -937,10 +1141,25 @@ namespace libtorrent
 		// the maximum number of connections for this torrent
 		int m_max_connections;
 
+		// the maximum number of blocks this torrent may have in
+		// the disk cache, -1 means no limit
+		int m_cache_limit;
+
+		// the number of read cache blocks this torrent keeps when
+		// other torrents need room in the cache
+		int m_cache_reservation;
+
+		// the disk_io_class_t of this torrent's disk jobs
+		int m_io_class;
+
+		// the device the files are saved on, see device_id()
+		size_type m_device_id;
+
 		// the size of a request block
 		// each piece is divided into these
 		// blocks when requested
 		int m_block_size;
+		block_math m_block_math;
 
 		// -----------------------------
 		// DATA FROM TRACKER RESPONSE
@@ -1018,6 +1237,13 @@ namespace libtorrent
 		// its value until the piece picker is created
 		bool m_sequential_download:1;
 
+		// set when something that goes into the resume data
+		// changes, and cleared when saving it is started
+		bool m_need_save_resume_data:1;
+
+		// true while m_seed_rank can be used
+		mutable bool m_seed_rank_valid:1;
+
 		// is false by default and set to
 		// true when the first tracker reponse
 		// is received
@@ -1069,6 +1295,14 @@ namespace libtorrent
 		// this is set when we don't want to load seed_mode,
 		// paused or auto_managed from the resume data
 		bool m_override_resume_data:1;
+
+		// set while the device the torrent is saved on has more
+		// than its share of the write cache. Peers don't receive
+		// while it's set
+		bool m_write_throttled:1;
+
+		// see share_mode()
+		bool m_share_mode:1;
 	};
 
 	inline ptime torrent::next_announce() const
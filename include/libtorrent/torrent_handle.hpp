@@ -117,6 +117,8 @@ namespace libtorrent
 			, has_incoming(false)
 			, sparse_regions(0)
 			, seed_mode(false)
+			, share_mode(false)
+			, cache_blocks(0)
 		{}
 
 		enum state_t
@@ -273,6 +275,16 @@ namespace libtorrent
 
 		// is true if this torrent is (still) in seed_mode
 		bool seed_mode;
+
+		// is true if this torrent is in share mode
+		bool share_mode;
+
+		// the number of blocks this torrent has in the disk cache
+		int cache_blocks;
+
+		// identifies the torrent this status belongs to, to be used
+		// with session::find_torrent()
+		sha1_hash info_hash;
 	};
 
 	struct TORRENT_EXPORT block_info
@@ -340,6 +352,42 @@ namespace libtorrent
 		state_t piece_state;
 	};
 
+	// a compact form of the download queue. Instead of one block_info
+	// per block (with the peer's endpoint in each of them) every block is
+	// a single word, and the peers are stored once in a side table. The
+	// vectors keep their capacity across calls, so polling with the same
+	// object doesn't allocate once it has grown to the size of the queue
+	struct TORRENT_EXPORT download_queue_snapshot
+	{
+		struct piece_entry
+		{
+			int piece_index;
+			// the index into blocks of the first block of this piece
+			int first_block;
+			boost::uint16_t blocks_in_piece;
+			// partial_piece_info::state_t
+			boost::uint8_t piece_state;
+		};
+
+		enum { state_mask = 3, peer_shift = 2 };
+
+		// bits 0-1 are the block_info::block_state_t of the block. The
+		// remaining bits are the index into peers of the peer the block
+		// was requested from, plus one. 0 means no peer
+		std::vector<boost::uint32_t> blocks;
+		std::vector<piece_entry> pieces;
+		std::vector<tcp::endpoint> peers;
+
+		int block_state(int block) const
+		{ return blocks[block] & state_mask; }
+
+		// returns -1 if the block isn't associated with a peer
+		int block_peer(int block) const
+		{ return int(blocks[block] >> peer_shift) - 1; }
+
+		void clear() { blocks.clear(); pieces.clear(); peers.clear(); }
+	};
+
 	struct TORRENT_EXPORT torrent_handle
 	{
 		friend class invariant_access;
@@ -351,11 +399,32 @@ namespace libtorrent
 		enum flags_t { overwrite_existing = 1 };
 		void add_piece(int piece, char const* data, int flags = 0) const;
 		void read_piece(int piece) const;
+		void read_range(size_type offset, int size, int deadline = 0) const;
 
 		void get_full_peer_list(std::vector<peer_list_entry>& v) const;
-		void get_peer_info(std::vector<peer_info>& v) const;
-		torrent_status status() const;
+		enum peer_info_flags_t
+		{
+			// peer_info::pieces. Copying it costs one bitfield
+			// allocation per peer
+			query_peer_pieces = 1
+		};
+		void get_peer_info(std::vector<peer_info>& v
+			, boost::uint32_t flags = 0xffffffff) const;
+		// the fields of torrent_status that are expensive to fill
+		// in, and only computed when asked for. The rest of the
+		// fields are always filled in
+		enum status_flags_t
+		{
+			// distributed_copies, otherwise it's -1
+			query_distributed_copies = 1,
+			// pieces and sparse_regions
+			query_pieces = 2,
+			// cache_blocks. Counting them locks the disk cache
+			query_cache_blocks = 4
+		};
+		torrent_status status(boost::uint32_t flags = 0xffffffff) const;
 		void get_download_queue(std::vector<partial_piece_info>& queue) const;
+		void get_download_queue(download_queue_snapshot& queue) const;
 
 		enum deadline_flags { alert_when_available = 1 };
 		void set_piece_deadline(int index, time_duration deadline, int flags = 0) const;
@@ -399,6 +468,7 @@ namespace libtorrent
 		void resume() const;
 		void force_recheck() const;
 		void save_resume_data() const;
+		bool need_save_resume_data() const;
 
 		bool is_auto_managed() const;
 		void auto_managed(bool m) const;
@@ -437,6 +507,11 @@ namespace libtorrent
 #endif
 
 		void piece_availability(std::vector<int>& avail) const;
+
+		// fills in st with the disk activity of this torrent. The per
+		// file read counters are only copied with query_file_reads
+		enum io_stats_flags_t { query_file_reads = 1 };
+		void get_io_stats(torrent_io_stats& st, int flags = 0) const;
 		
 		// priority must be within the range [0, 7]
 		void piece_priority(int index, int priority) const;
@@ -490,6 +565,10 @@ namespace libtorrent
 		void set_download_limit(int limit) const;
 		int download_limit() const;
 
+		// puts the torrent in a bandwidth class created with
+		// session::create_bandwidth_class(). -1 takes it out
+		void set_bandwidth_class(int c) const;
+
 		void set_sequential_download(bool sd) const;
 		bool is_sequential_download() const;
 
@@ -513,6 +592,21 @@ namespace libtorrent
 		void set_max_connections(int max_connections) const;
 		int max_connections() const;
 
+		// the maximum number of blocks the torrent may have in the
+		// disk cache. -1 means unlimited
+		void set_cache_limit(int blocks) const;
+		int cache_limit() const;
+
+		// the number of read cache blocks the torrent keeps when
+		// other torrents need room in the cache
+		void set_cache_reservation(int blocks) const;
+		int cache_reservation() const;
+
+		// the disk I/O class of the torrent's disk jobs, one of
+		// latency_io_class, normal_io_class and bulk_io_class
+		void set_io_class(int c) const;
+		int io_class() const;
+
 		void set_tracker_login(std::string const& name
 			, std::string const& password) const;
 
@@ -528,6 +622,8 @@ namespace libtorrent
 		bool super_seeding() const;
 		void super_seeding(bool on) const;
 
+		void set_share_mode(bool s) const;
+
 		sha1_hash info_hash() const;
 
 		bool operator==(const torrent_handle& h) const
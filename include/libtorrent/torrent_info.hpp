@@ -44,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/optional.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -66,6 +67,8 @@ namespace libtorrent
 	namespace gr = boost::gregorian;
 	namespace fs = boost::filesystem;
 
+	struct piece_hash_file;
+
 	enum
 	{
 		// wait 60 seconds before retrying a failed tracker
@@ -161,6 +164,10 @@ namespace libtorrent
 
 	int TORRENT_EXPORT load_file(fs::path const& filename, std::vector<char>& v);
 
+	// a list of merkle tree nodes, (node index, hash), sorted by
+	// node index
+	typedef std::vector<std::pair<int, sha1_hash> > merkle_node_list;
+
 	class TORRENT_EXPORT torrent_info : public intrusive_ptr_base<torrent_info>
 	{
 	public:
@@ -183,11 +190,29 @@ namespace libtorrent
 
 		~torrent_info();
 
-		file_storage const& files() const { return m_files; }
-		file_storage const& orig_files() const { return m_orig_files ? *m_orig_files : m_files; }
+		file_storage const& files() const { load_files(); return m_files; }
+		file_storage const& orig_files() const
+		{ load_files(); return m_orig_files ? *m_orig_files : m_files; }
+
+		// frees the decoded file list, it will be decoded again
+		// from the info section the next time it's accessed. This
+		// fails if the torrent_info is shared or has renamed files
+		bool release_files();
+
+		// moves the info section, and with it the piece hashes, out of
+		// memory into the file at path. Hashes are read back a page at
+		// a time as they're needed, and the cache_pages most recently
+		// used pages are kept. The file is removed when the last copy
+		// of this torrent_info goes away. This fails for merkle torrents
+		// and torrents without metadata. It must not be called while
+		// other threads may look up piece hashes
+		bool page_out_piece_hashes(fs::path const& path, int cache_pages
+			, error_code& ec);
+		bool piece_hashes_paged_out() const { return m_hash_file.get() != 0; }
 
 		void rename_file(int index, std::string const& new_filename)
 		{
+			load_files();
 			copy_on_write();
 			m_files.rename_file(index, new_filename);
 		}
@@ -195,6 +220,7 @@ namespace libtorrent
 #ifndef BOOST_FILESYSTEM_NARROW_ONLY
 		void rename_file(int index, std::wstring const& new_filename)
 		{
+			load_files();
 			copy_on_write();
 			m_files.rename_file(index, new_filename);
 		}
@@ -222,19 +248,19 @@ namespace libtorrent
 		typedef file_storage::iterator file_iterator;
 		typedef file_storage::reverse_iterator reverse_file_iterator;
 
-		file_iterator begin_files() const { return m_files.begin(); }
-		file_iterator end_files() const { return m_files.end(); }
-		reverse_file_iterator rbegin_files() const { return m_files.rbegin(); }
-		reverse_file_iterator rend_files() const { return m_files.rend(); }
-		int num_files() const { return m_files.num_files(); }
-		file_entry const& file_at(int index) const { return m_files.at(index); }
+		file_iterator begin_files() const { load_files(); return m_files.begin(); }
+		file_iterator end_files() const { load_files(); return m_files.end(); }
+		reverse_file_iterator rbegin_files() const { load_files(); return m_files.rbegin(); }
+		reverse_file_iterator rend_files() const { load_files(); return m_files.rend(); }
+		int num_files() const { load_files(); return m_files.num_files(); }
+		file_entry const& file_at(int index) const { load_files(); return m_files.at(index); }
 
 		file_iterator file_at_offset(size_type offset) const
-		{ return m_files.file_at_offset(offset); }
+		{ load_files(); return m_files.file_at_offset(offset); }
 		std::vector<file_slice> map_block(int piece, size_type offset, int size) const
-		{ return m_files.map_block(piece, offset, size); }
+		{ load_files(); return m_files.map_block(piece, offset, size); }
 		peer_request map_file(int file, size_type offset, int size) const
-		{ return m_files.map_file(file, offset, size); }
+		{ load_files(); return m_files.map_file(file, offset, size); }
 		
 #ifndef TORRENT_NO_DEPRECATE
 // ------- start deprecation -------
@@ -251,14 +277,21 @@ namespace libtorrent
 		int piece_size(int index) const { return m_files.piece_size(index); }
 
 		sha1_hash hash_for_piece(int index) const
-		{ return sha1_hash(hash_for_piece_ptr(index)); }
+		{
+			if (m_hash_file) return paged_hash_for_piece(index);
+			return sha1_hash(hash_for_piece_ptr(index));
+		}
 
 		std::vector<sha1_hash> const& merkle_tree() const { return m_merkle_tree; }
 		void set_merkle_tree(std::vector<sha1_hash>& h)
 		{ TORRENT_ASSERT(h.size() == m_merkle_tree.size() ); m_merkle_tree.swap(h); }
 
+		// the returned pointer is into the info section, which isn't
+		// kept in memory once the hashes are paged out. Use
+		// hash_for_piece() for those torrents
 		char const* hash_for_piece_ptr(int index) const
 		{
+			TORRENT_ASSERT(!m_hash_file);
 			TORRENT_ASSERT(index >= 0);
 			TORRENT_ASSERT(index < m_files.num_pieces());
 			if (is_merkle_torrent())
@@ -294,24 +327,34 @@ namespace libtorrent
 		
 		bool parse_info_section(lazy_entry const& e, error_code& ex);
 
+		// if the piece hashes are paged out, this reads the info
+		// section back into memory and keeps it there
 		lazy_entry const* info(char const* key) const
 		{
 			if (m_info_dict.type() == lazy_entry::none_t)
+			{
+				if (!m_info_section) m_info_section = metadata();
 				lazy_bdecode(m_info_section.get(), m_info_section.get()
 					+ m_info_section_size, m_info_dict);
+			}
 			return m_info_dict.dict_find(key);
 		}
 
 		void swap(torrent_info& ti);
 
+		// if the piece hashes are paged out, the info section is
+		// read from the file every time
 		boost::shared_array<char> metadata() const
-		{ return m_info_section; }
+		{ return m_info_section || !m_hash_file ? m_info_section : load_info_section(); }
 
 		int metadata_size() const { return m_info_section_size; }
 
-		bool add_merkle_nodes(std::map<int, sha1_hash> const& subtree
+		// subtree must be sorted by node index. The nodes are only
+		// added to the tree if they verify the piece's hash against
+		// the part of the tree that's already verified
+		bool add_merkle_nodes(merkle_node_list const& subtree
 			, int piece);
-		std::map<int, sha1_hash> build_merkle_list(int piece) const;
+		merkle_node_list build_merkle_list(int piece) const;
 		bool is_merkle_torrent() const { return !m_merkle_tree.empty(); }
 
 	private:
@@ -319,7 +362,18 @@ namespace libtorrent
 		void copy_on_write();
 		bool parse_torrent_file(lazy_entry const& libtorrent, error_code& ec);
 
-		file_storage m_files;
+		void load_files() const
+		{ if (m_files_released) decode_files(); }
+		void decode_files() const;
+
+		sha1_hash paged_hash_for_piece(int index) const;
+		boost::shared_array<char> load_info_section() const;
+
+		// the file list is mutable since it may be released
+		// and decoded again from m_info_section on demand.
+		// only the list of file entries is released, the
+		// piece length, total size and name are always kept
+		mutable file_storage m_files;
 
 		// if m_files is modified, it is first copied into
 		// m_orig_files so that the original name and
@@ -359,19 +413,32 @@ namespace libtorrent
 		// be announced on the dht
 		bool m_private;
 
+		// this is true if the file entries in m_files have
+		// been freed by release_files()
+		mutable bool m_files_released;
+
 		// this is a copy of the info section from the torrent.
 		// it use maintained in this flat format in order to
-		// make it available through the metadata extension
-		boost::shared_array<char> m_info_section;
+		// make it available through the metadata extension.
+		// It's empty once page_out_piece_hashes() has moved
+		// it to m_hash_file, unless info() read it back
+		mutable boost::shared_array<char> m_info_section;
 		int m_info_section_size;
 
 		// this is a pointer into the m_info_section buffer
 		// pointing to the first byte of the first sha-1 hash
 		char const* m_piece_hashes;
 
+		// the file the info section was paged out to, and the
+		// cache of piece hash pages read from it. Copies of this
+		// torrent_info share it
+		boost::shared_ptr<piece_hash_file> m_hash_file;
+
 		// if this is a merkle torrent, this is the merkle
 		// tree. It has space for merkle_num_nodes(merkle_num_leafs(num_pieces))
-		// hashes
+		// hashes. Nodes that are all zeros haven't been received yet,
+		// every other node has been verified against the root, and so
+		// have all its ancestors
 		std::vector<sha1_hash> m_merkle_tree;
 		// the index to the first leaf. This is where the hash for the
 		// first piece is stored
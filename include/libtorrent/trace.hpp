@@ -0,0 +1,132 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#ifndef TORRENT_TRACE_HPP_INCLUDED
+#define TORRENT_TRACE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+#include <string>
+
+namespace libtorrent
+{
+	// one entry in the trace buffer. The category, name and
+	// argument names point to string literals, so recording an
+	// event doesn't allocate
+	struct TORRENT_EXPORT trace_event
+	{
+		char const* category;
+		char const* name;
+		// microseconds since the trace buffer was created
+		boost::int64_t start;
+		// in microseconds. -1 for instant events
+		boost::int32_t duration;
+		// 0 is the network thread, 1 and up are the disk threads
+		int thread;
+		// up to three named integer arguments. Unused ones have
+		// a name of 0
+		char const* arg_name[3];
+		int arg[3];
+	};
+
+	// a fixed size ring buffer of trace events, shared by the network
+	// and the disk threads. When it's full, the oldest events are
+	// overwritten. While it's disabled (size 0), recording an event
+	// is a single branch
+	class TORRENT_EXPORT trace_buffer : boost::noncopyable
+	{
+	public:
+		trace_buffer();
+
+		// sets the number of events kept. 0 disables tracing and
+		// drops all the recorded events
+		void resize(int size);
+		bool enabled() const { return m_size > 0; }
+
+		void span(char const* category, char const* name
+			, ptime start, ptime end, int thread
+			, char const* name0 = 0, int arg0 = 0
+			, char const* name1 = 0, int arg1 = 0
+			, char const* name2 = 0, int arg2 = 0)
+		{
+			if (m_size == 0) return;
+			record(category, name, start, total_microseconds(end - start)
+				, thread, name0, arg0, name1, arg1, name2, arg2);
+		}
+
+		void instant(char const* category, char const* name, int thread
+			, char const* name0 = 0, int arg0 = 0
+			, char const* name1 = 0, int arg1 = 0
+			, char const* name2 = 0, int arg2 = 0)
+		{
+			if (m_size == 0) return;
+			record(category, name, time_now_hires(), -1
+				, thread, name0, arg0, name1, arg1, name2, arg2);
+		}
+
+		// copies the recorded events, oldest first
+		void get_events(std::vector<trace_event>& ret) const;
+
+	private:
+
+		void record(char const* category, char const* name
+			, ptime start, boost::int64_t duration, int thread
+			, char const* name0, int arg0, char const* name1, int arg1
+			, char const* name2, int arg2);
+
+		typedef boost::mutex mutex_t;
+		mutable mutex_t m_mutex;
+
+		std::vector<trace_event> m_events;
+		// the slot the next event goes in
+		int m_next;
+		// true once the buffer has been filled once, and m_next
+		// also is the oldest event
+		bool m_wrapped;
+		// the capacity. Read without holding the mutex,
+		// to keep disabled tracing cheap
+		volatile int m_size;
+
+		ptime m_epoch;
+	};
+
+	// formats events in the Chrome trace event format, which can be
+	// loaded in chrome://tracing. Spans become complete ("X") events
+	// and instant events are thread scoped ("i") events
+	TORRENT_EXPORT std::string chrome_trace(std::vector<trace_event> const& events);
+}
+
+#endif
+
@@ -37,6 +37,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <utility>
 #include <ctime>
+#include <map>
+#include <list>
+#include <functional>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -70,6 +73,8 @@ namespace libtorrent
 	class tracker_manager;
 	struct timeout_handler;
 	struct tracker_connection;
+	struct http_connection;
+	class resolver;
 	namespace aux { struct session_impl; }
 
 	// returns -1 if gzip header is invalid or the header size in bytes
@@ -138,6 +143,10 @@ namespace libtorrent
 			, int response_code
 			, const std::string& description) = 0;
 
+		// orders the requests held back by the tracker request
+		// rate limit. Requests with higher priority are sent first
+		virtual int tracker_request_priority() const { return 0; }
+
 		tcp::endpoint m_tracker_address;
 
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
@@ -204,11 +213,17 @@ namespace libtorrent
 		void sent_bytes(int bytes);
 		void received_bytes(int bytes);
 
+		// called when a valid response is handed to the
+		// requester, to record the round trip time
+		void response_received();
+
 	protected:
 		boost::weak_ptr<request_callback> m_requester;
 	private:
 		tracker_manager& m_man;
 		const tracker_request m_req;
+		// when this request was started
+		ptime m_request_start;
 	};
 
 	class TORRENT_EXPORT tracker_manager: boost::noncopyable
@@ -216,7 +231,8 @@ namespace libtorrent
 	public:
 
 		tracker_manager(aux::session_impl& ses, proxy_settings const& ps)
-			: m_ses(ses)
+			: m_request_quota(0.f)
+			, m_ses(ses)
 			, m_proxy(ps)
 			, m_abort(false) {}
 		~tracker_manager();
@@ -230,15 +246,84 @@ namespace libtorrent
 				= boost::weak_ptr<request_callback>());
 		void abort_all_requests(bool all = false);
 
+		// called on the session tick. Starts the requests held
+		// back by session_settings::tracker_requests_per_second
+		void tick(time_duration elapsed);
+
 		void remove_request(tracker_connection const*);
 		bool empty() const;
 		int num_requests() const;
 
 		void sent_bytes(int bytes);
 		void received_bytes(int bytes);
+		void record_round_trip(time_duration rtt);
+
+		// UDP trackers hand out connection ids that stay valid
+		// for a minute. They are shared by all torrents announcing
+		// to (or scraping) the same tracker, which saves the connect
+		// round trip for all but the first request in that minute.
+		// Returns false if there's no valid id for the endpoint
+		bool get_udp_connection_id(udp::endpoint const& ep
+			, boost::int64_t& id) const;
+		void set_udp_connection_id(udp::endpoint const& ep
+			, boost::int64_t id);
+		void remove_udp_connection_id(udp::endpoint const& ep);
+
+		// the session's host name lookup cache
+		resolver& host_resolver();
+
+		// HTTP tracker connections the tracker agreed to keep open
+		// are handed back to the tracker_manager and reused by the
+		// next request to the same host. host is the protocol, host
+		// name and port of the tracker url. Returns an empty pointer
+		// if there's no idle connection to the host
+		boost::shared_ptr<http_connection> get_http_connection(
+			std::string const& host);
+		void release_http_connection(std::string const& host
+			, boost::shared_ptr<http_connection> const& c);
 		
 	private:
 
+		void start_request(
+			io_service& ios
+			, connection_queue& cc
+			, tracker_request const& r
+			, std::string const& auth
+			, boost::weak_ptr<request_callback> c);
+
+		struct queued_request
+		{
+			io_service* ios;
+			connection_queue* cc;
+			tracker_request req;
+			std::string auth;
+			boost::weak_ptr<request_callback> callback;
+		};
+		// requests waiting for the rate limit, ordered by
+		// priority (highest first) and then by the order
+		// they were queued in
+		typedef std::multimap<int, queued_request, std::greater<int> > request_queue_t;
+		request_queue_t m_queued_requests;
+
+		// the number of requests we may start right now
+		float m_request_quota;
+
+		struct idle_http_connection
+		{
+			std::string host;
+			boost::shared_ptr<http_connection> connection;
+			ptime idle_since;
+		};
+		std::list<idle_http_connection> m_idle_http_connections;
+
+		struct udp_connection_id
+		{
+			boost::int64_t connection_id;
+			ptime expires;
+		};
+		typedef std::map<udp::endpoint, udp_connection_id> udp_conns_t;
+		udp_conns_t m_udp_conns;
+
 		typedef boost::recursive_mutex mutex_t;
 		mutable mutex_t m_mutex;
 
@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/socket.hpp"
 #include "libtorrent/session_settings.hpp"
 #include "libtorrent/buffer.hpp"
+#include "libtorrent/allocating_handler.hpp"
 
 #include <vector>
 #include <boost/function.hpp>
@@ -91,21 +92,37 @@ namespace libtorrent
 		void socks_forward_udp();
 		void connect1(error_code const& e);
 		void connect2(error_code const& e);
+		void hung_up(error_code const& e);
+
+		// (re)starts the SOCKS5 handshake
+		void connect_socks5();
+		// closes the SOCKS5 connection and schedules
+		// a reconnect, unless e is operation_aborted
+		void socks5_failed(error_code const& e);
+		void on_retry_socks5(error_code const& e);
+
+		typedef boost::mutex mutex_t;
+
+		// reads the packets already waiting on the socket, with
+		// non-blocking receives, and hands them to the callback
+		void drain(udp::socket* s, char* buf, int size
+			, udp::endpoint& ep, mutex_t::scoped_lock& l);
 
 		void wrap(udp::endpoint const& ep, char const* p, int len, error_code& ec);
 		void unwrap(error_code const& e, char const* buf, int size);
 
-		typedef boost::mutex mutex_t;
 		mutable mutex_t m_mutex;
 
 		udp::socket m_ipv4_sock;
 		udp::endpoint m_v4_ep;
 		char m_v4_buf[1600];
+		handler_storage<TORRENT_READ_HANDLER_MAX_SIZE> m_v4_read_storage;
 
 #if TORRENT_USE_IPV6
 		udp::socket m_ipv6_sock;
 		udp::endpoint m_v6_ep;
 		char m_v6_buf[1600];
+		handler_storage<TORRENT_READ_HANDLER_MAX_SIZE> m_v6_read_storage;
 #endif
 
 		int m_bind_port;
@@ -116,6 +133,9 @@ namespace libtorrent
 		proxy_settings m_proxy_settings;
 		connection_queue& m_cc;
 		tcp::resolver m_resolver;
+		deadline_timer m_retry_timer;
+		// seconds until the next SOCKS5 reconnect attempt
+		int m_retry_delay;
 		char m_tmp_buf[100];
 		bool m_tunnel_packets;
 		bool m_abort;
@@ -91,7 +91,8 @@ namespace libtorrent
 		boost::intrusive_ptr<udp_tracker_connection> self()
 		{ return boost::intrusive_ptr<udp_tracker_connection>(this); }
 
-		void name_lookup(error_code const& error, udp::resolver::iterator i);
+		void name_lookup(error_code const& error
+			, std::vector<address> const& addresses);
 		void timeout(error_code const& error);
 
 		void on_receive(error_code const& e, udp::endpoint const& ep
@@ -108,8 +109,9 @@ namespace libtorrent
 
 		tracker_manager& m_man;
 
-		udp::resolver m_name_lookup;
 		udp_socket m_socket;
+		// the port of the tracker, from the url
+		int m_port;
 		udp::endpoint m_target;
 		std::list<udp::endpoint> m_endpoints;
 
@@ -118,6 +120,15 @@ namespace libtorrent
 		aux::session_impl const& m_ses;
 		int m_attempts;
 
+		// true if m_connection_id was reused from an earlier
+		// connection to the same tracker, rather than received
+		// in response to our own connect
+		bool m_cached_connection_id;
+
+		// set when the connection is closed, the name lookup
+		// can't be cancelled since it's shared
+		bool m_abort;
+
 		action_t m_state;
 	};
 
@@ -105,13 +105,13 @@ private:
 	
 	void on_upnp_xml(error_code const& e
 		, libtorrent::http_parser const& p, rootdevice& d
-		, http_connection& c);
+		, char const* data, int size, http_connection& c);
 	void on_upnp_map_response(error_code const& e
 		, libtorrent::http_parser const& p, rootdevice& d
-		, int mapping, http_connection& c);
+		, int mapping, char const* data, int size, http_connection& c);
 	void on_upnp_unmap_response(error_code const& e
 		, libtorrent::http_parser const& p, rootdevice& d
-		, int mapping, http_connection& c);
+		, int mapping, char const* data, int size, http_connection& c);
 	void on_expire(error_code const& e);
 
 	void disable(char const* msg);
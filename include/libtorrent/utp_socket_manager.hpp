@@ -0,0 +1,105 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_UTP_SOCKET_MANAGER_HPP_INCLUDED
+#define TORRENT_UTP_SOCKET_MANAGER_HPP_INCLUDED
+
+#include <map>
+
+#include "libtorrent/socket_type.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace libtorrent
+{
+	class udp_socket;
+	class utp_stream;
+	struct utp_socket_impl;
+
+	// keeps track of all uTP sockets and dispatches the
+	// packets received on the session's udp socket to the
+	// right one. All of it runs under the session mutex
+	struct utp_socket_manager
+	{
+		typedef boost::function<void(boost::shared_ptr<socket_type> const&)>
+			incoming_utp_callback_t;
+
+		utp_socket_manager(session_settings const& s, udp_socket& sock
+			, incoming_utp_callback_t cb);
+		~utp_socket_manager();
+
+		// returns true if the packet was a uTP packet
+		bool incoming_packet(char const* p, int size
+			, udp::endpoint const& ep);
+
+		// called every 100 ms, to handle timeouts
+		void tick(ptime now);
+
+		// creates the implementation for a new outgoing
+		// socket. The connection id is assigned when it connects
+		utp_socket_impl* new_utp_socket(utp_stream* str);
+
+		// called by the sockets
+		void send_packet(udp::endpoint const& ep, char const* p, int len
+			, error_code& ec);
+		void add_socket(boost::uint16_t id, utp_socket_impl* s);
+		boost::uint16_t new_connection_id(udp::endpoint const& ep);
+		int local_port() const;
+		io_service& get_io_service();
+		session_settings const& settings() const { return m_sett; }
+
+		int num_sockets() const { return m_utp_sockets.size(); }
+
+	private:
+
+		void send_reset(udp::endpoint const& ep, boost::uint16_t id
+			, boost::uint16_t ack_nr);
+
+		session_settings const& m_sett;
+		udp_socket& m_sock;
+		incoming_utp_callback_t m_cb;
+
+		// sockets are keyed by the connection id they receive
+		// packets with. Different peers may pick the same id,
+		// so the endpoint has to match too
+		typedef std::multimap<boost::uint16_t, utp_socket_impl*> socket_map_t;
+		socket_map_t m_utp_sockets;
+
+		// sockets that were constructed but haven't connected
+		// yet, and don't have a connection id
+		std::vector<utp_socket_impl*> m_unconnected;
+	};
+}
+
+#endif
@@ -0,0 +1,285 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_UTP_STREAM_HPP_INCLUDED
+#define TORRENT_UTP_STREAM_HPP_INCLUDED
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	struct utp_socket_manager;
+	struct utp_socket_impl;
+	class utp_stream;
+
+	// the uTP packet types
+	enum utp_packet_type
+	{
+		ST_DATA = 0,
+		ST_FIN,
+		ST_STATE,
+		ST_RESET,
+		ST_SYN,
+		NUM_TYPES
+	};
+
+	enum { utp_header_size = 20 };
+
+	// these are the interface the utp_socket_manager uses to
+	// talk to the sockets. The socket implementation is private
+	// to utp_stream.cpp
+	utp_socket_impl* construct_utp_impl(boost::uint16_t recv_id
+		, boost::uint16_t send_id, utp_stream* userdata
+		, utp_socket_manager* sm);
+	void delete_utp_impl(utp_socket_impl* s);
+	bool should_delete(utp_socket_impl* s);
+	void tick_utp_impl(utp_socket_impl* s, ptime const& now);
+	bool utp_incoming_packet(utp_socket_impl* s, char const* p
+		, int size, udp::endpoint const& ep, ptime const& receive_time);
+	bool utp_match(utp_socket_impl* s, udp::endpoint const& ep, boost::uint16_t id);
+	udp::endpoint utp_remote_endpoint(utp_socket_impl* s);
+	boost::uint16_t utp_receive_id(utp_socket_impl* s);
+	void utp_detach(utp_socket_impl* s);
+
+	// a stream socket implementing the uTP protocol (BEP 29) on
+	// top of the session's udp socket. It has the same interface
+	// as the other streams in socket_type, so peer_connection can
+	// use it without knowing about it. All handlers are posted
+	// on the io_service, never invoked directly.
+	class utp_stream : boost::noncopyable
+	{
+	public:
+
+		typedef stream_socket::endpoint_type endpoint_type;
+		typedef stream_socket::protocol_type protocol_type;
+
+		explicit utp_stream(io_service& io_service);
+		~utp_stream();
+
+		// the socket manager attaches an implementation to the
+		// stream before it's used. Without one, the stream is closed
+		void set_impl(utp_socket_impl* s);
+		utp_socket_impl* get_impl() const { return m_impl; }
+
+		// options and io control commands are for tcp sockets,
+		// they don't have any effect on uTP sockets
+#ifndef BOOST_NO_EXCEPTIONS
+		template <class IO_Control_Command>
+		void io_control(IO_Control_Command& ioc) {}
+#endif
+
+		template <class IO_Control_Command>
+		void io_control(IO_Control_Command& ioc, error_code& ec) { ec.clear(); }
+
+#ifndef BOOST_NO_EXCEPTIONS
+		template <class SettableSocketOption>
+		void set_option(SettableSocketOption const& opt) {}
+#endif
+
+		template <class SettableSocketOption>
+		error_code set_option(SettableSocketOption const& opt, error_code& ec)
+		{ ec.clear(); return ec; }
+
+		// the socket is always bound to the session's udp port
+#ifndef BOOST_NO_EXCEPTIONS
+		void bind(endpoint_type const& endpoint) {}
+		void open(protocol_type const& p) {}
+#endif
+		void bind(endpoint_type const& endpoint, error_code& ec) { ec.clear(); }
+		void open(protocol_type const& p, error_code& ec) { ec.clear(); }
+
+		void close();
+		void close(error_code& ec) { close(); ec.clear(); }
+		bool is_open() const { return m_open; }
+
+		endpoint_type local_endpoint(error_code& ec) const;
+		endpoint_type remote_endpoint(error_code& ec) const;
+#ifndef BOOST_NO_EXCEPTIONS
+		endpoint_type local_endpoint() const
+		{ error_code ec; return local_endpoint(ec); }
+		endpoint_type remote_endpoint() const
+		{ error_code ec; return remote_endpoint(ec); }
+#endif
+
+		io_service& get_io_service() { return m_io_service; }
+
+		template <class Handler>
+		void async_connect(endpoint_type const& endpoint, Handler const& handler)
+		{
+			if (!m_impl)
+			{
+				m_io_service.post(boost::bind<void>(handler, asio::error::not_connected));
+				return;
+			}
+			TORRENT_ASSERT(!m_connect_handler);
+			m_connect_handler = handler;
+			do_connect(endpoint);
+		}
+
+		template <class Mutable_Buffers, class Handler>
+		void async_read_some(Mutable_Buffers const& buffers, Handler const& handler)
+		{
+			if (!m_impl)
+			{
+				m_io_service.post(boost::bind<void>(handler, asio::error::not_connected, 0));
+				return;
+			}
+			TORRENT_ASSERT(!m_read_handler);
+			for (typename Mutable_Buffers::const_iterator i = buffers.begin()
+				, end(buffers.end()); i != end; ++i)
+			{
+				add_read_buffer(asio::buffer_cast<void*>(*i), asio::buffer_size(*i));
+			}
+			m_read_handler = handler;
+			set_read_handler();
+		}
+
+		// waits for the socket to become readable. The handler
+		// is called with 0 bytes
+		template <class Handler>
+		void async_read_some(asio::null_buffers const&, Handler const& handler)
+		{
+			if (!m_impl)
+			{
+				m_io_service.post(boost::bind<void>(handler, asio::error::not_connected, 0));
+				return;
+			}
+			TORRENT_ASSERT(!m_read_handler);
+			m_read_handler = handler;
+			set_read_handler();
+		}
+
+		// copies whatever has been received already. If there
+		// is nothing, ec is set to would_block
+		template <class Mutable_Buffers>
+		std::size_t read_some(Mutable_Buffers const& buffers, error_code& ec)
+		{
+			TORRENT_ASSERT(!m_read_handler);
+			if (!m_impl)
+			{
+				ec = asio::error::not_connected;
+				return 0;
+			}
+			for (typename Mutable_Buffers::const_iterator i = buffers.begin()
+				, end(buffers.end()); i != end; ++i)
+			{
+				add_read_buffer(asio::buffer_cast<void*>(*i), asio::buffer_size(*i));
+			}
+			return do_read_some(ec);
+		}
+
+		template <class Const_Buffers, class Handler>
+		void async_write_some(Const_Buffers const& buffers, Handler const& handler)
+		{
+			if (!m_impl)
+			{
+				m_io_service.post(boost::bind<void>(handler, asio::error::not_connected, 0));
+				return;
+			}
+			TORRENT_ASSERT(!m_write_handler);
+			for (typename Const_Buffers::const_iterator i = buffers.begin()
+				, end(buffers.end()); i != end; ++i)
+			{
+				add_write_buffer(asio::buffer_cast<void const*>(*i), asio::buffer_size(*i));
+			}
+			m_write_handler = handler;
+			set_write_handler();
+		}
+
+		// waits for there to be room in the send buffer. The
+		// handler is called with 0 bytes
+		template <class Handler>
+		void async_write_some(asio::null_buffers const&, Handler const& handler)
+		{
+			if (!m_impl)
+			{
+				m_io_service.post(boost::bind<void>(handler, asio::error::not_connected, 0));
+				return;
+			}
+			TORRENT_ASSERT(!m_write_handler);
+			m_write_handler = handler;
+			set_write_handler();
+		}
+
+	private:
+
+		friend struct utp_socket_impl;
+
+		void do_connect(endpoint_type const& ep);
+		void add_read_buffer(void* buf, std::size_t len);
+		void add_write_buffer(void const* buf, std::size_t len);
+		void set_read_handler();
+		void set_write_handler();
+		std::size_t do_read_some(error_code& ec);
+
+		// these are called by the socket implementation to
+		// post the handlers
+		void on_read(std::size_t bytes_transferred, error_code const& ec);
+		void on_write(std::size_t bytes_transferred, error_code const& ec);
+		void on_connect(error_code const& ec);
+
+		// posts all outstanding handlers with the error
+		void cancel_handlers(error_code const& ec);
+
+		struct iovec_t
+		{
+			iovec_t(void* b, std::size_t l): buf(b), len(l) {}
+			void* buf;
+			std::size_t len;
+		};
+
+		typedef boost::function<void(error_code const&, std::size_t)> io_handler_t;
+
+		io_handler_t m_read_handler;
+		io_handler_t m_write_handler;
+		boost::function<void(error_code const&)> m_connect_handler;
+
+		// the buffers of the outstanding read and write
+		// operations. Empty for null_buffers operations
+		std::vector<iovec_t> m_read_buffer;
+		std::vector<iovec_t> m_write_buffer;
+
+		utp_socket_impl* m_impl;
+		io_service& m_io_service;
+
+		bool m_open;
+	};
+}
+
+#endif
@@ -541,7 +541,7 @@ public:
     typedef typename S0::protocol_type protocol_type;
 
     explicit variant_stream(io_service& ios)
-        : m_io_service(ios), m_variant(boost::blank()) {}
+        : m_io_service(ios), m_variant(boost::blank()), m_first(0) {}
 
     template <class S>
     void instantiate(io_service& ios)
@@ -550,6 +550,7 @@ public:
         std::auto_ptr<S> owned(new S(ios));
         boost::apply_visitor(aux::delete_visitor(), m_variant);
         m_variant = owned.get();
+        m_first = first_stream(owned.get());
         owned.release();
     }
 
@@ -575,6 +576,7 @@ public:
     std::size_t read_some(Mutable_Buffers const& buffers, error_code& ec)
     {
         TORRENT_ASSERT(instantiated());
+        if (m_first) return m_first->read_some(buffers, ec);
         return boost::apply_visitor(
             aux::read_some_visitor_ec<Mutable_Buffers>(buffers, ec)
           , m_variant
@@ -597,6 +599,11 @@ public:
     void async_read_some(Mutable_Buffers const& buffers, Handler const& handler)
     {
         TORRENT_ASSERT(instantiated());
+        if (m_first)
+        {
+            m_first->async_read_some(buffers, handler);
+            return;
+        }
         boost::apply_visitor(
             aux::async_read_some_visitor<Mutable_Buffers, Handler>(buffers, handler)
           , m_variant
@@ -607,6 +614,11 @@ public:
     void async_write_some(Const_Buffers const& buffers, Handler const& handler)
     {
         TORRENT_ASSERT(instantiated());
+        if (m_first)
+        {
+            m_first->async_write_some(buffers, handler);
+            return;
+        }
         boost::apply_visitor(
             aux::async_write_some_visitor<Const_Buffers, Handler>(buffers, handler)
           , m_variant
@@ -776,8 +788,16 @@ public:
     }
 
 private:
+    static S0* first_stream(S0* s) { return s; }
+    template <class S>
+    static S0* first_stream(S*) { return 0; }
+
     io_service& m_io_service;
     variant_type m_variant;
+    // points to the stream when it's the first stream type (the
+    // plain TCP socket for socket_type). Reads and writes on it
+    // are made directly instead of through apply_visitor
+    S0* m_first;
 };
 
 } // namespace libtorrent
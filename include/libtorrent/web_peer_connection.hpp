@@ -127,6 +127,7 @@ namespace libtorrent
 		void on_connected();
 		void write_reject_request(peer_request const&) {}
 		void write_allow_fast(int) {}
+		void write_suggest(int) {}
 
 #ifdef TORRENT_DEBUG
 		void check_invariant() const;
@@ -141,6 +142,14 @@ namespace libtorrent
 		// will be invalid.
 		boost::optional<piece_block_progress> downloading_piece_progress() const;
 
+		// appends to m_piece, returns false if we were
+		// disconnected
+		bool append_to_piece(char const* buf, int size);
+
+		// called for the bytes received directly into the
+		// disk buffer
+		void on_receive_disk_buffer(torrent& t, int bytes_transferred);
+
 		// this has one entry per bittorrent request
 		std::deque<peer_request> m_requests;
 		// this has one entry per http-request
@@ -161,8 +170,11 @@ namespace libtorrent
 		bool m_first_request;
 		
 		// this is used for intermediate storage of pieces
-		// that are received in more than one HTTP response
-		std::vector<char> m_piece;
+		// that are received in more than one HTTP response.
+		// It's a disk buffer, so that it can be handed to the
+		// disk thread without another copy once it's complete
+		disk_buffer_holder m_piece;
+		int m_piece_size;
 		
 		// the number of bytes into the receive buffer where
 		// current read cursor is.
@@ -44,18 +44,17 @@ namespace libtorrent {
 	ptime alert::timestamp() const { return m_timestamp; }
 
 	alert_manager::alert_manager(io_service& ios)
-		: m_alert_mask(alert::error_notification)
+		: m_queue_size(0)
+		, m_alert_mask(alert::error_notification)
 		, m_queue_size_limit(queue_size_limit_default)
 		, m_ios(ios)
 	{}
 
 	alert_manager::~alert_manager()
 	{
-		while (!m_alerts.empty())
-		{
-			delete m_alerts.front();
-			m_alerts.pop();
-		}
+		for (std::deque<alert*>::iterator i = m_alerts.begin()
+			, end(m_alerts.end()); i != end; ++i)
+			delete *i;
 	}
 
 	alert const* alert_manager::wait_for_alert(time_duration max_wait)
@@ -89,16 +88,19 @@ namespace libtorrent {
 		boost::mutex::scoped_lock lock(m_mutex);
 
 		m_dispatch = fun;
+		// without a dispatch function, alerts are queued again
+		if (!m_dispatch) return;
 
-		std::queue<alert*> alerts = m_alerts;
-		while (!m_alerts.empty()) m_alerts.pop();
+		std::deque<alert*> alerts;
+		m_alerts.swap(alerts);
+		m_queue_size = 0;
 		lock.unlock();
 
-		while (!alerts.empty())
+		for (std::deque<alert*>::iterator i = alerts.begin()
+			, end(alerts.end()); i != end; ++i)
 		{
-			m_dispatch(*alerts.front());
-			delete alerts.front();
-			alerts.pop();
+			m_dispatch(**i);
+			delete *i;
 		}
 	}
 
@@ -111,17 +113,27 @@ namespace libtorrent {
 
 	void alert_manager::post_alert(const alert& alert_)
 	{
+		// don't pay for the copy if it's going to be dropped. The
+		// queue is always empty when there's a dispatch function
+		if (m_queue_size > 0 && m_queue_size >= m_queue_size_limit) return;
+		post_alert_ptr(alert_.clone().release());
+	}
+
+	void alert_manager::post_alert_ptr(alert* alert_)
+	{
+		std::auto_ptr<alert> holder(alert_);
 		boost::mutex::scoped_lock lock(m_mutex);
 
 		if (m_dispatch)
 		{
 			TORRENT_ASSERT(m_alerts.empty());
-			m_ios.post(boost::bind(&dispatch_alert, m_dispatch, alert_.clone().release()));
+			m_ios.post(boost::bind(&dispatch_alert, m_dispatch, holder.release()));
 			return;
 		}
 
 		if (m_alerts.size() >= m_queue_size_limit) return;
-		m_alerts.push(alert_.clone().release());
+		m_alerts.push_back(holder.release());
+		m_queue_size = m_alerts.size();
 		m_condition.notify_all();
 	}
 
@@ -132,10 +144,33 @@ namespace libtorrent {
 		TORRENT_ASSERT(!m_alerts.empty());
 
 		alert* result = m_alerts.front();
-		m_alerts.pop();
+		m_alerts.pop_front();
+		m_queue_size = m_alerts.size();
 		return std::auto_ptr<alert>(result);
 	}
 
+	std::auto_ptr<alert> alert_manager::pop()
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		
+		if (m_alerts.empty()) return std::auto_ptr<alert>(0);
+
+		alert* result = m_alerts.front();
+		m_alerts.pop_front();
+		m_queue_size = m_alerts.size();
+		return std::auto_ptr<alert>(result);
+	}
+
+	void alert_manager::get_all(std::deque<alert*>& alerts)
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		if (alerts.empty()) alerts.swap(m_alerts);
+		else alerts.insert(alerts.end(), m_alerts.begin(), m_alerts.end());
+		m_alerts.clear();
+		m_queue_size = 0;
+	}
+
 	bool alert_manager::pending() const
 	{
 		boost::mutex::scoped_lock lock(m_mutex);
@@ -37,6 +37,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <Windows.h>
 #else
 #include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef TORRENT_USE_NUMA
+#include <numa.h>
 #endif
 
 
@@ -47,7 +52,27 @@ namespace libtorrent
 #ifdef TORRENT_WINDOWS
 		return reinterpret_cast<char*>(VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
 #else
-		return reinterpret_cast<char*>(valloc(bytes));
+		char* ret = 0;
+		if (bytes >= huge_page_size)
+		{
+			void* p = 0;
+			if (posix_memalign(&p, huge_page_size, bytes) != 0) return 0;
+			ret = reinterpret_cast<char*>(p);
+#ifdef MADV_HUGEPAGE
+			// only whole huge pages can be backed by huge pages,
+			// the tail of the allocation uses regular pages
+			madvise(ret, bytes & ~size_type(huge_page_size - 1), MADV_HUGEPAGE);
+#endif
+		}
+		else
+		{
+			ret = reinterpret_cast<char*>(valloc(bytes));
+			if (ret == 0) return 0;
+		}
+#ifdef TORRENT_USE_NUMA
+		if (numa_available() >= 0) numa_setlocal_memory(ret, bytes);
+#endif
+		return ret;
 #endif
 	}
 
@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 #include <limits>
+#include <algorithm>
 #include <boost/bind.hpp>
 
 #include "libtorrent/bt_peer_connection.hpp"
@@ -85,6 +86,32 @@ namespace libtorrent
 		&bt_peer_connection::on_extended
 	};
 
+	namespace
+	{
+		// the stats counter for each message type, in the
+		// same order as m_message_handler. Unsupported ids are -1
+		const int message_counter[] =
+		{
+			counters::num_incoming_choke,
+			counters::num_incoming_unchoke,
+			counters::num_incoming_interested,
+			counters::num_incoming_not_interested,
+			counters::num_incoming_have,
+			counters::num_incoming_bitfield,
+			counters::num_incoming_request,
+			counters::num_incoming_piece,
+			counters::num_incoming_cancel,
+			counters::num_incoming_dht_port,
+			-1, -1, -1,
+			counters::num_incoming_suggest,
+			counters::num_incoming_have_all,
+			counters::num_incoming_have_none,
+			counters::num_incoming_reject,
+			counters::num_incoming_allowed_fast,
+			-1, -1,
+			counters::num_incoming_extended
+		};
+	}
 
 	bt_peer_connection::bt_peer_connection(
 		session_impl& ses
@@ -104,7 +131,7 @@ namespace libtorrent
 		, m_encrypted(false)
 		, m_rc4_encrypted(false)
 		, m_sync_bytes_read(0)
-		, m_enc_send_buffer(0, 0)
+		, m_rc4_pending(0)
 #endif
 #ifdef TORRENT_DEBUG
 		, m_sent_bitfield(false)
@@ -138,7 +165,7 @@ namespace libtorrent
 		, m_encrypted(false)
 		, m_rc4_encrypted(false)
 		, m_sync_bytes_read(0)
-		, m_enc_send_buffer(0, 0)
+		, m_rc4_pending(0)
 #endif		
 #ifdef TORRENT_DEBUG
 		, m_sent_bitfield(false)
@@ -336,6 +363,28 @@ namespace libtorrent
 		send_buffer(msg, sizeof(msg));
 	}
 
+	void bt_peer_connection::write_suggest(int piece)
+	{
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(m_sent_handshake && m_sent_bitfield);
+		TORRENT_ASSERT(associated_torrent().lock()->valid_metadata());
+
+		if (!m_supports_fast) return;
+
+		char msg[] = {0,0,0,5, msg_suggest_piece, 0, 0, 0, 0};
+		char* ptr = msg + 5;
+		detail::write_int32(piece, ptr);
+		send_buffer(msg, sizeof(msg));
+	}
+
+	int bt_peer_connection::memory_usage() const
+	{
+		return peer_connection::memory_usage()
+			+ sizeof(bt_peer_connection) - sizeof(peer_connection)
+			+ m_payloads.capacity() * sizeof(range);
+	}
+
 	void bt_peer_connection::get_specific_peer_info(peer_info& p) const
 	{
 		TORRENT_ASSERT(!associated_torrent().expired());
@@ -371,6 +420,19 @@ namespace libtorrent
 		return m_state < read_packet_size;
 	}
 
+	// a piece message starts with the length prefix, the message
+	// id, the piece index and the offset in the piece. Reading that
+	// much ahead of the payload puts the payload at the start of the
+	// read ahead buffer
+	int bt_peer_connection::read_ahead_size() const
+	{
+		if (m_state == read_packet) return 13;
+		// the length prefix and the message id
+		// are read as one packet
+		if (m_state == read_packet_size) return 8;
+		return 0;
+	}
+
 #ifndef TORRENT_DISABLE_ENCRYPTION
 
 	void bt_peer_connection::write_pe1_2_dhkey()
@@ -387,7 +449,8 @@ namespace libtorrent
 			(*m_logger) << " initiating encrypted handshake\n";
 #endif
 
-		m_dh_key_exchange.reset(new (std::nothrow) dh_key_exchange);
+		// the key pair comes pre-generated from the pool
+		m_dh_key_exchange.reset(m_ses.m_dh_keys.get());
 		if (!m_dh_key_exchange || !m_dh_key_exchange->good())
 		{
 			disconnect("out of memory");
@@ -635,17 +698,11 @@ namespace libtorrent
 		TORRENT_ASSERT(buf);
 		TORRENT_ASSERT(size > 0);
 		
-		encrypt_pending_buffer();
-
 #ifndef TORRENT_DISABLE_ENCRYPTION
-		if (m_encrypted && m_rc4_encrypted)
-		{
-			TORRENT_ASSERT(send_buffer_size() == m_encrypted_bytes);
-			m_RC4_handler->encrypt(const_cast<char*>(buf), size);
-#ifdef TORRENT_DEBUG
-			m_encrypted_bytes += size;
-#endif
-		}
+		// the copy in the send buffer is encrypted by setup_send(),
+		// which peer_connection::send_buffer() calls, so this has
+		// to be counted first
+		if (m_encrypted && m_rc4_encrypted) m_rc4_pending += size;
 #endif
 		
 		peer_connection::send_buffer(buf, size, flags);
@@ -653,39 +710,31 @@ namespace libtorrent
 
 	buffer::interval bt_peer_connection::allocate_send_buffer(int size)
 	{
+		buffer::interval i = peer_connection::allocate_send_buffer(size);
 #ifndef TORRENT_DISABLE_ENCRYPTION
-		encrypt_pending_buffer();
-		if (m_encrypted && m_rc4_encrypted)
-		{
-			TORRENT_ASSERT(m_enc_send_buffer.left() == 0);
-			m_enc_send_buffer = peer_connection::allocate_send_buffer(size);
-			return m_enc_send_buffer;
-		}
-		else
+		// the caller fills it in before calling setup_send()
+		if (m_encrypted && m_rc4_encrypted && i.begin != 0)
+			m_rc4_pending += size;
 #endif
-		{
-			buffer::interval i = peer_connection::allocate_send_buffer(size);
-			return i;
-		}
+		return i;
 	}
 	
 #ifndef TORRENT_DISABLE_ENCRYPTION
 	void bt_peer_connection::encrypt_pending_buffer()
 	{
- 		if (m_encrypted && m_rc4_encrypted && m_enc_send_buffer.left())
-		{
-			TORRENT_ASSERT(m_enc_send_buffer.begin);
-			TORRENT_ASSERT(m_enc_send_buffer.end);
-			TORRENT_ASSERT(m_RC4_handler);
-			TORRENT_ASSERT(send_buffer_size() - m_enc_send_buffer.left() == m_encrypted_bytes);
+		if (m_rc4_pending == 0) return;
+		TORRENT_ASSERT(m_encrypted && m_rc4_encrypted);
+		TORRENT_ASSERT(m_RC4_handler);
+		TORRENT_ASSERT(send_buffer_size() - m_rc4_pending == m_encrypted_bytes);
 #ifdef TORRENT_DEBUG
-			m_encrypted_bytes += m_enc_send_buffer.left();
-			TORRENT_ASSERT(m_encrypted_bytes <= send_buffer_size());
+		m_encrypted_bytes += m_rc4_pending;
+		TORRENT_ASSERT(m_encrypted_bytes <= send_buffer_size());
 #endif
-			
- 			m_RC4_handler->encrypt(m_enc_send_buffer.begin, m_enc_send_buffer.left());
-			m_enc_send_buffer.end = m_enc_send_buffer.begin;
-		}
+		// everything that was queued since the last send is
+		// encrypted in place in a single pass over the buffers
+		for_each_send_buffer_tail(m_rc4_pending
+			, boost::bind(&RC4_handler::encrypt, m_RC4_handler.get(), _1, _2));
+		m_rc4_pending = 0;
 	}
 #endif
 
@@ -1206,7 +1255,7 @@ namespace libtorrent
 				return;
 			}
 
-			std::map<int, sha1_hash> nodes;
+			merkle_node_list nodes;
 			for (int i = 0; i < hash_list.list_size(); ++i)
 			{
 				lazy_entry const* e = hash_list.list_at(i);
@@ -1220,9 +1269,10 @@ namespace libtorrent
 				(*m_logger) << " " << e->list_int_value_at(0) << ": "
 					<< sha1_hash(e->list_at(1)->string_ptr());
 #endif
-				nodes.insert(nodes.begin(), std::make_pair(int(e->list_int_value_at(0))
+				nodes.push_back(std::make_pair(int(e->list_int_value_at(0))
 					, sha1_hash(e->list_at(1)->string_ptr())));
 			}
+			std::sort(nodes.begin(), nodes.end());
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << "\n";
 #endif
@@ -1421,10 +1471,10 @@ namespace libtorrent
 		}
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::extended_hook)
+			, end(m_hooks.end(peer_plugin::extended_hook)); k < end; ++k)
 		{
-			if ((*i)->on_extended(packet_size() - 2, extended_id
+			if (m_hooks[k]->on_extended(packet_size() - 2, extended_id
 				, recv_buffer))
 				return;
 		}
@@ -1470,6 +1520,7 @@ namespace libtorrent
 			else
 				++i;
 		}
+		update_extension_hooks();
 		if (is_disconnecting()) return;
 #endif
 
@@ -1544,10 +1595,10 @@ namespace libtorrent
 			|| m_message_handler[packet_type] == 0)
 		{
 #ifndef TORRENT_DISABLE_EXTENSIONS
-			for (extension_list_t::iterator i = m_extensions.begin()
-				, end(m_extensions.end()); i != end; ++i)
+			for (int k = m_hooks.begin(peer_plugin::unknown_message_hook)
+				, end(m_hooks.end(peer_plugin::unknown_message_hook)); k < end; ++k)
 			{
-				if ((*i)->on_unknown_message(packet_size(), packet_type
+				if (m_hooks[k]->on_unknown_message(packet_size(), packet_type
 					, buffer::const_interval(recv_buffer.begin+1
 					, recv_buffer.end)))
 					return packet_finished();
@@ -1577,7 +1628,12 @@ namespace libtorrent
 		TORRENT_ASSERT(stats_diff == received);
 #endif
 
-		return packet_finished();
+		// the handler is called for every chunk of a message
+		// as it arrives, only count the message once it's complete
+		if (!packet_finished()) return false;
+		TORRENT_ASSERT(message_counter[packet_type] >= 0);
+		m_ses.m_stats_counters.inc_stats_counter(message_counter[packet_type]);
+		return true;
 	}
 
 	void bt_peer_connection::write_keepalive()
@@ -1915,6 +1971,22 @@ namespace libtorrent
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
 		TORRENT_ASSERT(t);
 
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// RC4 encrypts the send buffer in place, so cache
+		// blocks shared with other peers have to be copied
+		if (m_rc4_encrypted && buffer.is_reference())
+		{
+			char* copy = m_ses.allocate_disk_buffer("send buffer");
+			if (copy == 0)
+			{
+				disconnect("out of memory");
+				return;
+			}
+			std::memcpy(copy, buffer.get(), r.length);
+			buffer.reset(copy);
+		}
+#endif
+
 		bool merkle = t->torrent_file().is_merkle_torrent() && r.start == 0;
 	// the hash piece looks like this:
 	// uint8_t  msg
@@ -1939,17 +2011,19 @@ namespace libtorrent
 		if (merkle)
 		{
 			std::vector<char>	piece_list_buf;
-			entry piece_list;
-			entry::list_type& l = piece_list.list();
-			std::map<int, sha1_hash> merkle_node_list = t->torrent_file().build_merkle_list(r.piece);
-			for (std::map<int, sha1_hash>::iterator i = merkle_node_list.begin()
-				, end(merkle_node_list.end()); i != end; ++i)
-			{
-				l.push_back(entry(entry::list_t));
-				l.back().list().push_back(i->first);
-				l.back().list().push_back(i->second.to_string());
-			}
-			bencode(std::back_inserter(piece_list_buf), piece_list);
+			bencode_writer<std::back_insert_iterator<std::vector<char> > > w(
+				std::back_inserter(piece_list_buf));
+			merkle_node_list nodes = t->torrent_file().build_merkle_list(r.piece);
+			w.begin_list();
+			for (merkle_node_list::iterator i = nodes.begin()
+				, end(nodes.end()); i != end; ++i)
+			{
+				w.begin_list();
+				w.write_int(i->first);
+				w.write_string((char const*)&i->second[0], sha1_hash::size);
+				w.end();
+			}
+			w.end();
 			detail::write_int32(piece_list_buf.size(), ptr);
 
 			char* ptr = msg;
@@ -1963,15 +2037,67 @@ namespace libtorrent
 			send_buffer(msg, 13);
 		}
 
-		append_send_buffer(buffer.get(), r.length
-			, boost::bind(&session_impl::free_disk_buffer
-			, boost::ref(m_ses), _1));
+		// cache blocks are sent without being copied, when the
+		// send buffer is done with one it only drops its reference
+		if (buffer.is_reference())
+			append_send_buffer(buffer.get(), r.length
+				, &session_impl::reclaim_disk_send_buffer, &m_ses);
+		else
+			append_send_buffer(buffer.get(), r.length
+				, &session_impl::free_disk_send_buffer, &m_ses);
 		buffer.release();
 
 		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
 		setup_send();
 	}
 
+	bool bt_peer_connection::write_piece_from_file(peer_request const& r)
+	{
+#if TORRENT_USE_SENDFILE
+		if (!m_ses.settings().use_sendfile) return false;
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// RC4 has to see the payload
+		if (m_rc4_encrypted) return false;
+#endif
+		// sendfile() needs the socket itself, not a proxy stream
+		if (get_socket()->get<stream_socket>() == 0) return false;
+
+		boost::shared_ptr<torrent> t = associated_torrent().lock();
+		TORRENT_ASSERT(t);
+
+		// merkle torrents may send hashes along with the payload
+		if (t->torrent_file().is_merkle_torrent()) return false;
+
+		size_type file_offset = 0;
+		boost::shared_ptr<file> f = t->filesystem().file_for_request(r, file_offset);
+		if (!f) return false;
+
+#ifdef TORRENT_VERBOSE_LOGGING
+		(*m_logger) << time_now_string()
+			<< " ==> PIECE   [ piece: " << r.piece << " | s: " << r.start
+			<< " | l: " << r.length << " | sendfile ]\n";
+#endif
+
+		char msg[4 + 1 + 4 + 4];
+		char* ptr = msg;
+		TORRENT_ASSERT(r.length <= 16 * 1024);
+		detail::write_int32(r.length + 1 + 4 + 4, ptr);
+		detail::write_uint8(msg_piece, ptr);
+		detail::write_int32(r.piece, ptr);
+		detail::write_int32(r.start, ptr);
+		send_buffer(msg, sizeof(msg));
+
+		append_send_file(f, file_offset, r.length);
+
+		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
+		setup_send();
+		return true;
+#else
+		return false;
+#endif
+	}
+
 	namespace
 	{
 		struct match_peer_id
@@ -2021,6 +2147,14 @@ namespace libtorrent
 		}
 #endif
 
+		// once the handshake is done, skip the checks
+		// for all the handshake states
+		if (m_state >= read_packet_size)
+		{
+			on_receive_packet(t, bytes_transferred);
+			return;
+		}
+
 		buffer::const_interval recv_buffer = receive_buffer();
 
 #ifndef TORRENT_DISABLE_ENCRYPTION
@@ -2180,33 +2314,28 @@ namespace libtorrent
 
 			recv_buffer = receive_buffer();
 
-			aux::session_impl::torrent_map::const_iterator i;
+			// the peer sent hash('req2', info-hash) xor hash('req3', S).
+			// Removing the mask leaves the obfuscated info-hash, which
+			// the session has an index of
+			sha1_hash skey_hash(recv_buffer.begin);
+			skey_hash ^= m_dh_key_exchange->get_hash_xor_mask();
 
-			for (i = m_ses.m_torrents.begin(); i != m_ses.m_torrents.end(); ++i)
+			boost::shared_ptr<torrent> ti = m_ses.find_encrypted_torrent(skey_hash).lock();
+			if (ti)
 			{
-				torrent const& ti = *i->second;
-				sha1_hash const& skey_hash = ti.obfuscated_hash();
-				sha1_hash obfs_hash = m_dh_key_exchange->get_hash_xor_mask();
-				obfs_hash ^= skey_hash;
-
-				if (std::equal(recv_buffer.begin, recv_buffer.begin + 20,
-					(char*)&obfs_hash[0]))
+				if (!t)
 				{
-					if (!t)
-					{
-						attach_to_torrent(ti.info_hash());
-						if (is_disconnecting()) return;
+					attach_to_torrent(ti->info_hash());
+					if (is_disconnecting()) return;
 
-						t = associated_torrent().lock();
-						TORRENT_ASSERT(t);
-					}
+					t = associated_torrent().lock();
+					TORRENT_ASSERT(t);
+				}
 
-					init_pe_RC4_handler(m_dh_key_exchange->get_secret(), ti.info_hash());
+				init_pe_RC4_handler(m_dh_key_exchange->get_secret(), ti->info_hash());
 #ifdef TORRENT_VERBOSE_LOGGING
-					(*m_logger) << " stream key found, torrent located.\n";
+				(*m_logger) << " stream key found, torrent located.\n";
 #endif
-					break;
-				}
 			}
 
 			if (!m_RC4_handler.get())
@@ -2803,6 +2932,7 @@ namespace libtorrent
 					++i;
 				}
 			}
+			update_extension_hooks();
 			if (is_disconnecting()) return;
 
 			if (m_supports_extensions) write_extensions();
@@ -2842,7 +2972,16 @@ namespace libtorrent
 			return;
 		}
 
-		// cannot fall through into
+		TORRENT_ASSERT(!packet_finished());
+	}
+
+	// the steady state of an established connection, going back and
+	// forth between reading the length prefix and the message
+	void bt_peer_connection::on_receive_packet(boost::shared_ptr<torrent> const& t
+		, std::size_t bytes_transferred)
+	{
+		buffer::const_interval recv_buffer = receive_buffer();
+
 		if (m_state == read_packet_size)
 		{
 			// Make sure this is not fallen though into
@@ -2925,9 +3064,9 @@ namespace libtorrent
 			TORRENT_ASSERT(!packet_finished());
 			return;
 		}
-		
+
 		TORRENT_ASSERT(!packet_finished());
-	}	
+	}
 
 	// --------------------------
 	// SEND DATA
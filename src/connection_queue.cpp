@@ -31,6 +31,9 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <boost/bind.hpp>
+#include <algorithm>
+#include <functional>
+#include <list>
 #include "libtorrent/invariant_check.hpp"
 #include "libtorrent/connection_queue.hpp"
 #include "libtorrent/socket.hpp"
@@ -38,7 +41,9 @@ POSSIBILITY OF SUCH DAMAGE.
 namespace libtorrent
 {
 
-	connection_queue::connection_queue(io_service& ios): m_next_ticket(0)
+	connection_queue::connection_queue(io_service& ios)
+		: m_next_timeout(max_time())
+		, m_next_ticket(0)
 		, m_num_connecting(0)
 		, m_half_open_limit(0)
 		, m_abort(false)
@@ -56,12 +61,12 @@ namespace libtorrent
 	{
 		mutex_t::scoped_lock l(m_mutex);
 		return m_half_open_limit == 0 ? (std::numeric_limits<int>::max)()
-			: m_half_open_limit - m_queue.size();
+			: m_half_open_limit - m_entries.size();
 	}
 
 	void connection_queue::enqueue(boost::function<void(int)> const& on_connect
 		, boost::function<void()> const& on_timeout
-		, time_duration timeout, int priority)
+		, time_duration timeout, int priority, void const* owner)
 	{
 		mutex_t::scoped_lock l(m_mutex);
 
@@ -70,26 +75,21 @@ namespace libtorrent
 		TORRENT_ASSERT(priority >= 0);
 		TORRENT_ASSERT(priority < 2);
 
-		entry* e = 0;
+		int ticket = m_next_ticket;
+		++m_next_ticket;
 
-		switch (priority)
-		{
-			case 0:
-				m_queue.push_back(entry());
-				e = &m_queue.back();
-				break;
-			case 1:
-				m_queue.push_front(entry());
-				e = &m_queue.front();
-				break;
-		}
+		entry& e = m_entries[ticket];
+		e.priority = priority;
+		e.on_connect = on_connect;
+		e.on_timeout = on_timeout;
+		e.ticket = ticket;
+		e.timeout = timeout;
+		e.queued = time_now_hires();
 
-		e->priority = priority;
-		e->on_connect = on_connect;
-		e->on_timeout = on_timeout;
-		e->ticket = m_next_ticket;
-		e->timeout = timeout;
-		++m_next_ticket;
+		waiting_queue& q = m_waiting[priority];
+		std::deque<int>& tickets = q.tickets[owner];
+		if (tickets.empty()) q.owners.push_back(owner);
+		tickets.push_back(ticket);
 
 		if (m_num_connecting < m_half_open_limit
 			|| m_half_open_limit == 0)
@@ -97,21 +97,36 @@ namespace libtorrent
 				&connection_queue::on_try_connect, this));
 	}
 
-	void connection_queue::done(int ticket)
+	void connection_queue::done(int ticket, int result)
 	{
 		mutex_t::scoped_lock l(m_mutex);
 
 		INVARIANT_CHECK;
 
-		std::list<entry>::iterator i = std::find_if(m_queue.begin()
-			, m_queue.end(), boost::bind(&entry::ticket, _1) == ticket);
-		if (i == m_queue.end())
+		entries_t::iterator i = m_entries.find(ticket);
+		if (i == m_entries.end())
 		{
 			// this might not be here in case on_timeout calls remove
 			return;
 		}
-		if (i->connecting) --m_num_connecting;
-		m_queue.erase(i);
+		// its tickets in m_waiting and m_timeouts are
+		// skipped once they're reached
+		if (i->second.connecting)
+		{
+			--m_num_connecting;
+			if (result == connect_succeeded)
+			{
+				++m_connect_stats.succeeded;
+				// expires was set to the start time plus the timeout
+				m_connect_stats.total_time += total_milliseconds(time_now_hires()
+					- (i->second.expires - i->second.timeout));
+			}
+			else if (result == connect_failed)
+			{
+				++m_connect_stats.failed;
+			}
+		}
+		m_entries.erase(i);
 
 		if (m_num_connecting < m_half_open_limit
 			|| m_half_open_limit == 0)
@@ -124,14 +139,15 @@ namespace libtorrent
 		error_code ec;
 		mutex_t::scoped_lock l(m_mutex);
 		m_timer.cancel(ec);
+		m_next_timeout = max_time();
 		m_abort = true;
 
-		while (!m_queue.empty())
+		while (!m_entries.empty())
 		{
 			// we don't want to call the timeout callback while we're locked
 			// since that is a recipie for dead-locks
-			entry e = m_queue.front();
-			m_queue.pop_front();
+			entry e = m_entries.begin()->second;
+			m_entries.erase(m_entries.begin());
 			if (e.connecting) --m_num_connecting;
 			l.unlock();
 #ifndef BOOST_NO_EXCEPTIONS
@@ -143,6 +159,12 @@ namespace libtorrent
 #endif
 			l.lock();
 		}
+		for (int i = 0; i < 2; ++i)
+		{
+			m_waiting[i].tickets.clear();
+			m_waiting[i].owners.clear();
+		}
+		m_timeouts.clear();
 	}
 
 	void connection_queue::limit(int limit)
@@ -154,21 +176,103 @@ namespace libtorrent
 	int connection_queue::limit() const
 	{ return m_half_open_limit; }
 
+	void connection_queue::get_wait_time(latency_histogram& h) const
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		h = m_wait_time;
+	}
+
+	void connection_queue::get_connect_stats(connect_stats& st)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		st.succeeded += m_connect_stats.succeeded;
+		st.failed += m_connect_stats.failed;
+		st.timed_out += m_connect_stats.timed_out;
+		st.total_time += m_connect_stats.total_time;
+		m_connect_stats = connect_stats();
+	}
+
 #ifdef TORRENT_DEBUG
 
 	void connection_queue::check_invariant() const
 	{
 		int num_connecting = 0;
-		for (std::list<entry>::const_iterator i = m_queue.begin();
-			i != m_queue.end(); ++i)
+		for (entries_t::const_iterator i = m_entries.begin();
+			i != m_entries.end(); ++i)
 		{
-			if (i->connecting) ++num_connecting;
+			if (i->second.connecting) ++num_connecting;
 		}
 		TORRENT_ASSERT(num_connecting == m_num_connecting);
 	}
 
 #endif
 
+	connection_queue::entries_t::iterator connection_queue::next_waiting()
+	{
+		for (int p = 1; p >= 0; --p)
+		{
+			waiting_queue& q = m_waiting[p];
+			while (!q.owners.empty())
+			{
+				void const* owner = q.owners.front();
+				q.owners.pop_front();
+				std::map<void const*, std::deque<int> >::iterator i
+					= q.tickets.find(owner);
+				TORRENT_ASSERT(i != q.tickets.end());
+				std::deque<int>& tickets = i->second;
+
+				entries_t::iterator e = m_entries.end();
+				while (!tickets.empty() && e == m_entries.end())
+				{
+					e = m_entries.find(tickets.front());
+					tickets.pop_front();
+				}
+
+				// the owner goes to the back of the line
+				if (tickets.empty()) q.tickets.erase(i);
+				else q.owners.push_back(owner);
+
+				if (e != m_entries.end())
+				{
+					TORRENT_ASSERT(!e->second.connecting);
+					return e;
+				}
+			}
+		}
+		return m_entries.end();
+	}
+
+	void connection_queue::pop_timeout()
+	{
+		std::pop_heap(m_timeouts.begin(), m_timeouts.end()
+			, std::greater<timeout_entry>());
+		m_timeouts.pop_back();
+	}
+
+	void connection_queue::update_timer()
+	{
+		// drop the timeouts of entries that are done
+		while (!m_timeouts.empty())
+		{
+			entries_t::iterator i = m_entries.find(m_timeouts.front().second);
+			if (i != m_entries.end() && i->second.connecting) break;
+			pop_timeout();
+		}
+
+		ptime next = m_timeouts.empty() ? max_time() : m_timeouts.front().first;
+		if (next == m_next_timeout) return;
+		m_next_timeout = next;
+
+		error_code ec;
+		if (next == max_time())
+		{
+			m_timer.cancel(ec);
+			return;
+		}
+		m_timer.expires_at(next, ec);
+		m_timer.async_wait(boost::bind(&connection_queue::on_timeout, this, _1));
+	}
+
 	void connection_queue::try_connect(connection_queue::mutex_t::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
@@ -182,45 +286,40 @@ namespace libtorrent
 		if (m_num_connecting >= m_half_open_limit
 			&& m_half_open_limit > 0) return;
 	
-		if (m_queue.empty())
+		if (m_entries.empty())
 		{
-			error_code ec;
-			m_timer.cancel(ec);
+			m_timeouts.clear();
+			update_timer();
 			return;
 		}
 
-		std::list<entry>::iterator i = std::find_if(m_queue.begin()
-			, m_queue.end(), boost::bind(&entry::connecting, _1) == false);
-
 		std::list<entry> to_connect;
+		ptime now = time_now_hires();
 
-		while (i != m_queue.end())
+		while (m_num_connecting < m_half_open_limit
+			|| m_half_open_limit == 0)
 		{
-			TORRENT_ASSERT(i->connecting == false);
-			ptime expire = time_now() + i->timeout;
-			if (m_num_connecting == 0)
-			{
-				error_code ec;
-				m_timer.expires_at(expire, ec);
-				m_timer.async_wait(boost::bind(&connection_queue::on_timeout, this, _1));
-			}
-			i->connecting = true;
-			++m_num_connecting;
-			i->expires = expire;
+			entries_t::iterator i = next_waiting();
+			if (i == m_entries.end()) break;
 
-			INVARIANT_CHECK;
+			entry& e = i->second;
+			e.connecting = true;
+			++m_num_connecting;
+			e.expires = now + e.timeout;
+			m_timeouts.push_back(timeout_entry(e.expires, e.ticket));
+			std::push_heap(m_timeouts.begin(), m_timeouts.end()
+				, std::greater<timeout_entry>());
+			m_wait_time.add(now - e.queued);
 
-			to_connect.push_back(*i);
+			to_connect.push_back(e);
 
 #ifdef TORRENT_CONNECTION_LOGGING
 			m_log << log_time() << " " << free_slots() << std::endl;
 #endif
-
-			if (m_num_connecting >= m_half_open_limit
-				&& m_half_open_limit > 0) break;
-			i = std::find_if(i, m_queue.end(), boost::bind(&entry::connecting, _1) == false);
 		}
 
+		update_timer();
+
 		l.unlock();
 
 		while (!to_connect.empty())
@@ -260,23 +359,18 @@ namespace libtorrent
 		TORRENT_ASSERT(!e || e == asio::error::operation_aborted);
 		if (e) return;
 
-		ptime next_expire = max_time();
-		ptime now = time_now();
+		m_next_timeout = max_time();
+		ptime now = time_now_hires();
 		std::list<entry> timed_out;
-		for (std::list<entry>::iterator i = m_queue.begin();
-			!m_queue.empty() && i != m_queue.end();)
+		while (!m_timeouts.empty() && !(now < m_timeouts.front().first))
 		{
-			if (i->connecting && i->expires < now)
-			{
-				std::list<entry>::iterator j = i;
-				++i;
-				timed_out.splice(timed_out.end(), m_queue, j, i);
-				--m_num_connecting;
-				continue;
-			}
-			if (i->expires < next_expire)
-				next_expire = i->expires;
-			++i;
+			entries_t::iterator i = m_entries.find(m_timeouts.front().second);
+			pop_timeout();
+			if (i == m_entries.end() || !i->second.connecting) continue;
+			timed_out.push_back(i->second);
+			m_entries.erase(i);
+			--m_num_connecting;
+			++m_connect_stats.timed_out;
 		}
 
 		// we don't want to call the timeout callback while we're locked
@@ -297,12 +391,7 @@ namespace libtorrent
 		
 		l.lock();
 		
-		if (next_expire < max_time())
-		{
-			error_code ec;
-			m_timer.expires_at(next_expire, ec);
-			m_timer.async_wait(boost::bind(&connection_queue::on_timeout, this, _1));
-		}
+		update_timer();
 		try_connect(l);
 	}
 
@@ -312,4 +401,3 @@ namespace libtorrent
 		try_connect(l);
 	}
 }
-
@@ -33,10 +33,18 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/create_torrent.hpp"
 #include "libtorrent/file_pool.hpp"
 #include "libtorrent/storage.hpp"
+#include "libtorrent/session_settings.hpp"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <map>
 
 #ifndef TORRENT_WINDOWS
 #include <sys/types.h>
@@ -89,6 +97,259 @@ namespace libtorrent
 			return (s.st_mode & S_IXUSR) ? file_storage::attribute_executable : 0;
 #endif
 		}
+
+		namespace
+		{
+			// a run of consecutive pieces read into one buffer
+			struct hash_batch
+			{
+				int piece;
+				int num_pieces;
+				char* buf;
+			};
+
+			// hashes batches of pieces on a set of threads. The
+			// number of buffers in flight is bounded, so reading
+			// blocks when the hash threads fall behind
+			struct hash_pool : boost::noncopyable
+			{
+				typedef boost::mutex mutex_t;
+
+				hash_pool(create_torrent const& t, int num_threads, int buffer_size)
+					: m_t(t)
+					, m_buffer_size(buffer_size)
+					, m_hashes(t.num_pieces())
+					, m_done(t.num_pieces(), false)
+					, m_num_buffers(0)
+					, m_max_buffers((std::max)(num_threads * 2, 1))
+					, m_abort(false)
+				{
+					for (int i = 0; i < num_threads; ++i)
+					{
+						m_threads.push_back(boost::shared_ptr<boost::thread>(
+							new boost::thread(boost::bind(&hash_pool::thread_fun, this))));
+					}
+				}
+
+				~hash_pool()
+				{
+					{
+						mutex_t::scoped_lock l(m_mutex);
+						m_abort = true;
+						m_cond.notify_all();
+					}
+					for (std::vector<boost::shared_ptr<boost::thread> >::iterator i
+						= m_threads.begin(), end(m_threads.end()); i != end; ++i)
+						(*i)->join();
+
+					for (std::deque<hash_batch>::iterator i = m_queue.begin()
+						, end(m_queue.end()); i != end; ++i)
+						page_aligned_allocator::free(i->buf);
+					for (std::vector<char*>::iterator i = m_free.begin()
+						, end(m_free.end()); i != end; ++i)
+						page_aligned_allocator::free(*i);
+				}
+
+				// blocks until a buffer is available. Returns 0
+				// if it could not be allocated
+				char* allocate_buffer()
+				{
+					mutex_t::scoped_lock l(m_mutex);
+					while (m_free.empty() && m_num_buffers >= m_max_buffers)
+						m_cond.wait(l);
+					if (!m_free.empty())
+					{
+						char* ret = m_free.back();
+						m_free.pop_back();
+						return ret;
+					}
+					char* ret = page_aligned_allocator::malloc(m_buffer_size);
+					if (ret) ++m_num_buffers;
+					return ret;
+				}
+
+				void free_buffer(char* buf)
+				{
+					mutex_t::scoped_lock l(m_mutex);
+					m_free.push_back(buf);
+					m_cond.notify_all();
+				}
+
+				// takes ownership of the buffer. Without any
+				// threads the batch is hashed right away
+				void post(hash_batch const& b)
+				{
+					if (m_threads.empty())
+					{
+						hash(b);
+						return;
+					}
+					mutex_t::scoped_lock l(m_mutex);
+					m_queue.push_back(b);
+					m_cond.notify_all();
+				}
+
+				// returns true and sets h if the piece
+				// has been hashed
+				bool try_get(int piece, sha1_hash& h)
+				{
+					mutex_t::scoped_lock l(m_mutex);
+					if (!m_done[piece]) return false;
+					h = m_hashes[piece];
+					return true;
+				}
+
+				// blocks until the piece has been hashed
+				sha1_hash get(int piece)
+				{
+					mutex_t::scoped_lock l(m_mutex);
+					while (!m_done[piece]) m_cond.wait(l);
+					return m_hashes[piece];
+				}
+
+			private:
+
+				void hash(hash_batch const& b)
+				{
+					std::vector<sha1_hash> h(b.num_pieces);
+					char const* ptr = b.buf;
+					for (int i = 0; i < b.num_pieces; ++i)
+					{
+						int size = m_t.piece_size(b.piece + i);
+						h[i] = hasher(ptr, size).final();
+						ptr += size;
+					}
+
+					mutex_t::scoped_lock l(m_mutex);
+					for (int i = 0; i < b.num_pieces; ++i)
+					{
+						m_hashes[b.piece + i] = h[i];
+						m_done[b.piece + i] = true;
+					}
+					m_free.push_back(b.buf);
+					m_cond.notify_all();
+				}
+
+				void thread_fun()
+				{
+					for (;;)
+					{
+						mutex_t::scoped_lock l(m_mutex);
+						while (m_queue.empty() && !m_abort) m_cond.wait(l);
+						if (m_abort) return;
+						hash_batch b = m_queue.front();
+						m_queue.pop_front();
+						l.unlock();
+						hash(b);
+					}
+				}
+
+				create_torrent const& m_t;
+				int m_buffer_size;
+
+				// protects everything below
+				mutex_t m_mutex;
+				// signalled when a batch is queued, when pieces
+				// have been hashed and when a buffer is freed
+				boost::condition m_cond;
+
+				std::vector<sha1_hash> m_hashes;
+				std::vector<bool> m_done;
+				std::deque<hash_batch> m_queue;
+				std::vector<char*> m_free;
+				int m_num_buffers;
+				int m_max_buffers;
+				bool m_abort;
+
+				std::vector<boost::shared_ptr<boost::thread> > m_threads;
+			};
+		}
+
+		void hash_pieces(create_torrent& t, storage_interface& st
+			, boost::function<void(int)> const& f, int flags, int num_threads
+			, error_code& ec)
+		{
+			session_settings s;
+			session_settings* prev_settings = st.m_settings;
+			if (flags & hash_disable_os_cache)
+			{
+				s.disk_io_read_mode = session_settings::disable_os_cache;
+				st.m_settings = &s;
+			}
+
+			if (num_threads <= 0) num_threads = boost::thread::hardware_concurrency();
+			// with a single core, hash on the reading thread
+			if (num_threads <= 1) num_threads = 0;
+
+			int num = t.num_pieces();
+			int piece_length = t.piece_length();
+			// read about 4 MiB at a time, to keep the disk
+			// reading sequentially in large chunks
+			int pieces_per_read = (std::max)(1, 4 * 1024 * 1024 / piece_length);
+
+			int next = 0;
+			{
+				hash_pool pool(t, num_threads, pieces_per_read * piece_length);
+
+				int i = 0;
+				while (i < num)
+				{
+					if (t.hash_reused(i))
+					{
+						++i;
+						continue;
+					}
+
+					// read a run of pieces that need hashing
+					int n = 1;
+					while (n < pieces_per_read && i + n < num && !t.hash_reused(i + n)) ++n;
+					int size = (n - 1) * piece_length + t.piece_size(i + n - 1);
+
+					char* buf = pool.allocate_buffer();
+					if (buf == 0)
+					{
+						ec = error_code(ENOMEM, get_posix_category());
+						break;
+					}
+
+					// read hits the disk and will block. Progress is
+					// reported in between reads
+					st.read(buf, i, 0, size);
+					if (st.error())
+					{
+						ec = st.error();
+						pool.free_buffer(buf);
+						break;
+					}
+
+					hash_batch b = { i, n, buf };
+					pool.post(b);
+					i += n;
+
+					sha1_hash h;
+					for (; next < num; ++next)
+					{
+						if (!t.hash_reused(next))
+						{
+							if (!pool.try_get(next, h)) break;
+							t.set_hash(next, h);
+						}
+						f(next);
+					}
+				}
+
+				if (!ec)
+				{
+					for (; next < num; ++next)
+					{
+						if (!t.hash_reused(next)) t.set_hash(next, pool.get(next));
+						f(next);
+					}
+				}
+			}
+
+			st.m_settings = prev_settings;
+		}
 	}
 
 	create_torrent::create_torrent(file_storage& fs, int piece_size, int pad_file_limit, int flags)
@@ -373,6 +634,80 @@ namespace libtorrent
 		m_piece_hash[index] = h;
 	}
 
+	int create_torrent::reuse_piece_hashes(torrent_info const& prev
+		, std::vector<std::pair<size_type, std::time_t> > const& prev_sizes
+		, std::vector<std::pair<size_type, std::time_t> > const& sizes)
+	{
+		file_storage const& prev_files = prev.orig_files();
+		if (prev.is_merkle_torrent() || m_merkle_torrent) return 0;
+		if (prev_files.piece_length() != m_files.piece_length()) return 0;
+		if (int(prev_sizes.size()) != prev_files.num_files()) return 0;
+		if (int(sizes.size()) != m_files.num_files()) return 0;
+
+		std::map<std::string, int> prev_index;
+		for (int i = 0; i < prev_files.num_files(); ++i)
+		{
+			file_entry const& e = prev_files.at(i);
+			if (e.pad_file) continue;
+			prev_index[e.path.string()] = i;
+		}
+
+		// a file is unchanged if the previous torrent has it at the
+		// same offset, with the same size and modification time. Pad
+		// files only need to be at the same offset with the same size
+		std::vector<bool> unchanged(m_files.num_files(), false);
+		for (int i = 0; i < m_files.num_files(); ++i)
+		{
+			file_entry const& e = m_files.at(i);
+			if (e.offset >= prev_files.total_size()) continue;
+			int j = -1;
+			if (e.pad_file)
+			{
+				if (e.size == 0)
+				{
+					unchanged[i] = true;
+					continue;
+				}
+				int piece = int(e.offset / prev_files.piece_length());
+				std::vector<file_slice> s = prev_files.map_block(piece
+					, e.offset - size_type(piece) * prev_files.piece_length(), 1);
+				if (s.empty() || !prev_files.at(s[0].file_index).pad_file) continue;
+				j = s[0].file_index;
+			}
+			else
+			{
+				std::map<std::string, int>::iterator k = prev_index.find(e.path.string());
+				if (k == prev_index.end()) continue;
+				j = k->second;
+				if (sizes[i].first != e.size
+					|| prev_sizes[j] != sizes[i]) continue;
+			}
+			file_entry const& pe = prev_files.at(j);
+			unchanged[i] = pe.offset == e.offset && pe.size == e.size;
+		}
+
+		m_hash_reused.resize(num_pieces(), false);
+		int ret = 0;
+		for (int i = 0; i < num_pieces() && i < prev.num_pieces(); ++i)
+		{
+			if (piece_size(i) != prev.piece_size(i)) continue;
+			std::vector<file_slice> s = m_files.map_block(i, 0, piece_size(i));
+			bool reuse = true;
+			for (std::vector<file_slice>::iterator k = s.begin()
+				, end(s.end()); k != end; ++k)
+			{
+				if (unchanged[k->file_index]) continue;
+				reuse = false;
+				break;
+			}
+			if (!reuse) continue;
+			set_hash(i, prev.hash_for_piece(i));
+			m_hash_reused[i] = true;
+			++ret;
+		}
+		return ret;
+	}
+
 	void create_torrent::add_node(std::pair<std::string, int> const& node)
 	{
 		m_nodes.push_back(node);
@@ -38,32 +38,41 @@ namespace libtorrent
 {
 
 	disk_buffer_holder::disk_buffer_holder(aux::session_impl& ses, char* buf)
-		: m_disk_pool(ses.m_disk_thread), m_buf(buf), m_num_blocks(1)
+		: m_disk_pool(ses.m_disk_thread), m_buf(buf), m_num_blocks(1), m_ref(false)
 	{
 		TORRENT_ASSERT(buf == 0 || m_disk_pool.is_disk_buffer(buf));
 	}
 
 	disk_buffer_holder::disk_buffer_holder(disk_buffer_pool& iothread, char* buf)
-		: m_disk_pool(iothread), m_buf(buf), m_num_blocks(1)
+		: m_disk_pool(iothread), m_buf(buf), m_num_blocks(1), m_ref(false)
 	{
 		TORRENT_ASSERT(buf == 0 || m_disk_pool.is_disk_buffer(buf));
 	}
 
 	disk_buffer_holder::disk_buffer_holder(disk_buffer_pool& iothread, char* buf, int num_blocks)
-		: m_disk_pool(iothread), m_buf(buf), m_num_blocks(num_blocks)
+		: m_disk_pool(iothread), m_buf(buf), m_num_blocks(num_blocks), m_ref(false)
 	{
 		TORRENT_ASSERT(buf == 0 || m_disk_pool.is_disk_buffer(buf));
 	}
 
+	disk_buffer_holder::disk_buffer_holder(aux::session_impl& ses, disk_io_job const& j)
+		: m_disk_pool(ses.m_disk_thread), m_buf(j.buffer), m_num_blocks(1)
+		, m_ref(j.cached_buffer)
+	{
+		TORRENT_ASSERT(m_buf == 0 || m_disk_pool.is_disk_buffer(m_buf));
+	}
+
 	void disk_buffer_holder::reset(char* buf, int num_blocks)
 	{
 		if (m_buf)
 		{
-			if (m_num_blocks == 1) m_disk_pool.free_buffer(m_buf);
+			if (m_ref) m_disk_pool.reclaim_buffer(m_buf);
+			else if (m_num_blocks == 1) m_disk_pool.free_buffer(m_buf);
 			else m_disk_pool.free_buffers(m_buf, m_num_blocks);
 		}
 		m_buf = buf;
 		m_num_blocks = num_blocks;
+		m_ref = false;
 	}
 
 	char* disk_buffer_holder::release()
@@ -77,7 +86,8 @@ namespace libtorrent
 	{
 		if (m_buf)
 		{
-			if (m_num_blocks == 1) m_disk_pool.free_buffer(m_buf);
+			if (m_ref) m_disk_pool.reclaim_buffer(m_buf);
+			else if (m_num_blocks == 1) m_disk_pool.free_buffer(m_buf);
 			else m_disk_pool.free_buffers(m_buf, m_num_blocks);
 		}
 	}
@@ -48,16 +48,27 @@ POSSIBILITY OF SUCH DAMAGE.
 
 namespace libtorrent
 {
+	namespace
+	{
+		// the trace event names of the disk_io_job actions
+		char const* const job_action_names[] =
+		{
+			"read", "write", "hash", "move_storage", "release_files"
+			, "delete_files", "check_fastresume", "check_files"
+			, "save_resume_data", "rename_file", "abort_thread"
+			, "clear_read_cache", "abort_torrent", "update_settings"
+			, "read_and_hash", "relocate_pieces", "discard_piece"
+		};
+	}
+
 	disk_buffer_pool::disk_buffer_pool(int block_size)
 		: m_block_size(block_size)
 		, m_in_use(0)
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
 		, m_pool(block_size, m_settings.cache_buffer_chunk_size)
 #endif
+		, m_thread_cache(&disk_buffer_pool::release_thread_cache)
 	{
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		m_allocations = 0;
-#endif
 #ifdef TORRENT_DISK_STATS
 		m_log.open("disk_buffers.log", std::ios::trunc);
 		m_categories["read cache"] = 0;
@@ -99,15 +110,72 @@ namespace libtorrent
 	}
 #endif
 
-	char* disk_buffer_pool::allocate_buffer(char const* category)
+	disk_buffer_pool::thread_cache& disk_buffer_pool::local_cache()
+	{
+		thread_cache* c = m_thread_cache.get();
+		if (c) return *c;
+		c = new thread_cache(this);
+		c->blocks.reserve(thread_cache_max + 1);
+		m_thread_cache.reset(c);
+		return *c;
+	}
+
+	void disk_buffer_pool::refill_thread_cache(thread_cache& c)
+	{
+		mutex_t::scoped_lock l(m_pool_mutex);
+		for (int i = 0; i < thread_cache_batch; ++i)
+		{
+#ifdef TORRENT_DISABLE_POOL_ALLOCATOR
+			char* b = page_aligned_allocator::malloc(m_block_size);
+#else
+			char* b = (char*)m_pool.ordered_malloc();
+			m_pool.set_next_size(m_settings.cache_buffer_chunk_size);
+#endif
+			if (b == 0) break;
+			c.blocks.push_back(b);
+		}
+	}
+
+	void disk_buffer_pool::drain_thread_cache(thread_cache& c, int num_blocks)
 	{
+		TORRENT_ASSERT(num_blocks <= int(c.blocks.size()));
 		mutex_t::scoped_lock l(m_pool_mutex);
+		for (int i = 0; i < num_blocks; ++i)
+		{
+#ifdef TORRENT_DISABLE_POOL_ALLOCATOR
+			page_aligned_allocator::free(c.blocks.back());
+#else
+			m_pool.ordered_free(c.blocks.back());
+#endif
+			c.blocks.pop_back();
+		}
+	}
+
+	// called when a thread that has used the pool exits
+	void disk_buffer_pool::release_thread_cache(thread_cache* c)
+	{
+		c->pool->drain_thread_cache(*c, c->blocks.size());
+		delete c;
+	}
+
+	char* disk_buffer_pool::allocate_buffer(char const* category)
+	{
 		TORRENT_ASSERT(m_magic == 0x1337);
+#ifdef TORRENT_DISK_STATS
+		// the per category statistics need the mutex anyway
+		mutex_t::scoped_lock l(m_pool_mutex);
 #ifdef TORRENT_DISABLE_POOL_ALLOCATOR
 		char* ret = page_aligned_allocator::malloc(m_block_size);
 #else
 		char* ret = (char*)m_pool.ordered_malloc();
 		m_pool.set_next_size(m_settings.cache_buffer_chunk_size);
+#endif
+#else
+		thread_cache& c = local_cache();
+		if (c.blocks.empty()) refill_thread_cache(c);
+		if (c.blocks.empty()) return 0;
+		char* ret = c.blocks.back();
+		c.blocks.pop_back();
 #endif
 		++m_in_use;
 #if TORRENT_USE_MLOCK
@@ -121,15 +189,14 @@ namespace libtorrent
 		}
 #endif
 
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		++m_allocations;
-#endif
 #ifdef TORRENT_DISK_STATS
 		++m_categories[category];
 		m_buf_to_category[ret] = category;
 		m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
-#endif
 		TORRENT_ASSERT(ret == 0 || is_disk_buffer(ret, l));
+#else
+		TORRENT_ASSERT(is_disk_buffer(ret));
+#endif
 		return ret;
 	}
 
@@ -155,13 +222,10 @@ namespace libtorrent
 	void disk_buffer_pool::free_buffer(char* buf)
 	{
 		TORRENT_ASSERT(buf);
-		mutex_t::scoped_lock l(m_pool_mutex);
 		TORRENT_ASSERT(m_magic == 0x1337);
-		TORRENT_ASSERT(is_disk_buffer(buf, l));
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		--m_allocations;
-#endif
+		TORRENT_ASSERT(is_disk_buffer(buf));
 #ifdef TORRENT_DISK_STATS
+		mutex_t::scoped_lock l(m_pool_mutex);
 		TORRENT_ASSERT(m_categories.find(m_buf_to_category[buf])
 			!= m_categories.end());
 		std::string const& category = m_buf_to_category[buf];
@@ -179,10 +243,19 @@ namespace libtorrent
 #endif		
 		}
 #endif
+#ifdef TORRENT_DISK_STATS
 #ifdef TORRENT_DISABLE_POOL_ALLOCATOR
 		page_aligned_allocator::free(buf);
 #else
 		m_pool.ordered_free(buf);
+#endif
+#else
+		thread_cache& c = local_cache();
+		c.blocks.push_back(buf);
+		// give half of the blocks back, to leave room for more
+		// frees as well as allocations without locking
+		if (int(c.blocks.size()) > thread_cache_max)
+			drain_thread_cache(c, thread_cache_max / 2);
 #endif
 		--m_in_use;
 	}
@@ -197,7 +270,8 @@ namespace libtorrent
 		char* ret = (char*)m_pool.ordered_malloc(num_blocks);
 		m_pool.set_next_size(m_settings.cache_buffer_chunk_size);
 #endif
-		m_in_use += num_blocks;
+		if (ret == 0) return 0;
+		for (int i = 0; i < num_blocks; ++i) ++m_in_use;
 #if TORRENT_USE_MLOCK
 		if (m_settings.lock_disk_cache)
 		{
@@ -208,9 +282,6 @@ namespace libtorrent
 #endif		
 		}
 #endif
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		m_allocations += num_blocks;
-#endif
 #ifdef TORRENT_DISK_STATS
 		m_categories[category] += num_blocks;
 		m_buf_to_category[ret] = category;
@@ -227,9 +298,6 @@ namespace libtorrent
 		mutex_t::scoped_lock l(m_pool_mutex);
 		TORRENT_ASSERT(m_magic == 0x1337);
 		TORRENT_ASSERT(is_disk_buffer(buf, l));
-#if defined TORRENT_DISK_STATS || defined TORRENT_STATS
-		m_allocations -= num_blocks;
-#endif
 #ifdef TORRENT_DISK_STATS
 		TORRENT_ASSERT(m_categories.find(m_buf_to_category[buf])
 			!= m_categories.end());
@@ -253,7 +321,32 @@ namespace libtorrent
 #else
 		m_pool.ordered_free(buf, num_blocks);
 #endif
-		m_in_use -= num_blocks;
+		for (int i = 0; i < num_blocks; ++i) --m_in_use;
+	}
+
+	void disk_buffer_pool::ref_buffer(char* buf)
+	{
+		TORRENT_ASSERT(buf);
+		TORRENT_ASSERT(m_magic == 0x1337);
+		mutex_t::scoped_lock l(m_pool_mutex);
+		TORRENT_ASSERT(is_disk_buffer(buf, l));
+		++m_buffer_refs[buf];
+	}
+
+	void disk_buffer_pool::reclaim_buffer(char* buf)
+	{
+		TORRENT_ASSERT(buf);
+		TORRENT_ASSERT(m_magic == 0x1337);
+		mutex_t::scoped_lock l(m_pool_mutex);
+		std::map<char*, int>::iterator i = m_buffer_refs.find(buf);
+		if (i != m_buffer_refs.end())
+		{
+			// someone else still holds a reference
+			if (--i->second == 0) m_buffer_refs.erase(i);
+			return;
+		}
+		l.unlock();
+		free_buffer(buf);
 	}
 
 	void disk_buffer_pool::release_memory()
@@ -268,19 +361,153 @@ namespace libtorrent
 // ------- disk_io_thread ------
 
 
-	disk_io_thread::disk_io_thread(asio::io_service& ios, int block_size)
+	disk_io_thread::disk_io_thread(asio::io_service& ios, int block_size
+		, int num_threads)
 		: disk_buffer_pool(block_size)
 		, m_abort(false)
 		, m_waiting_to_shutdown(false)
 		, m_queue_buffer_size(0)
+		, m_next_queue(0)
+		, m_num_running(0)
+		, m_trace(0)
 		, m_ios(ios)
 		, m_work(io_service::work(m_ios))
-		, m_disk_io_thread(boost::ref(*this))
+		, m_hash_abort(false)
+		, m_block_math(block_size)
 	{
+		TORRENT_ASSERT((block_size & (block_size - 1)) == 0);
+		TORRENT_ASSERT(sizeof(job_action_names) / sizeof(job_action_names[0])
+			== disk_io_job::num_actions);
 #ifdef TORRENT_DISK_STATS
 		m_log.open("disk_io_thread.log", std::ios::trunc);
 		m_disk_access_log.open("disk_access.log", std::ios::trunc);
 #endif
+		mutex_t::scoped_lock l(m_queue_mutex);
+		add_threads((std::max)(num_threads, 1));
+	}
+
+	// m_queue_mutex must be held when calling this
+	void disk_io_thread::add_threads(int num_threads)
+	{
+		int first = m_threads.size();
+		if (num_threads <= first) return;
+		m_queues.resize(num_threads);
+		for (int i = first; i < num_threads; ++i)
+		{
+			++m_num_running;
+			m_threads.push_back(boost::shared_ptr<boost::thread>(new boost::thread(
+				boost::bind(&disk_io_thread::thread_fun, this, i))));
+		}
+	}
+
+	int disk_io_thread::num_threads() const
+	{
+		mutex_t::scoped_lock l(m_queue_mutex);
+		return m_threads.size();
+	}
+
+	int disk_io_thread::num_hash_threads() const
+	{
+		mutex_t::scoped_lock l(m_hash_mutex);
+		return m_hash_threads.size();
+	}
+
+	// m_hash_mutex must be held when calling this
+	void disk_io_thread::add_hash_threads(int num_threads)
+	{
+		if (m_hash_abort) return;
+		for (int i = m_hash_threads.size(); i < num_threads; ++i)
+		{
+			m_hash_threads.push_back(boost::shared_ptr<boost::thread>(new boost::thread(
+				boost::bind(&disk_io_thread::hash_thread_fun, this))));
+		}
+	}
+
+	// lets the hash threads finish all outstanding jobs and
+	// waits for them to exit. This is called by the last disk
+	// thread before it flushes the cache
+	void disk_io_thread::stop_hash_threads()
+	{
+		mutex_t::scoped_lock l(m_hash_mutex);
+		m_hash_abort = true;
+		m_hash_signal.notify_all();
+		l.unlock();
+
+		// no threads are added once m_hash_abort is set
+		for (std::vector<boost::shared_ptr<boost::thread> >::iterator i
+			= m_hash_threads.begin(), end(m_hash_threads.end()); i != end; ++i)
+			(*i)->join();
+		l.lock();
+		TORRENT_ASSERT(m_hash_jobs.empty());
+		m_hash_threads.clear();
+	}
+
+	void disk_io_thread::add_hash_job(hash_job const& hj)
+	{
+		mutex_t::scoped_lock l(m_hash_mutex);
+		TORRENT_ASSERT(!m_hash_threads.empty());
+		m_hash_jobs.push_back(hj);
+		m_hash_signal.notify_one();
+	}
+
+	bool disk_io_thread::async_hash(boost::function<void()> const& f)
+	{
+		mutex_t::scoped_lock l(m_hash_mutex);
+		if (m_hash_threads.empty() || m_hash_abort) return false;
+		hash_job hj;
+		hj.work = f;
+		m_hash_jobs.push_back(hj);
+		m_hash_signal.notify_one();
+		return true;
+	}
+
+	// takes the partial hash of the piece from the storage and
+	// reads the part of the piece that isn't hashed yet into
+	// disk buffers owned by the hash job
+	int disk_io_thread::read_unhashed(hash_job& hj)
+	{
+		disk_io_job const& j = hj.job;
+		hj.ph = j.storage->take_partial_hash(j.piece);
+
+		int size = j.storage->info()->piece_size(j.piece) - hj.ph.offset;
+		hj.num_blocks = m_block_math.count(size);
+		if (hj.num_blocks <= 0)
+		{
+			hj.num_blocks = 0;
+			return 0;
+		}
+
+		hj.blocks.reset(new char*[hj.num_blocks]);
+		std::fill(hj.blocks.get(), hj.blocks.get() + hj.num_blocks, (char*)0);
+		file::iovec_t* iov = TORRENT_ALLOCA(file::iovec_t, hj.num_blocks);
+		for (int i = 0; i < hj.num_blocks; ++i)
+		{
+			hj.blocks[i] = allocate_buffer("hash temp");
+			if (hj.blocks[i] == 0)
+			{
+				free_hash_blocks(hj);
+				return -1;
+			}
+			iov[i].iov_base = hj.blocks[i];
+			iov[i].iov_len = (std::min)(size, m_block_size);
+			size -= iov[i].iov_len;
+		}
+		int ret = j.storage->read_impl(iov, j.piece, hj.ph.offset, hj.num_blocks);
+		if (ret < 0 || j.storage->get_storage_impl()->error())
+		{
+			free_hash_blocks(hj);
+			return -1;
+		}
+		return ret;
+	}
+
+	void disk_io_thread::free_hash_blocks(hash_job& hj)
+	{
+		TORRENT_ASSERT(!hj.cached);
+		for (int i = 0; i < hj.num_blocks; ++i)
+			if (hj.blocks[i]) free_buffer(hj.blocks[i]);
+		hj.blocks.reset();
+		hj.num_blocks = 0;
 	}
 
 	disk_io_thread::~disk_io_thread()
@@ -294,14 +521,24 @@ namespace libtorrent
 		disk_io_job j;
 		m_waiting_to_shutdown = true;
 		j.action = disk_io_job::abort_thread;
-		m_jobs.insert(m_jobs.begin(), j);
+		j.start_time = time_now_hires();
+		for (std::vector<job_queue>::iterator i = m_queues.begin()
+			, end(m_queues.end()); i != end; ++i)
+		{
+			i->jobs.insert(i->jobs.begin(), j);
+			++i->class_jobs[j.io_class];
+		}
 		m_signal.notify_all();
 		l.unlock();
 
-		m_disk_io_thread.join();
+		// no threads are added once m_waiting_to_shutdown is set
+		for (std::vector<boost::shared_ptr<boost::thread> >::iterator i
+			= m_threads.begin(), end(m_threads.end()); i != end; ++i)
+			(*i)->join();
 		l.lock();
 		TORRENT_ASSERT(m_abort == true);
-		m_jobs.clear();
+		TORRENT_ASSERT(m_num_running == 0);
+		m_queues.clear();
 	}
 
 	void disk_io_thread::get_cache_info(sha1_hash const& ih, std::vector<cached_piece_info>& ret) const
@@ -318,10 +555,10 @@ namespace libtorrent
 			info.piece = i->piece;
 			info.last_use = i->last_use;
 			info.kind = cached_piece_info::write_cache;
-			int blocks_in_piece = (ti.piece_size(i->piece) + (m_block_size) - 1) / m_block_size;
-			info.blocks.resize(blocks_in_piece);
+			int blocks_in_piece = m_block_math.count(ti.piece_size(i->piece));
+			info.blocks.resize(blocks_in_piece, false);
 			for (int b = 0; b < blocks_in_piece; ++b)
-				if (i->blocks[b]) info.blocks[b] = true;
+				if (i->blocks[b]) info.blocks.set_bit(b);
 			ret.push_back(info);
 		}
 		for (cache_t::const_iterator i = m_read_pieces.begin()
@@ -333,14 +570,40 @@ namespace libtorrent
 			info.piece = i->piece;
 			info.last_use = i->last_use;
 			info.kind = cached_piece_info::read_cache;
-			int blocks_in_piece = (ti.piece_size(i->piece) + (m_block_size) - 1) / m_block_size;
-			info.blocks.resize(blocks_in_piece);
+			int blocks_in_piece = m_block_math.count(ti.piece_size(i->piece));
+			info.blocks.resize(blocks_in_piece, false);
 			for (int b = 0; b < blocks_in_piece; ++b)
-				if (i->blocks[b]) info.blocks[b] = true;
+				if (i->blocks[b]) info.blocks.set_bit(b);
 			ret.push_back(info);
 		}
 	}
 	
+	int disk_io_thread::queued_jobs() const
+	{
+		mutex_t::scoped_lock l(m_queue_mutex);
+		int ret = 0;
+		for (std::vector<job_queue>::const_iterator i = m_queues.begin()
+			, end(m_queues.end()); i != end; ++i)
+			ret += i->jobs.size();
+		return ret;
+	}
+
+	void disk_io_thread::get_latency_stats(latency_stats& s) const
+	{
+		mutex_t::scoped_lock l(m_queue_mutex);
+		s.disk_job_time.assign(m_job_time, m_job_time + disk_io_job::num_actions);
+		s.disk_queue_time = m_queue_time;
+		s.disk_class_queue_time.assign(m_class_queue_time
+			, m_class_queue_time + num_io_classes);
+		s.disk_class_queued_jobs.assign(num_io_classes, 0);
+		for (std::vector<job_queue>::const_iterator i = m_queues.begin()
+			, end(m_queues.end()); i != end; ++i)
+		{
+			for (int c = 0; c < num_io_classes; ++c)
+				s.disk_class_queued_jobs[c] += i->class_jobs[c];
+		}
+	}
+
 	cache_status disk_io_thread::status() const
 	{
 		mutex_t::scoped_lock l(m_piece_mutex);
@@ -348,13 +611,63 @@ namespace libtorrent
 		return m_cache_stats;
 	}
 
+	// the limits are enforced the next time the storage adds
+	// blocks to the cache, to not flush pieces from the calling
+	// thread
+	void disk_io_thread::set_cache_limits(piece_manager* s, int limit, int reservation)
+	{
+		mutex_t::scoped_lock l(m_piece_mutex);
+		s->m_cache_limit = limit;
+		s->m_cache_reservation = reservation;
+	}
+
+	// jobs that are already queued stay in their class
+	void disk_io_thread::set_io_class(piece_manager* s, int c)
+	{
+		TORRENT_ASSERT(c >= 0 && c < num_io_classes);
+		mutex_t::scoped_lock l(m_queue_mutex);
+		s->m_io_class = c;
+	}
+
+	void disk_io_thread::dirty_bytes(dirty_bytes_t& ret) const
+	{
+		{
+			mutex_t::scoped_lock l(m_queue_mutex);
+			for (std::vector<job_queue>::const_iterator i = m_queues.begin()
+				, end(m_queues.end()); i != end; ++i)
+			{
+				for (std::list<disk_io_job>::const_iterator j = i->jobs.begin()
+					, end2(i->jobs.end()); j != end2; ++j)
+				{
+					if (j->action != disk_io_job::write) continue;
+					ret[j->storage.get()] += j->buffer_size;
+				}
+			}
+		}
+		mutex_t::scoped_lock l(m_piece_mutex);
+		for (cache_t::const_iterator i = m_pieces.begin()
+			, end(m_pieces.end()); i != end; ++i)
+			ret[i->storage.get()] += size_type(i->num_blocks) * m_block_size;
+	}
+
+	int disk_io_thread::cached_blocks(piece_manager const* s) const
+	{
+		mutex_t::scoped_lock l(m_piece_mutex);
+		return s->m_cached_blocks;
+	}
+
 	// aborts read operations
 	void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
 	{
 		mutex_t::scoped_lock l(m_queue_mutex);
+		// all jobs for a storage are in the same queue. If it
+		// hasn't been assigned one yet, it doesn't have any jobs
+		job_queue empty;
+		job_queue& q = s->m_disk_queue >= 0
+			? m_queues[s->m_disk_queue] : empty;
 		// read jobs are aborted, write and move jobs are syncronized
-		for (std::list<disk_io_job>::iterator i = m_jobs.begin();
-			i != m_jobs.end();)
+		for (std::list<disk_io_job>::iterator i = q.jobs.begin();
+			i != q.jobs.end();)
 		{
 			if (i->storage != s)
 			{
@@ -364,13 +677,13 @@ namespace libtorrent
 			if (i->action == disk_io_job::read)
 			{
 				post_callback(i->callback, *i, -1);
-				m_jobs.erase(i++);
+				i = erase_job(q, i);
 				continue;
 			}
 			if (i->action == disk_io_job::check_files)
 			{
 				post_callback(i->callback, *i, piece_manager::disk_check_aborted);
-				m_jobs.erase(i++);
+				i = erase_job(q, i);
 				continue;
 			}
 			++i;
@@ -406,19 +719,89 @@ namespace libtorrent
 //			if (lhs.offset > rhs.offset) return false;
 			return false;
 		}
+
+		struct update_last_use
+		{
+			update_last_use(ptime t): m_time(t) {}
+			void operator()(disk_io_thread::cached_piece_entry& p)
+			{ p.last_use = m_time; }
+			ptime m_time;
+		};
 	}
 
+	// if the piece is busy, this waits for the other disk thread
+	// to finish with it, and then looks it up again, since the
+	// other thread may have removed it from the cache
 	disk_io_thread::cache_t::iterator disk_io_thread::find_cached_piece(
 		disk_io_thread::cache_t& cache
 		, disk_io_job const& j, mutex_t::scoped_lock& l)
 	{
-		for (cache_t::iterator i = cache.begin()
-			, end(cache.end()); i != end; ++i)
+		std::pair<void*, int> key(j.storage.get(), j.piece);
+		for (;;)
+		{
+			cache_t::iterator i = cache.find(key);
+			if (i == cache.end() || !i->busy) return i;
+			m_piece_signal.wait(l);
+		}
+	}
+
+	// returns the least recently used piece that isn't busy, or
+	// cache.end() if there is none. If s is set, only pieces
+	// belonging to s are considered. If keep_reserved is true,
+	// pieces of storages that aren't using more than their cache
+	// reservation are skipped
+	disk_io_thread::cache_t::iterator disk_io_thread::oldest_idle_piece(cache_t& cache
+		, piece_manager const* s, bool keep_reserved)
+	{
+		cache_lru_index_t& idx = cache.get<1>();
+		cache_lru_index_t::iterator i = idx.begin();
+		while (i != idx.end()
+			&& (i->busy
+				|| (s && i->storage.get() != s)
+				|| (keep_reserved && i->storage->m_cached_blocks
+					<= i->storage->m_cache_reservation)))
+			++i;
+		return cache.project<0>(i);
+	}
+
+	// evicts pieces belonging to s until it's within its cache
+	// limit. Read cache pieces go first, then write cache pieces
+	// are flushed. ignore is the piece that was just added
+	void disk_io_thread::enforce_cache_limit(piece_manager* s, cache_t::iterator ignore
+		, mutex_t::scoped_lock& l)
+	{
+		if (s->m_cache_limit < 0) return;
+		while (s->m_cached_blocks > s->m_cache_limit)
+		{
+			cache_t::iterator i = oldest_idle_piece(m_read_pieces, s);
+			if (i != m_read_pieces.end() && i != ignore)
+			{
+				free_piece(*i, l);
+				evict_read_piece(i);
+				continue;
+			}
+			i = oldest_idle_piece(m_pieces, s);
+			if (i == m_pieces.end() || i == ignore) return;
+			flush_and_remove(i, l);
+		}
+	}
+
+	// waits until no cached piece belonging to the storage is busy
+	void disk_io_thread::wait_for_storage(piece_manager const* s
+		, mutex_t::scoped_lock& l)
+	{
+		for (;;)
 		{
-			if (i->storage != j.storage || i->piece != j.piece) continue;
-			return i;
+			bool busy = false;
+			for (cache_t::iterator i = m_pieces.begin()
+				, end(m_pieces.end()); i != end && !busy; ++i)
+				busy = i->busy && i->storage == s;
+			for (cache_t::iterator i = m_read_pieces.begin()
+				, end(m_read_pieces.end()); i != end && !busy; ++i)
+				busy = i->busy && i->storage == s;
+			if (!busy) return;
+			m_piece_signal.wait(l);
 		}
-		return cache.end();
 	}
 	
 	void disk_io_thread::flush_expired_pieces()
@@ -431,10 +814,7 @@ namespace libtorrent
 		// flush write cache
 		for (;;)
 		{
-			cache_t::iterator i = std::min_element(
-				m_pieces.begin(), m_pieces.end()
-				, bind(&cached_piece_entry::last_use, _1)
-				< bind(&cached_piece_entry::last_use, _2));
+			cache_t::iterator i = oldest_idle_piece(m_pieces);
 			if (i == m_pieces.end()) break;
 			int age = total_seconds(now - i->last_use);
 			if (age < m_settings.cache_expiry) break;
@@ -444,38 +824,73 @@ namespace libtorrent
 		// flush read cache
 		for (;;)
 		{
-			cache_t::iterator i = std::min_element(
-				m_read_pieces.begin(), m_read_pieces.end()
-				, bind(&cached_piece_entry::last_use, _1)
-				< bind(&cached_piece_entry::last_use, _2));
+			cache_t::iterator i = oldest_idle_piece(m_read_pieces);
 			if (i == m_read_pieces.end()) break;
 			int age = total_seconds(now - i->last_use);
 			if (age < m_settings.cache_expiry) break;
 			free_piece(*i, l);
-			m_read_pieces.erase(i);
+			evict_read_piece(i);
 		}
 	}
 
 	// returns the number of blocks that were freed
-	int disk_io_thread::free_piece(cached_piece_entry& p, mutex_t::scoped_lock& l)
+	int disk_io_thread::free_piece(cached_piece_entry const& p, mutex_t::scoped_lock& l)
 	{
 		int piece_size = p.storage->info()->piece_size(p.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 		int ret = 0;
 
 		for (int i = 0; i < blocks_in_piece; ++i)
 		{
 			if (p.blocks[i] == 0) continue;
-			free_buffer(p.blocks[i]);
+			// the block may still be referenced by a peer's
+			// send buffer
+			reclaim_buffer(p.blocks[i]);
 			++ret;
 			p.blocks[i] = 0;
 			--p.num_blocks;
+			--p.storage->m_cached_blocks;
 			--m_cache_stats.cache_size;
 			--m_cache_stats.read_cache_size;
 		}
 		return ret;
 	}
 
+	// removes a piece from the read cache to make room for other
+	// pieces. With the two_queue algorithm, pieces that weren't hot
+	// are remembered, in case they're requested again soon
+	void disk_io_thread::evict_read_piece(cache_t::iterator i)
+	{
+		if (m_settings.disk_cache_algorithm == session_settings::two_queue
+			&& !i->hot)
+		{
+			m_ghost_pieces.push_back(i->storage_piece_pair());
+			// remember about as many pieces as fit in the cache
+			int max_ghosts = m_settings.cache_size
+				/ (std::max)(m_settings.read_cache_line_size, 1);
+			while (int(m_ghost_pieces.size()) > max_ghosts)
+				m_ghost_pieces.pop_front();
+		}
+		m_read_pieces.erase(i);
+	}
+
+	// called for every piece about to be inserted in the read cache
+	void disk_io_thread::admit_read_piece(cached_piece_entry& p)
+	{
+		p.hot = false;
+		if (m_settings.disk_cache_algorithm != session_settings::two_queue)
+			return;
+		typedef ghost_list_t::nth_index<1>::type ghost_index_t;
+		ghost_index_t& idx = m_ghost_pieces.get<1>();
+		ghost_index_t::iterator i = idx.find(p.storage_piece_pair());
+		if (i == idx.end()) return;
+		// this piece was evicted recently, and requested
+		// again. Keep it around longer this time
+		idx.erase(i);
+		p.hot = true;
+		++m_cache_stats.ghost_hits;
+	}
+
 	// returns the number of blocks that were freed
 	int disk_io_thread::clear_oldest_read_piece(
 		int num_blocks
@@ -484,10 +899,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
-		cache_t::iterator i = std::min_element(
-			m_read_pieces.begin(), m_read_pieces.end()
-			, bind(&cached_piece_entry::last_use, _1)
-			< bind(&cached_piece_entry::last_use, _2));
+		cache_t::iterator i = oldest_idle_piece(m_read_pieces, 0, true);
 		if (i != m_read_pieces.end() && i != ignore)
 		{
 			// don't replace an entry that is less than one second old
@@ -501,17 +913,18 @@ namespace libtorrent
 			{
 				// delete blocks from the start and from the end
 				// until num_blocks have been freed
-				int end = (i->storage->info()->piece_size(i->piece) + m_block_size - 1) / m_block_size - 1;
+				int end = m_block_math.count(i->storage->info()->piece_size(i->piece)) - 1;
 				int start = 0;
 
 				while (num_blocks)
 				{
 					while (i->blocks[start] == 0 && start <= end) ++start;
 					if (start > end) break;
-					free_buffer(i->blocks[start]);
+					reclaim_buffer(i->blocks[start]);
 					i->blocks[start] = 0;
 					++blocks;
 					--i->num_blocks;
+					--i->storage->m_cached_blocks;
 					--m_cache_stats.cache_size;
 					--m_cache_stats.read_cache_size;
 					--num_blocks;
@@ -519,17 +932,18 @@ namespace libtorrent
 
 					while (i->blocks[end] == 0 && start <= end) --end;
 					if (start > end) break;
-					free_buffer(i->blocks[end]);
+					reclaim_buffer(i->blocks[end]);
 					i->blocks[end] = 0;
 					++blocks;
 					--i->num_blocks;
+					--i->storage->m_cached_blocks;
 					--m_cache_stats.cache_size;
 					--m_cache_stats.read_cache_size;
 					--num_blocks;
 				}
 			
 			}
-			if (i->num_blocks == 0) m_read_pieces.erase(i);
+			if (i->num_blocks == 0) evict_read_piece(i);
 			return blocks;
 		}
 		return 0;
@@ -537,6 +951,8 @@ namespace libtorrent
 
 	int contiguous_blocks(disk_io_thread::cached_piece_entry const& b)
 	{
+		// busy pieces can't be flushed
+		if (b.busy) return -1;
 		int ret = 0;
 		int current = 0;
 		int blocks_in_piece = (b.storage->info()->piece_size(b.piece) + 16 * 1024 - 1) / (16 * 1024);
@@ -560,8 +976,8 @@ namespace libtorrent
 		int current = 0;
 		int pos = 0;
 		int start = 0;
-		int blocks_in_piece = (e->storage->info()->piece_size(e->piece)
-			+ m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(
+			e->storage->info()->piece_size(e->piece));
 		for (int i = 0; i < blocks_in_piece; ++i)
 		{
 			if (e->blocks[i]) ++current;
@@ -579,7 +995,7 @@ namespace libtorrent
 
 		if (len < lower_limit) return 0;
 		len = flush_range(e, pos, pos + len, l);
-		if (e->num_blocks == 0) m_pieces.erase(e);
+		if (e->num_blocks == 0) remove_write_piece(e);
 		return len;
 	}
 
@@ -603,17 +1019,15 @@ namespace libtorrent
 		{
 			while (blocks > 0)
 			{
-				cache_t::iterator i = std::min_element(
-					m_pieces.begin(), m_pieces.end()
-					, bind(&cached_piece_entry::last_use, _1)
-					< bind(&cached_piece_entry::last_use, _2));
+				cache_t::iterator i = oldest_idle_piece(m_pieces);
 				if (i == m_pieces.end()) return ret;
 				tmp = flush_and_remove(i, l);
 				blocks -= tmp;
 				ret += tmp;
 			}
 		}
-		else if (m_settings.disk_cache_algorithm == session_settings::largest_contiguous)
+		else if (m_settings.disk_cache_algorithm == session_settings::largest_contiguous
+			|| m_settings.disk_cache_algorithm == session_settings::two_queue)
 		{
 			while (blocks > 0)
 			{
@@ -621,7 +1035,7 @@ namespace libtorrent
 					m_pieces.begin(), m_pieces.end()
 					, bind(&contiguous_blocks, _1)
 					< bind(&contiguous_blocks, _2));
-				if (i == m_pieces.end()) return ret;
+				if (i == m_pieces.end() || i->busy) return ret;
 				tmp = flush_contiguous_blocks(i, l);
 				blocks -= tmp;
 				ret += tmp;
@@ -634,31 +1048,49 @@ namespace libtorrent
 		, mutex_t::scoped_lock& l)
 	{
 		int ret = flush_range(e, 0, INT_MAX, l);
-		m_pieces.erase(e);
+		remove_write_piece(e);
 		return ret;
 	}
 
+	// removes a flushed piece from the write cache, and gives
+	// its hash state back to the storage
+	void disk_io_thread::remove_write_piece(cache_t::iterator i)
+	{
+		TORRENT_ASSERT(i->num_blocks == 0);
+		if (i->hash) i->storage->put_partial_hash(i->piece, *i->hash);
+		m_pieces.erase(i);
+	}
+
 	int disk_io_thread::flush_range(disk_io_thread::cache_t::iterator e
 		, int start, int end, mutex_t::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
 		// TODO: copy *e and unlink it before unlocking
-		cached_piece_entry& p = *e;
+		cached_piece_entry const& p = *e;
 		int piece_size = p.storage->info()->piece_size(p.piece);
 #ifdef TORRENT_DISK_STATS
 		m_log << log_time() << " flushing " << piece_size << std::endl;
 #endif
 		TORRENT_ASSERT(piece_size > 0);
 		
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 		int buffer_size = 0;
 		int offset = 0;
 
 		boost::scoped_array<char> buf;
 		file::iovec_t* iov = 0;
 		int iov_counter = 0;
+		// every contiguous run of blocks is written with a single
+		// writev() call, with one iovec per block. Copying the blocks
+		// into one buffer first only pays off where the vectored
+		// write would otherwise be split up into one write per buffer
+#if !TORRENT_USE_WRITEV || defined TORRENT_WINDOWS
 		if (m_settings.coalesce_writes) buf.reset(new (std::nothrow) char[piece_size]);
-		else iov = TORRENT_ALLOCA(file::iovec_t, blocks_in_piece);
+#endif
+		if (!buf) iov = TORRENT_ALLOCA(file::iovec_t, blocks_in_piece);
+
+		TORRENT_ASSERT(!p.busy);
+		p.busy = true;
 
 		end = (std::min)(end, blocks_in_piece);
 		for (int i = start; i <= end; ++i)
@@ -668,11 +1100,13 @@ namespace libtorrent
 				if (buffer_size == 0) continue;
 			
 				TORRENT_ASSERT(buffer_size <= i * m_block_size);
+				// other disk threads may look at the cache while
+				// we're writing. p is busy, so it won't be touched
 				l.unlock();
 				if (iov)
 				{
 					p.storage->write_impl(iov, p.piece, (std::min)(
-						i * m_block_size, piece_size) - buffer_size, iov_counter);
+						i * m_block_size, piece_size) - buffer_size, iov_counter, !p.hash);
 					iov_counter = 0;
 				}
 				else
@@ -680,7 +1114,7 @@ namespace libtorrent
 					TORRENT_ASSERT(buf);
 					file::iovec_t b = { buf.get(), buffer_size };
 					p.storage->write_impl(&b, p.piece, (std::min)(
-						i * m_block_size, piece_size) - buffer_size, 1);
+						i * m_block_size, piece_size) - buffer_size, 1, !p.hash);
 				}
 				l.lock();
 				++m_cache_stats.writes;
@@ -704,20 +1138,26 @@ namespace libtorrent
 				offset += m_block_size;
 			}
 			buffer_size += block_size;
-			TORRENT_ASSERT(p.num_blocks > 0);
-			--p.num_blocks;
 			++m_cache_stats.blocks_written;
-			--m_cache_stats.cache_size;
 		}
 
+		// the block counters are updated here, rather than as
+		// the blocks are written, to keep them consistent with
+		// the blocks array whenever the mutex is released
 		int ret = 0;
 		for (int i = start; i < end; ++i)
 		{
 			if (p.blocks[i] == 0) continue;
 			free_buffer(p.blocks[i]);
 			p.blocks[i] = 0;
+			TORRENT_ASSERT(p.num_blocks > 0);
+			--p.num_blocks;
+			--p.storage->m_cached_blocks;
+			--m_cache_stats.cache_size;
 			++ret;
 		}
+		p.busy = false;
+		m_piece_signal.notify_all();
 
 		TORRENT_ASSERT(buffer_size == 0);
 //		std::cerr << " flushing p: " << p.piece << " cached_blocks: " << m_cache_stats.cache_size << std::endl;
@@ -740,30 +1180,58 @@ namespace libtorrent
 #endif
 
 		int piece_size = j.storage->info()->piece_size(j.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
 		p.piece = j.piece;
 		p.storage = j.storage;
 		p.last_use = time_now();
 		p.num_blocks = 1;
+		p.busy = false;
+		p.hot = false;
 		p.blocks.reset(new (std::nothrow) char*[blocks_in_piece]);
 		if (!p.blocks) return -1;
+		p.hash.reset(new (std::nothrow) partial_hash);
+		if (!p.hash) return -1;
+		*p.hash = j.storage->take_partial_hash(j.piece);
 		std::memset(&p.blocks[0], 0, blocks_in_piece * sizeof(char*));
-		int block = j.offset / m_block_size;
+		int block = m_block_math.index(j.offset);
 //		std::cerr << " adding cache entry for p: " << j.piece << " block: " << block << " cached_blocks: " << m_cache_stats.cache_size << std::endl;
 		p.blocks[block] = j.buffer;
 		++m_cache_stats.cache_size;
-		m_pieces.push_back(p);
+		++j.storage->m_cached_blocks;
+		hash_contiguous_blocks(p);
+		m_pieces.insert(p);
 		return 0;
 	}
 
+	// extends the hash of the piece with the blocks following the
+	// ones hashed so far, as long as they're in the cache. This way
+	// every block is hashed as soon as all blocks before it are
+	// received, and the piece never has to be read back to be hashed
+	// unless blocks were flushed before that
+	void disk_io_thread::hash_contiguous_blocks(cached_piece_entry const& p)
+	{
+		TORRENT_ASSERT(p.hash);
+		partial_hash& ph = *p.hash;
+		int piece_size = p.storage->info()->piece_size(p.piece);
+		while (ph.offset < piece_size
+			&& m_block_math.remainder(ph.offset) == 0)
+		{
+			char const* block = p.blocks[m_block_math.index(ph.offset)];
+			if (block == 0) break;
+			int size = (std::min)(piece_size - ph.offset, m_block_size);
+			ph.h.update(block, size);
+			ph.offset += size;
+		}
+	}
+
 	// fills a piece with data from disk, returns the total number of bytes
 	// read or -1 if there was an error
-	int disk_io_thread::read_into_piece(cached_piece_entry& p, int start_block
+	int disk_io_thread::read_into_piece(cached_piece_entry const& p, int start_block
 		, int options, int num_blocks, mutex_t::scoped_lock& l)
 	{
 		int piece_size = p.storage->info()->piece_size(p.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
 		int end_block = start_block;
 		int num_read = 0;
@@ -780,6 +1248,7 @@ namespace libtorrent
 			// the allocation failed, break
 			if (p.blocks[i] == 0) break;
 			++p.num_blocks;
+			++p.storage->m_cached_blocks;
 			++m_cache_stats.cache_size;
 			++m_cache_stats.read_cache_size;
 			++end_block;
@@ -873,7 +1342,7 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		int piece_size = j.storage->info()->piece_size(j.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
 		if (in_use() + blocks_in_piece > m_settings.cache_size)
 			flush_cache_blocks(l, in_use() + blocks_in_piece - m_settings.cache_size, m_read_pieces.end());
@@ -883,6 +1352,7 @@ namespace libtorrent
 		p.storage = j.storage;
 		p.last_use = time_now();
 		p.num_blocks = 0;
+		p.busy = false;
 		p.blocks.reset(new (std::nothrow) char*[blocks_in_piece]);
 		if (!p.blocks) return -1;
 		std::memset(&p.blocks[0], 0, blocks_in_piece * sizeof(char*));
@@ -891,26 +1361,36 @@ namespace libtorrent
 		if (ret == -1)
 			free_piece(p, l);
 		else
-			m_read_pieces.push_back(p);
+		{
+			admit_read_piece(p);
+			enforce_cache_limit(j.storage.get(), m_read_pieces.insert(p).first, l);
+		}
 
 		return ret;
 	}
 
 	// returns -1 on read error, -2 if there isn't any space in the cache
 	// or the number of bytes read
+	int disk_io_thread::read_cache_line(disk_io_job const& j) const
+	{
+		if (j.read_ahead < 0) return m_settings.read_cache_line_size;
+		int block_offset = m_block_math.remainder(j.offset);
+		return m_block_math.count(block_offset + j.buffer_size + j.read_ahead);
+	}
+
 	int disk_io_thread::cache_read_block(disk_io_job const& j, mutex_t::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
 
 		int piece_size = j.storage->info()->piece_size(j.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
-		int start_block = j.offset / m_block_size;
+		int start_block = m_block_math.index(j.offset);
 
 		int blocks_to_read = blocks_in_piece - start_block;
 		blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
 			+ m_cache_stats.read_cache_size - in_use())/2, 3));
-		blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
+		blocks_to_read = (std::min)(blocks_to_read, read_cache_line(j));
 
 		if (in_use() + blocks_to_read > m_settings.cache_size)
 			if (flush_cache_blocks(l, in_use() + blocks_to_read - m_settings.cache_size
@@ -922,6 +1402,7 @@ namespace libtorrent
 		p.storage = j.storage;
 		p.last_use = time_now();
 		p.num_blocks = 0;
+		p.busy = false;
 		p.blocks.reset(new (std::nothrow) char*[blocks_in_piece]);
 		if (!p.blocks) return -1;
 		std::memset(&p.blocks[0], 0, blocks_in_piece * sizeof(char*));
@@ -930,7 +1411,10 @@ namespace libtorrent
 		if (ret == -1)
 			free_piece(p, l);
 		else
-			m_read_pieces.push_back(p);
+		{
+			admit_read_piece(p);
+			enforce_cache_limit(j.storage.get(), m_read_pieces.insert(p).first, l);
+		}
 
 		return ret;
 	}
@@ -947,7 +1431,7 @@ namespace libtorrent
 			
 			if (!p.storage) continue;
 			int piece_size = p.storage->info()->piece_size(p.piece);
-			int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+			int blocks_in_piece = m_block_math.count(piece_size);
 			int blocks = 0;
 			for (int k = 0; k < blocks_in_piece; ++k)
 			{
@@ -971,7 +1455,7 @@ namespace libtorrent
 			TORRENT_ASSERT(p.blocks);
 			
 			int piece_size = p.storage->info()->piece_size(p.piece);
-			int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+			int blocks_in_piece = m_block_math.count(piece_size);
 			int blocks = 0;
 			for (int k = 0; k < blocks_in_piece; ++k)
 			{
@@ -998,8 +1482,8 @@ namespace libtorrent
 #endif
 
 		// when writing, there may be a one block difference, right before an old piece
-		// is flushed
-		TORRENT_ASSERT(m_cache_stats.cache_size <= m_settings.cache_size + 1);
+		// is flushed. Every disk thread may be in that state at the same time
+		TORRENT_ASSERT(m_cache_stats.cache_size <= m_settings.cache_size + int(m_threads.size()));
 	}
 #endif
 
@@ -1009,10 +1493,35 @@ namespace libtorrent
 
 		mutex_t::scoped_lock l(m_piece_mutex);
 	
-		cache_t::iterator p
-			= find_cached_piece(m_read_pieces, j, l);
+		cache_t::iterator p;
+		bool hit;
+		int ret = cache_piece_for_hash(j, p, hit, l);
+		if (ret < 0) return ret;
 
-		bool hit = true;
+		hasher ctx;
+
+		int piece_size = j.storage->info()->piece_size(j.piece);
+		int blocks_in_piece = m_block_math.count(piece_size);
+
+		for (int i = 0; i < blocks_in_piece; ++i)
+		{
+			TORRENT_ASSERT(p->blocks[i]);
+			ctx.update((char const*)p->blocks[i], (std::min)(piece_size, m_block_size));
+			piece_size -= m_block_size;
+		}
+		h = ctx.final();
+
+		return copy_from_hashed_piece(p, hit, j, l);
+	}
+
+	// makes sure the whole piece is in the read cache, and
+	// sets p to point to it
+	int disk_io_thread::cache_piece_for_hash(disk_io_job const& j, cache_t::iterator& p
+		, bool& hit, mutex_t::scoped_lock& l)
+	{
+		p = find_cached_piece(m_read_pieces, j, l);
+
+		hit = true;
 		int ret = 0;
 
 		// if the piece cannot be found in the cache,
@@ -1023,27 +1532,21 @@ namespace libtorrent
 			ret = cache_read_piece(j, l);
 			hit = false;
 			if (ret < 0) return ret;
-			p = m_read_pieces.end();
-			--p;
-			TORRENT_ASSERT(!m_read_pieces.empty());
+			p = find_cached_piece(m_read_pieces, j, l);
+			TORRENT_ASSERT(p != m_read_pieces.end());
 			TORRENT_ASSERT(p->piece == j.piece);
 			TORRENT_ASSERT(p->storage == j.storage);
 		}
+		return ret;
+	}
 
-		hasher ctx;
-
-		int piece_size = j.storage->info()->piece_size(j.piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-
-		for (int i = 0; i < blocks_in_piece; ++i)
-		{
-			TORRENT_ASSERT(p->blocks[i]);
-			ctx.update((char const*)p->blocks[i], (std::min)(piece_size, m_block_size));
-			piece_size -= m_block_size;
-		}
-		h = ctx.final();
-
-		ret = copy_from_piece(p, hit, j, l);
+	// copies the requested block out of a piece that was read
+	// and hashed by read_piece_from_cache_and_hash() and evicts
+	// the piece if it shouldn't stay in the cache
+	int disk_io_thread::copy_from_hashed_piece(cache_t::iterator p, bool hit
+		, disk_io_job const& j, mutex_t::scoped_lock& l)
+	{
+		int ret = copy_from_piece(p, hit, j, l);
 		TORRENT_ASSERT(ret > 0);
 		if (ret < 0) return ret;
 
@@ -1065,42 +1568,60 @@ namespace libtorrent
 		ret = j.buffer_size;
 		++m_cache_stats.blocks_read;
 		if (hit) ++m_cache_stats.blocks_read_hit;
+		j.storage->count_block_read(1, hit);
 		return ret;
 	}
 
+	// if ref is set, the request must start at a block boundary.
+	// Instead of copying it, the cached block is returned in *ref
+	// with an added reference, to be dropped with reclaim_buffer()
 	int disk_io_thread::copy_from_piece(cache_t::iterator p, bool& hit
-		, disk_io_job const& j, mutex_t::scoped_lock& l)
+		, disk_io_job const& j, mutex_t::scoped_lock& l, char** ref)
 	{
-		TORRENT_ASSERT(j.buffer);
+		TORRENT_ASSERT(j.buffer || ref);
+		TORRENT_ASSERT(ref == 0 || m_block_math.remainder(j.offset) == 0);
 
 		// copy from the cache and update the last use timestamp
-		int block = j.offset / m_block_size;
-		int block_offset = j.offset & (m_block_size-1);
+		int block = m_block_math.index(j.offset);
+		int block_offset = m_block_math.remainder(j.offset);
 		int buffer_offset = 0;
 		int size = j.buffer_size;
 		if (p->blocks[block] == 0)
 		{
 			int piece_size = j.storage->info()->piece_size(j.piece);
-			int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+			int blocks_in_piece = m_block_math.count(piece_size);
 			int end_block = block;
 			while (end_block < blocks_in_piece && p->blocks[end_block] == 0) ++end_block;
 
 			int blocks_to_read = end_block - block;
 			blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
 				+ m_cache_stats.read_cache_size - in_use())/2, 3));
-			blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
+			blocks_to_read = (std::min)(blocks_to_read, read_cache_line(j));
 			if (in_use() + blocks_to_read > m_settings.cache_size)
 				if (flush_cache_blocks(l, in_use() + blocks_to_read - m_settings.cache_size
 					, p, dont_flush_write_blocks) == 0)
 					return -2;
 
+			// the piece is already in the cache, so other disk
+			// threads can see it while the mutex is released
+			p->busy = true;
 			int ret = read_into_piece(*p, block, 0, blocks_to_read, l);
+			p->busy = false;
+			m_piece_signal.notify_all();
 			hit = false;
 			if (ret < 0) return ret;
 			TORRENT_ASSERT(p->blocks[block]);
 		}
 
-		p->last_use = time_now();
+		m_read_pieces.modify(p, update_last_use(time_now()));
+		if (ref)
+		{
+			TORRENT_ASSERT(p->blocks[block]);
+			TORRENT_ASSERT(size <= m_block_size);
+			*ref = p->blocks[block];
+			ref_buffer(*ref);
+			return j.buffer_size;
+		}
 		while (size > 0)
 		{
 			TORRENT_ASSERT(p->blocks[block]);
@@ -1117,9 +1638,9 @@ namespace libtorrent
 		return j.buffer_size;
 	}
 
-	int disk_io_thread::try_read_from_cache(disk_io_job const& j)
+	int disk_io_thread::try_read_from_cache(disk_io_job const& j, char** ref)
 	{
-		TORRENT_ASSERT(j.buffer);
+		TORRENT_ASSERT(j.buffer || ref);
 
 		mutex_t::scoped_lock l(m_piece_mutex);
 		if (!m_settings.use_read_cache) return -2;
@@ -1138,24 +1659,128 @@ namespace libtorrent
 			ret = cache_read_block(j, l);
 			hit = false;
 			if (ret < 0) return ret;
-			p = m_read_pieces.end();
-			--p;
-			TORRENT_ASSERT(!m_read_pieces.empty());
+			p = find_cached_piece(m_read_pieces, j, l);
+			TORRENT_ASSERT(p != m_read_pieces.end());
 			TORRENT_ASSERT(p->piece == j.piece);
 			TORRENT_ASSERT(p->storage == j.storage);
 		}
 
 		if (p == m_read_pieces.end()) return ret;
 
-		ret = copy_from_piece(p, hit, j, l);
+		ret = copy_from_piece(p, hit, j, l, ref);
 		if (ret < 0) return ret;
 
 		ret = j.buffer_size;
 		++m_cache_stats.blocks_read;
 		if (hit) ++m_cache_stats.blocks_read_hit;
+		j.storage->count_block_read(1, hit);
 		return ret;
 	}
 
+	// picks the reads among the first read_hint_depth ones in the
+	// queue that haven't been hinted yet. Called with m_queue_mutex
+	// held
+	void disk_io_thread::collect_read_hints(job_queue& q
+		, std::vector<read_hint>& hints)
+	{
+		int depth = m_settings.read_hint_depth;
+		for (std::list<disk_io_job>::iterator i = q.jobs.begin()
+			, end(q.jobs.end()); i != end && depth > 0; ++i)
+		{
+			if (i->action != disk_io_job::read
+				&& i->action != disk_io_job::read_and_hash)
+				continue;
+			--depth;
+			if (i->read_hinted) continue;
+			i->read_hinted = true;
+			read_hint h = { i->storage, i->piece, i->offset, i->buffer_size };
+			hints.push_back(h);
+		}
+	}
+
+	void disk_io_thread::complete_duplicate_reads(int queue
+		, disk_io_job const& j, int ret)
+	{
+		TORRENT_ASSERT(j.action == disk_io_job::read);
+		TORRENT_ASSERT(ret > 0 && j.buffer);
+
+		// when a piece becomes available, many peers tend to request
+		// its blocks at the same time
+		std::vector<disk_io_job> dups;
+		{
+			mutex_t::scoped_lock jl(m_queue_mutex);
+			job_queue& q = m_queues[queue];
+			for (std::list<disk_io_job>::iterator i = q.jobs.begin();
+				i != q.jobs.end();)
+			{
+				if (i->storage != j.storage || i->piece != j.piece)
+				{
+					++i;
+					continue;
+				}
+				// reads queued behind a write to the same block have
+				// to see the new data
+				if (i->action == disk_io_job::write
+					&& range_overlap(i->offset, i->buffer_size
+						, j.offset, j.buffer_size))
+					break;
+				if (i->action != disk_io_job::read
+					|| i->offset != j.offset
+					|| i->buffer_size != j.buffer_size)
+				{
+					++i;
+					continue;
+				}
+				boost::function<void(int, disk_io_job const&)> handler;
+				handler.swap(i->callback);
+				dups.push_back(*i);
+				dups.back().callback.swap(handler);
+				time_duration queued = time_now_hires() - i->start_time;
+				m_queue_time.add(queued);
+				m_class_queue_time[i->io_class].add(queued);
+				i = erase_job(q, i);
+			}
+		}
+
+		if (dups.empty()) return;
+
+		for (std::vector<disk_io_job>::iterator i = dups.begin()
+			, end(dups.end()); i != end; ++i)
+		{
+			boost::function<void(int, disk_io_job const&)> handler;
+			handler.swap(i->callback);
+			int dup_ret = ret;
+			if (j.cached_buffer)
+			{
+				// the block stays in the cache until every
+				// reference to it has been reclaimed
+				ref_buffer(j.buffer);
+				i->buffer = j.buffer;
+				i->cached_buffer = true;
+			}
+			else
+			{
+				i->buffer = allocate_buffer("send buffer");
+				if (i->buffer == 0)
+				{
+					dup_ret = -1;
+					i->error = error_code(ENOMEM, get_posix_category());
+					i->str = i->error.message();
+				}
+				else
+				{
+					std::memcpy(i->buffer, j.buffer, ret);
+				}
+			}
+			post_callback(handler, *i, dup_ret);
+		}
+
+		mutex_t::scoped_lock l(m_piece_mutex);
+		m_cache_stats.blocks_read += dups.size();
+		m_cache_stats.blocks_read_hit += dups.size();
+		j.storage->count_block_read(int(dups.size()), true);
+	}
+
 	void disk_io_thread::add_job(disk_io_job const& j
 		, boost::function<void(int, disk_io_job const&)> const& f)
 	{
@@ -1167,13 +1792,15 @@ namespace libtorrent
 		TORRENT_ASSERT(j.buffer_size <= m_block_size);
 		mutex_t::scoped_lock l(m_queue_mutex);
 
-		std::list<disk_io_job>::reverse_iterator i = m_jobs.rbegin();
+		job_queue& q = m_queues[queue_for(j)];
+		std::list<disk_io_job>& jobs = q.jobs;
+		std::list<disk_io_job>::reverse_iterator i = jobs.rbegin();
 		if (j.action == disk_io_job::read)
 		{
 			// when we're reading, we may not skip
 			// ahead of any write operation that overlaps
 			// the region we're reading
-			for (; i != m_jobs.rend(); i++)
+			for (; i != jobs.rend(); i++)
 			{
 				// if *i should come before j, stop
 				// and insert j before i
@@ -1191,13 +1818,13 @@ namespace libtorrent
 		}
 		else if (j.action == disk_io_job::write)
 		{
-			for (; i != m_jobs.rend(); ++i)
+			for (; i != jobs.rend(); ++i)
 			{
 				if (*i < j)
 				{
-					if (i != m_jobs.rbegin()
+					if (i != jobs.rbegin()
 						&& i.base()->storage.get() != j.storage.get())
-						i = m_jobs.rbegin();
+						i = jobs.rbegin();
 					break;
 				}
 			}
@@ -1207,16 +1834,149 @@ namespace libtorrent
 		// the queue, to sweep the disk in the same direction, and to avoid
 		// starvation. The exception is if the priority is higher than the
 		// job at the front of the queue
-		if (i == m_jobs.rend() && (m_jobs.empty() || j.priority <= m_jobs.back().priority))
-			i = m_jobs.rbegin();
+		if (i == jobs.rend() && (jobs.empty() || j.priority <= jobs.back().priority))
+			i = jobs.rbegin();
 
-		std::list<disk_io_job>::iterator k = m_jobs.insert(i.base(), j);
+		std::list<disk_io_job>::iterator k = jobs.insert(i.base(), j);
 		k->callback.swap(const_cast<boost::function<void(int, disk_io_job const&)>&>(f));
+		// this is called for every block, the coarse clock is precise
+		// enough for the queue time and the read delay
+		k->start_time = time_now_coarse();
+		k->io_class = j.storage ? j.storage->m_io_class : normal_io_class;
+		// deleting the files of a removed torrent can wait
+		if (j.action == disk_io_job::delete_files) k->io_class = bulk_io_class;
+		// a class that's been idle starts out level with the others,
+		// rather than with a backlog of turns
+		if (q.class_jobs[k->io_class]++ == 0
+			&& q.class_time[k->io_class] < q.io_time)
+			q.class_time[k->io_class] = q.io_time;
 		if (j.action == disk_io_job::write)
 			m_queue_buffer_size += j.buffer_size;
 		m_signal.notify_all();
 	}
 
+	// m_queue_mutex must be held when calling this
+	int disk_io_thread::queue_for(disk_io_job const& j)
+	{
+		TORRENT_ASSERT(!m_queues.empty());
+		// jobs that don't belong to any storage are
+		// handled by the first thread
+		if (!j.storage) return 0;
+		int& q = j.storage->m_disk_queue;
+		if (q < 0)
+		{
+			q = m_next_queue;
+			m_next_queue = (m_next_queue + 1) % m_queues.size();
+		}
+		TORRENT_ASSERT(q < int(m_queues.size()));
+		return q;
+	}
+
+	namespace
+	{
+		// the offset of the job's data within its torrent. Since files
+		// are laid out in order, this orders jobs by file and file offset
+		size_type job_position(disk_io_job const& j)
+		{
+			return size_type(j.piece) * j.storage->info()->piece_length() + j.offset;
+		}
+	}
+
+	const int disk_io_thread::io_class_stride[num_io_classes] = { 1, 2, 8 };
+
+	// m_queue_mutex must be held when calling this
+	std::list<disk_io_job>::iterator disk_io_thread::erase_job(job_queue& q
+		, std::list<disk_io_job>::iterator i)
+	{
+		TORRENT_ASSERT(q.class_jobs[i->io_class] > 0);
+		--q.class_jobs[i->io_class];
+		return q.jobs.erase(i);
+	}
+
+	// m_queue_mutex must be held when calling this
+	int disk_io_thread::pick_io_class(job_queue& q)
+	{
+		int ret = -1;
+		for (int c = 0; c < num_io_classes; ++c)
+		{
+			if (q.class_jobs[c] == 0) continue;
+			if (ret == -1 || q.class_time[c] < q.class_time[ret]) ret = c;
+		}
+		TORRENT_ASSERT(ret >= 0);
+		q.io_time = q.class_time[ret];
+		q.class_time[ret] += io_class_stride[ret];
+		return ret;
+	}
+
+	// m_queue_mutex must be held when calling this
+	std::list<disk_io_job>::iterator disk_io_thread::pick_job(job_queue& q
+		, ptime now)
+	{
+		TORRENT_ASSERT(!q.jobs.empty());
+		std::list<disk_io_job>::iterator ret = q.jobs.begin();
+		// join() puts it in front of everything else
+		if (ret->action == disk_io_job::abort_thread) return ret;
+
+		// all of a storage's jobs are in the same class, so taking
+		// the first job of a class keeps every storage's jobs in order
+		int io_class = pick_io_class(q);
+		while (ret->io_class != io_class) ++ret;
+
+		if (!m_settings.elevator_disk_reads
+			|| ret->action != disk_io_job::read) return ret;
+
+		// look at the reads at the front of the class' jobs. They can be
+		// issued in any order, but not ahead of anything else. Pick the
+		// first one at or after the position of the last read. If there
+		// isn't any, wrap around and start over from the lowest position.
+		// Jobs in other classes belong to other storages, and are skipped
+		time_duration max_delay = milliseconds(m_settings.max_disk_read_delay);
+		std::list<disk_io_job>::iterator next = q.jobs.end();
+		std::list<disk_io_job>::iterator lowest = q.jobs.end();
+		size_type next_pos = 0;
+		size_type lowest_pos = 0;
+		bool starved = false;
+		for (std::list<disk_io_job>::iterator i = ret; i != q.jobs.end(); ++i)
+		{
+			if (i->io_class != io_class) continue;
+			if (i->action != disk_io_job::read) break;
+
+			// don't let any read starve
+			if (now - i->start_time >= max_delay)
+			{
+				next = i;
+				starved = true;
+				break;
+			}
+
+			piece_manager const* s = i->storage.get();
+			size_type pos = job_position(*i);
+			if (s > q.elevator_storage
+				|| (s == q.elevator_storage && pos >= q.elevator_pos))
+			{
+				if (next == q.jobs.end() || s < next->storage.get()
+					|| (s == next->storage.get() && pos < next_pos))
+				{
+					next = i;
+					next_pos = pos;
+				}
+			}
+			else if (lowest == q.jobs.end() || s < lowest->storage.get()
+				|| (s == lowest->storage.get() && pos < lowest_pos))
+			{
+				lowest = i;
+				lowest_pos = pos;
+			}
+		}
+
+		if (starved) ret = next;
+		else ret = next != q.jobs.end() ? next : lowest;
+
+		q.elevator_storage = ret->storage.get();
+		q.elevator_pos = job_position(*ret) + ret->buffer_size;
+		return ret;
+	}
+
 	bool disk_io_thread::test_error(disk_io_job& j)
 	{
 		TORRENT_ASSERT(j.storage);
@@ -1245,7 +2005,84 @@ namespace libtorrent
 		m_ios.post(bind(handler, ret, j));
 	}
 
-	void disk_io_thread::operator()()
+	void disk_io_thread::hash_thread_fun()
+	{
+		for (;;)
+		{
+			mutex_t::scoped_lock hl(m_hash_mutex);
+			while (m_hash_jobs.empty() && !m_hash_abort)
+				m_hash_signal.wait(hl);
+			if (m_hash_jobs.empty()) return;
+
+			hash_job hj = m_hash_jobs.front();
+			m_hash_jobs.pop_front();
+			hl.unlock();
+
+			if (hj.work)
+			{
+				hj.work();
+				continue;
+			}
+
+			disk_io_job& j = hj.job;
+			int size = j.storage->info()->piece_size(j.piece) - hj.ph.offset;
+			for (int i = 0; i < hj.num_blocks; ++i)
+			{
+				TORRENT_ASSERT(hj.blocks[i]);
+				hj.ph.h.update(hj.blocks[i], (std::min)(size, m_block_size));
+				size -= m_block_size;
+			}
+			bool match = j.storage->info()->hash_for_piece(j.piece) == hj.ph.h.final();
+
+			// pieces are only hashed here for storages that aren't
+			// in compact mode, so there's no need to call mark_failed()
+			// on hash failures. It doesn't do anything in that case
+			TORRENT_ASSERT(!j.storage->compact_allocation());
+
+			int ret = 0;
+			if (hj.cached)
+			{
+				// read_and_hash
+				mutex_t::scoped_lock l(m_piece_mutex);
+				cache_t::iterator p = m_read_pieces.find(
+					std::make_pair((void*)j.storage.get(), j.piece));
+				TORRENT_ASSERT(p != m_read_pieces.end());
+				TORRENT_ASSERT(p->busy);
+				p->busy = false;
+				ret = copy_from_hashed_piece(p, hj.hit, j, l);
+				m_piece_signal.notify_all();
+				l.unlock();
+
+				if (!match)
+				{
+					free_buffer(j.buffer);
+					j.buffer = 0;
+					j.error = error_code(errors::failed_hash_check, libtorrent_category);
+					j.str = j.error.message();
+					ret = -3;
+				}
+			}
+			else
+			{
+				// hash
+				free_hash_blocks(hj);
+				ret = match ? 0 : -2;
+			}
+
+#ifndef BOOST_NO_EXCEPTIONS
+			try {
+#endif
+				post_callback(hj.callback, j, ret);
+#ifndef BOOST_NO_EXCEPTIONS
+			} catch (std::exception&)
+			{
+				TORRENT_ASSERT(false);
+			}
+#endif
+		}
+	}
+
+	void disk_io_thread::thread_fun(int queue)
 	{
 		for (;;)
 		{
@@ -1254,7 +2091,9 @@ namespace libtorrent
 #endif
 			mutex_t::scoped_lock jl(m_queue_mutex);
 
-			while (m_jobs.empty() && !m_abort)
+			// m_queues may be resized by other threads while
+			// we're waiting, so never hold on to a reference into it
+			while (m_queues[queue].jobs.empty() && !m_queues[queue].abort)
 			{
 				// if there hasn't been an event in one second
 				// see if we should flush the cache
@@ -1263,10 +2102,18 @@ namespace libtorrent
 				m_signal.wait(jl);
 			}
 
-			if (m_abort && m_jobs.empty())
+			if (m_queues[queue].abort && m_queues[queue].jobs.empty())
 			{
+				// only the last thread to exit flushes the
+				// cache, since the other ones may still use it
+				TORRENT_ASSERT(m_num_running > 0);
+				if (--m_num_running > 0) return;
 				jl.unlock();
 
+				// the hash threads may still be using pieces
+				// in the read cache
+				stop_hash_threads();
+
 				mutex_t::scoped_lock l(m_piece_mutex);
 				// flush all disk caches
 				for (cache_t::iterator i = m_pieces.begin()
@@ -1286,19 +2133,37 @@ namespace libtorrent
 			// if there's a buffer in this job, it will be freed
 			// when this holder is destructed, unless it has been
 			// released.
+			// the clock is read once per job. The same reading is used
+			// to pick the job and as its start time
+			ptime now = time_now_hires();
+			std::list<disk_io_job>::iterator next = pick_job(m_queues[queue], now);
 			disk_buffer_holder holder(*this
-				, m_jobs.front().action != disk_io_job::check_fastresume
-				&& m_jobs.front().action != disk_io_job::update_settings
-				? m_jobs.front().buffer : 0);
+				, next->action != disk_io_job::check_fastresume
+				&& next->action != disk_io_job::update_settings
+				? next->buffer : 0);
 
 			boost::function<void(int, disk_io_job const&)> handler;
-			handler.swap(m_jobs.front().callback);
+			handler.swap(next->callback);
 
-			disk_io_job j = m_jobs.front();
-			m_jobs.pop_front();
+			disk_io_job j = *next;
+			erase_job(m_queues[queue], next);
 			m_queue_buffer_size -= j.buffer_size;
+			ptime job_start = now;
+			m_queue_time.add(job_start - j.start_time);
+			m_class_queue_time[j.io_class].add(job_start - j.start_time);
+
+			std::vector<read_hint> hints;
+			if (m_settings.read_hint_depth > 0)
+				collect_read_hints(m_queues[queue], hints);
 			jl.unlock();
 
+			// the disk thread issues one read at a time. Letting the
+			// storage start on the ones queued up behind it keeps
+			// several of them in flight on the device
+			for (std::vector<read_hint>::iterator i = hints.begin()
+				, end(hints.end()); i != end; ++i)
+				i->storage->hint_read_impl(i->piece, i->offset, i->size);
+
 			flush_expired_pieces();
 
 			int ret = 0;
@@ -1328,7 +2193,23 @@ namespace libtorrent
 					TORRENT_ASSERT(s.cache_size >= 0);
 					TORRENT_ASSERT(s.cache_expiry > 0);
 
+					mutex_t::scoped_lock l(m_piece_mutex);
 					m_settings = s;
+					if (m_settings.disk_cache_algorithm != session_settings::two_queue)
+						m_ghost_pieces.clear();
+					l.unlock();
+
+					// the number of disk threads can only grow
+					// at run-time. Existing storages stay on
+					// their queues, new ones are spread out over
+					// all of them
+					mutex_t::scoped_lock jl(m_queue_mutex);
+					if (!m_waiting_to_shutdown)
+					{
+						add_threads(m_settings.disk_io_threads);
+						mutex_t::scoped_lock hl(m_hash_mutex);
+						add_hash_threads(m_settings.hashing_threads);
+					}
 				}
 				case disk_io_job::abort_torrent:
 				{
@@ -1336,8 +2217,9 @@ namespace libtorrent
 					m_log << log_time() << " abort_torrent " << std::endl;
 #endif
 					mutex_t::scoped_lock jl(m_queue_mutex);
-					for (std::list<disk_io_job>::iterator i = m_jobs.begin();
-						i != m_jobs.end();)
+					job_queue& q = m_queues[queue];
+					for (std::list<disk_io_job>::iterator i = q.jobs.begin();
+						i != q.jobs.end();)
 					{
 						if (i->storage != j.storage)
 						{
@@ -1347,7 +2229,7 @@ namespace libtorrent
 						if (i->action == disk_io_job::check_files)
 						{
 							post_callback(i->callback, *i, piece_manager::disk_check_aborted);
-							m_jobs.erase(i++);
+							i = erase_job(q, i);
 							continue;
 						}
 						++i;
@@ -1360,26 +2242,31 @@ namespace libtorrent
 					m_log << log_time() << " abort_thread " << std::endl;
 #endif
 					mutex_t::scoped_lock jl(m_queue_mutex);
+					job_queue& q = m_queues[queue];
 
-					for (std::list<disk_io_job>::iterator i = m_jobs.begin();
-						i != m_jobs.end();)
+					for (std::list<disk_io_job>::iterator i = q.jobs.begin();
+						i != q.jobs.end();)
 					{
 						if (i->action == disk_io_job::read)
 						{
 							post_callback(i->callback, *i, -1);
-							m_jobs.erase(i++);
+							i = erase_job(q, i);
 							continue;
 						}
 						if (i->action == disk_io_job::check_files)
 						{
 							post_callback(i->callback, *i, piece_manager::disk_check_aborted);
-							m_jobs.erase(i++);
+							i = erase_job(q, i);
 							continue;
 						}
 						++i;
 					}
 
+					m_queues[queue].abort = true;
 					m_abort = true;
+					for (std::vector<job_queue>::iterator i = m_queues.begin()
+						, end(m_queues.end()); i != end; ++i)
+						if (!i->abort) m_abort = false;
 					break;
 				}
 				case disk_io_job::read_and_hash:
@@ -1406,6 +2293,34 @@ namespace libtorrent
 
 					disk_buffer_holder read_holder(*this, j.buffer);
 
+					// hand the piece over to a hash thread once it's
+					// in the read cache. It will copy the block out
+					// of it and post the callback
+					if (!j.storage->compact_allocation() && num_hash_threads() > 0)
+					{
+						hash_job hj;
+						mutex_t::scoped_lock l(m_piece_mutex);
+						cache_t::iterator p;
+						ret = cache_piece_for_hash(j, p, hj.hit, l);
+						if (ret < 0)
+						{
+							test_error(j);
+							break;
+						}
+						p->busy = true;
+						hj.cached = true;
+						hj.blocks = p->blocks;
+						hj.num_blocks = m_block_math.count(
+							j.storage->info()->piece_size(j.piece));
+						l.unlock();
+
+						hj.job = j;
+						hj.callback.swap(handler);
+						read_holder.release();
+						add_hash_job(hj);
+						continue;
+					}
+
 					// read the entire piece and verify the piece hash
 					// since we need to check the hash, this function
 					// will ignore the cache size limit (at least for
@@ -1443,8 +2358,31 @@ namespace libtorrent
 #endif
 					INVARIANT_CHECK;
 					TORRENT_ASSERT(j.buffer == 0);
-					j.buffer = allocate_buffer("send buffer");
 					TORRENT_ASSERT(j.buffer_size <= m_block_size);
+
+					// requests starting at a block boundary fit in
+					// a single cache block, and are handed out by
+					// reference to it rather than copied
+					bool by_ref = m_block_math.remainder(j.offset) == 0;
+					if (by_ref)
+					{
+						char* block = 0;
+						ret = try_read_from_cache(j, &block);
+						if (ret >= 0)
+						{
+							TORRENT_ASSERT(block);
+							j.buffer = block;
+							j.cached_buffer = true;
+							break;
+						}
+						if (ret == -1)
+						{
+							test_error(j);
+							break;
+						}
+					}
+
+					j.buffer = allocate_buffer("send buffer");
 					if (j.buffer == 0)
 					{
 						ret = -1;
@@ -1455,7 +2393,9 @@ namespace libtorrent
 
 					disk_buffer_holder read_holder(*this, j.buffer);
 
-					ret = try_read_from_cache(j);
+					// if we already tried the cache by reference, ret
+					// is -2, there's no room in it or it's disabled
+					if (!by_ref) ret = try_read_from_cache(j);
 
 					// -2 means there's no space in the read cache
 					// or that the read cache is disabled
@@ -1484,7 +2424,9 @@ namespace libtorrent
 							ret = -1;
 							break;
 						}
+						mutex_t::scoped_lock l(m_piece_mutex);
 						++m_cache_stats.blocks_read;
+						j.storage->count_block_read(1, false);
 					}
 					TORRENT_ASSERT(j.buffer == read_holder.get());
 					read_holder.release();
@@ -1508,7 +2450,7 @@ namespace libtorrent
 
 					cache_t::iterator p
 						= find_cached_piece(m_pieces, j, l);
-					int block = j.offset / m_block_size;
+					int block = m_block_math.index(j.offset);
 					TORRENT_ASSERT(j.buffer);
 					TORRENT_ASSERT(j.buffer_size <= m_block_size);
 					if (p != m_pieces.end())
@@ -1524,8 +2466,10 @@ namespace libtorrent
 						rename_buffer(j.buffer, "write cache");
 #endif
 						++m_cache_stats.cache_size;
+						++p->storage->m_cached_blocks;
 						++p->num_blocks;
-						p->last_use = time_now();
+						hash_contiguous_blocks(*p);
+						m_pieces.modify(p, update_last_use(time_now()));
 						// we might just have created a contiguous range
 						// that meets the requirement to be flushed. try it
 						flush_contiguous_blocks(p, l, m_settings.write_cache_line_size);
@@ -1548,6 +2492,8 @@ namespace libtorrent
 					// free it at the end
 					holder.release();
 
+					enforce_cache_limit(j.storage.get(), m_read_pieces.end(), l);
+
 					if (in_use() > m_settings.cache_size)
 						flush_cache_blocks(l, in_use() - m_settings.cache_size, m_read_pieces.end());
 
@@ -1574,6 +2520,28 @@ namespace libtorrent
 						}
 					}
 					l.unlock();
+
+					// read the part of the piece that hasn't been hashed
+					// yet and let a hash thread do the hashing
+					if (!j.storage->compact_allocation() && num_hash_threads() > 0)
+					{
+						hash_job hj;
+						hj.job = j;
+						if (read_unhashed(hj) < 0)
+						{
+							ret = -1;
+							if (!test_error(j))
+							{
+								j.error = error_code(ENOMEM, get_posix_category());
+								j.str = j.error.message();
+							}
+							break;
+						}
+						hj.callback.swap(handler);
+						add_hash_job(hj);
+						continue;
+					}
+
 					sha1_hash h = j.storage->hash_for_piece_impl(j.piece);
 					if (test_error(j))
 					{
@@ -1591,12 +2559,33 @@ namespace libtorrent
 					m_log << log_time() << " move" << std::endl;
 #endif
 					TORRENT_ASSERT(j.buffer == 0);
-					ret = j.storage->move_storage_impl(j.str);
-					if (ret != 0)
+					if (m_waiting_to_shutdown)
+					{
+						j.error = asio::error::operation_aborted;
+						ret = -1;
+						break;
+					}
+					ret = j.storage->move_storage_impl(j.str, j.offset);
+					if (ret < 0)
 					{
 						test_error(j);
 						break;
 					}
+					// the files are being copied a chunk at a time.
+					// Report the progress and put the job back at the
+					// end of the queue, to let other jobs run
+					if (ret > 0)
+					{
+#ifndef BOOST_NO_EXCEPTIONS
+						try {
+#endif
+							if (handler) post_callback(handler, j, ret);
+#ifndef BOOST_NO_EXCEPTIONS
+						} catch (std::exception&) {}
+#endif
+						add_job(j, handler);
+						continue;
+					}
 					j.str = j.storage->save_path().string();
 					break;
 				}
@@ -1609,12 +2598,14 @@ namespace libtorrent
 
 					mutex_t::scoped_lock l(m_piece_mutex);
 					INVARIANT_CHECK;
+					wait_for_storage(j.storage.get(), l);
 
 					for (cache_t::iterator i = m_pieces.begin(); i != m_pieces.end();)
 					{
 						if (i->storage == j.storage)
 						{
 							flush_range(i, 0, INT_MAX, l);
+							if (i->hash) i->storage->put_partial_hash(i->piece, *i->hash);
 							i = m_pieces.erase(i);
 						}
 						else
@@ -1638,6 +2629,7 @@ namespace libtorrent
 
 					mutex_t::scoped_lock l(m_piece_mutex);
 					INVARIANT_CHECK;
+					wait_for_storage(j.storage.get(), l);
 
 					for (cache_t::iterator i = m_read_pieces.begin();
 						i != m_read_pieces.end();)
@@ -1664,29 +2656,62 @@ namespace libtorrent
 #endif
 					TORRENT_ASSERT(j.buffer == 0);
 
+					// the files are deleted a few at a time. The cache
+					// only needs to be cleared before the first ones
+					if (j.offset > 0)
+					{
+						ret = j.storage->delete_files_impl(j.offset);
+						// when shutting down, delete the rest in one go
+						while (ret > 0 && m_waiting_to_shutdown)
+							ret = j.storage->delete_files_impl(j.offset);
+						if (ret > 0)
+						{
+							add_job(j, handler);
+							continue;
+						}
+						if (ret != 0) test_error(j);
+						break;
+					}
+
 					mutex_t::scoped_lock l(m_piece_mutex);
 					INVARIANT_CHECK;
+					wait_for_storage(j.storage.get(), l);
 
-					cache_t::iterator i = std::remove_if(
-						m_pieces.begin(), m_pieces.end(), bind(&cached_piece_entry::storage, _1) == j.storage);
-
-					for (cache_t::iterator k = i; k != m_pieces.end(); ++k)
+					// other disk threads may hold references to
+					// pieces of other storages, only touch the
+					// ones belonging to this storage
+					for (cache_t::iterator k = m_pieces.begin(); k != m_pieces.end();)
 					{
+						if (k->storage != j.storage)
+						{
+							++k;
+							continue;
+						}
 						torrent_info const& ti = *k->storage->info();
-						int blocks_in_piece = (ti.piece_size(k->piece) + m_block_size - 1) / m_block_size;
+						int blocks_in_piece = m_block_math.count(ti.piece_size(k->piece));
 						for (int j = 0; j < blocks_in_piece; ++j)
 						{
 							if (k->blocks[j] == 0) continue;
 							free_buffer(k->blocks[j]);
 							k->blocks[j] = 0;
+							--k->storage->m_cached_blocks;
 							--m_cache_stats.cache_size;
 						}
+						k = m_pieces.erase(k);
 					}
-					m_pieces.erase(i, m_pieces.end());
 					l.unlock();
 					release_memory();
 
-					ret = j.storage->delete_files_impl();
+					ret = j.storage->delete_files_impl(j.offset);
+					while (ret > 0 && m_waiting_to_shutdown)
+						ret = j.storage->delete_files_impl(j.offset);
+					// put the job back at the end of the queue, to let
+					// the reads and writes of other torrents run
+					if (ret > 0)
+					{
+						add_job(j, handler);
+						continue;
+					}
 					if (ret != 0) test_error(j);
 					break;
 				}
@@ -1700,6 +2725,59 @@ namespace libtorrent
 					ret = j.storage->check_fastresume(*rd, j.str);
 					break;
 				}
+				case disk_io_job::relocate_pieces:
+				{
+#ifdef TORRENT_DISK_STATS
+					m_log << log_time() << " relocate_pieces" << std::endl;
+#endif
+					// the pieces stay where they are if we're shutting down,
+					// the resume data records where they are
+					if (m_waiting_to_shutdown)
+					{
+						ret = 0;
+						break;
+					}
+					ret = j.storage->relocate_piece_impl();
+					if (test_error(j))
+					{
+						ret = -1;
+						break;
+					}
+					// move one piece at a time, and go to the back of
+					// the queue in between, so peer requests don't wait
+					// for more than one piece to be moved
+					if (ret > 0)
+					{
+						add_job(j, handler);
+						continue;
+					}
+					break;
+				}
+				case disk_io_job::discard_piece:
+				{
+#ifdef TORRENT_DISK_STATS
+					m_log << log_time() << " discard_piece" << std::endl;
+#endif
+					mutex_t::scoped_lock l(m_piece_mutex);
+					INVARIANT_CHECK;
+
+					cache_t::iterator p = find_cached_piece(m_read_pieces, j, l);
+					if (p != m_read_pieces.end())
+					{
+						free_piece(*p, l);
+						m_read_pieces.erase(p);
+					}
+					// a piece still in the write cache is written before
+					// its space is given back, so the write can't undo it
+					p = find_cached_piece(m_pieces, j, l);
+					if (p != m_pieces.end()) flush_and_remove(p, l);
+					l.unlock();
+					release_memory();
+
+					j.storage->discard_piece_impl(j.piece);
+					ret = 0;
+					break;
+				}
 				case disk_io_job::check_files:
 				{
 #ifdef TORRENT_DISK_STATS
@@ -1786,6 +2864,20 @@ namespace libtorrent
 			}
 #endif
 
+			ptime job_end = time_now_hires();
+			{
+				mutex_t::scoped_lock jl(m_queue_mutex);
+				m_job_time[j.action].add(job_end - job_start);
+			}
+			if (j.storage) j.storage->count_job(job_start - j.start_time
+				, job_end - job_start);
+			if (m_trace)
+			{
+				m_trace->span("disk", job_action_names[j.action], job_start
+					, job_end, 1 + queue, "piece", j.piece, "offset", j.offset
+					, "queue_us", total_microseconds(job_start - j.start_time));
+			}
+
 //			if (!handler) std::cerr << "DISK THREAD: no callback specified" << std::endl;
 //			else std::cerr << "DISK THREAD: invoking callback" << std::endl;
 #ifndef BOOST_NO_EXCEPTIONS
@@ -1793,6 +2885,8 @@ namespace libtorrent
 #endif
 				TORRENT_ASSERT(ret != -2 || !j.str.empty()
 					|| j.action == disk_io_job::hash);
+				if (j.action == disk_io_job::read && ret > 0)
+					complete_duplicate_reads(queue, j, ret);
 				post_callback(handler, j, ret);
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&)
@@ -86,22 +86,17 @@ namespace libtorrent
 
 	entry& entry::operator[](char const* key)
 	{
-		dictionary_type::iterator i = dict().find(key);
-		if (i != dict().end()) return i->second;
-		dictionary_type::iterator ret = dict().insert(
-			dict().begin()
-			, std::make_pair(key, entry()));
-		return ret->second;
+		return (*this)[std::string(key)];
 	}
 
 	entry& entry::operator[](std::string const& key)
 	{
-		dictionary_type::iterator i = dict().find(key);
-		if (i != dict().end()) return i->second;
-		dictionary_type::iterator ret = dict().insert(
-			dict().begin()
-			, std::make_pair(std::string(key), entry()));
-		return ret->second;
+		// the position found by lower_bound() is used as the
+		// insertion hint, so a new key costs a single lookup
+		dictionary_type& d = dict();
+		dictionary_type::iterator i = d.lower_bound(key);
+		if (i != d.end() && i->first == key) return i->second;
+		return d.insert(i, dictionary_type::value_type(key, entry()))->second;
 	}
 
 	entry* entry::find_key(char const* key)
@@ -351,8 +346,53 @@ namespace libtorrent
 
 	void entry::swap(entry& e)
 	{
-		// not implemented
-		TORRENT_ASSERT(false);
+		if (&e == this) return;
+		if (m_type != e.m_type)
+		{
+			// move the contents around through a temporary, none
+			// of the containers are copied
+			entry tmp;
+			tmp.take(e);
+			e.take(*this);
+			take(tmp);
+			return;
+		}
+
+		switch (m_type)
+		{
+		case int_t:
+			std::swap(*reinterpret_cast<integer_type*>(data)
+				, *reinterpret_cast<integer_type*>(e.data));
+			break;
+		case string_t:
+			reinterpret_cast<string_type*>(data)->swap(
+				*reinterpret_cast<string_type*>(e.data));
+			break;
+		case list_t:
+			reinterpret_cast<list_type*>(data)->swap(
+				*reinterpret_cast<list_type*>(e.data));
+			break;
+		case dictionary_t:
+			reinterpret_cast<dictionary_type*>(data)->swap(
+				*reinterpret_cast<dictionary_type*>(e.data));
+			break;
+		default:
+			TORRENT_ASSERT(m_type == undefined_t);
+			break;
+		}
+#ifdef TORRENT_DEBUG
+		std::swap(m_type_queried, e.m_type_queried);
+#endif
+	}
+
+	void entry::take(entry& e)
+	{
+		TORRENT_ASSERT(m_type == undefined_t);
+		TORRENT_ASSERT(&e != this);
+		if (e.m_type == undefined_t) return;
+		construct(e.m_type);
+		swap(e);
+		e.destruct();
 	}
 
 #if defined TORRENT_DEBUG && TORRENT_USE_IOSTREAM
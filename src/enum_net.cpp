@@ -35,6 +35,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include "libtorrent/enum_net.hpp"
 #include "libtorrent/broadcast_socket.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/thread/mutex.hpp>
 #if BOOST_VERSION < 103500
 #include <asio/ip/host_name.hpp>
 #else
@@ -78,6 +80,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #endif
 
 namespace libtorrent { namespace
@@ -255,7 +258,9 @@ namespace libtorrent
 		return false;
 	}
 	
-	std::vector<ip_interface> enum_net_interfaces(io_service& ios, error_code& ec)
+namespace
+{
+	std::vector<ip_interface> query_net_interfaces(io_service& ios, error_code& ec)
 	{
 		std::vector<ip_interface> ret;
 // covers linux, MacOS X and BSD distributions
@@ -376,6 +381,7 @@ namespace libtorrent
 #endif
 		return ret;
 	}
+}
 
 	address get_default_gateway(io_service& ios, error_code& ec)
 	{
@@ -391,7 +397,9 @@ namespace libtorrent
 		return i->gateway;
 	}
 
-	std::vector<ip_route> enum_routes(io_service& ios, error_code& ec)
+namespace
+{
+	std::vector<ip_route> query_routes(io_service& ios, error_code& ec)
 	{
 		std::vector<ip_route> ret;
 	
@@ -646,7 +654,135 @@ namespace libtorrent
 #endif
 		return ret;
 	}
+}
+
+namespace
+{
+	// the interfaces and routes are queried from the kernel the first
+	// time they're needed and then shared by every caller, until they
+	// are older than the max age or, on linux, the kernel reports that
+	// an address, link or route has changed
+	struct net_cache
+	{
+		net_cache()
+			: interfaces_valid(false)
+			, routes_valid(false)
+#if defined TORRENT_LINUX
+			, netlink(-1)
+			, netlink_opened(false)
+#endif
+		{}
+
+		boost::mutex mutex;
+
+		std::vector<ip_interface> interfaces;
+		ptime interfaces_updated;
+		bool interfaces_valid;
+
+		std::vector<ip_route> routes;
+		ptime routes_updated;
+		bool routes_valid;
+
+#if defined TORRENT_LINUX
+		// a netlink socket subscribed to address, link and route
+		// changes. It's only polled, with non-blocking reads, for
+		// whether anything has changed. -1 if it couldn't be opened
+		int netlink;
+		bool netlink_opened;
+#endif
+	};
+
+	net_cache& get_net_cache()
+	{
+		static net_cache c;
+		return c;
+	}
+
+	// invalidates the cache if the kernel has reported a change
+	// since the last call. Returns the max age of the cached
+	// entries. Must be called with the cache mutex held
+	time_duration check_for_changes(net_cache& c)
+	{
+#if defined TORRENT_LINUX
+		if (!c.netlink_opened)
+		{
+			c.netlink_opened = true;
+			c.netlink = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+			sockaddr_nl sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.nl_family = AF_NETLINK;
+			sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+				| RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+			if (c.netlink >= 0
+				&& (bind(c.netlink, (sockaddr*)&sa, sizeof(sa)) < 0
+				|| fcntl(c.netlink, F_SETFL, fcntl(c.netlink, F_GETFL) | O_NONBLOCK) < 0))
+			{
+				close(c.netlink);
+				c.netlink = -1;
+			}
+		}
 
+		if (c.netlink >= 0)
+		{
+			char buf[4096];
+			bool changed = false;
+			for (;;)
+			{
+				int ret = recv(c.netlink, buf, sizeof(buf), 0);
+				// ENOBUFS means notifications were dropped
+				if (ret > 0 || (ret < 0 && errno == ENOBUFS))
+				{
+					changed = true;
+					continue;
+				}
+				break;
+			}
+			if (changed)
+			{
+				c.interfaces_valid = false;
+				c.routes_valid = false;
+			}
+			// the notifications catch the changes, the max age
+			// is only a safety net
+			return minutes(1);
+		}
+#endif
+		return seconds(5);
+	}
 }
 
+	std::vector<ip_interface> enum_net_interfaces(io_service& ios, error_code& ec)
+	{
+		net_cache& c = get_net_cache();
+		boost::mutex::scoped_lock l(c.mutex);
+		time_duration max_age = check_for_changes(c);
+		ptime now = time_now_hires();
+		if (!c.interfaces_valid || now - c.interfaces_updated > max_age)
+		{
+			std::vector<ip_interface> ret = query_net_interfaces(ios, ec);
+			if (ec) return ret;
+			c.interfaces.swap(ret);
+			c.interfaces_updated = now;
+			c.interfaces_valid = true;
+		}
+		return c.interfaces;
+	}
+
+	std::vector<ip_route> enum_routes(io_service& ios, error_code& ec)
+	{
+		net_cache& c = get_net_cache();
+		boost::mutex::scoped_lock l(c.mutex);
+		time_duration max_age = check_for_changes(c);
+		ptime now = time_now_hires();
+		if (!c.routes_valid || now - c.routes_updated > max_age)
+		{
+			std::vector<ip_route> ret = query_routes(ios, ec);
+			if (ec) return ret;
+			c.routes.swap(ret);
+			c.routes_updated = now;
+			c.routes_valid = true;
+		}
+		return c.routes;
+	}
+}
 
@@ -71,6 +71,9 @@ namespace libtorrent
 			"invalid type requested from entry",
 			"missing info-hash from URI",
 			"file too short",
+			"not a resume journal",
+			"piece was evicted from storage",
+			"invalid range requested",
 		};
 		if (ev < 0 || ev >= sizeof(msgs)/sizeof(msgs[0]))
 			return "Unknown error";
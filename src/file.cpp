@@ -50,7 +50,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <errno.h>
+#if TORRENT_USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include <boost/static_assert.hpp>
 // make sure the _FILE_OFFSET_BITS define worked
@@ -510,7 +514,7 @@ namespace libtorrent
 		if (!aligned)
 		{
 			size = bufs_size(bufs, num_bufs);
-			if (size & (size_alignment()-1) == 0) aligned = true;
+			if ((size & (size_alignment()-1)) == 0) aligned = true;
 		}
 		if (aligned)
 #endif // TORRENT_LINUX
@@ -527,7 +531,9 @@ namespace libtorrent
 		file::iovec_t* temp_bufs = TORRENT_ALLOCA(file::iovec_t, num_bufs);
 		memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * num_bufs);
 		iovec_t& last = temp_bufs[num_bufs-1];
-		last.iov_len = (last.iov_len & ~(size_alignment()-1)) + m_page_size;
+		// this is the tail of the file. Round the last buffer up to
+		// the alignment, the buffers are allocated in whole blocks
+		last.iov_len = (last.iov_len + size_alignment() - 1) & ~(size_alignment()-1);
 		ret = ::readv(m_fd, temp_bufs, num_bufs);
 		if (ret < 0)
 		{
@@ -738,7 +744,7 @@ namespace libtorrent
 		if (!aligned)
 		{
 			size = bufs_size(bufs, num_bufs);
-			if (size & (size_alignment()-1) == 0) aligned = true;
+			if ((size & (size_alignment()-1)) == 0) aligned = true;
 		}
 		if (aligned)
 #endif
@@ -755,14 +761,22 @@ namespace libtorrent
 		file::iovec_t* temp_bufs = TORRENT_ALLOCA(file::iovec_t, num_bufs);
 		memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * num_bufs);
 		iovec_t& last = temp_bufs[num_bufs-1];
-		last.iov_len = (last.iov_len & ~(size_alignment()-1)) + size_alignment();
+		last.iov_len = (last.iov_len + size_alignment() - 1) & ~(size_alignment()-1);
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+		{
+			ec = error_code(errno, get_posix_category());
+			return -1;
+		}
 		ret = ::writev(m_fd, temp_bufs, num_bufs);
 		if (ret < 0)
 		{
 			ec = error_code(errno, get_posix_category());
 			return -1;
 		}
-		if (ftruncate(m_fd, file_offset + size) < 0)
+		// cut off the padding written past the end of the data, but
+		// don't cut off anything that was in the file already
+		if (ftruncate(m_fd, (std::max)(size_type(st.st_size), file_offset + size)) < 0)
 		{
 			ec = error_code(errno, get_posix_category());
 			return -1;
@@ -845,6 +859,125 @@ namespace libtorrent
 		return true;
 	}
 
+	bool file::allocate(size_type file_offset, size_type len, error_code& ec)
+	{
+		TORRENT_ASSERT(is_open());
+		TORRENT_ASSERT(file_offset >= 0);
+		TORRENT_ASSERT(len > 0);
+#if defined TORRENT_LINUX && defined FALLOC_FL_KEEP_SIZE
+		if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, file_offset, len) < 0)
+		{
+			ec = error_code(errno, get_posix_category());
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	bool file::discard(size_type file_offset, size_type len, error_code& ec)
+	{
+		TORRENT_ASSERT(is_open());
+		TORRENT_ASSERT(file_offset >= 0);
+		TORRENT_ASSERT(len > 0);
+		if ((m_open_mode & sparse) == 0) return true;
+#ifdef TORRENT_WINDOWS
+		FILE_ZERO_DATA_INFORMATION zero;
+		zero.FileOffset.QuadPart = file_offset;
+		zero.BeyondFinalZero.QuadPart = file_offset + len;
+		DWORD temp;
+		if (!DeviceIoControl(m_file_handle, FSCTL_SET_ZERO_DATA
+			, &zero, sizeof(zero), 0, 0, &temp, 0))
+		{
+			ec = error_code(GetLastError(), get_system_category());
+			return false;
+		}
+#elif defined TORRENT_LINUX && defined FALLOC_FL_PUNCH_HOLE
+		if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+			, file_offset, len) < 0)
+		{
+			// file systems that can't punch holes just keep the data
+			if (errno == EOPNOTSUPP) return true;
+			ec = error_code(errno, get_posix_category());
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	char* file::map(size_type file_offset, int size, bool write, error_code& ec)
+	{
+		TORRENT_ASSERT(is_open());
+		TORRENT_ASSERT(size > 0);
+		TORRENT_ASSERT((file_offset & 0xffff) == 0);
+#ifdef TORRENT_WINDOWS
+		HANDLE m = CreateFileMapping(m_file_handle, 0
+			, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0);
+		if (m == NULL)
+		{
+			ec = error_code(GetLastError(), get_system_category());
+			return 0;
+		}
+		void* ret = MapViewOfFile(m, write ? FILE_MAP_WRITE : FILE_MAP_READ
+			, DWORD(file_offset >> 32), DWORD(file_offset & 0xffffffff), size);
+		if (ret == 0) ec = error_code(GetLastError(), get_system_category());
+		// the view keeps the mapping object alive
+		CloseHandle(m);
+		return (char*)ret;
+#else
+		void* ret = mmap(0, size, write ? PROT_READ | PROT_WRITE : PROT_READ
+			, MAP_SHARED, m_fd, file_offset);
+		if (ret == MAP_FAILED)
+		{
+			ec = error_code(errno, get_posix_category());
+			return 0;
+		}
+		return (char*)ret;
+#endif
+	}
+
+	void file::unmap(char* p, int size)
+	{
+		TORRENT_ASSERT(p);
+#ifdef TORRENT_WINDOWS
+		UnmapViewOfFile(p);
+#else
+		munmap(p, size);
+#endif
+	}
+
+	void file::hint_read(size_type file_offset, int len)
+	{
+		TORRENT_ASSERT(is_open());
+#ifndef TORRENT_WINDOWS
+		// there's no page cache to read into
+		if (m_open_mode & no_buffer) return;
+#if defined POSIX_FADV_WILLNEED
+		posix_fadvise(m_fd, file_offset, len, POSIX_FADV_WILLNEED);
+#elif defined F_RDADVISE
+		radvisory r;
+		r.ra_offset = file_offset;
+		r.ra_count = len;
+		fcntl(m_fd, F_RDADVISE, &r);
+#endif
+#endif
+	}
+
+#if TORRENT_USE_SENDFILE
+	int file::sendfile(int sock, size_type file_offset, int size, error_code& ec)
+	{
+		TORRENT_ASSERT(is_open());
+		TORRENT_ASSERT(size > 0);
+		off_t offset = file_offset;
+		ssize_t ret = ::sendfile(sock, m_fd, &offset, size);
+		if (ret < 0)
+		{
+			ec = error_code(errno, get_posix_category());
+			return -1;
+		}
+		return int(ret);
+	}
+#endif
+
 	size_type file::get_size(error_code& ec) const
 	{
 #ifdef TORRENT_WINDOWS
@@ -898,9 +1031,17 @@ namespace libtorrent
 		return buffer.FileOffset.QuadPart;
 		
 #elif defined SEEK_DATA
-		// this is supported on solaris
+		// this is supported on solaris and linux. If start is
+		// in a hole, this is the offset of the next data
 		size_type ret = lseek(m_fd, start, SEEK_DATA);
-		if (ret < 0) return start;
+		if (ret >= 0) return ret;
+		// ENXIO means there is no data past start, the rest
+		// of the file is a hole
+		if (errno != ENXIO) return start;
+		error_code ec;
+		size_type file_size = get_size(ec);
+		if (ec) return start;
+		return file_size;
 #else
 		return start;
 #endif
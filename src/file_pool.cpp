@@ -31,52 +31,69 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <boost/version.hpp>
-#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
 #include "libtorrent/pch.hpp"
 #include "libtorrent/file_pool.hpp"
 #include "libtorrent/error_code.hpp"
+#include "libtorrent/assert.hpp"
 
 namespace libtorrent
 {
+	file_pool::file_pool(int size)
+		: m_size(size)
+		, m_num_open(0)
+	{}
+
+	file_pool::shard& file_pool::shard_for(file_key const& k)
+	{
+		return m_shards[boost::hash<file_key>()(k) % num_shards];
+	}
+
 	boost::shared_ptr<file> file_pool::open_file(void* st, fs::path const& p
-		, int m, error_code& ec)
+		, int file_index, int m, error_code& ec)
 	{
 		TORRENT_ASSERT(st != 0);
 		TORRENT_ASSERT(p.is_complete());
 		TORRENT_ASSERT((m & file::rw_mask) == file::read_only
 			|| (m & file::rw_mask) == file::read_write);
-		boost::mutex::scoped_lock l(m_mutex);
-		file_set::iterator i = m_files.find(p.string());
-		if (i != m_files.end())
+
+		file_key k(st, file_index);
+		shard& s = shard_for(k);
+		boost::mutex::scoped_lock l(s.mutex);
+
+		file_set::iterator i = s.files.find(k);
+		if (i != s.files.end() && i->path != p.string())
 		{
-			lru_file_entry& e = i->second;
-			e.last_use = time_now();
+			// the file was renamed behind our back, don't
+			// hand out the old one
+			close_file(s, i);
+			i = s.files.end();
+		}
 
-			if (e.key != st && ((e.mode & file::rw_mask) != file::read_only
-				|| (m & file::rw_mask) != file::read_only))
-			{
-				// this means that another instance of the storage
-				// is using the exact same file.
-#if BOOST_VERSION >= 103500
-				ec = error_code(errors::file_collision, libtorrent_category);
-#endif
-				return boost::shared_ptr<file>();
-			}
+		if (i != s.files.end())
+		{
+			lru_list& lru = s.files.get<1>();
+			lru.relocate(lru.end(), s.files.project<1>(i));
+			++s.hits;
 
-			e.key = st;
+			lru_file_entry const& e = *i;
 			// if we asked for a file in write mode,
 			// and the cached file is is not opened in
 			// write mode, re-open it
 			if (((e.mode & file::rw_mask) != file::read_write)
 				&& ((m & file::rw_mask) == file::read_write))
 			{
+				// another storage may be reading the same file
+				if (!register_path(st, file_index, e.path, m, ec))
+					return boost::shared_ptr<file>();
+
 				// close the file before we open it with
 				// the new read/write privilages
 				TORRENT_ASSERT(e.file_ptr.unique());
 				e.file_ptr->close();
 				if (!e.file_ptr->open(p, m, ec))
 				{
-					m_files.erase(i);
+					close_file(s, i);
 					return boost::shared_ptr<file>();
 				}
 				TORRENT_ASSERT(e.file_ptr->is_open());
@@ -85,58 +102,158 @@ namespace libtorrent
 			TORRENT_ASSERT((e.mode & file::no_buffer) == (m & file::no_buffer));
 			return e.file_ptr;
 		}
+
 		// the file is not in our cache
-		if ((int)m_files.size() >= m_size)
-		{
-			// the file cache is at its maximum size, close
-			// the least recently used (lru) file from it
-			remove_oldest();
-		}
+		++s.misses;
 		lru_file_entry e;
+		e.key = k;
+		e.path = p.string();
+		e.mode = m;
+
+		if (!register_path(st, file_index, e.path, m, ec))
+			return boost::shared_ptr<file>();
+
 		e.file_ptr.reset(new (std::nothrow)file);
 		if (!e.file_ptr)
 		{
+			unregister_path(st, file_index, e.path);
 			ec = error_code(ENOMEM, get_posix_category());
 			return e.file_ptr;
 		}
 		if (!e.file_ptr->open(p, m, ec))
+		{
+			unregister_path(st, file_index, e.path);
 			return boost::shared_ptr<file>();
-		e.mode = m;
-		e.key = st;
-		m_files.insert(std::make_pair(p.string(), e));
+		}
 		TORRENT_ASSERT(e.file_ptr->is_open());
+		s.files.get<1>().push_back(e);
+		++m_num_open;
+
+		// the file cache is at its maximum size, close
+		// the least recently used (lru) files. Start with
+		// this shard, since we already hold its lock
+		while (m_num_open > m_size && remove_oldest(s, true));
+		l.unlock();
+
+		if (m_num_open > m_size) make_room(s);
 		return e.file_ptr;
 	}
 
-	void file_pool::remove_oldest()
+	// closes files in the other shards until we're within the limit.
+	// Only one shard is locked at a time
+	void file_pool::make_room(shard& skip)
+	{
+		int start = &skip - m_shards;
+		bool removed = true;
+		while (m_num_open > m_size && removed)
+		{
+			removed = false;
+			for (int n = 1; n < num_shards && m_num_open > m_size; ++n)
+			{
+				shard& s = m_shards[(start + n) % num_shards];
+				boost::mutex::scoped_lock l(s.mutex);
+				if (remove_oldest(s, false)) removed = true;
+			}
+		}
+	}
+
+	// the shard must be locked
+	bool file_pool::remove_oldest(shard& s, bool keep_newest)
 	{
-		file_set::iterator i = std::min_element(m_files.begin(), m_files.end()
-			, boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _1))
-				< boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _2)));
-		if (i == m_files.end()) return;
-		m_files.erase(i);
+		lru_list& lru = s.files.get<1>();
+		if (lru.empty()) return false;
+		if (keep_newest && lru.size() == 1) return false;
+		close_file(s, s.files.project<0>(lru.begin()));
+		++s.evictions;
+		return true;
 	}
 
-	void file_pool::release(fs::path const& p)
+	// the shard must be locked
+	void file_pool::close_file(shard& s, file_set::iterator i)
 	{
-		boost::mutex::scoped_lock l(m_mutex);
+		unregister_path(i->key.first, i->key.second, i->path);
+		s.files.erase(i);
+		--m_num_open;
+	}
+
+	bool file_pool::register_path(void* st, int file_index
+		, std::string const& p, int mode, error_code& ec)
+	{
+		boost::mutex::scoped_lock l(m_path_mutex);
+		typedef std::multimap<std::string, path_owner>::iterator iter;
+		std::pair<iter, iter> range = m_open_paths.equal_range(p);
+		iter self = m_open_paths.end();
+		for (iter i = range.first; i != range.second; ++i)
+		{
+			path_owner const& o = i->second;
+			if (o.st == st && o.file_index == file_index)
+			{
+				self = i;
+				continue;
+			}
+			if ((o.mode & file::rw_mask) != file::read_only
+				|| (mode & file::rw_mask) != file::read_only)
+			{
+				// this means that another instance of the storage
+				// is using the exact same file.
+#if BOOST_VERSION >= 103500
+				ec = error_code(errors::file_collision, libtorrent_category);
+#endif
+				return false;
+			}
+		}
+		if (self != m_open_paths.end())
+		{
+			self->second.mode = mode;
+			return true;
+		}
+		path_owner o;
+		o.st = st;
+		o.file_index = file_index;
+		o.mode = mode;
+		m_open_paths.insert(std::make_pair(p, o));
+		return true;
+	}
+
+	void file_pool::unregister_path(void* st, int file_index, std::string const& p)
+	{
+		boost::mutex::scoped_lock l(m_path_mutex);
+		typedef std::multimap<std::string, path_owner>::iterator iter;
+		std::pair<iter, iter> range = m_open_paths.equal_range(p);
+		for (iter i = range.first; i != range.second; ++i)
+		{
+			if (i->second.st != st || i->second.file_index != file_index) continue;
+			m_open_paths.erase(i);
+			return;
+		}
+	}
 
-		file_set::iterator i = m_files.find(p.string());
-		if (i != m_files.end()) m_files.erase(i);
+	void file_pool::release(void* st, int file_index)
+	{
+		file_key k(st, file_index);
+		shard& s = shard_for(k);
+		boost::mutex::scoped_lock l(s.mutex);
+
+		file_set::iterator i = s.files.find(k);
+		if (i != s.files.end()) close_file(s, i);
 	}
 
 	void file_pool::release(void* st)
 	{
-		boost::mutex::scoped_lock l(m_mutex);
 		TORRENT_ASSERT(st != 0);
 
-		for (file_set::iterator i = m_files.begin();
-			i != m_files.end();)
+		for (int n = 0; n < num_shards; ++n)
 		{
-			if (i->second.key == st)
-				m_files.erase(i++);
-			else
-				++i;
+			shard& s = m_shards[n];
+			boost::mutex::scoped_lock l(s.mutex);
+			for (file_set::iterator i = s.files.begin();
+				i != s.files.end();)
+			{
+				if (i->key.first == st)
+					close_file(s, i++);
+				else
+					++i;
+			}
 		}
 	}
 
@@ -144,13 +261,39 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(size > 0);
 		if (size == m_size) return;
-		boost::mutex::scoped_lock l(m_mutex);
 		m_size = size;
-		if (int(m_files.size()) <= m_size) return;
+		if (m_num_open <= m_size) return;
+
+		// close the least recently used files, taking
+		// turns between the shards
+		bool removed = true;
+		while (m_num_open > m_size && removed)
+		{
+			removed = false;
+			for (int n = 0; n < num_shards && m_num_open > m_size; ++n)
+			{
+				shard& s = m_shards[n];
+				boost::mutex::scoped_lock l(s.mutex);
+				if (remove_oldest(s, false)) removed = true;
+			}
+		}
+	}
 
-		// close the least recently used files
-		while (int(m_files.size()) > m_size)
-			remove_oldest();
+	void file_pool::get_stats(size_type& hits, size_type& misses
+		, size_type& evictions) const
+	{
+		hits = 0;
+		misses = 0;
+		evictions = 0;
+		for (int n = 0; n < num_shards; ++n)
+		{
+			shard const& s = m_shards[n];
+			boost::mutex::scoped_lock l(s.mutex);
+			hits += s.hits;
+			misses += s.misses;
+			evictions += s.evictions;
+		}
 	}
 
 }
+
@@ -90,24 +90,21 @@ namespace libtorrent
 		m_files[index].path = new_filename;
 	}
 
-	file_storage::iterator file_storage::file_at_offset(size_type offset) const
+	int file_storage::file_index_at_offset(size_type offset) const
 	{
-		// TODO: do a binary search
-		std::vector<file_entry>::const_iterator i;
-		for (i = begin(); i != end(); ++i)
-		{
-			if (i->offset <= offset && i->offset + i->size > offset)
-				return i;
-		}
-		return i;
+		TORRENT_ASSERT(m_file_offsets.size() == m_files.size());
+		std::vector<size_type>::const_iterator i = std::upper_bound(
+			m_file_offsets.begin(), m_file_offsets.end(), offset);
+		return int(i - m_file_offsets.begin()) - 1;
 	}
 
-	namespace
+	file_storage::iterator file_storage::file_at_offset(size_type offset) const
 	{
-		bool compare_file_offset(file_entry const& lhs, file_entry const& rhs)
-		{
-			return lhs.offset < rhs.offset;
-		}
+		int index = file_index_at_offset(offset);
+		if (index < 0) return end();
+		file_entry const& e = m_files[index];
+		if (e.offset + e.size <= offset) return end();
+		return begin() + index;
 	}
 
 	std::vector<file_slice> file_storage::map_block(int piece, size_type offset
@@ -115,39 +112,56 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(num_files() > 0);
 		std::vector<file_slice> ret;
+		for (slice_iterator i(*this, piece, offset, size); !i.done(); ++i)
+			ret.push_back(*i);
+		return ret;
+	}
 
-		if (m_files.empty()) return ret;
+	file_storage::slice_iterator::slice_iterator(file_storage const& fs
+		, int piece, size_type offset, int size)
+		: m_files(&fs)
+		, m_index(0)
+		, m_file_offset(0)
+		, m_left(size)
+	{
+		if (fs.m_files.empty() || size <= 0)
+		{
+			m_left = 0;
+			return;
+		}
 
-		// find the file iterator and file offset
-		file_entry target;
-		target.offset = piece * (size_type)m_piece_length + offset;
-		TORRENT_ASSERT(target.offset + size <= m_total_size);
-		TORRENT_ASSERT(!compare_file_offset(target, m_files.front()));
+		size_type target = piece * (size_type)fs.m_piece_length + offset;
+		TORRENT_ASSERT(target + size <= fs.m_total_size);
 
-		std::vector<file_entry>::const_iterator file_iter = std::upper_bound(
-			begin(), end(), target, compare_file_offset);
+		m_index = fs.file_index_at_offset(target);
+		TORRENT_ASSERT(m_index >= 0);
+		m_file_offset = target - fs.m_files[m_index].offset;
+		fill();
+	}
 
-		TORRENT_ASSERT(file_iter != begin());
-		--file_iter;
+	file_storage::slice_iterator& file_storage::slice_iterator::operator++()
+	{
+		TORRENT_ASSERT(!done());
+		m_left -= m_slice.size;
+		TORRENT_ASSERT(m_left >= 0);
+		if (m_left == 0) return *this;
+		m_file_offset += m_slice.size;
+		fill();
+		return *this;
+	}
 
-		size_type file_offset = target.offset - file_iter->offset;
-		for (; size > 0; file_offset -= file_iter->size, ++file_iter)
+	void file_storage::slice_iterator::fill()
+	{
+		while (m_file_offset >= m_files->m_files[m_index].size)
 		{
-			TORRENT_ASSERT(file_iter != end());
-			if (file_offset < file_iter->size)
-			{
-				file_slice f;
-				f.file_index = file_iter - begin();
-				f.offset = file_offset + file_iter->file_base;
-				f.size = (std::min)(file_iter->size - file_offset, (size_type)size);
-				size -= f.size;
-				file_offset += f.size;
-				ret.push_back(f);
-			}
-			
-			TORRENT_ASSERT(size >= 0);
+			m_file_offset -= m_files->m_files[m_index].size;
+			++m_index;
+			TORRENT_ASSERT(m_index < int(m_files->m_files.size()));
 		}
-		return ret;
+		file_entry const& e = m_files->m_files[m_index];
+		m_slice.file_index = m_index;
+		m_slice.offset = m_file_offset + e.file_base;
+		m_slice.size = (std::min)(e.size - m_file_offset, m_left);
 	}
 	
 	peer_request file_storage::map_file(int file_index, size_type file_offset
@@ -194,6 +208,7 @@ namespace libtorrent
 		e.pad_file = bool(flags & pad_file);
 		e.hidden_attribute = bool(flags & attribute_hidden);
 		e.executable_attribute = bool(flags & attribute_executable);
+		m_file_offsets.push_back(m_total_size);
 		m_total_size += size;
 	}
 
@@ -220,6 +235,7 @@ namespace libtorrent
 		m_files.push_back(ent);
 		file_entry& e = m_files.back();
 		e.offset = m_total_size;
+		m_file_offsets.push_back(m_total_size);
 		m_total_size += ent.size;
 	}
 
@@ -300,6 +316,10 @@ namespace libtorrent
 			off += i->size;
 		}
 		m_total_size = off;
+
+		m_file_offsets.resize(m_files.size());
+		for (int k = 0; k < int(m_files.size()); ++k)
+			m_file_offsets[k] = m_files[k].offset;
 	}
 }
 
@@ -30,12 +30,14 @@ POSSIBILITY OF SUCH DAMAGE.
 
 */
 
+#include "libtorrent/gzip.hpp"
 #include "libtorrent/assert.hpp"
 
 #include "zlib.h"
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 namespace
 {
@@ -209,5 +211,79 @@ namespace libtorrent
 		return false;
 	}
 
+	gzip_inflater::gzip_inflater()
+		: m_stream(0)
+		, m_finished(false)
+	{}
+
+	gzip_inflater::~gzip_inflater()
+	{
+		if (m_stream == 0) return;
+		inflateEnd(m_stream);
+		delete m_stream;
+	}
+
+	bool gzip_inflater::decode(char const* in, int size
+		, std::vector<char>& out
+		, int maximum_size
+		, std::string& error)
+	{
+		TORRENT_ASSERT(maximum_size > 0);
+
+		if (m_finished) return false;
+
+		if (m_stream == 0)
+		{
+			m_stream = new z_stream;
+			m_stream->next_in = Z_NULL;
+			m_stream->avail_in = 0;
+			m_stream->zalloc = Z_NULL;
+			m_stream->zfree = Z_NULL;
+			m_stream->opaque = 0;
+			// 15 + 16 makes zlib parse the gzip header and
+			// trailer itself, they may be split over several
+			// calls
+			if (inflateInit2(m_stream, 15 + 16) != Z_OK)
+			{
+				delete m_stream;
+				m_stream = 0;
+				error = "gzip out of memory";
+				return true;
+			}
+		}
+
+		m_stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+		m_stream->avail_in = size;
+
+		while (m_stream->avail_in > 0)
+		{
+			int old_size = int(out.size());
+			if (old_size >= maximum_size)
+			{
+				error = "response too large";
+				return true;
+			}
+			int grow = (std::min)(maximum_size - old_size, 16 * 1024);
+			out.resize(old_size + grow);
+			m_stream->next_out = reinterpret_cast<Bytef*>(&out[old_size]);
+			m_stream->avail_out = grow;
+
+			int ret = inflate(m_stream, Z_SYNC_FLUSH);
+			out.resize(out.size() - m_stream->avail_out);
+
+			if (ret == Z_STREAM_END)
+			{
+				m_finished = true;
+				break;
+			}
+			if (ret != Z_OK)
+			{
+				error = "gzip error";
+				return true;
+			}
+		}
+		return false;
+	}
+
 }
 
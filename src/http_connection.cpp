@@ -37,10 +37,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/parse_url.hpp"
 #include "libtorrent/socket.hpp"
 #include "libtorrent/connection_queue.hpp"
+#include "libtorrent/resolver.hpp"
 
 #include <boost/bind.hpp>
 #include <string>
 #include <algorithm>
+#include <cstdlib>
 
 using boost::bind;
 
@@ -51,7 +53,7 @@ enum { max_bottled_buffer = 1024 * 1024 };
 
 void http_connection::get(std::string const& url, time_duration timeout, int prio
 	, proxy_settings const* ps, int handle_redirects, std::string const& user_agent
-	, address const& bind_addr)
+	, address const& bind_addr, bool keep_alive)
 {
 	std::string protocol;
 	std::string auth;
@@ -122,7 +124,13 @@ void http_connection::get(std::string const& url, time_duration timeout, int pri
 	if (m_bottled)
 		APPEND_FMT("Accept-Encoding: gzip\r\n");
 
-	APPEND_FMT("Connection: close\r\n\r\n");
+	// a keep-alive connection needs the response to have a
+	// content-length, which bottled responses are read to
+	m_keep_alive = keep_alive && m_bottled;
+	if (m_keep_alive)
+		APPEND_FMT("Connection: keep-alive\r\n\r\n");
+	else
+		APPEND_FMT("Connection: close\r\n\r\n");
 
 	sendbuffer.assign(request);
 	m_url = url;
@@ -148,6 +156,10 @@ void http_connection::start(std::string const& hostname, std::string const& port
 	m_parser.reset();
 	m_recvbuffer.clear();
 	m_read_pos = 0;
+	m_decoding = false;
+	m_body_finished = false;
+	m_inflater.reset();
+	std::vector<char>().swap(m_body);
 	m_priority = prio;
 
 	if (ec)
@@ -159,15 +171,18 @@ void http_connection::start(std::string const& hostname, std::string const& port
 	if (m_sock.is_open() && m_hostname == hostname && m_port == port
 		&& m_ssl == ssl && m_bind_addr == bind_addr)
 	{
+		m_reused = true;
 		async_write(m_sock, asio::buffer(sendbuffer)
 			, bind(&http_connection::on_write, shared_from_this(), _1));
 	}
 	else
 	{
+		m_reused = false;
 		m_ssl = ssl;
 		m_bind_addr = bind_addr;
 		error_code ec;
 		m_sock.close(ec);
+		m_endpoints.clear();
 
 #ifdef TORRENT_USE_OPENSSL
 		if (m_ssl)
@@ -201,9 +216,19 @@ void http_connection::start(std::string const& hostname, std::string const& port
 			}
 		}
 
-		tcp::resolver::query query(hostname, port);
-		m_resolver.async_resolve(query, bind(&http_connection::on_resolve
-			, shared_from_this(), _1, _2));
+		// the cache only knows about host names, the
+		// port has to be a number for it to be used
+		if (m_dns_cache && std::atoi(port.c_str()) > 0)
+		{
+			m_dns_cache->async_resolve(hostname, bind(&http_connection::on_cached_resolve
+				, shared_from_this(), _1, _2));
+		}
+		else
+		{
+			tcp::resolver::query query(hostname, port);
+			m_resolver.async_resolve(query, bind(&http_connection::on_resolve
+				, shared_from_this(), _1, _2));
+		}
 		m_hostname = hostname;
 		m_port = port;
 	}
@@ -283,7 +308,31 @@ void http_connection::on_resolve(error_code const& e
 
 	std::transform(i, tcp::resolver::iterator(), std::back_inserter(m_endpoints)
 		, boost::bind(&tcp::resolver::iterator::value_type::endpoint, _1));
+	on_endpoints();
+}
+
+void http_connection::on_cached_resolve(error_code const& e
+	, std::vector<address> const& addresses)
+{
+	// close() can't cancel a lookup in the shared cache
+	if (m_abort) return;
+	if (e)
+	{
+		callback(e);
+		close();
+		return;
+	}
+	TORRENT_ASSERT(!addresses.empty());
+
+	int port = std::atoi(m_port.c_str());
+	for (std::vector<address>::const_iterator i = addresses.begin()
+		, end(addresses.end()); i != end; ++i)
+		m_endpoints.push_back(tcp::endpoint(*i, port));
+	on_endpoints();
+}
 
+void http_connection::on_endpoints()
+{
 	if (m_filter_handler) m_filter_handler(*this, m_endpoints);
 	if (m_endpoints.empty())
 	{
@@ -358,39 +407,39 @@ void http_connection::callback(error_code const& e, char const* data, int size)
 {
 	if (m_bottled && m_called) return;
 
-	std::vector<char> buf;
-	if (m_bottled && m_parser.header_finished())
-	{
-		std::string const& encoding = m_parser.header("content-encoding");
-		if (encoding == "gzip" || encoding == "x-gzip")
-		{
-			std::string error;
-			if (inflate_gzip(data, size, buf, max_bottled_buffer, error))
-			{
-				if (m_handler) m_handler(asio::error::fault, m_parser, data, size, *this);
-				close();
-				return;
-			}
-			data = &buf[0];
-			size = int(buf.size());
-		}
-	}
 	m_called = true;
 	error_code ec;
 	m_timer.cancel(ec);
 	if (m_handler) m_handler(e, m_parser, data, size, *this);
 }
 
+// called when a reused keep-alive connection turns out to have been
+// closed by the server before it responded. Opens a new connection
+// and sends the request again. Returns false if it's not the case
+bool http_connection::reconnect()
+{
+	if (!m_reused || m_read_pos > 0 || m_decoding || m_abort) return false;
+	error_code ec;
+	m_sock.close(ec);
+	std::string hostname = m_hostname;
+	std::string port = m_port;
+	start(hostname, port, m_timeout, m_priority, 0, m_ssl, m_redirects, m_bind_addr);
+	return true;
+}
+
 void http_connection::on_write(error_code const& e)
 {
 	if (e)
 	{
+		if (reconnect()) return;
 		callback(e);
 		close();
 		return;
 	}
 
-	std::string().swap(sendbuffer);
+	// keep the request around until we know the reused
+	// connection is still alive
+	if (!m_reused) std::string().swap(sendbuffer);
 	m_recvbuffer.resize(4096);
 
 	int amount_to_read = m_recvbuffer.size() - m_read_pos;
@@ -406,8 +455,8 @@ void http_connection::on_write(error_code const& e)
 	}
 	m_sock.async_read_some(asio::buffer(&m_recvbuffer[0] + m_read_pos
 		, amount_to_read)
-		, bind(&http_connection::on_read
-		, shared_from_this(), _1, _2));
+		, make_allocating_handler(bind(&http_connection::on_read
+		, shared_from_this(), _1, _2), m_read_handler_storage));
 }
 
 void http_connection::on_read(error_code const& e
@@ -421,13 +470,28 @@ void http_connection::on_read(error_code const& e
 
 	// when using the asio SSL wrapper, it seems like
 	// we get the shut_down error instead of EOF
+	if ((e == asio::error::eof || e == asio::error::shut_down
+		|| e == asio::error::connection_reset) && reconnect())
+		return;
+
 	if (e == asio::error::eof || e == asio::error::shut_down)
 	{
 		error_code ec = asio::error::eof;
 		TORRENT_ASSERT(bytes_transferred == 0);
 		char const* data = 0;
 		std::size_t size = 0;
-		if (m_bottled && m_parser.header_finished())
+		if (m_decoding)
+		{
+			// a gzip stream that was cut short can't be used
+			if (m_inflater && !m_inflater->finished())
+				ec = asio::error::fault;
+			else if (m_bottled && !m_body.empty())
+			{
+				data = &m_body[0];
+				size = m_body.size();
+			}
+		}
+		else if (m_bottled && m_parser.header_finished())
 		{
 			data = m_parser.get_body().begin;
 			size = m_parser.get_body().left();
@@ -448,7 +512,20 @@ void http_connection::on_read(error_code const& e
 	m_read_pos += bytes_transferred;
 	TORRENT_ASSERT(m_read_pos <= int(m_recvbuffer.size()));
 
-	if (m_bottled || !m_parser.header_finished())
+	if (m_decoding)
+	{
+		// the receive buffer only holds what was just read,
+		// once it's decoded it can be reused
+		if (!decode_body(&m_recvbuffer[0], m_read_pos)) return;
+		m_read_pos = 0;
+		m_last_receive = time_now();
+		if (m_body_finished)
+		{
+			on_body_finished();
+			return;
+		}
+	}
+	else if (m_bottled || !m_parser.header_finished())
 	{
 		libtorrent::buffer::const_interval rcv_buf(&m_recvbuffer[0]
 			, &m_recvbuffer[0] + m_read_pos);
@@ -514,7 +591,28 @@ void http_connection::on_read(error_code const& e
 			m_redirects = 0;
 		}
 
-		if (!m_bottled && m_parser.header_finished())
+		if (m_parser.header_finished())
+		{
+			std::string const& encoding = m_parser.header("content-encoding");
+			if (encoding == "gzip" || encoding == "x-gzip"
+				|| m_parser.header("transfer-encoding") == "chunked")
+				start_decoding();
+		}
+
+		if (m_decoding)
+		{
+			int body_start = m_parser.body_start();
+			if (!decode_body(&m_recvbuffer[0] + body_start, m_read_pos - body_start))
+				return;
+			m_read_pos = 0;
+			m_last_receive = time_now();
+			if (m_body_finished)
+			{
+				on_body_finished();
+				return;
+			}
+		}
+		else if (!m_bottled && m_parser.header_finished())
 		{
 			if (m_read_pos > m_parser.body_start())
 				callback(e, &m_recvbuffer[0] + m_parser.body_start()
@@ -526,7 +624,19 @@ void http_connection::on_read(error_code const& e
 		{
 			error_code ec;
 			m_timer.cancel(ec);
+			// only keep the connection if the server said it would.
+			// The content-length is known, since the response finished
+			if (m_keep_alive)
+			{
+				std::string const& c = m_parser.header("connection");
+				m_keep_alive = string_begins_no_case("keep-alive", c.c_str())
+					&& c.size() == 10;
+			}
+			std::string().swap(sendbuffer);
 			callback(e, m_parser.get_body().begin, m_parser.get_body().left());
+			// leave the connection idle, the next request is
+			// sent on it by calling get() again
+			if (m_keep_alive) return;
 		}
 	}
 	else
@@ -558,8 +668,173 @@ void http_connection::on_read(error_code const& e
 	}
 	m_sock.async_read_some(asio::buffer(&m_recvbuffer[0] + m_read_pos
 		, amount_to_read)
-		, bind(&http_connection::on_read
-		, shared_from_this(), _1, _2));
+		, make_allocating_handler(bind(&http_connection::on_read
+		, shared_from_this(), _1, _2), m_read_handler_storage));
+}
+
+void http_connection::start_decoding()
+{
+	TORRENT_ASSERT(!m_decoding);
+	m_decoding = true;
+	m_body_finished = false;
+	m_chunked = m_parser.header("transfer-encoding") == "chunked";
+	m_chunk_state = chunk_header;
+	m_chunk_left = 0;
+	m_chunk_line.clear();
+	m_body_left = m_chunked ? -1 : m_parser.content_length();
+	if (m_body_left == 0) m_body_finished = true;
+
+	std::string const& encoding = m_parser.header("content-encoding");
+	if (encoding == "gzip" || encoding == "x-gzip")
+		m_inflater.reset(new gzip_inflater);
+	else
+		m_inflater.reset();
+	m_body.clear();
+}
+
+// passes the next part of the body, as it was received, through the
+// chunked transfer encoding. Returns false if the response failed, in
+// which case the handler has been called
+bool http_connection::decode_body(char const* buf, int size)
+{
+	char const* end = buf + size;
+	while (buf != end && !m_body_finished)
+	{
+		if (!m_chunked)
+		{
+			int payload = end - buf;
+			if (m_body_left >= 0 && payload > m_body_left)
+				payload = int(m_body_left);
+			if (!on_payload(buf, payload)) return false;
+			if (m_body_left < 0) return true;
+			m_body_left -= payload;
+			if (m_body_left == 0) m_body_finished = true;
+			return true;
+		}
+
+		if (m_chunk_state == chunk_data)
+		{
+			int payload = int((std::min)(size_type(end - buf), m_chunk_left));
+			if (!on_payload(buf, payload)) return false;
+			buf += payload;
+			m_chunk_left -= payload;
+			if (m_chunk_left == 0) m_chunk_state = chunk_end;
+			continue;
+		}
+
+		// everything else in the chunked encoding is a line
+		char const* newline = std::find(buf, end, '\n');
+		m_chunk_line.append(buf, newline);
+		if (newline == end)
+		{
+			if (m_chunk_line.size() <= 1024) return true;
+			callback(asio::error::fault);
+			close();
+			return false;
+		}
+		buf = newline + 1;
+		if (!m_chunk_line.empty() && m_chunk_line[m_chunk_line.size() - 1] == '\r')
+			m_chunk_line.resize(m_chunk_line.size() - 1);
+
+		switch (m_chunk_state)
+		{
+			case chunk_header:
+			{
+				// the chunk size is in hex, possibly followed by extensions
+				char const* line = m_chunk_line.c_str();
+				char* line_end;
+				m_chunk_left = strtoll(line, &line_end, 16);
+				if (line_end == line || m_chunk_left < 0)
+				{
+					callback(asio::error::fault);
+					close();
+					return false;
+				}
+				m_chunk_state = m_chunk_left == 0 ? chunk_trailer : chunk_data;
+				break;
+			}
+			case chunk_end:
+				// the line ending the chunk's data
+				m_chunk_state = chunk_header;
+				break;
+			case chunk_trailer:
+				// the trailer headers are ignored, it ends
+				// with an empty line
+				if (m_chunk_line.empty()) m_body_finished = true;
+				break;
+			default:
+				TORRENT_ASSERT(false);
+		}
+		m_chunk_line.clear();
+	}
+	return true;
+}
+
+// handles a part of the body once the transfer encoding has been
+// removed. If it's gzipped it's inflated. When bottled, the result is
+// collected in m_body, otherwise it's passed on to the handler
+bool http_connection::on_payload(char const* buf, int size)
+{
+	if (size == 0) return true;
+
+	if (m_inflater)
+	{
+		std::string error;
+		if (m_bottled)
+		{
+			if (!m_inflater->decode(buf, size, m_body, max_bottled_buffer, error))
+				return true;
+		}
+		else
+		{
+			std::vector<char> out;
+			if (!m_inflater->decode(buf, size, out, max_bottled_buffer, error))
+			{
+				if (!out.empty()) callback(error_code(), &out[0], out.size());
+				return true;
+			}
+		}
+		callback(asio::error::fault);
+		close();
+		return false;
+	}
+
+	if (!m_bottled)
+	{
+		callback(error_code(), buf, size);
+		return true;
+	}
+
+	if (int(m_body.size()) + size > max_bottled_buffer)
+	{
+		callback(asio::error::eof);
+		close();
+		return false;
+	}
+	m_body.insert(m_body.end(), buf, buf + size);
+	return true;
+}
+
+void http_connection::on_body_finished()
+{
+	error_code ec;
+	m_timer.cancel(ec);
+	// only keep the connection if the server said it would
+	if (m_keep_alive)
+	{
+		std::string const& c = m_parser.header("connection");
+		m_keep_alive = string_begins_no_case("keep-alive", c.c_str())
+			&& c.size() == 10;
+	}
+	std::string().swap(sendbuffer);
+	if (m_bottled)
+		callback(error_code(), m_body.empty() ? 0 : &m_body[0], m_body.size());
+	else
+		callback(asio::error::eof);
+	// leave the connection idle, the next request is
+	// sent on it by calling get() again
+	if (m_keep_alive) return;
+	close();
 }
 
 void http_connection::on_assign_bandwidth(error_code const& e)
@@ -586,8 +861,8 @@ void http_connection::on_assign_bandwidth(error_code const& e)
 
 	m_sock.async_read_some(asio::buffer(&m_recvbuffer[0] + m_read_pos
 		, amount_to_read)
-		, bind(&http_connection::on_read
-		, shared_from_this(), _1, _2));
+		, make_allocating_handler(bind(&http_connection::on_read
+		, shared_from_this(), _1, _2), m_read_handler_storage));
 
 	error_code ec;
 	m_limiter_timer_active = true;
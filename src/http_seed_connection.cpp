@@ -261,6 +261,28 @@ namespace libtorrent
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
 		TORRENT_ASSERT(t);
 
+		if (has_disk_receive_buffer())
+		{
+			// the rest of the response is received directly into the
+			// disk buffer
+			TORRENT_ASSERT(int(bytes_transferred) <= m_response_left);
+			m_statistics.received_bytes(bytes_transferred, 0);
+			incoming_piece_fragment(bytes_transferred);
+			m_response_left -= bytes_transferred;
+			if (!packet_finished()) return;
+
+			TORRENT_ASSERT(m_response_left == 0);
+			peer_request front_request = m_requests.front();
+			m_requests.pop_front();
+			disk_buffer_holder holder(m_ses, release_disk_receive_buffer());
+			incoming_piece(front_request, holder);
+			if (associated_torrent().expired()) return;
+			reset_recv_buffer(t->block_size() + 1024);
+			m_body_start = 0;
+			m_parser.reset();
+			return;
+		}
+
 		for (;;)
 		{
 			buffer::const_interval recv_buffer = receive_buffer();
@@ -416,7 +438,20 @@ namespace libtorrent
 			// we only received the header, no data
 			if (recv_buffer.left() == 0) break;
 
-			if (recv_buffer.left() < front_request.length) break;
+			if (recv_buffer.left() < front_request.length)
+			{
+				// if the rest of the response is the rest of this
+				// block, receive it directly into a disk buffer rather
+				// than into the receive buffer and then copying it out
+				if (m_response_left > 0
+					&& m_response_left == front_request.length - recv_buffer.left())
+				{
+					cut_receive_buffer(m_body_start, front_request.length);
+					m_body_start = 0;
+					move_to_disk_receive_buffer();
+				}
+				break;
+			}
 
 			m_requests.pop_front();
 			incoming_piece(front_request, recv_buffer.begin);
@@ -54,9 +54,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/http_connection.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/lazy_entry.hpp"
 #include "libtorrent/torrent.hpp"
 #include "libtorrent/io.hpp"
 #include "libtorrent/socket.hpp"
+#include "libtorrent/parse_url.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 
 using namespace libtorrent;
@@ -160,18 +162,45 @@ namespace libtorrent
 			}
 		}
 
-		m_tracker_connection.reset(new http_connection(m_ios, m_cc
-			, boost::bind(&http_tracker_connection::on_response, self(), _1, _2, _3, _4)
-			, true
-			, boost::bind(&http_tracker_connection::on_connect, self(), _1)
-			, boost::bind(&http_tracker_connection::on_filter, self(), _1, _2)));
+		std::string protocol;
+		std::string hostname;
+		int port;
+		using boost::tuples::ignore;
+		boost::tie(protocol, ignore, hostname, port, ignore, ignore)
+			= parse_url_components(url);
+		m_tracker_host = protocol + "://" + hostname + ":" + to_string(port).elems;
+
+		// use an idle connection to this tracker, kept open
+		// from an earlier request, if there is one
+		m_tracker_connection = m_man.get_http_connection(m_tracker_host);
+		bool reused = m_tracker_connection.get() != 0;
+		if (reused)
+		{
+			m_tracker_connection->set_handlers(
+				boost::bind(&http_tracker_connection::on_response, self(), _1, _2, _3, _4)
+				, boost::bind(&http_tracker_connection::on_connect, self(), _1)
+				, boost::bind(&http_tracker_connection::on_filter, self(), _1, _2));
+		}
+		else
+		{
+			m_tracker_connection.reset(new http_connection(m_ios, m_cc
+				, boost::bind(&http_tracker_connection::on_response, self(), _1, _2, _3, _4)
+				, true
+				, boost::bind(&http_tracker_connection::on_connect, self(), _1)
+				, boost::bind(&http_tracker_connection::on_filter, self(), _1, _2)
+				, &m_man.host_resolver()));
+		}
 
 		int timeout = tracker_req().event==tracker_request::stopped
 			?settings.stop_tracker_timeout
 			:settings.tracker_completion_timeout;
 
 		m_tracker_connection->get(url, seconds(timeout)
-			, 1, &m_ps, 5, settings.user_agent, bind_interface());
+			, 1, &m_ps, 5, settings.user_agent, bind_interface(), true);
+
+		// a reused connection is already connected, the connect
+		// handler won't be called
+		if (reused) on_connect(*m_tracker_connection);
 
 		// the url + 100 estimated header size
 		sent_bytes(url.size() + 100);
@@ -253,11 +282,13 @@ namespace libtorrent
 		
 		received_bytes(size + parser.body_start());
 
-		// handle tracker response
-		entry e;
-		e = bdecode(data, data + size);
+		// handle tracker response. The lazy entry refers to the
+		// response buffer instead of copying every string out of it,
+		// which matters for the large peer lists
+		lazy_entry e;
+		int res = lazy_bdecode(data, data + size, e);
 
-		if (e.type() == entry::dictionary_t)
+		if (res == 0 && e.type() == lazy_entry::dict_t)
 		{
 			parse(parser.status_code(), e);
 		}
@@ -272,26 +303,38 @@ namespace libtorrent
 			error_str += "\"";
 			fail(parser.status_code(), error_str.c_str());
 		}
+
+		// if the tracker kept the connection open, hand it back to
+		// the tracker_manager for the next request to this tracker.
+		// This has to wait until the response is parsed, it uses
+		// the connection's endpoints. keep_alive() is only true once
+		// the whole response was received
+		if (!ec && m_tracker_connection
+			&& m_tracker_connection->keep_alive())
+		{
+			m_man.release_http_connection(m_tracker_host, m_tracker_connection);
+			m_tracker_connection.reset();
+		}
 		close();
 	}
 
-	bool http_tracker_connection::extract_peer_info(const entry& info, peer_entry& ret)
+	bool http_tracker_connection::extract_peer_info(lazy_entry const& info, peer_entry& ret)
 	{
 		// extract peer id (if any)
-		if (info.type() != entry::dictionary_t)
+		if (info.type() != lazy_entry::dict_t)
 		{
 			fail(-1, "invalid response from tracker (invalid peer entry)");
 			return false;
 		}
-		entry const* i = info.find_key("peer id");
+		lazy_entry const* i = info.dict_find("peer id");
 		if (i != 0)
 		{
-			if (i->type() != entry::string_t || i->string().length() != 20)
+			if (i->type() != lazy_entry::string_t || i->string_length() != 20)
 			{
 				fail(-1, "invalid response from tracker (invalid peer id)");
 				return false;
 			}
-			std::copy(i->string().begin(), i->string().end(), ret.pid.begin());
+			std::copy(i->string_ptr(), i->string_ptr() + 20, ret.pid.begin());
 		}
 		else
 		{
@@ -300,43 +343,43 @@ namespace libtorrent
 		}
 
 		// extract ip
-		i = info.find_key("ip");
-		if (i == 0 || i->type() != entry::string_t)
+		i = info.dict_find_string("ip");
+		if (i == 0)
 		{
 			fail(-1, "invalid response from tracker");
 			return false;
 		}
-		ret.ip = i->string();
+		ret.ip = i->string_value();
 
 		// extract port
-		i = info.find_key("port");
-		if (i == 0 || i->type() != entry::int_t)
+		i = info.dict_find("port");
+		if (i == 0 || i->type() != lazy_entry::int_t)
 		{
 			fail(-1, "invalid response from tracker");
 			return false;
 		}
-		ret.port = (unsigned short)i->integer();
+		ret.port = (unsigned short)i->int_value();
 
 		return true;
 	}
 
-	void http_tracker_connection::parse(int status_code, entry const& e)
+	void http_tracker_connection::parse(int status_code, lazy_entry const& e)
 	{
 		boost::shared_ptr<request_callback> cb = requester();
 		if (!cb) return;
 
 		// parse the response
-		entry const* failure = e.find_key("failure reason");
-		if (failure && failure->type() == entry::string_t)
+		lazy_entry const* failure = e.dict_find_string("failure reason");
+		if (failure)
 		{
-			fail(status_code, failure->string().c_str());
+			fail(status_code, failure->string_value().c_str());
 			return;
 		}
 
-		entry const* warning = e.find_key("warning message");
-		if (warning && warning->type() == entry::string_t)
+		lazy_entry const* warning = e.dict_find_string("warning message");
+		if (warning)
 		{
-			cb->tracker_warning(tracker_req(), warning->string());
+			cb->tracker_warning(tracker_req(), warning->string_value());
 		}
 
 		std::vector<peer_entry> peer_list;
@@ -345,50 +388,61 @@ namespace libtorrent
 		{
 			std::string ih = tracker_req().info_hash.to_string();
 
-			entry const* files = e.find_key("files");
-			if (files == 0 || files->type() != entry::dictionary_t)
+			lazy_entry const* files = e.dict_find_dict("files");
+			if (files == 0)
 			{
 				fail(-1, "invalid or missing 'files' entry in scrape response");
 				return;
 			}
 
-			entry const* scrape_data = files->find_key(ih);
-			if (scrape_data == 0 || scrape_data->type() != entry::dictionary_t)
+			// the info-hash is binary and may contain zeroes, it
+			// can't be looked up with dict_find()
+			lazy_entry const* scrape_data = 0;
+			for (int i = 0; i < files->dict_size(); ++i)
+			{
+				std::pair<std::string, lazy_entry const*> f = files->dict_at(i);
+				if (f.first != ih) continue;
+				scrape_data = f.second;
+				break;
+			}
+			if (scrape_data == 0 || scrape_data->type() != lazy_entry::dict_t)
 			{
 				fail(-1, "missing or invalid info-hash entry in scrape response");
 				return;
 			}
-			entry const* complete = scrape_data->find_key("complete");
-			entry const* incomplete = scrape_data->find_key("incomplete");
-			entry const* downloaded = scrape_data->find_key("downloaded");
+			lazy_entry const* complete = scrape_data->dict_find("complete");
+			lazy_entry const* incomplete = scrape_data->dict_find("incomplete");
+			lazy_entry const* downloaded = scrape_data->dict_find("downloaded");
 			if (complete == 0 || incomplete == 0 || downloaded == 0
-				|| complete->type() != entry::int_t
-				|| incomplete->type() != entry::int_t
-				|| downloaded->type() != entry::int_t)
+				|| complete->type() != lazy_entry::int_t
+				|| incomplete->type() != lazy_entry::int_t
+				|| downloaded->type() != lazy_entry::int_t)
 			{
 				fail(-1, "missing 'complete' or 'incomplete' entries in scrape response");
 				return;
 			}
-			cb->tracker_scrape_response(tracker_req(), int(complete->integer())
-				, int(incomplete->integer()), int(downloaded->integer()));
+			response_received();
+			cb->tracker_scrape_response(tracker_req(), int(complete->int_value())
+				, int(incomplete->int_value()), int(downloaded->int_value()));
 			return;
 		}
 
-		entry const* interval = e.find_key("interval");
-		if (interval == 0 || interval->type() != entry::int_t)
+		lazy_entry const* interval = e.dict_find("interval");
+		if (interval == 0 || interval->type() != lazy_entry::int_t)
 		{
 			fail(-1, "missing or invalid 'interval' entry in tracker response");
 			return;
 		}
 
-		entry const* peers_ent = e.find_key("peers");
-		if (peers_ent && peers_ent->type() == entry::string_t)
+		lazy_entry const* peers_ent = e.dict_find("peers");
+		if (peers_ent && peers_ent->type() == lazy_entry::string_t)
 		{
-			std::string const& peers = peers_ent->string();
-			for (std::string::const_iterator i = peers.begin();
-				i != peers.end();)
+			char const* i = peers_ent->string_ptr();
+			char const* end = i + peers_ent->string_length();
+			peer_list.reserve((end - i) / 6);
+			while (i != end)
 			{
-				if (std::distance(i, peers.end()) < 6) break;
+				if (end - i < 6) break;
 
 				peer_entry p;
 				p.pid.clear();
@@ -399,13 +453,14 @@ namespace libtorrent
 				peer_list.push_back(p);
 			}
 		}
-		else if (peers_ent && peers_ent->type() == entry::list_t)
+		else if (peers_ent && peers_ent->type() == lazy_entry::list_t)
 		{
-			entry::list_type const& l = peers_ent->list();
-			for(entry::list_type::const_iterator i = l.begin(); i != l.end(); ++i)
+			int len = peers_ent->list_size();
+			peer_list.reserve(len);
+			for (int i = 0; i < len; ++i)
 			{
 				peer_entry p;
-				if (!extract_peer_info(*i, p)) return;
+				if (!extract_peer_info(*peers_ent->list_at(i), p)) return;
 				peer_list.push_back(p);
 			}
 		}
@@ -415,14 +470,14 @@ namespace libtorrent
 		}
 
 #if TORRENT_USE_IPV6
-		entry const* ipv6_peers = e.find_key("peers6");
-		if (ipv6_peers && ipv6_peers->type() == entry::string_t)
+		lazy_entry const* ipv6_peers = e.dict_find_string("peers6");
+		if (ipv6_peers)
 		{
-			std::string const& peers = ipv6_peers->string();
-			for (std::string::const_iterator i = peers.begin();
-				i != peers.end();)
+			char const* i = ipv6_peers->string_ptr();
+			char const* end = i + ipv6_peers->string_length();
+			while (i != end)
 			{
-				if (std::distance(i, peers.end()) < 18) break;
+				if (end - i < 18) break;
 
 				peer_entry p;
 				p.pid.clear();
@@ -438,7 +493,7 @@ namespace libtorrent
 			ipv6_peers = 0;
 		}
 #else
-		entry const* ipv6_peers = 0;
+		lazy_entry const* ipv6_peers = 0;
 #endif
 
 		if (peers_ent == 0 && ipv6_peers == 0)
@@ -453,26 +508,25 @@ namespace libtorrent
 		int incomplete = -1;
 		address external_ip;
 
-		entry const* ip_ent = e.find_key("external ip");
-		if (ip_ent && ip_ent->type() == entry::string_t)
+		lazy_entry const* ip_ent = e.dict_find_string("external ip");
+		if (ip_ent)
 		{
-			std::string const& ip = ip_ent->string();
-			char const* p = &ip[0];
-			if (ip.size() == address_v4::bytes_type::static_size)
+			char const* p = ip_ent->string_ptr();
+			if (ip_ent->string_length() == address_v4::bytes_type::static_size)
 				external_ip = detail::read_v4_address(p);
 #if TORRENT_USE_IPV6
-			else if (ip.size() == address_v6::bytes_type::static_size)
+			else if (ip_ent->string_length() == address_v6::bytes_type::static_size)
 				external_ip = detail::read_v6_address(p);
 #endif
 		}
 		
-		entry const* complete_ent = e.find_key("complete");
-		if (complete_ent && complete_ent->type() == entry::int_t)
-			complete = int(complete_ent->integer());
+		lazy_entry const* complete_ent = e.dict_find("complete");
+		if (complete_ent && complete_ent->type() == lazy_entry::int_t)
+			complete = int(complete_ent->int_value());
 
-		entry const* incomplete_ent = e.find_key("incomplete");
-		if (incomplete_ent && incomplete_ent->type() == entry::int_t)
-			incomplete = int(incomplete_ent->integer());
+		lazy_entry const* incomplete_ent = e.dict_find("incomplete");
+		if (incomplete_ent && incomplete_ent->type() == lazy_entry::int_t)
+			incomplete = int(incomplete_ent->int_value());
 
 		std::list<address> ip_list;
 		std::transform(m_tracker_connection->endpoints().begin()
@@ -480,8 +534,9 @@ namespace libtorrent
 			, std::back_inserter(ip_list)
 			, boost::bind(&tcp::endpoint::address, _1));
 
+		response_received();
 		cb->tracker_response(tracker_req(), m_tracker_ip, ip_list, peer_list
-			, interval->integer(), complete, incomplete, external_ip);
+			, int(interval->int_value()), complete, incomplete, external_ip);
 	}
 
 }
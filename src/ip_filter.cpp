@@ -56,6 +56,52 @@ namespace libtorrent
 			TORRENT_ASSERT(false);
 	}
 
+	void ip_filter::add_rules(std::vector<ip_range<address_v4> > const& rules)
+	{
+		std::vector<ip_range<address_v4::bytes_type> > r;
+		r.reserve(rules.size());
+		for (std::vector<ip_range<address_v4> >::const_iterator i = rules.begin()
+			, end(rules.end()); i != end; ++i)
+		{
+			ip_range<address_v4::bytes_type> e = { i->first.to_bytes()
+				, i->last.to_bytes(), i->flags };
+			r.push_back(e);
+		}
+		m_filter4.add_rules(r);
+	}
+
+#if TORRENT_USE_IPV6
+	void ip_filter::add_rules(std::vector<ip_range<address_v6> > const& rules)
+	{
+		std::vector<ip_range<address_v6::bytes_type> > r;
+		r.reserve(rules.size());
+		for (std::vector<ip_range<address_v6> >::const_iterator i = rules.begin()
+			, end(rules.end()); i != end; ++i)
+		{
+			ip_range<address_v6::bytes_type> e = { i->first.to_bytes()
+				, i->last.to_bytes(), i->flags };
+			r.push_back(e);
+		}
+		m_filter6.add_rules(r);
+	}
+#endif
+
+	void ip_filter::compile()
+	{
+		m_filter4.compile();
+#if TORRENT_USE_IPV6
+		m_filter6.compile();
+#endif
+	}
+
+	void ip_filter::swap(ip_filter& f)
+	{
+		m_filter4.swap(f.m_filter4);
+#if TORRENT_USE_IPV6
+		m_filter6.swap(f.m_filter6);
+#endif
+	}
+
 	int ip_filter::access(address const& addr) const
 	{
 		if (addr.is_v4())
@@ -78,6 +124,17 @@ namespace libtorrent
 			, std::vector<ip_range<address_v6> >());
 #endif
 	}
+
+	ip_filter::filter_tuple_t ip_filter::diff(ip_filter const& old) const
+	{
+#if TORRENT_USE_IPV6
+		return boost::make_tuple(m_filter4.diff<address_v4>(old.m_filter4)
+			, m_filter6.diff<address_v6>(old.m_filter6));
+#else
+		return boost::make_tuple(m_filter4.diff<address_v4>(old.m_filter4)
+			, std::vector<ip_range<address_v6> >());
+#endif
+	}
 	
 	void port_filter::add_rule(boost::uint16_t first, boost::uint16_t last, int flags)
 	{
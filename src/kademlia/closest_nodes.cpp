@@ -66,6 +66,12 @@ void closest_nodes_observer::reply(msg const& in)
 	m_algorithm = 0;
 }
 
+void closest_nodes_observer::short_timeout()
+{
+	if (!m_algorithm) return;
+	m_algorithm->short_timeout(m_self);
+}
+
 void closest_nodes_observer::timeout()
 {
 	if (!m_algorithm) return;
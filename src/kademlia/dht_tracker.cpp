@@ -36,6 +36,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <set>
 #include <numeric>
 #include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <boost/bind.hpp>
 #include <boost/ref.hpp>
 #include <boost/optional.hpp>
@@ -234,6 +237,10 @@ namespace libtorrent { namespace dht
 		send_packet(reply);
 	}
 
+	// the routing table saved by state() is not restored
+	// if it's older than this, in seconds
+	enum { max_routing_table_age = 24 * 60 * 60 };
+
 	void dht_tracker::start(entry const& bootstrap)
 	{
 		std::vector<udp::endpoint> initial_nodes;
@@ -247,6 +254,42 @@ namespace libtorrent { namespace dht
 #endif
 			if (entry const* nodes = bootstrap.find_key("nodes"))
 				read_endpoint_list<udp::endpoint>(nodes, initial_nodes);
+
+			entry const* saved = bootstrap.find_key("saved");
+			entry const* table = bootstrap.find_key("routing-table");
+			if (saved && saved->type() == entry::int_t
+				&& table && table->type() == entry::list_t
+				&& std::time(0) - saved->integer() < max_routing_table_age)
+			{
+				// put the nodes from the last session straight into the
+				// routing table, so lookups don't have to wait for the
+				// bootstrap. They are all pinged in parallel and the
+				// ones that don't respond are removed again
+				entry::list_type const& nodes = table->list();
+				for (entry::list_type::const_iterator i = nodes.begin()
+					, end(nodes.end()); i != end; ++i)
+				{
+					if (i->type() != entry::string_t) continue;
+					std::string const& n = i->string();
+					if (n.size() != 28
+#if TORRENT_USE_IPV6
+						&& n.size() != 40
+#endif
+						) continue;
+					node_id id(n.c_str());
+					std::string::const_iterator in = n.begin() + 20;
+					int rtt = read_uint16(in);
+					udp::endpoint ep = n.size() == 28
+						? read_v4_endpoint<udp::endpoint>(in)
+#if TORRENT_USE_IPV6
+						: read_v6_endpoint<udp::endpoint>(in)
+#else
+						: udp::endpoint()
+#endif
+						;
+					m_dht.restore_node(id, ep, rtt);
+				}
+			}
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -283,6 +326,12 @@ namespace libtorrent { namespace dht
 		m_dht.status(s);
 	}
 
+	void dht_tracker::round_trip_times(latency_histogram& h) const
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		h = m_dht.m_rpc.round_trip_times();
+	}
+
 	void dht_tracker::network_stats(int& sent, int& received)
 	{
 		mutex_t::scoped_lock l(m_mutex);
@@ -414,11 +463,12 @@ namespace libtorrent { namespace dht
 #endif
 	}
 
-	void dht_tracker::announce(sha1_hash const& ih, int listen_port
-		, boost::function<void(std::vector<tcp::endpoint> const&)> f)
+	void dht_tracker::announce(sha1_hash const& ih, int listen_port, bool seed
+		, boost::function<void(std::vector<tcp::endpoint> const&)> f
+		, boost::function<void(int, int)> scrape_f)
 	{
 		mutex_t::scoped_lock l(m_mutex);
-		m_dht.announce(ih, listen_port, f);
+		m_dht.announce(ih, listen_port, seed, f, scrape_f);
 	}
 
 
@@ -430,16 +480,42 @@ namespace libtorrent { namespace dht
 
 	// translate bittorrent kademlia message into the generice kademlia message
 	// used by the library
+	namespace
+	{
+		boost::uint32_t hash_address(address const& a)
+		{
+			boost::uint32_t ret = 0;
+#if TORRENT_USE_IPV6
+			if (a.is_v6())
+			{
+				address_v6::bytes_type b = a.to_v6().to_bytes();
+				for (int i = 0; i < int(b.size()); i += 4)
+				{
+					ret ^= (boost::uint32_t(b[i]) << 24) | (boost::uint32_t(b[i+1]) << 16)
+						| (boost::uint32_t(b[i+2]) << 8) | boost::uint32_t(b[i+3]);
+				}
+			}
+			else
+#endif
+				ret = a.to_v4().to_ulong();
+			// spread the bits, addresses from one network
+			// otherwise end up in neighbouring slots
+			return ret * 2654435761u;
+		}
+	}
+
 	void dht_tracker::on_receive(udp::endpoint const& ep, char const* buf, int bytes_transferred)
 	{
 		mutex_t::scoped_lock l(m_mutex);
 		// account for IP and UDP overhead
 		m_received_bytes += bytes_transferred + (ep.address().is_v6() ? 48 : 28);
 
+		// look at the two slots this address hashes to
 		node_ban_entry* match = 0;
-		node_ban_entry* min = m_ban_nodes;
+		node_ban_entry* min = m_ban_nodes
+			+ ((hash_address(ep.address()) >> 16) & (num_ban_nodes - 2));
 		ptime now = time_now();
-		for (node_ban_entry* i = m_ban_nodes; i < m_ban_nodes + num_ban_nodes; ++i)
+		for (node_ban_entry* i = min, *end(min + 2); i < end; ++i)
 		{
 			if (i->src == ep.address())
 			{
@@ -696,10 +772,23 @@ namespace libtorrent { namespace dht
 				log_line << " token: " << to_hex(m.write_token);
 #endif
 			}
+
+			lazy_entry const* bf = r->dict_find_string("BFsd");
+			if (bf && bf->string_length() == 256)
+				m.bloom_seeds = bf->string_value();
+			bf = r->dict_find_string("BFpe");
+			if (bf && bf->string_length() == 256)
+				m.bloom_downloaders = bf->string_value();
 		}
 		else if (msg_type == 'q')
 		{
+			// read-only nodes don't answer queries. The other
+			// node won't expect an answer since it didn't get
+			// our node id from a reply
+			if (m_settings.read_only) return;
+
 			m.reply = false;
+			m.read_only = e.dict_find_int_value("ro", 0) != 0;
 			lazy_entry const* a = e.dict_find_dict("a");
 			if (!a)
 			{
@@ -774,6 +863,8 @@ namespace libtorrent { namespace dht
 				}
 				std::copy(info_hash->string_ptr(), info_hash->string_ptr()
 					+ info_hash->string_length(), m.info_hash.begin());
+				m.scrape = a->dict_find_int_value("scrape", 0) != 0;
+				m.noseed = a->dict_find_int_value("noseed", 0) != 0;
 				m.message_id = libtorrent::dht::messages::get_peers;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 				log_line << " ih: " << boost::lexical_cast<std::string>(m.info_hash);
@@ -811,6 +902,7 @@ namespace libtorrent { namespace dht
 					return;
 				}
 				m.write_token = token->string_value();
+				m.seed = a->dict_find_int_value("seed", 0) != 0;
 				m.message_id = libtorrent::dht::messages::announce_peer;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 				log_line << " token: " << to_hex(m.write_token);
@@ -902,6 +994,27 @@ namespace libtorrent { namespace dht
 			if (!nodes.list().empty())
 				ret["nodes"] = nodes;
 		}
+		{
+			// the live nodes, with their ids and round trip times,
+			// to restore the routing table from. Each entry is the
+			// node id, the rtt in milliseconds (16 bits) and the
+			// compact endpoint
+			entry table(entry::list_t);
+			for (node_impl::iterator i(m_dht.begin())
+				, end(m_dht.end()); i != end; ++i)
+			{
+				std::string node(i->id.begin(), i->id.end());
+				std::back_insert_iterator<std::string> out(node);
+				write_uint16(i->rtt, out);
+				write_endpoint(udp::endpoint(i->addr, i->port), out);
+				table.list().push_back(entry(node));
+			}
+			if (!table.list().empty())
+			{
+				ret["routing-table"] = table;
+				ret["saved"] = entry::integer_type(std::time(0));
+			}
+		}
 
 		char node_id[41];
 		to_hex((char*)&m_dht.nid()[0], 20, node_id);
@@ -950,54 +1063,85 @@ namespace libtorrent { namespace dht
 
 	namespace
 	{
-		void write_nodes_entry(entry& r, libtorrent::dht::msg const& m)
+		// these write bencoded values straight into the send
+		// buffer. Dictionary keys must be written in sorted order
+		void write_string(std::vector<char>& buf, char const* str, int len)
 		{
-			bool ipv6_nodes = false;
-			entry& n = r["nodes"];
-			std::back_insert_iterator<std::string> out(n.string());
+			char header[20];
+			int header_len = std::sprintf(header, "%d:", len);
+			buf.insert(buf.end(), header, header + header_len);
+			buf.insert(buf.end(), str, str + len);
+		}
+
+		void write_string(std::vector<char>& buf, char const* str)
+		{ write_string(buf, str, int(std::strlen(str))); }
+
+		void write_string(std::vector<char>& buf, std::string const& str)
+		{ write_string(buf, str.c_str(), int(str.size())); }
+
+		void write_string(std::vector<char>& buf, node_id const& id)
+		{ write_string(buf, (char const*)&id[0], node_id::size); }
+
+		void write_int(std::vector<char>& buf, int val)
+		{
+			char str[20];
+			int len = std::sprintf(str, "i%de", val);
+			buf.insert(buf.end(), str, str + len);
+		}
+
+		void write_nodes_entry(std::vector<char>& buf, libtorrent::dht::msg const& m)
+		{
+			int num_v4 = 0;
+			int num_v6 = 0;
 			for (msg::nodes_t::const_iterator i = m.nodes.begin()
 				, end(m.nodes.end()); i != end; ++i)
 			{
-				if (!i->addr.is_v4())
-				{
-					ipv6_nodes = true;
-					continue;
-				}
-				std::copy(i->id.begin(), i->id.end(), out);
+				if (i->addr.is_v4()) ++num_v4;
+				else ++num_v6;
+			}
+
+			write_string(buf, "nodes");
+			char header[20];
+			int header_len = std::sprintf(header, "%d:", num_v4 * (20 + 6));
+			buf.insert(buf.end(), header, header + header_len);
+			std::back_insert_iterator<std::vector<char> > out(buf);
+			for (msg::nodes_t::const_iterator i = m.nodes.begin()
+				, end(m.nodes.end()); i != end; ++i)
+			{
+				if (!i->addr.is_v4()) continue;
+				buf.insert(buf.end(), i->id.begin(), i->id.end());
 				write_endpoint(udp::endpoint(i->addr, i->port), out);
 			}
 
-			if (ipv6_nodes)
+			if (num_v6 == 0) return;
+
+			write_string(buf, "nodes2");
+			buf.push_back('l');
+			for (msg::nodes_t::const_iterator i = m.nodes.begin()
+				, end(m.nodes.end()); i != end; ++i)
 			{
-				entry& p = r["nodes2"];
-				std::string endpoint;
-				for (msg::nodes_t::const_iterator i = m.nodes.begin()
-					, end(m.nodes.end()); i != end; ++i)
-				{
-					if (!i->addr.is_v6()) continue;
-					endpoint.resize(18 + 20);
-					std::string::iterator out = endpoint.begin();
-					std::copy(i->id.begin(), i->id.end(), out);
-					out += 20;
-					write_endpoint(udp::endpoint(i->addr, i->port), out);
-					endpoint.resize(out - endpoint.begin());
-					p.list().push_back(entry(endpoint));
-				}
+				if (!i->addr.is_v6()) continue;
+				char endpoint[18 + 20];
+				char* out = endpoint;
+				std::copy(i->id.begin(), i->id.end(), out);
+				out += 20;
+				write_endpoint(udp::endpoint(i->addr, i->port), out);
+				write_string(buf, endpoint, int(out - endpoint));
 			}
+			buf.push_back('e');
 		}
 	}
 
 	void dht_tracker::send_packet(msg const& m)
 	{
-		using libtorrent::bencode;
-		using libtorrent::entry;
 		int send_flags = 0;
-		entry e(entry::dictionary_t);
 		TORRENT_ASSERT(!m.transaction_id.empty() || m.message_id == messages::error);
-		e["t"] = m.transaction_id;
-		static char const version_str[] = {'L', 'T'
-			, LIBTORRENT_VERSION_MAJOR, LIBTORRENT_VERSION_MINOR};
-		e["v"] = std::string(version_str, version_str + 4);
+
+		// the message is bencoded directly into m_send_buf, which
+		// keeps its capacity between messages. The keys of each
+		// dictionary are written in sorted order: a, e, q, r, ro, t, v, y
+		m_send_buf.clear();
+		m_send_buf.push_back('d');
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 		std::stringstream log_line;
@@ -1005,15 +1149,17 @@ namespace libtorrent { namespace dht
 			<< " t: " << to_hex(m.transaction_id);
 #endif
 
+		char const* type = "q";
 		if (m.message_id == messages::error)
 		{
 			TORRENT_ASSERT(m.reply);
-			e["y"] = "e";
-			entry error_list(entry::list_t);
+			type = "e";
 			TORRENT_ASSERT(m.error_code > 200 && m.error_code <= 204);
-			error_list.list().push_back(entry(m.error_code));
-			error_list.list().push_back(entry(m.error_msg));
-			e["e"] = error_list;
+			write_string(m_send_buf, "e");
+			m_send_buf.push_back('l');
+			write_int(m_send_buf, m.error_code);
+			write_string(m_send_buf, m.error_msg);
+			m_send_buf.push_back('e');
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			log_line << " err: " << m.error_code
 				<< " msg: " << m.error_msg;
@@ -1021,74 +1167,70 @@ namespace libtorrent { namespace dht
 		}
 		else if (m.reply)
 		{
-			e["y"] = "r";
-			e["r"] = entry(entry::dictionary_t);
-			entry& r = e["r"];
-			r["id"] = std::string(m.id.begin(), m.id.end());
-			if (!m.write_token.empty())
+			type = "r";
+			write_string(m_send_buf, "r");
+			m_send_buf.push_back('d');
+			if (!m.bloom_downloaders.empty())
 			{
-			 	r["token"] = m.write_token;
-#ifdef TORRENT_DHT_VERBOSE_LOGGING
-				log_line << " token: " << to_hex(m.write_token);
-#endif
+				write_string(m_send_buf, "BFpe");
+				write_string(m_send_buf, m.bloom_downloaders);
 			}
+			if (!m.bloom_seeds.empty())
+			{
+				write_string(m_send_buf, "BFsd");
+				write_string(m_send_buf, m.bloom_seeds);
+			}
+			write_string(m_send_buf, "id");
+			write_string(m_send_buf, m.id);
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			log_line << " r: " << messages::ids[m.message_id]
 				<< " id: " << m.id;
 #endif
 
-			switch (m.message_id)
+			if (m.message_id == messages::find_node
+				|| m.message_id == messages::get_peers)
+				write_nodes_entry(m_send_buf, m);
+
+			if (!m.write_token.empty())
 			{
-				case messages::ping:
-					break;
-				case messages::find_node:
+				write_string(m_send_buf, "token");
+				write_string(m_send_buf, m.write_token);
+#ifdef TORRENT_DHT_VERBOSE_LOGGING
+				log_line << " token: " << to_hex(m.write_token);
+#endif
+			}
+
+			if (m.message_id == messages::get_peers && !m.peers.empty())
+			{
+				write_string(m_send_buf, "values");
+				m_send_buf.push_back('l');
+				for (msg::peers_t::const_iterator i = m.peers.begin()
+					, end(m.peers.end()); i != end; ++i)
 				{
-					write_nodes_entry(r, m);
-					break;
+					char endpoint[18];
+					char* out = endpoint;
+					write_endpoint(*i, out);
+					write_string(m_send_buf, endpoint, int(out - endpoint));
 				}
-				case messages::get_peers:
-				{
-					write_nodes_entry(r, m);
-
-					if (!m.peers.empty())
-					{
-						r["values"] = entry(entry::list_t);
-						entry& p = r["values"];
-						std::string endpoint;
-						for (msg::peers_t::const_iterator i = m.peers.begin()
-							, end(m.peers.end()); i != end; ++i)
-						{
-							endpoint.resize(18);
-							std::string::iterator out = endpoint.begin();
-							write_endpoint(*i, out);
-							endpoint.resize(out - endpoint.begin());
-							p.list().push_back(entry(endpoint));
-						}
+				m_send_buf.push_back('e');
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-						log_line << " values: " << m.peers.size();
+				log_line << " values: " << m.peers.size();
 #endif
-					}
-					break;
-				}
-
-				case messages::announce_peer:
-					break;
-				break;
 			}
+			m_send_buf.push_back('e');
 		}
 		else
 		{
 			// set bit 1 of send_flags to indicate that
 			// this packet should not be dropped by the
 			// rate limiter.
-			e["y"] = "q";
-			e["a"] = entry(entry::dictionary_t);
-			entry& a = e["a"];
-			a["id"] = std::string(m.id.begin(), m.id.end());
+			write_string(m_send_buf, "a");
+			m_send_buf.push_back('d');
+			write_string(m_send_buf, "id");
+			write_string(m_send_buf, m.id);
 
 			TORRENT_ASSERT(m.message_id <= messages::error);
-			e["q"] = messages::ids[m.message_id];
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			log_line << " q: " << messages::ids[m.message_id]
@@ -1100,7 +1242,8 @@ namespace libtorrent { namespace dht
 				case messages::find_node:
 				{
 					send_flags = 1;
-					a["target"] = std::string(m.info_hash.begin(), m.info_hash.end());
+					write_string(m_send_buf, "target");
+					write_string(m_send_buf, m.info_hash);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					log_line << " target: " << boost::lexical_cast<std::string>(m.info_hash);
 #endif
@@ -1109,7 +1252,18 @@ namespace libtorrent { namespace dht
 				case messages::get_peers:
 				{
 					send_flags = 1;
-					a["info_hash"] = std::string(m.info_hash.begin(), m.info_hash.end());
+					write_string(m_send_buf, "info_hash");
+					write_string(m_send_buf, m.info_hash);
+					if (m.noseed)
+					{
+						write_string(m_send_buf, "noseed");
+						write_int(m_send_buf, 1);
+					}
+					if (m.scrape)
+					{
+						write_string(m_send_buf, "scrape");
+						write_int(m_send_buf, 1);
+					}
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					log_line << " ih: " << boost::lexical_cast<std::string>(m.info_hash);
 #endif
@@ -1117,9 +1271,17 @@ namespace libtorrent { namespace dht
 				}
 				case messages::announce_peer:
 					send_flags = 1;
-					a["port"] = m.port;
-					a["info_hash"] = std::string(m.info_hash.begin(), m.info_hash.end());
-					a["token"] = m.write_token;
+					write_string(m_send_buf, "info_hash");
+					write_string(m_send_buf, m.info_hash);
+					write_string(m_send_buf, "port");
+					write_int(m_send_buf, m.port);
+					if (m.seed)
+					{
+						write_string(m_send_buf, "seed");
+						write_int(m_send_buf, 1);
+					}
+					write_string(m_send_buf, "token");
+					write_string(m_send_buf, m.write_token);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					log_line << " port: " << m.port
 						<< " ih: " << boost::lexical_cast<std::string>(m.info_hash)
@@ -1128,11 +1290,28 @@ namespace libtorrent { namespace dht
 					break;
 				default: break;
 			}
+			m_send_buf.push_back('e');
 
+			write_string(m_send_buf, "q");
+			write_string(m_send_buf, messages::ids[m.message_id]);
 		}
 
-		m_send_buf.clear();
-		bencode(std::back_inserter(m_send_buf), e);
+		if (!m.reply && m_settings.read_only)
+		{
+			write_string(m_send_buf, "ro");
+			write_int(m_send_buf, 1);
+		}
+
+		write_string(m_send_buf, "t");
+		write_string(m_send_buf, m.transaction_id);
+		static char const version_str[] = {'L', 'T'
+			, LIBTORRENT_VERSION_MAJOR, LIBTORRENT_VERSION_MINOR};
+		write_string(m_send_buf, "v");
+		write_string(m_send_buf, version_str, 4);
+		write_string(m_send_buf, "y");
+		write_string(m_send_buf, type);
+		m_send_buf.push_back('e');
+
 		error_code ec;
 		if (m_sock.send(m.addr, &m_send_buf[0], (int)m_send_buf.size(), ec, send_flags))
 		{
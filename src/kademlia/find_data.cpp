@@ -61,6 +61,9 @@ void find_data_observer::reply(msg const& m)
 	if (!m.peers.empty())
 		m_algorithm->got_data(&m);
 
+	if (!m.bloom_seeds.empty() || !m.bloom_downloaders.empty())
+		m_algorithm->got_scrape(m);
+
 	if (!m.nodes.empty())
 	{
 		for (msg::nodes_t::const_iterator i = m.nodes.begin()
@@ -73,6 +76,12 @@ void find_data_observer::reply(msg const& m)
 	m_algorithm = 0;
 }
 
+void find_data_observer::short_timeout()
+{
+	if (!m_algorithm) return;
+	m_algorithm->short_timeout(m_self);
+}
+
 void find_data_observer::timeout()
 {
 	if (!m_algorithm) return;
@@ -85,12 +94,17 @@ find_data::find_data(
 	node_impl& node
 	, node_id target
 	, data_callback const& dcallback
-	, nodes_callback const& ncallback)
+	, nodes_callback const& ncallback
+	, scrape_callback const& scallback
+	, bool noseed)
 	: traversal_algorithm(node, target, node.m_table.begin(), node.m_table.end())
 	, m_data_callback(dcallback)
 	, m_nodes_callback(ncallback)
+	, m_scrape_callback(scallback)
 	, m_target(target)
 	, m_done(false)
+	, m_got_scrape(false)
+	, m_noseed(noseed)
 {
 	boost::intrusive_ptr<find_data> self(this);
 	add_requests();
@@ -124,9 +138,26 @@ void find_data::got_data(msg const* m)
 	m_data_callback(m->peers);
 }
 
+void find_data::got_scrape(msg const& m)
+{
+	// filters of the wrong size are ignored, they can't be merged
+	bloom_filter<256> f;
+	if (f.from_string(m.bloom_seeds.c_str(), m.bloom_seeds.size()))
+	{
+		m_seeds |= f;
+		m_got_scrape = true;
+	}
+	if (f.from_string(m.bloom_downloaders.c_str(), m.bloom_downloaders.size()))
+	{
+		m_downloaders |= f;
+		m_got_scrape = true;
+	}
+}
+
 void find_data::done()
 {
-	if (m_invoke_count != 0) return;
+	if (m_got_scrape && m_scrape_callback)
+		m_scrape_callback(m_seeds.size(), m_downloaders.size());
 
 	std::vector<std::pair<node_entry, std::string> > results;
 	int num_results = m_node.m_table.bucket_size();
@@ -41,6 +41,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/io.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/random_sample.hpp"
+#include "libtorrent/bloom_filter.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 #include "libtorrent/kademlia/node_id.hpp"
@@ -71,23 +72,20 @@ enum { announce_interval = 30 };
 TORRENT_DEFINE_LOG(node)
 #endif
 
-// remove peers that have timed out
-void purge_peers(std::set<peer_entry>& peers)
+// remove peers that have timed out. Returns the number
+// of peers that were removed
+int purge_peers(std::vector<peer_entry>& peers)
 {
-	for (std::set<peer_entry>::iterator i = peers.begin()
-		  , end(peers.end()); i != end;)
-	{
-		// the peer has timed out
-		if (i->added + minutes(int(announce_interval * 1.5f)) < time_now())
-		{
+	ptime cutoff = time_now() - minutes(int(announce_interval * 1.5f));
+	std::vector<peer_entry>::iterator i = std::remove_if(peers.begin()
+		, peers.end(), bind(&peer_entry::added, _1) < cutoff);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-			TORRENT_LOG(node) << "peer timed out at: " << i->addr;
+	for (std::vector<peer_entry>::iterator j = i; j != peers.end(); ++j)
+		TORRENT_LOG(node) << "peer timed out at: " << j->addr;
 #endif
-			peers.erase(i++);
-		}
-		else
-			++i;
-	}
+	int ret = int(peers.end() - i);
+	peers.erase(i, peers.end());
+	return ret;
 }
 
 void nop() {}
@@ -100,7 +98,9 @@ node_impl::node_impl(libtorrent::aux::session_impl& ses
 	, m_id(nid ? *nid : generate_id())
 	, m_table(m_id, 8, settings)
 	, m_rpc(bind(&node_impl::incoming_request, this, _1)
-		, m_id, m_table, f)
+		, m_id, m_table, f, settings)
+	, m_num_peers(0)
+	, m_purge_cursor(0)
 	, m_last_tracker_tick(time_now())
 	, m_ses(ses)
 {
@@ -210,9 +210,11 @@ void node_impl::refresh_bucket(int bucket)
 {
 	TORRENT_ASSERT(bucket >= 0 && bucket < 160);
 	
-	// generate a random node_id within the given bucket
+	// generate a random node_id within the given bucket.
+	// bucket i holds the nodes that share i bits of prefix
+	// with us (the last one also holds every node closer)
 	node_id target = generate_id();
-	int num_bits = 160 - bucket;
+	int num_bits = bucket + 1;
 	node_id mask(0);
 	for (int i = 0; i < num_bits; ++i)
 	{
@@ -232,7 +234,7 @@ void node_impl::refresh_bucket(int bucket)
 	target[(num_bits - 1) / 8] |=
 		(~(m_id[(num_bits - 1) / 8])) & (0x80 >> ((num_bits - 1) % 8));
 
-	TORRENT_ASSERT(distance_exp(m_id, target) == bucket);
+	TORRENT_ASSERT(distance_exp(m_id, target) == 159 - bucket);
 
 	std::vector<node_entry> start;
 	start.reserve(m_table.bucket_size());
@@ -258,7 +260,7 @@ void node_impl::incoming(msg const& m)
 namespace
 {
 	void announce_fun(std::vector<std::pair<node_entry, std::string> > const& v
-		, rpc_manager& rpc, int listen_port, sha1_hash const& ih)
+		, rpc_manager& rpc, int listen_port, sha1_hash const& ih, bool seed)
 	{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 		TORRENT_LOG(node) << "sending announce_peer [ ih: " << ih
@@ -278,7 +280,7 @@ namespace
 			if (ptr == 0) return;
 			rpc.allocator().set_next_size(10);
 			observer_ptr o(new (ptr) announce_observer(
-				rpc.allocator(), ih, listen_port, i->second));
+				rpc.allocator(), ih, listen_port, i->second, seed));
 #ifdef TORRENT_DEBUG
 			o->m_in_constructor = false;
 #endif
@@ -309,24 +311,44 @@ void node_impl::add_node(udp::endpoint node)
 	m_rpc.invoke(messages::ping, node, o);
 }
 
-void node_impl::announce(sha1_hash const& info_hash, int listen_port
-	, boost::function<void(std::vector<tcp::endpoint> const&)> f)
+void node_impl::restore_node(node_id const& id, udp::endpoint const& ep, int rtt)
+{
+	m_table.heard_about(id, ep, rtt);
+
+	void* ptr = m_rpc.allocator().malloc();
+	if (ptr == 0) return;
+	m_rpc.allocator().set_next_size(10);
+	observer_ptr o(new (ptr) verify_observer(m_rpc.allocator(), m_table, id));
+#ifdef TORRENT_DEBUG
+	o->m_in_constructor = false;
+#endif
+	m_rpc.invoke(messages::ping, ep, o);
+}
+
+void node_impl::announce(sha1_hash const& info_hash, int listen_port, bool seed
+	, boost::function<void(std::vector<tcp::endpoint> const&)> f
+	, boost::function<void(int, int)> scrape_f)
 {
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-	TORRENT_LOG(node) << "announcing [ ih: " << info_hash << " p: " << listen_port << " ]" ;
+	TORRENT_LOG(node) << "announcing [ ih: " << info_hash << " p: " << listen_port
+		<< " seed: " << seed << " ]" ;
 #endif
 	// search for nodes with ids close to id or with peers
 	// for info-hash id. then send announce_peer to them.
 	new find_data(*this, info_hash, f, boost::bind(&announce_fun, _1, boost::ref(m_rpc)
-		, listen_port, info_hash));
+		, listen_port, info_hash, seed), scrape_f, seed);
 }
 
 time_duration node_impl::refresh_timeout()
 {
+	// a read-only node doesn't serve other nodes, so it only
+	// needs the nodes it runs into when searching
+	if (m_settings.read_only) return minutes(15);
+
 	int refresh = -1;
 	ptime now = time_now();
 	ptime next = now + minutes(15);
-	for (int i = 0; i < 160; ++i)
+	for (int i = 0; i < m_table.num_active_buckets(); ++i)
 	{
 		ptime r = m_table.next_refresh(i);
 		if (r <= next)
@@ -364,24 +386,35 @@ time_duration node_impl::connection_timeout()
 {
 	time_duration d = m_rpc.tick();
 	ptime now(time_now());
-	if (now - m_last_tracker_tick < minutes(10)) return d;
+	if (m_map.empty())
+	{
+		m_last_tracker_tick = now;
+		return d;
+	}
+
+	// look through the peers of a slice of the torrents and see
+	// if any have timed out. The slice is proportional to the time
+	// since the last purge, so that every torrent is visited once
+	// every 10 minutes without stalling on a sweep of all of them
+	int num_purge = int(size_type(m_map.size())
+		* total_milliseconds(now - m_last_tracker_tick)
+		/ total_milliseconds(minutes(10)));
+	if (num_purge == 0) return d;
 	m_last_tracker_tick = now;
+	if (num_purge > int(m_map.size())) num_purge = int(m_map.size());
 
-	// look through all peers and see if any have timed out
-	for (data_iterator i = begin_data(), end(end_data()); i != end;)
+	table_t::iterator i = m_map.lower_bound(m_purge_cursor);
+	for (; num_purge > 0 && !m_map.empty(); --num_purge)
 	{
-		torrent_entry& t = i->second;
-		node_id const& key = i->first;
-		++i;
-		purge_peers(t.peers);
+		if (i == m_map.end()) i = m_map.begin();
+		m_num_peers -= purge_peers(i->second.peers);
 
 		// if there are no more peers, remove the entry altogether
-		if (t.peers.empty())
-		{
-			table_t::iterator i = m_map.find(key);
-			if (i != m_map.end()) m_map.erase(i);
-		}
+		if (i->second.peers.empty()) m_map.erase(i++);
+		else ++i;
 	}
+	m_purge_cursor = i != m_map.end() ? i->first : node_id(0);
+	TORRENT_ASSERT(m_num_peers >= 0);
 
 	return d;
 }
@@ -405,13 +438,78 @@ void node_impl::on_announce(msg const& m, msg& reply)
 	// the table get a chance to add it.
 	m_table.node_seen(m.id, m.addr);
 
-	torrent_entry& v = m_map[m.info_hash];
+	table_t::iterator ti = m_map.find(m.info_hash);
+	if (ti == m_map.end())
+	{
+		// make room for the new torrent if we're at the limit
+		if (int(m_map.size()) >= m_settings.max_torrents)
+			evict_torrent();
+		ti = m_map.insert(std::make_pair(m.info_hash, torrent_entry())).first;
+	}
+
+	std::vector<peer_entry>& peers = ti->second.peers;
 	peer_entry e;
 	e.addr = tcp::endpoint(m.addr.address(), m.port);
 	e.added = time_now();
-	std::set<peer_entry>::iterator i = v.peers.find(e);
-	if (i != v.peers.end()) v.peers.erase(i++);
-	v.peers.insert(i, e);
+	e.seed = m.seed;
+	std::vector<peer_entry>::iterator i = std::lower_bound(peers.begin()
+		, peers.end(), e);
+	if (i != peers.end() && !(e < *i))
+	{
+		// the peer is already in the list, just
+		// extend its life time
+		i->added = e.added;
+		i->seed = e.seed;
+		return;
+	}
+
+	if (m_num_peers >= m_settings.max_peers)
+	{
+		// evict_peer() never removes torrent entries,
+		// so peers is still valid. i may not be though
+		evict_peer();
+		i = std::lower_bound(peers.begin(), peers.end(), e);
+	}
+	peers.insert(i, e);
+	++m_num_peers;
+}
+
+void node_impl::evict_peer()
+{
+	// the largest torrents give up peers first, so that
+	// a few popular swarms can't push out all the others
+	table_t::iterator largest = m_map.end();
+	std::size_t most = 0;
+	for (table_t::iterator i = m_map.begin(), end(m_map.end()); i != end; ++i)
+	{
+		if (i->second.peers.size() <= most) continue;
+		most = i->second.peers.size();
+		largest = i;
+	}
+	if (largest == m_map.end()) return;
+
+	std::vector<peer_entry>& peers = largest->second.peers;
+	peers.erase(std::min_element(peers.begin(), peers.end()
+		, bind(&peer_entry::added, _1) < bind(&peer_entry::added, _2)));
+	--m_num_peers;
+	// if this left the torrent empty, it's removed when
+	// it's next purged
+}
+
+void node_impl::evict_torrent()
+{
+	table_t::iterator smallest = m_map.end();
+	std::size_t fewest = 0;
+	for (table_t::iterator i = m_map.begin(), end(m_map.end()); i != end; ++i)
+	{
+		if (smallest != m_map.end() && i->second.peers.size() >= fewest) continue;
+		fewest = i->second.peers.size();
+		smallest = i;
+	}
+	if (smallest == m_map.end()) return;
+
+	m_num_peers -= int(smallest->second.peers.size());
+	m_map.erase(smallest);
 }
 
 namespace
@@ -420,6 +518,26 @@ namespace
 	{
 		return p.addr;
 	}
+
+	// the SHA-1 of the address in its compact form, as the
+	// BEP 33 bloom filters use
+	sha1_hash hash_address(address const& a)
+	{
+		hasher h;
+		if (a.is_v4())
+		{
+			address_v4::bytes_type b = a.to_v4().to_bytes();
+			h.update((char const*)&b[0], b.size());
+		}
+#if TORRENT_USE_IPV6
+		else
+		{
+			address_v6::bytes_type b = a.to_v6().to_bytes();
+			h.update((char const*)&b[0], b.size());
+		}
+#endif
+		return h.final();
+	}
 }
 
 void node_impl::status(session_status& s)
@@ -438,7 +556,7 @@ void node_impl::status(session_status& s)
 	}
 }
 
-bool node_impl::on_find(msg const& m, std::vector<tcp::endpoint>& peers) const
+bool node_impl::on_find(msg const& m, msg& reply) const
 {
 	if (m_ses.m_alerts.should_post<dht_get_peers_alert>())
 		m_ses.m_alerts.post_alert(dht_get_peers_alert(m.info_hash));
@@ -447,9 +565,46 @@ bool node_impl::on_find(msg const& m, std::vector<tcp::endpoint>& peers) const
 	if (i == m_map.end()) return false;
 
 	torrent_entry const& v = i->second;
+	std::vector<tcp::endpoint>& peers = reply.peers;
+
+	if (m.scrape)
+	{
+		// BEP 33. Each peer is counted once per IP, which is
+		// what's hashed into the filters
+		bloom_filter<256> seeds;
+		bloom_filter<256> downloaders;
+		for (std::vector<peer_entry>::const_iterator k = v.peers.begin()
+			, end(v.peers.end()); k != end; ++k)
+		{
+			sha1_hash h = hash_address(k->addr.address());
+			if (k->seed) seeds.set(h);
+			else downloaders.set(h);
+		}
+		reply.bloom_seeds = seeds.to_string();
+		reply.bloom_downloaders = downloaders.to_string();
+	}
 
-	int num = (std::min)((int)v.peers.size(), m_settings.max_peers_reply);
 	peers.clear();
+	if (m.noseed)
+	{
+		std::vector<peer_entry const*> candidates;
+		candidates.reserve(v.peers.size());
+		for (std::vector<peer_entry>::const_iterator k = v.peers.begin()
+			, end(v.peers.end()); k != end; ++k)
+			if (!k->seed) candidates.push_back(&*k);
+		int num = (std::min)(int(candidates.size()), m_settings.max_peers_reply);
+		std::vector<peer_entry const*> sample;
+		sample.reserve(num);
+		random_sample_n(candidates.begin(), candidates.end()
+			, std::back_inserter(sample), num);
+		peers.reserve(num);
+		for (std::vector<peer_entry const*>::iterator k = sample.begin()
+			, end(sample.end()); k != end; ++k)
+			peers.push_back((*k)->addr);
+		return true;
+	}
+
+	int num = (std::min)((int)v.peers.size(), m_settings.max_peers_reply);
 	peers.reserve(num);
 	random_sample_n(boost::make_transform_iterator(v.peers.begin(), &get_endpoint)
 		, boost::make_transform_iterator(v.peers.end(), &get_endpoint)
@@ -483,7 +638,7 @@ void node_impl::incoming_request(msg const& m)
 			reply.info_hash = m.info_hash;
 			reply.write_token = generate_token(m);
 			
-			on_find(m, reply.peers);
+			on_find(m, reply);
 			// always return nodes as well as peers
 			m_table.find_node(m.info_hash, reply.nodes, 0);
 /*
@@ -520,7 +675,9 @@ void node_impl::incoming_request(msg const& m)
 		TORRENT_ASSERT(false);
 	};
 
-	m_table.heard_about(m.id, m.addr);
+	// read-only nodes won't answer our queries, there's
+	// no point in having them in the routing table
+	if (!m.read_only) m_table.heard_about(m.id, m.addr);
 	m_rpc.reply(reply);
 }
 
@@ -73,6 +73,12 @@ void refresh_observer::reply(msg const& in)
 	m_algorithm = 0;
 }
 
+void refresh_observer::short_timeout()
+{
+	if (!m_algorithm) return;
+	m_algorithm->short_timeout(m_self);
+}
+
 void refresh_observer::timeout()
 {
 	if (!m_algorithm) return;
@@ -59,13 +59,11 @@ routing_table::routing_table(node_id const& id, int bucket_size
 	: m_bucket_size(bucket_size)
 	, m_settings(settings)
 	, m_id(id)
-	, m_lowest_active_bucket(160)
 {
-	// distribute the refresh times for the buckets in an
-	// attempt to even out the network load
-	for (int i = 0; i < 160; ++i)
-		m_bucket_activity[i] = time_now() - milliseconds(i*5625);
-	m_bucket_activity[0] = time_now() - minutes(15);
+	// the table starts out with a single bucket covering
+	// the whole id space. Refresh it right away
+	m_buckets.resize(1);
+	m_buckets[0].last_active = time_now() - minutes(15);
 }
 
 void routing_table::status(session_status& s) const
@@ -81,24 +79,34 @@ boost::tuple<int, int> routing_table::size() const
 	for (table_t::const_iterator i = m_buckets.begin()
 		, end(m_buckets.end()); i != end; ++i)
 	{
-		nodes += i->first.size();
-		replacements += i->second.size();
+		nodes += i->live_nodes.size();
+		replacements += i->replacements.size();
 	}
 	return boost::make_tuple(nodes, replacements);
 }
 
 size_type routing_table::num_global_nodes() const
 {
-	int first_full = m_lowest_active_bucket;
-	int num_nodes = 1; // we are one of the nodes
-	for (; first_full < 160
-		&& int(m_buckets[first_full].first.size()) < m_bucket_size;
-		++first_full)
+	// the first bucket that isn't full tells us how deep
+	// into the id space the nodes are dense enough to fill
+	// the buckets. Each bucket halves the id space
+	int deepest_bucket = 0;
+	int deepest_size = 0;
+	for (table_t::const_iterator i = m_buckets.begin()
+		, end(m_buckets.end()); i != end; ++i)
 	{
-		num_nodes += m_buckets[first_full].first.size();
+		deepest_size = i->live_nodes.size();
+		if (deepest_size < m_bucket_size) break;
+		++deepest_bucket;
 	}
 
-	return (2 << (160 - first_full)) * num_nodes;
+	if (deepest_bucket == 0) return 1 + deepest_size;
+	if (deepest_bucket > 60) deepest_bucket = 60;
+
+	if (deepest_size < m_bucket_size / 2)
+		return (size_type(1) << deepest_bucket) * m_bucket_size;
+	else
+		return (size_type(2) << deepest_bucket) * deepest_size;
 }
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -111,7 +119,7 @@ void routing_table::print_state(std::ostream& os) const
 		<< "node_id: " << m_id << "\n\n";
 
 	os << "number of nodes per bucket:\n-- live ";
-	for (int i = 8; i < 160; ++i)
+	for (int i = 8; i < int(m_buckets.size()); ++i)
 		os << "-";
 	os << "\n";
 
@@ -120,7 +128,7 @@ void routing_table::print_state(std::ostream& os) const
 		for (table_t::const_iterator i = m_buckets.begin(), end(m_buckets.end());
 			i != end; ++i)
 		{
-			os << (int(i->first.size()) > (7 - k) ? "|" : " ");
+			os << (int(i->live_nodes.size()) > (7 - k) ? "|" : " ");
 		}
 		os << "\n";
 	}
@@ -135,12 +143,12 @@ void routing_table::print_state(std::ostream& os) const
 		for (table_t::const_iterator i = m_buckets.begin(), end(m_buckets.end());
 			i != end; ++i)
 		{
-			os << (int(i->second.size()) > k ? "|" : " ");
+			os << (int(i->replacements.size()) > k ? "|" : " ");
 		}
 		os << "\n";
 	}
 	os << "-- cached ";
-	for (int i = 10; i < 160; ++i)
+	for (int i = 10; i < int(m_buckets.size()); ++i)
 		os << "-";
 	os << "\n\n";
 
@@ -148,19 +156,19 @@ void routing_table::print_state(std::ostream& os) const
 	for (table_t::const_iterator i = m_buckets.begin(), end(m_buckets.end());
 		i != end; ++i)
 	{
-		if (i->first.empty()) continue;
+		if (i->live_nodes.empty()) continue;
 		int bucket_index = int(i - m_buckets.begin());
 		os << "=== BUCKET = " << bucket_index
-			<< " = " << (bucket_index >= m_lowest_active_bucket?"active":"inactive")
-			<< " = " << total_seconds(time_now() - m_bucket_activity[bucket_index])
+			<< " = " << total_seconds(time_now() - i->last_active)
 			<< " seconds ago ===== \n";
-		for (bucket_t::const_iterator j = i->first.begin()
-			, end(i->first.end()); j != end; ++j)
+		for (bucket_t::const_iterator j = i->live_nodes.begin()
+			, end(i->live_nodes.end()); j != end; ++j)
 		{
 			os << " id: " << j->id
 				<< " ip: " << j->ep()
 				<< " fails: " << j->fail_count()
 				<< " pinged: " << j->pinged()
+				<< " rtt: " << j->rtt
 				<< "\n";
 		}
 	}
@@ -170,18 +178,15 @@ void routing_table::print_state(std::ostream& os) const
 
 void routing_table::touch_bucket(int bucket)
 {
-	m_bucket_activity[bucket] = time_now();
+	TORRENT_ASSERT(bucket >= 0 && bucket < int(m_buckets.size()));
+	m_buckets[bucket].last_active = time_now();
 }
 
 ptime routing_table::next_refresh(int bucket)
 {
-	TORRENT_ASSERT(bucket < 160);
+	TORRENT_ASSERT(bucket < int(m_buckets.size()));
 	TORRENT_ASSERT(bucket >= 0);
-	// lower than or equal to since a refresh of bucket 0 will
-	// effectively refresh the lowest active bucket as well
-	if (bucket < m_lowest_active_bucket && bucket > 0)
-		return time_now() + minutes(15);
-	return m_bucket_activity[bucket] + minutes(15);
+	return m_buckets[bucket].last_active + minutes(15);
 }
 
 void routing_table::replacement_cache(bucket_t& nodes) const
@@ -189,18 +194,100 @@ void routing_table::replacement_cache(bucket_t& nodes) const
 	for (table_t::const_iterator i = m_buckets.begin()
 		, end(m_buckets.end()); i != end; ++i)
 	{
-		std::copy(i->second.begin(), i->second.end()
+		std::copy(i->replacements.begin(), i->replacements.end()
 			, std::back_inserter(nodes));
 	}
 }
 
-void routing_table::heard_about(node_id const& id, udp::endpoint const& ep)
+int routing_table::find_bucket(node_id const& id) const
 {
-	int bucket_index = distance_exp(m_id, id);
-	TORRENT_ASSERT(bucket_index < (int)m_buckets.size());
+	int num_buckets = m_buckets.size();
+	// the number of bits of prefix id shares with our id
+	int bucket_index = 159 - distance_exp(m_id, id);
+	if (bucket_index >= num_buckets) bucket_index = num_buckets - 1;
 	TORRENT_ASSERT(bucket_index >= 0);
-	bucket_t& b = m_buckets[bucket_index].first;
-	bucket_t& rb = m_buckets[bucket_index].second;
+	return bucket_index;
+}
+
+namespace
+{
+	// moves nodes from the replacement cache into the bucket
+	// until it's full, preferring nodes that have responded
+	void fill_from_replacements(bucket_t& b, bucket_t& rb, int bucket_size)
+	{
+		while (int(b.size()) < bucket_size && !rb.empty())
+		{
+			bucket_t::iterator i = std::find_if(rb.begin(), rb.end()
+				, bind(&node_entry::pinged, _1) == true);
+			if (i == rb.end()) i = rb.begin();
+			b.push_back(*i);
+			rb.erase(i);
+		}
+	}
+}
+
+void routing_table::split_bucket()
+{
+	TORRENT_ASSERT(m_buckets.size() < 160);
+	int bucket_index = m_buckets.size() - 1;
+
+	m_buckets.push_back(routing_table_node());
+	m_buckets.back().last_active = time_now();
+
+	// the nodes that share more than bucket_index bits of prefix
+	// with us belong in the new bucket
+	bucket_t& b = m_buckets[bucket_index].live_nodes;
+	bucket_t& rb = m_buckets[bucket_index].replacements;
+	bucket_t& new_bucket = m_buckets.back().live_nodes;
+	bucket_t& new_replacements = m_buckets.back().replacements;
+
+	for (bucket_t::iterator j = b.begin(); j != b.end();)
+	{
+		if (distance_exp(m_id, j->id) >= 159 - bucket_index)
+		{
+			++j;
+			continue;
+		}
+		new_bucket.push_back(*j);
+		j = b.erase(j);
+	}
+
+	for (bucket_t::iterator j = rb.begin(); j != rb.end();)
+	{
+		if (distance_exp(m_id, j->id) >= 159 - bucket_index)
+		{
+			++j;
+			continue;
+		}
+		new_replacements.push_back(*j);
+		j = rb.erase(j);
+	}
+
+	fill_from_replacements(b, rb, m_bucket_size);
+	fill_from_replacements(new_bucket, new_replacements, m_bucket_size);
+}
+
+void routing_table::heard_about(node_id const& id, udp::endpoint const& ep
+	, int rtt)
+{
+	// we never keep ourself in the routing table
+	if (id == m_id) return;
+
+	int bucket_index = find_bucket(id);
+
+	// split the last bucket the same way node_seen() does,
+	// otherwise a table restored from a previous session
+	// would collapse into the first few buckets
+	while ((int)m_buckets[bucket_index].live_nodes.size() >= m_bucket_size
+		&& bucket_index == int(m_buckets.size()) - 1
+		&& m_buckets.size() < 160)
+	{
+		split_bucket();
+		bucket_index = find_bucket(id);
+	}
+
+	bucket_t& b = m_buckets[bucket_index].live_nodes;
+	bucket_t& rb = m_buckets[bucket_index].replacements;
 
 	// if the replacement cache is full, we don't
 	// need another node. The table is fine the
@@ -216,33 +303,29 @@ void routing_table::heard_about(node_id const& id, udp::endpoint const& ep)
 
 	if (b.size() < m_bucket_size)
 	{
-		if (bucket_index < m_lowest_active_bucket
-			&& bucket_index > 0)
-			m_lowest_active_bucket = bucket_index;
 		b.push_back(node_entry(id, ep, false));
+		b.back().update_rtt(rtt);
 		return;
 	}
 
 	if (rb.size() < m_bucket_size)
+	{
 		rb.push_back(node_entry(id, ep, false));
+		rb.back().update_rtt(rtt);
+	}
 }
 
 void routing_table::node_failed(node_id const& id)
 {
-	int bucket_index = distance_exp(m_id, id);
-	TORRENT_ASSERT(bucket_index < (int)m_buckets.size());
-	TORRENT_ASSERT(bucket_index >= 0);
-	bucket_t& b = m_buckets[bucket_index].first;
-	bucket_t& rb = m_buckets[bucket_index].second;
+	int bucket_index = find_bucket(id);
+	bucket_t& b = m_buckets[bucket_index].live_nodes;
+	bucket_t& rb = m_buckets[bucket_index].replacements;
 
 	bucket_t::iterator i = std::find_if(b.begin(), b.end()
 		, bind(&node_entry::id, _1) == id);
 
 	if (i == b.end()) return;
 	
-	// if messages to ourself fails, ignore it
-	if (bucket_index == 0) return;
-
 	if (rb.empty())
 	{
 		i->timed_out();
@@ -259,15 +342,7 @@ void routing_table::node_failed(node_id const& id)
 		// if this node has failed too many times, or if this node
 		// has never responded at all, remove it
 		if (i->fail_count() >= m_settings.max_fail_count || !i->pinged())
-		{
 			b.erase(i);
-			TORRENT_ASSERT(m_lowest_active_bucket <= bucket_index);
-			while (m_lowest_active_bucket < 160
-				&& m_buckets[m_lowest_active_bucket].first.empty())
-			{
-				++m_lowest_active_bucket;
-			}
-		}
 		return;
 	}
 
@@ -291,22 +366,26 @@ void routing_table::add_router_node(udp::endpoint router)
 // the return value indicates if the table needs a refresh.
 // if true, the node should refresh the table (i.e. do a find_node
 // on its own id)
-bool routing_table::node_seen(node_id const& id, udp::endpoint addr)
+bool routing_table::node_seen(node_id const& id, udp::endpoint addr, int rtt)
 {
 	if (m_router_nodes.find(addr) != m_router_nodes.end()) return false;
-	int bucket_index = distance_exp(m_id, id);
-	TORRENT_ASSERT(bucket_index < (int)m_buckets.size());
-	TORRENT_ASSERT(bucket_index >= 0);
-	bucket_t& b = m_buckets[bucket_index].first;
-
-	bucket_t::iterator i = std::find_if(b.begin(), b.end()
-		, bind(&node_entry::id, _1) == id);
 
 	bool ret = need_bootstrap();
 
-	//m_bucket_activity[bucket_index] = time_now();
+	// we never keep ourself in the buckets
+	if (id == m_id)
+	{
+		m_self = node_entry(id, addr, true);
+		return ret;
+	}
 
-	if (i != b.end())
+	int bucket_index = find_bucket(id);
+	bucket_t* bp = &m_buckets[bucket_index].live_nodes;
+
+	bucket_t::iterator i = std::find_if(bp->begin(), bp->end()
+		, bind(&node_entry::id, _1) == id);
+
+	if (i != bp->end())
 	{
 		// we already have the node in our bucket
 		// just move it to the back since it was
@@ -314,12 +393,28 @@ bool routing_table::node_seen(node_id const& id, udp::endpoint addr)
 		// in this bucket
 		i->set_pinged();
 		i->reset_fail_count();
+		i->update_rtt(rtt);
 		i->addr = addr.address();
 		i->port = addr.port();
 //		TORRENT_LOG(table) << "updating node: " << id << " " << addr;
 		return ret;
 	}
 
+	// if the node falls in the last bucket, the one covering
+	// our own id, and it's full, split it rather than replacing
+	// or caching nodes. The new node may still end up in the
+	// old bucket, or the nodes may all move to the new one, so
+	// keep splitting until it fits or we run out of bits
+	while ((int)bp->size() >= m_bucket_size
+		&& bucket_index == int(m_buckets.size()) - 1
+		&& m_buckets.size() < 160)
+	{
+		split_bucket();
+		bucket_index = find_bucket(id);
+		bp = &m_buckets[bucket_index].live_nodes;
+	}
+	bucket_t& b = *bp;
+
 	// if the node was not present in our list
 	// we will only insert it if there is room
 	// for it, or if some of our nodes have gone
@@ -328,11 +423,7 @@ bool routing_table::node_seen(node_id const& id, udp::endpoint addr)
 	{
 		if (b.empty()) b.reserve(m_bucket_size);
 		b.push_back(node_entry(id, addr, true));
-		// if bucket index is 0, the node is ourselves
-		// don't updated m_lowest_active_bucket
-		if (bucket_index < m_lowest_active_bucket
-			&& bucket_index > 0)
-			m_lowest_active_bucket = bucket_index;
+		b.back().update_rtt(rtt);
 //		TORRENT_LOG(table) << "inserting node: " << id << " " << addr;
 		return ret;
 	}
@@ -379,7 +470,7 @@ bool routing_table::node_seen(node_id const& id, udp::endpoint addr)
 	// cache this node and wait until some node fails
 	// and then replace it.
 
-	bucket_t& rb = m_buckets[bucket_index].second;
+	bucket_t& rb = m_buckets[bucket_index].replacements;
 
 	i = std::find_if(rb.begin(), rb.end()
 		, bind(&node_entry::id, _1) == id);
@@ -446,6 +537,25 @@ DstIter copy_n(SrcIter begin, SrcIter end, DstIter target, size_t n)
 	return target;
 }
 
+namespace
+{
+	// appends nodes from b to l until l has count nodes
+	void copy_nodes(bucket_t const& b, std::vector<node_entry>& l
+		, int count, int options)
+	{
+		size_t to_copy = count - l.size();
+		if (options & routing_table::include_failed)
+		{
+			copy_n(b.begin(), b.end(), std::back_inserter(l), to_copy);
+		}
+		else
+		{
+			copy_if_n(b.begin(), b.end(), std::back_inserter(l)
+				, to_copy, bind(&node_entry::confirmed, _1));
+		}
+	}
+}
+
 // fills the vector with the k nodes from our buckets that
 // are nearest to the given id.
 void routing_table::find_node(node_id const& target
@@ -455,99 +565,25 @@ void routing_table::find_node(node_id const& target
 	if (count == 0) count = m_bucket_size;
 	l.reserve(count);
 
-	int bucket_index = distance_exp(m_id, target);
-	bucket_t& b = m_buckets[bucket_index].first;
+	int bucket_index = find_bucket(target);
 
-	// copy all nodes that hasn't failed into the target
-	// vector.
-	if (options & include_failed)
+	// the nodes in the target's bucket share the most bits of
+	// prefix with it. All nodes in the buckets after it (closer
+	// to us) differ from the target in the same bit, and the
+	// nodes in the buckets before it are further away, the
+	// further back we go. Stop as soon as we have enough nodes
+	for (int i = bucket_index; i < int(m_buckets.size())
+		&& int(l.size()) < count; ++i)
 	{
-		copy_n(b.begin(), b.end(), std::back_inserter(l)
-			, (std::min)(size_t(count), b.size()));
-	}
-	else
-	{
-		copy_if_n(b.begin(), b.end(), std::back_inserter(l)
-			, (std::min)(size_t(count), b.size())
-			, bind(&node_entry::confirmed, _1));
-	}
-	TORRENT_ASSERT((int)l.size() <= count);
-
-	if (int(l.size()) == count)
-	{
-		TORRENT_ASSERT((options & include_failed)
-			|| std::count_if(l.begin(), l.end()
-			, !boost::bind(&node_entry::confirmed, _1)) == 0);
-		return;
-	}
-
-	// if we didn't have enough nodes in that bucket
-	// we have to reply with nodes from buckets closer
-	// to us. i.e. all the buckets in the range
-	// [0, bucket_index) if we are to include ourself
-	// or [1, bucket_index) if not.
-	bucket_t tmpb;
-	for (int i = (options & include_self)?0:1; i < bucket_index; ++i)
-	{
-		bucket_t& b = m_buckets[i].first;
-		if (options & include_failed)
-		{
-			copy(b.begin(), b.end(), std::back_inserter(tmpb));
-		}
-		else
-		{
-			std::remove_copy_if(b.begin(), b.end(), std::back_inserter(tmpb)
-				, !bind(&node_entry::confirmed, _1));
-		}
+		copy_nodes(m_buckets[i].live_nodes, l, count, options);
 	}
 
-	if (count - l.size() < tmpb.size())
-	{
-		std::random_shuffle(tmpb.begin(), tmpb.end());
-		size_t to_copy = count - l.size();
-		std::copy(tmpb.begin(), tmpb.begin() + to_copy, std::back_inserter(l));
-	}
-	else
-	{
-		std::copy(tmpb.begin(), tmpb.end(), std::back_inserter(l));
-	}
-		
-	TORRENT_ASSERT((int)l.size() <= count);
+	for (int i = bucket_index - 1; i >= 0 && int(l.size()) < count; --i)
+		copy_nodes(m_buckets[i].live_nodes, l, count, options);
 
-	// return if we have enough nodes or if the bucket index
-	// is the biggest index available (there are no more buckets)
-	// to look in.
-	if (int(l.size()) == count)
-	{
-		TORRENT_ASSERT((options & include_failed)
-			|| std::count_if(l.begin(), l.end()
-				, !boost::bind(&node_entry::confirmed, _1)) == 0);
-		return;
-	}
+	if ((options & include_self) && m_self && int(l.size()) < count)
+		l.push_back(*m_self);
 
-	for (size_t i = bucket_index + 1; i < m_buckets.size(); ++i)
-	{
-		bucket_t& b = m_buckets[i].first;
-	
-		size_t to_copy = (std::min)(count - l.size(), b.size());
-		if (options & include_failed)
-		{
-			copy_n(b.begin(), b.end(), std::back_inserter(l), to_copy);
-		}
-		else
-		{
-			copy_if_n(b.begin(), b.end(), std::back_inserter(l)
-				, to_copy, bind(&node_entry::confirmed, _1));
-		}
-		TORRENT_ASSERT((int)l.size() <= count);
-		if (int(l.size()) == count)
-		{
-			TORRENT_ASSERT((options & include_failed)
-				|| std::count_if(l.begin(), l.end()
-					, !boost::bind(&node_entry::confirmed, _1)) == 0);
-			return;
-		}
-	}
 	TORRENT_ASSERT((int)l.size() <= count);
 
 	TORRENT_ASSERT((options & include_failed)
@@ -557,8 +593,7 @@ void routing_table::find_node(node_id const& target
 
 routing_table::iterator routing_table::begin() const
 {
-	// +1 to avoid ourself
-	return iterator(m_buckets.begin() + 1, m_buckets.end());
+	return iterator(m_buckets.begin(), m_buckets.end());
 }
 
 routing_table::iterator routing_table::end() const
@@ -44,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libtorrent/io.hpp>
 #include <libtorrent/invariant_check.hpp>
 #include <libtorrent/kademlia/rpc_manager.hpp>
+#include <libtorrent/session_settings.hpp>
 #include <libtorrent/kademlia/logging.hpp>
 #include <libtorrent/kademlia/routing_table.hpp>
 #include <libtorrent/kademlia/find_data.hpp>
@@ -95,6 +96,7 @@ typedef mpl::vector<
 	, announce_observer
 	, refresh_observer
 	, ping_observer
+	, verify_observer
 	, null_observer
 	> observer_types;
 
@@ -103,8 +105,10 @@ typedef mpl::max_element<
     >::type max_observer_type_iter;
 
 rpc_manager::rpc_manager(fun const& f, node_id const& our_id
-	, routing_table& table, send_fun const& sf)
+	, routing_table& table, send_fun const& sf
+	, dht_settings const& settings)
 	: m_pool_allocator(sizeof(mpl::deref<max_observer_type_iter::base>::type), 10)
+	, m_outstanding(0)
 	, m_next_transaction_id(std::rand() % max_transactions)
 	, m_oldest_transaction_id(m_next_transaction_id)
 	, m_incoming(f)
@@ -113,7 +117,9 @@ rpc_manager::rpc_manager(fun const& f, node_id const& our_id
 	, m_table(table)
 	, m_timer(time_now())
 	, m_random_number(generate_id())
+	, m_settings(settings)
 	, m_destructing(false)
+	, m_avg_rtt(1000)
 {
 	std::srand(time(0));
 
@@ -137,6 +143,10 @@ rpc_manager::~rpc_manager()
 #endif
 	std::for_each(m_aborted_transactions.begin(), m_aborted_transactions.end()
 		, bind(&observer::abort, _1));
+
+	for (std::deque<deferred_rpc>::iterator i = m_deferred.begin()
+		, end(m_deferred.end()); i != end; ++i)
+		i->o->abort();
 	
 	for (transactions_t::iterator i = m_transactions.begin()
 		, end(m_transactions.end()); i != end; ++i)
@@ -165,6 +175,9 @@ void rpc_manager::check_invariant() const
 	{
 		TORRENT_ASSERT(!m_transactions[i]);
 	}
+
+	TORRENT_ASSERT(m_outstanding == std::count_if(m_transactions.begin()
+		, m_transactions.end(), bind(&observer_ptr::get, _1) != (observer*)0));
 }
 #endif
 
@@ -187,6 +200,7 @@ void rpc_manager::unreachable(udp::endpoint const& ep)
 		if (o->target_ep() != ep) continue;
 		observer_ptr ptr = m_transactions[tid];
 		m_transactions[tid] = 0;
+		--m_outstanding;
 		if (tid == m_oldest_transaction_id)
 		{
 			++m_oldest_transaction_id;
@@ -197,6 +211,7 @@ void rpc_manager::unreachable(udp::endpoint const& ep)
 		TORRENT_LOG(rpc) << "  found transaction [ tid: " << tid << " ]";
 #endif
 		ptr->timeout();
+		send_deferred();
 		return;
 	}
 }
@@ -280,9 +295,17 @@ bool rpc_manager::incoming(msg const& m)
 		TORRENT_LOG(rpc) << "Reply with transaction id: " 
 			<< tid << " from " << m.addr;
 #endif
+		time_duration round_trip = time_now_coarse() - o->sent;
+		m_rtt.add(round_trip);
+		int rtt = int(total_milliseconds(round_trip));
+		m_avg_rtt = (m_avg_rtt * 7 + rtt) / 8;
+
 		o->reply(m);
 		m_transactions[tid] = 0;
-		return m_table.node_seen(m.id, m.addr);
+		--m_outstanding;
+		bool ret = m_table.node_seen(m.id, m.addr, rtt);
+		send_deferred();
+		return ret;
 	}
 	else
 	{
@@ -336,6 +359,7 @@ time_duration rpc_manager::tick()
 		{
 #endif
 			m_transactions[m_oldest_transaction_id] = 0;
+			--m_outstanding;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			TORRENT_LOG(rpc) << "Timing out transaction id: " 
 				<< m_oldest_transaction_id << " from " << o->target_ep();
@@ -348,6 +372,33 @@ time_duration rpc_manager::tick()
 	
 	std::for_each(timeouts.begin(), timeouts.end(), bind(&observer::timeout, _1));
 	timeouts.clear();
+
+	// requests that have been outstanding for a few round trip
+	// times are unlikely to get a reply soon. Tell the lookups
+	// so they can send another request in the meantime
+	time_duration short_timeout = milliseconds(
+		(std::min)((std::max)(m_avg_rtt * 3, 500), 3000));
+	ptime now = time_now();
+	for (int tid = m_oldest_transaction_id; tid != m_next_transaction_id;
+		tid = (tid + 1) % max_transactions)
+	{
+		observer_ptr const& o = m_transactions[tid];
+		if (!o) continue;
+		time_duration diff = o->sent + short_timeout - now;
+		if (diff > seconds(0))
+		{
+			if (diff < milliseconds(100)) diff = milliseconds(100);
+			if (diff < ret) ret = diff;
+			break;
+		}
+		if (o->short_timed_out) continue;
+		o->short_timed_out = true;
+		timeouts.push_back(o);
+	}
+
+	std::for_each(timeouts.begin(), timeouts.end(), bind(&observer::short_timeout, _1));
+
+	send_deferred();
 	
 	// clear the aborted transactions, will likely
 	// generate new requests. We need to swap, since the
@@ -375,10 +426,12 @@ unsigned int rpc_manager::new_transaction_id(observer_ptr o)
 			<< " " << total_seconds(time_now() - o->sent) << " seconds ago";
 #endif
 		m_transactions[m_next_transaction_id] = 0;
+		--m_outstanding;
 		TORRENT_ASSERT(m_oldest_transaction_id == m_next_transaction_id);
 	}
 	TORRENT_ASSERT(!m_transactions[tid]);
 	m_transactions[tid] = o;
+	++m_outstanding;
 	if (m_oldest_transaction_id == m_next_transaction_id)
 	{
 		m_oldest_transaction_id = (m_oldest_transaction_id + 1) % max_transactions;
@@ -406,6 +459,27 @@ void rpc_manager::update_oldest_transaction_id()
 	}
 }
 
+bool rpc_manager::can_send() const
+{
+	int limit = (std::min)(m_settings.max_outstanding_requests
+		, int(max_transactions) - 1);
+	if (limit < 1) limit = 1;
+	// the slot after the next transaction id must be free,
+	// otherwise sending would abort the oldest transaction
+	return m_outstanding < limit
+		&& !m_transactions[(m_next_transaction_id + 1) % max_transactions];
+}
+
+void rpc_manager::send_deferred()
+{
+	while (!m_deferred.empty() && can_send() && !m_destructing)
+	{
+		deferred_rpc r = m_deferred.front();
+		m_deferred.pop_front();
+		send_rpc(r.message_id, r.target, r.o);
+	}
+}
+
 void rpc_manager::invoke(int message_id, udp::endpoint target_addr
 	, observer_ptr o)
 {
@@ -417,6 +491,36 @@ void rpc_manager::invoke(int message_id, udp::endpoint target_addr
 		return;
 	}
 
+	if (!can_send() || !m_deferred.empty())
+	{
+		if (int(m_deferred.size()) >= max_transactions)
+		{
+			// the queue is full too. Drop the request the way a
+			// request that can't get a transaction id is dropped,
+			// when its observer is released it reports a failure
+			m_aborted_transactions.push_back(o);
+			return;
+		}
+#ifdef TORRENT_DHT_VERBOSE_LOGGING
+		TORRENT_LOG(rpc) << "Deferring " << messages::ids[message_id]
+			<< " -> " << target_addr << " queue: " << m_deferred.size();
+#endif
+		deferred_rpc r;
+		r.message_id = message_id;
+		r.target = target_addr;
+		r.o = o;
+		m_deferred.push_back(r);
+		return;
+	}
+
+	send_rpc(message_id, target_addr, o);
+}
+
+void rpc_manager::send_rpc(int message_id, udp::endpoint target_addr
+	, observer_ptr o)
+{
+	INVARIANT_CHECK;
+
 	msg m;
 	m.message_id = message_id;
 	m.reply = false;
@@ -436,7 +540,7 @@ void rpc_manager::invoke(int message_id, udp::endpoint target_addr
 		
 		o->send(m);
 
-		o->sent = time_now();
+		o->sent = time_now_coarse();
 #if TORRENT_USE_IPV6
 		o->target_addr = target_addr.address();
 #else
@@ -98,10 +98,56 @@ void traversal_algorithm::traverse(node_id const& id, udp::endpoint addr)
 
 void traversal_algorithm::finished(node_id const& id)
 {
+	std::vector<result>::iterator i = std::find_if(m_results.begin()
+		, m_results.end(), bind(&result::id, _1) == id);
+
+	if (i != m_results.end())
+	{
+		// a node that was given up on and then responded
+		// gives back the extra request slot it caused
+		if (i->flags & result::short_timeout) --m_branch_factor;
+		i->flags |= result::alive;
+	}
+
 	++m_responses;
 	--m_invoke_count;
 	add_requests();
-	if (m_invoke_count == 0) done();
+	if (m_invoke_count == 0 || closest_nodes_responded()) finish();
+}
+
+void traversal_algorithm::short_timeout(node_id const& id)
+{
+	std::vector<result>::iterator i = std::find_if(m_results.begin()
+		, m_results.end(), bind(&result::id, _1) == id);
+
+	if (i == m_results.end() || (i->flags & result::short_timeout)) return;
+
+#ifdef TORRENT_DHT_VERBOSE_LOGGING
+	TORRENT_LOG(traversal) << "short timeout: " << i->id << " " << i->addr;
+#endif
+	// open up another request slot while
+	// we're waiting for this node
+	i->flags |= result::short_timeout;
+	++m_branch_factor;
+	add_requests();
+}
+
+bool traversal_algorithm::closest_nodes_responded()
+{
+	if (m_results.empty()) return false;
+	for (std::vector<result>::iterator i = m_results.begin()
+		, end(last_iterator()); i != end; ++i)
+	{
+		if ((i->flags & result::alive) == 0) return false;
+	}
+	return true;
+}
+
+void traversal_algorithm::finish()
+{
+	if (m_done) return;
+	m_done = true;
+	done();
 }
 
 // prevent request means that the total number of requests has
@@ -135,6 +181,7 @@ void traversal_algorithm::failed(node_id const& id, bool prevent_request)
 		// node ids that we just generated ourself
 		if ((i->flags & result::no_id) == 0)
 			m_node.m_table.node_failed(id);
+		if (i->flags & result::short_timeout) --m_branch_factor;
 		m_results.erase(i);
 		++m_timeouts;
 	}
@@ -144,7 +191,7 @@ void traversal_algorithm::failed(node_id const& id, bool prevent_request)
 		if (m_branch_factor <= 0) m_branch_factor = 1;
 	}
 	add_requests();
-	if (m_invoke_count == 0) done();
+	if (m_invoke_count == 0 || closest_nodes_responded()) finish();
 }
 
 namespace
@@ -157,6 +204,10 @@ namespace
 
 void traversal_algorithm::add_requests()
 {
+	// once we're done, outstanding replies
+	// don't spawn new requests
+	if (m_done) return;
+
 	while (m_invoke_count < m_branch_factor)
 	{
 		// Find the first node that hasn't already been queried.
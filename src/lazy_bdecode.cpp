@@ -33,6 +33,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/lazy_entry.hpp"
 #include "libtorrent/escape_string.hpp"
 #include <cstring>
+#include <new>
+#include <algorithm>
 
 #if TORRENT_USE_IOSTREAM
 #include <iostream>
@@ -69,14 +71,153 @@ namespace libtorrent
 		return start;
 	}
 
+	// returns end if the delimiter isn't found. memchr() is vectorized
+	// on every libc we care about, which makes this a lot cheaper than
+	// a byte by byte loop for long integers and strings
 	char const* find_char(char const* start, char const* end, char delimiter)
 	{
-		while (start < end && *start != delimiter) ++start;
-		return start;
+		if (start >= end) return end;
+		char const* ret = static_cast<char const*>(
+			std::memchr(start, delimiter, end - start));
+		return ret ? ret : end;
+	}
+
+	lazy_entry_arena::lazy_entry_arena(int block_size)
+		: m_block_size(block_size)
+		, m_ptr(0)
+		, m_end(0)
+	{}
+
+	lazy_entry_arena::~lazy_entry_arena()
+	{
+		for (std::vector<char*>::iterator i = m_blocks.begin()
+			, end(m_blocks.end()); i != end; ++i)
+			delete[] *i;
+	}
+
+	void* lazy_entry_arena::allocate(int bytes)
+	{
+		// keep everything pointer aligned
+		bytes = (bytes + sizeof(void*) - 1) & ~int(sizeof(void*) - 1);
+		if (m_end - m_ptr < bytes)
+		{
+			int size = (std::max)(bytes, m_block_size);
+			char* b = new (std::nothrow) char[size];
+			if (b == 0) return 0;
+			m_blocks.push_back(b);
+			m_ptr = b;
+			m_end = b + size;
+		}
+		void* ret = m_ptr;
+		m_ptr += bytes;
+		return ret;
+	}
+
+	void lazy_entry_arena::reset()
+	{
+		if (m_blocks.empty()) return;
+		for (std::vector<char*>::iterator i = m_blocks.begin() + 1
+			, end(m_blocks.end()); i != end; ++i)
+			delete[] *i;
+		m_blocks.resize(1);
+		m_ptr = m_blocks[0];
+		// the first block may have been allocated for a large
+		// request, but it's at least the block size
+		m_end = m_ptr + m_block_size;
+	}
+
+	namespace
+	{
+		int bdecode_impl(char const* start, char const* end, lazy_entry& ret
+			, lazy_entry_arena* arena, int depth_limit);
 	}
 
 	// return 0 = success
 	int lazy_bdecode(char const* start, char const* end, lazy_entry& ret, int depth_limit)
+	{
+		return bdecode_impl(start, end, ret, 0, depth_limit);
+	}
+
+	int lazy_bdecode(char const* start, char const* end, lazy_entry& ret
+		, lazy_entry_arena& arena, int depth_limit)
+	{
+		return bdecode_impl(start, end, ret, &arena, depth_limit);
+	}
+
+	// return 0 = success
+	int lazy_bdecode_validate(char const* start, char const* end, int depth_limit)
+	{
+		if (start >= end) return -1;
+
+		// one entry per open container. 'l' for lists, 'd' for a dict
+		// expecting a key and 'v' for a dict expecting a value
+		std::vector<char> stack;
+
+		do
+		{
+			if (int(stack.size()) > depth_limit) return -1;
+			char t = *start;
+
+			if (!stack.empty())
+			{
+				char& top = stack.back();
+				if (t == 'e' && top != 'v')
+				{
+					stack.pop_back();
+					++start;
+					if (!stack.empty() && stack.back() == 'v') stack.back() = 'd';
+					continue;
+				}
+				// dictionary keys must be strings
+				if (top == 'd' && !is_digit(t)) return -1;
+			}
+
+			switch (t)
+			{
+				case 'd':
+				case 'l':
+					stack.push_back(t);
+					++start;
+					continue;
+				case 'i':
+				{
+					++start;
+					char const* int_end = find_char(start, end, 'e');
+					if (int_end == end) return -1;
+					if (start < int_end && *start == '-') ++start;
+					if (start == int_end) return -1;
+					for (; start < int_end; ++start)
+						if (!is_digit(*start)) return -1;
+					++start;
+					break;
+				}
+				default:
+				{
+					if (!is_digit(t)) return -1;
+					boost::int64_t len = 0;
+					start = parse_int(start, end, ':', len);
+					if (start == 0 || start == end || end - start - 1 < len) return -1;
+					start += len + 1;
+					break;
+				}
+			}
+
+			// a primitive was consumed, or a key in a dict
+			if (!stack.empty())
+			{
+				char& top = stack.back();
+				if (top == 'd') top = 'v';
+				else if (top == 'v') top = 'd';
+			}
+		} while (!stack.empty() && start < end);
+
+		return stack.empty() ? 0 : -1;
+	}
+
+	namespace {
+
+	int bdecode_impl(char const* start, char const* end, lazy_entry& ret
+		, lazy_entry_arena* arena, int depth_limit)
 	{
 		ret.clear();
 		if (start == end) return 0;
@@ -111,7 +252,7 @@ namespace libtorrent
 					if (start == 0 || start + len + 3 > end || *start != ':') return fail_bdecode(ret);
 					++start;
 					if (start == end) fail_bdecode(ret);
-					lazy_entry* ent = top->dict_append(start);
+					lazy_entry* ent = top->dict_append(start, arena);
 					start += len;
 					if (start >= end) fail_bdecode(ret);
 					stack.push_back(ent);
@@ -127,7 +268,7 @@ namespace libtorrent
 						stack.pop_back();
 						continue;
 					}
-					lazy_entry* ent = top->list_append();
+					lazy_entry* ent = top->list_append(arena);
 					stack.push_back(ent);
 					break;
 				}
@@ -173,6 +314,8 @@ namespace libtorrent
 		return 0;
 	}
 
+	} // anonymous namespace
+
 	size_type lazy_entry::int_value() const
 	{
 		TORRENT_ASSERT(m_type == int_t);
@@ -184,10 +327,31 @@ namespace libtorrent
 		return val;
 	}
 
-	lazy_entry* lazy_entry::dict_append(char const* name)
+	lazy_entry* lazy_entry::dict_append(char const* name, lazy_entry_arena* arena)
 	{
 		TORRENT_ASSERT(m_type == dict_t);
 		TORRENT_ASSERT(m_size <= m_capacity);
+		typedef std::pair<char const*, lazy_entry> item_t;
+		if (arena && (m_capacity == 0 || m_in_arena))
+		{
+			if (m_size == m_capacity)
+			{
+				// the old array is left in the arena, it's
+				// freed along with everything else
+				int capacity = m_capacity == 0 ? lazy_entry_dict_init
+					: int(m_capacity * lazy_entry_grow_factor);
+				item_t* tmp = static_cast<item_t*>(arena->allocate(sizeof(item_t) * capacity));
+				if (tmp == 0) return 0;
+				if (m_size > 0) std::memcpy(tmp, m_data.dict, sizeof(item_t) * m_size);
+				m_data.dict = tmp;
+				m_capacity = capacity;
+				m_in_arena = true;
+			}
+			item_t* ret = new (m_data.dict + m_size++) item_t;
+			ret->first = name;
+			return &ret->second;
+		}
+
 		if (m_capacity == 0)
 		{
 			int capacity = lazy_entry_dict_init;
@@ -304,10 +468,26 @@ namespace libtorrent
 		return 0;
 	}
 
-	lazy_entry* lazy_entry::list_append()
+	lazy_entry* lazy_entry::list_append(lazy_entry_arena* arena)
 	{
 		TORRENT_ASSERT(m_type == list_t);
 		TORRENT_ASSERT(m_size <= m_capacity);
+		if (arena && (m_capacity == 0 || m_in_arena))
+		{
+			if (m_size == m_capacity)
+			{
+				int capacity = m_capacity == 0 ? lazy_entry_list_init
+					: int(m_capacity * lazy_entry_grow_factor);
+				lazy_entry* tmp = static_cast<lazy_entry*>(arena->allocate(sizeof(lazy_entry) * capacity));
+				if (tmp == 0) return 0;
+				if (m_size > 0) std::memcpy(tmp, m_data.list, sizeof(lazy_entry) * m_size);
+				m_data.list = tmp;
+				m_capacity = capacity;
+				m_in_arena = true;
+			}
+			return new (m_data.list + m_size++) lazy_entry;
+		}
+
 		if (m_capacity == 0)
 		{
 			int capacity = lazy_entry_list_init;
@@ -347,16 +527,20 @@ namespace libtorrent
 
 	void lazy_entry::clear()
 	{
-		switch (m_type)
+		if (!m_in_arena)
 		{
-			case list_t: delete[] m_data.list; break;
-			case dict_t: delete[] m_data.dict; break;
-			default: break;
+			switch (m_type)
+			{
+				case list_t: delete[] m_data.list; break;
+				case dict_t: delete[] m_data.dict; break;
+				default: break;
+			}
 		}
 		m_data.start = 0;
 		m_size = 0;
 		m_capacity = 0;
 		m_type = none_t;
+		m_in_arena = false;
 	}
 
 	std::pair<char const*, int> lazy_entry::data_section() const
@@ -78,6 +78,16 @@ namespace
 			m_file << time_now_string() << ": ";
 		}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << choke_hook) | (1 << unchoke_hook)
+				| (1 << interested_hook) | (1 << not_interested_hook)
+				| (1 << have_hook) | (1 << request_hook)
+				| (1 << cancel_hook) | (1 << extended_hook)
+				| (1 << unknown_message_hook) | (1 << piece_pass_hook)
+				| (1 << piece_failed_hook);
+		}
+
 		// can add entries to the extension handshake
 		virtual void add_handshake(entry&) {}
 		
@@ -209,6 +219,11 @@ namespace
 
 	struct logger_plugin : torrent_plugin
 	{
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << new_connection_hook);
+		}
+
 		virtual boost::shared_ptr<peer_plugin> new_connection(
 			peer_connection* pc)
 		{
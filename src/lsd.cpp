@@ -67,6 +67,8 @@ lsd::lsd(io_service& ios, address const& listen_interface
 	, peer_callback_t const& cb)
 	: m_callback(cb)
 	, m_retry_count(1)
+	, m_listen_port(0)
+	, m_timer_armed(false)
 	, m_socket(ios, udp::endpoint(address_v4::from_string("239.192.152.143", ec), 6771)
 		, bind(&lsd::on_announce, self(), _1, _2, _3))
 	, m_broadcast_timer(ios)
@@ -79,52 +81,90 @@ lsd::lsd(io_service& ios, address const& listen_interface
 
 lsd::~lsd() {}
 
+namespace
+{
+	// a message carrying this many info-hashes still fits
+	// in a single unfragmented datagram
+	enum { max_hashes_per_message = 25 };
+
+	// the site-wide rate limit of announce messages
+	const int announce_interval_ms = 250;
+}
+
 void lsd::announce(sha1_hash const& ih, int listen_port)
 {
 	if (m_disabled) return;
 
-	char ih_hex[41];
-	to_hex((char const*)&ih[0], 20, ih_hex);
-	char msg[200];
-	int msg_len = snprintf(msg, 200,
-		"BT-SEARCH * HTTP/1.1\r\n"
-		"Host: 239.192.152.143:6771\r\n"
-		"Port: %d\r\n"
-		"Infohash: %s\r\n"
-		"\r\n\r\n", listen_port, ih_hex);
-
-	m_retry_count = 1;
-	error_code ec;
-	m_socket.send(msg, msg_len, ec);
-	if (ec)
-	{
-		m_disabled = true;
-		return;
-	}
+	m_listen_port = listen_port;
+	if (std::find(m_pending.begin(), m_pending.end(), ih) == m_pending.end())
+		m_pending.push_back(ih);
 
-#if defined(TORRENT_LOGGING) || defined(TORRENT_VERBOSE_LOGGING)
-	snprintf(msg, 200, "%s ==> announce: ih: %s port: %u\n"
-		, time_now_string(), ih_hex, listen_port);
-	m_log << msg;
-#endif
+	if (m_timer_armed) return;
 
-	m_broadcast_timer.expires_from_now(milliseconds(250 * m_retry_count), ec);
-	m_broadcast_timer.async_wait(bind(&lsd::resend_announce, self(), _1, msg));
+	// wait a little while for other torrents to announce,
+	// they're likely to be started at the same time
+	error_code ec;
+	m_timer_armed = true;
+	m_broadcast_timer.expires_from_now(milliseconds(100), ec);
+	m_broadcast_timer.async_wait(bind(&lsd::on_announce_timer, self(), _1));
 }
 
-void lsd::resend_announce(error_code const& e, std::string msg)
+void lsd::on_announce_timer(error_code const& e)
 {
-	if (e) return;
+	m_timer_armed = false;
+	if (e || m_disabled) return;
 
 	error_code ec;
-	m_socket.send(msg.c_str(), int(msg.size()), ec);
+	if (!m_pending.empty())
+	{
+		int num = (std::min)(int(m_pending.size()), int(max_hashes_per_message));
+
+		char msg[100];
+		snprintf(msg, sizeof(msg),
+			"BT-SEARCH * HTTP/1.1\r\n"
+			"Host: 239.192.152.143:6771\r\n"
+			"Port: %d\r\n", m_listen_port);
+		m_last_msg = msg;
+		for (int i = 0; i < num; ++i)
+		{
+			char ih_hex[41];
+			to_hex((char const*)&m_pending[i][0], 20, ih_hex);
+			m_last_msg += "Infohash: ";
+			m_last_msg += ih_hex;
+			m_last_msg += "\r\n";
 
-	++m_retry_count;
-	if (m_retry_count >= 5)
+#if defined(TORRENT_LOGGING) || defined(TORRENT_VERBOSE_LOGGING)
+			snprintf(msg, sizeof(msg), "%s ==> announce: ih: %s port: %u\n"
+				, time_now_string(), ih_hex, m_listen_port);
+			m_log << msg;
+#endif
+		}
+		m_last_msg += "\r\n\r\n";
+		m_pending.erase(m_pending.begin(), m_pending.begin() + num);
+		m_retry_count = 1;
+	}
+	else if (m_retry_count < 5 && !m_last_msg.empty())
+	{
+		++m_retry_count;
+	}
+	else
+	{
 		return;
+	}
 
-	m_broadcast_timer.expires_from_now(milliseconds(250 * m_retry_count), ec);
-	m_broadcast_timer.async_wait(bind(&lsd::resend_announce, self(), _1, msg));
+	m_socket.send(m_last_msg.c_str(), int(m_last_msg.size()), ec);
+	if (ec)
+	{
+		m_disabled = true;
+		return;
+	}
+
+	// more info-hashes are sent at the rate limit, the
+	// last message is resent with a linear back-off
+	m_timer_armed = true;
+	m_broadcast_timer.expires_from_now(milliseconds(m_pending.empty()
+		? announce_interval_ms * m_retry_count : announce_interval_ms), ec);
+	m_broadcast_timer.async_wait(bind(&lsd::on_announce_timer, self(), _1));
 }
 
 void lsd::on_announce(udp::endpoint const& from, char* buffer
@@ -166,8 +206,7 @@ void lsd::on_announce(udp::endpoint const& from, char* buffer
 		return;
 	}
 
-	std::string const& ih_str = p.header("infohash");
-	if (ih_str.empty())
+	if (p.header("infohash").empty())
 	{
 #if defined(TORRENT_LOGGING) || defined(TORRENT_VERBOSE_LOGGING)
 	m_log << time_now_string()
@@ -176,27 +215,46 @@ void lsd::on_announce(udp::endpoint const& from, char* buffer
 		return;
 	}
 
-	sha1_hash ih(0);
-	from_hex(ih_str.c_str(), 40, (char*)&ih[0]);
 	int port = std::atoi(port_str.c_str());
-
-	if (!ih.is_all_zeros() && port != 0)
+	if (port == 0) return;
+
+	// a message may carry several Infohash headers. The
+	// http_parser only keeps the first header with a given
+	// name, so they are picked out of the header section here
+	char const* ptr = buffer;
+	char const* end = buffer + p.body_start();
+	while (ptr < end)
 	{
+		char const* line_end = std::find(ptr, end, '\n');
+		char const* value = ptr + 9;
+		// the length is checked first, string_begins_no_case()
+		// doesn't read past the end of the prefix
+		if (line_end - ptr >= 9 && string_begins_no_case("infohash:", ptr))
+		{
+			while (value < line_end && *value == ' ') ++value;
+			sha1_hash ih(0);
+			if (line_end - value >= 40 && from_hex(value, 40, (char*)&ih[0])
+				&& !ih.is_all_zeros())
+			{
 #if defined(TORRENT_LOGGING) || defined(TORRENT_VERBOSE_LOGGING)
-		char msg[200];
-		snprintf(msg, 200, "%s *** incoming local announce %s:%d ih: %s\n"
-			, time_now_string(), print_address(from.address()).c_str()
-			, port, ih_str.c_str());
+				char msg[200];
+				snprintf(msg, 200, "%s *** incoming local announce %s:%d ih: %s\n"
+					, time_now_string(), print_address(from.address()).c_str()
+					, port, std::string(value, 40).c_str());
+				m_log << msg;
 #endif
-		// we got an announce, pass it on through the callback
+				// we got an announce, pass it on through the callback
 #ifndef BOOST_NO_EXCEPTIONS
-		try {
+				try {
 #endif
-			m_callback(tcp::endpoint(from.address(), port), ih);
+					m_callback(tcp::endpoint(from.address(), port), ih);
 #ifndef BOOST_NO_EXCEPTIONS
-		}
-		catch (std::exception&) {}
+				}
+				catch (std::exception&) {}
 #endif
+			}
+		}
+		ptr = line_end + 1;
 	}
 }
 
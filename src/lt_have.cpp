@@ -0,0 +1,267 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/shared_ptr.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include <vector>
+#include <algorithm>
+
+#include "libtorrent/peer_connection.hpp"
+#include "libtorrent/bt_peer_connection.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/extensions.hpp"
+#include "libtorrent/extensions/lt_have.hpp"
+#include "libtorrent/io.hpp"
+
+namespace libtorrent { namespace
+{
+	// the lt_have message announces a set of pieces at once. The
+	// pieces are sent as runs of consecutive piece indices, each
+	// run is two variable length integers: the number of pieces
+	// between the end of the previous run (or 0) and the start of
+	// this run, followed by the number of pieces in the run minus
+	// one. The integers are 7 bits per byte, least significant
+	// first, with the top bit set on every byte but the last.
+
+	void write_varint(int v, std::vector<char>& out)
+	{
+		TORRENT_ASSERT(v >= 0);
+		while (v >= 0x80)
+		{
+			out.push_back(char((v & 0x7f) | 0x80));
+			v >>= 7;
+		}
+		out.push_back(char(v));
+	}
+
+	// returns false if the buffer ends in the middle
+	// of the integer or if it's too large
+	bool read_varint(char const*& p, char const* end, int& v)
+	{
+		v = 0;
+		for (int shift = 0; shift < 28; shift += 7)
+		{
+			if (p == end) return false;
+			int b = (unsigned char)*p++;
+			v |= (b & 0x7f) << shift;
+			if ((b & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	struct lt_have_plugin : torrent_plugin
+	{
+		lt_have_plugin(torrent& t)
+			: m_torrent(t)
+		{}
+
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << new_connection_hook);
+		}
+
+		virtual boost::shared_ptr<peer_plugin> new_connection(
+			peer_connection* pc);
+
+	private:
+		torrent& m_torrent;
+	};
+
+	struct lt_have_peer_plugin : peer_plugin
+	{
+		lt_have_peer_plugin(torrent& t, bt_peer_connection& pc)
+			: m_message_index(0)
+			, m_torrent(t)
+			, m_pc(pc)
+		{}
+
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << write_have_hook) | (1 << extended_hook)
+				| (1 << tick_hook);
+		}
+
+		// can add entries to the extension handshake
+		virtual void add_handshake(entry& h)
+		{
+			entry& messages = h["m"];
+			messages["lt_have"] = 4;
+		}
+
+		// called when the extension handshake from the other end is received
+		virtual bool on_extension_handshake(lazy_entry const& h)
+		{
+			m_message_index = 0;
+			if (h.type() != lazy_entry::dict_t) return false;
+			lazy_entry const* messages = h.dict_find("m");
+			if (!messages || messages->type() != lazy_entry::dict_t) return false;
+
+			int index = messages->dict_find_int_value("lt_have", -1);
+			if (index <= 0) return false;
+			m_message_index = index;
+			return true;
+		}
+
+		// the HAVE messages to peers that support lt_have
+		// are held back and sent in one message on the next tick
+		virtual bool write_have(int index)
+		{
+			if (m_message_index == 0) return false;
+			m_pending.push_back(index);
+			return true;
+		}
+
+		virtual bool on_extended(int length
+			, int extended_msg, buffer::const_interval body)
+		{
+			if (extended_msg != 4) return false;
+			if (m_message_index == 0) return false;
+			if (!m_pc.packet_finished()) return true;
+
+#ifdef TORRENT_VERBOSE_LOGGING
+			(*m_pc.m_logger) << time_now_string() << " <== LT_HAVE [ size: "
+				<< body.left() << " ]\n";
+#endif
+
+			// the number of pieces a peer can announce
+			int max_pieces = m_torrent.valid_metadata()
+				? m_torrent.torrent_file().num_pieces() : 65536;
+
+			char const* p = body.begin;
+			int next = 0;
+			while (p != body.end)
+			{
+				int gap;
+				int run;
+				if (!read_varint(p, body.end, gap)
+					|| !read_varint(p, body.end, run)
+					|| gap > max_pieces - next
+					|| run >= max_pieces - next - gap)
+				{
+					m_pc.disconnect("invalid lt_have message", 2);
+					return true;
+				}
+				next += gap;
+				for (int end = next + run + 1; next < end; ++next)
+				{
+					m_pc.incoming_have(next);
+					if (m_pc.is_disconnecting()) return true;
+				}
+			}
+			return true;
+		}
+
+		virtual void tick()
+		{
+			if (m_pending.empty()) return;
+
+			std::sort(m_pending.begin(), m_pending.end());
+			m_pending.erase(std::unique(m_pending.begin(), m_pending.end())
+				, m_pending.end());
+
+			std::vector<char> msg;
+			int prev_end = 0;
+			for (std::vector<int>::iterator i = m_pending.begin()
+				, end(m_pending.end()); i != end;)
+			{
+				int start = *i;
+				std::vector<int>::iterator k = i + 1;
+				while (k != end && *k == *(k - 1) + 1) ++k;
+				int run = k - i;
+				write_varint(start - prev_end, msg);
+				write_varint(run - 1, msg);
+				prev_end = start + run;
+				i = k;
+			}
+
+#ifdef TORRENT_VERBOSE_LOGGING
+			(*m_pc.m_logger) << time_now_string() << " ==> LT_HAVE [ pieces: "
+				<< m_pending.size() << " size: " << msg.size() << " ]\n";
+#endif
+			m_pending.clear();
+
+			buffer::interval i = m_pc.allocate_send_buffer(6 + msg.size());
+
+			detail::write_uint32(1 + 1 + msg.size(), i.begin);
+			detail::write_uint8(bt_peer_connection::msg_extended, i.begin);
+			detail::write_uint8(m_message_index, i.begin);
+			std::copy(msg.begin(), msg.end(), i.begin);
+			i.begin += msg.size();
+
+			TORRENT_ASSERT(i.begin == i.end);
+			m_pc.setup_send();
+		}
+
+	private:
+
+		// this is the message index the remote peer uses
+		// for lt_have messages
+		int m_message_index;
+
+		// the pieces to announce on the next tick
+		std::vector<int> m_pending;
+
+		torrent& m_torrent;
+		bt_peer_connection& m_pc;
+	};
+
+	boost::shared_ptr<peer_plugin> lt_have_plugin::new_connection(
+		peer_connection* pc)
+	{
+		bt_peer_connection* c = dynamic_cast<bt_peer_connection*>(pc);
+		if (!c) return boost::shared_ptr<peer_plugin>();
+		return boost::shared_ptr<peer_plugin>(new lt_have_peer_plugin(m_torrent, *c));
+	}
+
+} }
+
+namespace libtorrent
+{
+
+	boost::shared_ptr<torrent_plugin> create_lt_have_plugin(torrent* t, void*)
+	{
+		return boost::shared_ptr<torrent_plugin>(new lt_have_plugin(*t));
+	}
+
+}
+
@@ -43,6 +43,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <vector>
+#include <set>
 #include <utility>
 #include <numeric>
 #include <cstdio>
@@ -55,9 +56,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/extensions.hpp"
 #include "libtorrent/extensions/ut_metadata.hpp"
 #include "libtorrent/alert_types.hpp"
-#ifdef TORRENT_STATS
 #include "libtorrent/aux_/session_impl.hpp"
-#endif
 
 namespace libtorrent { namespace
 {
@@ -74,13 +73,26 @@ namespace libtorrent { namespace
 	{
 		lt_tracker_plugin(torrent& t)
 			: m_torrent(t)
-			, m_updates(0)
+			, m_version(0)
 			, m_2_minutes(110)
 		{
-			m_old_trackers = t.trackers();
+			std::vector<announce_entry> const& trackers = t.trackers();
+			for (std::vector<announce_entry>::const_iterator i = trackers.begin()
+				, end(trackers.end()); i != end; ++i)
+			{
+				m_known.insert(i->url);
+				if (!send_tracker(*i)) continue;
+				if (!m_urls.insert(i->url).second) continue;
+				m_trackers.push_back(i->url);
+			}
 			update_list_hash();
 		}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << new_connection_hook) | (1 << tick_hook);
+		}
+
 		virtual boost::shared_ptr<peer_plugin> new_connection(
 			peer_connection* pc);
 		
@@ -96,45 +108,66 @@ namespace libtorrent { namespace
 			for (std::vector<announce_entry>::const_iterator i = trackers.begin()
 				, end(trackers.end()); i != end; ++i)
 			{
-				std::vector<announce_entry>::const_iterator k = std::find_if(
-					m_old_trackers.begin(), m_old_trackers.end()
-					, boost::bind(&announce_entry::url, _1) == i->url);
-				if (k != m_old_trackers.end()) continue;
 				if (!send_tracker(*i)) continue;
-				m_old_trackers.push_back(*i);
-				++m_updates;
+				if (!m_urls.insert(i->url).second) continue;
+				m_known.insert(i->url);
+				m_trackers.push_back(i->url);
 				added.push_back(i->url);
 			}
+
+			// if nothing was added, the list keeps its version
+			// and the peers that are up to date aren't sent anything
+			if (added.empty()) return;
+
 			m_lt_trackers_msg.clear();
 			bencode(std::back_inserter(m_lt_trackers_msg), tex);
-			if (m_updates > 0) update_list_hash();
+			++m_version;
+			update_list_hash();
 		}
 
 		void update_list_hash()
 		{
-			std::vector<std::string> canonical_list;
-			std::transform(m_old_trackers.begin(), m_old_trackers.end(), back_inserter(canonical_list)
-				, boost::bind(&announce_entry::url, _1));
-			std::sort(canonical_list.begin(), canonical_list.end());
-
+			// m_urls is sorted, which makes it the canonical list
 			hasher h;
-			std::for_each(canonical_list.begin(), canonical_list.end()
-				, boost::bind(&hasher::update, &h, _1));
+			for (std::set<std::string>::const_iterator i = m_urls.begin()
+				, end(m_urls.end()); i != end; ++i)
+				h.update(*i);
 			m_list_hash = h.final();
 		}
 
-		int num_updates() const { return m_updates; }
+		// the version of our tracker list. It's incremented every
+		// time trackers are added to it. get_lt_tex_msg() holds the
+		// trackers added between the previous version and this one
+		int version() const { return m_version; }
 
 		std::vector<char> const& get_lt_tex_msg() const { return m_lt_trackers_msg; }
 
 		sha1_hash const& list_hash() const { return m_list_hash; }
 
-		std::vector<announce_entry> const& trackers() const { return m_old_trackers; }
+		std::vector<std::string> const& trackers() const { return m_trackers; }
+
+		// returns true if the torrent has had this tracker
+		// since this plugin was created, or if it's been
+		// added through tracker exchange already
+		bool is_known(std::string const& url) const
+		{ return m_known.count(url) > 0; }
+
+		void add_known(std::string const& url) { m_known.insert(url); }
 
 	private:
 		torrent& m_torrent;
-		std::vector<announce_entry> m_old_trackers;
-		int m_updates;
+
+		// the trackers we send to peers, in the order they
+		// were added. m_urls holds the same urls, sorted
+		std::vector<std::string> m_trackers;
+		std::set<std::string> m_urls;
+
+		// every tracker url this torrent has seen, including the ones
+		// we don't pass on. Used to ignore trackers we already have
+		// before spending any of the session's tracker budget on them
+		std::set<std::string> m_known;
+
+		int m_version;
 		int m_2_minutes;
 		std::vector<char> m_lt_trackers_msg;
 		sha1_hash m_list_hash;
@@ -149,9 +182,14 @@ namespace libtorrent { namespace
 			, m_pc(pc)
 			, m_tp(tp)
 			, m_2_minutes(115)
-			, m_full_list(true)
+			, m_version(-1)
 		{}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << extended_hook) | (1 << tick_hook);
+		}
+
 		// can add entries to the extension handshake
 		virtual void add_handshake(entry& h)
 		{
@@ -178,7 +216,7 @@ namespace libtorrent { namespace
 			if (tracker_list_hash.size() == 20
 				&& sha1_hash(tracker_list_hash) == m_tp.list_hash())
 			{
-				m_full_list = false;
+				m_version = m_tp.version();
 			}
 			return true;
 		}
@@ -219,6 +257,12 @@ namespace libtorrent { namespace
 			{
 				announce_entry e(added->list_string_value_at(i));
 				if (e.url.empty()) continue;
+				if (m_tp.is_known(e.url)) continue;
+				// the session caps the number of trackers added
+				// this way, to not have every torrent start
+				// announcing to hundreds of new trackers
+				if (!m_torrent.session().allow_tex_tracker()) break;
+				m_tp.add_known(e.url);
 				e.fail_limit = 3;
 				e.source = announce_entry::source_tex;
 				m_torrent.add_tracker(e);
@@ -239,24 +283,22 @@ namespace libtorrent { namespace
 			if (++m_2_minutes <= 120) return;
 			m_2_minutes = 0;
 
-			if (m_full_list)
-			{
-				send_full_tex_list();
-				m_full_list = false;
-			}
-			else
-			{
+			// the peer already has our current list
+			if (m_version == m_tp.version()) return;
+
+			// if the peer has the previous version, the
+			// trackers added since then is all it needs
+			if (m_version >= 0 && m_version == m_tp.version() - 1)
 				send_lt_tex_diff();
-			}
+			else
+				send_full_tex_list();
+			m_version = m_tp.version();
 		}
 
 	private:
 
 		void send_lt_tex_diff()
 		{
-			// if there's no change in out tracker set, don't send anything
-			if (m_tp.num_updates() == 0) return;
-
 			std::vector<char> const& tex_msg = m_tp.get_lt_tex_msg();
 
 			buffer::interval i = m_pc.allocate_send_buffer(6 + tex_msg.size());
@@ -282,13 +324,12 @@ namespace libtorrent { namespace
 #endif
 			entry tex;
 			entry::list_type& added = tex["added"].list();
-			for (std::vector<announce_entry>::const_iterator i = m_tp.trackers().begin()
+			for (std::vector<std::string>::const_iterator i = m_tp.trackers().begin()
 				, end(m_tp.trackers().end()); i != end; ++i)
 			{
-				if (!send_tracker(*i)) continue;
-				added.push_back(i->url);
+				added.push_back(*i);
 #ifdef TORRENT_VERBOSE_LOGGING
-				log_line << i->url << " ";
+				log_line << *i << " ";
 #endif
 			}
 			std::vector<char> tex_msg;
@@ -320,7 +361,10 @@ namespace libtorrent { namespace
 		lt_tracker_plugin& m_tp;
 
 		int m_2_minutes;
-		bool m_full_list;
+
+		// the version of our tracker list this peer has, or
+		// -1 if we haven't sent it any trackers yet
+		int m_version;
 	};
 
 	boost::shared_ptr<peer_plugin> lt_tracker_plugin::new_connection(
@@ -105,6 +105,12 @@ namespace libtorrent { namespace
 			m_requested_metadata.resize(256, 0);
 		}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << files_checked_hook) | (1 << new_connection_hook)
+				| (1 << piece_pass_hook);
+		}
+
 		virtual void on_files_checked()
 		{
 			// if the torrent is a seed, make a reference to
@@ -245,6 +251,11 @@ namespace libtorrent { namespace
 			, m_tp(tp)
 		{}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << extended_hook) | (1 << tick_hook);
+		}
+
 		// can add entries to the extension handshake
 		virtual void add_handshake(entry& h)
 		{
@@ -531,6 +531,19 @@ void natpmp::mapping_expired(error_code const& e, int i)
 	log(msg);
 	m_mappings[i].action = mapping_t::action_add;
 	if (m_next_refresh == i) m_next_refresh = -1;
+
+	// refresh the mappings that are about to expire along with
+	// this one, instead of waking up again for each of them.
+	// They're sent one at a time, in order, from try_next_mapping()
+	ptime refresh_until = time_now() + seconds(60);
+	for (std::vector<mapping_t>::iterator k = m_mappings.begin()
+		, end(m_mappings.end()); k != end; ++k)
+	{
+		if (k->protocol == none
+			|| k->action != mapping_t::action_none
+			|| k->expires > refresh_until) continue;
+		k->action = mapping_t::action_add;
+	}
 	update_mapping(i);
 }
 
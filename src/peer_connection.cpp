@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 #include <limits>
+#include <cerrno>
 #include <boost/bind.hpp>
 
 #include "libtorrent/peer_connection.hpp"
@@ -95,6 +96,7 @@ namespace libtorrent
 		, m_downloaded_at_last_unchoke(0)
 		, m_uploaded_at_last_unchoke(0)
 		, m_disk_recv_buffer(ses, 0)
+		, m_read_ahead_buffer(ses, 0)
 		, m_socket(s)
 		, m_remote(endp)
 		, m_torrent(tor)
@@ -106,8 +108,12 @@ namespace libtorrent
 		, m_soft_packet_size(0)
 		, m_recv_pos(0)
 		, m_disk_recv_buffer_size(0)
+		, m_read_ahead_header_size(0)
 		, m_reading_bytes(0)
+		, m_file_send_bytes(0)
 		, m_num_invalid_requests(0)
+		, m_last_read_piece(-1)
+		, m_last_read_end(0)
 		, m_priority(1)
 		, m_upload_limit(0)
 		, m_download_limit(0)
@@ -124,6 +130,7 @@ namespace libtorrent
 		, m_prefer_whole_pieces(0)
 		, m_desired_queue_size(2)
 		, m_choke_rejects(0)
+		, m_sequential_reads(0)
 		, m_fast_reconnect(false)
 		, m_active(true)
 		, m_peer_interested(false)
@@ -142,6 +149,10 @@ namespace libtorrent
 		, m_snubbed(false)
 		, m_bitfield_received(false)
 		, m_no_download(false)
+		, m_readable(false)
+		, m_corked(false)
+		, m_uncorking(false)
+		, m_reading_ahead(false)
 #ifdef TORRENT_DEBUG
 		, m_in_constructor(true)
 		, m_disconnect_started(false)
@@ -216,6 +227,7 @@ namespace libtorrent
 		, m_downloaded_at_last_unchoke(0)
 		, m_uploaded_at_last_unchoke(0)
 		, m_disk_recv_buffer(ses, 0)
+		, m_read_ahead_buffer(ses, 0)
 		, m_socket(s)
 		, m_remote(endp)
 		, m_outstanding_bytes(0)
@@ -226,8 +238,12 @@ namespace libtorrent
 		, m_soft_packet_size(0)
 		, m_recv_pos(0)
 		, m_disk_recv_buffer_size(0)
+		, m_read_ahead_header_size(0)
 		, m_reading_bytes(0)
+		, m_file_send_bytes(0)
 		, m_num_invalid_requests(0)
+		, m_last_read_piece(-1)
+		, m_last_read_end(0)
 		, m_priority(1)
 		, m_upload_limit(0)
 		, m_download_limit(0)
@@ -244,6 +260,7 @@ namespace libtorrent
 		, m_prefer_whole_pieces(0)
 		, m_desired_queue_size(2)
 		, m_choke_rejects(0)
+		, m_sequential_reads(0)
 		, m_fast_reconnect(false)
 		, m_active(false)
 		, m_peer_interested(false)
@@ -262,6 +279,10 @@ namespace libtorrent
 		, m_snubbed(false)
 		, m_bitfield_received(false)
 		, m_no_download(false)
+		, m_readable(false)
+		, m_corked(false)
+		, m_uncorking(false)
+		, m_reading_ahead(false)
 #ifdef TORRENT_DEBUG
 		, m_in_constructor(true)
 		, m_disconnect_started(false)
@@ -312,10 +333,30 @@ namespace libtorrent
 		TORRENT_ASSERT(p);
 		peer_connection const& rhs = *p;
 
+		// peers in the preferred ASes go first
+		bool cheap1 = in_cheap_as();
+		bool cheap2 = rhs.in_cheap_as();
+		if (cheap1 != cheap2) return cheap1;
+
+		boost::shared_ptr<torrent> t1 = m_torrent.lock();
+		TORRENT_ASSERT(t1);
+		boost::shared_ptr<torrent> t2 = rhs.associated_torrent().lock();
+		TORRENT_ASSERT(t2);
+
+		// with the rate based seed choker, the peers of seeding
+		// torrents are ordered on their own, after the peers of
+		// the torrents we're downloading
+		if (m_ses.settings().seed_choking_algorithm == session_settings::rate_based
+			&& (t1->is_seed() || t2->is_seed()))
+		{
+			if (t1->is_seed() != t2->is_seed()) return t2->is_seed();
+			return seed_unchoke_compare(rhs, *t1, *t2);
+		}
+
 		size_type c1;
 		size_type c2;
 
-		// first compare how many bytes they've sent us
+		// then compare how many bytes they've sent us
 		c1 = m_statistics.total_payload_download() - m_downloaded_at_last_unchoke;
 		c2 = rhs.m_statistics.total_payload_download() - rhs.m_downloaded_at_last_unchoke;
 		if (c1 > c2) return true;
@@ -328,10 +369,6 @@ namespace libtorrent
 		// in order to not switch back and forth too often,
 		// unchoked peers must be at least one piece ahead
 		// of a choked peer to be sorted at a lower unchoke-priority
-		boost::shared_ptr<torrent> t1 = m_torrent.lock();
-		TORRENT_ASSERT(t1);
-		boost::shared_ptr<torrent> t2 = rhs.associated_torrent().lock();
-		TORRENT_ASSERT(t2);
 		int pieces = m_ses.settings().seeding_piece_quota;
 		bool c1_done = is_choked() || c1 > (std::max)(t1->torrent_file().piece_length() * pieces, 256 * 1024);
 		bool c2_done = rhs.is_choked() || c2 > (std::max)(t2->torrent_file().piece_length() * pieces, 256 * 1024);
@@ -344,6 +381,48 @@ namespace libtorrent
 		return m_last_unchoke < rhs.m_last_unchoke;
 	}
 
+	bool peer_connection::seed_unchoke_compare(peer_connection const& rhs
+		, torrent const& t1, torrent const& t2) const
+	{
+		size_type u1 = m_statistics.total_payload_upload() - m_uploaded_at_last_unchoke;
+		size_type u2 = rhs.m_statistics.total_payload_upload() - rhs.m_uploaded_at_last_unchoke;
+
+		// an unchoked peer keeps its slot until it has been sent its
+		// quota. After that it goes behind the choked peers, so the
+		// slots still rotate
+		int pieces = m_ses.settings().seeding_piece_quota;
+		bool turn1 = !is_choked() && u1 <= (std::max)(t1.torrent_file().piece_length() * pieces, 256 * 1024);
+		bool turn2 = !rhs.is_choked() && u2 <= (std::max)(t2.torrent_file().piece_length() * pieces, 256 * 1024);
+		if (turn1 != turn2) return turn1;
+
+		if (!turn1 && is_choked() != rhs.is_choked()) return is_choked();
+
+		// the share of the torrent the peer has, in permille
+		int have1 = t1.torrent_file().num_pieces() > 0
+			? m_num_pieces * 1000 / t1.torrent_file().num_pieces() : 1000;
+		int have2 = t2.torrent_file().num_pieces() > 0
+			? rhs.m_num_pieces * 1000 / t2.torrent_file().num_pieces() : 1000;
+
+		if (is_choked())
+		{
+			// the choked peers are given the rotated slots in
+			// order of how little of the torrent they have
+			if (have1 != have2) return have1 < have2;
+		}
+		else
+		{
+			// the rate we upload to it, weighted so that a peer that
+			// has nothing counts twice as much as one that's almost
+			// done. Bytes sent to peers with little of the torrent
+			// are more likely to be passed on
+			size_type s1 = u1 * (2000 - have1);
+			size_type s2 = u2 * (2000 - have2);
+			if (s1 != s2) return s1 > s2;
+		}
+
+		return m_last_unchoke < rhs.m_last_unchoke;
+	}
+
 	bool peer_connection::upload_rate_compare(peer_connection const* p) const
 	{
 		size_type c1;
@@ -405,13 +484,14 @@ namespace libtorrent
 		bool interested = false;
 		if (!t->is_finished())
 		{
+			// we have all pieces outside of the cursors, and only
+			// the pieces the peer has need to be looked at
 			piece_picker const& p = t->picker();
-			int num_pieces = p.num_pieces();
-			for (int j = 0; j != num_pieces; ++j)
+			for (int j = m_have_piece.find_first_set(p.cursor());
+				j >= 0 && j < p.reverse_cursor(); j = m_have_piece.find_first_set(j + 1))
 			{
 				if (!p.have_piece(j)
-					&& t->piece_priority(j) > 0
-					&& m_have_piece[j])
+					&& t->piece_priority(j) > 0)
 				{
 					interested = true;
 					break;
@@ -428,6 +508,12 @@ namespace libtorrent
 	void peer_connection::add_extension(boost::shared_ptr<peer_plugin> ext)
 	{
 		m_extensions.push_back(ext);
+		update_extension_hooks();
+	}
+
+	void peer_connection::update_extension_hooks()
+	{
+		m_hooks.update(m_extensions.begin(), m_extensions.end());
 	}
 #endif
 
@@ -471,6 +557,26 @@ namespace libtorrent
 			return;
 		}
 
+		// pieces that are in the read cache make the cheapest
+		// allowed fast pieces to serve
+		if (m_ses.settings().suggest_mode == session_settings::suggest_read_cache)
+		{
+			std::vector<int> const& cached = t->suggested_pieces();
+			for (std::vector<int>::const_iterator i = cached.begin()
+				, end(cached.end()); i != end; ++i)
+			{
+				if (int(m_accept_fast.size()) >= num_allowed_pieces) return;
+				if (has_piece(*i)) continue;
+#ifdef TORRENT_VERBOSE_LOGGING
+				(*m_logger) << time_now_string()
+					<< " ==> ALLOWED_FAST [ " << *i << " ]\n";
+#endif
+				write_allow_fast(*i);
+				if (m_accept_fast.empty()) m_accept_fast.reserve(10);
+				m_accept_fast.push_back(*i);
+			}
+		}
+
 		std::string x;
 		address const& addr = m_remote.address();
 		if (addr.is_v4())
@@ -510,6 +616,27 @@ namespace libtorrent
 		}
 	}
 
+	void peer_connection::send_suggest(int piece)
+	{
+		if (in_handshake() || is_disconnecting()) return;
+		if (has_piece(piece)) return;
+
+		if (m_sent_suggested_pieces.empty())
+		{
+			boost::shared_ptr<torrent> t = m_torrent.lock();
+			TORRENT_ASSERT(t);
+			m_sent_suggested_pieces.resize(t->torrent_file().num_pieces(), false);
+		}
+		if (m_sent_suggested_pieces[piece]) return;
+		m_sent_suggested_pieces.set_bit(piece);
+
+#ifdef TORRENT_VERBOSE_LOGGING
+		(*m_logger) << time_now_string()
+			<< " ==> SUGGEST_PIECE [ piece: " << piece << " ]\n";
+#endif
+		write_suggest(piece);
+	}
+
 	void peer_connection::on_metadata_impl()
 	{
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
@@ -550,15 +677,19 @@ namespace libtorrent
 		{
 			t->peer_has(m_have_piece);
 
-			for (int i = 0; i < (int)m_have_piece.size(); ++i)
+			for (int i = m_have_piece.find_first_set(0); i >= 0
+				; i = m_have_piece.find_first_set(i + 1))
 			{
-				if (m_have_piece[i])
+				if (!t->have_piece(i) && t->picker().piece_priority(i) != 0)
 				{
-					if (!t->have_piece(i) && t->picker().piece_priority(i) != 0)
-						interesting = true;
+					interesting = true;
+					break;
 				}
 			}
 		}
+		// the torrent counts the pieces of its peers
+		// while super seeding
+		else if (!t->has_picker()) t->peer_has(m_have_piece);
 
 		if (interesting) t->get_policy().peer_is_interesting(*this);
 		else if (upload_only()) disconnect("upload to upload connections");
@@ -604,14 +735,15 @@ namespace libtorrent
 		{
 			t->peer_has(m_have_piece);
 			bool interesting = false;
-			for (int i = 0; i < int(m_have_piece.size()); ++i)
+			for (int i = m_have_piece.find_first_set(0); i >= 0
+				; i = m_have_piece.find_first_set(i + 1))
 			{
-				if (m_have_piece[i])
+				// if the peer has a piece and we don't, the peer is interesting
+				if (!t->have_piece(i)
+					&& t->picker().piece_priority(i) != 0)
 				{
-					// if the peer has a piece and we don't, the peer is interesting
-					if (!t->have_piece(i)
-						&& t->picker().piece_priority(i) != 0)
-						interesting = true;
+					interesting = true;
+					break;
 				}
 			}
 			if (interesting) t->get_policy().peer_is_interesting(*this);
@@ -619,6 +751,9 @@ namespace libtorrent
 		}
 		else
 		{
+			// the torrent counts the pieces of its peers
+			// while super seeding
+			if (!t->has_picker()) t->peer_has(m_have_piece);
 			update_interest();
 		}
 	}
@@ -631,6 +766,7 @@ namespace libtorrent
 		TORRENT_ASSERT(m_disconnect_started);
 
 		m_disk_recv_buffer_size = 0;
+		m_ses.release_recv_buffer(m_recv_buffer);
 
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_ERROR_LOGGING
 		if (m_logger)
@@ -738,6 +874,24 @@ namespace libtorrent
 				return;
 			}
 		}
+		else if (upload_only() && !m_ses.settings().send_redundant_have)
+		{
+			// the peer won't download anything, there's
+			// no point in telling it which pieces we have
+#ifdef TORRENT_VERBOSE_LOGGING
+			(*m_logger) << time_now_string()
+				<< " ==> HAVE    [ piece: " << index << " ] SUPRESSED (upload only)\n";
+#endif
+			return;
+		}
+
+#ifndef TORRENT_DISABLE_EXTENSIONS
+		for (int k = m_hooks.begin(peer_plugin::write_have_hook)
+			, end(m_hooks.end(peer_plugin::write_have_hook)); k < end; ++k)
+		{
+			if (m_hooks[k]->write_have(index)) return;
+		}
+#endif
 
 #ifdef TORRENT_VERBOSE_LOGGING
 		(*m_logger) << time_now_string()
@@ -802,13 +956,13 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::piece_pass_hook)
+			, end(m_hooks.end(peer_plugin::piece_pass_hook)); k < end; ++k)
 		{
 #ifdef BOOST_NO_EXCEPTIONS
-			(*i)->on_piece_pass(index);
+			m_hooks[k]->on_piece_pass(index);
 #else
-			try { (*i)->on_piece_pass(index); } catch (std::exception&) {}
+			try { m_hooks[k]->on_piece_pass(index); } catch (std::exception&) {}
 #endif
 		}
 #endif
@@ -819,13 +973,13 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::piece_failed_hook)
+			, end(m_hooks.end(peer_plugin::piece_failed_hook)); k < end; ++k)
 		{
 #ifdef BOOST_NO_EXCEPTIONS
-			(*i)->on_piece_failed(index);
+			m_hooks[k]->on_piece_failed(index);
 #else
-			try { (*i)->on_piece_failed(index); } catch (std::exception&) {}
+			try { m_hooks[k]->on_piece_failed(index); } catch (std::exception&) {}
 #endif
 		}
 #endif
@@ -885,7 +1039,7 @@ namespace libtorrent
 					1 : m_prefer_whole_pieces)))
 			&& p.piece * size_type(ti.piece_length()) + p.start + p.length
 				<= ti.total_size()
-			&& (p.start % t->block_size() == 0);
+			&& t->block_arithmetic().aligned(p.start);
 	}
 
 	void peer_connection::attach_to_torrent(sha1_hash const& ih)
@@ -984,10 +1138,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::choke_hook)
+			, end(m_hooks.end(peer_plugin::choke_hook)); k < end; ++k)
 		{
-			if ((*i)->on_choke()) return;
+			if (m_hooks[k]->on_choke()) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -1034,10 +1188,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::reject_hook)
+			, end(m_hooks.end(peer_plugin::reject_hook)); k < end; ++k)
 		{
-			if ((*i)->on_reject(r)) return;
+			if (m_hooks[k]->on_reject(r)) return;
 		}
 #endif
 
@@ -1121,10 +1275,10 @@ namespace libtorrent
 		if (!t) return;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::suggest_hook)
+			, end(m_hooks.end(peer_plugin::suggest_hook)); k < end; ++k)
 		{
-			if ((*i)->on_suggest(index)) return;
+			if (m_hooks[k]->on_suggest(index)) return;
 		}
 #endif
 
@@ -1153,10 +1307,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::unchoke_hook)
+			, end(m_hooks.end(peer_plugin::unchoke_hook)); k < end; ++k)
 		{
-			if ((*i)->on_unchoke()) return;
+			if (m_hooks[k]->on_unchoke()) return;
 		}
 #endif
 
@@ -1181,10 +1335,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::interested_hook)
+			, end(m_hooks.end(peer_plugin::interested_hook)); k < end; ++k)
 		{
-			if ((*i)->on_interested()) return;
+			if (m_hooks[k]->on_interested()) return;
 		}
 #endif
 
@@ -1206,10 +1360,10 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::not_interested_hook)
+			, end(m_hooks.end(peer_plugin::not_interested_hook)); k < end; ++k)
 		{
-			if ((*i)->on_not_interested()) return;
+			if (m_hooks[k]->on_not_interested()) return;
 		}
 #endif
 
@@ -1259,10 +1413,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::have_hook)
+			, end(m_hooks.end(peer_plugin::have_hook)); k < end; ++k)
 		{
-			if ((*i)->on_have(index)) return;
+			if (m_hooks[k]->on_have(index)) return;
 		}
 #endif
 
@@ -1360,7 +1514,8 @@ namespace libtorrent
 			// a new piece to that peer
 			if (t->super_seeding()
 				&& m_ses.settings().strict_super_seeding
-				&& (index != m_superseed_piece || t->num_peers() == 1))
+				&& (index != m_superseed_piece || t->num_peers() == 1)
+				&& t->superseeding_piece(index))
 			{
 				for (torrent::peer_iterator i = t->begin()
 					, end(t->end()); i != end; ++i)
@@ -1394,10 +1549,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::bitfield_hook)
+			, end(m_hooks.end(peer_plugin::bitfield_hook)); k < end; ++k)
 		{
-			if ((*i)->on_bitfield(bits)) return;
+			if (m_hooks[k]->on_bitfield(bits)) return;
 		}
 #endif
 
@@ -1486,6 +1641,9 @@ namespace libtorrent
 				}
 			}
 		}
+		// the torrent counts the pieces of its peers
+		// while super seeding
+		else if (!t->has_picker()) t->peer_has(bits);
 
 		m_have_piece = bits;
 		m_num_pieces = num_pieces;
@@ -1558,10 +1716,10 @@ namespace libtorrent
 		if (is_disconnecting()) return;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::request_hook)
+			, end(m_hooks.end(peer_plugin::request_hook)); k < end; ++k)
 		{
-			if ((*i)->on_request(r)) return;
+			if (m_hooks[k]->on_request(r)) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -1729,7 +1887,7 @@ namespace libtorrent
 
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
 		TORRENT_ASSERT(t);
-		piece_block b(r.piece, r.start / t->block_size());
+		piece_block b(r.piece, t->block_arithmetic().index(r.start));
 
 		if (!verify_piece(r))
 		{
@@ -1818,10 +1976,30 @@ namespace libtorrent
 		incoming_piece(p, holder);
 	}
 
+	// takes a round trip time sample from a block that just arrived. The
+	// time it spent waiting behind the blocks requested before it, at the
+	// current download rate, is not part of the round trip time
+	void peer_connection::update_rtt(pending_block const& b, int length, ptime now)
+	{
+		if (b.send_time == min_time()) return;
+		int ms = total_milliseconds(now - b.send_time);
+		float rate = m_statistics.download_payload_rate();
+		if (rate > 0.f)
+			ms -= int((b.bytes_ahead + length) * 1000.f / rate);
+		else if (b.bytes_ahead > 0)
+			return;
+		if (ms <= 0) return;
+		if (ms > 0xffff) ms = 0xffff;
+		m_rtt = m_rtt == 0 ? ms : (m_rtt * 7 + ms) / 8;
+	}
+
 	void peer_connection::incoming_piece(peer_request const& p, disk_buffer_holder& data)
 	{
 		INVARIANT_CHECK;
 
+		m_ses.m_trace.instant("piece", "block received", 0
+			, "piece", p.piece, "start", p.start, "length", p.length);
+
 		boost::shared_ptr<torrent> t = m_torrent.lock();
 		TORRENT_ASSERT(t);
 
@@ -1843,10 +2021,10 @@ namespace libtorrent
 		if (is_disconnecting()) return;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::piece_hook)
+			, end(m_hooks.end(peer_plugin::piece_hook)); k < end; ++k)
 		{
-			if ((*i)->on_piece(p, data))
+			if (m_hooks[k]->on_piece(p, data))
 			{
 #ifdef TORRENT_DEBUG
 				TORRENT_ASSERT(m_received_in_piece == p.length);
@@ -1905,8 +2083,8 @@ namespace libtorrent
 		piece_manager& fs = t->filesystem();
 
 		std::vector<piece_block> finished_blocks;
-		piece_block block_finished(p.piece, p.start / t->block_size());
-		TORRENT_ASSERT(p.start % t->block_size() == 0);
+		piece_block block_finished(p.piece, t->block_arithmetic().index(p.start));
+		TORRENT_ASSERT(t->block_arithmetic().aligned(p.start));
 		TORRENT_ASSERT(p.length == t->block_size()
 			|| p.length == t->torrent_file().total_size() % t->block_size());
 
@@ -1976,6 +2154,8 @@ namespace libtorrent
 		TORRENT_ASSERT(int(m_download_queue.size()) > block_index + 1);
 		b = m_download_queue.begin() + (block_index + 1);
 		TORRENT_ASSERT(b->block == pending_b.block);
+
+		update_rtt(*b, p.length, now);
 		
 #ifdef TORRENT_DEBUG
 		TORRENT_ASSERT(m_received_in_piece == p.length);
@@ -2015,11 +2195,14 @@ namespace libtorrent
 		TORRENT_ASSERT(m_channel_state[download_channel] == peer_info::bw_idle);
 		m_download_queue.erase(b);
 
-		if (m_outstanding_writing_bytes > m_ses.settings().max_outstanding_disk_bytes_per_connection
-			&& t->alerts().should_post<performance_alert>())
+		if (m_outstanding_writing_bytes > m_ses.settings().max_outstanding_disk_bytes_per_connection)
 		{
-			t->alerts().post_alert(performance_alert(t->get_handle()
-				, performance_alert::outstanding_disk_buffer_limit_reached));
+			m_ses.m_stats_counters.inc_stats_counter(counters::num_disk_write_limit_hits);
+			if (t->alerts().should_post<performance_alert>())
+			{
+				t->alerts().post_alert(performance_alert(t->get_handle()
+					, performance_alert::outstanding_disk_buffer_limit_reached));
+			}
 		}
 
 		if (!m_download_queue.empty())
@@ -2062,6 +2245,9 @@ namespace libtorrent
 		m_outstanding_writing_bytes -= p.length;
 		TORRENT_ASSERT(m_outstanding_writing_bytes >= 0);
 
+		m_ses.m_trace.instant("piece", "block written", 0
+			, "piece", p.piece, "start", p.start, "result", ret);
+
 #if defined(TORRENT_VERBOSE_LOGGING) || defined(TORRENT_LOGGING)
 //		(*m_ses.m_logger) << time_now_string() << " *** DISK_WRITE_COMPLETE [ p: "
 //			<< p.piece << " o: " << p.start << " ]\n";
@@ -2070,7 +2256,7 @@ namespace libtorrent
 		// to allow to receive more data
 		setup_receive();
 
-		piece_block block_finished(p.piece, p.start / t->block_size());
+		piece_block block_finished(p.piece, t->block_arithmetic().index(p.start));
 
 		if (ret == -1 || !t)
 		{
@@ -2131,10 +2317,10 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::cancel_hook)
+			, end(m_hooks.end(peer_plugin::cancel_hook)); k < end; ++k)
 		{
-			if ((*i)->on_cancel(r)) return;
+			if (m_hooks[k]->on_cancel(r)) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -2201,10 +2387,10 @@ namespace libtorrent
 #endif
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::have_all_hook)
+			, end(m_hooks.end(peer_plugin::have_all_hook)); k < end; ++k)
 		{
-			if ((*i)->on_have_all()) return;
+			if (m_hooks[k]->on_have_all()) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -2265,10 +2451,10 @@ namespace libtorrent
 		TORRENT_ASSERT(t);
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::have_none_hook)
+			, end(m_hooks.end(peer_plugin::have_none_hook)); k < end; ++k)
 		{
-			if ((*i)->on_have_none()) return;
+			if (m_hooks[k]->on_have_none()) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -2298,10 +2484,10 @@ namespace libtorrent
 #endif
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::allowed_fast_hook)
+			, end(m_hooks.end(peer_plugin::allowed_fast_hook)); k < end; ++k)
 		{
-			if ((*i)->on_allowed_fast(index)) return;
+			if (m_hooks[k]->on_allowed_fast(index)) return;
 		}
 #endif
 		if (is_disconnecting()) return;
@@ -2353,9 +2539,8 @@ namespace libtorrent
 	bool peer_connection::can_request_time_critical() const
 	{
 		if (has_peer_choked() || !is_interesting()) return false;
-		if (m_desired_queue_size * 2 <
-			- (int)m_download_queue.size()
-			- (int)m_request_queue.size()) return false;
+		if ((int)m_download_queue.size() + (int)m_request_queue.size()
+			> m_desired_queue_size * 2) return false;
 		if (on_parole()) return false; 
 		return true;
 	}
@@ -2488,6 +2673,7 @@ namespace libtorrent
 				<< block_offset << " | l: " << block_size << " | " << block.block_index << " ]\n";
 #endif
 		write_cancel(r);
+		m_ses.add_cancelled_bytes(block_size);
 	}
 
 	void peer_connection::send_choke()
@@ -2523,6 +2709,31 @@ namespace libtorrent
 			peer_request const& r = *i;
 			write_reject_request(r);
 
+#ifdef TORRENT_VERBOSE_LOGGING
+			(*m_logger) << time_now_string()
+				<< " ==> REJECT_PIECE [ "
+				"piece: " << r.piece << " | "
+				"s: " << r.start << " | "
+				"l: " << r.length << " ]\n";
+#endif
+			i = m_requests.erase(i);
+		}
+	}
+
+	void peer_connection::reject_piece(int index)
+	{
+		for (std::vector<peer_request>::iterator i = m_requests.begin();
+			i != m_requests.end();)
+		{
+			if (i->piece != index)
+			{
+				++i;
+				continue;
+			}
+
+			peer_request const& r = *i;
+			write_reject_request(r);
+
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << time_now_string()
 				<< " ==> REJECT_PIECE [ "
@@ -2616,7 +2827,9 @@ namespace libtorrent
 			if (t->picker().is_finished(block) || t->picker().is_downloaded(block))
 				continue;
 
+			int queue_start = m_download_queue.size();
 			m_download_queue.push_back(block);
+			m_download_queue.back().bytes_ahead = m_outstanding_bytes;
 			m_outstanding_bytes += block_size;
 #if !defined TORRENT_DISABLE_INVARIANT_CHECKS && defined TORRENT_DEBUG
 			check_invariant();
@@ -2646,6 +2859,7 @@ namespace libtorrent
 					block = m_request_queue.front();
 					m_request_queue.erase(m_request_queue.begin());
 					m_download_queue.push_back(block);
+					m_download_queue.back().bytes_ahead = m_outstanding_bytes;
 					if (m_queued_time_critical) --m_queued_time_critical;
 
 #ifdef TORRENT_VERBOSE_LOGGING
@@ -2673,10 +2887,10 @@ namespace libtorrent
 			
 #ifndef TORRENT_DISABLE_EXTENSIONS
 			bool handled = false;
-			for (extension_list_t::iterator i = m_extensions.begin()
-				, end(m_extensions.end()); i != end; ++i)
+			for (int k = m_hooks.begin(peer_plugin::write_request_hook)
+				, end(m_hooks.end(peer_plugin::write_request_hook)); k < end; ++k)
 			{
-				if ((handled = (*i)->write_request(r))) break;
+				if ((handled = m_hooks[k]->write_request(r))) break;
 			}
 			if (is_disconnecting()) return;
 			if (!handled)
@@ -2685,6 +2899,13 @@ namespace libtorrent
 				write_request(r);
 				m_last_request = time_now();
 			}
+			m_ses.m_trace.instant("piece", "block requested", 0
+				, "piece", r.piece, "start", r.start, "length", r.length);
+
+			ptime now = time_now();
+			for (std::vector<pending_block>::iterator i = m_download_queue.begin()
+				+ queue_start, end(m_download_queue.end()); i != end; ++i)
+				i->send_time = now;
 
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << time_now_string()
@@ -2717,6 +2938,8 @@ namespace libtorrent
 		(*m_ses.m_logger) << time_now_string() << " CONNECTION TIMED OUT: " << m_remote.address().to_string(ec)
 			<< "\n";
 #endif
+		if (m_peer_info && m_socket->get<utp_stream>())
+			m_peer_info->supports_utp = false;
 		disconnect("timed out: connect", 1);
 	}
 
@@ -2797,6 +3020,14 @@ namespace libtorrent
 				}
 			}
 
+#ifndef TORRENT_DISABLE_EXTENSIONS
+			for (int k = m_hooks.begin(peer_plugin::disconnect_hook)
+				, end(m_hooks.end(peer_plugin::disconnect_hook)); k < end; ++k)
+			{
+				m_hooks[k]->on_disconnect();
+			}
+#endif
+
 			t->remove_peer(this);
 			m_torrent.reset();
 		}
@@ -2859,7 +3090,7 @@ namespace libtorrent
 	bool peer_connection::ignore_unchoke_slots() const
 	{
 		return m_ignore_unchoke_slots
-			|| (m_ses.settings().ignore_limits_on_local_network && on_local_network());
+			|| (m_ses.settings().ignore_limits_on_local_network && in_local_rate_class());
 	}
 
 	// defined in upnp.cpp
@@ -2872,7 +3103,21 @@ namespace libtorrent
 		return false;
 	}
 
-	void peer_connection::get_peer_info(peer_info& p) const
+	bool peer_connection::in_local_rate_class() const
+	{
+		return on_local_network() || in_cheap_as();
+	}
+
+	bool peer_connection::in_cheap_as() const
+	{
+#ifndef TORRENT_DISABLE_GEO_IP
+		return m_peer_info && m_peer_info->cheap_as;
+#else
+		return false;
+#endif
+	}
+
+	void peer_connection::get_peer_info(peer_info& p, boost::uint32_t flags) const
 	{
 		TORRENT_ASSERT(!associated_torrent().expired());
 
@@ -2941,7 +3186,10 @@ namespace libtorrent
 			p.downloading_total = 0;
 		}
 
-		p.pieces = get_bitfield();
+		if (flags & torrent_handle::query_peer_pieces)
+			p.pieces = get_bitfield();
+		else
+			p.pieces.resize(0);
 		p.last_request = now - m_last_request;
 		p.last_active = now - (std::max)(m_last_sent, m_last_receive);
 
@@ -2983,7 +3231,8 @@ namespace libtorrent
 		p.write_state = m_channel_state[upload_channel];
 		p.read_state = m_channel_state[download_channel];
 		
-		p.progress = (float)p.pieces.count() / (float)p.pieces.size();
+		int num_total = get_bitfield().size();
+		p.progress = num_total > 0 ? (float)m_num_pieces / (float)num_total : 0.f;
 	}
 
 	// allocates a disk buffer of size 'disk_buffer_size' and replaces the
@@ -2992,6 +3241,38 @@ namespace libtorrent
 	// the disk buffer can be accessed through release_disk_receive_buffer()
 	// when it is queried, the responsibility to free it is transferred
 	// to the caller
+	int peer_connection::memory_usage() const
+	{
+		int ret = sizeof(peer_connection)
+			+ m_recv_buffer.capacity()
+			+ m_send_buffer.capacity()
+			+ (m_have_piece.size() + 7) / 8
+			+ m_requests.capacity() * sizeof(peer_request)
+			+ m_request_queue.capacity() * sizeof(piece_block)
+			+ m_download_queue.capacity() * sizeof(pending_block)
+			+ m_accept_fast.capacity() * sizeof(int)
+			+ m_allowed_fast.capacity() * sizeof(int)
+			+ m_suggested_pieces.capacity() * sizeof(int)
+			+ m_requests_in_buffer.capacity() * sizeof(int)
+			+ m_file_sends.size() * sizeof(file_send);
+		if (m_disk_recv_buffer) ret += m_ses.m_disk_thread.block_size();
+		if (m_read_ahead_buffer) ret += m_ses.m_disk_thread.block_size();
+		return ret;
+	}
+
+	void peer_connection::release_idle_memory()
+	{
+		// vectors only give their memory back when swapped
+		// with an empty one
+		if (m_requests.empty()) std::vector<peer_request>().swap(m_requests);
+		if (m_request_queue.empty()) std::vector<piece_block>().swap(m_request_queue);
+		if (m_download_queue.empty()) std::vector<pending_block>().swap(m_download_queue);
+		if (m_requests_in_buffer.empty()) std::vector<int>().swap(m_requests_in_buffer);
+		if (m_recv_pos == 0 && !m_disk_recv_buffer)
+			m_ses.release_recv_buffer(m_recv_buffer);
+		m_read_ahead_buffer.reset();
+	}
+
 	bool peer_connection::allocate_disk_receive_buffer(int disk_buffer_size)
 	{
 		INVARIANT_CHECK;
@@ -3019,6 +3300,32 @@ namespace libtorrent
 		return true;
 	}
 
+	// moves the whole current packet into a disk buffer. The bytes
+	// received so far are copied into it, and the rest of the packet
+	// is received directly into it. This is used by the web seeds, where
+	// the start of a block typically arrives together with the HTTP
+	// header. The packet must not be larger than a block
+	bool peer_connection::move_to_disk_receive_buffer()
+	{
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(m_packet_size > 0);
+		TORRENT_ASSERT(m_packet_size <= 16 * 1024);
+		TORRENT_ASSERT(m_recv_pos < m_packet_size);
+		TORRENT_ASSERT(!m_disk_recv_buffer);
+
+		m_disk_recv_buffer.reset(m_ses.allocate_disk_buffer("receive buffer"));
+		if (!m_disk_recv_buffer)
+		{
+			disconnect("out of memory");
+			return false;
+		}
+		if (m_recv_pos > 0)
+			std::memcpy(m_disk_recv_buffer.get(), &m_recv_buffer[0], m_recv_pos);
+		m_disk_recv_buffer_size = m_packet_size;
+		return true;
+	}
+
 	char* peer_connection::release_disk_receive_buffer()
 	{
 		m_disk_recv_buffer_size = 0;
@@ -3053,7 +3360,6 @@ namespace libtorrent
 		if (index == -1)
 		{
 			if (m_superseed_piece == -1) return;
-			m_superseed_piece = -1;
 			
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << time_now_string()
@@ -3061,6 +3367,8 @@ namespace libtorrent
 #endif
 			boost::shared_ptr<torrent> t = m_torrent.lock();
 			assert(t);
+			t->superseed_piece_changed(m_superseed_piece, -1);
+			m_superseed_piece = -1;
 
 			for (int i = 0; i < m_have_piece.size(); ++i)
 			{
@@ -3081,6 +3389,8 @@ namespace libtorrent
 			<< " ==> HAVE    [ piece: " << index << "] (super seed)\n";
 #endif
 		write_have(index);
+		boost::shared_ptr<torrent> t = m_torrent.lock();
+		if (t) t->superseed_piece_changed(m_superseed_piece, index);
 		m_superseed_piece = index;
 	}
 
@@ -3142,10 +3452,10 @@ namespace libtorrent
 		on_tick();
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(peer_plugin::tick_hook)
+			, end(m_hooks.end(peer_plugin::tick_hook)); k < end; ++k)
 		{
-			(*i)->tick();
+			m_hooks[k]->tick();
 		}
 		if (is_disconnecting()) return;
 #endif
@@ -3225,6 +3535,8 @@ namespace libtorrent
 			return;
 		}
 
+		if (!m_interesting && !m_peer_interested) release_idle_memory();
+
 		if (!m_download_queue.empty()
 			&& now > m_requested + seconds(m_ses.settings().request_timeout
 			+ m_timeout_extend))
@@ -3236,7 +3548,7 @@ namespace libtorrent
 		keep_alive();
 
 		m_ignore_bandwidth_limits = m_ses.settings().ignore_limits_on_local_network
-			&& on_local_network();
+			&& in_local_rate_class();
 
 		m_statistics.second_tick(tick_interval);
 
@@ -3261,13 +3573,20 @@ namespace libtorrent
 		if (!t->ready_for_connections()) return;
 
 		// calculate the desired download queue size
-		const float queue_time = m_ses.settings().request_queue_time;
+		float queue_time = m_ses.settings().request_queue_time;
 		// (if the latency is more than this, the download will stall)
 		// so, the queue size is queue_time * down_rate / 16 kiB
 		// (16 kB is the size of each request)
 		// the minimum number of requests is 2 and the maximum is 48
 		// the block size doesn't have to be 16. So we first query the
 		// torrent for it
+		// once we have an estimate of the round trip time, a few times
+		// the bandwidth delay product is enough to keep the peer busy
+		if (m_rtt > 0 && m_ses.settings().request_queue_rtt_factor > 0.f)
+		{
+			queue_time = (std::min)(queue_time, m_rtt
+				* m_ses.settings().request_queue_rtt_factor / 1000.f);
+		}
 		const int block_size = t->block_size();
 		TORRENT_ASSERT(block_size > 0);
 		
@@ -3277,10 +3596,17 @@ namespace libtorrent
 		}
 		else
 		{
+			// when the session is out of memory budget, keep the
+			// pipeline short to limit the receive and disk buffers
+			// tied up in outstanding blocks
+			int max_queue = m_max_out_request_queue;
+			if (m_ses.memory_pressure() >= aux::session_impl::pipeline_pressure)
+				max_queue = (std::max)(int(min_request_queue), max_queue / 4);
+
 			m_desired_queue_size = static_cast<int>(queue_time
 				* statistics().download_rate() / block_size);
-			if (m_desired_queue_size > m_max_out_request_queue)
-				m_desired_queue_size = m_max_out_request_queue;
+			if (m_desired_queue_size > max_queue)
+				m_desired_queue_size = max_queue;
 			if (m_desired_queue_size < min_request_queue)
 				m_desired_queue_size = min_request_queue;
 
@@ -3446,6 +3772,43 @@ namespace libtorrent
 		send_block_requests();
 	}
 
+	int peer_connection::read_ahead_hint(peer_request const& r)
+	{
+		TORRENT_ASSERT(!m_requests.empty() && m_requests.front() == r);
+
+		if (r.piece == m_last_read_piece && r.start == m_last_read_end)
+		{
+			if (m_sequential_reads < 255) ++m_sequential_reads;
+		}
+		else
+		{
+			m_sequential_reads = 0;
+		}
+		m_last_read_piece = r.piece;
+		m_last_read_end = r.start + r.length;
+
+		// the requests queued up right behind this one, that
+		// continue where it ends
+		int end = r.start + r.length;
+		for (std::vector<peer_request>::const_iterator i = m_requests.begin() + 1
+			, last(m_requests.end()); i != last
+			&& i->piece == r.piece && i->start == end; ++i)
+			end += i->length;
+		int ret = end - r.start - r.length;
+
+		// a peer that keeps requesting the blocks of a piece in
+		// order is likely to ask for the following ones too, but
+		// they're not known yet. Read a regular cache line for it
+		if (m_sequential_reads >= 4)
+		{
+			boost::shared_ptr<torrent> t = m_torrent.lock();
+			TORRENT_ASSERT(t);
+			ret = (std::max)(ret, (m_ses.settings().read_cache_line_size - 1)
+				* t->block_size());
+		}
+		return ret;
+	}
+
 	void peer_connection::fill_send_buffer()
 	{
 #ifdef TORRENT_EXPENSIVE_INVARIANT_CHECKS
@@ -3463,10 +3826,28 @@ namespace libtorrent
 		else if (buffer_size_watermark > m_ses.settings().send_buffer_watermark)
 			buffer_size_watermark = m_ses.settings().send_buffer_watermark;
 
+		// with a notsent low watermark on the socket, what's still
+		// waiting in the kernel is part of the send buffer too
+		int kernel_queue = unsent_kernel_bytes();
+
 		while (!m_requests.empty()
-			&& (send_buffer_size() + m_reading_bytes < buffer_size_watermark))
+			&& (send_buffer_size() + m_reading_bytes + kernel_queue < buffer_size_watermark))
 		{
 			TORRENT_ASSERT(t->ready_for_connections());
+
+			// in seed mode, serve the requests for pieces that are
+			// verified already before the ones that need to be
+			// read and hashed first
+			if (t->seed_mode() && !t->verified_piece(m_requests.front().piece))
+			{
+				std::vector<peer_request>::iterator i = std::find_if(
+					m_requests.begin() + 1, m_requests.end()
+					, boost::bind(&torrent::verified_piece, t.get()
+						, boost::bind(&peer_request::piece, _1)));
+				if (i != m_requests.end())
+					std::rotate(m_requests.begin(), i, i + 1);
+			}
+
 			peer_request& r = m_requests.front();
 			
 			TORRENT_ASSERT(r.piece >= 0);
@@ -3477,8 +3858,15 @@ namespace libtorrent
 
 			if (!t->seed_mode() || t->verified_piece(r.piece))
 			{
+				if (write_piece_from_file(r))
+				{
+					m_requests.erase(m_requests.begin());
+					continue;
+				}
+				int read_ahead = m_ses.settings().request_queue_read_ahead
+					? read_ahead_hint(r) : -1;
 				t->filesystem().async_read(r, bind(&peer_connection::on_disk_read_complete
-					, self(), _1, _2, r));
+					, self(), _1, _2, r), 0, read_ahead);
 			}
 			else
 			{
@@ -3493,6 +3881,66 @@ namespace libtorrent
 
 			m_requests.erase(m_requests.begin());
 		}
+
+		// the kernel holds enough to keep the connection busy,
+		// and nothing else will wake us up. Wait for the socket
+		// to drain below the notsent low watermark
+		if (kernel_queue > 0
+			&& !m_requests.empty()
+			&& send_buffer_size() == 0
+			&& m_reading_bytes == 0
+			&& m_channel_state[upload_channel] == peer_info::bw_idle)
+		{
+			m_socket->async_write_some(asio::null_buffers()
+				, make_write_handler(bind(
+					&peer_connection::on_send_ready, self(), _1)));
+			m_channel_state[upload_channel] = peer_info::bw_network;
+		}
+	}
+
+	// returns the number of bytes in the kernel send buffer that
+	// haven't been sent yet, above send_socket_notsent_lowat. The
+	// socket becomes writable once they're sent
+	int peer_connection::unsent_kernel_bytes() const
+	{
+#if TORRENT_USE_NOTSENT_LOWAT
+		int lowat = m_ses.settings().send_socket_notsent_lowat;
+		if (lowat == 0) return 0;
+		unsent_bytes cmd;
+		error_code ec;
+		m_socket->io_control(cmd, ec);
+		if (ec || cmd.get() < lowat) return 0;
+		return cmd.get();
+#else
+		return 0;
+#endif
+	}
+
+	// called when the kernel send buffer has drained below the
+	// notsent low watermark while requests were waiting for it
+	void peer_connection::on_send_ready(error_code const& error)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(m_channel_state[upload_channel] == peer_info::bw_network);
+		m_channel_state[upload_channel] = peer_info::bw_idle;
+
+		if (error)
+		{
+#if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_ERROR_LOGGING
+			(*m_logger) << time_now_string() << " **ERROR**: "
+				<< error.message() << "[in peer_connection::on_send_ready]\n";
+#endif
+			disconnect(error.message().c_str());
+			return;
+		}
+
+		if (m_disconnecting) return;
+
+		fill_send_buffer();
+		setup_send();
 	}
 
 	void peer_connection::on_disk_read_complete(int ret, disk_io_job const& j, peer_request r)
@@ -3501,7 +3949,7 @@ namespace libtorrent
 
 		m_reading_bytes -= r.length;
 
-		disk_buffer_holder buffer(m_ses, j.buffer);
+		disk_buffer_holder buffer(m_ses, j);
 
 		boost::shared_ptr<torrent> t = m_torrent.lock();
 		if (ret != r.length || m_torrent.expired())
@@ -3517,6 +3965,13 @@ namespace libtorrent
 				if (t->seed_mode()) t->leave_seed_mode(false);
 				write_reject_request(r);
 			}
+			else if (j.error == error_code(errors::piece_evicted, libtorrent_category))
+			{
+				// the storage dropped the piece since we told
+				// the peer we have it
+				t->piece_evicted(r.piece);
+				write_reject_request(r);
+			}
 			else
 			{
 				if (t->alerts().should_post<file_error_alert>())
@@ -3574,11 +4029,11 @@ namespace libtorrent
 		// peers that we are not interested in are non-prioritized
 		m_channel_state[upload_channel] = peer_info::bw_limit;
 		m_ses.m_upload_rate.request_bandwidth(self()
-			, m_send_buffer.size(), priority
+			, send_buffer_size(), priority
 			, bwc1, bwc2, bwc3, bwc4);
 #ifdef TORRENT_VERBOSE_LOGGING
 		(*m_logger) << time_now_string() << " *** REQUEST_BANDWIDTH [ "
-			"upload: " << m_send_buffer.size()
+			"upload: " << send_buffer_size()
 			<< " prio: " << priority << "]\n";
 #endif
 	}
@@ -3607,11 +4062,26 @@ namespace libtorrent
 	void peer_connection::setup_send()
 	{
 		if (m_channel_state[upload_channel] != peer_info::bw_idle) return;
+
+		// small messages aren't sent right away. They're collected
+		// until the handler that wrote them returns, and then go
+		// out in a single write
+		if (!m_uncorking
+			&& send_buffer_size() > 0
+			&& send_buffer_size() < send_coalesce_limit)
+		{
+			if (!m_corked)
+			{
+				m_corked = true;
+				m_ses.m_io_service.post(bind(&peer_connection::on_uncork, self()));
+			}
+			return;
+		}
 		
 		shared_ptr<torrent> t = m_torrent.lock();
 
 		if (m_quota[upload_channel] == 0
-			&& !m_send_buffer.empty()
+			&& send_buffer_size() > 0
 			&& !m_connecting
 			&& t)
 		{
@@ -3640,7 +4110,7 @@ namespace libtorrent
 		if (!can_write())
 		{
 #ifdef TORRENT_VERBOSE_LOGGING
-			if (m_send_buffer.empty())
+			if (send_buffer_size() == 0)
 			{
 				(*m_logger) << time_now_string() << " *** SEND BUFFER DEPLETED ["
 					" quota: " << m_quota[upload_channel] <<
@@ -3662,10 +4132,27 @@ namespace libtorrent
 			return;
 		}
 
+		if (!m_file_sends.empty() && m_file_sends.front().position == 0)
+		{
+			// the next thing to go out is a file range. Wait for
+			// the socket to become writable, on_sendfile_ready()
+			// then sends it
+			TORRENT_ASSERT(m_socket->get<stream_socket>());
+			m_socket->get<stream_socket>()->async_write_some(
+				asio::null_buffers(), make_write_handler(bind(
+					&peer_connection::on_sendfile_ready, self(), _1, _2)));
+
+			m_channel_state[upload_channel] = peer_info::bw_network;
+			return;
+		}
+
 		// send the actual buffer
 		if (!m_send_buffer.empty())
 		{
 			int amount_to_send = m_send_buffer.size();
+			// stop at the next file range
+			if (!m_file_sends.empty())
+				amount_to_send = m_file_sends.front().position;
 			int quota_left = m_quota[upload_channel];
 			if (!m_ignore_bandwidth_limits && amount_to_send > quota_left)
 				amount_to_send = quota_left;
@@ -3675,7 +4162,7 @@ namespace libtorrent
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << time_now_string() << " *** ASYNC_WRITE [ bytes: " << amount_to_send << " ]\n";
 #endif
-			std::list<asio::const_buffer> const& vec = m_send_buffer.build_iovec(amount_to_send);
+			std::vector<asio::const_buffer> const& vec = m_send_buffer.build_iovec(amount_to_send);
 			m_socket->async_write_some(
 				vec, make_write_handler(bind(
 					&peer_connection::on_send_data, self(), _1, _2)));
@@ -3749,31 +4236,69 @@ namespace libtorrent
 		(*m_logger) << time_now_string() << " *** ASYNC_READ [ max: " << max_receive << " bytes ]\n";
 #endif
 
+		// if we're not in the middle of a message and we don't
+		// expect the peer to send anything but the occasional
+		// HAVE or keep-alive, give the receive buffer back and
+		// just wait for the socket to become readable
+		if (m_recv_pos == 0
+			&& !m_disk_recv_buffer
+			&& !m_readable
+			&& m_choked
+			&& m_download_queue.empty()
+			&& m_request_queue.empty())
+		{
+			m_ses.release_recv_buffer(m_recv_buffer);
+			m_read_ahead_buffer.reset();
+			m_socket->async_read_some(asio::null_buffers()
+				, make_read_handler(
+					bind(&peer_connection::on_receive_ready, self(), _1)
+				));
+			m_channel_state[download_channel] = peer_info::bw_network;
+			return;
+		}
+		m_readable = false;
+
+		boost::array<asio::mutable_buffer, 4> vec;
+		setup_receive_buffers(max_receive, vec);
+		m_socket->async_read_some(
+			vec, make_read_handler(
+				bind(&peer_connection::on_receive_data, self(), _1, _2)));
+		m_channel_state[download_channel] = peer_info::bw_network;
+	}
+
+	// fills in the buffers to receive the next max_receive bytes of
+	// the current packet into. If they are the last bytes of the packet,
+	// the start of the next message is added to the same read, and if
+	// a block has been requested, the start of its payload as well.
+	// That way back to back piece messages don't alternate between a
+	// small read for the header and a large one for the payload, and
+	// small messages are received several at a time.
+	// The buffers that aren't used are left empty
+	void peer_connection::setup_receive_buffers(int max_receive
+		, boost::array<asio::mutable_buffer, 4>& vec)
+	{
 		int regular_buffer_size = m_packet_size - m_disk_recv_buffer_size;
 
 		if (int(m_recv_buffer.size()) < regular_buffer_size)
-			m_recv_buffer.resize(regular_buffer_size);
+			m_ses.grow_recv_buffer(m_recv_buffer, regular_buffer_size);
 
+		std::fill(vec.begin(), vec.end(), asio::mutable_buffer());
+		m_reading_ahead = false;
+
+		int num_buffers = 0;
 		if (!m_disk_recv_buffer || regular_buffer_size >= m_recv_pos + max_receive)
 		{
 			// only receive into regular buffer
 			TORRENT_ASSERT(m_recv_pos + max_receive <= int(m_recv_buffer.size()));
-			m_socket->async_read_some(asio::buffer(&m_recv_buffer[m_recv_pos]
-				, max_receive)
-				, make_read_handler(
-					bind(&peer_connection::on_receive_data, self(), _1, _2)
-				));
+			vec[num_buffers++] = asio::buffer(&m_recv_buffer[m_recv_pos], max_receive);
 		}
 		else if (m_recv_pos >= regular_buffer_size)
 		{
 			// only receive into disk buffer
 			TORRENT_ASSERT(m_recv_pos - regular_buffer_size >= 0);
 			TORRENT_ASSERT(m_recv_pos - regular_buffer_size + max_receive <= m_disk_recv_buffer_size);
-			m_socket->async_read_some(asio::buffer(m_disk_recv_buffer.get() + m_recv_pos - regular_buffer_size
-				, max_receive)
-				, make_read_handler(
-					bind(&peer_connection::on_receive_data, self(), _1, _2)
-				));
+			vec[num_buffers++] = asio::buffer(m_disk_recv_buffer.get()
+				+ m_recv_pos - regular_buffer_size, max_receive);
 		}
 		else
 		{
@@ -3783,16 +4308,110 @@ namespace libtorrent
 			TORRENT_ASSERT(max_receive - regular_buffer_size
 				+ m_recv_pos <= m_disk_recv_buffer_size);
 
-			boost::array<asio::mutable_buffer, 2> vec;
-			vec[0] = asio::buffer(&m_recv_buffer[m_recv_pos]
+			vec[num_buffers++] = asio::buffer(&m_recv_buffer[m_recv_pos]
 				, regular_buffer_size - m_recv_pos);
-			vec[1] = asio::buffer(m_disk_recv_buffer.get()
+			vec[num_buffers++] = asio::buffer(m_disk_recv_buffer.get()
 				, max_receive - regular_buffer_size + m_recv_pos);
-			m_socket->async_read_some(
-				vec, make_read_handler(
-					bind(&peer_connection::on_receive_data, self(), _1, _2)));
 		}
-		m_channel_state[download_channel] = peer_info::bw_network;
+
+		// only read ahead if this read completes the packet
+		int header_size = read_ahead_size();
+		if (header_size == 0
+			|| m_soft_packet_size != 0
+			|| m_recv_pos + max_receive != m_packet_size)
+			return;
+
+		int extra = m_ignore_bandwidth_limits ? 16 * 1024 + header_size
+			: m_quota[download_channel] - max_receive;
+		if (extra <= 0) return;
+
+		TORRENT_ASSERT(header_size <= int(sizeof(m_read_ahead_header)));
+		m_read_ahead_header_size = (std::min)(header_size, extra);
+		extra -= m_read_ahead_header_size;
+		vec[num_buffers++] = asio::buffer(m_read_ahead_header, m_read_ahead_header_size);
+		m_reading_ahead = true;
+
+		// the spare disk buffer is only worth holding on to
+		// if the peer is expected to send another block
+		int blocks_expected = int(m_download_queue.size())
+			- (m_disk_recv_buffer ? 1 : 0);
+		if (extra == 0 || blocks_expected <= 0) return;
+
+		if (!m_read_ahead_buffer)
+		{
+			m_read_ahead_buffer.reset(m_ses.allocate_disk_buffer("read ahead buffer"));
+			if (!m_read_ahead_buffer) return;
+		}
+
+		vec[num_buffers++] = asio::buffer(m_read_ahead_buffer.get()
+			, (std::min)(extra, 16 * 1024));
+	}
+
+	// passes the bytes a read received past the end of the previous
+	// packet to on_receive(), as if they had been received by separate
+	// reads. They are first in m_read_ahead_header, followed by the
+	// start of m_read_ahead_buffer
+	void peer_connection::consume_read_ahead(int bytes)
+	{
+		TORRENT_ASSERT(bytes > 0);
+		int offset = 0;
+		while (offset < bytes)
+		{
+			char const* src;
+			int left;
+			if (offset < m_read_ahead_header_size)
+			{
+				src = m_read_ahead_header + offset;
+				left = (std::min)(bytes, m_read_ahead_header_size) - offset;
+			}
+			else
+			{
+				src = m_read_ahead_buffer.get() + offset - m_read_ahead_header_size;
+				left = bytes - offset;
+			}
+
+			int regular_buffer_size = m_packet_size - m_disk_recv_buffer_size;
+			int chunk = (std::min)(left, m_packet_size - m_recv_pos);
+			if (chunk == 0)
+			{
+				// the previous packet was never finished, there's
+				// nowhere to put the bytes we already read
+				disconnect("failed to receive read ahead data", 2);
+				return;
+			}
+
+			if (m_disk_recv_buffer && m_recv_pos >= regular_buffer_size)
+			{
+				if (m_recv_pos == regular_buffer_size
+					&& offset == m_read_ahead_header_size
+					&& chunk == left)
+				{
+					// the payload was received at the start of the read
+					// ahead buffer and fits in this block. Use that buffer
+					// as the disk buffer, and the empty one for the next
+					// read ahead
+					m_disk_recv_buffer.swap(m_read_ahead_buffer);
+				}
+				else
+				{
+					std::memcpy(m_disk_recv_buffer.get() + m_recv_pos
+						- regular_buffer_size, src, chunk);
+				}
+			}
+			else
+			{
+				if (m_recv_pos + chunk > regular_buffer_size)
+					chunk = regular_buffer_size - m_recv_pos;
+				if (int(m_recv_buffer.size()) < regular_buffer_size)
+					m_ses.grow_recv_buffer(m_recv_buffer, regular_buffer_size);
+				std::memcpy(&m_recv_buffer[m_recv_pos], src, chunk);
+			}
+
+			m_recv_pos += chunk;
+			offset += chunk;
+			on_receive(error_code(), chunk);
+			if (m_disconnecting) return;
+		}
 	}
 
 #ifndef TORRENT_DISABLE_ENCRYPTION
@@ -3847,7 +4466,7 @@ namespace libtorrent
 	void peer_connection::send_buffer(char const* buf, int size, int flags)
 	{
 		if (flags == message_type_request)
-			m_requests_in_buffer.push_back(m_send_buffer.size() + size);
+			m_requests_in_buffer.push_back(send_buffer_size() + size);
 
 		int free_space = m_send_buffer.space_in_last_buffer();
 		if (free_space > size) free_space = size;
@@ -3862,7 +4481,19 @@ namespace libtorrent
 			m_ses.log_buffer_usage();
 #endif
 		}
-		if (size <= 0) return;
+		if (size <= 0)
+		{
+			setup_send();
+			return;
+		}
+
+		char* insert = m_send_buffer.allocate_inline(size);
+		if (insert)
+		{
+			std::memcpy(insert, buf, size);
+			setup_send();
+			return;
+		}
 
 		std::pair<char*, int> buffer = m_ses.allocate_buffer(size);
 		if (buffer.first == 0)
@@ -3873,7 +4504,7 @@ namespace libtorrent
 		TORRENT_ASSERT(buffer.second >= size);
 		std::memcpy(buffer.first, buf, size);
 		m_send_buffer.append_buffer(buffer.first, buffer.second, size
-			, bind(&session_impl::free_buffer, boost::ref(m_ses), _1, buffer.second));
+			, &session_impl::free_send_buffer, &m_ses);
 #ifdef TORRENT_STATS
 		m_ses.m_buffer_usage_logger << log_time() << " send_buffer_alloc: " << size << std::endl;
 		m_ses.log_buffer_usage();
@@ -3887,6 +4518,7 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(size > 0);
 		char* insert = m_send_buffer.allocate_appendix(size);
+		if (insert == 0) insert = m_send_buffer.allocate_inline(size);
 		if (insert == 0)
 		{
 			std::pair<char*, int> buffer = m_ses.allocate_buffer(size);
@@ -3897,7 +4529,7 @@ namespace libtorrent
 			}
 			TORRENT_ASSERT(buffer.second >= size);
 			m_send_buffer.append_buffer(buffer.first, buffer.second, size
-				, bind(&session_impl::free_buffer, boost::ref(m_ses), _1, buffer.second));
+				, &session_impl::free_send_buffer, &m_ses);
 			buffer::interval ret(buffer.first, buffer.first + size);
 #ifdef TORRENT_STATS
 			m_ses.m_buffer_usage_logger << log_time() << " allocate_buffer_alloc: " << size << std::endl;
@@ -3935,6 +4567,9 @@ namespace libtorrent
 		, std::size_t bytes_transferred)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+		aux::update_time_now();
+		m_ses.m_stats_counters.inc_stats_counter(counters::on_read_counter);
+		latency_timer receive_timer(m_ses.m_latency.peer_receive_time);
 
 		INVARIANT_CHECK;
 
@@ -3982,6 +4617,17 @@ namespace libtorrent
 			TORRENT_ASSERT(bytes_transferred > 0);
 
 			m_last_receive = time_now();
+
+			// bytes past the end of the packet were read
+			// ahead, they're handled once it's finished
+			int read_ahead = 0;
+			if (m_reading_ahead && int(bytes_transferred) > m_packet_size - m_recv_pos)
+			{
+				read_ahead = bytes_transferred - (m_packet_size - m_recv_pos);
+				bytes_transferred -= read_ahead;
+			}
+			m_reading_ahead = false;
+
 			m_recv_pos += bytes_transferred;
 			TORRENT_ASSERT(m_recv_pos <= int(m_recv_buffer.size()
 				+ m_disk_recv_buffer_size));
@@ -3999,13 +4645,24 @@ namespace libtorrent
 			TORRENT_ASSERT(stats_diff == bytes_transferred);
 #endif
 
+			if (read_ahead > 0 && !m_disconnecting)
+				consume_read_ahead(read_ahead);
+
+			if (m_disconnecting)
+			{
+				m_statistics.trancieve_ip_packet(bytes_in_loop, m_remote.address().is_v6());
+				return;
+			}
+
 			TORRENT_ASSERT(m_packet_size > 0);
 
 			if (m_peer_choked
 				&& m_recv_pos == 0
 				&& (m_recv_buffer.capacity() - m_packet_size) > 128)
 			{
-				buffer(m_packet_size).swap(m_recv_buffer);
+				// the buffer is handed out again, in a smaller
+				// size class, the next time something is read
+				m_ses.release_recv_buffer(m_recv_buffer);
 			}
 
 			if (m_recv_pos >= m_soft_packet_size) m_soft_packet_size = 0;
@@ -4018,44 +4675,10 @@ namespace libtorrent
 
 			if (max_receive == 0) break;
 
-			int regular_buffer_size = m_packet_size - m_disk_recv_buffer_size;
-
-			if (int(m_recv_buffer.size()) < regular_buffer_size)
-				m_recv_buffer.resize(regular_buffer_size);
-
-			error_code ec;	
-			if (!m_disk_recv_buffer || regular_buffer_size >= m_recv_pos + max_receive)
-			{
-				// only receive into regular buffer
-				TORRENT_ASSERT(m_recv_pos + max_receive <= int(m_recv_buffer.size()));
-				bytes_transferred = m_socket->read_some(asio::buffer(&m_recv_buffer[m_recv_pos]
-					, max_receive), ec);
-			}
-			else if (m_recv_pos >= regular_buffer_size)
-			{
-				// only receive into disk buffer
-				TORRENT_ASSERT(m_recv_pos - regular_buffer_size >= 0);
-				TORRENT_ASSERT(m_recv_pos - regular_buffer_size + max_receive <= m_disk_recv_buffer_size);
-				bytes_transferred = m_socket->read_some(asio::buffer(m_disk_recv_buffer.get()
-					+ m_recv_pos - regular_buffer_size, (std::min)(m_packet_size
-					- m_recv_pos, max_receive)), ec);
-			}
-			else
-			{
-				// receive into both regular and disk buffer
-				TORRENT_ASSERT(max_receive + m_recv_pos > regular_buffer_size);
-				TORRENT_ASSERT(m_recv_pos < regular_buffer_size);
-				TORRENT_ASSERT(max_receive - regular_buffer_size
-					+ m_recv_pos <= m_disk_recv_buffer_size);
-
-				boost::array<asio::mutable_buffer, 2> vec;
-				vec[0] = asio::buffer(&m_recv_buffer[m_recv_pos]
-					, regular_buffer_size - m_recv_pos);
-				vec[1] = asio::buffer(m_disk_recv_buffer.get()
-					, (std::min)(m_disk_recv_buffer_size
-					, max_receive - regular_buffer_size + m_recv_pos));
-				bytes_transferred = m_socket->read_some(vec, ec);
-			}
+			error_code ec;
+			boost::array<asio::mutable_buffer, 4> vec;
+			setup_receive_buffers(max_receive, vec);
+			bytes_transferred = m_socket->read_some(vec, ec);
 			if (ec && ec != asio::error::would_block)
 			{
 				m_statistics.trancieve_ip_packet(bytes_in_loop, m_remote.address().is_v6());
@@ -4071,11 +4694,52 @@ namespace libtorrent
 		setup_receive();	
 	}
 
+	void peer_connection::on_uncork()
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		TORRENT_ASSERT(m_corked);
+		m_corked = false;
+		if (m_disconnecting) return;
+
+		m_uncorking = true;
+		setup_send();
+		m_uncorking = false;
+	}
+
+	// called when an idle connection's socket has become readable
+	void peer_connection::on_receive_ready(error_code const& error)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(m_channel_state[download_channel] == peer_info::bw_network);
+		m_channel_state[download_channel] = peer_info::bw_idle;
+
+		if (error)
+		{
+#if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_ERROR_LOGGING
+			(*m_logger) << time_now_string() << " **ERROR**: "
+				<< error.message() << "[in peer_connection::on_receive_ready]\n";
+#endif
+			disconnect(error.message().c_str());
+			return;
+		}
+
+		if (m_disconnecting) return;
+
+		// the data is already waiting, so this read
+		// into a buffer completes right away
+		m_readable = true;
+		setup_receive();
+	}
+
 	bool peer_connection::can_write() const
 	{
 		// if we have requests or pending data to be sent or announcements to be made
 		// we want to send data
-		return !m_send_buffer.empty()
+		return send_buffer_size() > 0
 			&& (m_quota[upload_channel] > 0
 				|| m_ignore_bandwidth_limits)
 			&& !m_connecting;
@@ -4088,6 +4752,14 @@ namespace libtorrent
 			&& !m_connecting
 			&& m_outstanding_writing_bytes <=
 				m_ses.settings().max_outstanding_disk_bytes_per_connection;
+
+		// the device the torrent writes to has too much in the
+		// write cache. Stop receiving until it's written some
+		if (ret && m_ses.m_write_throttling)
+		{
+			boost::shared_ptr<torrent> t = m_torrent.lock();
+			if (t && t->write_throttled()) ret = false;
+		}
 		
 		return ret;
 	}
@@ -4193,7 +4865,9 @@ namespace libtorrent
 		if (m_disconnecting) return;
 
 		m_connecting = false;
-		m_ses.m_half_open.done(m_connection_ticket);
+		m_ses.m_half_open.done(m_connection_ticket, e
+			? connection_queue::connect_failed
+			: connection_queue::connect_succeeded);
 
 		error_code ec;
 		if (e)
@@ -4202,6 +4876,9 @@ namespace libtorrent
 			(*m_ses.m_logger) << time_now_string() << " CONNECTION FAILED: " << m_remote.address().to_string(ec)
 				<< ": " << e.message() << "\n";
 #endif
+			// try TCP the next time
+			if (m_peer_info && m_socket->get<utp_stream>())
+				m_peer_info->supports_utp = false;
 			disconnect(e.message().c_str(), 1);
 			return;
 		}
@@ -4243,10 +4920,100 @@ namespace libtorrent
 	// SEND DATA
 	// --------------------------
 
+	void peer_connection::append_send_file(boost::shared_ptr<file> const& f
+		, size_type offset, int size)
+	{
+		TORRENT_ASSERT(size > 0);
+		file_send fs;
+		fs.f = f;
+		fs.offset = offset;
+		fs.size = size;
+		fs.position = m_send_buffer.size();
+		m_file_sends.push_back(fs);
+		m_file_send_bytes += size;
+	}
+
+	// removes bytes that were sent from the front of the send buffer,
+	// or of the file range with nothing left to send in front of it
+	void peer_connection::pop_send_buffer(int bytes)
+	{
+		if (!m_file_sends.empty() && m_file_sends.front().position == 0)
+		{
+			file_send& fs = m_file_sends.front();
+			TORRENT_ASSERT(bytes <= fs.size);
+			fs.offset += bytes;
+			fs.size -= bytes;
+			m_file_send_bytes -= bytes;
+			if (fs.size == 0) m_file_sends.pop_front();
+			return;
+		}
+
+		m_send_buffer.pop_front(bytes);
+		for (std::deque<file_send>::iterator i = m_file_sends.begin()
+			, end(m_file_sends.end()); i != end; ++i)
+		{
+			TORRENT_ASSERT(i->position >= bytes);
+			i->position -= bytes;
+		}
+	}
+
+	// the socket is writable, send as much of the file range at the
+	// front of the send buffer as the quota allows
+	void peer_connection::on_sendfile_ready(error_code const& error
+		, std::size_t)
+	{
+		error_code ec = error;
+		int bytes_transferred = 0;
+		{
+			session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+			TORRENT_ASSERT(m_channel_state[upload_channel] == peer_info::bw_network);
+			TORRENT_ASSERT(!m_file_sends.empty());
+			TORRENT_ASSERT(m_file_sends.front().position == 0);
+
+#if TORRENT_USE_SENDFILE
+			if (!ec && !m_disconnecting)
+			{
+				file_send const& fs = m_file_sends.front();
+				int amount_to_send = fs.size;
+				if (!m_ignore_bandwidth_limits && amount_to_send > m_quota[upload_channel])
+					amount_to_send = m_quota[upload_channel];
+				TORRENT_ASSERT(amount_to_send > 0);
+
+				stream_socket* s = m_socket->get<stream_socket>();
+#if BOOST_VERSION >= 104700
+				int fd = s->native_handle();
+#else
+				int fd = s->native();
+#endif
+				bytes_transferred = fs.f->sendfile(fd, fs.offset, amount_to_send, ec);
+
+				if (bytes_transferred < 0 && (ec.value() == EAGAIN || ec.value() == EWOULDBLOCK))
+				{
+					// someone else filled the socket buffer
+					// before we got to it, wait again
+					s->async_write_some(asio::null_buffers(), make_write_handler(bind(
+						&peer_connection::on_sendfile_ready, self(), _1, _2)));
+					return;
+				}
+				// the file was truncated behind our back
+				if (bytes_transferred == 0)
+					ec = error_code(errors::file_too_short, libtorrent_category);
+				if (bytes_transferred < 0) bytes_transferred = 0;
+			}
+#else
+			TORRENT_ASSERT(false);
+#endif
+		}
+		on_send_data(ec, bytes_transferred);
+	}
+
 	void peer_connection::on_send_data(error_code const& error
 		, std::size_t bytes_transferred)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+		aux::update_time_now();
+		m_ses.m_stats_counters.inc_stats_counter(counters::on_write_counter);
 
 		INVARIANT_CHECK;
 
@@ -4256,7 +5023,7 @@ namespace libtorrent
 
 		TORRENT_ASSERT(m_channel_state[upload_channel] == peer_info::bw_network);
 
-		m_send_buffer.pop_front(bytes_transferred);
+		pop_send_buffer(bytes_transferred);
 
 		for (std::vector<int>::iterator i = m_requests_in_buffer.begin()
 			, end(m_requests_in_buffer.end()); i != end; ++i)
@@ -4310,6 +5077,11 @@ namespace libtorrent
 
 		fill_send_buffer();
 
+		// everything we had has been sent, and the rest is still
+		// being read from disk
+		if (send_buffer_size() == 0 && m_reading_bytes > 0)
+			m_ses.m_stats_counters.inc_stats_counter(counters::num_send_buffer_drained);
+
 		setup_send();
 	}
 
@@ -90,6 +90,9 @@ namespace libtorrent
 			, piece_pos(0, 0));
 		m_reverse_cursor = int(m_piece_map.size());
 		m_cursor = 0;
+		m_refcount_delta.clear();
+		m_refcount_pending.clear();
+		m_download_index.assign(m_piece_map.size(), -1);
 
 		m_num_filtered += m_num_have_filtered;
 		m_num_have_filtered = 0;
@@ -132,9 +135,7 @@ namespace libtorrent
 
 		if (m_piece_map[index].downloading)
 		{
-			std::vector<downloading_piece>::const_iterator piece = std::find_if(
-				m_downloads.begin(), m_downloads.end()
-				, bind(&downloading_piece::index, _1) == index);
+			std::vector<downloading_piece>::const_iterator piece = find_download(index);
 			TORRENT_ASSERT(piece != m_downloads.end());
 			st = *piece;
 			st.info = 0;
@@ -152,12 +153,35 @@ namespace libtorrent
 		st.finished = 0;
 	}
 
-	piece_picker::downloading_piece& piece_picker::add_download_piece()
+	std::vector<piece_picker::downloading_piece>::iterator piece_picker::find_download(int piece)
 	{
-		int num_downloads = m_downloads.size();
-		int block_index = num_downloads * m_blocks_per_piece;
-		if (int(m_block_info.size()) < block_index + m_blocks_per_piece)
+		TORRENT_ASSERT(piece >= 0 && piece < int(m_download_index.size()));
+		int i = m_download_index[piece];
+		if (i < 0 || i >= int(m_downloads.size()) || m_downloads[i].index != piece)
+			return m_downloads.end();
+		return m_downloads.begin() + i;
+	}
+
+	std::vector<piece_picker::downloading_piece>::const_iterator piece_picker::find_download(int piece) const
+	{
+		TORRENT_ASSERT(piece >= 0 && piece < int(m_download_index.size()));
+		int i = m_download_index[piece];
+		if (i < 0 || i >= int(m_downloads.size()) || m_downloads[i].index != piece)
+			return m_downloads.end();
+		return m_downloads.begin() + i;
+	}
+
+	piece_picker::downloading_piece& piece_picker::add_download_piece(int piece)
+	{
+		int block_index;
+		if (!m_free_block_info.empty())
+		{
+			block_index = m_free_block_info.back() * m_blocks_per_piece;
+			m_free_block_info.pop_back();
+		}
+		else
 		{
+			block_index = int(m_block_info.size());
 			block_info* base = 0;
 			if (!m_block_info.empty()) base = &m_block_info[0];
 			m_block_info.resize(block_index + m_blocks_per_piece);
@@ -170,6 +194,8 @@ namespace libtorrent
 		}
 		m_downloads.push_back(downloading_piece());
 		downloading_piece& ret = m_downloads.back();
+		ret.index = piece;
+		m_download_index[piece] = int(m_downloads.size()) - 1;
 		ret.info = &m_block_info[block_index];
 		for (int i = 0; i < m_blocks_per_piece; ++i)
 		{
@@ -182,18 +208,12 @@ namespace libtorrent
 
 	void piece_picker::erase_download_piece(std::vector<downloading_piece>::iterator i)
 	{
-		std::vector<downloading_piece>::iterator other = std::find_if(
-			m_downloads.begin(), m_downloads.end()
-			, bind(&downloading_piece::info, _1)
-			== &m_block_info[(m_downloads.size() - 1) * m_blocks_per_piece]);
-		TORRENT_ASSERT(other != m_downloads.end());
-
-		if (i != other)
-		{
-			std::copy(other->info, other->info + m_blocks_per_piece, i->info);
-			other->info = i->info;
-		}
-		m_downloads.erase(i);
+		// the block info slot is reused by the next piece
+		// that starts downloading
+		m_free_block_info.push_back(int(i->info - &m_block_info[0]) / m_blocks_per_piece);
+		m_download_index[i->index] = -1;
+		for (i = m_downloads.erase(i); i != m_downloads.end(); ++i)
+			m_download_index[i->index] = int(i - m_downloads.begin());
 	}
 
 #ifdef TORRENT_DEBUG
@@ -444,6 +464,7 @@ namespace libtorrent
 			if (i->downloading == 1)
 			{
 				TORRENT_ASSERT(count == 1);
+				TORRENT_ASSERT(find_download(index) != m_downloads.end());
 			}
 			else
 			{
@@ -468,6 +489,7 @@ namespace libtorrent
 	float piece_picker::distributed_copies() const
 	{
 		TORRENT_ASSERT(m_seeds >= 0);
+		update_refcounts();
 		const float num_pieces = static_cast<float>(m_piece_map.size());
 
 		int min_availability = piece_pos::max_peer_count;
@@ -502,7 +524,7 @@ namespace libtorrent
 		return float(min_availability + m_seeds) + (fraction_part / num_pieces);
 	}
 
-	void piece_picker::priority_range(int prio, int* start, int* end)
+	void piece_picker::priority_range(int prio, int* start, int* end) const
 	{
 		TORRENT_ASSERT(prio >= 0);
 		TORRENT_ASSERT(prio < int(m_priority_boundries.size())
@@ -513,7 +535,7 @@ namespace libtorrent
 		TORRENT_ASSERT(*start <= *end);
 	}
 
-	void piece_picker::add(int index)
+	void piece_picker::add(int index) const
 	{
 		TORRENT_ASSERT(!m_dirty);
 		TORRENT_ASSERT(index >= 0);
@@ -580,7 +602,7 @@ namespace libtorrent
 		}
 	}
 
-	void piece_picker::remove(int priority, int elem_index)
+	void piece_picker::remove(int priority, int elem_index) const
 	{
 		TORRENT_ASSERT(!m_dirty);
 		TORRENT_ASSERT(priority >= 0);
@@ -624,7 +646,7 @@ namespace libtorrent
 
 	// will update the piece with the given properties (priority, elem_index)
 	// to place it at the correct position
-	void piece_picker::update(int priority, int elem_index)
+	void piece_picker::update(int priority, int elem_index) const
 	{
 		TORRENT_ASSERT(!m_dirty);
 		TORRENT_ASSERT(priority >= 0);
@@ -729,7 +751,7 @@ namespace libtorrent
 		}
 	}
 
-	void piece_picker::shuffle(int priority, int elem_index)
+	void piece_picker::shuffle(int priority, int elem_index) const
 	{
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "shuffle()" << std::endl;
@@ -770,6 +792,8 @@ namespace libtorrent
 			if (j->finished + j->writing >= complete) return;
 			using std::swap;
 			swap(*j, *i);
+			m_download_index[i->index] = int(i - m_downloads.begin());
+			m_download_index[j->index] = int(j - m_downloads.begin());
 			if (j == m_downloads.begin()) break;
 		}
 	}
@@ -784,8 +808,7 @@ namespace libtorrent
 		TORRENT_ASSERT(m_piece_map[index].downloading == 1);
 
 		std::vector<downloading_piece>::iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end()
-			, has_index(index));
+			= find_download(index);
 
 		TORRENT_ASSERT(i != m_downloads.end());
 #ifdef TORRENT_DEBUG
@@ -845,6 +868,7 @@ namespace libtorrent
 			return;
 		}
 		TORRENT_ASSERT(m_seeds == 0);
+		update_refcounts();
 
 		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
 			, end(m_piece_map.end()); i != end; ++i)
@@ -862,17 +886,18 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 
-		piece_pos& p = m_piece_map[index];
-	
-		int prev_priority = p.priority(this);
-		++p.peer_count;
-		if (m_dirty) return;
-		int new_priority = p.priority(this);
-		if (prev_priority == new_priority) return;
-		if (prev_priority == -1)
-			add(index);
-		else
-			update(prev_priority, p.index);
+		TORRENT_ASSERT(index >= 0 && index < int(m_piece_map.size()));
+		if (m_dirty)
+		{
+			++m_piece_map[index].peer_count;
+			return;
+		}
+
+		if (m_refcount_delta.empty()) m_refcount_delta.resize(m_piece_map.size(), 0);
+		boost::int16_t& d = m_refcount_delta[index];
+		if (d == 0) m_refcount_pending.push_back(index);
+		++d;
+		if (m_refcount_pending.size() >= m_piece_map.size()) update_refcounts();
 	}
 
 	void piece_picker::dec_refcount(int index)
@@ -881,12 +906,55 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 
-		piece_pos& p = m_piece_map[index];
-		int prev_priority = p.priority(this);
-		TORRENT_ASSERT(p.peer_count > 0);
-		--p.peer_count;
-		if (m_dirty) return;
-		if (prev_priority >= 0) update(prev_priority, p.index);
+		TORRENT_ASSERT(index >= 0 && index < int(m_piece_map.size()));
+		int pending = m_refcount_delta.empty() ? 0 : m_refcount_delta[index];
+		if (int(m_piece_map[index].peer_count) + pending == 0)
+		{
+			// the peer count of this piece has been taken off
+			// by a near-seed, it's counted in m_seeds instead
+			expand_seed();
+		}
+
+		if (m_dirty)
+		{
+			update_refcounts();
+			TORRENT_ASSERT(m_piece_map[index].peer_count > 0);
+			--m_piece_map[index].peer_count;
+			return;
+		}
+
+		if (m_refcount_delta.empty()) m_refcount_delta.resize(m_piece_map.size(), 0);
+		boost::int16_t& d = m_refcount_delta[index];
+		TORRENT_ASSERT(int(m_piece_map[index].peer_count) + d > 0);
+		if (d == 0) m_refcount_pending.push_back(index);
+		--d;
+		if (m_refcount_pending.size() >= m_piece_map.size()) update_refcounts();
+	}
+
+	void piece_picker::update_refcounts() const
+	{
+		for (std::vector<int>::const_iterator i = m_refcount_pending.begin()
+			, end(m_refcount_pending.end()); i != end; ++i)
+		{
+			boost::int16_t& d = m_refcount_delta[*i];
+			// the changes added up to 0, or the piece
+			// was queued more than once
+			if (d == 0) continue;
+
+			piece_pos& p = m_piece_map[*i];
+			int prev_priority = p.priority(this);
+			TORRENT_ASSERT(int(p.peer_count) + d >= 0);
+			p.peer_count += d;
+			d = 0;
+			if (m_dirty) continue;
+			int new_priority = p.priority(this);
+			if (prev_priority == new_priority) continue;
+			if (prev_priority == -1)
+				add(*i);
+			else
+				update(prev_priority, p.index);
+		}
+		m_refcount_pending.clear();
 	}
 
 	void piece_picker::inc_refcount(bitfield const& bitmask)
@@ -895,17 +963,28 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 		TORRENT_ASSERT(bitmask.size() == m_piece_map.size());
+		// the counts are changed in place below, the queued
+		// changes have to be in them first
+		update_refcounts();
 
-		int index = 0;
+		// peers missing less than 10% of the pieces are
+		// counted as seeds minus the pieces they're missing
+		int num_pieces = int(m_piece_map.size());
+		if ((num_pieces - bitmask.count()) * 10 < num_pieces
+			&& inc_refcount_near_seed(bitmask))
+			return;
+
+		// only the set bits are visited, runs of pieces the
+		// peer doesn't have are skipped a word at a time. The
+		// priority buckets are rebuilt once, the next time
+		// they're needed, no matter how many bitfields are added
 		bool updated = false;
-		for (bitfield::const_iterator i = bitmask.begin()
-			, end(bitmask.end()); i != end; ++i, ++index)
+		for (int index = bitmask.find_first_set(0); index != -1;
+			index = bitmask.find_first_set(index + 1))
 		{
-			if (*i)
-			{
-				++m_piece_map[index].peer_count;
-				updated = true;
-			}
+			TORRENT_ASSERT(m_piece_map[index].peer_count < piece_pos::max_peer_count);
+			++m_piece_map[index].peer_count;
+			updated = true;
 		}
 
 		if (updated) m_dirty = true;
@@ -917,25 +996,113 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 		TORRENT_ASSERT(bitmask.size() == m_piece_map.size());
+		// the counts are changed in place below, the queued
+		// changes have to be in them first
+		update_refcounts();
+
+		// it doesn't matter whether the peer was added as a
+		// near-seed or not, the availability is the same
+		int num_pieces = int(m_piece_map.size());
+		if ((num_pieces - bitmask.count()) * 10 < num_pieces
+			&& dec_refcount_near_seed(bitmask))
+			return;
 
-		int index = 0;
 		bool updated = false;
-		for (bitfield::const_iterator i = bitmask.begin()
-			, end(bitmask.end()); i != end; ++i, ++index)
+		for (int index = bitmask.find_first_set(0); index != -1;
+			index = bitmask.find_first_set(index + 1))
 		{
-			if (*i)
+			if (m_piece_map[index].peer_count == 0) expand_seed();
+			--m_piece_map[index].peer_count;
+			updated = true;
+		}
+
+		if (updated) m_dirty = true;
+	}
+
+	bool piece_picker::inc_refcount_near_seed(bitfield const& bitmask)
+	{
+		for (int i = bitmask.find_first_clear(0); i != -1;
+			i = bitmask.find_first_clear(i + 1))
+		{
+			if (m_piece_map[i].peer_count == 0) return false;
+		}
+
+		++m_seeds;
+		// when m_seeds is increased from 0 to 1 we
+		// may have to add pieces that didn't have any peers
+		if (m_seeds == 1) m_dirty = true;
+
+		for (int i = bitmask.find_first_clear(0); i != -1;
+			i = bitmask.find_first_clear(i + 1))
+		{
+			piece_pos& p = m_piece_map[i];
+			if (m_dirty)
 			{
-				--m_piece_map[index].peer_count;
-				updated = true;
+				--p.peer_count;
+				continue;
 			}
+			int prev_priority = p.priority(this);
+			--p.peer_count;
+			int new_priority = p.priority(this);
+			if (prev_priority == new_priority) continue;
+			update(prev_priority, p.index);
 		}
+		return true;
+	}
 
-		if (updated) m_dirty = true;
+	bool piece_picker::dec_refcount_near_seed(bitfield const& bitmask)
+	{
+		if (m_seeds == 0) return false;
+
+		for (int i = bitmask.find_first_clear(0); i != -1;
+			i = bitmask.find_first_clear(i + 1))
+		{
+			if (m_piece_map[i].peer_count == piece_pos::max_peer_count) return false;
+		}
+
+		--m_seeds;
+		// when m_seeds is decreased from 1 to 0 we may have
+		// to remove pieces that don't have any peers anymore
+		if (m_seeds == 0) m_dirty = true;
+
+		for (int i = bitmask.find_first_clear(0); i != -1;
+			i = bitmask.find_first_clear(i + 1))
+		{
+			piece_pos& p = m_piece_map[i];
+			if (m_dirty)
+			{
+				++p.peer_count;
+				continue;
+			}
+			int prev_priority = p.priority(this);
+			++p.peer_count;
+			int new_priority = p.priority(this);
+			if (prev_priority == new_priority) continue;
+			update(prev_priority, p.index);
+		}
+		return true;
+	}
+
+	void piece_picker::expand_seed()
+	{
+		TORRENT_ASSERT(m_seeds > 0);
+		update_refcounts();
+		--m_seeds;
+		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
+			, end(m_piece_map.end()); i != end; ++i)
+		{
+			TORRENT_ASSERT(i->peer_count < piece_pos::max_peer_count);
+			++i->peer_count;
+		}
+		m_dirty = true;
 	}
 
 	void piece_picker::update_pieces() const
 	{
 		TORRENT_ASSERT(m_dirty);
+		// the queued peer count changes are just applied, since
+		// all pieces are put in place below
+		update_refcounts();
 		if (m_priority_boundries.empty()) m_priority_boundries.resize(1, 0);
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "update_pieces" << std::endl;
@@ -1066,16 +1233,13 @@ namespace libtorrent
 		if (p.downloading)
 		{
 			std::vector<downloading_piece>::iterator i
-				= std::find_if(m_downloads.begin()
-				, m_downloads.end()
-				, has_index(index));
+				= find_download(index);
 			TORRENT_ASSERT(i != m_downloads.end());
 			erase_download_piece(i);
 			p.downloading = 0;
 		}
 
-		TORRENT_ASSERT(std::find_if(m_downloads.begin(), m_downloads.end()
-			, has_index(index)) == m_downloads.end());
+		TORRENT_ASSERT(find_download(index) == m_downloads.end());
 
 		if (p.have()) return;
 
@@ -1240,6 +1404,28 @@ namespace libtorrent
 		return ret;
 	}
 
+	bool piece_picker::set_piece_priorities(int first, std::vector<int> const& prio)
+	{
+		TORRENT_ASSERT(first >= 0);
+		TORRENT_ASSERT(first + int(prio.size()) <= int(m_piece_map.size()));
+
+		int changed = 0;
+		for (int i = 0; i < int(prio.size()); ++i)
+			if (int(m_piece_map[first + i].piece_priority) != prio[i]) ++changed;
+		if (changed == 0) return false;
+
+		// moving a piece between buckets is linear in the number of
+		// buckets. Past a small share of the pieces, it's cheaper to
+		// rebuild the piece list once, the next time it's used
+		if (changed > 16 && changed > int(m_piece_map.size()) / 64)
+			m_dirty = true;
+
+		bool ret = false;
+		for (int i = 0; i < int(prio.size()); ++i)
+			ret |= set_piece_priority(first + i, prio[i]);
+		return ret;
+	}
+
 	int piece_picker::piece_priority(int index) const
 	{
 		TORRENT_ASSERT(index >= 0);
@@ -1351,6 +1537,8 @@ namespace libtorrent
 		TORRENT_ASSERT(num_blocks > 0);
 		TORRENT_ASSERT(pieces.size() == m_piece_map.size());
 
+		update_refcounts();
+
 		TORRENT_ASSERT(!m_priority_boundries.empty()
 			|| m_dirty);
 
@@ -1422,7 +1610,9 @@ namespace libtorrent
 			}
 			else
 			{
-				for (int i = m_cursor; i < m_reverse_cursor; ++i)
+				// skip straight to the pieces the peer has
+				for (int i = pieces.find_first_set(m_cursor);
+					i >= 0 && i < m_reverse_cursor; i = pieces.find_first_set(i + 1))
 				{	
 					if (!is_piece_free(i, pieces)) continue;
 					num_blocks = add_blocks(i, pieces
@@ -1457,27 +1647,20 @@ namespace libtorrent
 				
 					TORRENT_ASSERT(prio >= 0);
 					TORRENT_ASSERT(prio < int(m_priority_boundries.size()));
-					int start = prio == 0 ? 0 : m_priority_boundries[prio - 1];
-					for (int p = start; p < m_priority_boundries[prio]; ++p)
-					{
-						if (!is_piece_free(m_pieces[p], pieces)) continue;
-						num_blocks = add_blocks(m_pieces[p], pieces
-							, interesting_blocks, backup_blocks
-							, backup_blocks2, num_blocks
-							, prefer_whole_pieces, peer, suggested_pieces
-							, speed, options);
-						if (num_blocks <= 0) return;
-					}
+					num_blocks = add_blocks_bucket(prio, pieces
+						, interesting_blocks, backup_blocks
+						, backup_blocks2, num_blocks
+						, prefer_whole_pieces, peer, suggested_pieces
+						, speed, options);
+					if (num_blocks <= 0) return;
 				}
 #undef div_round_up
 			}
 			else
 			{
-				for (std::vector<int>::const_iterator i = m_pieces.begin();
-					i != m_pieces.end(); ++i)
+				for (int prio = 0; prio < int(m_priority_boundries.size()); ++prio)
 				{
-					if (!is_piece_free(*i, pieces)) continue;
-					num_blocks = add_blocks(*i, pieces
+					num_blocks = add_blocks_bucket(prio, pieces
 						, interesting_blocks, backup_blocks
 						, backup_blocks2, num_blocks
 						, prefer_whole_pieces, peer, suggested_pieces
@@ -1504,10 +1687,16 @@ namespace libtorrent
 					, suggested_pieces.end(), piece)
 					== suggested_pieces.end())
 				{
-					++piece;
-					if (piece == int(m_piece_map.size())) piece = 0;
+					// skip to the next piece the peer has, wrapping
+					// around at the end
+					int next = pieces.find_first_set(piece + 1);
+					if (next < 0 && piece >= start_piece)
+						next = pieces.find_first_set(0);
 					// could not find any more pieces
-					if (piece == start_piece) { done = true; break; }
+					if (next < 0 || (next >= start_piece
+						&& (piece < start_piece || next <= piece)))
+					{ done = true; break; }
+					piece = next;
 				}
 				if (done) break;
 
@@ -1623,7 +1812,7 @@ namespace libtorrent
 				if (have_piece(i)) continue;
 
 				std::vector<downloading_piece>::const_iterator k
-					= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(i));
+					= find_download(i);
 
 				TORRENT_ASSERT(k != m_downloads.end());
 				if (k == m_downloads.end()) continue;
@@ -1725,7 +1914,7 @@ namespace libtorrent
 			if (options & prioritize_partials) return num_blocks;
 
 			std::vector<downloading_piece>::const_iterator i
-				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(piece));
+				= find_download(piece);
 			TORRENT_ASSERT(i != m_downloads.end());
 
 //			std::cout << "add_blocks_downloading(" << piece << ")" << std::endl;
@@ -1735,6 +1924,17 @@ namespace libtorrent
 				, num_blocks, prefer_whole_pieces, peer, speed, options);
 		}
 
+		return add_blocks_free(piece, pieces, interesting_blocks
+			, num_blocks, prefer_whole_pieces);
+	}
+
+	int piece_picker::add_blocks_free(int piece, bitfield const& pieces
+		, std::vector<piece_block>& interesting_blocks
+		, int num_blocks, int prefer_whole_pieces) const
+	{
+		TORRENT_ASSERT(is_piece_free(piece, pieces));
+		TORRENT_ASSERT(!m_piece_map[piece].downloading);
+
 		int num_blocks_in_piece = blocks_in_piece(piece);
 
 		// pick a new piece
@@ -1768,6 +1968,53 @@ namespace libtorrent
 		return num_blocks;
 	}
 
+	int piece_picker::add_blocks_bucket(int prio, bitfield const& pieces
+		, std::vector<piece_block>& interesting_blocks
+		, std::vector<piece_block>& backup_blocks
+		, std::vector<piece_block>& backup_blocks2
+		, int num_blocks, int prefer_whole_pieces
+		, void* peer, std::vector<int> const& ignore
+		, piece_state_t speed, int options) const
+	{
+		TORRENT_ASSERT(!m_dirty);
+		TORRENT_ASSERT(prio >= 0 && prio < int(m_priority_boundries.size()));
+
+		// downloading pieces are always in the buckets at
+		// even multiples of prio_factor
+		bool downloading = (prio % prio_factor) == 0;
+
+		// if we're prioritizing partials, we've already
+		// looked through the downloading pieces
+		if (downloading && (options & prioritize_partials)) return num_blocks;
+
+		int start = prio == 0 ? 0 : m_priority_boundries[prio - 1];
+		int end = m_priority_boundries[prio];
+		for (int p = start; p < end; ++p)
+		{
+			int piece = m_pieces[p];
+			if (!pieces[piece]) continue;
+			TORRENT_ASSERT(is_piece_free(piece, pieces));
+			TORRENT_ASSERT(m_piece_map[piece].priority(this) == prio);
+
+			if (downloading)
+			{
+				num_blocks = add_blocks(piece, pieces
+					, interesting_blocks, backup_blocks, backup_blocks2
+					, num_blocks, prefer_whole_pieces, peer, ignore
+					, speed, options);
+			}
+			else
+			{
+				if (std::find(ignore.begin(), ignore.end(), piece) != ignore.end())
+					continue;
+				num_blocks = add_blocks_free(piece, pieces, interesting_blocks
+					, num_blocks, prefer_whole_pieces);
+			}
+			if (num_blocks <= 0) return 0;
+		}
+		return num_blocks;
+	}
+
 	int piece_picker::add_blocks_downloading(downloading_piece const& dp
 		, bitfield const& pieces
 		, std::vector<piece_block>& interesting_blocks
@@ -1813,7 +2060,14 @@ namespace libtorrent
 		{
 			// ignore completed blocks and already requested blocks
 			block_info const& info = dp.info[j];
-			if (info.state != block_info::state_none) continue;
+			if (info.state != block_info::state_none)
+			{
+				if ((options & time_critical_mode)
+					&& info.state == block_info::state_requested
+					&& info.peer != peer)
+					backup_blocks.push_back(piece_block(dp.index, j));
+				continue;
+			}
 
 			TORRENT_ASSERT(dp.info[j].state == block_info::state_none);
 
@@ -1895,12 +2149,11 @@ namespace libtorrent
 
 		if (m_piece_map[index].downloading == 0)
 		{
-			TORRENT_ASSERT(std::find_if(m_downloads.begin(), m_downloads.end()
-				, has_index(index)) == m_downloads.end());
+			TORRENT_ASSERT(find_download(index) == m_downloads.end());
 			return false;
 		}
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(index));
+			= find_download(index);
 		TORRENT_ASSERT(i != m_downloads.end());
 		TORRENT_ASSERT((int)i->finished <= m_blocks_per_piece);
 		int max_blocks = blocks_in_piece(index);
@@ -1925,10 +2178,7 @@ namespace libtorrent
 
 		if (m_piece_map[block.piece_index].downloading == 0) return false;
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(
-				m_downloads.begin()
-				, m_downloads.end()
-				, has_index(block.piece_index));
+			= find_download(block.piece_index);
 
 		TORRENT_ASSERT(i != m_downloads.end());
 		return i->info[block.block_index].state == block_info::state_requested;
@@ -1943,7 +2193,7 @@ namespace libtorrent
 		if (m_piece_map[block.piece_index].index == piece_pos::we_have_index) return true;
 		if (m_piece_map[block.piece_index].downloading == 0) return false;
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+			= find_download(block.piece_index);
 		TORRENT_ASSERT(i != m_downloads.end());
 		return i->info[block.block_index].state == block_info::state_finished
 			|| i->info[block.block_index].state == block_info::state_writing;
@@ -1958,7 +2208,7 @@ namespace libtorrent
 		if (m_piece_map[block.piece_index].index == piece_pos::we_have_index) return true;
 		if (m_piece_map[block.piece_index].downloading == 0) return false;
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+			= find_download(block.piece_index);
 		TORRENT_ASSERT(i != m_downloads.end());
 		return i->info[block.block_index].state == block_info::state_finished;
 	}
@@ -1986,9 +2236,8 @@ namespace libtorrent
 			p.downloading = 1;
 			if (prio >= 0 && !m_dirty) update(prio, p.index);
 
-			downloading_piece& dp = add_download_piece();
+			downloading_piece& dp = add_download_piece(block.piece_index);
 			dp.state = state;
-			dp.index = block.piece_index;
 			block_info& info = dp.info[block.block_index];
 			info.state = block_info::state_requested;
 			info.peer = peer;
@@ -2001,7 +2250,7 @@ namespace libtorrent
 			TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 			std::vector<downloading_piece>::iterator i
-				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+				= find_download(block.piece_index);
 			TORRENT_ASSERT(i != m_downloads.end());
 			block_info& info = i->info[block.block_index];
 			if (info.state == block_info::state_writing
@@ -2033,7 +2282,7 @@ namespace libtorrent
 		if (!p.downloading) return 0;
 
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+			= find_download(block.piece_index);
 		TORRENT_ASSERT(i != m_downloads.end());
 
 		block_info const& info = i->info[block.block_index];
@@ -2044,6 +2293,7 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(m_seeds >= 0);
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+		update_refcounts();
 	
 		avail.resize(m_piece_map.size());
 		std::vector<int>::iterator j = avail.begin();
@@ -2076,8 +2326,7 @@ namespace libtorrent
 			p.downloading = 1;
 			if (prio >= 0 && !m_dirty) update(prio, p.index);
 
-			downloading_piece& dp = add_download_piece();
-			dp.index = block.piece_index;
+			downloading_piece& dp = add_download_piece(block.piece_index);
 			dp.state = none;
 			block_info& info = dp.info[block.block_index];
 			info.state = block_info::state_writing;
@@ -2089,7 +2338,7 @@ namespace libtorrent
 		else
 		{
 			std::vector<downloading_piece>::iterator i
-				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+				= find_download(block.piece_index);
 			TORRENT_ASSERT(i != m_downloads.end());
 			block_info& info = i->info[block.block_index];
 
@@ -2119,7 +2368,7 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 
 		std::vector<downloading_piece>::iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+			= find_download(block.piece_index);
 		TORRENT_ASSERT(i != m_downloads.end());
 		block_info& info = i->info[block.block_index];
 		TORRENT_ASSERT(info.state == block_info::state_writing);
@@ -2152,9 +2401,8 @@ namespace libtorrent
 			p.downloading = 1;
 			if (prio >= 0 && !m_dirty) update(prio, p.index);
 
-			downloading_piece& dp = add_download_piece();
+			downloading_piece& dp = add_download_piece(block.piece_index);
 			dp.state = none;
-			dp.index = block.piece_index;
 			block_info& info = dp.info[block.block_index];
 			info.peer = peer;
 			TORRENT_ASSERT(info.state == block_info::state_none);
@@ -2173,7 +2421,7 @@ namespace libtorrent
 #endif
 			
 			std::vector<downloading_piece>::iterator i
-				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+				= find_download(block.piece_index);
 			TORRENT_ASSERT(i != m_downloads.end());
 			block_info& info = i->info[block.block_index];
 
@@ -2203,7 +2451,7 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(index >= 0 && index <= (int)m_piece_map.size());
 		std::vector<downloading_piece>::const_iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(index));
+			= find_download(index);
 		TORRENT_ASSERT(i != m_downloads.end());
 
 		d.clear();
@@ -2215,10 +2463,7 @@ namespace libtorrent
 
 	void* piece_picker::get_downloader(piece_block block) const
 	{
-		std::vector<downloading_piece>::const_iterator i = std::find_if(
-			m_downloads.begin()
-			, m_downloads.end()
-			, has_index(block.piece_index));
+		std::vector<downloading_piece>::const_iterator i = find_download(block.piece_index);
 
 		if (i == m_downloads.end()) return 0;
 
@@ -2245,13 +2490,11 @@ namespace libtorrent
 
 		if (m_piece_map[block.piece_index].downloading == 0)
 		{
-			TORRENT_ASSERT(std::find_if(m_downloads.begin(), m_downloads.end()
-				, has_index(block.piece_index)) == m_downloads.end());
+			TORRENT_ASSERT(find_download(block.piece_index) == m_downloads.end());
 			return;
 		}
 
-		std::vector<downloading_piece>::iterator i = std::find_if(m_downloads.begin()
-			, m_downloads.end(), has_index(block.piece_index));
+		std::vector<downloading_piece>::iterator i = find_download(block.piece_index);
 		TORRENT_ASSERT(i != m_downloads.end());
 
 		block_info& info = i->info[block.block_index];
@@ -2298,8 +2541,7 @@ namespace libtorrent
 				else if (prev_prio >= 0) update(prev_prio, p.index);
 			}
 
-			TORRENT_ASSERT(std::find_if(m_downloads.begin(), m_downloads.end()
-				, has_index(block.piece_index)) == m_downloads.end());
+			TORRENT_ASSERT(find_download(block.piece_index) == m_downloads.end());
 		}
 		else if (i->requested == 0)
 		{
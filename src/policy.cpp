@@ -216,9 +216,19 @@ namespace libtorrent
 
 		if (prefer_whole_pieces == 0)
 		{
+			int piece_length = t.torrent_file().piece_length();
 			prefer_whole_pieces = c.statistics().download_payload_rate()
 				* t.settings().whole_pieces_threshold
-				> t.torrent_file().piece_length() ? 1 : 0;
+				> piece_length ? 1 : 0;
+
+			// give the peer a run of adjacent pieces in proportion
+			// to its rate, as many as fit in its request queue
+			int max_stripe = t.settings().max_whole_piece_stripe;
+			if (prefer_whole_pieces && max_stripe > 1)
+			{
+				int queue_pieces = c.desired_queue_size() * t.block_size() / piece_length;
+				prefer_whole_pieces = (std::max)(1, (std::min)(queue_pieces, max_stripe));
+			}
 		}
 	
 		// if we prefer whole pieces, the piece picker will pick at least
@@ -247,6 +257,7 @@ namespace libtorrent
 		std::vector<int> const& suggested = c.suggested_pieces();
 		bitfield const& bits = c.get_bitfield();
 
+		ptime pick_start = time_now_hires();
 		if (c.has_peer_choked())
 		{
 			// if we are choked we can only pick pieces from the
@@ -278,6 +289,12 @@ namespace libtorrent
 				, num_requests, prefer_whole_pieces, c.peer_info_struct()
 				, state, c.picker_options(), suggested);
 		}
+		time_duration pick_time = time_now_hires() - pick_start;
+		counters& stats = t.session().m_stats_counters;
+		stats.inc_stats_counter(counters::piece_picks);
+		stats.inc_stats_counter(counters::piece_picker_time_us
+			, total_microseconds(pick_time));
+		t.session().m_latency.piece_pick_time.add(pick_time);
 
 #ifdef TORRENT_VERBOSE_LOGGING
 		(*c.m_logger) << time_now_string() << " PIECE_PICKER [ php: " << prefer_whole_pieces
@@ -324,6 +341,33 @@ namespace libtorrent
 			return;
 		}
 
+		// blocks that have been requested from other peers are only
+		// requested again in end-game mode. Before that, the peers
+		// holding them are expected to deliver and there are free
+		// blocks left for everyone else
+		if (!t.is_end_game()) return;
+
+		// don't request a block from more peers than the limit, and
+		// don't duplicate a request to a peer that's slower than the
+		// one the block was last requested from. The duplicates are
+		// supposed to speed the tail of the download up, not to waste
+		// bandwidth on peers that won't deliver first anyway
+		int max_requests = t.settings().max_end_game_requests;
+		float rate = c.statistics().download_payload_rate();
+		for (std::vector<piece_block>::iterator i = busy_pieces.begin();
+			i != busy_pieces.end();)
+		{
+			policy::peer* holder = static_cast<policy::peer*>(p.get_downloader(*i));
+			if ((max_requests > 0 && p.num_peers(*i) >= max_requests)
+				|| (holder && holder->connection
+					&& holder->connection->statistics().download_payload_rate() > rate))
+				i = busy_pieces.erase(i);
+			else
+				++i;
+		}
+
+		if (busy_pieces.empty()) return;
+
 		// if all blocks has the same number of peers on them
 		// we want to pick a random block
 		std::random_shuffle(busy_pieces.begin(), busy_pieces.end());
@@ -341,10 +385,15 @@ namespace libtorrent
 		TORRENT_ASSERT(p.is_requested(*i));
 		TORRENT_ASSERT(p.num_peers(*i) > 0);
 		c.add_request(*i);
+
+		int block_offset = i->block_index * t.block_size();
+		t.session().add_duplicate_request_bytes((std::min)(t.block_size()
+			, t.torrent_file().piece_size(i->piece_index) - block_offset));
 	}
 
 	policy::policy(torrent* t)
 		: m_round_robin(0)
+		, m_num_erase_entries(0)
 		, m_torrent(t)
 		, m_available_free_upload(0)
 		, m_num_connect_candidates(0)
@@ -356,8 +405,6 @@ namespace libtorrent
 	void policy::ip_filter_updated()
 	{
 		aux::session_impl& ses = m_torrent->session();
-		piece_picker* p = 0;
-		if (m_torrent->has_picker()) p = &m_torrent->picker();
 
 		for (iterator i = m_peers.begin(); i != m_peers.end();)
 		{
@@ -366,26 +413,59 @@ namespace libtorrent
 				++i;
 				continue;
 			}
-		
-			if ((*i)->connection)
-			{
-				(*i)->connection->disconnect("peer banned by IP filter");
-				if (ses.m_alerts.should_post<peer_blocked_alert>())
-					ses.m_alerts.post_alert(peer_blocked_alert((*i)->address()));
-				TORRENT_ASSERT((*i)->connection == 0
-					|| (*i)->connection->peer_info_struct() == 0);
-			}
-			else
-			{
-				if (ses.m_alerts.should_post<peer_blocked_alert>())
-					ses.m_alerts.post_alert(peer_blocked_alert((*i)->address()));
-			}
 			int current = i - m_peers.begin();
-			erase_peer(i);
+			erase_filtered_peer(i);
 			i = m_peers.begin() + current;
 		}
 	}
 
+	int policy::ip_filter_updated(std::vector<ip_range<address> > const& ranges)
+	{
+		// with more ranges than peers, looking each peer up
+		// in the filter is cheaper than a search per range
+		if (ranges.size() >= m_peers.size())
+		{
+			ip_filter_updated();
+			return m_peers.size();
+		}
+
+		aux::session_impl& ses = m_torrent->session();
+		int checked = 0;
+
+		for (std::vector<ip_range<address> >::const_iterator r = ranges.begin()
+			, end(ranges.end()); r != end; ++r)
+		{
+			iterator i = lower_bound_peer(r->first);
+			while (i != m_peers.end() && !(r->last < (*i)->address()))
+			{
+				++checked;
+				if ((ses.m_ip_filter.access((*i)->address()) & ip_filter::blocked) == 0)
+				{
+					++i;
+					continue;
+				}
+				int current = i - m_peers.begin();
+				erase_filtered_peer(i);
+				i = m_peers.begin() + current;
+			}
+		}
+		return checked + ranges.size();
+	}
+
+	void policy::erase_filtered_peer(iterator i)
+	{
+		aux::session_impl& ses = m_torrent->session();
+		if ((*i)->connection)
+		{
+			(*i)->connection->disconnect("peer banned by IP filter");
+			TORRENT_ASSERT((*i)->connection == 0
+				|| (*i)->connection->peer_info_struct() == 0);
+		}
+		if (ses.m_alerts.should_post<peer_blocked_alert>())
+			ses.m_alerts.post_alert(peer_blocked_alert((*i)->address()));
+		erase_peer(i);
+	}
+
 	void policy::erase_peer(policy::peer* p)
 	{
 		INVARIANT_CHECK;
@@ -411,6 +491,10 @@ namespace libtorrent
 			--m_num_connect_candidates;
 		if (m_round_robin > i - m_peers.begin()) --m_round_robin;
 
+		std::vector<peer*>::iterator c = std::find(m_candidate_cache.begin()
+			, m_candidate_cache.end(), *i);
+		if (c != m_candidate_cache.end()) m_candidate_cache.erase(c);
+
 #if TORRENT_USE_IPV6
 		if ((*i)->is_v6_addr)
 			m_torrent->session().m_ipv6_peer_pool.destroy(
@@ -437,16 +521,91 @@ namespace libtorrent
 			&& !is_connect_candidate(pe, m_finished);
 	}
 
-	void policy::erase_peers()
+	int policy::erase_bucket(peer const& p) const
 	{
-		INVARIANT_CHECK;
+		// peers only known from resume data go first, then
+		// the ones that failed the most
+		if (p.source == peer_info::resume_data) return num_erase_buckets - 1;
+		return p.failcount;
+	}
+
+	void policy::add_erase_candidate(peer const& p)
+	{
+		// entries of peers that are gone are only dropped when they're
+		// popped. Don't let them grow past the size of the peer list,
+		// recalculate_connect_candidates() and the scans find the rest
+		if (m_num_erase_entries > int(m_peers.size()) + 100)
+		{
+			for (int i = 0; i < num_erase_buckets; ++i)
+				m_erase_buckets[i].clear();
+			m_num_erase_entries = 0;
+		}
+		m_erase_buckets[erase_bucket(p)].push_back(p.ip());
+		++m_num_erase_entries;
+	}
 
-		int max_peerlist_size = m_torrent->is_paused()
+	policy::iterator policy::pop_erase_candidate()
+	{
+		for (int b = num_erase_buckets - 1; b >= 0; --b)
+		{
+			std::deque<tcp::endpoint>& bucket = m_erase_buckets[b];
+			while (!bucket.empty())
+			{
+				tcp::endpoint ep = bucket.front();
+				bucket.pop_front();
+				--m_num_erase_entries;
+
+				std::pair<iterator, iterator> range = find_peers(ep.address());
+				iterator i = std::find_if(range.first, range.second, match_peer_endpoint(ep));
+				if (i == range.second) continue;
+				if (!is_erase_candidate(**i, m_finished)) continue;
+
+				// the peer's failcount or source may have changed since it
+				// was added. If it belongs in a lower bucket, move it there
+				int current = erase_bucket(**i);
+				if (current < b)
+				{
+					m_erase_buckets[current].push_back(ep);
+					++m_num_erase_entries;
+					continue;
+				}
+				return i;
+			}
+		}
+		return m_peers.end();
+	}
+
+	int policy::max_peerlist_size() const
+	{
+		int ret = m_torrent->is_paused()
 			?m_torrent->settings().max_paused_peerlist_size
 			:m_torrent->settings().max_peerlist_size;
+		if (m_torrent->session().memory_pressure()
+			>= aux::session_impl::peer_list_pressure)
+			ret = (ret + 1) / 2;
+		return ret;
+	}
+
+	void policy::erase_peers()
+	{
+		INVARIANT_CHECK;
+
+		int max_peerlist_size = this->max_peerlist_size();
 
 		if (max_peerlist_size == 0 || m_peers.empty()) return;
 
+		// the candidates found when peers disconnected are
+		// erased first, worst first
+		while (m_peers.size() >= max_peerlist_size * 0.95)
+		{
+			iterator i = pop_erase_candidate();
+			if (i == m_peers.end()) break;
+			erase_peer(i);
+		}
+
+		if (m_peers.size() < max_peerlist_size * 0.95 || m_peers.empty())
+			return;
+
 		int erase_candidate = -1;
 
 		TORRENT_ASSERT(m_finished == m_torrent->is_finished());
@@ -503,16 +662,48 @@ namespace libtorrent
 		return true;
 	}
 
-	policy::iterator policy::find_connect_candidate(int session_time)
+	bool policy::is_reconnect_candidate(peer const& p, int session_time) const
 	{
-		INVARIANT_CHECK;
+		if (!is_connect_candidate(p, m_finished)) return false;
+		int min_reconnect_time = m_torrent->settings().min_reconnect_time;
+		return p.last_connected == 0
+			|| session_time - p.last_connected
+			>= (int(p.failcount) + 1) * min_reconnect_time;
+	}
 
-		int candidate = -1;
-		int erase_candidate = -1;
+	policy::peer* policy::find_connect_candidate(int session_time)
+	{
+		INVARIANT_CHECK;
 
 		TORRENT_ASSERT(m_finished == m_torrent->is_finished());
 
-		int min_reconnect_time = m_torrent->settings().min_reconnect_time;
+		// the best peers from the last scan are used first.
+		// They may have been connected or failed since, so
+		// they're checked again
+		while (!m_candidate_cache.empty())
+		{
+			peer* p = m_candidate_cache.back();
+			m_candidate_cache.pop_back();
+			if (is_reconnect_candidate(*p, session_time)) return p;
+		}
+
+		update_candidate_cache(session_time);
+		if (m_candidate_cache.empty()) return 0;
+		peer* p = m_candidate_cache.back();
+		m_candidate_cache.pop_back();
+		return p;
+	}
+
+	// scans a part of the peer list, starting at the round robin
+	// cursor, and keeps the best connect candidates it finds in
+	// m_candidate_cache, ordered with the best one last. This
+	// lets a scan pay for several connection attempts
+	void policy::update_candidate_cache(int session_time)
+	{
+		const int max_cache_size = 10;
+
+		int erase_candidate = -1;
+
 		address external_ip = m_torrent->session().external_address();
 
 		// don't bias any particular peers when seeding
@@ -531,9 +722,7 @@ namespace libtorrent
 		bool pinged = false;
 #endif
 
-		int max_peerlist_size = m_torrent->is_paused()
-			?m_torrent->settings().max_paused_peerlist_size
-			:m_torrent->settings().max_peerlist_size;
+		int max_peerlist_size = this->max_peerlist_size();
 
 		for (int iterations = (std::min)(int(m_peers.size()), 300);
 			iterations > 0; --iterations)
@@ -569,8 +758,8 @@ namespace libtorrent
 					if (should_erase_immediately(pe))
 					{
 						if (erase_candidate > current) --erase_candidate;
-						if (candidate > current) --candidate;
 						erase_peer(m_peers.begin() + current);
+						continue;
 					}
 					else
 					{
@@ -581,44 +770,41 @@ namespace libtorrent
 
 			++m_round_robin;
 
-			if (!is_connect_candidate(pe, m_finished)) continue;
+			if (!is_reconnect_candidate(pe, session_time)) continue;
 
-			// compare peer returns true if lhs is better than rhs. In this
-			// case, it returns true if the current candidate is better than
-			// pe, which is the peer m_round_robin points to. If it is, just
-			// keep looking.
-			if (candidate != -1
-				&& compare_peer(*m_peers[candidate], pe, external_ip)) continue;
+			// compare_peer returns true if lhs is a better candidate
+			// than rhs. The cache is ordered worst first, so pe goes
+			// in front of the first entry that's better than it
+			std::vector<peer*>::iterator j = m_candidate_cache.begin();
+			for (; j != m_candidate_cache.end(); ++j)
+				if (compare_peer(**j, pe, external_ip)) break;
 
-			if (pe.last_connected
-				&& session_time - pe.last_connected <
-				(int(pe.failcount) + 1) * min_reconnect_time)
+			if (j == m_candidate_cache.begin()
+				&& int(m_candidate_cache.size()) >= max_cache_size)
 				continue;
 
-			candidate = current;
+			m_candidate_cache.insert(j, &pe);
+			if (int(m_candidate_cache.size()) > max_cache_size)
+				m_candidate_cache.erase(m_candidate_cache.begin());
 		}
 		
 		if (erase_candidate > -1)
-		{
-			if (candidate > erase_candidate) --candidate;
 			erase_peer(m_peers.begin() + erase_candidate);
-		}
 
 #if defined TORRENT_LOGGING || defined TORRENT_VERBOSE_LOGGING
-		if (candidate != -1)
+		if (!m_candidate_cache.empty())
 		{
+			peer const* c = m_candidate_cache.back();
 			(*m_torrent->session().m_logger) << time_now_string()
 				<< " *** FOUND CONNECTION CANDIDATE ["
-				" ip: " << m_peers[candidate]->ip() <<
-				" d: " << cidr_distance(external_ip, m_peers[candidate]->address()) <<
+				" ip: " << c->ip() <<
+				" d: " << cidr_distance(external_ip, c->address()) <<
 				" external: " << external_ip <<
-				" t: " << (session_time - m_peers[candidate]->last_connected) <<
+				" t: " << (session_time - c->last_connected) <<
+				" candidates: " << m_candidate_cache.size() <<
 				" ]\n";
 		}
 #endif
-
-		if (candidate == -1) return m_peers.end();
-		return m_peers.begin() + candidate;
 	}
 
 	void policy::pulse()
@@ -706,10 +892,7 @@ namespace libtorrent
 		}
 		else
 		{
-			iter = std::lower_bound(
-				m_peers.begin(), m_peers.end()
-			  , c.remote().address(), peer_address_compare()
-			);
+			iter = lower_bound_peer(c.remote().address());
 
 			if (iter != m_peers.end() && (*iter)->address() == c.remote().address()) found = true;
 		}
@@ -823,8 +1006,16 @@ namespace libtorrent
 			i->inet_as_num = as;
 #endif
 			i->inet_as = ses.lookup_as(as);
+			i->cheap_as = ses.is_cheap_as(as);
 #endif
 			i->source = peer_info::incoming;
+
+			ses.apply_peer_reputation(*i);
+			if (i->banned)
+			{
+				c.disconnect("ip address banned, closing");
+				return false;
+			}
 		}
 	
 		TORRENT_ASSERT(i);
@@ -927,9 +1118,7 @@ namespace libtorrent
 		iterator iter;
 		peer* i = 0;
 
-		int max_peerlist_size = m_torrent->is_paused()
-			?m_torrent->settings().max_paused_peerlist_size
-			:m_torrent->settings().max_peerlist_size;
+		int max_peerlist_size = this->max_peerlist_size();
 
 		bool found = false;
 		if (m_torrent->settings().allow_multiple_connections_per_ip)
@@ -940,10 +1129,7 @@ namespace libtorrent
 		}
 		else
 		{
-			iter = std::lower_bound(
-				m_peers.begin(), m_peers.end()
-			  , remote.address(), peer_address_compare()
-			);
+			iter = lower_bound_peer(remote.address());
 
 			if (iter != m_peers.end() && (*iter)->address() == remote.address()) found = true;
 		}
@@ -961,116 +1147,258 @@ namespace libtorrent
 
 				// since some peers were removed, we need to
 				// update the iterator to make it valid again
-				iter = std::lower_bound(
-					m_peers.begin(), m_peers.end()
-				  , remote.address(), peer_address_compare()
-				);
+				iter = lower_bound_peer(remote.address());
 			}
 
+			i = create_peer(remote, src, flags);
+			if (i == 0) return 0;
+
 			if (m_round_robin > iter - m_peers.begin()) ++m_round_robin;
+			m_peers.insert(iter, i);
 
-			// we don't have any info about this peer.
-			// add a new entry
+			if (is_connect_candidate(*i, m_finished))
+				++m_num_connect_candidates;
+		}
+		else
+		{
+			i = *iter;
+			m_num_connect_candidates += update_peer(i, remote, src, flags);
+			if (m_num_connect_candidates < 0) m_num_connect_candidates = 0;
+		}
+
+		return i;
+	}
+
+	namespace
+	{
+		typedef policy::peer_entry_t peer_entry_t;
+
+		bool compare_entry_address(peer_entry_t const& lhs, peer_entry_t const& rhs)
+		{ return lhs.first.address() < rhs.first.address(); }
+
+		bool compare_entry_endpoint(peer_entry_t const& lhs, peer_entry_t const& rhs)
+		{ return lhs.first < rhs.first; }
+	}
+
+	int policy::add_peers(std::vector<peer_entry_t>& peers, int src)
+	{
+		INVARIANT_CHECK;
+
+		if (peers.empty()) return 0;
+
+		aux::session_impl& ses = m_torrent->session();
+		bool multiple_per_ip = m_torrent->settings().allow_multiple_connections_per_ip;
+
+		// sort the batch in peer list order. When the same peer is in it
+		// more than once, the last entry wins, like it does when they're
+		// added one at a time
+		std::stable_sort(peers.begin(), peers.end()
+			, multiple_per_ip ? &compare_entry_endpoint : &compare_entry_address);
+
+		port_filter const& pf = ses.m_port_filter;
+		std::vector<peer_entry_t>::iterator out = peers.begin();
+		address filtered_address;
+		bool looked_up = false;
+		bool blocked = false;
+		for (std::vector<peer_entry_t>::iterator i = peers.begin()
+			, end(peers.end()); i != end; ++i)
+		{
+			tcp::endpoint const& remote = i->first;
+
+			// just ignore the obviously invalid entries
+			if (remote.address() == address() || remote.port() == 0)
+				continue;
+
+			// the entries are sorted by address, only look up
+			// each address in the ip filter once
+			if (!looked_up || remote.address() != filtered_address)
+			{
+				filtered_address = remote.address();
+				blocked = ses.m_ip_filter.access(filtered_address) & ip_filter::blocked;
+				looked_up = true;
+			}
+
+			if (blocked || (pf.access(remote.port()) & port_filter::blocked))
+			{
+				if (ses.m_alerts.should_post<peer_blocked_alert>())
+					ses.m_alerts.post_alert(peer_blocked_alert(remote.address()));
+				continue;
+			}
+
+			if (out != peers.begin()
+				&& (out - 1)->first.address() == remote.address()
+				&& (!multiple_per_ip || (out - 1)->first == remote))
+			{
+				// a duplicate of the previous entry, it replaces it
+				char flags = (out - 1)->second | i->second;
+				*(out - 1) = *i;
+				(out - 1)->second = flags;
+				continue;
+			}
+			*out++ = *i;
+		}
+		peers.erase(out, peers.end());
+		if (peers.empty()) return 0;
+
+		int max_peerlist_size = this->max_peerlist_size();
+		if (max_peerlist_size
+			&& int(m_peers.size() + peers.size()) > max_peerlist_size
+			&& src != peer_info::resume_data)
+			erase_peers();
+
+		// merge the batch into the peer list in one pass. Peers that are
+		// already in the list are updated in place
+		peers_t merged;
+		merged.reserve(m_peers.size() + peers.size());
+		iterator old = m_peers.begin();
+		int added = 0;
+		int added_before_round_robin = 0;
+		int candidates = 0;
+		for (std::vector<peer_entry_t>::iterator i = peers.begin()
+			, end(peers.end()); i != end; ++i)
+		{
+			tcp::endpoint const& remote = i->first;
+			while (old != m_peers.end() && (*old)->address() < remote.address())
+				merged.push_back(*old++);
+
+			iterator match = old;
+			if (multiple_per_ip)
+			{
+				while (match != m_peers.end() && (*match)->address() == remote.address()
+					&& (*match)->port != remote.port())
+					++match;
+			}
+			if (match != m_peers.end() && (*match)->address() == remote.address())
+			{
+				candidates += update_peer(*match, remote, src, i->second);
+				continue;
+			}
+
+			// a new peer goes after the ones with the same address
+			while (old != m_peers.end() && (*old)->address() == remote.address())
+				merged.push_back(*old++);
+
+			if (max_peerlist_size
+				&& int(m_peers.size()) + added >= max_peerlist_size)
+				continue;
+
+			peer* p = create_peer(remote, src, i->second);
+			if (p == 0) continue;
+
+			if (m_round_robin > old - m_peers.begin()) ++added_before_round_robin;
+			merged.push_back(p);
+			++added;
+			if (is_connect_candidate(*p, m_finished)) ++candidates;
+		}
+
+		if (added > 0)
+		{
+			merged.insert(merged.end(), old, m_peers.end());
+			m_peers.swap(merged);
+			m_round_robin += added_before_round_robin;
+		}
+
+		m_num_connect_candidates += candidates;
+		if (m_num_connect_candidates < 0) m_num_connect_candidates = 0;
+		return added;
+	}
+
+	policy::peer* policy::create_peer(tcp::endpoint const& remote, int src, char flags)
+	{
+		aux::session_impl& ses = m_torrent->session();
+
+		// we don't have any info about this peer.
+		// add a new entry
 #if TORRENT_USE_IPV6
-			bool is_v6 = remote.address().is_v6();
+		bool is_v6 = remote.address().is_v6();
 #endif
-			peer* p =
+		peer* i =
 #if TORRENT_USE_IPV6
-				is_v6 ? (peer*)m_torrent->session().m_ipv6_peer_pool.malloc() :
+			is_v6 ? (peer*)ses.m_ipv6_peer_pool.malloc() :
 #endif
-				(peer*)m_torrent->session().m_ipv4_peer_pool.malloc();
-			if (p == 0) return 0;
+			(peer*)ses.m_ipv4_peer_pool.malloc();
+		if (i == 0) return 0;
 #if TORRENT_USE_IPV6
-			if (is_v6)
-				m_torrent->session().m_ipv6_peer_pool.set_next_size(500);
-			else
+		if (is_v6)
+			ses.m_ipv6_peer_pool.set_next_size(500);
+		else
 #endif
-				m_torrent->session().m_ipv4_peer_pool.set_next_size(500);
+			ses.m_ipv4_peer_pool.set_next_size(500);
 
 #if TORRENT_USE_IPV6
-			if (is_v6)
-				new (p) ipv6_peer(remote, true, src);
-			else
+		if (is_v6)
+			new (i) ipv6_peer(remote, true, src);
+		else
 #endif
-				new (p) ipv4_peer(remote, true, src);
-
-			iter = m_peers.insert(iter, p);
+			new (i) ipv4_peer(remote, true, src);
 
-			i = *iter;
 #ifndef TORRENT_DISABLE_ENCRYPTION
-			if (flags & 0x01) i->pe_support = true;
+		if (flags & 0x01) i->pe_support = true;
 #endif
-			if (flags & 0x02)
-			{
-				i->seed = true;
-				++m_num_seeds;
-			}
+		if (flags & 0x02)
+		{
+			i->seed = true;
+			++m_num_seeds;
+		}
 
 #ifndef TORRENT_DISABLE_GEO_IP
-			int as = ses.as_for_ip(remote.address());
+		int as = ses.as_for_ip(remote.address());
 #ifdef TORRENT_DEBUG
-			i->inet_as_num = as;
+		i->inet_as_num = as;
 #endif
-			i->inet_as = ses.lookup_as(as);
+		i->inet_as = ses.lookup_as(as);
+		i->cheap_as = ses.is_cheap_as(as);
 #endif
-			if (is_connect_candidate(*i, m_finished))
-				++m_num_connect_candidates;
-		}
-		else
-		{
-			i = *iter;
+		ses.apply_peer_reputation(*i);
+		return i;
+	}
 
-			bool was_conn_cand = is_connect_candidate(*i, m_finished);
-
-			i->connectable = true;
-
-			TORRENT_ASSERT(i->address() == remote.address());
-			i->port = remote.port();
-			i->source |= src;
-				
-			// if this peer has failed before, decrease the
-			// counter to allow it another try, since somebody
-			// else is appearantly able to connect to it
-			// only trust this if it comes from the tracker
-			if (i->failcount > 0 && src == peer_info::tracker)
-				--i->failcount;
-
-			// if we're connected to this peer
-			// we already know if it's a seed or not
-			// so we don't have to trust this source
-			if ((flags & 0x02) && !i->connection)
-			{
-				if (!i->seed) ++m_num_seeds;
-				i->seed = true;
-			}
+	int policy::update_peer(peer* i, tcp::endpoint const& remote, int src, char flags)
+	{
+		bool was_conn_cand = is_connect_candidate(*i, m_finished);
+
+		i->connectable = true;
+
+		TORRENT_ASSERT(i->address() == remote.address());
+		i->port = remote.port();
+		i->source |= src;
+			
+		// if this peer has failed before, decrease the
+		// counter to allow it another try, since somebody
+		// else is appearantly able to connect to it
+		// only trust this if it comes from the tracker
+		if (i->failcount > 0 && src == peer_info::tracker)
+			--i->failcount;
+
+		// if we're connected to this peer
+		// we already know if it's a seed or not
+		// so we don't have to trust this source
+		if ((flags & 0x02) && !i->connection)
+		{
+			if (!i->seed) ++m_num_seeds;
+			i->seed = true;
+		}
 
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING
-			if (i->connection)
-			{
-				// this means we're already connected
-				// to this peer. don't connect to
-				// it again.
-
-				error_code ec;
-				char hex_pid[41];
-				to_hex((char*)&i->connection->pid()[0], 20, hex_pid);
-				char msg[200];
-				snprintf(msg, 200, "already connected to peer: %s %s"
-					, print_endpoint(remote).c_str(), hex_pid);
-				m_torrent->debug_log(msg);
-
-				TORRENT_ASSERT(i->connection->associated_torrent().lock().get() == m_torrent);
-			}
-#endif
+		if (i->connection)
+		{
+			// this means we're already connected
+			// to this peer. don't connect to
+			// it again.
 
-			if (was_conn_cand != is_connect_candidate(*i, m_finished))
-			{
-				m_num_connect_candidates += was_conn_cand ? -1 : 1;
-				if (m_num_connect_candidates < 0) m_num_connect_candidates = 0;
-			}
+			error_code ec;
+			char hex_pid[41];
+			to_hex((char*)&i->connection->pid()[0], 20, hex_pid);
+			char msg[200];
+			snprintf(msg, 200, "already connected to peer: %s %s"
+				, print_endpoint(remote).c_str(), hex_pid);
+			m_torrent->debug_log(msg);
+
+			TORRENT_ASSERT(i->connection->associated_torrent().lock().get() == m_torrent);
 		}
+#endif
 
-		return i;
+		return int(is_connect_candidate(*i, m_finished)) - int(was_conn_cand);
 	}
 
 	// this is called when we are unchoked by a peer
@@ -1197,9 +1525,9 @@ namespace libtorrent
 
 		TORRENT_ASSERT(m_torrent->want_more_peers());
 		
-		iterator i = find_connect_candidate(session_time);
-		if (i == m_peers.end()) return false;
-		peer& p = **i;
+		peer* candidate = find_connect_candidate(session_time);
+		if (candidate == 0) return false;
+		peer& p = *candidate;
 
 		TORRENT_ASSERT(!p.banned);
 		TORRENT_ASSERT(!p.connection);
@@ -1211,6 +1539,7 @@ namespace libtorrent
 		{
 			// failcount is a 5 bit value
 			if (p.failcount < 31) ++p.failcount;
+			m_torrent->session().update_peer_reputation(p);
 			return false;
 		}
 		TORRENT_ASSERT(p.connection);
@@ -1251,6 +1580,7 @@ namespace libtorrent
 			// failcount is a 5 bit value
 			if (p->failcount < 31) ++p->failcount;
 		}
+		m_torrent->session().update_peer_reputation(*p);
 
 		if (is_connect_candidate(*p, m_finished))
 			++m_num_connect_candidates;
@@ -1277,8 +1607,14 @@ namespace libtorrent
 		if (m_torrent->is_seed() || m_peers.size() >= m_torrent->settings().max_peerlist_size * 0.9)
 		{
 			if (p->source == peer_info::resume_data)
+			{
 				erase_peer(p);
+				return;
+			}
 		}
+
+		if (is_erase_candidate(*p, m_finished))
+			add_erase_candidate(*p);
 	}
 
 	void policy::peer_is_interesting(peer_connection& c)
@@ -1304,10 +1640,19 @@ namespace libtorrent
 		if (is_finished == m_finished) return;
 
 		m_finished = is_finished;
+		// seeds stop being candidates once we're finished
+		m_candidate_cache.clear();
+		// and become erase candidates. The buckets are
+		// rebuilt as part of the same pass
+		for (int i = 0; i < num_erase_buckets; ++i)
+			m_erase_buckets[i].clear();
+		m_num_erase_entries = 0;
 		for (const_iterator i = m_peers.begin();
 			i != m_peers.end(); ++i)
 		{
 			m_num_connect_candidates += is_connect_candidate(**i, m_finished);
+			if (is_erase_candidate(**i, m_finished))
+				add_erase_candidate(**i);
 		}
 	}
 
@@ -1473,6 +1818,10 @@ namespace libtorrent
 		, banned(false)
 #ifndef TORRENT_DISABLE_DHT
 		, added_to_dht(false)
+#endif
+		, supports_utp(true)
+#ifndef TORRENT_DISABLE_GEO_IP
+		, cheap_as(false)
 #endif
 	{
 		TORRENT_ASSERT((src & 0xff) == src);
@@ -1531,6 +1880,11 @@ namespace libtorrent
 		bool rhs_local = is_local(rhs.address());
 		if (lhs_local != rhs_local) return lhs_local > rhs_local;
 
+#ifndef TORRENT_DISABLE_GEO_IP
+		// then the ones in ASes that are cheap to reach
+		if (lhs.cheap_as != rhs.cheap_as) return lhs.cheap_as;
+#endif
+
 		if (lhs.last_connected != rhs.last_connected)
 			return lhs.last_connected < rhs.last_connected;
 
@@ -0,0 +1,144 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+
+#include "libtorrent/resolver.hpp"
+
+namespace libtorrent
+{
+	namespace
+	{
+		enum
+		{
+			// how long a successful lookup is cached, in seconds. The
+			// system resolver doesn't tell us the record's TTL
+			dns_cache_timeout = 20 * 60,
+			// how long a failed lookup is cached
+			dns_negative_cache_timeout = 5 * 60,
+			max_dns_cache_size = 700
+		};
+	}
+
+	resolver::resolver(io_service& ios)
+		: m_ios(ios)
+		, m_resolver(ios)
+	{}
+
+	void resolver::async_resolve(std::string const& host, callback_t const& h)
+	{
+		mutex_t l(m_mutex);
+
+		cache_t::iterator i = m_cache.find(host);
+		if (i != m_cache.end())
+		{
+			dns_cache_entry const& e = i->second;
+			int timeout = e.error
+				? dns_negative_cache_timeout : dns_cache_timeout;
+			if (time_now() - e.last_seen < seconds(timeout))
+			{
+				m_ios.post(boost::bind(h, e.error, e.addresses));
+				return;
+			}
+		}
+
+		pending_t::iterator p = m_pending.find(host);
+		if (p != m_pending.end())
+		{
+			// this name is already being looked up
+			p->second.push_back(h);
+			return;
+		}
+
+		m_pending[host].push_back(h);
+		tcp::resolver::query q(host, "0");
+		m_resolver.async_resolve(q, boost::bind(&resolver::on_lookup
+			, this, _1, _2, host));
+	}
+
+	void resolver::on_lookup(error_code const& ec, tcp::resolver::iterator i
+		, std::string hostname)
+	{
+		std::vector<callback_t> handlers;
+		dns_cache_entry e;
+		{
+			mutex_t l(m_mutex);
+
+			pending_t::iterator p = m_pending.find(hostname);
+			if (p == m_pending.end()) return;
+			handlers.swap(p->second);
+			m_pending.erase(p);
+
+			e.last_seen = time_now();
+			e.error = ec;
+			if (!ec)
+			{
+				for (; i != tcp::resolver::iterator(); ++i)
+					e.addresses.push_back(i->endpoint().address());
+				if (e.addresses.empty()) e.error = asio::error::host_not_found;
+			}
+
+			// an aborted lookup says nothing about the host
+			if (ec != asio::error::operation_aborted)
+			{
+				if (int(m_cache.size()) >= max_dns_cache_size)
+				{
+					// make room by dropping the expired entries, or
+					// everything, if none of them have expired
+					ptime cutoff = e.last_seen - seconds(dns_cache_timeout);
+					for (cache_t::iterator j = m_cache.begin(); j != m_cache.end();)
+					{
+						if (j->second.last_seen < cutoff) m_cache.erase(j++);
+						else ++j;
+					}
+					if (int(m_cache.size()) >= max_dns_cache_size) m_cache.clear();
+				}
+				m_cache[hostname] = e;
+			}
+		}
+
+		for (std::vector<callback_t>::iterator j = handlers.begin()
+			, end(handlers.end()); j != end; ++j)
+			(*j)(e.error, e.addresses);
+	}
+
+	void resolver::abort()
+	{
+		mutex_t l(m_mutex);
+		m_cache.clear();
+		m_resolver.cancel();
+	}
+}
+
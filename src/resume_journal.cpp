@@ -0,0 +1,317 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include <cstring>
+#include <boost/filesystem/operations.hpp>
+#include <boost/version.hpp>
+
+#include "libtorrent/resume_journal.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/io.hpp"
+
+namespace libtorrent
+{
+	namespace
+	{
+		// the file starts with a magic number and a version
+		char const journal_magic[] = "LTRJ";
+		enum
+		{
+			journal_version = 1,
+			file_header_size = 8,
+			// info-hash and size of the resume data
+			record_header_size = 20 + 4,
+			// don't bother compacting smaller journals
+			min_compact_size = 1024 * 1024
+		};
+
+		bool write_all(file& f, size_type offset, char const* header, int header_size
+			, char const* buf, int size, error_code& ec)
+		{
+			file::iovec_t b[2] = {
+				{ (void*)header, size_t(header_size) }
+				, { (void*)buf, size_t(size) } };
+			size_type ret = f.writev(offset, b, size > 0 ? 2 : 1, ec);
+			if (ec) return false;
+			if (ret != header_size + size)
+			{
+				ec = error_code(errors::file_too_short, libtorrent_category);
+				return false;
+			}
+			return true;
+		}
+
+		bool read_all(file& f, size_type offset, char* buf, int size, error_code& ec)
+		{
+			file::iovec_t b = { buf, size_t(size) };
+			size_type ret = f.readv(offset, &b, 1, ec);
+			if (ec) return false;
+			if (ret != size)
+			{
+				ec = error_code(errors::file_too_short, libtorrent_category);
+				return false;
+			}
+			return true;
+		}
+
+		// replaces to with from. The old file is removed first, since
+		// a rename doesn't overwrite on all platforms. open() picks up
+		// the new file if we're interrupted in between
+		bool replace_file(fs::path const& from, fs::path const& to, error_code& ec)
+		{
+#ifndef BOOST_NO_EXCEPTIONS
+			try
+			{
+#endif
+				if (exists(to)) fs::remove(to);
+				fs::rename(from, to);
+#ifndef BOOST_NO_EXCEPTIONS
+			}
+#if BOOST_VERSION >= 103500
+			catch (boost::system::system_error& e)
+			{
+				ec = e.code();
+				return false;
+			}
+#else
+			catch (boost::filesystem::filesystem_error& e)
+			{
+				ec = error_code(e.system_error(), get_system_category());
+				return false;
+			}
+#endif // BOOST_VERSION
+#endif
+			return true;
+		}
+
+		fs::path temp_path(fs::path const& p)
+		{ return fs::path(p.string() + ".tmp"); }
+	}
+
+	resume_journal::resume_journal(fs::path const& p)
+		: m_path(p)
+		, m_size(0)
+		, m_live_size(0)
+	{}
+
+	bool resume_journal::open(error_code& ec)
+	{
+		m_index.clear();
+		m_size = 0;
+		m_live_size = 0;
+
+		// a compaction was interrupted after the old
+		// journal was removed
+		if (!exists(m_path) && exists(temp_path(m_path))
+			&& !replace_file(temp_path(m_path), m_path, ec))
+			return false;
+
+		if (!m_file.open(m_path, file::read_write, ec)) return false;
+		size_type file_size = m_file.get_size(ec);
+		if (ec) return false;
+
+		char header[file_header_size];
+		if (file_size == 0)
+		{
+			char* ptr = header;
+			std::memcpy(ptr, journal_magic, 4);
+			ptr += 4;
+			detail::write_uint32(journal_version, ptr);
+			if (!write_all(m_file, 0, header, file_header_size, 0, 0, ec)) return false;
+			m_size = file_header_size;
+			return true;
+		}
+
+		if (file_size < file_header_size
+			|| !read_all(m_file, 0, header, file_header_size, ec)
+			|| std::memcmp(header, journal_magic, 4) != 0)
+		{
+			if (!ec) ec = error_code(errors::invalid_resume_journal, libtorrent_category);
+			m_file.close();
+			return false;
+		}
+
+		size_type offset = file_header_size;
+		while (offset + record_header_size <= file_size)
+		{
+			char h[record_header_size];
+			if (!read_all(m_file, offset, h, record_header_size, ec)) return false;
+			sha1_hash ih(h);
+			char const* ptr = h + 20;
+			int size = detail::read_uint32(ptr);
+			if (size < 0 || offset + record_header_size + size > file_size) break;
+
+			std::map<sha1_hash, record>::iterator i = m_index.find(ih);
+			if (i != m_index.end())
+			{
+				m_live_size -= record_header_size + i->second.size;
+				m_index.erase(i);
+			}
+			if (size > 0)
+			{
+				record r = { offset + record_header_size, size };
+				m_index.insert(std::make_pair(ih, r));
+				m_live_size += record_header_size + size;
+			}
+			offset += record_header_size + size;
+		}
+		m_size = offset;
+
+		// drop the partially written record at the end
+		if (m_size < file_size && !m_file.set_size(m_size, ec)) return false;
+		return true;
+	}
+
+	void resume_journal::close()
+	{
+		m_file.close();
+		m_index.clear();
+	}
+
+	bool resume_journal::append_record(sha1_hash const& ih, char const* buf
+		, int size, error_code& ec)
+	{
+		TORRENT_ASSERT(m_file.is_open());
+		char h[record_header_size];
+		std::memcpy(h, &ih[0], 20);
+		char* ptr = h + 20;
+		detail::write_uint32(size, ptr);
+		if (!write_all(m_file, m_size, h, record_header_size, buf, size, ec))
+		{
+			// don't leave a partial record behind
+			error_code ignore;
+			m_file.set_size(m_size, ignore);
+			return false;
+		}
+
+		std::map<sha1_hash, record>::iterator i = m_index.find(ih);
+		if (i != m_index.end())
+		{
+			m_live_size -= record_header_size + i->second.size;
+			m_index.erase(i);
+		}
+		if (size > 0)
+		{
+			record r = { m_size + record_header_size, size };
+			m_index.insert(std::make_pair(ih, r));
+			m_live_size += record_header_size + size;
+		}
+		m_size += record_header_size + size;
+		return true;
+	}
+
+	bool resume_journal::append(sha1_hash const& ih, entry const& rd, error_code& ec)
+	{
+		std::vector<char> buf;
+		bencode(std::back_inserter(buf), rd);
+		if (!append_record(ih, &buf[0], int(buf.size()), ec)) return false;
+
+		// compact once the outdated records take up
+		// more space than the current ones
+		size_type outdated = m_size - file_header_size - m_live_size;
+		if (m_size > min_compact_size && outdated > m_live_size)
+			return compact(ec);
+		return true;
+	}
+
+	bool resume_journal::remove(sha1_hash const& ih, error_code& ec)
+	{
+		if (m_index.find(ih) == m_index.end()) return true;
+		return append_record(ih, 0, 0, ec);
+	}
+
+	bool resume_journal::read(sha1_hash const& ih, std::vector<char>& buf
+		, error_code& ec)
+	{
+		std::map<sha1_hash, record>::iterator i = m_index.find(ih);
+		if (i == m_index.end()) return false;
+		buf.resize(i->second.size);
+		return read_all(m_file, i->second.offset, &buf[0], i->second.size, ec);
+	}
+
+	void resume_journal::torrents(std::vector<sha1_hash>& ret) const
+	{
+		ret.clear();
+		ret.reserve(m_index.size());
+		for (std::map<sha1_hash, record>::const_iterator i = m_index.begin()
+			, end(m_index.end()); i != end; ++i)
+			ret.push_back(i->first);
+	}
+
+	bool resume_journal::compact(error_code& ec)
+	{
+		TORRENT_ASSERT(m_file.is_open());
+		fs::path tmp = temp_path(m_path);
+		file out;
+		if (!out.open(tmp, file::read_write, ec)) return false;
+
+		char header[file_header_size];
+		if (!read_all(m_file, 0, header, file_header_size, ec)
+			|| !write_all(out, 0, header, file_header_size, 0, 0, ec))
+			return false;
+
+		std::map<sha1_hash, record> index;
+		size_type offset = file_header_size;
+		std::vector<char> buf;
+		for (std::map<sha1_hash, record>::iterator i = m_index.begin()
+			, end(m_index.end()); i != end; ++i)
+		{
+			char h[record_header_size];
+			buf.resize(i->second.size);
+			// copies the record header of the current record
+			if (!read_all(m_file, i->second.offset - record_header_size
+				, h, record_header_size, ec)
+				|| !read_all(m_file, i->second.offset, &buf[0], i->second.size, ec)
+				|| !write_all(out, offset, h, record_header_size
+					, &buf[0], i->second.size, ec))
+				return false;
+			record r = { offset + record_header_size, i->second.size };
+			index.insert(index.end(), std::make_pair(i->first, r));
+			offset += record_header_size + i->second.size;
+		}
+		// the temporary file may be left over from an earlier attempt
+		if (!out.set_size(offset, ec)) return false;
+		out.close();
+		m_file.close();
+
+		if (!replace_file(tmp, m_path, ec)) return false;
+		if (!m_file.open(m_path, file::read_write, ec)) return false;
+
+		m_index.swap(index);
+		m_size = offset;
+		m_live_size = offset - file_header_size;
+		return true;
+	}
+}
+
@@ -122,6 +122,7 @@ namespace libtorrent
 		// pieces and fewer entries in the partial
 		// piece list
 		set.whole_pieces_threshold = 2;
+		set.max_whole_piece_stripe = 8;
 		set.use_parole_mode = false;
 		set.prioritize_partial_pieces = true;
 
@@ -197,7 +198,8 @@ namespace libtorrent
 		// use 128 MB of cache
 		set.cache_size = 8192;
 		set.use_read_cache = true;
-		set.cache_buffer_chunk_size = 64;
+		// 2 MiB chunks, to have the cache backed by huge pages
+		set.cache_buffer_chunk_size = 128;
 
 		set.close_redundant_connections = true;
 
@@ -205,6 +207,25 @@ namespace libtorrent
 
 		set.optimize_hashing_for_speed = true;
 
+		// seed boxes typically have several drives, don't
+		// let a slow one stall all the others
+		set.disk_io_threads = 4;
+
+		// serving many peers means many small reads spread
+		// out over the disk, order them to save seeks
+		set.elevator_disk_reads = true;
+
+		// SSDs need many reads in flight to reach their
+		// throughput
+		set.read_hint_depth = 32;
+
+		// don't let piece hashing hold up disk I/O
+		set.hashing_threads = 2;
+
+		// read ahead when checking files, to keep the
+		// disk reading while the pieces are hashed
+		set.file_checks_read_ahead = 8;
+
 		return set;
 	}
 
@@ -340,6 +361,12 @@ namespace libtorrent
 		return m_impl->as_for_ip(addr);
 	}
 
+	void session::set_cheap_as(std::vector<int> const& as)
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		m_impl->set_cheap_as(as);
+	}
+
 #ifndef BOOST_FILESYSTEM_NARROW_ONLY
 	bool session::load_asnum_db(wchar_t const* file)
 	{
@@ -369,8 +396,12 @@ namespace libtorrent
 
 	void session::set_ip_filter(ip_filter const& f)
 	{
+		// compile the copy before taking the lock, a large
+		// filter would otherwise stall the network thread
+		ip_filter compiled(f);
+		compiled.compile();
 		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
-		m_impl->set_ip_filter(f);
+		m_impl->set_ip_filter(compiled);
 	}
 
 	void session::set_port_filter(port_filter const& f)
@@ -409,6 +440,20 @@ namespace libtorrent
 		return m_impl->get_torrents();
 	}
 	
+	int session::save_modified_resume_data()
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		return m_impl->save_modified_resume_data();
+	}
+
+	void session::get_torrent_status(std::vector<torrent_status>* ret
+		, boost::function<bool(torrent_status const&)> const& pred
+		, boost::uint32_t flags) const
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		m_impl->get_torrent_status(ret, pred, flags, l);
+	}
+
 	torrent_handle session::find_torrent(sha1_hash const& info_hash) const
 	{
 		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
@@ -433,6 +478,14 @@ namespace libtorrent
 		return m_impl->add_torrent(params, ec);
 	}
 
+	std::vector<torrent_handle> session::add_torrents(
+		std::vector<add_torrent_params> const& params
+		, std::vector<error_code>& ec)
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		return m_impl->add_torrents(params, ec);
+	}
+
 #ifndef BOOST_NO_EXCEPTIONS
 #ifndef TORRENT_NO_DEPRECATE
 	// if the torrent already exists, this will throw duplicate_torrent
@@ -709,6 +762,18 @@ namespace libtorrent
 		m_impl->set_max_connections(limit);
 	}
 
+	int session::create_bandwidth_class(int parent)
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		return m_impl->create_bandwidth_class(parent);
+	}
+
+	void session::set_bandwidth_class_limits(int c, int upload_limit, int download_limit)
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		m_impl->set_bandwidth_class_limits(c, upload_limit, download_limit);
+	}
+
 	int session::max_half_open_connections() const
 	{
 		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
@@ -779,10 +844,42 @@ namespace libtorrent
 
 	std::auto_ptr<alert> session::pop_alert()
 	{
-		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		// the alert queue has its own mutex
 		return m_impl->pop_alert();
 	}
 
+	void session::pop_alerts(std::deque<alert*>* alerts)
+	{
+		m_impl->pop_alerts(alerts);
+	}
+
+	void session::post_torrent_updates()
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		m_impl->post_torrent_updates();
+	}
+
+	void session::post_session_stats()
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		m_impl->post_session_stats();
+	}
+
+	std::vector<trace_event> session::get_trace() const
+	{
+		std::vector<trace_event> ret;
+		m_impl->get_trace(ret);
+		return ret;
+	}
+
+	latency_stats session::get_latency_stats() const
+	{
+		session_impl::mutex_t::scoped_lock l(m_impl->m_mutex);
+		latency_stats ret;
+		m_impl->get_latency_stats(ret);
+		return ret;
+	}
+
 	void session::set_alert_dispatch(boost::function<void(alert const&)> const& fun)
 	{
 		return m_impl->set_alert_dispatch(fun);
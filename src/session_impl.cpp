@@ -94,6 +94,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef TORRENT_WINDOWS
 #include <sys/resource.h>
+#include <sys/stat.h>
 #endif
 
 #ifndef TORRENT_DISABLE_ENCRYPTION
@@ -176,15 +177,13 @@ namespace aux {
 		: m_ipv4_peer_pool(500)
 #if TORRENT_USE_IPV6
 		, m_ipv6_peer_pool(500)
-#endif
-#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
-		, m_send_buffers(send_buffer_size)
 #endif
 		, m_files(40)
 		, m_io_service()
 		, m_alerts(m_io_service)
 		, m_disk_thread(m_io_service)
 		, m_half_open(m_io_service)
+		, m_host_resolver(m_io_service)
 		, m_download_rate(peer_connection::download_channel)
 #ifdef TORRENT_VERBOSE_BANDWIDTH_LIMIT
 		, m_upload_rate(peer_connection::upload_channel, true)
@@ -195,47 +194,77 @@ namespace aux {
 		, m_listen_port_retries(listen_port_range.second - listen_port_range.first)
 		, m_abort(false)
 		, m_paused(false)
+		, m_state_queue_pos(0)
+		, m_num_state_changed(0)
+		, m_state_queue_posted(false)
 		, m_max_uploads(8)
 		, m_allowed_upload_slots(8)
 		, m_max_connections(200)
 		, m_num_unchoked(0)
+		, m_upload_slot_probe_rate(0.f)
+		, m_saturated_upload_rate(0.f)
 		, m_unchoke_time_scaler(0)
 		, m_auto_manage_time_scaler(0)
 		, m_optimistic_unchoke_time_scaler(0)
 		, m_disconnect_time_scaler(90)
 		, m_auto_scrape_time_scaler(180)
+		, m_auto_tune_time_scaler(0)
 		, m_incoming_connection(false)
 		, m_created(time_now_hires())
 		, m_last_tick(m_created)
 		, m_last_second_tick(m_created)
 		, m_last_choke(m_created)
+		, m_tex_trackers_added(0)
+		, m_tex_interval_start(m_created)
 #ifndef TORRENT_DISABLE_DHT
 		, m_dht_same_port(true)
 		, m_external_udp_port(0)
 		, m_dht_socket(m_io_service, bind(&session_impl::on_receive_udp, this, _1, _2, _3, _4)
 			, m_half_open)
+		, m_utp_socket_manager(m_settings, m_dht_socket
+			, bind(&session_impl::incoming_connection, this, _1))
 #endif
 		, m_timer(m_io_service)
+		, m_bandwidth_timer(m_io_service)
+		, m_last_quota_update(m_created)
 		, m_next_connect_torrent(0)
+		, m_connect_rate(m_settings.connection_speed)
+		, m_connect_time_base(0)
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 		, m_logpath(logpath)
 #endif
 #ifndef TORRENT_DISABLE_GEO_IP
-		, m_asnum_db(0)
 		, m_country_db(0)
+		, m_own_as(0)
 #endif
 		, m_total_failed_bytes(0)
 		, m_total_redundant_bytes(0)
+		, m_total_duplicate_request_bytes(0)
+		, m_total_cancelled_bytes(0)
 	{
 		TORRENT_ASSERT(listen_interface);
 		error_code ec;
 		m_listen_interface = tcp::endpoint(address::from_string(listen_interface, ec), listen_port_range.first);
 		TORRENT_ASSERT(!ec);
 
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		for (int i = 0; i < num_recv_buffer_classes; ++i)
+			m_free_recv_buffers[i].reserve(max_free_recv_buffers);
+		for (int i = 0; i < num_send_buffer_classes; ++i)
+			m_free_send_buffers[i].reserve(max_free_send_buffers);
+#endif
+
+		m_disk_thread.set_trace(&m_trace);
+		m_download_rate.set_trace(&m_trace);
+		m_upload_rate.set_trace(&m_trace);
+
 		m_tcp_mapping[0] = -1;
 		m_tcp_mapping[1] = -1;
 		m_udp_mapping[0] = -1;
 		m_udp_mapping[1] = -1;
+		m_send_buffer_bytes = 0;
+		m_memory_pressure = no_memory_pressure;
+		m_write_throttling = false;
 #ifdef WIN32
 		// windows XP has a limit on the number of
 		// simultaneous half-open TCP connections
@@ -360,23 +389,59 @@ namespace aux {
 
 	int session_impl::as_for_ip(address const& a)
 	{
-		if (!a.is_v4() || m_asnum_db == 0) return 0;
-		char* name = GeoIP_name_by_ipnum(m_asnum_db, a.to_v4().to_ulong());
-		if (name == 0) return 0;
-		free_ptr p(name);
-		// GeoIP returns the name as AS??? where ? is the AS-number
-		return atoi(name + 2);
+		if (!a.is_v4() || m_as_range_start.empty()) return 0;
+		std::vector<boost::uint32_t>::const_iterator i = std::upper_bound(
+			m_as_range_start.begin(), m_as_range_start.end(), a.to_v4().to_ulong());
+		// the first range starts at 0.0.0.0
+		TORRENT_ASSERT(i != m_as_range_start.begin());
+		return m_as_range_num[i - m_as_range_start.begin() - 1];
 	}
 
 	std::string session_impl::as_name_for_ip(address const& a)
 	{
-		if (!a.is_v4() || m_asnum_db == 0) return std::string();
-		char* name = GeoIP_name_by_ipnum(m_asnum_db, a.to_v4().to_ulong());
-		if (name == 0) return std::string();
-		free_ptr p(name);
-		char* tmp = std::strchr(name, ' ');
-		if (tmp == 0) return std::string();
-		return tmp + 1;
+		int as = as_for_ip(a);
+		if (as == 0) return std::string();
+		std::map<int, std::string>::const_iterator i = m_as_names.find(as);
+		if (i == m_as_names.end()) return std::string();
+		return i->second;
+	}
+
+	void session_impl::load_as_ranges(GeoIP* db)
+	{
+		std::vector<boost::uint32_t> start;
+		std::vector<int> num;
+		std::map<int, std::string> names;
+
+		// step through the database one network at a time. Every
+		// lookup leaves the prefix length of the network that
+		// matched in the last netmask
+		boost::uint64_t ip = 0;
+		while (ip <= 0xffffffff)
+		{
+			char* name = GeoIP_name_by_ipnum(db, (unsigned long)ip);
+			int netmask = GeoIP_last_netmask(db);
+			if (netmask < 1 || netmask > 32) netmask = 32;
+			int as = 0;
+			if (name)
+			{
+				free_ptr p(name);
+				// GeoIP returns the name as AS??? where ? is the AS-number
+				as = atoi(name + 2);
+				char* tmp = std::strchr(name, ' ');
+				if (as != 0 && tmp != 0 && names.find(as) == names.end())
+					names[as] = tmp + 1;
+			}
+			if (num.empty() || num.back() != as)
+			{
+				start.push_back(boost::uint32_t(ip));
+				num.push_back(as);
+			}
+			ip += boost::uint64_t(1) << (32 - netmask);
+		}
+
+		m_as_range_start.swap(start);
+		m_as_range_num.swap(num);
+		m_as_names.swap(names);
 	}
 
 	std::pair<const int, int>* session_impl::lookup_as(int as)
@@ -391,21 +456,52 @@ namespace aux {
 		return &(*i);
 	}
 
+	void session_impl::set_cheap_as(std::vector<int> const& as)
+	{
+		m_cheap_as.clear();
+		m_cheap_as.insert(as.begin(), as.end());
+		update_cheap_as();
+	}
+
+	void session_impl::update_cheap_as()
+	{
+		for (torrent_map::iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			policy& p = i->second->get_policy();
+			for (policy::iterator j = p.begin_peer()
+				, end2(p.end_peer()); j != end2; ++j)
+			{
+				policy::peer* pe = *j;
+				pe->cheap_as = pe->inet_as && is_cheap_as(pe->inet_as->first);
+			}
+		}
+	}
+
 	bool session_impl::load_asnum_db(char const* file)
 	{
-		if (m_asnum_db) GeoIP_delete(m_asnum_db);
-		m_asnum_db = GeoIP_open(file, GEOIP_STANDARD);
-		return m_asnum_db;
+		// the whole database is read into memory, so there's
+		// no need to keep it open
+		GeoIP* db = GeoIP_open(file, GEOIP_MEMORY_CACHE);
+		if (db == 0) return false;
+		if (GeoIP_database_edition(db) != GEOIP_ASNUM_EDITION)
+		{
+			GeoIP_delete(db);
+			return false;
+		}
+		load_as_ranges(db);
+		GeoIP_delete(db);
+		if (m_external_address != address())
+			m_own_as = as_for_ip(m_external_address);
+		return true;
 	}
 
 #ifndef BOOST_FILESYSTEM_NARROW_ONLY
 	bool session_impl::load_asnum_db(wchar_t const* file)
 	{
-		if (m_asnum_db) GeoIP_delete(m_asnum_db);
 		std::string utf8;
 		wchar_utf8(file, utf8);
-		m_asnum_db = GeoIP_open(utf8.c_str(), GEOIP_STANDARD);
-		return m_asnum_db;
+		return load_asnum_db(utf8.c_str());
 	}
 
 	bool session_impl::load_country_db(wchar_t const* file)
@@ -497,23 +593,79 @@ namespace aux {
 		(*m_logger) << time_now_string() << " *** session paused ***\n";
 #endif
 		m_paused = true;
-		for (torrent_map::iterator i = m_torrents.begin()
-			, end(m_torrents.end()); i != end; ++i)
-		{
-			torrent& t = *i->second;
-			if (!t.is_torrent_paused()) t.do_pause();
-		}
+		queue_state_change();
 	}
 
 	void session_impl::resume()
 	{
 		if (!m_paused) return;
 		m_paused = false;
-		for (torrent_map::iterator i = m_torrents.begin()
-			, end(m_torrents.end()); i != end; ++i)
+		queue_state_change();
+	}
+
+	void session_impl::queue_state_change()
+	{
+		if (!m_state_queue.empty())
 		{
-			torrent& t = *i->second;
-			t.do_resume();
+			// the previous pause or resume hasn't finished. The torrents
+			// it already got to have to be switched back, the rest are
+			// still in the state we want
+			m_state_queue.resize(m_state_queue_pos);
+		}
+		else
+		{
+			m_state_queue.reserve(m_torrents.size());
+			for (torrent_map::iterator i = m_torrents.begin()
+				, end(m_torrents.end()); i != end; ++i)
+				m_state_queue.push_back(i->second);
+		}
+		m_state_queue_pos = 0;
+		m_num_state_changed = 0;
+
+		if (m_state_queue_posted) return;
+		m_state_queue_posted = true;
+		m_io_service.post(boost::bind(&session_impl::on_state_queue, this));
+	}
+
+	void session_impl::on_state_queue()
+	{
+		session_impl::mutex_t::scoped_lock l(m_mutex);
+
+		m_state_queue_posted = false;
+		if (m_abort) return;
+
+		// the number of torrents to pause or resume before
+		// letting other handlers run
+		const int batch_size = 100;
+		for (int left = batch_size; left > 0
+			&& m_state_queue_pos < int(m_state_queue.size()); --left)
+		{
+			boost::shared_ptr<torrent> t = m_state_queue[m_state_queue_pos++].lock();
+			if (!t || t->is_torrent_paused()) continue;
+			if (m_paused) t->do_pause(false);
+			else t->do_resume(false);
+			++m_num_state_changed;
+		}
+
+		if (m_state_queue_pos < int(m_state_queue.size()))
+		{
+			m_state_queue_posted = true;
+			m_io_service.post(boost::bind(&session_impl::on_state_queue, this));
+			return;
+		}
+
+		std::vector<boost::weak_ptr<torrent> >().swap(m_state_queue);
+		m_state_queue_pos = 0;
+
+		if (m_paused)
+		{
+			if (m_alerts.should_post<session_paused_alert>())
+				m_alerts.post_alert(session_paused_alert(m_num_state_changed));
+		}
+		else
+		{
+			if (m_alerts.should_post<session_resumed_alert>())
+				m_alerts.post_alert(session_resumed_alert(m_num_state_changed));
 		}
 	}
 	
@@ -526,15 +678,21 @@ namespace aux {
 		// abort the main thread
 		m_abort = true;
 		m_queued_for_checking.clear();
+		m_checking_devices.clear();
 		if (m_lsd) m_lsd->close();
 		if (m_upnp) m_upnp->close();
 		if (m_natpmp) m_natpmp->close();
 #ifndef TORRENT_DISABLE_DHT
 		if (m_dht) m_dht->stop();
 		m_dht_socket.close();
+#endif
+		m_host_resolver.abort();
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		m_dh_keys.stop();
 #endif
 		error_code ec;
 		m_timer.cancel(ec);
+		m_bandwidth_timer.cancel(ec);
 
 		// close the listen sockets
 		for (std::list<listen_socket_t>::iterator i = m_listen_sockets.begin()
@@ -611,17 +769,56 @@ namespace aux {
 		m_port_filter = f;
 	}
 
-	void session_impl::set_ip_filter(ip_filter const& f)
+	void session_impl::set_ip_filter(ip_filter& f)
 	{
 		INVARIANT_CHECK;
 
-		m_ip_filter = f;
+		// only peers in the ranges the new filter blocks that the
+		// old one didn't have to be looked at
+		ip_filter::filter_tuple_t delta = f.diff(m_ip_filter);
+		m_ip_filter.swap(f);
+
+		std::vector<ip_range<address_v4> > const& v4 = delta.get<0>();
+		std::vector<ip_range<address_v6> > const& v6 = delta.get<1>();
+		if (v4.empty() && v6.empty()) return;
+
+		// if an earlier update is still being applied, the torrents
+		// it hasn't reached need its ranges as well. Start over with
+		// all of them, checking peers against the current filter
+		m_ip_filter_delta.reserve(m_ip_filter_delta.size() + v4.size() + v6.size());
+		for (std::vector<ip_range<address_v4> >::const_iterator i = v4.begin()
+			, end(v4.end()); i != end; ++i)
+		{
+			ip_range<address> r = { i->first, i->last, i->flags };
+			m_ip_filter_delta.push_back(r);
+		}
+		for (std::vector<ip_range<address_v6> >::const_iterator i = v6.begin()
+			, end(v6.end()); i != end; ++i)
+		{
+			ip_range<address> r = { i->first, i->last, i->flags };
+			m_ip_filter_delta.push_back(r);
+		}
+		m_ip_filter_cursor.clear();
+		update_ip_filter_step();
+	}
+
+	void session_impl::update_ip_filter_step()
+	{
+		// the number of peers and ranges to look at per tick, to
+		// keep a filter update from stalling the network thread
+		const int work_per_tick = 20000;
+
+		int work = 0;
+		torrent_map::iterator i = m_torrents.lower_bound(m_ip_filter_cursor);
+		for (; i != m_torrents.end() && work < work_per_tick; ++i)
+			work += i->second->ip_filter_updated(m_ip_filter_delta) + 1;
 
-		// Close connections whose endpoint is filtered
-		// by the new ip-filter
-		for (torrent_map::iterator i = m_torrents.begin()
-			, end(m_torrents.end()); i != end; ++i)
-			i->second->ip_filter_updated();
+		if (i == m_torrents.end())
+		{
+			std::vector<ip_range<address> >().swap(m_ip_filter_delta);
+			return;
+		}
+		m_ip_filter_cursor = i->first;
 	}
 
 	void session_impl::set_settings(session_settings const& s)
@@ -646,6 +843,10 @@ namespace aux {
 			|| m_settings.write_cache_line_size != s.write_cache_line_size
 			|| m_settings.coalesce_writes != s.coalesce_writes
 			|| m_settings.coalesce_reads != s.coalesce_reads
+			|| m_settings.disk_io_threads != s.disk_io_threads
+			|| m_settings.elevator_disk_reads != s.elevator_disk_reads
+			|| m_settings.max_disk_read_delay != s.max_disk_read_delay
+			|| m_settings.hashing_threads != s.hashing_threads
 #ifndef TORRENT_DISABLE_MLOCK
 			|| m_settings.lock_disk_cache != s.lock_disk_cache
 #endif
@@ -659,8 +860,42 @@ namespace aux {
 			|| m_settings.active_limit != s.active_limit)
 			&& m_auto_manage_time_scaler > 2)
 			m_auto_manage_time_scaler = 2;
+		if (!s.share_peer_reputation) m_peer_reputation.clear();
+		bool restart_bandwidth_timer = s.bandwidth_refill_interval > 0
+			&& s.bandwidth_refill_interval != m_settings.bandwidth_refill_interval;
+#ifndef TORRENT_DISABLE_GEO_IP
+		bool cheap_as_changed = s.prefer_own_as != m_settings.prefer_own_as;
+#endif
+		// start over from the configured rate when it's changed
+		bool reset_connect_rate = s.connection_speed != m_settings.connection_speed
+			|| s.adaptive_connection_speed != m_settings.adaptive_connection_speed;
+		// the torrents' cached seed ranks depend on the seed limits
+		bool seed_limits_changed = s.share_ratio_limit != m_settings.share_ratio_limit
+			|| s.seed_time_ratio_limit != m_settings.seed_time_ratio_limit
+			|| s.seed_time_limit != m_settings.seed_time_limit;
 		m_settings = s;
+		if (seed_limits_changed)
+		{
+			for (torrent_map::iterator i = m_torrents.begin()
+				, end(m_torrents.end()); i != end; ++i)
+				i->second->invalidate_seed_rank();
+		}
+		m_trace.resize(s.trace_buffer_size);
+#ifndef TORRENT_DISABLE_GEO_IP
+		if (cheap_as_changed) update_cheap_as();
+#endif
+		m_tune_base.cache_size = s.cache_size;
+		m_tune_base.read_cache_line_size = s.read_cache_line_size;
+		m_tune_base.send_buffer_watermark = s.send_buffer_watermark;
+		m_tune_base.max_outstanding_disk_bytes_per_connection
+			= s.max_outstanding_disk_bytes_per_connection;
+		if (restart_bandwidth_timer) start_bandwidth_timer();
  		if (m_settings.connection_speed <= 0) m_settings.connection_speed = 200;
+		if (reset_connect_rate)
+		{
+			m_connect_rate = m_settings.connection_speed;
+			m_connect_window = connection_queue::connect_stats();
+		}
  
 		if (update_disk_io_thread)
 		{
@@ -738,7 +973,7 @@ namespace aux {
 			return listen_socket_t();
 		}
 		s.external_port = s.sock->local_endpoint(ec).port();
-		s.sock->listen(5, ec);
+		s.sock->listen(m_settings.listen_queue_size, ec);
 		if (ec)
 		{
 			if (m_alerts.should_post<listen_failed_alert>())
@@ -905,6 +1140,12 @@ namespace aux {
 			// this is probably a dht message
 			m_dht->on_receive(ep, buf, len);
 		}
+		else
+		{
+			// everything else may be uTP
+			mutex_t::scoped_lock l(m_mutex);
+			m_utp_socket_manager.incoming_packet(buf, len, ep);
+		}
 	}
 
 #endif
@@ -959,9 +1200,28 @@ namespace aux {
 				m_alerts.post_alert(listen_failed_alert(ep, e));
 			return;
 		}
+
+		// under a connection storm, more connections are likely
+		// waiting in the backlog. Take a batch of them while we're
+		// here, instead of going through the reactor once for
+		// each of them
+		std::vector<shared_ptr<socket_type> > accepted;
+		accepted.push_back(s);
+		socket_acceptor::non_blocking_io ioc(true);
+		listener->io_control(ioc, ec);
+		while (!ec && accepted.size() < 20)
+		{
+			shared_ptr<socket_type> c(new socket_type(m_io_service));
+			c->instantiate<stream_socket>(m_io_service);
+			listener->accept(*c->get<stream_socket>(), ec);
+			if (!ec) accepted.push_back(c);
+		}
+
 		async_accept(listener);
 
-		incoming_connection(s);
+		for (std::vector<shared_ptr<socket_type> >::iterator i = accepted.begin()
+			, end(accepted.end()); i != end; ++i)
+			incoming_connection(*i);
 	}
 
 	void session_impl::incoming_connection(boost::shared_ptr<socket_type> const& s)
@@ -1069,6 +1329,10 @@ namespace aux {
 				m_settings.recv_socket_buffer_size);
 			s.set_option(option, ec);
 		}
+#if TORRENT_USE_NOTSENT_LOWAT
+		if (m_settings.send_socket_notsent_lowat)
+			s.set_option(tcp_notsent_lowat(m_settings.send_socket_notsent_lowat), ec);
+#endif
 	}
 
 	void session_impl::on_socks_accept(boost::shared_ptr<socket_type> const& s
@@ -1150,6 +1414,65 @@ namespace aux {
 		return port;
 	}
 
+	void session_impl::add_ticking_torrent(torrent& t)
+	{
+		if (t.m_tick_index >= 0) return;
+		t.m_tick_index = m_ticking_torrents.size();
+		m_ticking_torrents.push_back(&t);
+	}
+
+	bool session_impl::allow_tex_tracker()
+	{
+		ptime now = time_now();
+		if (now - m_tex_interval_start >= minutes(1))
+		{
+			m_tex_interval_start = now;
+			m_tex_trackers_added = 0;
+		}
+		if (m_settings.max_tex_trackers_per_minute > 0
+			&& m_tex_trackers_added >= m_settings.max_tex_trackers_per_minute)
+			return false;
+		++m_tex_trackers_added;
+		return true;
+	}
+
+	void session_impl::remove_ticking_torrent(torrent& t)
+	{
+		int i = t.m_tick_index;
+		if (i < 0) return;
+		TORRENT_ASSERT(m_ticking_torrents[i] == &t);
+		torrent* last = m_ticking_torrents.back();
+		m_ticking_torrents[i] = last;
+		last->m_tick_index = i;
+		m_ticking_torrents.pop_back();
+		t.m_tick_index = -1;
+	}
+
+	void session_impl::start_bandwidth_timer()
+	{
+		int interval = (std::max)(m_settings.bandwidth_refill_interval, 10);
+		error_code ec;
+		m_bandwidth_timer.expires_from_now(milliseconds(interval), ec);
+		m_bandwidth_timer.async_wait(bind(&session_impl::on_bandwidth_tick, this, _1));
+	}
+
+	void session_impl::on_bandwidth_tick(error_code const& e)
+	{
+		session_impl::mutex_t::scoped_lock l(m_mutex);
+
+		// the timer is reset when the interval changes, and
+		// stops when it's turned off
+		if (e || m_abort) return;
+		if (m_settings.bandwidth_refill_interval <= 0) return;
+
+		ptime now = time_now_hires();
+		m_download_rate.update_quotas(now - m_last_quota_update);
+		m_upload_rate.update_quotas(now - m_last_quota_update);
+		m_last_quota_update = now;
+
+		start_bandwidth_timer();
+	}
+
 	void session_impl::on_tick(error_code const& e)
 	{
 		session_impl::mutex_t::scoped_lock l(m_mutex);
@@ -1161,6 +1484,9 @@ namespace aux {
 
 		if (m_abort) return;
 
+		m_stats_counters.inc_stats_counter(counters::on_tick_counter);
+		latency_timer tick_timer(m_latency.tick_time);
+
 		if (e)
 		{
 #if defined TORRENT_LOGGING
@@ -1174,14 +1500,30 @@ namespace aux {
 		m_timer.expires_at(now + milliseconds(100), ec);
 		m_timer.async_wait(bind(&session_impl::on_tick, this, _1));
 
-		m_download_rate.update_quotas(now - m_last_tick);
-		m_upload_rate.update_quotas(now - m_last_tick);
+		if (m_settings.bandwidth_refill_interval <= 0)
+		{
+			m_download_rate.update_quotas(now - m_last_quota_update);
+			m_upload_rate.update_quotas(now - m_last_quota_update);
+			m_last_quota_update = now;
+		}
+
+		m_tracker_manager.tick(now - m_last_tick);
 
 		m_last_tick = now;
 
+#ifndef TORRENT_DISABLE_DHT
+		m_utp_socket_manager.tick(now);
+#endif
+
+		if (!m_ip_filter_delta.empty()) update_ip_filter_step();
+
 		// only tick the following once per second
 		if (now - m_last_second_tick < seconds(1)) return;
 
+#ifndef TORRENT_DISABLE_DHT
+		if (m_dht) announce_dht();
+#endif
+
 		float tick_interval = total_microseconds(now - m_last_second_tick) / 1000000.f;
 		m_last_second_tick = now;
 
@@ -1270,6 +1612,9 @@ namespace aux {
 			<< std::endl;
 #endif
 
+		update_memory_pressure();
+		update_write_throttling();
+
 		// --------------------------------------------------------------
 		// check for incoming connections that might have timed out
 		// --------------------------------------------------------------
@@ -1301,30 +1646,19 @@ namespace aux {
 		// count the number of peers of downloading torrents
 		int num_downloads_peers = 0;
 
-		torrent_map::iterator least_recently_scraped = m_torrents.begin();
-		int num_paused_auto_managed = 0;
-
-		for (torrent_map::iterator i = m_torrents.begin();
-			i != m_torrents.end();)
+		// only the torrents that have something to do are
+		// ticked. The idle ones drop out of the list here, and
+		// are counted as uncongested
+		for (int k = 0; k < int(m_ticking_torrents.size());)
 		{
-			torrent& t = *i->second;
+			torrent& t = *m_ticking_torrents[k];
 			TORRENT_ASSERT(!t.is_aborted());
+			TORRENT_ASSERT(t.m_tick_index == k);
 			if (t.statistics().upload_rate() > t.upload_limit() * 0.9f)
 				++congested_torrents;
 			else
 				++uncongested_torrents;
 
-			if (t.is_auto_managed() && t.is_paused() && !t.has_error())
-			{
-				++num_paused_auto_managed;
-				if (!least_recently_scraped->second->is_auto_managed()
-					|| !least_recently_scraped->second->is_paused()
-					|| least_recently_scraped->second->last_scrape() > t.last_scrape())
-				{
-					least_recently_scraped = i;
-				}
-			}
-
 			if (t.is_finished())
 			{
 				++num_seeds;
@@ -1336,8 +1670,14 @@ namespace aux {
 			}
 
 			t.second_tick(m_stat, tick_interval);
-			++i;
+			if (!t.wants_tick())
+			{
+				remove_ticking_torrent(t);
+				continue;
+			}
+			++k;
 		}
+		uncongested_torrents += m_torrents.size() - m_ticking_torrents.size();
 
 		if (m_dht)
 		{
@@ -1378,6 +1718,12 @@ namespace aux {
 
 		m_stat.second_tick(tick_interval);
 
+		if (m_settings.auto_tune && --m_auto_tune_time_scaler <= 0)
+		{
+			m_auto_tune_time_scaler = (std::max)(m_settings.auto_tune_interval, 1);
+			auto_tune_settings();
+		}
+
 		// --------------------------------------------------------------
 		// scrape paused torrents that are auto managed
 		// --------------------------------------------------------------
@@ -1386,6 +1732,24 @@ namespace aux {
 			--m_auto_scrape_time_scaler;
 			if (m_auto_scrape_time_scaler <= 0)
 			{
+				// the paused torrents aren't ticked, so they're
+				// only looked at when it's time to scrape one
+				torrent_map::iterator least_recently_scraped = m_torrents.end();
+				int num_paused_auto_managed = 0;
+				for (torrent_map::iterator i = m_torrents.begin()
+					, end(m_torrents.end()); i != end; ++i)
+				{
+					torrent& t = *i->second;
+					if (!t.is_auto_managed() || !t.is_paused() || t.has_error())
+						continue;
+					++num_paused_auto_managed;
+					if (least_recently_scraped == m_torrents.end()
+						|| least_recently_scraped->second->last_scrape() > t.last_scrape())
+					{
+						least_recently_scraped = i;
+					}
+				}
+
 				m_auto_scrape_time_scaler = m_settings.auto_scrape_interval
 					/ (std::max)(1, num_paused_auto_managed);
 				if (m_auto_scrape_time_scaler < m_settings.auto_scrape_min_interval)
@@ -1405,34 +1769,35 @@ namespace aux {
 		// let torrents connect to peers if they want to
 		// if there are any torrents and any free slots
 
+		update_connect_rate();
+
 		// this loop will "hand out" max(connection_speed
 		// , half_open.free_slots()) to the torrents, in a
 		// round robin fashion, so that every torrent is
 		// equallt likely to connect to a peer
 
+		// paused torrents don't want peers, so only the ticking
+		// torrents need to be considered
 		int free_slots = m_half_open.free_slots();
-		if (!m_torrents.empty()
+		if (!m_ticking_torrents.empty()
 			&& free_slots > -m_half_open.limit()
 			&& num_connections() < m_max_connections
 			&& !m_abort)
 		{
 			// this is the maximum number of connections we will
 			// attempt this tick
-			int max_connections = m_settings.connection_speed;
+			int max_connections = m_connect_rate;
 			int average_peers = 0;
 			if (num_downloads > 0)
 				average_peers = num_downloads_peers / num_downloads;
 
-			torrent_map::iterator i = m_torrents.begin();
-			if (m_next_connect_torrent < int(m_torrents.size()))
-				std::advance(i, m_next_connect_torrent);
-			else
+			if (m_next_connect_torrent >= int(m_ticking_torrents.size()))
 				m_next_connect_torrent = 0;
 			int steps_since_last_connect = 0;
-			int num_torrents = int(m_torrents.size());
+			int num_torrents = int(m_ticking_torrents.size());
 			for (;;)
 			{
-				torrent& t = *i->second;
+				torrent& t = *m_ticking_torrents[m_next_connect_torrent];
 				if (t.want_more_peers())
 				{
 					int connect_points = 100;
@@ -1474,13 +1839,8 @@ namespace aux {
 				}
 				++m_next_connect_torrent;
 				++steps_since_last_connect;
-				++i;
-				if (i == m_torrents.end())
-				{
-					TORRENT_ASSERT(m_next_connect_torrent == num_torrents);
-					i = m_torrents.begin();
+				if (m_next_connect_torrent == num_torrents)
 					m_next_connect_torrent = 0;
-				}
 				// if we have gone two whole loops without
 				// handing out a single connection, break
 				if (steps_since_last_connect > num_torrents * 2) break;
@@ -1594,7 +1954,9 @@ namespace aux {
 		// these vectors are filled with auto managed torrents
 		std::vector<torrent*> downloaders;
 		downloaders.reserve(m_torrents.size());
-		std::vector<torrent*> seeds;
+		// the seeds are paired with their seed rank, which is
+		// too expensive to compute in the sort's comparisons
+		std::vector<std::pair<int, torrent*> > seeds;
 		seeds.reserve(m_torrents.size());
 
 		// these counters are set to the number of torrents
@@ -1620,7 +1982,7 @@ namespace aux {
 				// this torrent is auto managed, add it to
 				// the list (depending on if it's a seed or not)
 				if (t->is_finished())
-					seeds.push_back(t);
+					seeds.push_back(std::make_pair(t->seed_rank(m_settings), t));
 				else
 					downloaders.push_back(t);
 			}
@@ -1650,8 +2012,8 @@ namespace aux {
 				, bind(&torrent::sequence_number, _1) < bind(&torrent::sequence_number, _2));
 
 			std::sort(seeds.begin(), seeds.end()
-				, bind(&torrent::seed_rank, _1, boost::ref(m_settings))
-				> bind(&torrent::seed_rank, _2, boost::ref(m_settings)));
+				, bind(&std::pair<int, torrent*>::first, _1)
+				> bind(&std::pair<int, torrent*>::first, _2));
 		}
 
 		int total_running = 0;
@@ -1680,10 +2042,10 @@ namespace aux {
 			}
 		}
 
-		for (std::vector<torrent*>::iterator i = seeds.begin()
+		for (std::vector<std::pair<int, torrent*> >::iterator i = seeds.begin()
 			, end(seeds.end()); i != end; ++i)
 		{
-			torrent* t = *i;
+			torrent* t = i->second;
 			if (!t->is_paused() && !is_active(t, settings())
 				&& hard_limit > 0)
 			{
@@ -1706,6 +2068,114 @@ namespace aux {
 		}
 	}
 
+	namespace
+	{
+		// moves v up by a quarter, but not past ceiling
+		int tune_up(int v, int ceiling)
+		{
+			int ret = v + (std::max)(v / 4, 1);
+			if (ret > ceiling) ret = ceiling;
+			return (std::max)(ret, v);
+		}
+
+		// moves v a quarter of the way back down to floor
+		int tune_down(int v, int floor)
+		{
+			if (v <= floor) return v;
+			return v - (std::max)((v - floor) / 4, 1);
+		}
+	}
+
+	void session_impl::auto_tune_settings()
+	{
+		cache_status cs = m_disk_thread.status();
+		counters const& c = m_stats_counters;
+		counters const& last = m_tune_last_counters;
+
+		size_type reads = cs.blocks_read - m_tune_last_cache.blocks_read;
+		size_type hits = cs.blocks_read_hit - m_tune_last_cache.blocks_read_hit;
+		boost::int64_t sends = c[counters::on_write_counter]
+			- last[counters::on_write_counter];
+		boost::int64_t drained = c[counters::num_send_buffer_drained]
+			- last[counters::num_send_buffer_drained];
+		boost::int64_t limit_hits = c[counters::num_disk_write_limit_hits]
+			- last[counters::num_disk_write_limit_hits];
+		m_tune_last_cache = cs;
+		m_tune_last_counters = c;
+
+		session_settings& s = m_settings;
+		tuned_settings const& base = m_tune_base;
+		int const cache_size = s.cache_size;
+		int const read_cache_line_size = s.read_cache_line_size;
+
+		if (s.auto_tune_memory_limit > 0
+			&& cs.total_used_buffers > s.auto_tune_memory_limit)
+		{
+			// too much memory in use. Back off everything that
+			// makes us hold on to more buffers
+			s.cache_size = tune_down(s.cache_size, base.cache_size);
+			s.read_cache_line_size = tune_down(s.read_cache_line_size
+				, base.read_cache_line_size);
+			s.send_buffer_watermark = tune_down(s.send_buffer_watermark
+				, base.send_buffer_watermark);
+			s.max_outstanding_disk_bytes_per_connection = tune_down(
+				s.max_outstanding_disk_bytes_per_connection
+				, base.max_outstanding_disk_bytes_per_connection);
+		}
+		else
+		{
+			// don't act on too few reads, the ratio is just noise
+			if (reads >= 64)
+			{
+				float hit_ratio = float(hits) / reads;
+				// a full cache with few hits is too small for
+				// the working set
+				if (hit_ratio < 0.5f && cs.cache_size >= s.cache_size * 9 / 10)
+					s.cache_size = tune_up(s.cache_size, s.auto_tune_max_cache_size);
+
+				// when most reads hit the cache, the blocks read
+				// ahead are used and reading more of them pays off.
+				// When few do, the read-ahead is mostly wasted
+				if (hit_ratio > 0.8f)
+					s.read_cache_line_size = tune_up(s.read_cache_line_size
+						, s.auto_tune_max_read_cache_line_size);
+				else if (hit_ratio < 0.3f)
+					s.read_cache_line_size = tune_down(s.read_cache_line_size
+						, base.read_cache_line_size);
+			}
+
+			// peers whose send buffer runs dry while they're waiting
+			// for the disk would upload faster with a deeper buffer
+			if (sends > 0 && drained * 10 > sends)
+				s.send_buffer_watermark = tune_up(s.send_buffer_watermark
+					, s.auto_tune_max_send_buffer_watermark);
+
+			// peers stopped reading from the socket because of
+			// their outstanding disk writes
+			if (limit_hits > 0)
+				s.max_outstanding_disk_bytes_per_connection = tune_up(
+					s.max_outstanding_disk_bytes_per_connection
+					, s.auto_tune_max_outstanding_disk_bytes);
+		}
+
+#if defined TORRENT_LOGGING
+		(*m_logger) << time_now_string() << " auto tune: cache_size: " << s.cache_size
+			<< " read_cache_line_size: " << s.read_cache_line_size
+			<< " send_buffer_watermark: " << s.send_buffer_watermark
+			<< " max_outstanding_disk_bytes: " << s.max_outstanding_disk_bytes_per_connection
+			<< " buffers in use: " << cs.total_used_buffers << "\n";
+#endif
+
+		if (s.cache_size != cache_size
+			|| s.read_cache_line_size != read_cache_line_size)
+		{
+			disk_io_job j;
+			j.buffer = (char*)&m_settings;
+			j.action = disk_io_job::update_settings;
+			m_disk_thread.add_job(j);
+		}
+	}
+
 	void session_impl::recalculate_optimistic_unchoke_slot()
 	{
 		if (m_allowed_upload_slots == 0) return;
@@ -1794,6 +2264,7 @@ namespace aux {
 		ptime now = time_now();
 		time_duration unchoke_interval = now - m_last_choke;
 		m_last_choke = now;
+		ptime round_start = m_trace.enabled() ? time_now_hires() : now;
 
 		// build list of all peers that are
 		// unchoke:able.
@@ -1829,10 +2300,21 @@ namespace aux {
 			peers.push_back(p.get());
 		}
 
+		int upload_limit = m_bandwidth_channel[peer_connection::upload_channel]->throttle();
+
+		// with the rate based seed choker and no upload limit to
+		// aim for, the number of slots is found by probing for
+		// the upload capacity instead
+		bool probe_upload_slots = m_settings.seed_choking_algorithm
+			== session_settings::rate_based
+			&& m_settings.auto_upload_slots
+			&& upload_limit <= 0;
+
 		// if the client is configured to use fully automatic
 		// unchoke slots, ignore m_max_uploads
 		if (m_settings.auto_upload_slots_rate_based
-			&& m_settings.auto_upload_slots)
+			&& m_settings.auto_upload_slots
+			&& !probe_upload_slots)
 		{
 			m_allowed_upload_slots = 0;
 			std::sort(peers.begin(), peers.end()
@@ -1873,15 +2355,7 @@ namespace aux {
 			++m_allowed_upload_slots;
 		}
 
-		// sorts the peers that are eligible for unchoke by download rate and secondary
-		// by total upload. The reason for this is, if all torrents are being seeded,
-		// the download rate will be 0, and the peers we have sent the least to should
-		// be unchoked
-		std::sort(peers.begin(), peers.end()
-			, bind(&peer_connection::unchoke_compare, _1, _2));
-
 		// auto unchoke
-		int upload_limit = m_bandwidth_channel[peer_connection::upload_channel]->throttle();
 		if (!m_settings.auto_upload_slots_rate_based
 			&& m_settings.auto_upload_slots
 			&& upload_limit > 0)
@@ -1904,15 +2378,67 @@ namespace aux {
 			}
 		}
 
+		if (probe_upload_slots)
+		{
+			// a slot is added as long as the previous one raised the
+			// upload rate. Once one doesn't, the upload is saturated
+			// and that slot is taken back. A new probe starts when
+			// the rate has moved away from the saturated rate
+			float rate = m_stat.upload_rate();
+			if (m_upload_slot_probe_rate > 0.f)
+			{
+				if (rate > m_upload_slot_probe_rate * 1.05f)
+				{
+					++m_allowed_upload_slots;
+					m_upload_slot_probe_rate = rate;
+				}
+				else
+				{
+					if (m_allowed_upload_slots > m_max_uploads)
+						--m_allowed_upload_slots;
+					m_upload_slot_probe_rate = 0.f;
+					m_saturated_upload_rate = rate;
+				}
+			}
+			else if (m_allowed_upload_slots <= m_num_unchoked + 1
+				&& int(peers.size()) >= m_allowed_upload_slots
+				&& (rate < m_saturated_upload_rate * 0.9f
+					|| rate > m_saturated_upload_rate * 1.1f))
+			{
+				m_upload_slot_probe_rate = (std::max)(rate, 1.f);
+				++m_allowed_upload_slots;
+			}
+		}
+		else
+		{
+			m_upload_slot_probe_rate = 0.f;
+			m_saturated_upload_rate = 0.f;
+		}
+
 		// reserve one upload slot for optimistic unchokes
 		int unchoke_set_size = m_allowed_upload_slots - 1;
 
 		m_num_unchoked = 0;
 		// go through all the peers and unchoke the first ones and choke
 		// all the other ones.
+		// The peers that are eligible for unchoke are ordered by download
+		// rate and secondary by total upload. The reason for this is, if
+		// all torrents are being seeded, the download rate will be 0, and
+		// the peers we have sent the least to should be unchoked. Only the
+		// ones that will be unchoked need to be in order, so they're sorted
+		// one batch of the remaining slots at a time. A new batch is only
+		// needed when some peers couldn't be unchoked
+		std::vector<peer_connection*>::iterator sorted_end = peers.begin();
 		for (std::vector<peer_connection*>::iterator i = peers.begin()
 			, end(peers.end()); i != end; ++i)
 		{
+			if (i == sorted_end && unchoke_set_size > 0)
+			{
+				sorted_end = i + (std::min)(unchoke_set_size, int(end - i));
+				std::partial_sort(i, sorted_end, end
+					, bind(&peer_connection::unchoke_compare, _1, _2));
+			}
+
 			peer_connection* p = *i;
 			TORRENT_ASSERT(p);
 			TORRENT_ASSERT(!p->ignore_unchoke_slots());
@@ -1954,6 +2480,13 @@ namespace aux {
 					++m_num_unchoked;
 			}
 		}
+
+		if (m_trace.enabled())
+		{
+			m_trace.span("choker", "unchoke round", round_start, time_now_hires()
+				, 0, "peers", int(peers.size()), "unchoked", m_num_unchoked
+				, "slots", m_allowed_upload_slots);
+		}
 	}
 
 	void session_impl::operator()()
@@ -2000,7 +2533,12 @@ namespace aux {
 #if defined(TORRENT_VERBOSE_LOGGING) || defined(TORRENT_LOGGING)
 		(*m_logger) << time_now_string() << " cleaning up torrents\n";
 #endif
+		m_ticking_torrents.clear();
+		m_state_updates.clear();
 		m_torrents.clear();
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		m_obfuscated_torrents.clear();
+#endif
 
 		TORRENT_ASSERT(m_torrents.empty());
 		TORRENT_ASSERT(m_connections.empty());
@@ -2025,6 +2563,15 @@ namespace aux {
 		return boost::weak_ptr<torrent>();
 	}
 
+#ifndef TORRENT_DISABLE_ENCRYPTION
+	boost::weak_ptr<torrent> session_impl::find_encrypted_torrent(sha1_hash const& obfuscated_hash)
+	{
+		torrent_map::iterator i = m_obfuscated_torrents.find(obfuscated_hash);
+		if (i != m_obfuscated_torrents.end()) return i->second;
+		return boost::weak_ptr<torrent>();
+	}
+#endif
+
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 	boost::shared_ptr<logger> session_impl::create_log(std::string const& name
 		, int instance, bool append)
@@ -2048,23 +2595,106 @@ namespace aux {
 		return ret;
 	}
 
-	torrent_handle session_impl::find_torrent_handle(sha1_hash const& info_hash)
+	int session_impl::save_modified_resume_data()
 	{
-		return torrent_handle(find_torrent(info_hash));
+		int ret = 0;
+		for (session_impl::torrent_map::iterator i
+			= m_torrents.begin(), end(m_torrents.end());
+			i != end; ++i)
+		{
+			torrent& t = *i->second;
+			if (t.is_aborted() || !t.need_save_resume_data()) continue;
+			t.save_resume_data();
+			++ret;
+		}
+		return ret;
 	}
 
-	torrent_handle session_impl::add_torrent(add_torrent_params const& params
-		, error_code& ec)
+	void session_impl::on_torrent_status_callback(boost::condition& c
+		, std::vector<torrent_status>* ret
+		, boost::function<bool(torrent_status const&)> const& pred
+		, boost::uint32_t flags, bool& done) const
 	{
-		TORRENT_ASSERT(!params.save_path.empty());
-
-		if (params.ti && params.ti->num_files() == 0)
+		mutex_t::scoped_lock l(m_mutex);
+		for (session_impl::torrent_map::const_iterator i
+			= m_torrents.begin(), end(m_torrents.end());
+			i != end; ++i)
 		{
-			ec = error_code(errors::no_files_in_torrent, libtorrent_category);
-			return torrent_handle();
+			if (i->second->is_aborted()) continue;
+			torrent_status st = i->second->status(flags);
+			if (!pred(st)) continue;
+			ret->push_back(st);
 		}
+		done = true;
+		c.notify_all();
+	}
 
-//		INVARIANT_CHECK;
+	// builds the status of all torrents in one go on the network
+	// thread, instead of one round trip per torrent
+	void session_impl::get_torrent_status(std::vector<torrent_status>* ret
+		, boost::function<bool(torrent_status const&)> const& pred
+		, boost::uint32_t flags, session_impl::mutex_t::scoped_lock& l) const
+	{
+		boost::condition cond;
+		bool done = false;
+		m_io_service.post(boost::bind(&session_impl::on_torrent_status_callback
+			, this, boost::ref(cond), ret, boost::cref(pred), flags, boost::ref(done)));
+		while (!done) cond.wait(l);
+	}
+
+	torrent_handle session_impl::find_torrent_handle(sha1_hash const& info_hash)
+	{
+		return torrent_handle(find_torrent(info_hash));
+	}
+
+	int session_impl::next_queue_position() const
+	{
+		int queue_pos = 0;
+		for (torrent_map::const_iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			int pos = i->second->queue_position();
+			if (pos >= queue_pos) queue_pos = pos + 1;
+		}
+		return queue_pos;
+	}
+
+	torrent_handle session_impl::add_torrent(add_torrent_params const& params
+		, error_code& ec)
+	{
+		int queue_pos = next_queue_position();
+		return add_torrent_impl(params, ec, queue_pos);
+	}
+
+	std::vector<torrent_handle> session_impl::add_torrents(
+		std::vector<add_torrent_params> const& params
+		, std::vector<error_code>& ec)
+	{
+		std::vector<torrent_handle> ret;
+		ret.reserve(params.size());
+		ec.clear();
+		ec.resize(params.size());
+
+		// finding the end of the queue means looking at every
+		// torrent, so it's only done once for the whole batch
+		int queue_pos = next_queue_position();
+		for (int i = 0; i < int(params.size()); ++i)
+			ret.push_back(add_torrent_impl(params[i], ec[i], queue_pos));
+		return ret;
+	}
+
+	torrent_handle session_impl::add_torrent_impl(add_torrent_params const& params
+		, error_code& ec, int& queue_pos)
+	{
+		TORRENT_ASSERT(!params.save_path.empty());
+
+		if (params.ti && params.ti->num_files() == 0)
+		{
+			ec = error_code(errors::no_files_in_torrent, libtorrent_category);
+			return torrent_handle();
+		}
+
+//		INVARIANT_CHECK;
 
 		if (is_aborted())
 		{
@@ -2088,17 +2718,13 @@ namespace aux {
 			return torrent_handle();
 		}
 
-		int queue_pos = 0;
-		for (torrent_map::const_iterator i = m_torrents.begin()
-			, end(m_torrents.end()); i != end; ++i)
-		{
-			int pos = i->second->queue_position();
-			if (pos >= queue_pos) queue_pos = pos + 1;
-		}
-
 		torrent_ptr.reset(new torrent(*this, m_listen_interface
 			, 16 * 1024, queue_pos, params));
 		torrent_ptr->start();
+		// torrents that start out finished leave the queue, and
+		// their position is free again
+		if (torrent_ptr->queue_position() >= 0)
+			queue_pos = torrent_ptr->queue_position() + 1;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		for (extension_list_t::iterator i = m_extensions.begin()
@@ -2121,6 +2747,10 @@ namespace aux {
 #endif
 
 		m_torrents.insert(std::make_pair(*ih, torrent_ptr));
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		m_obfuscated_torrents.insert(std::make_pair(torrent_ptr->obfuscated_hash(), torrent_ptr));
+#endif
+		add_ticking_torrent(*torrent_ptr);
 
 		// if this is an auto managed torrent, force a recalculation
 		// of which torrents to have active
@@ -2130,23 +2760,101 @@ namespace aux {
 		return torrent_handle(torrent_ptr);
 	}
 
+	namespace
+	{
+		// identifies the device the path is stored on. A path
+		// that doesn't exist yet is on the device of its closest
+		// existing parent
+		std::string device_for_path(fs::path p)
+		{
+#ifdef TORRENT_WINDOWS
+			return fs::path(p.root_name()).string();
+#else
+			struct ::stat st;
+			while (::stat(p.string().c_str(), &st) != 0)
+			{
+#if BOOST_VERSION < 103600
+				if (!p.has_branch_path()) return std::string();
+				p = p.branch_path();
+#else
+				if (!p.has_parent_path()) return std::string();
+				p = p.parent_path();
+#endif
+			}
+			return boost::lexical_cast<std::string>(st.st_dev);
+#endif
+		}
+
+		bool queued_before(boost::shared_ptr<torrent> const& lhs
+			, boost::shared_ptr<torrent> const& rhs)
+		{
+			return lhs->queue_position() < rhs->queue_position();
+		}
+	}
+
 	void session_impl::check_torrent(boost::shared_ptr<torrent> const& t)
 	{
 		if (m_abort) return;
 		TORRENT_ASSERT(t->should_check_files());
 		TORRENT_ASSERT(t->state() != torrent_status::checking_files);
-		if (m_queued_for_checking.empty()) t->start_checking();
-		else t->set_state(torrent_status::queued_for_checking);
 		TORRENT_ASSERT(std::find(m_queued_for_checking.begin()
 			, m_queued_for_checking.end(), t) == m_queued_for_checking.end());
+
+		if (m_settings.checking_torrents_per_device > 0)
+		{
+			m_checking_devices[t.get()] = device_for_path(t->save_path());
+			t->set_state(torrent_status::queued_for_checking);
+			m_queued_for_checking.push_back(t);
+			start_device_checks();
+			return;
+		}
+
+		if (m_queued_for_checking.empty()) t->start_checking();
+		else t->set_state(torrent_status::queued_for_checking);
 		m_queued_for_checking.push_back(t);
 	}
 
+	void session_impl::start_device_checks()
+	{
+		std::map<std::string, int> checking;
+		std::vector<boost::shared_ptr<torrent> > queued;
+		for (check_queue_t::iterator i = m_queued_for_checking.begin()
+			, end(m_queued_for_checking.end()); i != end; ++i)
+		{
+			// torrents queued before checking_torrents_per_device was
+			// enabled don't have a device, they count as one
+			std::string const& dev = m_checking_devices[i->get()];
+			if ((*i)->state() == torrent_status::checking_files) ++checking[dev];
+			else queued.push_back(*i);
+		}
+
+		std::stable_sort(queued.begin(), queued.end(), &queued_before);
+		for (std::vector<boost::shared_ptr<torrent> >::iterator i = queued.begin()
+			, end(queued.end()); i != end; ++i)
+		{
+			int& num = checking[m_checking_devices[i->get()]];
+			if (num >= m_settings.checking_torrents_per_device) continue;
+			++num;
+			(*i)->start_checking();
+		}
+	}
+
 	void session_impl::done_checking(boost::shared_ptr<torrent> const& t)
 	{
 		INVARIANT_CHECK;
 
 		if (m_queued_for_checking.empty()) return;
+
+		if (m_settings.checking_torrents_per_device > 0)
+		{
+			check_queue_t::iterator done = std::find(m_queued_for_checking.begin()
+				, m_queued_for_checking.end(), t);
+			if (done == m_queued_for_checking.end()) return;
+			m_queued_for_checking.erase(done);
+			m_checking_devices.erase(t.get());
+			start_device_checks();
+			return;
+		}
 		boost::shared_ptr<torrent> next_check = *m_queued_for_checking.begin();
 		check_queue_t::iterator done = m_queued_for_checking.end();
 		for (check_queue_t::iterator i = m_queued_for_checking.begin()
@@ -2163,6 +2871,7 @@ namespace aux {
 		if (next_check != t && t->state() == torrent_status::checking_files)
 			next_check->start_checking();
 		m_queued_for_checking.erase(done);
+		m_checking_devices.erase(t.get());
 	}
 
 	void session_impl::remove_torrent(const torrent_handle& h, int options)
@@ -2191,10 +2900,21 @@ namespace aux {
 			sha1_hash i_hash = t.torrent_file().info_hash();
 #endif
 			t.set_queue_position(-1);
+			remove_ticking_torrent(t);
+			if (t.m_in_state_updates)
+			{
+				m_state_updates.erase(std::find(m_state_updates.begin()
+					, m_state_updates.end(), &t));
+				t.m_in_state_updates = false;
+			}
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			m_obfuscated_torrents.erase(t.obfuscated_hash());
+#endif
 			m_torrents.erase(i);
 			std::list<boost::shared_ptr<torrent> >::iterator k
 				= std::find(m_queued_for_checking.begin(), m_queued_for_checking.end(), tptr);
 			if (k != m_queued_for_checking.end()) m_queued_for_checking.erase(k);
+			m_checking_devices.erase(tptr.get());
 			TORRENT_ASSERT(m_torrents.find(i_hash) == m_torrents.end());
 			return;
 		}
@@ -2270,6 +2990,46 @@ namespace aux {
 			m_lsd->announce(ih, m_listen_interface.port());
 	}
 
+#ifndef TORRENT_DISABLE_DHT
+	void session_impl::prioritize_dht(boost::weak_ptr<torrent> t)
+	{
+		if (!m_dht) return;
+		m_dht_torrents.push_back(t);
+	}
+
+	// called once per second. Instead of letting every torrent
+	// announce on its own timer, which makes large sessions send
+	// their announces in bursts, the session visits a slice of
+	// the torrents every second, large enough for every torrent
+	// to be visited once every 14 minutes
+	void session_impl::announce_dht()
+	{
+		int num_announces = (int(m_torrents.size()) + 839) / 840;
+
+		// torrents that were just started go first. Don't let
+		// a large number of them being started at once turn into
+		// a burst either
+		int num_prio = (std::max)(num_announces, 5);
+		while (!m_dht_torrents.empty() && num_prio > 0)
+		{
+			boost::shared_ptr<torrent> t = m_dht_torrents.front().lock();
+			m_dht_torrents.pop_front();
+			if (t && t->dht_announce()) --num_prio;
+		}
+
+		if (m_torrents.empty()) return;
+
+		torrent_map::iterator i = m_torrents.lower_bound(m_next_dht_torrent);
+		for (int k = 0; k < num_announces; ++k)
+		{
+			if (i == m_torrents.end()) i = m_torrents.begin();
+			i->second->dht_announce();
+			++i;
+		}
+		m_next_dht_torrent = i == m_torrents.end() ? sha1_hash(0) : i->first;
+	}
+#endif
+
 	void session_impl::on_lsd_peer(tcp::endpoint peer, sha1_hash const& ih)
 	{
 		mutex_t::scoped_lock l(m_mutex);
@@ -2353,9 +3113,17 @@ namespace aux {
 		s.num_peers = (int)m_connections.size();
 		s.num_unchoked = m_num_unchoked;
 		s.allowed_upload_slots = m_allowed_upload_slots;
+		s.connection_speed = m_connect_rate;
+
+		s.peers_memory = 0;
+		for (connection_map::const_iterator i = m_connections.begin()
+			, end(m_connections.end()); i != end; ++i)
+			s.peers_memory += (*i)->memory_usage();
 
 		s.total_redundant_bytes = m_total_redundant_bytes;
 		s.total_failed_bytes = m_total_failed_bytes;
+		s.total_duplicate_request_bytes = m_total_duplicate_request_bytes;
+		s.total_cancelled_bytes = m_total_cancelled_bytes;
 
 		s.up_bandwidth_queue = m_upload_rate.queue_size();
 		s.down_bandwidth_queue = m_download_rate.queue_size();
@@ -2363,8 +3131,26 @@ namespace aux {
 		s.up_bandwidth_bytes_queue = m_upload_rate.queued_bytes();
 		s.down_bandwidth_bytes_queue = m_download_rate.queued_bytes();
 
+		s.bandwidth_classes.resize(m_bandwidth_classes.size());
+		for (int i = 0; i < int(m_bandwidth_classes.size()); ++i)
+		{
+			bandwidth_class const& bc = m_bandwidth_classes[i];
+			bandwidth_class_status& st = s.bandwidth_classes[i];
+			bandwidth_channel const& up = bc.channel[peer_connection::upload_channel];
+			bandwidth_channel const& down = bc.channel[peer_connection::download_channel];
+			st.parent = bc.parent;
+			st.upload_limit = up.throttle();
+			st.download_limit = down.throttle();
+			st.total_upload = up.total_used();
+			st.total_download = down.total_used();
+		}
+
 		s.has_incoming_connections = m_incoming_connection;
 
+		s.open_files = m_files.num_open();
+		m_files.get_stats(s.file_pool_hits, s.file_pool_misses
+			, s.file_pool_evictions);
+
 		// total
 		s.download_rate = m_stat.download_rate();
 		s.total_upload = m_stat.total_upload();
@@ -2423,6 +3209,7 @@ namespace aux {
 			m_dht->stop();
 			m_dht = 0;
 		}
+		m_next_dht_torrent.clear();
 		if (m_dht_settings.service_port == 0
 			|| m_dht_same_port)
 		{
@@ -2495,6 +3282,7 @@ namespace aux {
 		if (!m_dht) return;
 		m_dht->stop();
 		m_dht = 0;
+		m_dht_torrents.clear();
 	}
 
 	void session_impl::set_dht_settings(dht_settings const& settings)
@@ -2592,7 +3380,6 @@ namespace aux {
 		m_disk_thread.join();
 
 #ifndef TORRENT_DISABLE_GEO_IP
-		if (m_asnum_db) GeoIP_delete(m_asnum_db);
 		if (m_country_db) GeoIP_delete(m_country_db);
 #endif
 #if defined(TORRENT_VERBOSE_LOGGING) || defined(TORRENT_LOGGING)
@@ -2600,12 +3387,31 @@ namespace aux {
 #endif
 		m_thread->join();
 
+		// queued read_range_alerts hold references to disk buffers,
+		// which have to be dropped while the disk thread still exists
+		std::deque<alert*> alerts;
+		m_alerts.get_all(alerts);
+		for (std::deque<alert*>::iterator i = alerts.begin()
+			, end(alerts.end()); i != end; ++i)
+			delete *i;
+
 		TORRENT_ASSERT(m_torrents.empty());
 		TORRENT_ASSERT(m_connections.empty());
 #if defined(TORRENT_VERBOSE_LOGGING) || defined(TORRENT_LOGGING)
 		(*m_logger) << time_now_string() << " shutdown complete!\n";
 #endif
 		TORRENT_ASSERT(m_connections.empty());
+
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		for (int i = 0; i < num_send_buffer_classes; ++i)
+		{
+			std::vector<char*>& free_list = m_free_send_buffers[i];
+			for (std::vector<char*>::iterator j = free_list.begin()
+				, end(free_list.end()); j != end; ++j)
+				std::free(*j);
+			free_list.clear();
+		}
+#endif
 	}
 
 	void session_impl::set_max_uploads(int limit)
@@ -2640,6 +3446,57 @@ namespace aux {
 		m_max_connections = limit;
 	}
 
+	void session_impl::update_connect_rate()
+	{
+		connection_queue::connect_stats& w = m_connect_window;
+		m_half_open.get_connect_stats(w);
+
+		if (!m_settings.adaptive_connection_speed)
+		{
+			m_connect_rate = m_settings.connection_speed;
+			w = connection_queue::connect_stats();
+			return;
+		}
+
+		int max_rate = (std::max)(m_settings.max_connection_speed, 1);
+		int min_rate = (std::min)((std::max)(m_settings.min_connection_speed, 1), max_rate);
+
+		// wait for enough attempts to have ended to tell
+		// congestion apart from a few unlucky peers
+		int attempts = w.succeeded + w.failed + w.timed_out;
+		if (attempts >= 20)
+		{
+			// refused connections mean the peer is gone, but
+			// attempts that get no answer at all are what a full
+			// NAT table or a saturated uplink looks like
+			bool congested = w.timed_out * 4 > attempts;
+
+			if (w.succeeded > 0)
+			{
+				int connect_time = int(w.total_time / w.succeeded);
+				// the base follows lower connect times right away, and
+				// higher ones slowly, in case the peers are further away
+				if (m_connect_time_base == 0 || connect_time < m_connect_time_base)
+					m_connect_time_base = connect_time;
+				else
+					m_connect_time_base += (connect_time - m_connect_time_base) / 32 + 1;
+				if (connect_time > m_connect_time_base * 3 + 100) congested = true;
+			}
+			else if (w.timed_out > w.failed)
+			{
+				// nothing got through
+				congested = true;
+			}
+
+			if (congested) m_connect_rate /= 2;
+			else m_connect_rate += (std::max)(max_rate / 20, 1);
+			w = connection_queue::connect_stats();
+		}
+
+		if (m_connect_rate < min_rate) m_connect_rate = min_rate;
+		if (m_connect_rate > max_rate) m_connect_rate = max_rate;
+	}
+
 	void session_impl::set_max_half_open_connections(int limit)
 	{
 		INVARIANT_CHECK;
@@ -2684,6 +3541,74 @@ namespace aux {
 		m_upload_channel.throttle(bytes_per_second);
 	}
 
+	void session_impl::update_peer_reputation(policy::peer const& p)
+	{
+		if (!m_settings.share_peer_reputation) return;
+
+		std::map<address, peer_reputation>::iterator i
+			= m_peer_reputation.find(p.address());
+		if (i == m_peer_reputation.end())
+		{
+			if (p.failcount == 0 && !p.banned) return;
+			// the table is bounded by the size of a peer list
+			if (m_settings.max_peerlist_size > 0
+				&& int(m_peer_reputation.size()) >= m_settings.max_peerlist_size)
+				return;
+			peer_reputation r = { 0, false };
+			i = m_peer_reputation.insert(std::make_pair(p.address(), r)).first;
+		}
+
+		// a ban in any torrent sticks
+		i->second.failcount = p.failcount;
+		i->second.banned |= p.banned;
+		if (i->second.failcount == 0 && !i->second.banned)
+			m_peer_reputation.erase(i);
+	}
+
+	void session_impl::apply_peer_reputation(policy::peer& p) const
+	{
+		if (!m_settings.share_peer_reputation) return;
+
+		std::map<address, peer_reputation>::const_iterator i
+			= m_peer_reputation.find(p.address());
+		if (i == m_peer_reputation.end()) return;
+		if (i->second.failcount > p.failcount) p.failcount = i->second.failcount;
+		if (i->second.banned) p.banned = true;
+	}
+
+	int session_impl::create_bandwidth_class(int parent)
+	{
+		TORRENT_ASSERT(parent >= -1 && parent < int(m_bandwidth_classes.size()));
+		if (parent >= int(m_bandwidth_classes.size())) parent = -1;
+
+		m_bandwidth_classes.push_back(bandwidth_class());
+		bandwidth_class& bc = m_bandwidth_classes.back();
+		bc.parent = parent;
+		if (parent >= 0)
+		{
+			// a parent always has a lower id, so there can't be cycles
+			bc.channel[peer_connection::upload_channel].parent
+				= &m_bandwidth_classes[parent].channel[peer_connection::upload_channel];
+			bc.channel[peer_connection::download_channel].parent
+				= &m_bandwidth_classes[parent].channel[peer_connection::download_channel];
+		}
+		return m_bandwidth_classes.size() - 1;
+	}
+
+	void session_impl::set_bandwidth_class_limits(int c, int upload_limit, int download_limit)
+	{
+		if (c < 0 || c >= int(m_bandwidth_classes.size())) return;
+		bandwidth_class& bc = m_bandwidth_classes[c];
+		bc.channel[peer_connection::upload_channel].throttle((std::max)(upload_limit, 0));
+		bc.channel[peer_connection::download_channel].throttle((std::max)(download_limit, 0));
+	}
+
+	bandwidth_channel* session_impl::bandwidth_class_channel(int c, int channel)
+	{
+		if (c < 0 || c >= int(m_bandwidth_classes.size())) return 0;
+		return &m_bandwidth_classes[c].channel[channel];
+	}
+
 	void session_impl::set_alert_dispatch(boost::function<void(alert const&)> const& fun)
 	{
 		m_alerts.set_dispatch_function(fun);
@@ -2694,11 +3619,86 @@ namespace aux {
 // too expensive
 //		INVARIANT_CHECK;
 
-		if (m_alerts.pending())
-			return m_alerts.get();
-		return std::auto_ptr<alert>(0);
+		return m_alerts.pop();
+	}
+
+	void session_impl::pop_alerts(std::deque<alert*>* alerts)
+	{
+		TORRENT_ASSERT(alerts);
+		m_alerts.get_all(*alerts);
+	}
+
+	void session_impl::add_state_update(torrent& t)
+	{
+		TORRENT_ASSERT(!t.m_in_state_updates);
+		t.m_in_state_updates = true;
+		m_state_updates.push_back(&t);
+	}
+
+	void session_impl::post_torrent_updates()
+	{
+		if (!m_alerts.should_post<state_update_alert>()) return;
+
+		std::auto_ptr<state_update_alert> alert(new (std::nothrow) state_update_alert);
+		if (alert.get() == 0) return;
+		alert->status.reserve(m_state_updates.size());
+		for (std::vector<torrent*>::iterator i = m_state_updates.begin()
+			, end(m_state_updates.end()); i != end; ++i)
+		{
+			torrent* t = *i;
+			TORRENT_ASSERT(t->m_in_state_updates);
+			alert->status.push_back(t->status());
+			t->m_in_state_updates = false;
+		}
+		m_state_updates.clear();
+		m_alerts.post_alert_ptr(alert.release());
+	}
+
+	void session_impl::post_session_stats()
+	{
+		if (!m_alerts.should_post<session_stats_alert>()) return;
+
+		std::auto_ptr<session_stats_alert> alert(new (std::nothrow) session_stats_alert);
+		if (alert.get() == 0) return;
+
+		counters& c = m_stats_counters;
+		c.set_value(counters::num_torrents, m_torrents.size());
+		c.set_value(counters::num_ticking_torrents, m_ticking_torrents.size());
+		c.set_value(counters::num_peers_connected, m_connections.size());
+		c.set_value(counters::num_peers_half_open, m_half_open.size());
+		c.set_value(counters::num_peers_unchoked, m_num_unchoked);
+
+		cache_status cs = m_disk_thread.status();
+		c.set_value(counters::disk_queue_depth, m_disk_thread.queued_jobs());
+		c.set_value(counters::disk_queued_bytes, m_disk_thread.queue_buffer_size());
+		c.set_value(counters::disk_buffers_in_use, cs.total_used_buffers);
+		c.set_value(counters::disk_cache_size, cs.cache_size);
+		c.set_value(counters::disk_blocks_read, cs.blocks_read);
+		c.set_value(counters::disk_blocks_read_hit, cs.blocks_read_hit);
+		c.set_value(counters::disk_blocks_written, cs.blocks_written);
+		c.set_value(counters::disk_writes, cs.writes);
+
+		c.set_value(counters::up_bandwidth_queue, m_upload_rate.queue_size());
+		c.set_value(counters::down_bandwidth_queue, m_download_rate.queue_size());
+		c.set_value(counters::up_bandwidth_bytes_queue, m_upload_rate.queued_bytes());
+		c.set_value(counters::down_bandwidth_bytes_queue, m_download_rate.queued_bytes());
+
+		alert->values.resize(counters::num_counters);
+		for (int i = 0; i < counters::num_counters; ++i)
+			alert->values[i] = c[i];
+		m_alerts.post_alert_ptr(alert.release());
 	}
 	
+	void session_impl::get_latency_stats(latency_stats& s) const
+	{
+		s = m_latency;
+		m_disk_thread.get_latency_stats(s);
+		m_half_open.get_wait_time(s.connect_queue_time);
+#ifndef TORRENT_DISABLE_DHT
+		if (m_dht) m_dht->round_trip_times(s.dht_round_trip);
+#endif
+	}
+
 	alert const* session_impl::wait_for_alert(time_duration max_wait)
 	{
 		return m_alerts.wait_for_alert(max_wait);
@@ -2837,6 +3837,15 @@ namespace aux {
 		m_external_address = ip;
 		if (m_alerts.should_post<external_ip_alert>())
 			m_alerts.post_alert(external_ip_alert(ip));
+
+#ifndef TORRENT_DISABLE_GEO_IP
+		int as = as_for_ip(ip);
+		if (as != m_own_as)
+		{
+			m_own_as = as;
+			if (m_settings.prefer_own_as) update_cheap_as();
+		}
+#endif
 	}
 
 	void session_impl::free_disk_buffer(char* buf)
@@ -2844,6 +3853,26 @@ namespace aux {
 		m_disk_thread.free_buffer(buf);
 	}
 
+	void session_impl::reclaim_disk_buffer(char* buf)
+	{
+		m_disk_thread.reclaim_buffer(buf);
+	}
+
+	void session_impl::free_send_buffer(char* buf, void* userdata, int size)
+	{
+		static_cast<session_impl*>(userdata)->free_buffer(buf, size);
+	}
+
+	void session_impl::free_disk_send_buffer(char* buf, void* userdata, int)
+	{
+		static_cast<session_impl*>(userdata)->free_disk_buffer(buf);
+	}
+
+	void session_impl::reclaim_disk_send_buffer(char* buf, void* userdata, int)
+	{
+		static_cast<session_impl*>(userdata)->reclaim_disk_buffer(buf);
+	}
+
 	char* session_impl::allocate_disk_buffer(char const* category)
 	{
 		return m_disk_thread.allocate_buffer(category);
@@ -2855,20 +3884,35 @@ namespace aux {
 		int num_buffers = (size + send_buffer_size - 1) / send_buffer_size;
 		TORRENT_ASSERT(num_buffers > 0);
 
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		int c = 0;
+		while (c < num_send_buffer_classes && (1 << c) < num_buffers) ++c;
+		if (c < num_send_buffer_classes) num_buffers = 1 << c;
+#endif
+		int num_bytes = num_buffers * send_buffer_size;
+
 		boost::mutex::scoped_lock l(m_send_buffer_mutex);
+		m_send_buffer_bytes += num_bytes;
 #ifdef TORRENT_STATS
 		TORRENT_ASSERT(m_buffer_allocations >= 0);
 		m_buffer_allocations += num_buffers;
 		m_buffer_usage_logger << log_time() << " protocol_buffer: "
 			<< (m_buffer_allocations * send_buffer_size) << std::endl;
 #endif
-#ifdef TORRENT_DISABLE_POOL_ALLOCATOR
-		int num_bytes = num_buffers * send_buffer_size;
-		return std::make_pair((char*)malloc(num_bytes), num_bytes);
-#else
-		return std::make_pair((char*)m_send_buffers.ordered_malloc(num_buffers)
-			, num_buffers * send_buffer_size);
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		if (c < num_send_buffer_classes)
+		{
+			std::vector<char*>& free_list = m_free_send_buffers[c];
+			if (!free_list.empty())
+			{
+				char* ret = free_list.back();
+				free_list.pop_back();
+				return std::make_pair(ret, num_bytes);
+			}
+		}
 #endif
+		l.unlock();
+		return std::make_pair((char*)std::malloc(num_bytes), num_bytes);
 	}
 
 #ifdef TORRENT_STATS
@@ -2898,28 +3942,195 @@ namespace aux {
 		TORRENT_ASSERT(num_buffers > 0);
 
 		boost::mutex::scoped_lock l(m_send_buffer_mutex);
+		m_send_buffer_bytes -= size;
+		TORRENT_ASSERT(m_send_buffer_bytes >= 0);
 #ifdef TORRENT_STATS
 		m_buffer_allocations -= num_buffers;
 		TORRENT_ASSERT(m_buffer_allocations >= 0);
 		m_buffer_usage_logger << log_time() << " protocol_buffer: "
 			<< (m_buffer_allocations * send_buffer_size) << std::endl;
 #endif
-#ifdef TORRENT_DISABLE_POOL_ALLOCATOR
-		free(buf);
-#else
-		m_send_buffers.ordered_free(buf, num_buffers);
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		// allocate_buffer() only hands out buffers of exactly a
+		// class size, unless they are bigger than the biggest class
+		int c = 0;
+		while (c < num_send_buffer_classes && (1 << c) < num_buffers) ++c;
+		if (c < num_send_buffer_classes)
+		{
+			TORRENT_ASSERT((1 << c) == num_buffers);
+			std::vector<char*>& free_list = m_free_send_buffers[c];
+			if (int(free_list.size()) < max_free_send_buffers)
+			{
+				free_list.push_back(buf);
+				return;
+			}
+		}
 #endif
+		l.unlock();
+		std::free(buf);
 	}	
 
+	void session_impl::update_memory_pressure()
+	{
+		if (m_settings.memory_budget <= 0)
+		{
+			m_memory_pressure = no_memory_pressure;
+			return;
+		}
+
+		size_type used = size_type(m_disk_thread.in_use())
+			* m_disk_thread.block_size();
+		{
+			boost::mutex::scoped_lock l(m_send_buffer_mutex);
+			used += m_send_buffer_bytes;
+		}
+		for (connection_map::const_iterator i = m_connections.begin()
+			, end(m_connections.end()); i != end; ++i)
+			used += (*i)->receive_buffer_capacity();
+		for (torrent_map::const_iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			used += size_type(i->second->get_policy().num_peers())
+				* (sizeof(policy::ipv4_peer) + sizeof(policy::peer*));
+		}
+
+		// each level kicks in at a higher fraction of the budget,
+		// so the cheapest things to give up go first
+		size_type budget = size_type(m_settings.memory_budget) * 1024;
+		if (used >= budget) m_memory_pressure = pipeline_pressure;
+		else if (used >= budget * 9 / 10) m_memory_pressure = peer_list_pressure;
+		else if (used >= budget * 8 / 10) m_memory_pressure = read_cache_pressure;
+		else m_memory_pressure = no_memory_pressure;
+
+		if (m_memory_pressure == no_memory_pressure) return;
+
+		bool clear_cache = m_disk_thread.status().read_cache_size > 0;
+		for (torrent_map::iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			torrent& t = *i->second;
+			if (clear_cache) t.clear_read_cache();
+			// the policy honors the lower limit when adding peers,
+			// this weeds out the ones that are already there
+			if (m_memory_pressure >= peer_list_pressure)
+				t.get_policy().erase_peers();
+		}
+	}
+
+	void session_impl::update_write_throttling()
+	{
+		size_type limit = size_type(m_settings.cache_size)
+			* m_disk_thread.block_size() / 100 * m_settings.device_write_cache_share;
+		if (limit <= 0)
+		{
+			if (!m_write_throttling) return;
+			m_write_throttling = false;
+			for (torrent_map::iterator i = m_torrents.begin()
+				, end(m_torrents.end()); i != end; ++i)
+				i->second->set_write_throttled(false);
+			return;
+		}
+		m_write_throttling = true;
+
+		disk_io_thread::dirty_bytes_t dirty;
+		m_disk_thread.dirty_bytes(dirty);
+
+		// the torrents saved on the same device share its limit
+		std::map<size_type, size_type> device_dirty;
+		for (torrent_map::iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			torrent& t = *i->second;
+			if (!t.has_storage()) continue;
+			disk_io_thread::dirty_bytes_t::iterator d = dirty.find(&t.filesystem());
+			if (d == dirty.end()) continue;
+			device_dirty[t.device_id()] += d->second;
+		}
+
+		for (torrent_map::iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			torrent& t = *i->second;
+			std::map<size_type, size_type>::iterator d
+				= device_dirty.find(t.device_id());
+			t.set_write_throttled(t.has_storage()
+				&& d != device_dirty.end() && d->second > limit);
+		}
+	}
+
+	void session_impl::grow_recv_buffer(buffer& b, int size)
+	{
+		TORRENT_ASSERT(size >= int(b.size()));
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		if (int(b.capacity()) < size)
+		{
+			int c = 0;
+			while (c < num_recv_buffer_classes && (min_recv_buffer << c) < size) ++c;
+			if (c < num_recv_buffer_classes)
+			{
+				buffer nb;
+				{
+					boost::mutex::scoped_lock l(m_send_buffer_mutex);
+					std::vector<buffer>& free_list = m_free_recv_buffers[c];
+					if (!free_list.empty())
+					{
+						nb.swap(free_list.back());
+						free_list.pop_back();
+					}
+				}
+				if (nb.capacity() == 0) nb.reserve(min_recv_buffer << c);
+				TORRENT_ASSERT(int(nb.capacity()) == (min_recv_buffer << c));
+				nb.resize(size);
+				if (!b.empty()) std::memcpy(nb.begin(), b.begin(), b.size());
+				b.swap(nb);
+				release_recv_buffer(nb);
+				return;
+			}
+		}
+#endif
+		b.resize(size);
+	}
+
+	void session_impl::release_recv_buffer(buffer& b)
+	{
+#ifndef TORRENT_DISABLE_POOL_ALLOCATOR
+		int c = 0;
+		while (c < num_recv_buffer_classes && (min_recv_buffer << c) < int(b.capacity())) ++c;
+		if (c < num_recv_buffer_classes && (min_recv_buffer << c) == int(b.capacity()))
+		{
+			boost::mutex::scoped_lock l(m_send_buffer_mutex);
+			std::vector<buffer>& free_list = m_free_recv_buffers[c];
+			if (int(free_list.size()) < max_free_recv_buffers)
+			{
+				b.clear();
+				// the free lists have room reserved, pushing
+				// doesn't copy the buffers already in there
+				free_list.push_back(buffer());
+				free_list.back().swap(b);
+				return;
+			}
+		}
+#endif
+		buffer().swap(b);
+	}
+
 #ifdef TORRENT_DEBUG
 	void session_impl::check_invariant() const
 	{
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		TORRENT_ASSERT(m_obfuscated_torrents.size() == m_torrents.size());
+#endif
+
 		int num_checking =  std::count_if(m_queued_for_checking.begin()
 			, m_queued_for_checking.end(), boost::bind(&torrent::state, _1)
 			== torrent_status::checking_files);
 
-		// the queue is either empty, or it has exactly one checking torrent in it
-		TORRENT_ASSERT(m_queued_for_checking.empty() || num_checking == 1);
+		// the queue is either empty, or it has a checking torrent in it.
+		// Only one, unless torrents on different devices may check
+		// at the same time (or did, before it was disabled)
+		TORRENT_ASSERT(m_queued_for_checking.empty() || num_checking >= 1);
+		TORRENT_ASSERT(num_checking <= 1 || m_settings.checking_torrents_per_device > 0
+			|| !m_checking_devices.empty());
 
 		std::set<int> unique;
 		int total_downloaders = 0;
@@ -2937,6 +4148,15 @@ namespace aux {
 		}
 		TORRENT_ASSERT(int(unique.size()) == total_downloaders);
 
+		for (int i = 0; i < int(m_ticking_torrents.size()); ++i)
+			TORRENT_ASSERT(m_ticking_torrents[i]->m_tick_index == i);
+		for (torrent_map::const_iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			// a torrent that wants to be ticked is always in the list
+			TORRENT_ASSERT(!i->second->wants_tick() || i->second->m_tick_index >= 0);
+		}
+
 		std::set<peer_connection*> unique_peers;
 		TORRENT_ASSERT(m_max_connections > 0);
 		TORRENT_ASSERT(m_max_uploads > 0);
@@ -0,0 +1,156 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/session_stats.hpp"
+
+namespace libtorrent
+{
+	namespace
+	{
+		struct stats_metric_impl
+		{
+			char const* name;
+			int value_index;
+		};
+
+#define METRIC(name) { #name, counters:: name },
+
+		stats_metric_impl const metrics[] =
+		{
+			METRIC(on_read_counter)
+			METRIC(on_write_counter)
+			METRIC(on_tick_counter)
+			METRIC(piece_picks)
+			METRIC(piece_picker_time_us)
+			METRIC(num_incoming_choke)
+			METRIC(num_incoming_unchoke)
+			METRIC(num_incoming_interested)
+			METRIC(num_incoming_not_interested)
+			METRIC(num_incoming_have)
+			METRIC(num_incoming_bitfield)
+			METRIC(num_incoming_request)
+			METRIC(num_incoming_piece)
+			METRIC(num_incoming_cancel)
+			METRIC(num_incoming_dht_port)
+			METRIC(num_incoming_suggest)
+			METRIC(num_incoming_have_all)
+			METRIC(num_incoming_have_none)
+			METRIC(num_incoming_reject)
+			METRIC(num_incoming_allowed_fast)
+			METRIC(num_incoming_extended)
+			METRIC(num_send_buffer_drained)
+			METRIC(num_disk_write_limit_hits)
+			METRIC(disk_blocks_read)
+			METRIC(disk_blocks_read_hit)
+			METRIC(disk_blocks_written)
+			METRIC(disk_writes)
+
+			// gauges
+			METRIC(num_torrents)
+			METRIC(num_ticking_torrents)
+			METRIC(num_peers_connected)
+			METRIC(num_peers_half_open)
+			METRIC(num_peers_unchoked)
+			METRIC(disk_queue_depth)
+			METRIC(disk_queued_bytes)
+			METRIC(disk_buffers_in_use)
+			METRIC(disk_cache_size)
+			METRIC(up_bandwidth_queue)
+			METRIC(down_bandwidth_queue)
+			METRIC(up_bandwidth_bytes_queue)
+			METRIC(down_bandwidth_bytes_queue)
+		};
+
+#undef METRIC
+	}
+
+	std::vector<stats_metric> session_stats_metrics()
+	{
+		int const num_metrics = sizeof(metrics) / sizeof(metrics[0]);
+		TORRENT_ASSERT(num_metrics == counters::num_counters);
+		std::vector<stats_metric> ret(num_metrics);
+		for (int i = 0; i < num_metrics; ++i)
+		{
+			ret[i].name = metrics[i].name;
+			ret[i].value_index = metrics[i].value_index;
+			ret[i].type = metrics[i].value_index >= counters::num_stats_counters
+				? stats_metric::type_gauge : stats_metric::type_counter;
+		}
+		return ret;
+	}
+
+	void latency_histogram::clear()
+	{
+		for (int i = 0; i < num_buckets; ++i) buckets[i] = 0;
+		samples = 0;
+		total = 0;
+		max_value = 0;
+	}
+
+	void latency_histogram::merge(latency_histogram const& h)
+	{
+		for (int i = 0; i < num_buckets; ++i) buckets[i] += h.buckets[i];
+		samples += h.samples;
+		total += h.total;
+		if (h.max_value > max_value) max_value = h.max_value;
+	}
+
+	boost::int64_t latency_histogram::bucket_start(int i)
+	{
+		TORRENT_ASSERT(i >= 0 && i < num_buckets);
+		if (i < sub_buckets) return i;
+		int shift = i / sub_buckets - 1;
+		return boost::int64_t(sub_buckets + i % sub_buckets) << shift;
+	}
+
+	boost::int64_t latency_histogram::percentile(double p) const
+	{
+		if (samples == 0) return 0;
+		boost::int64_t limit = boost::int64_t(p * samples);
+		if (limit >= samples) limit = samples - 1;
+		boost::int64_t seen = 0;
+		for (int i = 0; i < num_buckets; ++i)
+		{
+			seen += buckets[i];
+			if (seen <= limit) continue;
+			if (i == num_buckets - 1) return max_value;
+			// the upper bound of the bucket, but never more than
+			// the largest sample we've seen
+			boost::int64_t ret = bucket_start(i + 1) - 1;
+			return ret < max_value ? ret : max_value;
+		}
+		return max_value;
+	}
+}
+
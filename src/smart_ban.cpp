@@ -38,13 +38,14 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/cstdint.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
 
 #include <vector>
-#include <map>
+#include <algorithm>
 #include <utility>
 #include <numeric>
 #include <cstdio>
@@ -58,6 +59,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/extensions/smart_ban.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/disk_io_thread.hpp"
+#include "libtorrent/disk_buffer_holder.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 
 namespace libtorrent { namespace
@@ -67,56 +69,51 @@ namespace libtorrent { namespace
 	{
 		smart_ban_plugin(torrent& t)
 			: m_torrent(t)
+			, m_num_blocks(0)
+			, m_sequence(0)
 			, m_salt(rand())
 		{
 		}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << piece_pass_hook) | (1 << piece_failed_hook);
+		}
+
 		void on_piece_pass(int p)
 		{
 #ifdef TORRENT_LOGGING
 			(*m_torrent.session().m_logger) << time_now_string() << " PIECE PASS [ p: " << p
-				<< " | block_crc_size: " << m_block_crc.size() << " ]\n";
+				<< " | failed_pieces: " << m_failed.size() << " ]\n";
 #endif
 			// has this piece failed earlier? If it has, go through the
 			// CRCs from the time it failed and ban the peers that
 			// sent bad blocks
-			std::map<piece_block, block_entry>::iterator i = m_block_crc.lower_bound(piece_block(p, 0));
-			if (i == m_block_crc.end() || i->first.piece_index != p) return;
+			std::vector<failed_piece>::iterator i = find_piece(p);
+			if (i == m_failed.end() || i->piece != p) return;
 
 			int size = m_torrent.torrent_file().piece_size(p);
 			peer_request r = {p, 0, (std::min)(16*1024, size)};
-			piece_block pb(p, 0);
-			while (size > 0)
+			for (int k = 0; k < int(i->blocks.size()); ++k)
 			{
-				if (i->first.block_index == pb.block_index)
+				if (i->blocks[k].peer != 0)
 				{
 					m_torrent.filesystem().async_read(r, bind(&smart_ban_plugin::on_read_ok_block
-						, shared_from_this(), *i, _1, _2));
-					m_block_crc.erase(i++);
+						, shared_from_this(), piece_block(p, k), i->blocks[k], _1, _2));
 				}
-				else
-				{
-					TORRENT_ASSERT(i->first.block_index > pb.block_index);
-				}
-
-				if (i == m_block_crc.end() || i->first.piece_index != p)
-					break;
 
 				r.start += 16*1024;
 				size -= 16*1024;
 				r.length = (std::min)(16*1024, size);
-				++pb.block_index;
 			}
 
-#ifndef NDEBUG
-			// make sure we actually removed all the entries for piece 'p'
-			i = m_block_crc.lower_bound(piece_block(p, 0));
-			TORRENT_ASSERT(i == m_block_crc.end() || i->first.piece_index != p);
-#endif
+			m_num_blocks -= i->blocks.size();
+			m_failed.erase(i);
 
 			if (m_torrent.is_seed())
 			{
-				std::map<piece_block, block_entry>().swap(m_block_crc);
+				std::vector<failed_piece>().swap(m_failed);
+				m_num_blocks = 0;
 				return;
 			}
 		}
@@ -156,15 +153,74 @@ namespace libtorrent { namespace
 	private:
 
 		// this entry ties a specific block CRC to
-		// a peer.
+		// a peer. A peer of 0 means we don't have a
+		// CRC for the block
 		struct block_entry
 		{
 			policy::peer* peer;
-			unsigned long crc;
+			boost::uint32_t crc;
 		};
 
+		// the block CRCs recorded for one piece that
+		// failed the hash check, indexed by block
+		struct failed_piece
+		{
+			int piece;
+			// the order in which pieces were first recorded.
+			// Used to evict the oldest piece when we hit the cap
+			int sequence;
+			std::vector<block_entry> blocks;
+		};
+
+		// the cap on the number of block entries kept for
+		// this torrent. When a new piece would exceed it, the
+		// pieces that failed longest ago are forgotten
+		enum { max_block_entries = 32 * 1024 };
+
+		struct piece_less
+		{
+			bool operator()(failed_piece const& lhs, int rhs) const
+			{ return lhs.piece < rhs; }
+		};
+
+		std::vector<failed_piece>::iterator find_piece(int p)
+		{
+			return std::lower_bound(m_failed.begin(), m_failed.end(), p, piece_less());
+		}
+
+		// returns the record for piece p, creating it if
+		// there isn't one already
+		failed_piece& record_piece(int p)
+		{
+			std::vector<failed_piece>::iterator i = find_piece(p);
+			if (i != m_failed.end() && i->piece == p) return *i;
+
+			int num_blocks = (m_torrent.torrent_file().piece_size(p) + 16*1024 - 1) / (16*1024);
+			while (!m_failed.empty() && m_num_blocks + num_blocks > max_block_entries)
+			{
+				std::vector<failed_piece>::iterator oldest = m_failed.begin();
+				for (std::vector<failed_piece>::iterator k = m_failed.begin()
+					, end(m_failed.end()); k != end; ++k)
+				{
+					if (k->sequence < oldest->sequence) oldest = k;
+				}
+				m_num_blocks -= oldest->blocks.size();
+				m_failed.erase(oldest);
+			}
+
+			failed_piece fp;
+			fp.piece = p;
+			fp.sequence = m_sequence++;
+			block_entry e = {0, 0};
+			fp.blocks.resize(num_blocks, e);
+			m_num_blocks += num_blocks;
+			return *m_failed.insert(find_piece(p), fp);
+		}
+
 		void on_read_failed_block(piece_block b, address a, int ret, disk_io_job const& j)
 		{
+			disk_buffer_holder buffer(m_torrent.session(), j);
+
 			// ignore read errors
 			if (ret != j.buffer_size) return;
 
@@ -183,14 +239,16 @@ namespace libtorrent { namespace
 			if (range.first == range.second) return;
 
 			policy::peer* p = (*range.first);
-			block_entry e = {p, crc.final()};
+			block_entry e = {p, boost::uint32_t(crc.final())};
 
-			std::map<piece_block, block_entry>::iterator i = m_block_crc.lower_bound(b);
+			failed_piece& fp = record_piece(b.piece_index);
+			TORRENT_ASSERT(b.block_index < int(fp.blocks.size()));
+			block_entry& i = fp.blocks[b.block_index];
 
-			if (i != m_block_crc.end() && i->first == b && i->second.peer == p)
+			if (i.peer == p)
 			{
 				// this peer has sent us this block before
-				if (i->second.crc != e.crc)
+				if (i.crc != e.crc)
 				{
 					// this time the crc of the block is different
 					// from the first time it sent it
@@ -209,19 +267,22 @@ namespace libtorrent { namespace
 					(*m_torrent.session().m_logger) << time_now_string() << " BANNING PEER [ p: " << b.piece_index
 						<< " | b: " << b.block_index
 						<< " | c: " << client
-						<< " | crc1: " << i->second.crc
+						<< " | crc1: " << i.crc
 						<< " | crc2: " << e.crc
 						<< " | ip: " << p->ip() << " ]\n";
 #endif
 					p->banned = true;
 					if (p->connection) p->connection->disconnect("banning peer for sending bad data");
 				}
-				// we already have this exact entry in the map
-				// we don't have to insert it
+				// we already have this exact entry
+				// we don't have to store it
 				return;
 			}
-			
-			m_block_crc.insert(i, std::make_pair(b, e));
+
+			// the first peer that sent us this block is the one
+			// we hold accountable for it
+			if (i.peer != 0) return;
+			i = e;
 
 #ifdef TORRENT_LOGGING
 			char const* client = "-";
@@ -239,11 +300,12 @@ namespace libtorrent { namespace
 #endif
 		}
 		
-		void on_read_ok_block(std::pair<piece_block, block_entry> b, int ret, disk_io_job const& j)
+		void on_read_ok_block(piece_block b, block_entry e, int ret, disk_io_job const& j)
 		{
 			// since this callback is called directory from the disk io
 			// thread, the session mutex is not locked when we get here
 			aux::session_impl::mutex_t::scoped_lock l(m_torrent.session().m_mutex);
+			disk_buffer_holder buffer(m_torrent.session(), j);
 
 			// ignore read errors
 			if (ret != j.buffer_size) return;
@@ -251,11 +313,11 @@ namespace libtorrent { namespace
 			adler32_crc crc;
 			crc.update(j.buffer, j.buffer_size);
 			crc.update((char const*)&m_salt, sizeof(m_salt));
-			unsigned long ok_crc = crc.final();
+			boost::uint32_t ok_crc = crc.final();
 
-			if (b.second.crc == ok_crc) return;
+			if (e.crc == ok_crc) return;
 
-			policy::peer* p = b.second.peer;
+			policy::peer* p = e.peer;
 
 			if (p == 0) return;
 			if (!m_torrent.get_policy().has_peer(p)) return;
@@ -268,11 +330,11 @@ namespace libtorrent { namespace
 				p->connection->get_peer_info(info);
 				client = info.client.c_str();
 			}
-			(*m_torrent.session().m_logger) << time_now_string() << " BANNING PEER [ p: " << b.first.piece_index
-				<< " | b: " << b.first.block_index
+			(*m_torrent.session().m_logger) << time_now_string() << " BANNING PEER [ p: " << b.piece_index
+				<< " | b: " << b.block_index
 				<< " | c: " << client
 				<< " | ok_crc: " << ok_crc
-				<< " | bad_crc: " << b.second.crc
+				<< " | bad_crc: " << e.crc
 				<< " | ip: " << p->ip() << " ]\n";
 #endif
 			p->banned = true;
@@ -281,10 +343,17 @@ namespace libtorrent { namespace
 		
 		torrent& m_torrent;
 
-		// This table maps a piece_block (piece and block index
-		// pair) to a peer and the block CRC. The CRC is calculated
-		// from the data in the block + the salt
-		std::map<piece_block, block_entry> m_block_crc;
+		// the pieces that have failed the hash check, sorted by
+		// piece index. Each one holds the peer and the block CRC
+		// of every block. The CRC is calculated from the data in
+		// the block + the salt
+		std::vector<failed_piece> m_failed;
+
+		// the total number of block entries in m_failed
+		int m_num_blocks;
+
+		// the sequence number given to the next failed piece
+		int m_sequence;
 
 		// This salt is a random value used to calculate the block CRCs
 		// Since the CRC function that is used is not a one way function
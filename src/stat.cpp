@@ -54,13 +54,14 @@ void stat_channel::second_tick(float tick_interval)
 {
 	INVARIANT_CHECK;
 
-	m_rate_sum -= m_rate_history[history-1];
-
-	for (int i = history - 2; i >= 0; --i)
-		m_rate_history[i + 1] = m_rate_history[i];
-
-	m_rate_history[0] = m_counter / tick_interval;
-	m_rate_sum += m_rate_history[0];
+	// most channels of most peers don't transfer anything. When
+	// the whole history is 0, where the ring starts doesn't matter
+	if (m_counter == 0 && m_rate_sum == 0) return;
+
+	m_rate_sum -= m_rate_history[m_oldest];
+	m_rate_history[m_oldest] = m_counter / tick_interval;
+	m_rate_sum += m_rate_history[m_oldest];
+	if (++m_oldest == history) m_oldest = 0;
 	m_counter = 0;
 }
 
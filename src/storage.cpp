@@ -33,6 +33,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/pch.hpp"
 
 #include <ctime>
+#include <cctype>
 #include <iterator>
 #include <algorithm>
 #include <set>
@@ -69,6 +70,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/aux_/session_impl.hpp"
 #include "libtorrent/disk_buffer_holder.hpp"
 #include "libtorrent/alloca.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/block_math.hpp"
 
 #include <cstdio>
 
@@ -94,6 +97,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sys/statfs.h>
 #endif
 
+#ifndef TORRENT_WINDOWS
+// for stat()
+#include <sys/stat.h>
+#endif
+
 #if defined(__FreeBSD__)
 // for statfs()
 #include <sys/param.h>
@@ -186,6 +194,72 @@ namespace libtorrent
 		} catch (std::exception& e) {}
 #endif
 	}
+
+	namespace
+	{
+		// in the packed resume data format (see
+		// session_settings::packed_resume_data) the slot map is a
+		// string of 32 bit big-endian integers rather than a list
+		lazy_entry const* find_slots(lazy_entry const& rd)
+		{
+			lazy_entry const* e = rd.dict_find("slots");
+			if (e == 0) return 0;
+			if (e->type() == lazy_entry::list_t) return e;
+			if (e->type() == lazy_entry::string_t
+				&& (e->string_length() % 4) == 0) return e;
+			return 0;
+		}
+
+		int num_slots(lazy_entry const* slots)
+		{
+			if (slots->type() == lazy_entry::string_t)
+				return slots->string_length() / 4;
+			return slots->list_size();
+		}
+
+		// returns false if the slot entry is not an integer
+		bool slot_at(lazy_entry const* slots, int i, int& index)
+		{
+			if (slots->type() == lazy_entry::string_t)
+			{
+				char const* p = slots->string_ptr() + i * 4;
+				index = detail::read_int32(p);
+				return true;
+			}
+			lazy_entry const* e = slots->list_at(i);
+			if (e->type() != lazy_entry::int_t) return false;
+			index = int(e->int_value());
+			return true;
+		}
+
+		// returns true if p1 and p2, or the closest of their parents
+		// that exist, are on the same device, which means files can be
+		// renamed from one to the other
+		bool same_device(fs::path const& p1, fs::path const& p2)
+		{
+			return device_id(p1) == device_id(p2);
+		}
+	}
+
+	size_type device_id(fs::path p)
+	{
+#ifdef TORRENT_WINDOWS
+		// the drive letter, or the server of UNC paths
+		size_type ret = 0;
+		std::string root = complete(p).root_name();
+		for (std::string::iterator i = root.begin(), end(root.end()); i != end; ++i)
+			ret = ret * 31 + std::toupper(*i);
+		return ret;
+#else
+		struct ::stat st;
+		while (::stat(p.string().c_str(), &st) != 0)
+		{
+			if (!p.has_branch_path()) return 0;
+			p = p.branch_path();
+		}
+		return size_type(st.st_dev) + 1;
+#endif
+	}
 	std::vector<std::pair<size_type, std::time_t> > get_filesizes(
 		file_storage const& s, fs::path p)
 	{
@@ -236,7 +310,8 @@ namespace libtorrent
 		, fs::path p
 		, std::vector<std::pair<size_type, std::time_t> > const& sizes
 		, bool compact_mode
-		, std::string* error)
+		, std::string* error
+		, std::vector<int>* touched_files)
 	{
 		if ((int)sizes.size() != fs.num_files())
 		{
@@ -289,6 +364,12 @@ namespace libtorrent
 			if ((compact_mode && (time > s->second + 1 || time < s->second - 1)) ||
 				(!compact_mode && (time > s->second + 5 * 60 || time < s->second - 1)))
 			{
+				// the caller will verify the contents of the file
+				if (touched_files)
+				{
+					touched_files->push_back(i - fs.begin());
+					continue;
+				}
 				if (error) *error = "timestamp mismatch for file '"
 					+ i->path.external_file_string()
 					+ "', modification date: " + boost::lexical_cast<std::string>(time)
@@ -403,6 +484,8 @@ namespace libtorrent
 			, m_pool(fp)
 			, m_page_size(4096)
 			, m_allocate_files(false)
+			, m_chunk_size(0)
+			, m_preallocate_unsupported(false)
 		{
 			TORRENT_ASSERT(m_files.begin() != m_files.end());
 			m_save_path = fs::complete(path);
@@ -420,11 +503,17 @@ namespace libtorrent
 		bool rename_file(int index, std::string const& new_filename);
 		bool release_files();
 		bool delete_files();
+		int delete_files_chunk(int& progress);
 		bool initialize(bool allocate_files);
 		bool move_storage(fs::path save_path);
+		int move_storage_chunk(fs::path save_path, int& progress);
 		int read(char* buf, int slot, int offset, int size);
 		int write(char const* buf, int slot, int offset, int size);
 		int sparse_end(int start) const;
+		boost::shared_ptr<file> file_for_range(int slot, int offset
+			, int size, size_type& file_offset);
+		void hint_read(int slot, int offset, int size);
+		void discard_slot(int slot);
 		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 		int writev(file::iovec_t const* buf, int slot, int offset, int num_bufs);
 		bool move_slot(int src_slot, int dst_slot);
@@ -448,6 +537,19 @@ namespace libtorrent
 		};
 
 		void delete_one_file(std::string const& p);
+		// opens the file at file_index in the old and the new save
+		// path of the move in progress. Returns false on errors
+		bool open_for_move(int file_index, error_code& ec);
+		// copies size bytes at offset from the current file of
+		// the move to its new location
+		bool copy_for_move(size_type offset, int size);
+		// records a write to a range of a file that the move has
+		// already copied, so it's copied again before switching over
+		void write_during_move(int file_index, size_type offset, int size);
+		// allocates the chunks of the file that the range falls in,
+		// if they haven't been already
+		void preallocate(int file_index, file& f, size_type file_offset
+			, int size);
 		int readwritev(file::iovec_t const* bufs, int slot, int offset
 			, int num_bufs, fileop const&);
 
@@ -473,6 +575,51 @@ namespace libtorrent
 
 		int m_page_size;
 		bool m_allocate_files;
+
+		// the chunks of each file that have been allocated by
+		// preallocate(), in units of preallocate_chunk_size
+		std::vector<std::vector<bool> > m_allocated_chunks;
+		int m_chunk_size;
+		// set if the file system can't allocate ranges of files
+		bool m_preallocate_unsupported;
+
+		// the state of a move_storage_chunk() in progress. The
+		// files are copied to the new save path one chunk at a time
+		// while reads and writes keep using the old one. Writes to
+		// ranges that have already been copied are recorded and copied
+		// again before the storage switches over to the new path
+		struct move_state
+		{
+			move_state(fs::path const& p)
+				: save_path(p), file_index(0), offset(0), file_size(0)
+				, moved(0), total(0), open_index(-1) {}
+
+			struct range
+			{
+				int file_index;
+				size_type offset;
+				size_type size;
+			};
+
+			fs::path save_path;
+			// the file being copied and how much of it has been
+			// copied so far
+			int file_index;
+			size_type offset;
+			size_type file_size;
+			// the number of bytes copied and the number of bytes
+			// to copy, for the progress
+			size_type moved;
+			size_type total;
+			// ranges of files written to after they were copied
+			std::deque<range> dirty;
+			// the file index src and dst are open for, or -1
+			int open_index;
+			file src;
+			file dst;
+			std::vector<char> buffer;
+		};
+		boost::scoped_ptr<move_state> m_move;
 	};
 
 	int piece_manager::hash_for_slot(int slot, partial_hash& ph, int piece_size
@@ -503,6 +650,7 @@ namespace libtorrent
 					size -= bufs[i].iov_len;
 				}
 				num_read = m_storage->readv(bufs, slot, ph.offset, num_blocks);
+				if (num_read > 0) count_read(slot, ph.offset, num_read);
 
 				for (int i = 0; i < num_blocks; ++i)
 				{
@@ -532,7 +680,11 @@ namespace libtorrent
 				{
 					buf.iov_len = (std::min)(block_size, size);
 					int ret = m_storage->readv(&buf, slot, ph.offset, 1);
-					if (ret > 0) num_read += ret;
+					if (ret > 0)
+					{
+						count_read(slot, ph.offset, ret);
+						num_read += ret;
+					}
 
 					if (small_hash && small_piece_size < block_size)
 					{
@@ -620,7 +772,7 @@ namespace libtorrent
 					mode |= file::no_buffer;
 				if (!m_allocate_files) mode |= file::sparse;
 				boost::shared_ptr<file> f = m_pool.open_file(this
-					, m_save_path / file_iter->path, mode, ec);
+					, m_save_path / file_iter->path, file_iter - files().begin(), mode, ec);
 				if (ec) set_error(m_save_path / file_iter->path, ec);
 				else if (f)
 				{
@@ -701,7 +853,9 @@ namespace libtorrent
 	{
 		if (index < 0 || index >= m_files.num_files()) return true;
 		fs::path old_name = m_save_path / files().at(index).path;
-		m_pool.release(old_name);
+		m_pool.release(this, index);
+		// a move in progress has to start over with the new name
+		m_move.reset();
 
 #if TORRENT_USE_WPATH
 		fs::wpath old_path = convert_to_wstring(old_name.string());
@@ -796,16 +950,36 @@ namespace libtorrent
 
 	bool storage::delete_files()
 	{
-		// make sure we don't have the files open
-		m_pool.release(this);
+		int progress = 0;
+		int ret;
+		while ((ret = delete_files_chunk(progress)) > 0);
+		return ret != 0;
+	}
+
+	int storage::delete_files_chunk(int& progress)
+	{
+		if (progress == 0)
+		{
+			// make sure we don't have the files open
+			m_pool.release(this);
+			m_allocated_chunks.clear();
+			m_move.reset();
+		}
+
+		// deleting a large file may take a while on some
+		// filesystems, so only a few are deleted per call
+		const int files_per_chunk = 8;
+		int end = (std::min)(progress + files_per_chunk, files().num_files());
+		for (; progress < end; ++progress)
+			delete_one_file((m_save_path / files().at(progress).path).string());
+		if (progress < files().num_files()) return 1;
 
-		// delete the files from disk
+		// delete the directories once all files are gone
 		std::set<std::string> directories;
 		typedef std::set<std::string>::iterator iter_t;
 		for (file_storage::iterator i = files().begin()
 			, end(files().end()); i != end; ++i)
 		{
-			std::string p = (m_save_path / i->path).string();
 			fs::path bp = i->path.branch_path();
 			std::pair<iter_t, bool> ret;
 			ret.second = true;
@@ -814,7 +988,6 @@ namespace libtorrent
 				std::pair<iter_t, bool> ret = directories.insert((m_save_path / bp).string());
 				bp = bp.branch_path();
 			}
-			delete_one_file(p);
 		}
 
 		// remove the directories. Reverse order to delete
@@ -826,8 +999,8 @@ namespace libtorrent
 			delete_one_file(*i);
 		}
 
-		if (error()) return true;
-		return false;
+		if (error()) return -1;
+		return 0;
 	}
 
 	bool storage::write_resume_data(entry& rd) const
@@ -837,6 +1010,22 @@ namespace libtorrent
 		std::vector<std::pair<size_type, std::time_t> > file_sizes
 			= get_filesizes(files(), m_save_path);
 
+		if (m_settings && settings().packed_resume_data)
+		{
+			// 64 bit size followed by 64 bit modification time
+			// for each file
+			std::string& fl = rd["file sizes"].string();
+			fl.resize(file_sizes.size() * 16);
+			char* ptr = fl.empty() ? 0 : &fl[0];
+			for (std::vector<std::pair<size_type, std::time_t> >::iterator i
+				= file_sizes.begin(), end(file_sizes.end()); i != end; ++i)
+			{
+				detail::write_int64(i->first, ptr);
+				detail::write_int64(i->second, ptr);
+			}
+			return false;
+		}
+
 		entry::list_type& fl = rd["file sizes"].list();
 		for (std::vector<std::pair<size_type, std::time_t> >::iterator i
 			= file_sizes.begin(), end(file_sizes.end()); i != end; ++i)
@@ -855,36 +1044,174 @@ namespace libtorrent
 		TORRENT_ASSERT(slot >= 0);
 		TORRENT_ASSERT(slot < m_files.num_pieces());
 
-		size_type file_offset = (size_type)slot * m_files.piece_length();
+		size_type start = (size_type)slot * m_files.piece_length();
 		std::vector<file_entry>::const_iterator file_iter;
 
-		for (file_iter = files().begin();;)
+		for (file_iter = files().begin(); file_iter != files().end()
+			&& file_iter->offset + file_iter->size <= start; ++file_iter);
+
+		// walk the files for as long as everything from start on is a
+		// hole. A hole may span several files, pad files are all holes
+		for (; file_iter != files().end(); ++file_iter)
 		{
-			if (file_offset < file_iter->size)
-				break;
+			if (file_iter->size == 0 || file_iter->pad_file) continue;
 
-			file_offset -= file_iter->size;
-			++file_iter;
-			TORRENT_ASSERT(file_iter != files().end());
+			size_type file_offset = (std::max)(start - file_iter->offset, size_type(0));
+			fs::path path = m_save_path / file_iter->path;
+			error_code ec;
+			int mode = file::read_only;
+
+			boost::shared_ptr<file> file_handle;
+			int cache_setting = m_settings ? settings().disk_io_write_mode : 0;
+			if (cache_setting == session_settings::disable_os_cache
+				|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
+				&& ((file_iter->offset + file_iter->file_base) & (m_page_size-1)) == 0))
+				mode |= file::no_buffer;
+			if (!m_allocate_files) mode |= file::sparse;
+
+			file_handle = m_pool.open_file(const_cast<storage*>(this), path
+				, file_iter - files().begin(), mode, ec);
+			// missing files are skipped by the check when the read fails
+			if (!file_handle || ec) return (file_iter->offset + file_offset)
+				/ m_files.piece_length();
+
+			size_type data_start = file_handle->sparse_end(file_offset);
+			if (data_start < file_iter->size)
+			{
+				// the slot this data is in is the first one that
+				// isn't entirely in a hole
+				return (file_iter->offset + data_start) / m_files.piece_length();
+			}
 		}
-	
-		fs::path path = m_save_path / file_iter->path;
-		error_code ec;
-		int mode = file::read_only;
+		// there is no data from start to the end of the torrent
+		return m_files.num_pieces();
+	}
 
-		boost::shared_ptr<file> file_handle;
-		int cache_setting = m_settings ? settings().disk_io_write_mode : 0;
+	boost::shared_ptr<file> storage::file_for_range(int slot, int offset
+		, int size, size_type& file_offset)
+	{
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+
+		file_storage::slice_iterator slice(files(), slot, offset, size);
+		if (slice.done() || slice->size != size) return boost::shared_ptr<file>();
+		file_entry const& fe = files().at(slice->file_index);
+		if (fe.pad_file) return boost::shared_ptr<file>();
+
+		// the file has to be opened the same way readv() opens it,
+		// and it can't be sent from if it bypasses the page cache
+		int cache_setting = m_settings ? settings().disk_io_read_mode : 0;
 		if (cache_setting == session_settings::disable_os_cache
 			|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
-			&& ((file_iter->offset + file_iter->file_base) & (m_page_size-1)) == 0))
-			mode |= file::no_buffer;
+			&& ((fe.offset + fe.file_base) & (m_page_size-1)) == 0))
+			return boost::shared_ptr<file>();
+		int mode = file::read_only;
 		if (!m_allocate_files) mode |= file::sparse;
 
-		file_handle = m_pool.open_file(const_cast<storage*>(this), path, mode, ec);
-		if (!file_handle || ec) return slot;
+		error_code ec;
+		boost::shared_ptr<file> file_handle = m_pool.open_file(this
+			, m_save_path / fe.path, slice->file_index, mode, ec);
+		if (!file_handle || ec) return boost::shared_ptr<file>();
+
+		file_offset = fe.file_base + slice->offset;
+		return file_handle;
+	}
+
+	void storage::hint_read(int slot, int offset, int size)
+	{
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+
+		int cache_setting = m_settings ? settings().disk_io_read_mode : 0;
+		for (file_storage::slice_iterator i(files(), slot, offset, size);
+			!i.done(); ++i)
+		{
+			file_entry const& fe = files().at(i->file_index);
+			if (fe.pad_file) continue;
+
+			// open the file the same way readv() would
+			int mode = file::read_only;
+			if (cache_setting == session_settings::disable_os_cache
+				|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
+				&& ((fe.offset + fe.file_base) & (m_page_size-1)) == 0))
+				mode |= file::no_buffer;
+			if (!m_allocate_files) mode |= file::sparse;
+
+			error_code ec;
+			boost::shared_ptr<file> file_handle = m_pool.open_file(this
+				, m_save_path / fe.path, i->file_index, mode, ec);
+			// errors are reported by the read itself
+			if (!file_handle || ec) continue;
+			file_handle->hint_read(fe.file_base + i->offset, int(i->size));
+		}
+	}
+
+	void storage::discard_slot(int slot)
+	{
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+
+		// allocated files keep their space
+		if (m_allocate_files) return;
+
+		int cache_setting = m_settings ? settings().disk_io_write_mode : 0;
+		for (file_storage::slice_iterator i(files(), slot, 0, m_files.piece_size(slot));
+			!i.done(); ++i)
+		{
+			file_entry const& fe = files().at(i->file_index);
+			if (fe.pad_file || i->size == 0) continue;
+
+			// open the file the same way writev() would
+			int mode = file::read_write | file::sparse;
+			if (cache_setting == session_settings::disable_os_cache
+				|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
+				&& ((fe.offset + fe.file_base) & (m_page_size-1)) == 0))
+				mode |= file::no_buffer;
+
+			error_code ec;
+			boost::shared_ptr<file> file_handle = m_pool.open_file(this
+				, m_save_path / fe.path, i->file_index, mode, ec);
+			// the piece is treated as gone either way, the space just
+			// isn't given back
+			if (!file_handle || ec) continue;
+			file_handle->discard(fe.file_base + i->offset, i->size, ec);
+		}
+	}
+
+	void storage::preallocate(int file_index, file& f, size_type file_offset
+		, int size)
+	{
+		int chunk_size = settings().preallocate_chunk_size;
+		if (m_allocated_chunks.empty() || chunk_size != m_chunk_size)
+		{
+			// we don't know which chunks were allocated with a
+			// different chunk size, start over
+			std::vector<std::vector<bool> >(files().num_files()).swap(m_allocated_chunks);
+			m_chunk_size = chunk_size;
+		}
+
+		file_entry const& fe = files().at(file_index);
+		size_type file_size = fe.file_base + fe.size;
+		std::vector<bool>& chunks = m_allocated_chunks[file_index];
+		if (chunks.empty())
+			chunks.resize(int((file_size + chunk_size - 1) / chunk_size), false);
 
-		size_type data_start = file_handle->sparse_end(file_offset);
-		return (data_start + m_files.piece_length() - 1) / m_files.piece_length();
+		int first = int(file_offset / chunk_size);
+		int last = int((file_offset + size - 1) / chunk_size);
+		for (int i = first; i <= last; ++i)
+		{
+			if (chunks[i]) continue;
+			chunks[i] = true;
+			size_type start = size_type(i) * chunk_size;
+			size_type len = (std::min)(size_type(chunk_size), file_size - start);
+			error_code ec;
+			if (f.allocate(start, len, ec)) continue;
+			// the write itself will fail if we're out of space,
+			// any other error means the file system can't do this
+			if (ec != error_code(ENOSPC, get_posix_category()))
+				m_preallocate_unsupported = true;
+			return;
+		}
 	}
 
 	bool storage::verify_resume_data(lazy_entry const& rd, std::string& error)
@@ -899,23 +1226,39 @@ namespace libtorrent
 		}
 
 		std::vector<std::pair<size_type, std::time_t> > file_sizes;
-		lazy_entry const* file_sizes_ent = rd.dict_find_list("file sizes");
-		if (file_sizes_ent == 0)
+		lazy_entry const* file_sizes_ent = rd.dict_find("file sizes");
+		if (file_sizes_ent && file_sizes_ent->type() == lazy_entry::string_t)
 		{
-			error = "missing or invalid 'file sizes' entry in resume data";
-			return false;
+			// packed format, 64 bit size and 64 bit modification
+			// time for each file
+			char const* p = file_sizes_ent->string_ptr();
+			int num_files = file_sizes_ent->string_length() / 16;
+			file_sizes.reserve(num_files);
+			for (int i = 0; i < num_files; ++i)
+			{
+				size_type s = detail::read_int64(p);
+				std::time_t t = std::time_t(detail::read_int64(p));
+				file_sizes.push_back(std::pair<size_type, std::time_t>(s, t));
+			}
 		}
-		
-		for (int i = 0; i < file_sizes_ent->list_size(); ++i)
+		else if (file_sizes_ent && file_sizes_ent->type() == lazy_entry::list_t)
 		{
-			lazy_entry const* e = file_sizes_ent->list_at(i);
-			if (e->type() != lazy_entry::list_t
-				|| e->list_size() != 2
-				|| e->list_at(0)->type() != lazy_entry::int_t
-				|| e->list_at(1)->type() != lazy_entry::int_t)
-				continue;
-			file_sizes.push_back(std::pair<size_type, std::time_t>(
-				e->list_int_value_at(0), std::time_t(e->list_int_value_at(1))));
+			for (int i = 0; i < file_sizes_ent->list_size(); ++i)
+			{
+				lazy_entry const* e = file_sizes_ent->list_at(i);
+				if (e->type() != lazy_entry::list_t
+					|| e->list_size() != 2
+					|| e->list_at(0)->type() != lazy_entry::int_t
+					|| e->list_at(1)->type() != lazy_entry::int_t)
+					continue;
+				file_sizes.push_back(std::pair<size_type, std::time_t>(
+					e->list_int_value_at(0), std::time_t(e->list_int_value_at(1))));
+			}
+		}
+		else
+		{
+			error = "missing or invalid 'file sizes' entry in resume data";
+			return false;
 		}
 
 		if (file_sizes.empty())
@@ -926,15 +1269,16 @@ namespace libtorrent
 		
 		bool seed = false;
 		
-		lazy_entry const* slots = rd.dict_find_list("slots");
+		lazy_entry const* slots = find_slots(rd);
 		if (slots)
 		{
-			if (int(slots->list_size()) == m_files.num_pieces())
+			if (num_slots(slots) == m_files.num_pieces())
 			{
 				seed = true;
-				for (int i = 0; i < slots->list_size(); ++i)
+				for (int i = 0; i < num_slots(slots); ++i)
 				{
-					if (slots->list_int_value_at(i, -1) >= 0) continue;
+					int index;
+					if (slot_at(slots, i, index) && index >= 0) continue;
 					seed = false;
 					break;
 				}
@@ -990,8 +1334,13 @@ namespace libtorrent
 				}
 			}
 		}
+		m_touched_files.clear();
+		// compact storages can't be spot checked, their pieces
+		// may be in any slot
+		bool spot_check = m_settings && settings().fastresume_spot_checks > 0
+			&& full_allocation_mode;
 		return match_filesizes(files(), m_save_path, file_sizes
-			, !full_allocation_mode, &error);
+			, !full_allocation_mode, &error, spot_check ? &m_touched_files : 0);
 
 	}
 
@@ -1083,6 +1432,252 @@ namespace libtorrent
 		return ret;
 	}
 
+	int storage::move_storage_chunk(fs::path save_path, int& progress)
+	{
+		save_path = complete(save_path);
+		int chunk_size = m_settings ? settings().move_storage_chunk_size : 0;
+
+		if (!m_move || m_move->save_path != save_path)
+		{
+			m_move.reset();
+			// on the same file system the files are just renamed,
+			// which doesn't take long enough to need to be split up
+			if (chunk_size <= 0 || same_device(m_save_path, save_path))
+			{
+				progress = 1000000;
+				return move_storage(save_path) ? 0 : -1;
+			}
+
+			m_move.reset(new move_state(save_path));
+			for (file_storage::iterator i = files().begin()
+				, end(files().end()); i != end; ++i)
+				m_move->total += i->size;
+		}
+		if (chunk_size <= 0) chunk_size = 4 * 1024 * 1024;
+
+		move_state& m = *m_move;
+		int budget = chunk_size;
+		error_code ec;
+		while (budget > 0)
+		{
+			if (m.file_index < files().num_files())
+			{
+				file_entry const& fe = files().at(m.file_index);
+				if (m.open_index != m.file_index)
+				{
+					if (fe.pad_file || !open_for_move(m.file_index, ec))
+					{
+						if (ec) return -1;
+						// there's nothing to copy
+						m.moved += fe.size;
+						++m.file_index;
+						continue;
+					}
+					m.file_size = m.src.get_size(ec);
+					if (!ec) m.dst.set_size(m.file_size, ec);
+					if (ec)
+					{
+						set_error(m_save_path / fe.path, ec);
+						return -1;
+					}
+					m.offset = 0;
+				}
+
+				int size = int((std::min)(size_type(budget), m.file_size - m.offset));
+				if (size > 0 && !copy_for_move(m.offset, size)) return -1;
+				m.offset += size;
+				m.moved += size;
+				budget -= size;
+				if (m.offset >= m.file_size)
+				{
+					m.src.close();
+					m.dst.close();
+					m.open_index = -1;
+					++m.file_index;
+				}
+				continue;
+			}
+
+			// every file has been copied once. Now copy the ranges
+			// that were written to after they were copied
+			if (m.dirty.empty()) break;
+			move_state::range& r = m.dirty.front();
+			if (m.open_index != r.file_index && !open_for_move(r.file_index, ec))
+			{
+				if (ec) return -1;
+				m.dirty.pop_front();
+				continue;
+			}
+			int size = int((std::min)(size_type(budget), r.size));
+			if (!copy_for_move(r.offset, size)) return -1;
+			r.offset += size;
+			r.size -= size;
+			budget -= size;
+			if (r.size == 0) m.dirty.pop_front();
+		}
+
+		if (m.file_index < files().num_files() || !m.dirty.empty())
+		{
+			progress = m.total > 0 ? int(m.moved * 1000000 / m.total) : 0;
+			if (progress >= 1000000) progress = 999999;
+			return 1;
+		}
+
+		// everything is in the new location. Switch over to it and
+		// remove the old files. Directories are only removed if they're
+		// empty, files that aren't part of the torrent are left alone
+		m_pool.release(this);
+		m.src.close();
+		m.dst.close();
+
+		std::set<std::string> directories;
+		for (file_storage::iterator i = files().begin()
+			, end(files().end()); i != end; ++i)
+		{
+			for (fs::path bp = i->path.branch_path(); !bp.empty()
+				; bp = bp.branch_path())
+			{
+				directories.insert((m_save_path / bp).string());
+			}
+			if (!i->pad_file) delete_one_file((m_save_path / i->path).string());
+		}
+		for (std::set<std::string>::reverse_iterator i = directories.rbegin()
+			, end(directories.rend()); i != end; ++i)
+		{
+			delete_one_file(*i);
+		}
+		// failing to clean up the old location doesn't fail the move
+		clear_error();
+
+		m_save_path = save_path;
+		m_move.reset();
+		progress = 1000000;
+		return 0;
+	}
+
+	bool storage::open_for_move(int file_index, error_code& ec)
+	{
+		TORRENT_ASSERT(m_move);
+		move_state& m = *m_move;
+		m.src.close();
+		m.dst.close();
+		m.open_index = -1;
+
+		fs::path const& p = files().at(file_index).path;
+		fs::path old_path = m_save_path / p;
+		fs::path new_path = m.save_path / p;
+
+#if TORRENT_USE_WPATH
+		fs::wpath src = convert_to_wstring(old_path.string());
+		fs::wpath dir = convert_to_wstring(new_path.branch_path().string());
+#elif TORRENT_USE_LOCALE_FILENAMES
+		fs::path src = convert_to_native(old_path.string());
+		fs::path dir = convert_to_native(new_path.branch_path().string());
+#else
+		fs::path const& src = old_path;
+		fs::path dir = new_path.branch_path();
+#endif
+		// files that haven't been created yet don't need to be copied
+		if (!exists(src)) return false;
+
+#ifndef BOOST_NO_EXCEPTIONS
+		try {
+#endif
+			if (!exists(dir)) create_directories(dir);
+#ifndef BOOST_NO_EXCEPTIONS
+		}
+#if BOOST_VERSION >= 103500
+		catch (boost::system::system_error& e)
+		{
+			ec = e.code();
+		}
+#else
+		catch (boost::filesystem::filesystem_error& e)
+		{
+			ec = error_code(e.system_error(), get_system_category());
+		}
+#endif // BOOST_VERSION
+#endif // BOOST_NO_EXCEPTIONS
+		if (ec)
+		{
+			set_error(new_path.branch_path(), ec);
+			return false;
+		}
+
+		if (!m.src.open(old_path, file::read_only, ec))
+		{
+			set_error(old_path, ec);
+			return false;
+		}
+		if (!m.dst.open(new_path, file::read_write, ec))
+		{
+			set_error(new_path, ec);
+			return false;
+		}
+		m.open_index = file_index;
+		return true;
+	}
+
+	bool storage::copy_for_move(size_type offset, int size)
+	{
+		TORRENT_ASSERT(m_move);
+		move_state& m = *m_move;
+		TORRENT_ASSERT(m.open_index >= 0);
+		fs::path const& p = files().at(m.open_index).path;
+		if (m.buffer.empty()) m.buffer.resize(1024 * 1024);
+
+		while (size > 0)
+		{
+			error_code ec;
+			file::iovec_t b = { &m.buffer[0], (std::min)(size, int(m.buffer.size())) };
+			int bytes = int(m.src.readv(offset, &b, 1, ec));
+			if (ec)
+			{
+				set_error(m_save_path / p, ec);
+				return false;
+			}
+			// the file was truncated after we got its size,
+			// there's nothing more to copy
+			if (bytes <= 0) return true;
+			b.iov_len = bytes;
+			int written = int(m.dst.writev(offset, &b, 1, ec));
+			if (!ec && written != bytes) ec = error_code(EIO, get_posix_category());
+			if (ec)
+			{
+				set_error(m_move->save_path / p, ec);
+				return false;
+			}
+			offset += bytes;
+			size -= bytes;
+		}
+		return true;
+	}
+
+	void storage::write_during_move(int file_index, size_type offset, int size)
+	{
+		TORRENT_ASSERT(m_move);
+		move_state& m = *m_move;
+		// files the move hasn't got to yet will be copied with
+		// this write in them
+		if (file_index > m.file_index) return;
+
+		size_type end = offset + size;
+		if (file_index == m.file_index)
+		{
+			if (m.open_index == file_index && end > m.file_size)
+			{
+				// the file grew, copy the rest of it too
+				m.total += end - m.file_size;
+				m.file_size = end;
+			}
+			if (offset >= m.offset) return;
+			if (end > m.offset) end = m.offset;
+		}
+		move_state::range r = { file_index, offset, end - offset };
+		m.dirty.push_back(r);
+		m.total += r.size;
+	}
+
 #ifdef TORRENT_DEBUG
 /*
 	void storage::shuffle()
@@ -1269,14 +1864,12 @@ ret:
 		TORRENT_ASSERT(start + size <= m_files.total_size());
 
 		// find the file iterator and file offset
-		size_type file_offset = start;
-		std::vector<file_entry>::const_iterator file_iter;
+		std::vector<file_entry>::const_iterator file_iter = files().begin()
+			+ files().file_index_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
 
-		for (file_iter = files().begin();;)
+		while (file_offset >= file_iter->size)
 		{
-			if (file_offset < file_iter->size)
-				break;
-
 			file_offset -= file_iter->size;
 			++file_iter;
 			TORRENT_ASSERT(file_iter != files().end());
@@ -1349,7 +1942,8 @@ ret:
 				mode |= file::no_buffer;
 			if (!m_allocate_files) mode |= file::sparse;
 
-			file_handle = m_pool.open_file(this, path, mode, ec);
+			file_handle = m_pool.open_file(this, path
+				, file_iter - files().begin(), mode, ec);
 			if (!file_handle || ec)
 			{
 				TORRENT_ASSERT(ec);
@@ -1357,6 +1951,14 @@ ret:
 				return -1;
 			}
 
+			if (op.mode == file::read_write && (mode & file::sparse)
+				&& !m_preallocate_unsupported && m_settings
+				&& settings().preallocate_chunk_size > 0)
+			{
+				preallocate(file_iter - files().begin(), *file_handle
+					, file_iter->file_base + file_offset, file_bytes_left);
+			}
+
 			int num_tmp_bufs = copy_bufs(current_buf, file_bytes_left, tmp_bufs);
 			TORRENT_ASSERT(count_bufs(tmp_bufs, file_bytes_left) == num_tmp_bufs);
 			TORRENT_ASSERT(num_tmp_bufs <= num_bufs);
@@ -1377,6 +1979,12 @@ ret:
 				bytes_transferred = (int)((*file_handle).*op.regular_op)(file_iter->file_base
 					+ file_offset, tmp_bufs, num_tmp_bufs, ec);
 			}
+
+			if (m_move && op.mode == file::read_write && !ec && bytes_transferred > 0)
+			{
+				write_during_move(file_iter - files().begin()
+					, file_iter->file_base + file_offset, bytes_transferred);
+			}
 			file_offset = 0;
 
 			if (ec)
@@ -1430,14 +2038,74 @@ ret:
 		return size;
 	}
 
+	// they write an unaligned buffer to a file that requires aligned access.
+	// The sectors at either end are only partly covered by the write, they
+	// are read first so that the bytes around it are written back unchanged
+
 	size_type storage::write_unaligned(boost::shared_ptr<file> const& file_handle
 		, size_type file_offset, file::iovec_t const* bufs, int num_bufs, error_code& ec)
 	{
-		TORRENT_ASSERT(false); // not implemented
-		return 0;
-	}
-
-	int storage::write(
+		const int pos_align = file_handle->pos_alignment()-1;
+		const int size_align = file_handle->size_alignment()-1;
+		const int block_size = disk_pool()->block_size();
+
+		const int size = bufs_size(bufs, num_bufs);
+		const int start_adjust = file_offset & pos_align;
+		const size_type aligned_start = file_offset - start_adjust;
+		const int aligned_size = ((size+start_adjust) & size_align)
+			? ((size+start_adjust) & ~size_align) + size_align + 1 : size + start_adjust;
+		const int num_blocks = (aligned_size + block_size - 1) / block_size;
+		TORRENT_ASSERT((aligned_size & size_align) == 0);
+
+		size_type file_size = file_handle->get_size(ec);
+		if (ec) return -1;
+
+		disk_buffer_holder tmp_buf(*disk_pool(), disk_pool()->allocate_buffers(num_blocks, "write scratch"), num_blocks);
+		char* buf = tmp_buf.get();
+
+		// the head and tail sectors. Past the end of the
+		// file there's nothing to keep
+		const int sector = size_align + 1;
+		int edges[2] = { 0, aligned_size - sector };
+		bool partial[2] = { start_adjust != 0, ((size + start_adjust) & size_align) != 0 };
+		for (int k = 0; k < 2; ++k)
+		{
+			if (!partial[k]) continue;
+			if (k == 1 && partial[0] && edges[1] == edges[0]) break;
+			size_type ret = 0;
+			if (aligned_start + edges[k] < file_size)
+			{
+				file::iovec_t b = {buf + edges[k], sector};
+				ret = file_handle->readv(aligned_start + edges[k], &b, 1, ec);
+				if (ret < 0) return ret;
+			}
+			if (ret < sector) memset(buf + edges[k] + ret, 0, sector - ret);
+		}
+
+		char* write_buf = buf + start_adjust;
+		for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i != end; ++i)
+		{
+			memcpy(write_buf, i->iov_base, i->iov_len);
+			write_buf += i->iov_len;
+		}
+
+		file::iovec_t b = {buf, aligned_size};
+		size_type ret = file_handle->writev(aligned_start, &b, 1, ec);
+		if (ret < 0) return ret;
+
+		// the padding of the tail sector may have made the file
+		// longer than it should be
+		size_type end = file_offset + size;
+		if (aligned_start + ret > end && aligned_start + ret > file_size)
+		{
+			if (!file_handle->set_size((std::max)(file_size, end), ec))
+				return -1;
+		}
+		if (ret < size + start_adjust) return (std::max)(ret - start_adjust, size_type(0));
+		return size;
+	}
+
+	int storage::write(
 		const char* buf
 		, int slot
 		, int offset
@@ -1453,14 +2121,797 @@ ret:
 		, int offset
 		, int size)
 	{
-		file::iovec_t b = { (void*)buf, size };
-		return readv(&b, slot, offset, 1);
+		file::iovec_t b = { (void*)buf, size };
+		return readv(&b, slot, offset, 1);
+	}
+
+	storage_interface* default_storage_constructor(file_storage const& fs
+		, fs::path const& path, file_pool& fp)
+	{
+		return new storage(fs, path, fp);
+	}
+
+	// reads and writes by copying to and from windows of the files
+	// mapped into memory, leaving the caching to the page cache. The
+	// windows don't hold on to file handles, so the file pool limit
+	// still applies. Everything but readv() and writev() is handled
+	// by storage, with the windows unmapped first where needed
+	class mmap_storage : public storage
+	{
+	public:
+		mmap_storage(file_storage const& fs, fs::path const& path, file_pool& fp)
+			: storage(fs, path, fp), m_use_counter(0) {}
+
+		~mmap_storage() { unmap_all(); }
+
+		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+		{ return mapped_op(bufs, slot, offset, num_bufs, false); }
+		int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+		{ return mapped_op(bufs, slot, offset, num_bufs, true); }
+
+		bool rename_file(int index, std::string const& new_filename)
+		{
+			unmap_file(index);
+			return storage::rename_file(index, new_filename);
+		}
+		bool release_files()
+		{
+			unmap_all();
+			return storage::release_files();
+		}
+		bool delete_files()
+		{
+			unmap_all();
+			return storage::delete_files();
+		}
+		int delete_files_chunk(int& progress)
+		{
+			if (progress == 0) unmap_all();
+			return storage::delete_files_chunk(progress);
+		}
+		bool move_storage(fs::path save_path)
+		{
+			unmap_all();
+			return storage::move_storage(save_path);
+		}
+		// writes through the mapped windows can't be tracked by a
+		// chunked move, the files are always moved in one go
+		int move_storage_chunk(fs::path save_path, int& progress)
+		{
+			progress = 1000000;
+			return move_storage(save_path) ? 0 : -1;
+		}
+
+	private:
+
+		enum { window_size = 16 * 1024 * 1024 };
+
+		// the address space used per storage is limited to this
+		// many windows
+		enum { max_windows = sizeof(void*) >= 8 ? 256 : 8 };
+
+		struct window
+		{
+			char* base;
+			int size;
+			bool writable;
+			boost::uint64_t last_use;
+		};
+
+		int mapped_op(file::iovec_t const* bufs, int slot, int offset
+			, int num_bufs, bool write);
+		char* map_range(int file_index, size_type file_offset, bool write
+			, int& available, error_code& ec);
+		void unmap_file(int file_index);
+		void unmap_all();
+
+		// the mapped windows, by file index and window
+		// index within the file
+		typedef std::map<std::pair<int, int>, window> windows_t;
+		windows_t m_windows;
+		boost::uint64_t m_use_counter;
+	};
+
+	int mmap_storage::mapped_op(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs, bool write)
+	{
+		TORRENT_ASSERT(bufs != 0);
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+		TORRENT_ASSERT(offset >= 0);
+
+		int size = 0;
+		for (int i = 0; i < num_bufs; ++i) size += bufs[i].iov_len;
+		int slot_size = static_cast<int>(m_files.piece_size(slot));
+		if (offset + size > slot_size) size = slot_size - offset;
+		if (size <= 0) return 0;
+
+		file::iovec_t const* cur = bufs;
+		int cur_offset = 0;
+		int ret = 0;
+		for (file_storage::slice_iterator i(files(), slot, offset, size);
+			!i.done(); ++i)
+		{
+			file_entry const& fe = files().at(i->file_index);
+			size_type file_offset = fe.file_base + i->offset;
+			size_type left = i->size;
+			while (left > 0)
+			{
+				char* p = 0;
+				int available = int((std::min)(left, size_type(window_size)));
+				if (!fe.pad_file)
+				{
+					error_code ec;
+					p = map_range(i->file_index, file_offset, write, available, ec);
+					if (ec)
+					{
+						set_error(m_save_path / fe.path, ec);
+						return -1;
+					}
+					// reading past the end of the file
+					if (p == 0) return ret;
+				}
+				int n = int((std::min)(left, size_type(available)));
+				for (int k = n; k > 0;)
+				{
+					int chunk = (std::min)(k, int(cur->iov_len) - cur_offset);
+					char* b = (char*)cur->iov_base + cur_offset;
+					if (p == 0)
+					{
+						// pad files read as zeroes and
+						// ignore what's written to them
+						if (!write) std::memset(b, 0, chunk);
+					}
+					else
+					{
+						if (write) std::memcpy(p, b, chunk);
+						else std::memcpy(b, p, chunk);
+						p += chunk;
+					}
+					k -= chunk;
+					cur_offset += chunk;
+					if (cur_offset == int(cur->iov_len))
+					{
+						++cur;
+						cur_offset = 0;
+					}
+				}
+				left -= n;
+				file_offset += n;
+				ret += n;
+			}
+		}
+		return ret;
+	}
+
+	// returns a pointer to file_offset in the file, mapping the window
+	// around it if it isn't already, and sets available to the number
+	// of bytes that can be accessed from it. Returns 0 with no error
+	// if file_offset is past the end of the file, when reading
+	char* mmap_storage::map_range(int file_index, size_type file_offset
+		, bool write, int& available, error_code& ec)
+	{
+		int index = int(file_offset / window_size);
+		size_type start = size_type(index) * window_size;
+		std::pair<int, int> key(file_index, index);
+
+		windows_t::iterator i = m_windows.find(key);
+		if (i != m_windows.end())
+		{
+			window& w = i->second;
+			if ((w.writable || !write) && file_offset < start + w.size)
+			{
+				w.last_use = ++m_use_counter;
+				available = int(start + w.size - file_offset);
+				return w.base + (file_offset - start);
+			}
+			// the window is read-only, or it was mapped before
+			// the file grew. Map it again
+			file::unmap(w.base, w.size);
+			m_windows.erase(i);
+		}
+
+		file_entry const& fe = files().at(file_index);
+		fs::path path = m_save_path / fe.path;
+
+		// open the file the same way readv() and writev() would
+		int mode = write ? file::read_write : file::read_only;
+		int cache_setting = m_settings ? (write ? settings().disk_io_write_mode
+			: settings().disk_io_read_mode) : 0;
+		if (cache_setting == session_settings::disable_os_cache
+			|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
+			&& ((fe.offset + fe.file_base) & (m_page_size-1)) == 0))
+			mode |= file::no_buffer;
+		if (!m_allocate_files) mode |= file::sparse;
+
+		boost::shared_ptr<file> f = m_pool.open_file(this, path, file_index, mode, ec);
+		if (!f || ec) return 0;
+
+		size_type file_size = f->get_size(ec);
+		if (ec) return 0;
+		if (write && file_size < fe.file_base + fe.size)
+		{
+			// writing to a mapping past the end of the file
+			// is an error, the file has to be grown first
+			file_size = fe.file_base + fe.size;
+			f->set_size(file_size, ec);
+			if (ec) return 0;
+		}
+		if (file_offset >= file_size) return 0;
+
+		int size = int((std::min)(size_type(window_size), file_size - start));
+		char* base = f->map(start, size, write, ec);
+		if (base == 0) return 0;
+
+		if (int(m_windows.size()) >= max_windows)
+		{
+			windows_t::iterator oldest = m_windows.begin();
+			for (windows_t::iterator k = m_windows.begin()
+				, end(m_windows.end()); k != end; ++k)
+				if (k->second.last_use < oldest->second.last_use) oldest = k;
+			file::unmap(oldest->second.base, oldest->second.size);
+			m_windows.erase(oldest);
+		}
+
+		window w;
+		w.base = base;
+		w.size = size;
+		w.writable = write;
+		w.last_use = ++m_use_counter;
+		m_windows.insert(std::make_pair(key, w));
+
+		available = int(start + size - file_offset);
+		return base + (file_offset - start);
+	}
+
+	void mmap_storage::unmap_file(int file_index)
+	{
+		windows_t::iterator i = m_windows.lower_bound(std::make_pair(file_index, 0));
+		while (i != m_windows.end() && i->first.first == file_index)
+		{
+			file::unmap(i->second.base, i->second.size);
+			m_windows.erase(i++);
+		}
+	}
+
+	void mmap_storage::unmap_all()
+	{
+		for (windows_t::iterator i = m_windows.begin()
+			, end(m_windows.end()); i != end; ++i)
+			file::unmap(i->second.base, i->second.size);
+		m_windows.clear();
+	}
+
+	storage_interface* mmap_storage_constructor(file_storage const& fs
+		, fs::path const& path, file_pool& fp)
+	{
+		return new mmap_storage(fs, path, fp);
+	}
+
+	// keeps a copy of the pieces that are read the most in a cache
+	// directory, one file per piece, and serves reads of them from
+	// there. The cache directory is meant to be on a faster drive than
+	// the save path. Writes go to the regular files and drop the
+	// cached copy, so the cache never holds data that isn't on the
+	// regular files too, and is thrown away when the storage is opened.
+	// Everything but readv() and writev() is handled by storage
+	class tiered_storage : public storage
+	{
+	public:
+		tiered_storage(file_storage const& fs, fs::path const& path, file_pool& fp)
+			: storage(fs, path, fp)
+			, m_state(tier_unopened)
+			, m_tier_bytes(0)
+			, m_use_counter(0)
+		{}
+
+		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+		int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+
+		bool delete_files()
+		{
+			drop_all();
+			return storage::delete_files();
+		}
+		int delete_files_chunk(int& progress)
+		{
+			if (progress == 0) drop_all();
+			return storage::delete_files_chunk(progress);
+		}
+		bool move_slot(int src_slot, int dst_slot)
+		{
+			drop(dst_slot);
+			return storage::move_slot(src_slot, dst_slot);
+		}
+		bool swap_slots(int slot1, int slot2)
+		{
+			drop(slot1);
+			drop(slot2);
+			return storage::swap_slots(slot1, slot2);
+		}
+		bool swap_slots3(int slot1, int slot2, int slot3)
+		{
+			drop(slot1);
+			drop(slot2);
+			drop(slot3);
+			return storage::swap_slots3(slot1, slot2, slot3);
+		}
+
+	private:
+
+		// creates the cache directory the first time it's needed.
+		// Returns false if the cache is disabled or can't be used
+		bool open_tier();
+		fs::path piece_path(int slot) const
+		{ return m_tier_path / boost::lexical_cast<std::string>(slot); }
+
+		// counts a read from a slot that isn't in the cache, and
+		// copies the slot into it once it's been read enough
+		void record_read(int slot, int size);
+		bool admit(int slot);
+		void drop(int slot);
+		void drop_all();
+
+		enum { tier_unopened, tier_open, tier_disabled };
+		int m_state;
+		fs::path m_tier_path;
+
+		struct cached_slot
+		{
+			int size;
+			boost::uint64_t last_use;
+		};
+		typedef std::map<int, cached_slot> tier_t;
+		tier_t m_tier;
+		size_type m_tier_bytes;
+		boost::uint64_t m_use_counter;
+
+		// the number of bytes read from each slot since it
+		// was last dropped from the cache, or ever
+		std::vector<boost::uint32_t> m_read_bytes;
+	};
+
+	bool tiered_storage::open_tier()
+	{
+		if (m_state == tier_open) return true;
+		if (m_state == tier_disabled) return false;
+		if (m_settings == 0) return false;
+		if (settings().tiered_cache_path.empty()
+			|| settings().tiered_cache_size <= 0)
+		{
+			m_state = tier_disabled;
+			return false;
+		}
+
+		// the directory belongs to this torrent's save path
+		std::string id = m_save_path.string() + "/" + files().name();
+		sha1_hash h = hasher(id.c_str(), id.size()).final();
+		m_tier_path = fs::path(settings().tiered_cache_path)
+			/ to_hex(std::string((char const*)&h[0], 20));
+
+		error_code ec;
+#ifndef BOOST_NO_EXCEPTIONS
+		try {
+#endif
+			// whatever was left from before may be stale
+			fs::remove_all(m_tier_path);
+			fs::create_directories(m_tier_path);
+#ifndef BOOST_NO_EXCEPTIONS
+		}
+#if BOOST_VERSION >= 103500
+		catch (boost::system::system_error& e)
+		{
+			ec = e.code();
+		}
+#else
+		catch (boost::filesystem::filesystem_error& e)
+		{
+			ec = error_code(e.system_error(), get_system_category());
+		}
+#endif // BOOST_VERSION
+#endif // BOOST_NO_EXCEPTIONS
+		// the torrent works without the cache, it's just slower
+		if (ec)
+		{
+			m_state = tier_disabled;
+			return false;
+		}
+		m_read_bytes.resize(files().num_pieces(), 0);
+		m_state = tier_open;
+		return true;
+	}
+
+	int tiered_storage::readv(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		if (!open_tier()) return storage::readv(bufs, slot, offset, num_bufs);
+
+		tier_t::iterator i = m_tier.find(slot);
+		if (i != m_tier.end())
+		{
+			int size = bufs_size(bufs, num_bufs);
+			if (offset + size > i->second.size) size = i->second.size - offset;
+			error_code ec;
+			file f(piece_path(slot), file::read_only, ec);
+			if (!ec)
+			{
+				size_type ret = f.readv(offset, bufs, num_bufs, ec);
+				if (!ec && ret >= size)
+				{
+					i->second.last_use = ++m_use_counter;
+					return size;
+				}
+			}
+			// the cached copy is broken. Read from the
+			// regular files and leave the cache alone
+			drop(slot);
+			return storage::readv(bufs, slot, offset, num_bufs);
+		}
+
+		int ret = storage::readv(bufs, slot, offset, num_bufs);
+		if (ret > 0) record_read(slot, ret);
+		return ret;
+	}
+
+	int tiered_storage::writev(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		drop(slot);
+		return storage::writev(bufs, slot, offset, num_bufs);
+	}
+
+	void tiered_storage::record_read(int slot, int size)
+	{
+		TORRENT_ASSERT(slot < int(m_read_bytes.size()));
+		boost::uint32_t& n = m_read_bytes[slot];
+		n += size;
+		boost::uint32_t threshold = boost::uint32_t(files().piece_size(slot))
+			* (std::max)(settings().tiered_cache_admission, 1);
+		if (n < threshold) return;
+		// if it can't be admitted, don't try again on every read
+		n = 0;
+		admit(slot);
+	}
+
+	bool tiered_storage::admit(int slot)
+	{
+		if (m_disk_pool == 0) return false;
+
+		int piece_size = files().piece_size(slot);
+		size_type limit = size_type(settings().tiered_cache_size) * 1024 * 1024;
+		if (piece_size > limit) return false;
+
+		// make room by dropping the least recently read slots
+		while (m_tier_bytes + piece_size > limit && !m_tier.empty())
+		{
+			tier_t::iterator lru = m_tier.begin();
+			for (tier_t::iterator i = m_tier.begin(), end(m_tier.end()); i != end; ++i)
+				if (i->second.last_use < lru->second.last_use) lru = i;
+			drop(lru->first);
+		}
+
+		error_code ec;
+		file f(piece_path(slot), file::write_only, ec);
+		if (ec) return false;
+
+		// copy the slot one disk buffer at a time
+		int block_size = m_disk_pool->block_size();
+		disk_buffer_holder buf(*m_disk_pool, m_disk_pool->allocate_buffer("tiered cache"));
+		if (!buf.get()) return false;
+		for (int offset = 0; offset < piece_size; offset += block_size)
+		{
+			file::iovec_t b = { buf.get(), (std::min)(block_size, piece_size - offset) };
+			if (storage::readv(&b, slot, offset, 1) != int(b.iov_len)) return false;
+			if (f.writev(offset, &b, 1, ec) != int(b.iov_len) || ec) return false;
+		}
+
+		cached_slot s;
+		s.size = piece_size;
+		s.last_use = ++m_use_counter;
+		m_tier[slot] = s;
+		m_tier_bytes += piece_size;
+		return true;
+	}
+
+	void tiered_storage::drop(int slot)
+	{
+		if (m_state != tier_open) return;
+		tier_t::iterator i = m_tier.find(slot);
+		if (i == m_tier.end()) return;
+		m_tier_bytes -= i->second.size;
+		m_tier.erase(i);
+		m_read_bytes[slot] = 0;
+#ifndef BOOST_NO_EXCEPTIONS
+		try {
+#endif
+			fs::remove(piece_path(slot));
+#ifndef BOOST_NO_EXCEPTIONS
+		} catch (std::exception&) {}
+#endif
+	}
+
+	void tiered_storage::drop_all()
+	{
+		if (m_state != tier_open) return;
+		m_tier.clear();
+		m_tier_bytes = 0;
+		std::fill(m_read_bytes.begin(), m_read_bytes.end(), 0);
+#ifndef BOOST_NO_EXCEPTIONS
+		try {
+#endif
+			fs::remove_all(m_tier_path);
+#ifndef BOOST_NO_EXCEPTIONS
+		} catch (std::exception&) {}
+#endif
+		// it's created again the next time it's needed
+		m_state = tier_unopened;
+	}
+
+	storage_interface* tiered_storage_constructor(file_storage const& fs
+		, fs::path const& path, file_pool& fp)
+	{
+		return new tiered_storage(fs, path, fp);
+	}
+
+	// keeps every slot as an array of disk buffers. Slots that have
+	// all their blocks are dropped, least recently used first, to
+	// stay within session_settings::ram_storage_size. Slots that are
+	// still being downloaded are never dropped, they would fail the
+	// hash check
+	class ram_storage : public storage_interface
+	{
+	public:
+		ram_storage(file_storage const& fs)
+			: m_files(fs)
+			, m_block_size(0)
+			, m_bytes(0)
+			, m_use_counter(0)
+		{}
+
+		~ram_storage() { free_all(); }
+
+		bool initialize(bool allocate_files)
+		{
+			TORRENT_ASSERT(m_disk_pool);
+			m_block_size = m_disk_pool->block_size();
+			m_block_math.set_size(m_block_size);
+			m_slots.resize(m_files.num_pieces());
+			m_dropped_flag.resize(m_files.num_pieces(), false);
+			return false;
+		}
+
+		bool has_any_file() { return false; }
+
+		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+		int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+
+		int read(char* buf, int slot, int offset, int size)
+		{
+			file::iovec_t b = { buf, size };
+			return readv(&b, slot, offset, 1);
+		}
+		int write(char const* buf, int slot, int offset, int size)
+		{
+			file::iovec_t b = { (void*)buf, size };
+			return writev(&b, slot, offset, 1);
+		}
+
+		void dropped_slots(std::vector<int>& slots)
+		{
+			boost::mutex::scoped_lock l(m_dropped_mutex);
+			slots.insert(slots.end(), m_dropped.begin(), m_dropped.end());
+			for (std::vector<int>::iterator i = m_dropped.begin()
+				, end(m_dropped.end()); i != end; ++i)
+				m_dropped_flag[*i] = false;
+			m_dropped.clear();
+		}
+
+		void discard_slot(int slot) { free_slot(slot); }
+
+		// there are no files to move
+		bool move_storage(fs::path save_path) { return true; }
+
+		// nothing survives a restart
+		bool verify_resume_data(lazy_entry const& rd, std::string& error)
+		{
+			error = "pieces are only kept in memory";
+			return false;
+		}
+		bool write_resume_data(entry& rd) const { return false; }
+
+		bool move_slot(int src_slot, int dst_slot)
+		{
+			free_slot(dst_slot);
+			std::swap(m_slots[src_slot], m_slots[dst_slot]);
+			return false;
+		}
+		bool swap_slots(int slot1, int slot2)
+		{
+			std::swap(m_slots[slot1], m_slots[slot2]);
+			return false;
+		}
+		bool swap_slots3(int slot1, int slot2, int slot3)
+		{
+			// slot1 goes to slot2, slot2 to slot3 and slot3 to slot1
+			std::swap(m_slots[slot1], m_slots[slot2]);
+			std::swap(m_slots[slot1], m_slots[slot3]);
+			return false;
+		}
+
+		bool release_files() { return false; }
+		bool rename_file(int index, std::string const& new_filename) { return false; }
+		bool delete_files() { free_all(); return false; }
+
+	private:
+
+		struct ram_slot
+		{
+			ram_slot(): num_blocks(0), last_use(0) {}
+			// the blocks that haven't been written are 0
+			std::vector<char*> blocks;
+			int num_blocks;
+			boost::uint64_t last_use;
+		};
+
+		int blocks_in_slot(int slot) const
+		{ return m_block_math.count(m_files.piece_size(slot)); }
+
+		// copies between bufs and the blocks of s, starting at offset
+		void copy(file::iovec_t const* bufs, int num_bufs, ram_slot& s
+			, int offset, int size, bool write);
+
+		// drops the least recently used complete slots, other than
+		// slot, until there's room for one more block
+		void make_room(int slot);
+		void drop(int slot);
+		void free_slot(int slot);
+		void free_all();
+
+		file_storage const& m_files;
+		int m_block_size;
+		block_math m_block_math;
+		std::vector<ram_slot> m_slots;
+		size_type m_bytes;
+		boost::uint64_t m_use_counter;
+
+		// the slots that have been dropped since the last call to
+		// dropped_slots(). m_dropped_flag is set for the slots in it
+		boost::mutex m_dropped_mutex;
+		std::vector<int> m_dropped;
+		std::vector<bool> m_dropped_flag;
+	};
+
+	void ram_storage::copy(file::iovec_t const* bufs, int num_bufs, ram_slot& s
+		, int offset, int size, bool write)
+	{
+		for (file::iovec_t const* i = bufs, *end(bufs + num_bufs);
+			i != end && size > 0; ++i)
+		{
+			char* p = (char*)i->iov_base;
+			int left = (std::min)(int(i->iov_len), size);
+			size -= left;
+			while (left > 0)
+			{
+				int block_offset = m_block_math.remainder(offset);
+				int n = (std::min)(left, m_block_size - block_offset);
+				char* b = s.blocks[m_block_math.index(offset)] + block_offset;
+				if (write) std::memcpy(b, p, n);
+				else std::memcpy(p, b, n);
+				p += n;
+				offset += n;
+				left -= n;
+			}
+		}
+	}
+
+	int ram_storage::readv(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		TORRENT_ASSERT(slot >= 0 && slot < int(m_slots.size()));
+		ram_slot& s = m_slots[slot];
+		int size = bufs_size(bufs, num_bufs);
+		int piece_size = m_files.piece_size(slot);
+		if (offset + size > piece_size) size = piece_size - offset;
+
+		// a block that isn't there has either been dropped or never
+		// been written. Either way, the piece isn't available
+		for (int b = m_block_math.index(offset)
+			, end(m_block_math.count(offset + size)); b < end; ++b)
+		{
+			if (b < int(s.blocks.size()) && s.blocks[b]) continue;
+			set_error("", error_code(errors::piece_evicted, libtorrent_category));
+			return -1;
+		}
+
+		copy(bufs, num_bufs, s, offset, size, false);
+		s.last_use = ++m_use_counter;
+		return size;
+	}
+
+	int ram_storage::writev(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		TORRENT_ASSERT(slot >= 0 && slot < int(m_slots.size()));
+		ram_slot& s = m_slots[slot];
+		int size = bufs_size(bufs, num_bufs);
+		int piece_size = m_files.piece_size(slot);
+		if (offset + size > piece_size) size = piece_size - offset;
+
+		if (s.blocks.empty()) s.blocks.resize(blocks_in_slot(slot), 0);
+		for (int b = m_block_math.index(offset)
+			, end(m_block_math.count(offset + size)); b < end; ++b)
+		{
+			if (s.blocks[b]) continue;
+			make_room(slot);
+			s.blocks[b] = m_disk_pool->allocate_buffer("ram storage");
+			if (s.blocks[b] == 0)
+			{
+				set_error("", error_code(ENOMEM, get_posix_category()));
+				return -1;
+			}
+			++s.num_blocks;
+			m_bytes += m_block_size;
+		}
+
+		copy(bufs, num_bufs, s, offset, size, true);
+		s.last_use = ++m_use_counter;
+		return size;
+	}
+
+	void ram_storage::make_room(int slot)
+	{
+		size_type limit = size_type(m_settings
+			? settings().ram_storage_size : 64) * 1024 * 1024;
+		while (m_bytes + m_block_size > limit)
+		{
+			int lru = -1;
+			for (int i = 0, end(m_slots.size()); i < end; ++i)
+			{
+				ram_slot const& s = m_slots[i];
+				if (i == slot || s.num_blocks < blocks_in_slot(i)) continue;
+				if (lru == -1 || s.last_use < m_slots[lru].last_use) lru = i;
+			}
+			// everything that's left is still being downloaded.
+			// Go over the limit rather than fail the write
+			if (lru == -1) return;
+			drop(lru);
+		}
+	}
+
+	void ram_storage::drop(int slot)
+	{
+		free_slot(slot);
+		boost::mutex::scoped_lock l(m_dropped_mutex);
+		if (m_dropped_flag[slot]) return;
+		m_dropped_flag[slot] = true;
+		m_dropped.push_back(slot);
+	}
+
+	void ram_storage::free_slot(int slot)
+	{
+		ram_slot& s = m_slots[slot];
+		for (std::vector<char*>::iterator i = s.blocks.begin()
+			, end(s.blocks.end()); i != end; ++i)
+		{
+			if (*i == 0) continue;
+			m_disk_pool->free_buffer(*i);
+			m_bytes -= m_block_size;
+		}
+		std::vector<char*>().swap(s.blocks);
+		s.num_blocks = 0;
+	}
+
+	void ram_storage::free_all()
+	{
+		for (int i = 0, end(m_slots.size()); i < end; ++i)
+			free_slot(i);
+		TORRENT_ASSERT(m_bytes == 0);
 	}
 
-	storage_interface* default_storage_constructor(file_storage const& fs
+	storage_interface* ram_storage_constructor(file_storage const& fs
 		, fs::path const& path, file_pool& fp)
 	{
-		return new storage(fs, path, fp);
+		return new ram_storage(fs);
 	}
 
 	// -- piece_manager -----------------------------------------------------
@@ -1477,15 +2928,23 @@ ret:
 		, m_files(m_info->files())
 		, m_storage(sc(m_files, save_path, fp))
 		, m_storage_mode(sm)
+		, m_relocation_queued(false)
 		, m_save_path(complete(save_path))
 		, m_state(state_none)
 		, m_current_slot(0)
 		, m_out_of_place(false)
+		, m_zero_piece_checked(false)
+		, m_has_zero_piece(false)
 		, m_scratch_buffer(io, 0)
 		, m_scratch_buffer2(io, 0)
 		, m_scratch_piece(-1)
 		, m_storage_constructor(sc)
 		, m_io_thread(io)
+		, m_disk_queue(-1)
+		, m_io_class(normal_io_class)
+		, m_cached_blocks(0)
+		, m_cache_limit(-1)
+		, m_cache_reservation(0)
 		, m_torrent(torrent)
 	{
 		m_storage->m_disk_pool = &m_io_thread;
@@ -1495,6 +2954,54 @@ ret:
 	{
 	}
 
+	void piece_manager::get_io_stats(torrent_io_stats& st, bool file_reads) const
+	{
+		boost::mutex::scoped_lock l(m_io_stats_mutex);
+		st.bytes_read = m_io_stats.bytes_read;
+		st.bytes_written = m_io_stats.bytes_written;
+		st.reads = m_io_stats.reads;
+		st.writes = m_io_stats.writes;
+		st.blocks_read = m_io_stats.blocks_read;
+		st.blocks_read_hit = m_io_stats.blocks_read_hit;
+		st.job_time = m_io_stats.job_time;
+		st.queue_time = m_io_stats.queue_time;
+		if (file_reads) st.file_bytes_read = m_io_stats.file_bytes_read;
+		else st.file_bytes_read.clear();
+	}
+
+	void piece_manager::count_read(int slot, int offset, int size)
+	{
+		boost::mutex::scoped_lock l(m_io_stats_mutex);
+		m_io_stats.bytes_read += size;
+		++m_io_stats.reads;
+		std::vector<size_type>& files = m_io_stats.file_bytes_read;
+		if (files.empty()) files.resize(m_files.num_files(), 0);
+		for (file_storage::slice_iterator i(m_files, slot, offset, size);
+			!i.done(); ++i)
+			files[i->file_index] += i->size;
+	}
+
+	void piece_manager::count_write(int size)
+	{
+		boost::mutex::scoped_lock l(m_io_stats_mutex);
+		m_io_stats.bytes_written += size;
+		++m_io_stats.writes;
+	}
+
+	void piece_manager::count_block_read(int blocks, bool hit)
+	{
+		boost::mutex::scoped_lock l(m_io_stats_mutex);
+		m_io_stats.blocks_read += blocks;
+		if (hit) m_io_stats.blocks_read_hit += blocks;
+	}
+
+	void piece_manager::count_job(time_duration queued, time_duration run)
+	{
+		boost::mutex::scoped_lock l(m_io_stats_mutex);
+		m_io_stats.queue_time.add(queued);
+		m_io_stats.job_time.add(run);
+	}
+
 	void piece_manager::async_save_resume_data(
 		boost::function<void(int, disk_io_job const&)> const& handler)
 	{
@@ -1513,6 +3020,16 @@ ret:
 		m_io_thread.add_job(j, handler);
 	}
 
+	void piece_manager::async_discard_piece(int piece
+		, boost::function<void(int, disk_io_job const&)> const& handler)
+	{
+		disk_io_job j;
+		j.storage = this;
+		j.action = disk_io_job::discard_piece;
+		j.piece = piece;
+		m_io_thread.add_job(j, handler);
+	}
+
 	void piece_manager::async_release_files(
 		boost::function<void(int, disk_io_job const&)> const& handler)
 	{
@@ -1603,7 +3120,7 @@ ret:
 	void piece_manager::async_read(
 		peer_request const& r
 		, boost::function<void(int, disk_io_job const&)> const& handler
-		, int priority)
+		, int priority, int read_ahead)
 	{
 		disk_io_job j;
 		j.storage = this;
@@ -1613,6 +3130,7 @@ ret:
 		j.buffer_size = r.length;
 		j.buffer = 0;
 		j.priority = priority;
+		j.read_ahead = read_ahead;
 		// if a buffer is not specified, only one block can be read
 		// since that is the size of the pool allocator's buffers
 		TORRENT_ASSERT(r.length <= 16 * 1024);
@@ -1646,12 +3164,14 @@ ret:
 	}
 
 	void piece_manager::async_hash(int piece
-		, boost::function<void(int, disk_io_job const&)> const& handler)
+		, boost::function<void(int, disk_io_job const&)> const& handler
+		, int priority)
 	{
 		disk_io_job j;
 		j.storage = this;
 		j.action = disk_io_job::hash;
 		j.piece = piece;
+		j.priority = priority;
 
 		m_io_thread.add_job(j, handler);
 	}
@@ -1662,7 +3182,31 @@ ret:
 		return m_save_path;
 	}
 
-	sha1_hash piece_manager::hash_for_piece_impl(int piece)
+	boost::shared_ptr<file> piece_manager::file_for_request(peer_request const& r
+		, size_type& file_offset)
+	{
+		// in compact mode, pieces move between slots
+		if (m_storage_mode == storage_mode_compact)
+			return boost::shared_ptr<file>();
+
+		// don't block the network thread while files
+		// are being moved or renamed
+		boost::recursive_mutex::scoped_try_lock l(m_mutex);
+		if (!l.owns_lock()) return boost::shared_ptr<file>();
+		return m_storage->file_for_range(r.piece, r.start, r.length, file_offset);
+	}
+
+	void piece_manager::dropped_pieces(std::vector<int>& pieces)
+	{
+		int size = pieces.size();
+		m_storage->dropped_slots(pieces);
+		// in compact mode, pieces move between slots and the slot
+		// map can't be read from this thread. The dropped pieces are
+		// found when they fail to be read instead
+		if (m_storage_mode == storage_mode_compact) pieces.resize(size);
+	}
+
+	partial_hash piece_manager::take_partial_hash(int piece)
 	{
 		partial_hash ph;
 
@@ -1672,6 +3216,19 @@ ret:
 			ph = i->second;
 			m_piece_hasher.erase(i);
 		}
+		return ph;
+	}
+
+	void piece_manager::put_partial_hash(int piece, partial_hash const& ph)
+	{
+		TORRENT_ASSERT(m_piece_hasher.find(piece) == m_piece_hasher.end());
+		if (ph.offset == 0) return;
+		m_piece_hasher[piece] = ph;
+	}
+
+	sha1_hash piece_manager::hash_for_piece_impl(int piece)
+	{
+		partial_hash ph = take_partial_hash(piece);
 
 		int slot = slot_for(piece);
 		TORRENT_ASSERT(slot != has_no_slot);
@@ -1680,14 +3237,39 @@ ret:
 		return ph.h.final();
 	}
 
-	int piece_manager::move_storage_impl(fs::path const& save_path)
+	// file_for_request() is called from the network thread and
+	// picks up the file paths, so they're only changed with
+	// m_mutex held
+	int piece_manager::rename_file_impl(int index, std::string const& new_filename)
 	{
-		if (m_storage->move_storage(save_path))
-		{
-			m_save_path = fs::complete(save_path);
-			return 0;
-		}
-		return -1;
+		boost::recursive_mutex::scoped_lock l(m_mutex);
+		return m_storage->rename_file(index, new_filename);
+	}
+
+	void piece_manager::hint_read_impl(int piece, int offset, int size)
+	{
+		int slot = slot_for(piece);
+		if (slot < 0) return;
+		m_storage->hint_read(slot, offset, size);
+	}
+
+	void piece_manager::discard_piece_impl(int piece)
+	{
+		boost::recursive_mutex::scoped_lock l(m_mutex);
+		// in compact mode the slot stays assigned to the piece, and
+		// the resume data would still claim it, so the data is kept
+		if (m_storage_mode == storage_mode_compact) return;
+		int slot = slot_for(piece);
+		if (slot < 0) return;
+		m_storage->discard_slot(slot);
+	}
+
+	int piece_manager::move_storage_impl(fs::path const& save_path, int& progress)
+	{
+		boost::recursive_mutex::scoped_lock l(m_mutex);
+		int ret = m_storage->move_storage_chunk(save_path, progress);
+		if (ret == 0) m_save_path = fs::complete(save_path);
+		return ret;
 	}
 
 	void piece_manager::write_resume_data(entry& rd) const
@@ -1700,8 +3282,6 @@ ret:
 
 		if (m_storage_mode == storage_mode_compact)
 		{
-			entry::list_type& slots = rd["slots"].list();
-			slots.clear();
 			std::vector<int>::const_reverse_iterator last; 
 			for (last = m_slot_to_piece.rbegin();
 				last != m_slot_to_piece.rend(); ++last)
@@ -1709,11 +3289,28 @@ ret:
 				if (*last != unallocated) break;
 			}
 
-			for (std::vector<int>::const_iterator i =
-				m_slot_to_piece.begin();
-				i != last.base(); ++i)
+			if (m_storage->m_settings && m_storage->settings().packed_resume_data)
+			{
+				std::string& slots = rd["slots"].string();
+				slots.resize((last.base() - m_slot_to_piece.begin()) * 4);
+				char* ptr = slots.empty() ? 0 : &slots[0];
+				for (std::vector<int>::const_iterator i =
+					m_slot_to_piece.begin();
+					i != last.base(); ++i)
+				{
+					detail::write_int32((*i >= 0) ? *i : unassigned, ptr);
+				}
+			}
+			else
 			{
-				slots.push_back((*i >= 0) ? *i : unassigned);
+				entry::list_type& slots = rd["slots"].list();
+				slots.clear();
+				for (std::vector<int>::const_iterator i =
+					m_slot_to_piece.begin();
+					i != last.base(); ++i)
+				{
+					slots.push_back((*i >= 0) ? *i : unassigned);
+				}
 			}
 		}
 
@@ -1746,14 +3343,17 @@ ret:
 		TORRENT_ASSERT(offset >= 0);
 		TORRENT_ASSERT(num_bufs > 0);
 		int slot = slot_for(piece_index);
-		return m_storage->readv(bufs, slot, offset, num_bufs);
+		int ret = m_storage->readv(bufs, slot, offset, num_bufs);
+		if (ret > 0) count_read(slot, offset, ret);
+		return ret;
 	}
 
 	int piece_manager::write_impl(
 		file::iovec_t* bufs
 	  , int piece_index
 	  , int offset
-	  , int num_bufs)
+	  , int num_bufs
+	  , bool update_hash)
 	{
 		TORRENT_ASSERT(bufs);
 		TORRENT_ASSERT(offset >= 0);
@@ -1766,8 +3366,9 @@ ret:
 		std::copy(bufs, bufs + num_bufs, iov);
 		int slot = allocate_slot_for_piece(piece_index);
 		int ret = m_storage->writev(bufs, slot, offset, num_bufs);
+		if (ret > 0) count_write(ret);
 		// only save the partial hash if the write succeeds
-		if (ret != size) return ret;
+		if (ret != size || !update_hash) return ret;
 
 #if defined TORRENT_PARTIAL_HASH_LOG && TORRENT_USE_IOSTREAM
 		std::ofstream out("partial_hash.log", std::ios::app);
@@ -1957,6 +3558,9 @@ ret:
 
 	int piece_manager::check_no_fastresume(std::string& error)
 	{
+		// the slot maps are rebuilt from scratch
+		m_pending_relocations.clear();
+
 		bool has_files = m_storage->has_any_file();
 
 		if (m_storage->error())
@@ -2005,6 +3609,10 @@ ret:
 		m_state = state_finished;
 		m_scratch_buffer.reset();
 		m_scratch_buffer2.reset();
+		if (m_storage_mode != storage_mode_compact)
+			m_pending_relocations.clear();
+		else if (!m_pending_relocations.empty())
+			queue_relocation();
 		if (m_storage_mode != storage_mode_compact)
 		{
 			// if no piece is out of place
@@ -2032,6 +3640,8 @@ ret:
 		TORRENT_ASSERT(m_files.piece_length() > 0);
 		
 		m_current_slot = 0;
+		// a check that was interrupted may have left slots read ahead
+		clear_check_queue();
 
 		// if we don't have any resume data, return
 		if (rd.type() == lazy_entry::none_t) return check_no_fastresume(error);
@@ -2058,6 +3668,10 @@ ret:
 		if (!m_storage->verify_resume_data(rd, error))
 			return check_no_fastresume(error);
 
+		if (!m_storage->m_touched_files.empty()
+			&& !spot_check_pieces(rd, error))
+			return check_no_fastresume(error);
+
 		// assume no piece is out of place (i.e. in a slot
 		// other than the one it should be in)
 		bool out_of_place = false;
@@ -2067,17 +3681,17 @@ ret:
 		if (storage_mode == storage_mode_compact || rd.dict_find("pieces") == 0)
 		{
 			// read slots map
-			lazy_entry const* slots = rd.dict_find_list("slots");
+			lazy_entry const* slots = find_slots(rd);
 			if (slots == 0)
 			{
 				error = "missing slot list";
 				return check_no_fastresume(error);
 			}
 
-			if ((int)slots->list_size() > m_files.num_pieces())
+			if (num_slots(slots) > m_files.num_pieces())
 			{
 				error = "file has more slots than torrent (slots: "
-					+ boost::lexical_cast<std::string>(slots->list_size()) + " size: "
+					+ boost::lexical_cast<std::string>(num_slots(slots)) + " size: "
 					+ boost::lexical_cast<std::string>(m_files.num_pieces()) + " )";
 				return check_no_fastresume(error);
 			}
@@ -2087,16 +3701,15 @@ ret:
 				int num_pieces = int(m_files.num_pieces());
 				m_slot_to_piece.resize(num_pieces, unallocated);
 				m_piece_to_slot.resize(num_pieces, has_no_slot);
-				for (int i = 0; i < slots->list_size(); ++i)
+				for (int i = 0; i < num_slots(slots); ++i)
 				{
-					lazy_entry const* e = slots->list_at(i);
-					if (e->type() != lazy_entry::int_t)
+					int index;
+					if (!slot_at(slots, i, index))
 					{
 						error = "invalid entry type in slot list";
 						return check_no_fastresume(error);
 					}
 
-					int index = int(e->int_value());
 					if (index >= num_pieces || index < -2)
 					{
 						error = "too high index number in slot map (index: "
@@ -2108,7 +3721,13 @@ ret:
 					{
 						m_slot_to_piece[i] = index;
 						m_piece_to_slot[index] = i;
-						if (i != index) out_of_place = true;
+						if (i != index)
+						{
+							out_of_place = true;
+							// pieces may have been left out of place
+							// when the resume data was saved
+							m_pending_relocations.push_back(index);
+						}
 					}
 					else if (index == unassigned)
 					{
@@ -2125,16 +3744,15 @@ ret:
 			}
 			else
 			{
-				for (int i = 0; i < slots->list_size(); ++i)
+				for (int i = 0; i < num_slots(slots); ++i)
 				{
-					lazy_entry const* e = slots->list_at(i);
-					if (e->type() != lazy_entry::int_t)
+					int index;
+					if (!slot_at(slots, i, index))
 					{
 						error = "invalid entry type in slot list";
 						return check_no_fastresume(error);
 					}
 
-					int index = int(e->int_value());
 					if (index != i && index >= 0)
 					{
 						error = "invalid slot index";
@@ -2151,7 +3769,8 @@ ret:
 
 			if (m_storage_mode == storage_mode_compact)
 			{
-				if (m_unallocated_slots.empty()) switch_to_full_mode();
+				if (m_unallocated_slots.empty() && m_pending_relocations.empty())
+					switch_to_full_mode();
 			}
 			else
 			{
@@ -2211,6 +3830,84 @@ ret:
 		return check_init_storage(error);
 	}
 
+	bool piece_manager::spot_check_pieces(lazy_entry const& rd, std::string& error)
+	{
+		std::vector<int> touched;
+		touched.swap(m_storage->m_touched_files);
+
+		if (m_storage_mode == storage_mode_compact)
+		{
+			error = "modification time mismatch for file '"
+				+ m_files.at(touched.front()).path.external_file_string() + "'";
+			return false;
+		}
+
+		// the pieces we have according to the resume data
+		int num_pieces = m_files.num_pieces();
+		bitfield have(num_pieces, false);
+		if (lazy_entry const* pieces = rd.dict_find_string("pieces"))
+		{
+			if (pieces->string_length() == num_pieces)
+			{
+				char const* p = pieces->string_ptr();
+				for (int i = 0; i < num_pieces; ++i)
+					if (p[i] & 1) have.set_bit(i);
+			}
+		}
+		else if (lazy_entry const* slots = find_slots(rd))
+		{
+			for (int i = 0; i < (std::min)(num_slots(slots), num_pieces); ++i)
+			{
+				int index;
+				if (slot_at(slots, i, index) && index == i) have.set_bit(i);
+			}
+		}
+
+		// the pieces with data in the touched files
+		std::vector<int> candidates;
+		int piece_length = m_files.piece_length();
+		for (std::vector<int>::iterator i = touched.begin()
+			, end(touched.end()); i != end; ++i)
+		{
+			file_entry const& fe = m_files.at(*i);
+			if (fe.size == 0) continue;
+			int first = int(fe.offset / piece_length);
+			int last = int((fe.offset + fe.size - 1) / piece_length);
+			for (int p = first; p <= last; ++p)
+				if (have[p]) candidates.push_back(p);
+		}
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end())
+			, candidates.end());
+
+		std::random_shuffle(candidates.begin(), candidates.end());
+		int num_checks = (std::min)(int(candidates.size())
+			, m_storage->settings().fastresume_spot_checks);
+
+		for (int i = 0; i < num_checks; ++i)
+		{
+			int piece = candidates[i];
+			int piece_size = m_files.piece_size(piece);
+			partial_hash ph;
+			int num_read = hash_for_slot(piece, ph, piece_size);
+			if (num_read != piece_size || m_storage->error())
+			{
+				clear_error();
+				error = "failed to read piece "
+					+ boost::lexical_cast<std::string>(piece)
+					+ " for the resume data spot check";
+				return false;
+			}
+			if (ph.h.final() != m_info->hash_for_piece(piece))
+			{
+				error = "piece " + boost::lexical_cast<std::string>(piece)
+					+ " failed the resume data spot check";
+				return false;
+			}
+		}
+		return true;
+	}
+
 /*
    state chart:
 
@@ -2347,27 +4044,14 @@ ret:
 
 		TORRENT_ASSERT(m_state == state_full_check);
 
-		int skip = check_one_piece(have_piece);
-		TORRENT_ASSERT(m_current_slot <= m_files.num_pieces());
-
-		if (skip == -1)
-		{
-			error = m_storage->error().message();
-			TORRENT_ASSERT(!error.empty());
-			return fatal_disk_error;
-		}
-
-		if (skip > 0)
+		int hole_end = skip_holes();
+		if (hole_end > m_current_slot)
 		{
-			clear_error();
-			// skip means that the piece we checked failed to be read from disk
-			// completely. This may be caused by the file not being there, or the
-			// piece overlapping with a sparse region. We should skip 'skip' number
-			// of pieces
-
+			// these slots lie entirely in holes of sparse files. There
+			// is nothing to read or hash in them
 			if (m_storage_mode == storage_mode_compact)
 			{
-				for (int i = m_current_slot; i < m_current_slot + skip - 1; ++i)
+				for (int i = m_current_slot; i < hole_end; ++i)
 				{
 					TORRENT_ASSERT(m_slot_to_piece[i] == unallocated);
 					m_unallocated_slots.push_back(i);
@@ -2375,8 +4059,41 @@ ret:
 			}
 
 			// current slot will increase by one below
-			m_current_slot += skip - 1;
+			m_current_slot = hole_end - 1;
+		}
+		else
+		{
+			int skip = check_one_piece(have_piece);
 			TORRENT_ASSERT(m_current_slot <= m_files.num_pieces());
+
+			if (skip == -1)
+			{
+				error = m_storage->error().message();
+				TORRENT_ASSERT(!error.empty());
+				return fatal_disk_error;
+			}
+
+			if (skip > 0)
+			{
+				clear_error();
+				// skip means that the piece we checked failed to be read from disk
+				// completely. This may be caused by the file not being there, or the
+				// piece overlapping with a sparse region. We should skip 'skip' number
+				// of pieces
+
+				if (m_storage_mode == storage_mode_compact)
+				{
+					for (int i = m_current_slot; i < m_current_slot + skip - 1; ++i)
+					{
+						TORRENT_ASSERT(m_slot_to_piece[i] == unallocated);
+						m_unallocated_slots.push_back(i);
+					}
+				}
+
+				// current slot will increase by one below
+				m_current_slot += skip - 1;
+				TORRENT_ASSERT(m_current_slot <= m_files.num_pieces());
+			}
 		}
 
 		++m_current_slot;
@@ -2388,6 +4105,7 @@ ret:
 
 			// clear the memory we've been using
 			std::multimap<sha1_hash, int>().swap(m_hash_to_piece);
+			clear_check_queue();
 
 			if (m_storage_mode != storage_mode_compact)
 			{
@@ -2442,6 +4160,192 @@ ret:
 		return ret;
 	}
 
+	namespace
+	{
+		sha1_hash zero_hash(int size)
+		{
+			char zeros[0x4000];
+			std::memset(zeros, 0, sizeof(zeros));
+			hasher h;
+			for (int left = size; left > 0; left -= int(sizeof(zeros)))
+				h.update(zeros, (std::min)(left, int(sizeof(zeros))));
+			return h.final();
+		}
+	}
+
+	int piece_manager::skip_holes()
+	{
+		if (!m_zero_piece_checked)
+		{
+			// a piece of all zeros reads back from a hole just like from
+			// written data. If the torrent has one, holes can't be skipped
+			m_zero_piece_checked = true;
+			int last = m_files.num_pieces() - 1;
+			sha1_hash large_hash = zero_hash(m_files.piece_length());
+			sha1_hash small_hash = zero_hash(m_files.piece_size(last));
+			for (int i = 0; i < last && !m_has_zero_piece; ++i)
+				m_has_zero_piece = m_info->hash_for_piece(i) == large_hash;
+			if (m_info->hash_for_piece(last) == small_hash)
+				m_has_zero_piece = true;
+		}
+		if (m_has_zero_piece) return m_current_slot;
+		return m_storage->sparse_end(m_current_slot);
+	}
+
+	bool piece_manager::hash_for_check(int slot, int& num_read
+		, sha1_hash& large_hash, sha1_hash& small_hash)
+	{
+		// the slots are read ahead in order. If the check skipped
+		// past the front of the queue, start over
+		while (!m_check_queue.empty() && m_check_queue.front()->slot < slot)
+		{
+			boost::shared_ptr<check_slot> s = m_check_queue.front();
+			m_check_queue.pop_front();
+			boost::mutex::scoped_lock l(m_check_mutex);
+			while (!s->done) m_check_signal.wait(l);
+		}
+		if (!m_check_queue.empty() && m_check_queue.front()->slot != slot)
+			clear_check_queue();
+
+		read_ahead_for_check(slot);
+		if (m_check_queue.empty()) return false;
+
+		boost::shared_ptr<check_slot> s = m_check_queue.front();
+		TORRENT_ASSERT(s->slot == slot);
+		m_check_queue.pop_front();
+
+		boost::mutex::scoped_lock l(m_check_mutex);
+		while (!s->done) m_check_signal.wait(l);
+		l.unlock();
+
+		// the error was taken off the storage when the slot was
+		// read, to not fail the check of the slots before it
+		if (s->error) m_storage->set_error(s->error_file, s->error);
+		num_read = s->num_read;
+		large_hash = s->large_hash;
+		small_hash = s->small_hash;
+		return true;
+	}
+
+	void piece_manager::read_ahead_for_check(int slot)
+	{
+		// don't read past a slot that couldn't be read completely,
+		// the check will skip the rest of that file
+		if (!m_check_queue.empty()
+			&& m_check_queue.back()->num_read != m_check_queue.back()->piece_size)
+			return;
+
+		disk_buffer_pool* pool = m_storage->disk_pool();
+		TORRENT_ASSERT(pool);
+		int block_size = pool->block_size();
+		int read_ahead = m_storage->settings().file_checks_read_ahead;
+		int small_piece_size = m_files.piece_size(m_files.num_pieces() - 1);
+		int next = m_check_queue.empty() ? slot : m_check_queue.back()->slot + 1;
+
+		while (next < m_files.num_pieces() && int(m_check_queue.size()) <= read_ahead)
+		{
+			boost::shared_ptr<check_slot> s(new check_slot);
+			s->slot = next;
+			s->piece_size = m_files.piece_size(next);
+			s->small_piece_size = small_piece_size;
+
+			int num_blocks = (s->piece_size + block_size - 1) / block_size;
+			file::iovec_t* bufs = TORRENT_ALLOCA(file::iovec_t, num_blocks);
+			int size = s->piece_size;
+			for (int i = 0; i < num_blocks; ++i)
+			{
+				char* b = pool->allocate_buffer("check temp");
+				if (b == 0) break;
+				s->blocks.push_back(b);
+				bufs[i].iov_base = b;
+				bufs[i].iov_len = (std::min)(block_size, size);
+				size -= bufs[i].iov_len;
+			}
+			if (int(s->blocks.size()) < num_blocks)
+			{
+				// we're out of disk buffers, check the slots
+				// we have before reading more
+				for (std::vector<char*>::iterator i = s->blocks.begin()
+					, end(s->blocks.end()); i != end; ++i)
+					pool->free_buffer(*i);
+				return;
+			}
+
+			TORRENT_ASSERT(!error());
+			s->num_read = m_storage->readv(bufs, next, 0, num_blocks);
+			if (s->num_read > 0) count_read(next, 0, s->num_read);
+			m_check_queue.push_back(s);
+			++next;
+
+			if (s->num_read != s->piece_size)
+			{
+				s->error = error();
+				s->error_file = error_file();
+				clear_error();
+				for (std::vector<char*>::iterator i = s->blocks.begin()
+					, end(s->blocks.end()); i != end; ++i)
+					pool->free_buffer(*i);
+				s->blocks.clear();
+				s->done = true;
+				return;
+			}
+
+			if (!m_io_thread.async_hash(boost::bind(&piece_manager::hash_check_slot
+				, boost::intrusive_ptr<piece_manager>(this), s)))
+				hash_check_slot(s);
+		}
+	}
+
+	// this is called from a hash thread, or from the disk thread
+	// if there are no hash threads
+	void piece_manager::hash_check_slot(boost::shared_ptr<check_slot> s)
+	{
+		disk_buffer_pool* pool = m_storage->disk_pool();
+		int block_size = pool->block_size();
+		// the number of bytes left until the end of what would be
+		// the last piece, for the small hash. -1 once it's computed
+		int small_left = s->small_piece_size < s->piece_size ? s->small_piece_size : -1;
+		int size = s->piece_size;
+		hasher h;
+		for (std::vector<char*>::iterator i = s->blocks.begin()
+			, end(s->blocks.end()); i != end; ++i)
+		{
+			int len = (std::min)(block_size, size);
+			size -= len;
+			if (small_left >= 0 && small_left <= len)
+			{
+				h.update(*i, small_left);
+				s->small_hash = hasher(h).final();
+				h.update(*i + small_left, len - small_left);
+				small_left = -1;
+			}
+			else
+			{
+				h.update(*i, len);
+				if (small_left >= 0) small_left -= len;
+			}
+			pool->free_buffer(*i);
+		}
+		s->blocks.clear();
+		s->large_hash = h.final();
+
+		boost::mutex::scoped_lock l(m_check_mutex);
+		s->done = true;
+		m_check_signal.notify_all();
+	}
+
+	void piece_manager::clear_check_queue()
+	{
+		boost::mutex::scoped_lock l(m_check_mutex);
+		for (std::deque<boost::shared_ptr<check_slot> >::iterator i
+			= m_check_queue.begin(), end(m_check_queue.end()); i != end; ++i)
+		{
+			while (!(*i)->done) m_check_signal.wait(l);
+		}
+		l.unlock();
+		m_check_queue.clear();
+	}
+
 	// -1 = error, 0 = ok, >0 = skip this many pieces
 	int piece_manager::check_one_piece(int& have_piece)
 	{
@@ -2466,14 +4370,24 @@ ret:
 		int small_piece_size = m_files.piece_size(m_files.num_pieces() - 1);
 		bool read_short = true;
 		sha1_hash small_hash;
-		if (piece_size == small_piece_size)
+		sha1_hash large_hash;
+		if (m_storage->settings().file_checks_read_ahead > 0
+			&& hash_for_check(m_current_slot, num_read, large_hash, small_hash))
 		{
-			num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
+			// hashed by the read-ahead pipeline
 		}
 		else
 		{
-			num_read = hash_for_slot(m_current_slot, ph, piece_size
-				, small_piece_size, &small_hash);
+			if (piece_size == small_piece_size)
+			{
+				num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
+			}
+			else
+			{
+				num_read = hash_for_slot(m_current_slot, ph, piece_size
+					, small_piece_size, &small_hash);
+			}
+			large_hash = ph.h.final();
 		}
 		read_short = num_read != piece_size;
 
@@ -2493,7 +4407,6 @@ ret:
 			return skip_file();
 		}
 
-		sha1_hash large_hash = ph.h.final();
 		int piece_index = identify_data(large_hash, small_hash, m_current_slot);
 
 		if (piece_index >= 0) have_piece = piece_index;
@@ -2507,6 +4420,10 @@ ret:
 		const bool this_should_move = piece_index >= 0 && m_slot_to_piece[piece_index] != unallocated;
 		const bool other_should_move = m_piece_to_slot[m_current_slot] != has_no_slot;
 
+		// moving pieces around invalidates the slots that
+		// have been read ahead
+		if (this_should_move || other_should_move) clear_check_queue();
+
 		// check if this piece should be swapped with any other slot
 		// this section will ensure that the storage is correctly sorted
 		// libtorrent will never leave the storage in a state that
@@ -2706,16 +4623,6 @@ ret:
 				|| m_piece_to_slot[m_slot_to_piece[m_current_slot]] == m_current_slot);
 		}
 
-		if (piece_index == unassigned)
-		{
-			// the data did not match any piece. Maybe we're reading
-			// from a sparse region, see if we are and skip
-			if (m_current_slot == m_files.num_pieces() -1) return 0;
-
-			int next_slot = m_storage->sparse_end(m_current_slot + 1);
-			if (next_slot > m_current_slot + 1) return next_slot - m_current_slot;
-		}
-
 		return 0;
 	}
 
@@ -2816,23 +4723,14 @@ ret:
 			debug_log();
 #endif
 
-			int piece_at_our_slot = m_slot_to_piece[piece_index];
-			TORRENT_ASSERT(m_piece_to_slot[piece_at_our_slot] == piece_index);
-
-			std::swap(
-				m_slot_to_piece[piece_index]
-				, m_slot_to_piece[slot_index]);
+			TORRENT_ASSERT(m_piece_to_slot[m_slot_to_piece[piece_index]] == piece_index);
 
-			std::swap(
-				m_piece_to_slot[piece_index]
-				, m_piece_to_slot[piece_at_our_slot]);
-
-			m_storage->move_slot(piece_index, slot_index);
-
-			TORRENT_ASSERT(m_slot_to_piece[piece_index] == piece_index);
-			TORRENT_ASSERT(m_piece_to_slot[piece_index] == piece_index);
-
-			slot_index = piece_index;
+			// moving the other piece out of the way would mean reading
+			// and writing all of it before this write can be made. Store
+			// this piece in the free slot for now, and swap them in
+			// the background
+			m_pending_relocations.push_back(piece_index);
+			queue_relocation();
 
 #if defined TORRENT_DEBUG && defined TORRENT_STORAGE_DEBUG
 			debug_log();
@@ -2841,7 +4739,8 @@ ret:
 		TORRENT_ASSERT(slot_index >= 0);
 		TORRENT_ASSERT(slot_index < (int)m_slot_to_piece.size());
 
-		if (m_free_slots.empty() && m_unallocated_slots.empty())
+		if (m_free_slots.empty() && m_unallocated_slots.empty()
+			&& m_pending_relocations.empty())
 			switch_to_full_mode();
 		
 		return slot_index;
@@ -2870,11 +4769,21 @@ ret:
 			int new_free_slot = pos;
 			if (m_piece_to_slot[pos] != has_no_slot)
 			{
-				new_free_slot = m_piece_to_slot[pos];
-				m_storage->move_slot(new_free_slot, pos);
-				m_slot_to_piece[pos] = pos;
-				m_piece_to_slot[pos] = pos;
-				written = true;
+				if (abort_on_disk)
+				{
+					new_free_slot = m_piece_to_slot[pos];
+					m_storage->move_slot(new_free_slot, pos);
+					m_slot_to_piece[pos] = pos;
+					m_piece_to_slot[pos] = pos;
+					written = true;
+				}
+				else
+				{
+					// the piece that belongs in this slot is stored
+					// somewhere else. Move it here in the background
+					m_pending_relocations.push_back(pos);
+					queue_relocation();
+				}
 			}
 			m_unallocated_slots.erase(m_unallocated_slots.begin());
 			m_slot_to_piece[new_free_slot] = unassigned;
@@ -2886,6 +4795,99 @@ ret:
 		return written;
 	}
 
+	void piece_manager::queue_relocation()
+	{
+		if (m_relocation_queued) return;
+		m_relocation_queued = true;
+		disk_io_job j;
+		j.storage = this;
+		j.action = disk_io_job::relocate_pieces;
+		m_io_thread.add_job(j);
+	}
+
+	int piece_manager::relocate_piece_impl()
+	{
+		boost::recursive_mutex::scoped_lock lock(m_mutex);
+
+		INVARIANT_CHECK;
+
+		// the slot maps are rebuilt when the files are checked
+		if (m_storage_mode != storage_mode_compact || m_state != state_finished)
+		{
+			m_pending_relocations.clear();
+			m_relocation_queued = false;
+			return 0;
+		}
+
+		while (!m_pending_relocations.empty())
+		{
+			int piece = m_pending_relocations.front();
+			m_pending_relocations.erase(m_pending_relocations.begin());
+
+			int slot = m_piece_to_slot[piece];
+			// the piece may have been moved into place already
+			if (slot == piece || slot < 0) continue;
+			int other_piece = m_slot_to_piece[piece];
+			// allocate_slots() moves it once its slot is allocated
+			if (other_piece == unallocated) continue;
+
+			if (other_piece >= 0)
+			{
+				// swap places with the piece that's in our slot
+				TORRENT_ASSERT(m_piece_to_slot[other_piece] == piece);
+				m_slot_to_piece[piece] = piece;
+				m_slot_to_piece[slot] = other_piece;
+				m_piece_to_slot[piece] = piece;
+				m_piece_to_slot[other_piece] = slot;
+				m_storage->swap_slots(slot, piece);
+			}
+			else
+			{
+				// our slot is free
+				TORRENT_ASSERT(other_piece == unassigned);
+				std::vector<int>::iterator i = std::find(m_free_slots.begin()
+					, m_free_slots.end(), piece);
+				TORRENT_ASSERT(i != m_free_slots.end());
+				m_free_slots.erase(i);
+				m_free_slots.push_back(slot);
+				m_slot_to_piece[piece] = piece;
+				m_slot_to_piece[slot] = unassigned;
+				m_piece_to_slot[piece] = piece;
+				m_storage->move_slot(slot, piece);
+			}
+			// one piece per job. Errors are reported by the disk thread
+			break;
+		}
+
+		if (m_pending_relocations.empty())
+		{
+			m_relocation_queued = false;
+			if (m_free_slots.empty() && m_unallocated_slots.empty())
+				switch_to_full_mode();
+		}
+		return m_pending_relocations.size();
+	}
+
+	int piece_manager::delete_files_impl(int& progress)
+	{
+		if (progress == 0)
+		{
+			boost::recursive_mutex::scoped_lock lock(m_mutex);
+			// there are no pieces left to move once the files are gone
+			m_pending_relocations.clear();
+			if (m_storage_mode == storage_mode_compact && !m_piece_to_slot.empty())
+			{
+				std::fill(m_piece_to_slot.begin(), m_piece_to_slot.end(), int(has_no_slot));
+				std::fill(m_slot_to_piece.begin(), m_slot_to_piece.end(), int(unallocated));
+				m_free_slots.clear();
+				m_unallocated_slots.clear();
+				for (int i = 0; i < m_files.num_pieces(); ++i)
+					m_unallocated_slots.push_back(i);
+			}
+		}
+		return m_storage->delete_files_chunk(progress);
+	}
+
 	int piece_manager::slot_for(int piece) const
 	{
 		if (m_storage_mode != storage_mode_compact) return piece;
@@ -2980,7 +4982,9 @@ ret:
 					TORRENT_ASSERT(m_slot_to_piece[m_piece_to_slot[i]] == i);
 					if (m_piece_to_slot[i] != i)
 					{
-						TORRENT_ASSERT(m_slot_to_piece[i] == unallocated);
+						TORRENT_ASSERT(m_slot_to_piece[i] == unallocated
+							|| std::find(m_pending_relocations.begin()
+							, m_pending_relocations.end(), i) != m_pending_relocations.end());
 					}
 				}
 				else
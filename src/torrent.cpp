@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <set>
 #include <cctype>
 #include <numeric>
+#include <cmath>
 
 #ifdef TORRENT_DEBUG
 #include <iostream>
@@ -77,6 +78,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/broadcast_socket.hpp"
 #include "libtorrent/kademlia/dht_tracker.hpp"
+#include "libtorrent/escape_string.hpp"
 
 #if TORRENT_USE_IOSTREAM
 #include <iostream>
@@ -143,6 +145,9 @@ namespace libtorrent
 		, m_total_uploaded(0)
 		, m_total_downloaded(0)
 		, m_started(time_now())
+		, m_seed_rank_expires(min_time())
+		, m_seed_rank_upload_limit(0)
+		, m_seed_rank(0)
 		, m_last_scrape(min_time())
 		, m_torrent_file(p.ti ? p.ti : new torrent_info(p.info_hash))
 		, m_storage(0)
@@ -162,6 +167,8 @@ namespace libtorrent
 		, m_net_interface(net_interface.address(), 0)
 		, m_save_path(complete(p.save_path))
 		, m_num_verified(0)
+		, m_verify_cursor(0)
+		, m_outstanding_verify(0)
 		, m_storage_mode(p.storage_mode)
 		, m_state(torrent_status::checking_resume_data)
 		, m_settings(ses.settings())
@@ -171,10 +178,17 @@ namespace libtorrent
 		, m_max_uploads((std::numeric_limits<int>::max)())
 		, m_num_uploads(0)
 		, m_max_connections((std::numeric_limits<int>::max)())
+		, m_cache_limit(-1)
+		, m_cache_reservation(0)
+		, m_io_class(normal_io_class)
+		, m_device_id(0)
 		, m_block_size(p.ti ? (std::min)(block_size, m_torrent_file->piece_length()) : block_size)
+		, m_block_math(m_block_size)
 		, m_complete(-1)
 		, m_incomplete(-1)
 		, m_deficit_counter(0)
+		, m_tick_index(-1)
+		, m_in_state_updates(false)
 		, m_sequence_number(seq)
 		, m_last_working_tracker(-1)
 		, m_time_scaler(0)
@@ -186,6 +200,8 @@ namespace libtorrent
 		, m_resolve_countries(false)
 #endif
 		, m_sequential_download(false)
+		, m_need_save_resume_data(true)
+		, m_seed_rank_valid(false)
 		, m_got_tracker_response(false)
 		, m_connections_initialized(p.ti)
 		, m_super_seeding(false)
@@ -196,6 +212,8 @@ namespace libtorrent
 		, m_waiting_tracker(false)
 		, m_seed_mode(p.seed_mode && m_torrent_file->is_valid())
 		, m_override_resume_data(p.override_resume_data)
+		, m_write_throttled(false)
+		, m_share_mode(p.share_mode)
 	{
 		if (m_seed_mode)
 			m_verified.resize(m_torrent_file->num_pieces(), false);
@@ -256,7 +274,10 @@ namespace libtorrent
 		}
 
 		// we need to start announcing since we don't have any
-		// metadata. To receive peers to ask for it.
+		// metadata. To receive peers to ask for it. This is done
+		// even without trackers, the DHT and local peer discovery
+		// are started together with the trackers and may be the
+		// only source of peers for a magnet link
 		if (m_torrent_file->is_valid())
 		{
 			init();
@@ -264,7 +285,7 @@ namespace libtorrent
 		else
 		{
 			set_state(torrent_status::downloading_metadata);
-			if (!m_trackers.empty()) start_announcing();
+			start_announcing();
 		}
 	}
 
@@ -280,6 +301,11 @@ namespace libtorrent
 		if (m_torrent_file->is_valid() && m_torrent_file->priv()) return false;
 		if (m_trackers.empty()) return true;
 
+		// while downloading the metadata, the DHT is used alongside
+		// the trackers rather than as a fallback. Whichever answers
+		// first provides the peers to ask for the metadata
+		if (!m_torrent_file->is_valid()) return true;
+
 		int verified_trackers = 0;
 		for (std::vector<announce_entry>::const_iterator i = m_trackers.begin()
 			, end(m_trackers.end()); i != end; ++i)
@@ -321,7 +347,7 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(piece >= 0 && piece < m_torrent_file->num_pieces());
 		int piece_size = m_torrent_file->piece_size(piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
 		read_piece_struct* rp = new read_piece_struct;
 		rp->piece_data.reset(new (std::nothrow) char[piece_size]);
@@ -344,7 +370,7 @@ namespace libtorrent
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
-		disk_buffer_holder buffer(m_ses, j.buffer);
+		disk_buffer_holder buffer(m_ses, j);
 
 		--rp->blocks_left;
 		if (ret != r.length)
@@ -376,11 +402,149 @@ namespace libtorrent
 		}
 	}
 
+	void torrent::read_range(size_type offset, int size, int deadline)
+	{
+		if (!valid_metadata() || offset < 0 || size <= 0
+			|| offset + size > m_torrent_file->total_size())
+		{
+			if (m_ses.m_alerts.should_post<read_range_alert>())
+			{
+				m_ses.m_alerts.post_alert(read_range_alert(get_handle(), offset, 0
+					, boost::shared_ptr<disk_buffer_holder>(), 0
+					, error_code(errors::invalid_range, libtorrent_category)));
+			}
+			return;
+		}
+
+		int piece_length = m_torrent_file->piece_length();
+		int piece = int(offset / piece_length);
+		int start = int(offset - size_type(piece) * piece_length);
+		ptime deadline_time = time_now() + milliseconds(deadline);
+		while (size > 0)
+		{
+			int piece_size = (std::min)(m_torrent_file->piece_size(piece) - start, size);
+			if (is_seed() || m_picker->have_piece(piece))
+			{
+				read_piece_range(piece, start, piece_size);
+			}
+			else
+			{
+				pending_range_read rr;
+				rr.piece = piece;
+				rr.start = start;
+				rr.size = piece_size;
+				m_pending_range_reads.push_back(rr);
+
+				// pieces that already are time critical keep their
+				// flags, and an earlier deadline
+				std::list<time_critical_piece>::iterator i = m_time_critical_pieces.begin();
+				for (; i != m_time_critical_pieces.end(); ++i)
+					if (i->piece == piece) break;
+				if (i == m_time_critical_pieces.end())
+					set_piece_deadline(piece, milliseconds(deadline), 0);
+				else if (i->deadline > deadline_time)
+					set_piece_deadline(piece, milliseconds(deadline), i->flags);
+			}
+			size -= piece_size;
+			start = 0;
+			++piece;
+		}
+	}
+
+	void torrent::read_piece_range(int piece, int start, int size)
+	{
+		TORRENT_ASSERT(piece >= 0 && piece < m_torrent_file->num_pieces());
+		int piece_size = m_torrent_file->piece_size(piece);
+		int end = start + size;
+		TORRENT_ASSERT(end <= piece_size);
+
+		// whole blocks are read, even if the range starts or ends
+		// in the middle of one, since block aligned reads are handed
+		// out by reference to the read cache instead of copied
+		peer_request r;
+		r.piece = piece;
+		for (r.start = m_block_math.start(m_block_math.index(start));
+			r.start < end; r.start += m_block_size)
+		{
+			r.length = (std::min)(piece_size - r.start, m_block_size);
+			int skip = (std::max)(start - r.start, 0);
+			int chunk = (std::min)(r.start + r.length, end) - r.start - skip;
+			filesystem().async_read(r, bind(&torrent::on_range_read_complete
+				, shared_from_this(), _1, _2, r, skip, chunk));
+		}
+	}
+
+	void torrent::on_range_read_complete(int ret, disk_io_job const& j
+		, peer_request r, int skip, int size)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		// the alert (and every copy of it) shares the buffer
+		boost::shared_ptr<disk_buffer_holder> buffer(
+			new disk_buffer_holder(m_ses, j));
+
+		error_code ec;
+		if (ret != r.length)
+		{
+			if (j.error == error_code(errors::piece_evicted, libtorrent_category))
+			{
+				// the storage dropped the piece. Download it again, and
+				// serve this chunk once it has passed the hash check
+				piece_evicted(r.piece);
+				if (m_picker && m_picker->have_piece(r.piece))
+				{
+					read_piece_range(r.piece, r.start + skip, size);
+					return;
+				}
+				pending_range_read rr;
+				rr.piece = r.piece;
+				rr.start = r.start + skip;
+				rr.size = size;
+				m_pending_range_reads.push_back(rr);
+				set_piece_deadline(r.piece, seconds(0), 0);
+				return;
+			}
+
+			ec = j.error;
+			if (!ec) ec = error_code(errors::file_too_short, libtorrent_category);
+			buffer.reset();
+			if (!m_abort)
+			{
+				set_error(j.error, j.error_file);
+				pause();
+			}
+		}
+
+		if (m_ses.m_alerts.should_post<read_range_alert>())
+		{
+			size_type offset = size_type(r.piece) * m_torrent_file->piece_length()
+				+ r.start + skip;
+			m_ses.m_alerts.post_alert(read_range_alert(get_handle(), offset
+				, size, buffer, skip, ec));
+		}
+	}
+
+	void torrent::service_range_reads(int piece)
+	{
+		for (std::list<pending_range_read>::iterator i = m_pending_range_reads.begin();
+			i != m_pending_range_reads.end();)
+		{
+			if (piece >= 0 ? i->piece != piece
+				: !is_seed() && !m_picker->have_piece(i->piece))
+			{
+				++i;
+				continue;
+			}
+			read_piece_range(i->piece, i->start, i->size);
+			i = m_pending_range_reads.erase(i);
+		}
+	}
+
 	void torrent::add_piece(int piece, char const* data, int flags)
 	{
 		TORRENT_ASSERT(piece >= 0 && piece < m_torrent_file->num_pieces());
 		int piece_size = m_torrent_file->piece_size(piece);
-		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+		int blocks_in_piece = m_block_math.count(piece_size);
 
 		peer_request p;
 		p.piece = piece;
@@ -420,11 +584,11 @@ namespace libtorrent
 	
 		if (m_abort)
 		{
-			piece_block block_finished(p.piece, p.start / m_block_size);
+			piece_block block_finished(p.piece, m_block_math.index(p.start));
 			return;
 		}
 
-		piece_block block_finished(p.piece, p.start / m_block_size);
+		piece_block block_finished(p.piece, m_block_math.index(p.start));
 
 		if (ret == -1)
 		{
@@ -445,7 +609,7 @@ namespace libtorrent
 		}
 	}
 
-	bool torrent::add_merkle_nodes(std::map<int, sha1_hash> const& nodes, int piece)
+	bool torrent::add_merkle_nodes(merkle_node_list const& nodes, int piece)
 	{
 		return m_torrent_file->add_merkle_nodes(nodes, piece);
 	}
@@ -477,6 +641,7 @@ namespace libtorrent
 	void torrent::add_extension(boost::shared_ptr<torrent_plugin> ext)
 	{
 		m_extensions.push_back(ext);
+		m_hooks.update(m_extensions.begin(), m_extensions.end());
 	}
 
 	void torrent::add_extension(boost::function<boost::shared_ptr<torrent_plugin>(torrent*, void*)> const& ext
@@ -514,6 +679,20 @@ namespace libtorrent
 		m_file_priority.resize(m_torrent_file->num_files(), 1);
 
 		m_block_size = (std::min)(m_block_size, m_torrent_file->piece_length());
+		m_block_math.set_size(m_block_size);
+
+		// this has to happen before the storage is created, while no
+		// disk thread can be looking up piece hashes. If it fails, the
+		// hashes just stay in memory
+		if (!m_ses.settings().piece_hash_path.empty()
+			&& !m_torrent_file->is_merkle_torrent())
+		{
+			error_code ec;
+			m_torrent_file->page_out_piece_hashes(
+				fs::path(m_ses.settings().piece_hash_path)
+				/ (to_hex(m_torrent_file->info_hash().to_string()) + ".hashes")
+				, m_ses.settings().piece_hash_cache_pages, ec);
+		}
 
 		if (m_torrent_file->num_pieces() > piece_picker::max_pieces)
 		{
@@ -527,6 +706,11 @@ namespace libtorrent
 			, m_save_path, m_ses.m_files, m_ses.m_disk_thread, m_storage_constructor
 			, m_storage_mode);
 		m_storage = m_owning_storage.get();
+		if (m_cache_limit >= 0 || m_cache_reservation > 0)
+			m_ses.m_disk_thread.set_cache_limits(m_storage, m_cache_limit, m_cache_reservation);
+		if (m_io_class != normal_io_class)
+			m_ses.m_disk_thread.set_io_class(m_storage, m_io_class);
+		m_device_id = libtorrent::device_id(m_save_path);
 
 		if (has_picker())
 		{
@@ -546,6 +730,26 @@ namespace libtorrent
 
 		if (m_seed_mode)
 		{
+			// pick up the pieces verified in an earlier session,
+			// to not hash them again
+			if (!m_resume_data.empty()
+				&& lazy_bdecode(&m_resume_data[0], &m_resume_data[0]
+					+ m_resume_data.size(), m_resume_entry) == 0
+				&& m_resume_entry.type() == lazy_entry::dict_t)
+			{
+				lazy_entry const* pieces = m_resume_entry.dict_find("pieces");
+				if (pieces && pieces->type() == lazy_entry::string_t
+					&& int(pieces->string_length()) == m_torrent_file->num_pieces())
+				{
+					char const* pieces_str = pieces->string_ptr();
+					for (int i = 0, end(pieces->string_length()); i < end; ++i)
+					{
+						if ((pieces_str[i] & 2) && !m_verified.get_bit(i))
+							verified(i);
+					}
+				}
+			}
+
 			m_ses.m_io_service.post(boost::bind(&torrent::files_checked_lock, shared_from_this()));
 			std::vector<char>().swap(m_resume_data);
 			lazy_entry().swap(m_resume_entry);
@@ -758,7 +962,8 @@ namespace libtorrent
 					for (int i = 0, end(pieces->string_length()); i < end; ++i)
 					{
 						if (pieces_str[i] & 1) m_picker->we_have(i);
-						if (m_seed_mode && (pieces_str[i] & 2)) m_verified.set_bit(i);
+						if (m_seed_mode && (pieces_str[i] & 2) && !m_verified.get_bit(i))
+							verified(i);
 					}
 				}
 
@@ -766,39 +971,41 @@ namespace libtorrent
 				int num_blocks_per_piece =
 					static_cast<int>(torrent_file().piece_length()) / block_size();
 
-				if (lazy_entry const* unfinished_ent = m_resume_entry.dict_find_list("unfinished"))
+				const int num_bitmask_bytes = (std::max)(num_blocks_per_piece / 8, 1);
+				lazy_entry const* unfinished_ent = m_resume_entry.dict_find("unfinished");
+				if (unfinished_ent && unfinished_ent->type() == lazy_entry::string_t)
+				{
+					// packed format, a 32 bit piece index followed by
+					// the bitmask of finished blocks for each piece
+					char const* p = unfinished_ent->string_ptr();
+					int num_unfinished = unfinished_ent->string_length()
+						/ (4 + num_bitmask_bytes);
+					for (int i = 0; i < num_unfinished; ++i)
+					{
+						int piece = detail::read_int32(p);
+						char const* bitmask = p;
+						p += num_bitmask_bytes;
+						if (piece < 0 || piece >= torrent_file().num_pieces()) continue;
+						resume_unfinished_piece(piece, bitmask, num_bitmask_bytes);
+					}
+				}
+				else if (unfinished_ent && unfinished_ent->type() == lazy_entry::list_t)
 				{
 					for (int i = 0; i < unfinished_ent->list_size(); ++i)
 					{
 						lazy_entry const* e = unfinished_ent->list_at(i);
 						if (e->type() != lazy_entry::dict_t) continue;
 						int piece = e->dict_find_int_value("piece", -1);
-						if (piece < 0 || piece > torrent_file().num_pieces()) continue;
-
-						if (m_picker->have_piece(piece))
-							m_picker->we_dont_have(piece);
-
-						std::string bitmask = e->dict_find_string_value("bitmask");
-						if (bitmask.empty()) continue;
+						if (piece < 0 || piece >= torrent_file().num_pieces()) continue;
 
-						const int num_bitmask_bytes = (std::max)(num_blocks_per_piece / 8, 1);
-						if ((int)bitmask.size() != num_bitmask_bytes) continue;
-						for (int j = 0; j < num_bitmask_bytes; ++j)
+						lazy_entry const* bitmask = e->dict_find_string("bitmask");
+						if (bitmask == 0 || bitmask->string_length() != num_bitmask_bytes)
 						{
-							unsigned char bits = bitmask[j];
-							int num_bits = (std::min)(num_blocks_per_piece - j*8, 8);
-							for (int k = 0; k < num_bits; ++k)
-							{
-								const int bit = j * 8 + k;
-								if (bits & (1 << k))
-								{
-									m_picker->mark_as_finished(piece_block(piece, bit), 0);
-									if (m_picker->is_piece_finished(piece))
-										async_verify_piece(piece, bind(&torrent::piece_finished
-											, shared_from_this(), piece, _1));
-								}
-							}
+							if (m_picker->have_piece(piece))
+								m_picker->we_dont_have(piece);
+							continue;
 						}
+						resume_unfinished_piece(piece, bitmask->string_ptr(), num_bitmask_bytes);
 					}
 				}
 			}
@@ -1016,21 +1223,51 @@ namespace libtorrent
 
 		// announce with the local discovery service
 		m_ses.announce_lsd(m_torrent_file->info_hash());
+	}
 
 #ifndef TORRENT_DISABLE_DHT
-		if (!m_ses.m_dht) return;
+
+	bool torrent::dht_announce()
+	{
+		if (!m_ses.m_dht) return false;
+		if (m_abort || !m_announcing || is_paused()) return false;
+		if (!should_announce_dht()) return false;
+
+		// the session visits every torrent about once every
+		// 14 minutes. This only protects against announcing
+		// twice in a row when a torrent was prioritized. Torrents
+		// downloading metadata are re-announced every minute
+		// while they don't have any peers
 		ptime now = time_now();
-		if (should_announce_dht() && now - m_last_dht_announce > minutes(14))
-		{
-			m_last_dht_announce = now;
-			m_ses.m_dht->announce(m_torrent_file->info_hash()
-				, m_ses.listen_port()
-				, bind(&torrent::on_dht_announce_response_disp, self, _1));
-		}
-#endif
+		if (now - m_last_dht_announce < minutes(valid_metadata() ? 5 : 1)) return false;
+
+		m_last_dht_announce = now;
+		boost::weak_ptr<torrent> self(shared_from_this());
+		m_ses.m_dht->announce(m_torrent_file->info_hash()
+			, m_ses.listen_port(), is_seed()
+			, bind(&torrent::on_dht_announce_response_disp, self, _1)
+			, bind(&torrent::on_dht_scrape_disp, self, _1, _2));
+		return true;
 	}
 
-#ifndef TORRENT_DISABLE_DHT
+	void torrent::on_dht_scrape_disp(boost::weak_ptr<libtorrent::torrent> t
+		, int seeds, int downloaders)
+	{
+		boost::shared_ptr<libtorrent::torrent> tor = t.lock();
+		if (!tor) return;
+		tor->on_dht_scrape(seeds, downloaders);
+	}
+
+	void torrent::on_dht_scrape(int seeds, int downloaders)
+	{
+		// a tracker's scrape is exact, the DHT's is an estimate.
+		// Only use it for torrents that don't have a working tracker
+		if (m_last_working_tracker >= 0) return;
+		m_complete = seeds;
+		m_incomplete = downloaders;
+		m_last_scrape = time_now();
+		invalidate_seed_rank();
+	}
 
 	void torrent::on_dht_announce_response_disp(boost::weak_ptr<libtorrent::torrent> t
 		, std::vector<tcp::endpoint> const& peers)
@@ -1049,9 +1286,12 @@ namespace libtorrent
 			m_ses.m_alerts.post_alert(dht_reply_alert(
 				get_handle(), peers.size()));
 		}
-		std::for_each(peers.begin(), peers.end(), bind(
-			&policy::add_peer, boost::ref(m_policy), _1, peer_id(0)
-			, peer_info::dht, 0));
+		std::vector<policy::peer_entry_t> batch;
+		batch.reserve(peers.size());
+		for (std::vector<tcp::endpoint>::const_iterator i = peers.begin()
+			, end(peers.end()); i != end; ++i)
+			batch.push_back(policy::peer_entry_t(*i, 0));
+		m_policy.add_peers(batch, peer_info::dht);
 	}
 
 #endif
@@ -1178,6 +1418,7 @@ namespace libtorrent
  
  		if (complete >= 0) m_complete = complete;
  		if (incomplete >= 0) m_incomplete = incomplete;
+		invalidate_seed_rank();
  
  		if (m_ses.m_alerts.should_post<scrape_reply_alert>())
  		{
@@ -1229,6 +1470,7 @@ namespace libtorrent
 		if (incomplete >= 0) m_incomplete = incomplete;
 		if (complete >= 0 && incomplete >= 0)
 			m_last_scrape = now;
+		invalidate_seed_rank();
 
 #if (defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING) && TORRENT_USE_IOSTREAM
 		std::stringstream s;
@@ -1250,6 +1492,11 @@ namespace libtorrent
 		s << "we connected to: " << tracker_ip << "\n";
 		debug_log(s.str());
 #endif
+		// the peers with ip addresses are added to the
+		// peer list in one batch
+		std::vector<policy::peer_entry_t> batch;
+		batch.reserve(peer_list.size());
+
 		// for each of the peers we got from the tracker
 		for (std::vector<peer_entry>::iterator i = peer_list.begin();
 			i != peer_list.end(); ++i)
@@ -1274,9 +1521,10 @@ namespace libtorrent
 			{
 				// ignore local addresses from the tracker (unless the tracker is local too)
 				if (is_local(a.address()) && !is_local(tracker_ip)) continue;
-				m_policy.add_peer(a, i->pid, peer_info::tracker, 0);
+				batch.push_back(policy::peer_entry_t(a, 0));
 			}
 		}
+		m_policy.add_peers(batch, peer_info::tracker);
 
 		if (m_ses.m_alerts.should_post<tracker_reply_alert>())
 		{
@@ -1507,7 +1755,7 @@ namespace libtorrent
 		const std::vector<piece_picker::downloading_piece>& dl_queue
 			= m_picker->get_download_queue();
 
-		const int blocks_per_piece = (piece_size + m_block_size - 1) / m_block_size;
+		const int blocks_per_piece = m_block_math.count(piece_size);
 
 		// look at all unfinished pieces and add the completed
 		// blocks to our 'done' counter
@@ -1654,6 +1902,9 @@ namespace libtorrent
 
 		TORRENT_ASSERT(valid_metadata());
 
+		m_ses.m_trace.instant("piece", "piece hashed", 0
+			, "piece", index, "result", passed_hash_check);
+
 		if (passed_hash_check == 0)
 		{
 			// the following call may cause picker to become invalid
@@ -1676,6 +1927,165 @@ namespace libtorrent
 		}
 	}
 
+	void torrent::piece_evicted(int index)
+	{
+		TORRENT_ASSERT(valid_metadata());
+		TORRENT_ASSERT(index >= 0 && index < m_torrent_file->num_pieces());
+
+		bool was_finished = is_finished();
+		if (!m_picker)
+		{
+			// we're a seed, so we have every piece. Seeds don't
+			// count the pieces peers have, so that's done here
+			m_picker.reset(new piece_picker());
+			m_picker->init(m_torrent_file->piece_length() / m_block_size
+				, int((m_torrent_file->total_size()+m_block_size-1)/m_block_size));
+			for (int i = 0, end(m_torrent_file->num_pieces()); i < end; ++i)
+				m_picker->we_have(i);
+			for (const_peer_iterator i = begin(); i != end(); ++i)
+			{
+				bitfield const& bits = (*i)->get_bitfield();
+				if (int(bits.size()) == m_torrent_file->num_pieces())
+					m_picker->inc_refcount(bits);
+			}
+		}
+		if (!m_picker->have_piece(index)) return;
+
+		// the peers can't be sent the piece anymore
+		for (peer_iterator i = begin(); i != end(); ++i)
+			(*i)->reject_piece(index);
+
+		m_picker->we_dont_have(index);
+		m_need_save_resume_data = true;
+		if (m_state == torrent_status::seeding)
+			set_state(torrent_status::finished);
+		update_peer_interest(was_finished);
+	}
+
+	void torrent::discard_piece(int index)
+	{
+		TORRENT_ASSERT(m_picker);
+		TORRENT_ASSERT(m_picker->have_piece(index));
+		set_piece_priority(index, 0);
+		piece_evicted(index);
+		if (m_owning_storage) m_owning_storage->async_discard_piece(index);
+	}
+
+	void torrent::set_share_mode(bool s)
+	{
+		if (s == m_share_mode) return;
+		m_share_mode = s;
+		m_need_save_resume_data = true;
+		state_updated();
+
+		// the priorities are set when the files are checked
+		if (!m_files_checked || is_seed()) return;
+
+		// entering share mode drops what we're downloading, leaving
+		// it downloads everything
+		prioritize_piece_range(0, std::vector<int>(
+			m_torrent_file->num_pieces(), s ? 0 : 1));
+		if (s) recalc_share_mode();
+	}
+
+	void torrent::recalc_share_mode()
+	{
+		TORRENT_ASSERT(m_share_mode);
+		if (is_seed() || !m_picker || !m_files_checked || is_paused()) return;
+
+		int num_pieces = m_torrent_file->num_pieces();
+		int piece_length = m_torrent_file->piece_length();
+
+		// the number of pieces we may have, counting the ones
+		// being downloaded
+		int budget = int((size_type(settings().share_mode_size) * 1024 * 1024
+			+ piece_length - 1) / piece_length);
+		if (budget < 1) budget = 1;
+
+		// the peers that are downloading are the ones that may want
+		// our pieces. The seeds are only counted to tell how many
+		// downloaders have each piece
+		int num_downloaders = 0;
+		int num_seeds = 0;
+		for (const_peer_iterator i = begin(); i != end(); ++i)
+		{
+			peer_connection const* p = *i;
+			if (p->is_connecting() || p->is_disconnecting()) continue;
+			if (p->is_seed()) ++num_seeds;
+			else ++num_downloaders;
+		}
+		if (num_downloaders == 0) return;
+
+		std::vector<int> avail;
+		m_picker->get_availability(avail);
+
+		int num_wanted = 0;
+		// the rarest pieces we could download
+		std::vector<int> candidates;
+		int best_avail = (std::numeric_limits<int>::max)();
+		// the piece we have that's the least worth keeping
+		int worst_have = -1;
+		int worst_avail = -1;
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			// the number of downloaders that don't have the piece
+			int demand = num_downloaders - (avail[i] - num_seeds);
+			if (m_picker->have_piece(i))
+			{
+				// a piece no downloader lacks is worth nothing
+				int value = demand <= 0 ? (std::numeric_limits<int>::max)() : avail[i];
+				if (value > worst_avail)
+				{
+					worst_avail = value;
+					worst_have = i;
+				}
+				continue;
+			}
+			if (m_picker->piece_priority(i) > 0)
+			{
+				++num_wanted;
+				continue;
+			}
+			// there has to be a peer to download it from, and one
+			// to upload it to
+			if (avail[i] == 0 || demand <= 0) continue;
+			if (avail[i] < best_avail)
+			{
+				best_avail = avail[i];
+				candidates.clear();
+			}
+			if (avail[i] == best_avail) candidates.push_back(i);
+		}
+
+		// only a couple of pieces are downloaded at a time, the
+		// rarest pieces are likely to have changed by the time
+		// they're done
+		if (num_wanted >= 2 || candidates.empty()) return;
+
+		if (m_picker->num_have() + num_wanted >= budget)
+		{
+			// we're full. Only make room if the piece we'd drop is
+			// much less rare than the one we'd get, to not keep
+			// swapping pieces back and forth
+			if (worst_have < 0 || worst_avail <= best_avail * 2) return;
+			discard_piece(worst_have);
+		}
+
+		// pick one of the rarest at random, so that share mode
+		// peers in the same swarm don't all pick the same one
+		set_piece_priority(candidates[rand() % candidates.size()], 1);
+	}
+
+	void torrent::update_evicted_pieces()
+	{
+		if (!m_owning_storage || !valid_metadata()) return;
+		std::vector<int> pieces;
+		m_owning_storage->dropped_pieces(pieces);
+		for (std::vector<int>::iterator i = pieces.begin()
+			, end(pieces.end()); i != end; ++i)
+			piece_evicted(*i);
+	}
+
 	void torrent::update_sparse_piece_prio(int i, int start, int end)
 	{
 		TORRENT_ASSERT(m_picker);
@@ -1693,6 +2103,7 @@ namespace libtorrent
 	{
 //		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(index >= 0);
 		TORRENT_ASSERT(index < m_torrent_file->num_pieces());
 
@@ -1703,6 +2114,7 @@ namespace libtorrent
 		}
 
 		remove_time_critical_piece(index, true);
+		service_range_reads(index);
 
 		bool was_finished = m_picker->num_filtered() + num_have()
 			== torrent_file().num_pieces();
@@ -1750,13 +2162,13 @@ namespace libtorrent
 		}
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::piece_pass_hook)
+			, end(m_hooks.end(torrent_plugin::piece_pass_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				(*i)->on_piece_pass(index);
+				m_hooks[k]->on_piece_pass(index);
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -1836,13 +2248,13 @@ namespace libtorrent
 #endif
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::piece_failed_hook)
+			, end(m_hooks.end(torrent_plugin::piece_failed_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				(*i)->on_piece_failed(index);
+				m_hooks[k]->on_piece_failed(index);
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -1980,6 +2392,19 @@ namespace libtorrent
 		if (m_state == torrent_status::checking_files)
 			set_state(torrent_status::queued_for_checking);
 
+		if (m_ses.m_alerts.should_post<read_range_alert>())
+		{
+			for (std::list<pending_range_read>::iterator i = m_pending_range_reads.begin()
+				, end(m_pending_range_reads.end()); i != end; ++i)
+			{
+				m_ses.m_alerts.post_alert(read_range_alert(get_handle()
+					, size_type(i->piece) * m_torrent_file->piece_length() + i->start
+					, i->size, boost::shared_ptr<disk_buffer_holder>(), 0
+					, error_code(asio::error::operation_aborted)));
+			}
+		}
+		m_pending_range_reads.clear();
+
 		m_owning_storage = 0;
 		m_host_resolver.cancel();
 	}
@@ -1987,6 +2412,7 @@ namespace libtorrent
 	void torrent::super_seeding(bool on)
 	{
 		if (on == m_super_seeding) return;
+		m_need_save_resume_data = true;
 
 		// don't turn on super seeding if we're not a seed
 		TORRENT_ASSERT(!on || is_seed() || !m_files_checked);
@@ -2000,6 +2426,28 @@ namespace libtorrent
 		{
 			(*i)->superseed_piece(-1);
 		}
+		std::vector<boost::uint16_t>().swap(m_superseed_avail);
+		std::vector<boost::uint16_t>().swap(m_superseed_assigned);
+	}
+
+	void torrent::init_superseed_state()
+	{
+		int num_pieces = m_torrent_file->num_pieces();
+		m_superseed_avail.assign(num_pieces, 0);
+		m_superseed_assigned.assign(num_pieces, 0);
+		for (const_peer_iterator i = begin(); i != end(); ++i)
+		{
+			peer_connection const& p = **i;
+			bitfield const& bits = p.get_bitfield();
+			if (int(bits.size()) == num_pieces)
+			{
+				for (int k = bits.find_first_set(0); k >= 0
+					; k = bits.find_first_set(k + 1))
+					++m_superseed_avail[k];
+			}
+			if (p.superseed_piece() >= 0)
+				++m_superseed_assigned[p.superseed_piece()];
+		}
 	}
 
 	int torrent::get_piece_to_super_seed(bitfield const& bits)
@@ -2008,27 +2456,23 @@ namespace libtorrent
 		// the bitfield and that is not currently being super
 		// seeded by any peer
 		TORRENT_ASSERT(m_super_seeding);
-		
-		// do a linear search from the first piece
+
+		// while we still have a piece picker, the counters aren't
+		// kept up to date, so they're rebuilt for every pick
+		if (m_superseed_avail.empty() || m_picker)
+			init_superseed_state();
+
 		int min_availability = 9999;
 		std::vector<int> avail_vec;
 		for (int i = 0; i < m_torrent_file->num_pieces(); ++i)
 		{
 			if (bits[i]) continue;
 
-			int availability = 0;
-			for (const_peer_iterator j = begin(); j != end(); ++j)
-			{
-				if ((*j)->superseed_piece() == i)
-				{
-					// avoid superseeding the same piece to more than one
-					// peer if we can avoid it. Do this by artificially
-					// increase the availability
-					availability = 999;
-					break;
-				}
-				if ((*j)->has_piece(i)) ++availability;
-			}
+			// avoid superseeding the same piece to more than one
+			// peer if we can avoid it. Do this by artificially
+			// increase the availability
+			int availability = m_superseed_assigned[i] > 0
+				? 999 : m_superseed_avail[i];
 			if (availability > min_availability) continue;
 			if (availability == min_availability)
 			{
@@ -2104,6 +2548,7 @@ namespace libtorrent
 		
 		if (ret == 0)
 		{
+			m_need_save_resume_data = true;
 			if (alerts().should_post<file_renamed_alert>())
 				alerts().post_alert(file_renamed_alert(get_handle(), j.str, j.piece));
 			m_torrent_file->rename_file(j.piece, j.str);
@@ -2116,11 +2561,11 @@ namespace libtorrent
 		}
 	}
 
-	void torrent::on_torrent_paused(int ret, disk_io_job const& j)
+	void torrent::on_torrent_paused(int ret, disk_io_job const& j, bool post_alert)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
-		if (alerts().should_post<torrent_paused_alert>())
+		if (post_alert && alerts().should_post<torrent_paused_alert>())
 			alerts().post_alert(torrent_paused_alert(get_handle()));
 	}
 
@@ -2156,7 +2601,7 @@ namespace libtorrent
 			}
 			while (i != m_time_critical_pieces.begin() && i->deadline < boost::prior(i)->deadline)
 			{
-				std::iter_swap(i, boost::next(i));
+				std::iter_swap(i, boost::prior(i));
 				--i;
 			}
 			return;
@@ -2210,12 +2655,13 @@ namespace libtorrent
 	}
 
 	// remove time critical pieces where priority is 0
-	void torrent::remove_time_critical_pieces(std::vector<int> const& priority)
+	void torrent::remove_time_critical_pieces(int first, std::vector<int> const& priority)
 	{
 		for (std::list<time_critical_piece>::iterator i = m_time_critical_pieces.begin();
 			i != m_time_critical_pieces.end();)
 		{
-			if (priority[i->piece] == 0)
+			if (i->piece >= first && i->piece < first + int(priority.size())
+				&& priority[i->piece - first] == 0)
 			{
 				i = m_time_critical_pieces.erase(i);
 				continue;
@@ -2238,10 +2684,22 @@ namespace libtorrent
 		m_picker->get_availability(avail);
 	}
 
+	void torrent::get_io_stats(torrent_io_stats& st, int flags) const
+	{
+		if (!m_owning_storage)
+		{
+			st = torrent_io_stats();
+			return;
+		}
+		m_owning_storage->get_io_stats(st
+			, (flags & torrent_handle::query_file_reads) != 0);
+	}
+
 	void torrent::set_piece_priority(int index, int priority)
 	{
 //		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(valid_metadata());
 		if (is_seed()) return;
 
@@ -2280,27 +2738,27 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		// this call is only valid on torrents with metadata
 		TORRENT_ASSERT(valid_metadata());
 		if (is_seed()) return;
 
+		prioritize_piece_range(0, pieces);
+	}
+
+	void torrent::prioritize_piece_range(int first, std::vector<int> const& pieces)
+	{
+		if (is_seed()) return;
+
 		TORRENT_ASSERT(m_picker.get());
 
-		int index = 0;
-		bool filter_updated = false;
 		bool was_finished = is_finished();
-		for (std::vector<int>::const_iterator i = pieces.begin()
-			, end(pieces.end()); i != end; ++i, ++index)
-		{
-			TORRENT_ASSERT(*i >= 0);
-			TORRENT_ASSERT(*i <= 7);
-			filter_updated |= m_picker->set_piece_priority(index, *i);
-			TORRENT_ASSERT(num_have() >= m_picker->num_have_filtered());
-		}
+		bool filter_updated = m_picker->set_piece_priorities(first, pieces);
+		TORRENT_ASSERT(num_have() >= m_picker->num_have_filtered());
 		if (filter_updated)
 		{
 			update_peer_interest(was_finished);
-			remove_time_critical_pieces(pieces);
+			remove_time_critical_pieces(first, pieces);
 		}
 	}
 
@@ -2333,6 +2791,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		// this call is only valid on torrents with metadata
 		if (!valid_metadata() || is_seed()) return;
 
@@ -2342,18 +2801,31 @@ namespace libtorrent
 		
 		if (m_torrent_file->num_pieces() == 0) return;
 
+		// only the pieces of the files that changed need updating
+		int first_file = -1;
+		int last_file = -1;
+		for (int i = 0; i < int(files.size()); ++i)
+		{
+			if (m_file_priority[i] == files[i]) continue;
+			if (first_file == -1) first_file = i;
+			last_file = i;
+		}
+		if (first_file == -1) return;
+
 		std::copy(files.begin(), files.end(), m_file_priority.begin());
-		update_piece_priorities();
+		update_piece_priorities(first_file, last_file);
 	}
 
 	void torrent::set_file_priority(int index, int prio)
 	{
 		INVARIANT_CHECK;
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(index < m_torrent_file->num_files());
 		TORRENT_ASSERT(index >= 0);
 		if (m_file_priority[index] == prio) return;
 		m_file_priority[index] = prio;
-		update_piece_priorities();
+		if (!valid_metadata() || is_seed()) return;
+		update_piece_priorities(index, index);
 	}
 	
 	int torrent::file_priority(int index) const
@@ -2376,32 +2848,58 @@ namespace libtorrent
 
 		if (m_torrent_file->num_pieces() == 0) return;
 
-		size_type position = 0;
+		update_piece_priorities(0, int(m_file_priority.size()) - 1);
+	}
+
+	void torrent::update_piece_priorities(int first_file, int last_file)
+	{
+		if (m_torrent_file->num_pieces() == 0) return;
+
+		file_storage const& fs = m_torrent_file->files();
 		int piece_length = m_torrent_file->piece_length();
+		TORRENT_ASSERT(first_file >= 0);
+		TORRENT_ASSERT(last_file < fs.num_files());
+		TORRENT_ASSERT(first_file <= last_file);
+
+		size_type start = fs.at(first_file).offset;
+		size_type end = fs.at(last_file).offset + fs.at(last_file).size;
+		// the files are all empty, they don't have any pieces
+		if (start == end) return;
+		int first_piece = int(start / piece_length);
+		int last_piece = int((end - 1) / piece_length);
+		TORRENT_ASSERT(last_piece < m_torrent_file->num_pieces());
+
+		// the pieces at either end of the range may be shared with
+		// files outside of it. Their priorities depend on those too
+		size_type range_start = size_type(first_piece) * piece_length;
+		size_type range_end = size_type(last_piece + 1) * piece_length;
+		int file = first_file;
+		while (file > 0 && fs.at(file - 1).offset + fs.at(file - 1).size > range_start)
+			--file;
+
 		// initialize the piece priorities to 0, then only allow
 		// setting higher priorities
-		std::vector<int> pieces(m_torrent_file->num_pieces(), 0);
-		for (int i = 0; i < int(m_file_priority.size()); ++i)
+		std::vector<int> pieces(last_piece - first_piece + 1, 0);
+		for (; file < fs.num_files(); ++file)
 		{
-			size_type start = position;
-			size_type size = m_torrent_file->files().at(i).size;
-			if (size == 0) continue;
-			position += size;
-			if (m_file_priority[i] == 0) continue;
+			file_entry const& fe = fs.at(file);
+			if (fe.offset >= range_end) break;
+			if (fe.size == 0) continue;
+			if (m_file_priority[file] == 0) continue;
 
 			// mark all pieces of the file with this file's priority
 			// but only if the priority is higher than the pieces
 			// already set (to avoid problems with overlapping pieces)
-			int start_piece = int(start / piece_length);
-			int last_piece = int((position - 1) / piece_length);
-			TORRENT_ASSERT(last_piece < int(pieces.size()));
+			int start_piece = (std::max)(int(fe.offset / piece_length), first_piece);
+			int end_piece = (std::min)(int((fe.offset + fe.size - 1) / piece_length)
+				, last_piece);
 			// if one piece spans several files, we might
 			// come here several times with the same start_piece, end_piece
-			std::for_each(pieces.begin() + start_piece
-				, pieces.begin() + last_piece + 1
-				, bind(&set_if_greater, _1, m_file_priority[i]));
+			std::for_each(pieces.begin() + (start_piece - first_piece)
+				, pieces.begin() + (end_piece - first_piece) + 1
+				, bind(&set_if_greater, _1, m_file_priority[file]));
 		}
-		prioritize_pieces(pieces);
+		prioritize_piece_range(first_piece, pieces);
 	}
 
 	// this is called when piece priorities have been updated
@@ -2434,6 +2932,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(valid_metadata());
 		if (is_seed()) return;
 
@@ -2451,6 +2950,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		// this call is only valid on torrents with metadata
 		TORRENT_ASSERT(valid_metadata());
 		if (is_seed()) return;
@@ -2505,6 +3005,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		m_need_save_resume_data = true;
 		// this call is only valid on torrents with metadata
 		if (!valid_metadata() || is_seed()) return;
 
@@ -2542,6 +3043,7 @@ namespace libtorrent
 
 	void torrent::replace_trackers(std::vector<announce_entry> const& urls)
 	{
+		m_need_save_resume_data = true;
 		m_trackers.clear();
 		std::remove_copy_if(urls.begin(), urls.end(), back_inserter(m_trackers)
 			, boost::bind(&std::string::empty, boost::bind(&announce_entry::url, _1)));
@@ -2554,7 +3056,9 @@ namespace libtorrent
 		if (m_settings.prefer_udp_trackers)
 			prioritize_udp_trackers();
 
-		if (!m_trackers.empty()) start_announcing();
+		// a torrent without metadata keeps announcing to the
+		// DHT, it may not have any other way of finding peers
+		if (!m_trackers.empty() || !valid_metadata()) start_announcing();
 		else stop_announcing();
 	}
 
@@ -2592,6 +3096,7 @@ namespace libtorrent
 
 	void torrent::add_tracker(announce_entry const& url)
 	{
+		m_need_save_resume_data = true;
 		std::vector<announce_entry>::iterator k = std::find_if(m_trackers.begin()
 			, m_trackers.end(), boost::bind(&announce_entry::url, _1) == url.url);
 		if (k != m_trackers.end()) 
@@ -2674,6 +3179,17 @@ namespace libtorrent
 					m_picker->dec_refcount(pieces);
 				}
 			}
+
+			if (!m_superseed_avail.empty() && !m_picker)
+			{
+				bitfield const& pieces = p->get_bitfield();
+				for (int k = pieces.find_first_set(0); k >= 0
+					; k = pieces.find_first_set(k + 1))
+				{
+					if (m_superseed_avail[k] > 0) --m_superseed_avail[k];
+				}
+				superseed_piece_changed(p->superseed_piece(), -1);
+			}
 		}
 
 		if (!p->is_choked() && !p->ignore_unchoke_slots())
@@ -2766,8 +3282,7 @@ namespace libtorrent
 			|| ps.type == proxy_settings::http_pw)
 		{
 			// use proxy
-			tcp::resolver::query q(ps.hostname, to_string(ps.port).elems);
-			m_host_resolver.async_resolve(q,
+			m_ses.m_host_resolver.async_resolve(ps.hostname,
 				bind(&torrent::on_proxy_name_lookup, shared_from_this(), _1, _2, web));
 		}
 		else
@@ -2784,16 +3299,15 @@ namespace libtorrent
 				return;
 			}
 
-			tcp::resolver::query q(hostname, to_string(port).elems);
-			m_host_resolver.async_resolve(q,
+			m_ses.m_host_resolver.async_resolve(hostname,
 				bind(&torrent::on_name_lookup, shared_from_this(), _1, _2, web
-					, tcp::endpoint()));
+					, port, tcp::endpoint()));
 		}
 
 	}
 
-	void torrent::on_proxy_name_lookup(error_code const& e, tcp::resolver::iterator host
-		, web_seed_entry web)
+	void torrent::on_proxy_name_lookup(error_code const& e
+		, std::vector<address> const& addresses, web_seed_entry web)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
@@ -2805,7 +3319,7 @@ namespace libtorrent
 
 		if (m_abort) return;
 
-		if (e || host == tcp::resolver::iterator())
+		if (e || addresses.empty())
 		{
 			if (m_ses.m_alerts.should_post<url_seed_alert>())
 			{
@@ -2821,7 +3335,7 @@ namespace libtorrent
 
 		if (m_ses.is_aborted()) return;
 
-		tcp::endpoint a(host->endpoint());
+		tcp::endpoint a(addresses.front(), m_ses.web_seed_proxy().port);
 
 		using boost::tuples::ignore;
 		std::string hostname;
@@ -2848,13 +3362,13 @@ namespace libtorrent
 			return;
 		}
 
-		tcp::resolver::query q(hostname, to_string(port).elems);
-		m_host_resolver.async_resolve(q,
-			bind(&torrent::on_name_lookup, shared_from_this(), _1, _2, web, a));
+		m_ses.m_host_resolver.async_resolve(hostname,
+			bind(&torrent::on_name_lookup, shared_from_this(), _1, _2, web, port, a));
 	}
 
-	void torrent::on_name_lookup(error_code const& e, tcp::resolver::iterator host
-		, web_seed_entry web, tcp::endpoint proxy)
+	void torrent::on_name_lookup(error_code const& e
+		, std::vector<address> const& addresses, web_seed_entry web
+		, int port, tcp::endpoint proxy)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
@@ -2869,7 +3383,7 @@ namespace libtorrent
 		std::set<web_seed_entry>::iterator i = m_resolving_web_seeds.find(web);
 		if (i != m_resolving_web_seeds.end()) m_resolving_web_seeds.erase(i);
 
-		if (e || host == tcp::resolver::iterator())
+		if (e || addresses.empty())
 		{
 			if (m_ses.m_alerts.should_post<url_seed_alert>())
 			{
@@ -2889,7 +3403,7 @@ namespace libtorrent
 
 		if (m_ses.is_aborted()) return;
 
-		tcp::endpoint a(host->endpoint());
+		tcp::endpoint a(addresses.front(), port);
 
 		if (m_ses.m_ip_filter.access(a.address()) & ip_filter::blocked)
 		{
@@ -2931,11 +3445,11 @@ namespace libtorrent
 #endif
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::new_connection_hook)
+			, end(m_hooks.end(torrent_plugin::new_connection_hook)); k < end; ++k)
 		{
 			boost::shared_ptr<peer_plugin>
-				pp((*i)->new_connection(c.get()));
+				pp(m_hooks[k]->new_connection(c.get()));
 			if (pp) c->add_extension(pp);
 		}
 #endif
@@ -2947,12 +3461,13 @@ namespace libtorrent
 			// add the newly connected peer to this torrent's peer list
 			m_connections.insert(boost::get_pointer(c));
 			m_ses.m_connections.insert(c);
+			m_ses.add_ticking_torrent(*this);
 			c->start();
 
 			m_ses.m_half_open.enqueue(
 				bind(&peer_connection::on_connect, c, _1)
 				, bind(&peer_connection::on_timeout, c)
-				, seconds(settings().peer_connect_timeout));
+				, seconds(settings().peer_connect_timeout), 0, this);
 #ifndef BOOST_NO_EXCEPTIONS
 		}
 		catch (std::exception& e)
@@ -3114,10 +3629,13 @@ namespace libtorrent
 		m_seeding_time = seconds(rd.dict_find_int_value("seeding_time"));
 		m_complete = rd.dict_find_int_value("num_seeds", -1);
 		m_incomplete = rd.dict_find_int_value("num_downloaders", -1);
+		invalidate_seed_rank();
 		set_upload_limit(rd.dict_find_int_value("upload_rate_limit", -1));
 		set_download_limit(rd.dict_find_int_value("download_rate_limit", -1));
 		set_max_connections(rd.dict_find_int_value("max_connections", -1));
 		set_max_uploads(rd.dict_find_int_value("max_uploads", -1));
+		set_cache_limit(rd.dict_find_int_value("cache_limit", -1));
+		set_cache_reservation(rd.dict_find_int_value("cache_reservation", 0));
 		m_seed_mode = rd.dict_find_int_value("seed_mode", 0) && m_torrent_file->is_valid();
 		if (m_seed_mode) m_verified.resize(m_torrent_file->num_pieces(), false);
 
@@ -3151,6 +3669,9 @@ namespace libtorrent
 		{
 			int paused_ = rd.dict_find_int_value("paused", -1);
 			if (paused_ != -1) m_paused = paused_;
+
+			int share_mode_ = rd.dict_find_int_value("share_mode", -1);
+			if (share_mode_ != -1) m_share_mode = share_mode_;
 		}
 
 		lazy_entry const* trackers = rd.dict_find_list("trackers");
@@ -3237,11 +3758,40 @@ namespace libtorrent
 		}
 	}
 	
+	// marks the blocks in the bitmask of an unfinished piece from the
+	// resume data as finished
+	void torrent::resume_unfinished_piece(int piece, char const* bitmask
+		, int num_bitmask_bytes)
+	{
+		if (m_picker->have_piece(piece))
+			m_picker->we_dont_have(piece);
+
+		int num_blocks_per_piece =
+			static_cast<int>(torrent_file().piece_length()) / block_size();
+		for (int j = 0; j < num_bitmask_bytes; ++j)
+		{
+			unsigned char bits = bitmask[j];
+			int num_bits = (std::min)(num_blocks_per_piece - j*8, 8);
+			for (int k = 0; k < num_bits; ++k)
+			{
+				const int bit = j * 8 + k;
+				if (bits & (1 << k))
+				{
+					m_picker->mark_as_finished(piece_block(piece, bit), 0);
+					if (m_picker->is_piece_finished(piece))
+						async_verify_piece(piece, bind(&torrent::piece_finished
+							, shared_from_this(), piece, _1));
+				}
+			}
+		}
+	}
+
 	void torrent::write_resume_data(entry& ret) const
 	{
 		using namespace libtorrent::detail; // for write_*_endpoint()
 		ret["file-format"] = "libtorrent resume file";
-		ret["file-version"] = 1;
+		bool const packed = m_ses.settings().packed_resume_data;
+		ret["file-version"] = packed ? 2 : 1;
 
 		ret["total_uploaded"] = m_total_uploaded;
 		ret["total_downloaded"] = m_total_downloaded;
@@ -3262,6 +3812,7 @@ namespace libtorrent
 		ret["sequential_download"] = m_sequential_download;
 
 		ret["seed_mode"] = m_seed_mode;
+		ret["share_mode"] = m_share_mode;
 		
 		const sha1_hash& info_hash = torrent_file().info_hash();
 		ret["info-hash"] = std::string((char*)info_hash.begin(), (char*)info_hash.end());
@@ -3288,9 +3839,20 @@ namespace libtorrent
 			const std::vector<piece_picker::downloading_piece>& q
 				= m_picker->get_download_queue();
 
-			// unfinished pieces
-			ret["unfinished"] = entry::list_type();
-			entry::list_type& up = ret["unfinished"].list();
+			const int num_bitmask_bytes
+				= (std::max)(num_blocks_per_piece / 8, 1);
+
+			// unfinished pieces. In the packed format this is a string
+			// with the 32 bit piece index followed by the bitmask for
+			// each piece
+			entry::list_type* up = 0;
+			std::string* packed_up = 0;
+			if (packed) packed_up = &ret["unfinished"].string();
+			else
+			{
+				ret["unfinished"] = entry::list_type();
+				up = &ret["unfinished"].list();
+			}
 
 			// info for each unfinished piece
 			for (std::vector<piece_picker::downloading_piece>::const_iterator i
@@ -3298,15 +3860,7 @@ namespace libtorrent
 			{
 				if (i->finished == 0) continue;
 
-				entry piece_struct(entry::dictionary_t);
-
-				// the unfinished piece's index
-				piece_struct["piece"] = i->index;
-
 				std::string bitmask;
-				const int num_bitmask_bytes
-					= (std::max)(num_blocks_per_piece / 8, 1);
-
 				for (int j = 0; j < num_bitmask_bytes; ++j)
 				{
 					unsigned char v = 0;
@@ -3317,9 +3871,23 @@ namespace libtorrent
 					bitmask.insert(bitmask.end(), v);
 					TORRENT_ASSERT(bits == 8 || j == num_bitmask_bytes - 1);
 				}
+
+				if (packed)
+				{
+					std::back_insert_iterator<std::string> out(*packed_up);
+					detail::write_int32(i->index, out);
+					packed_up->append(bitmask);
+					continue;
+				}
+
+				entry piece_struct(entry::dictionary_t);
+
+				// the unfinished piece's index
+				piece_struct["piece"] = i->index;
 				piece_struct["bitmask"] = bitmask;
-				// push the struct onto the unfinished-piece list
-				up.push_back(piece_struct);
+				// move the struct onto the unfinished-piece list
+				up->push_back(entry());
+				up->back().swap(piece_struct);
 			}
 		}
 
@@ -3454,6 +4022,8 @@ namespace libtorrent
 		ret["download_rate_limit"] = download_limit();
 		ret["max_connections"] = max_connections();
 		ret["max_uploads"] = max_uploads();
+		ret["cache_limit"] = cache_limit();
+		ret["cache_reservation"] = cache_reservation();
 		ret["paused"] = m_paused;
 		ret["auto_managed"] = m_auto_managed;
 
@@ -3494,9 +4064,12 @@ namespace libtorrent
 		}
 	}
 
-	void torrent::get_peer_info(std::vector<peer_info>& v)
+	void torrent::get_peer_info(std::vector<peer_info>& v, boost::uint32_t flags)
 	{
-		v.clear();
+		// reuse the entries already in the vector. Callers polling
+		// this keep the same vector around, which saves re-allocating
+		// the strings and bitfields of every entry each time
+		int num_peers = 0;
 		for (peer_iterator i = begin();
 			i != end(); ++i)
 		{
@@ -3506,15 +4079,16 @@ namespace libtorrent
 			// not be included in this list
 			if (peer->associated_torrent().expired()) continue;
 
-			v.push_back(peer_info());
-			peer_info& p = v.back();
+			if (num_peers == int(v.size())) v.push_back(peer_info());
+			peer_info& p = v[num_peers++];
 			
-			peer->get_peer_info(p);
+			peer->get_peer_info(p, flags);
 #ifndef TORRENT_DISABLE_RESOLVE_COUNTRIES
 			if (resolving_countries())
 				resolve_peer_country(intrusive_ptr<peer_connection>(peer));
 #endif
 		}
+		v.resize(num_peers);
 	}
 
 	void torrent::get_download_queue(std::vector<partial_piece_info>& queue)
@@ -3531,6 +4105,7 @@ namespace libtorrent
 		const int blocks_per_piece = m_picker->blocks_in_piece(0);
 		blk.resize(q.size() * blocks_per_piece);
 
+		queue.reserve(q.size());
 		int counter = 0;
 		for (std::vector<piece_picker::downloading_piece>::const_iterator i
 			= q.begin(); i != q.end(); ++i, ++counter)
@@ -3595,6 +4170,60 @@ namespace libtorrent
 		}
 	
 	}
+
+	void torrent::get_download_queue_snapshot(download_queue_snapshot& queue)
+	{
+		queue.clear();
+
+		if (!valid_metadata() || is_seed()) return;
+		piece_picker const& p = picker();
+		std::vector<piece_picker::downloading_piece> const& q
+			= p.get_download_queue();
+
+		queue.pieces.resize(q.size());
+		queue.blocks.reserve(q.size() * p.blocks_in_piece(0));
+
+		// maps policy::peer to its index in queue.peers. Consecutive
+		// blocks are almost always from the same peer, so remember
+		// the last one to save most of the lookups
+		std::map<void*, int> peer_index;
+		void* last_peer = 0;
+		boost::uint32_t last_index = 0;
+
+		int counter = 0;
+		for (std::vector<piece_picker::downloading_piece>::const_iterator i
+			= q.begin(); i != q.end(); ++i, ++counter)
+		{
+			download_queue_snapshot::piece_entry& pe = queue.pieces[counter];
+			int num_blocks = p.blocks_in_piece(i->index);
+			pe.piece_index = i->index;
+			pe.first_block = queue.blocks.size();
+			pe.blocks_in_piece = num_blocks;
+			pe.piece_state = i->state;
+
+			for (int j = 0; j < num_blocks; ++j)
+			{
+				void* peer = i->info[j].peer;
+				if (peer != 0 && peer != last_peer)
+				{
+					std::map<void*, int>::iterator k = peer_index.find(peer);
+					if (k == peer_index.end())
+					{
+						policy::peer* pp = static_cast<policy::peer*>(peer);
+						k = peer_index.insert(std::make_pair(peer
+							, int(queue.peers.size()))).first;
+						queue.peers.push_back(pp->connection
+							? pp->connection->remote() : pp->ip());
+					}
+					last_peer = peer;
+					last_index = k->second + 1;
+				}
+				boost::uint32_t peer_bits = peer == 0 ? 0 : last_index;
+				queue.blocks.push_back(i->info[j].state
+					| (peer_bits << download_queue_snapshot::peer_shift));
+			}
+		}
+	}
 	
 	bool torrent::connect_to_peer(policy::peer* peerinfo)
 	{
@@ -3620,9 +4249,26 @@ namespace libtorrent
 
 		boost::shared_ptr<socket_type> s(new socket_type(m_ses.m_io_service));
 
-		bool ret = instantiate_connection(m_ses.m_io_service, m_ses.peer_proxy(), *s);
-		(void)ret;
-		TORRENT_ASSERT(ret);
+#ifndef TORRENT_DISABLE_DHT
+		// uTP shares the udp socket with the DHT, and can't
+		// go through a proxy. If it failed for this peer
+		// before, fall back to TCP
+		if (m_ses.m_settings.enable_outgoing_utp
+			&& peerinfo->supports_utp
+			&& m_ses.peer_proxy().type == proxy_settings::none
+			&& m_ses.m_dht_socket.is_open())
+		{
+			s->instantiate<utp_stream>(m_ses.m_io_service);
+			utp_stream* str = s->get<utp_stream>();
+			str->set_impl(m_ses.m_utp_socket_manager.new_utp_socket(str));
+		}
+		else
+#endif
+		{
+			bool ret = instantiate_connection(m_ses.m_io_service, m_ses.peer_proxy(), *s);
+			(void)ret;
+			TORRENT_ASSERT(ret);
+		}
 
 		m_ses.setup_socket_buffers(*s);
 
@@ -3638,13 +4284,13 @@ namespace libtorrent
  		peerinfo->prev_amount_upload = 0;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::new_connection_hook)
+			, end(m_hooks.end(torrent_plugin::new_connection_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				boost::shared_ptr<peer_plugin> pp((*i)->new_connection(c.get()));
+				boost::shared_ptr<peer_plugin> pp(m_hooks[k]->new_connection(c.get()));
 				if (pp) c->add_extension(pp);
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
@@ -3655,6 +4301,7 @@ namespace libtorrent
 		// add the newly connected peer to this torrent's peer list
 		m_connections.insert(boost::get_pointer(c));
 		m_ses.m_connections.insert(c);
+		m_ses.add_ticking_torrent(*this);
 		peerinfo->connection = c.get();
 		c->start();
 
@@ -3668,7 +4315,7 @@ namespace libtorrent
 			m_ses.m_half_open.enqueue(
 				bind(&peer_connection::on_connect, c, _1)
 				, bind(&peer_connection::on_timeout, c)
-				, seconds(timeout));
+				, seconds(timeout), 0, this);
 #ifndef BOOST_NO_EXCEPTIONS
 		}
 		catch (std::exception& e)
@@ -3772,10 +4419,10 @@ namespace libtorrent
 		{
 #endif
 #ifndef TORRENT_DISABLE_EXTENSIONS
-			for (extension_list_t::iterator i = m_extensions.begin()
-				, end(m_extensions.end()); i != end; ++i)
+			for (int k = m_hooks.begin(torrent_plugin::new_connection_hook)
+				, end(m_hooks.end(torrent_plugin::new_connection_hook)); k < end; ++k)
 			{
-				boost::shared_ptr<peer_plugin> pp((*i)->new_connection(p));
+				boost::shared_ptr<peer_plugin> pp(m_hooks[k]->new_connection(p));
 				if (pp) p->add_extension(pp);
 			}
 #endif
@@ -3795,6 +4442,7 @@ namespace libtorrent
 #endif
 		TORRENT_ASSERT(m_connections.find(p) == m_connections.end());
 		peer_iterator ci = m_connections.insert(p).first;
+		m_ses.add_ticking_torrent(*this);
 #ifdef TORRENT_DEBUG
 		error_code ec;
 		TORRENT_ASSERT(p->remote() == p->get_socket()->remote_endpoint(ec) || ec);
@@ -3985,6 +4633,10 @@ namespace libtorrent
 	void torrent::completed()
 	{
 		m_picker.reset();
+		// the super seeding counters weren't kept up to date
+		// while we had a picker. They're rebuilt when needed
+		std::vector<boost::uint16_t>().swap(m_superseed_avail);
+		std::vector<boost::uint16_t>().swap(m_superseed_assigned);
 
 		set_state(torrent_status::seeding);
 		if (!m_announcing) return;
@@ -4051,6 +4703,7 @@ namespace libtorrent
 		TORRENT_ASSERT(m_torrent_file->is_valid());
 
 		if (m_abort) return;
+		m_need_save_resume_data = true;
 
 		// we might be finished already, in which case we should
 		// not switch to downloading mode. If all files are
@@ -4065,6 +4718,17 @@ namespace libtorrent
 			m_ses.m_alerts.post_alert(torrent_checked_alert(
 				get_handle()));
 		}
+
+		// range reads may be waiting for pieces the check found
+		if (!m_pending_range_reads.empty()) service_range_reads();
+
+		// in share mode, nothing is downloaded until
+		// recalc_share_mode() picks it
+		if (m_share_mode && !is_seed())
+		{
+			m_picker->set_piece_priorities(0
+				, std::vector<int>(m_torrent_file->num_pieces(), 0));
+		}
 		
 		if (!is_seed())
 		{
@@ -4090,13 +4754,13 @@ namespace libtorrent
 		}
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::files_checked_hook)
+			, end(m_hooks.end(torrent_plugin::files_checked_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				(*i)->on_files_checked();
+				m_hooks[k]->on_files_checked();
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -4172,6 +4836,17 @@ namespace libtorrent
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
+		// the move is still in progress
+		if (ret > 0)
+		{
+			if (alerts().should_post<storage_move_progress_alert>())
+			{
+				alerts().post_alert(storage_move_progress_alert(get_handle()
+					, j.str, j.offset / 1000000.f));
+			}
+			return;
+		}
+
 		if (ret == 0)
 		{
 			if (alerts().should_post<storage_moved_alert>())
@@ -4179,6 +4854,8 @@ namespace libtorrent
 				alerts().post_alert(storage_moved_alert(get_handle(), j.str));
 			}
 			m_save_path = j.str;
+			m_device_id = libtorrent::device_id(m_save_path);
+			m_need_save_resume_data = true;
 		}
 		else
 		{
@@ -4232,9 +4909,11 @@ namespace libtorrent
 					if (i->second->should_check_files()) ++found_active;
 				}
 			// the case of 2 is in the special case where one switches over from
-			// checking to complete.
+			// checking to complete. Torrents on different devices may be
+			// checking at the same time when checking_torrents_per_device is set
 			TORRENT_ASSERT(found_active >= 1);
-			TORRENT_ASSERT(found_active <= 2);
+			TORRENT_ASSERT(found_active <= 2 || settings().checking_torrents_per_device > 0
+				|| !m_ses.m_checking_devices.empty());
 			TORRENT_ASSERT(found >= 1);
 		}
 
@@ -4350,7 +5029,10 @@ namespace libtorrent
 #endif
 
 	void torrent::set_sequential_download(bool sd)
-	{ m_sequential_download = sd; }
+	{
+		m_need_save_resume_data = true;
+		m_sequential_download = sd;
+	}
 
 	void torrent::set_queue_position(int p)
 	{
@@ -4425,6 +5107,7 @@ namespace libtorrent
 
 	void torrent::set_max_uploads(int limit)
 	{
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(limit >= -1);
 		if (limit <= 0) limit = (std::numeric_limits<int>::max)();
 		m_max_uploads = limit;
@@ -4432,11 +5115,52 @@ namespace libtorrent
 
 	void torrent::set_max_connections(int limit)
 	{
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(limit >= -1);
 		if (limit <= 0) limit = (std::numeric_limits<int>::max)();
 		m_max_connections = limit;
 	}
 
+	void torrent::set_cache_limit(int blocks)
+	{
+		TORRENT_ASSERT(blocks >= -1);
+		if (blocks < 0) blocks = -1;
+		m_cache_limit = blocks;
+		if (m_owning_storage)
+			m_ses.m_disk_thread.set_cache_limits(m_owning_storage.get()
+				, m_cache_limit, m_cache_reservation);
+	}
+
+	void torrent::set_cache_reservation(int blocks)
+	{
+		TORRENT_ASSERT(blocks >= 0);
+		if (blocks < 0) blocks = 0;
+		m_cache_reservation = blocks;
+		if (m_owning_storage)
+			m_ses.m_disk_thread.set_cache_limits(m_owning_storage.get()
+				, m_cache_limit, m_cache_reservation);
+	}
+
+	void torrent::set_io_class(int c)
+	{
+		TORRENT_ASSERT(c >= 0 && c < num_io_classes);
+		if (c < 0 || c >= num_io_classes) return;
+		m_io_class = c;
+		if (m_owning_storage)
+			m_ses.m_disk_thread.set_io_class(m_owning_storage.get(), c);
+	}
+
+	void torrent::set_write_throttled(bool t)
+	{
+		if (m_write_throttled == t) return;
+		m_write_throttled = t;
+		if (t) return;
+		// peers stopped receiving when they ran out of quota,
+		// they may have to be woken up
+		for (peer_iterator i = begin(); i != end(); ++i)
+			(*i)->setup_receive();
+	}
+
 	void torrent::set_peer_upload_limit(tcp::endpoint ip, int limit)
 	{
 		TORRENT_ASSERT(limit >= -1);
@@ -4457,6 +5181,7 @@ namespace libtorrent
 
 	void torrent::set_upload_limit(int limit)
 	{
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(limit >= -1);
 		if (limit <= 0) limit = 0;
 		if (limit < num_peers() * 10) limit = num_peers() * 10;
@@ -4472,12 +5197,21 @@ namespace libtorrent
 
 	void torrent::set_download_limit(int limit)
 	{
+		m_need_save_resume_data = true;
 		TORRENT_ASSERT(limit >= -1);
 		if (limit <= 0) limit = 0;
 		if (limit < num_peers() * 10) limit = num_peers() * 10;
 		m_bandwidth_channel[peer_connection::download_channel].throttle(limit);
 	}
 
+	void torrent::set_bandwidth_class(int c)
+	{
+		m_bandwidth_channel[peer_connection::upload_channel].parent
+			= m_ses.bandwidth_class_channel(c, peer_connection::upload_channel);
+		m_bandwidth_channel[peer_connection::download_channel].parent
+			= m_ses.bandwidth_class_channel(c, peer_connection::download_channel);
+	}
+
 	int torrent::download_limit() const
 	{
 		int limit = m_bandwidth_channel[peer_connection::download_channel].throttle();
@@ -4523,6 +5257,7 @@ namespace libtorrent
 		bool checking_files = should_check_files();
 		m_error = ec;
 		m_error_file = error_file;
+		state_updated();
 		if (checking_files && !should_check_files())
 		{
 			// stop checking
@@ -4537,8 +5272,10 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		if (m_auto_managed == a) return;
+		m_need_save_resume_data = true;
 		bool checking_files = should_check_files();
 		m_auto_managed = a;
+		state_updated();
 		// recalculate which torrents should be
 		// paused
 		m_ses.m_auto_manage_time_scaler = 0;
@@ -4569,16 +5306,46 @@ namespace libtorrent
 
 		if (!is_finished()) return 0;
 
+		ptime now = time_now();
+		if (m_seed_rank_valid && now < m_seed_rank_expires
+			&& m_total_uploaded < m_seed_rank_upload_limit)
+			return m_seed_rank;
+
 		int scale = 100;
 		if (!is_seed()) scale = 50;
 
 		int ret = 0;
 
-		ptime now = time_now();
+		// the rank is valid until the first of these deadlines. The
+		// seeding time doesn't grow faster than the clock, so a
+		// deadline computed from it is never late
+		m_seed_rank_expires = now + hours(1);
+		m_seed_rank_upload_limit = (std::numeric_limits<size_type>::max)();
 
 		int seed_time = total_seconds(m_seeding_time);
 		int download_time = total_seconds(m_active_time) - seed_time;
 
+		// the seed times at which the seed time terms below change
+		int seed_time_boundary[3] = { 2, s.seed_time_limit
+			, (std::numeric_limits<int>::max)() };
+		if (s.seed_time_ratio_limit > 0.f
+			&& download_time / s.seed_time_ratio_limit < seed_time_boundary[2] - 1)
+			seed_time_boundary[2] = int(download_time / s.seed_time_ratio_limit) + 1;
+		for (int i = 0; i < 3; ++i)
+		{
+			if (seconds(seed_time_boundary[i]) <= m_seeding_time) continue;
+			ptime t = now + seconds(seed_time_boundary[i]) - m_seeding_time;
+			if (t < m_seed_rank_expires) m_seed_rank_expires = t;
+		}
+		// a finished torrent that isn't a seed adds to its download
+		// time instead, which moves the seed time ratio the other way
+		if (!is_seed() && s.seed_time_ratio_limit > 0.f)
+		{
+			float left = s.seed_time_ratio_limit * seed_time - download_time;
+			if (left < total_seconds(m_seed_rank_expires - now))
+				m_seed_rank_expires = now + seconds((std::max)(int(left), 0));
+		}
+
 		// if we haven't yet met the seed limits, set the seed_ratio_not_met
 		// flag. That will make this seed prioritized
 		// downloaded may be 0 if the torrent is 0-sized
@@ -4587,12 +5354,22 @@ namespace libtorrent
 			&& (seed_time > 1 && download_time / float(seed_time) < s.seed_time_ratio_limit)
 			&& downloaded > 0
 			&& m_total_uploaded / downloaded < s.share_ratio_limit)
+		{
 			ret |= seed_ratio_not_met;
+			// the upload total at which the share ratio limit is met
+			double limit = std::ceil(s.share_ratio_limit) * double(downloaded);
+			if (limit < double(m_seed_rank_upload_limit))
+				m_seed_rank_upload_limit = size_type(limit);
+		}
 
 		// if this torrent is running, and it was started less
 		// than 30 minutes ago, give it priority, to avoid oscillation
 		if (!is_paused() && now - m_started < minutes(30))
+		{
 			ret |= recently_started;
+			if (m_started + minutes(30) < m_seed_rank_expires)
+				m_seed_rank_expires = m_started + minutes(30);
+		}
 
 		// if we have any scrape data, use it to calculate
 		// seed rank
@@ -4615,6 +5392,10 @@ namespace libtorrent
 			ret |= (downloaders * scale / seeds) & prio_mask;
 		}
 
+		// without scrape data, the rank depends on the number of peers,
+		// which changes too often to keep track of
+		m_seed_rank = ret;
+		m_seed_rank_valid = m_complete >= 0 && m_incomplete >= 0;
 		return ret;
 	}
 
@@ -4622,6 +5403,10 @@ namespace libtorrent
 	void torrent::save_resume_data()
 	{
 		INVARIANT_CHECK;
+
+		// anything that changes from here on is
+		// picked up by the next save
+		m_need_save_resume_data = false;
 	
 		if (!m_owning_storage.get())
 		{
@@ -4665,13 +5450,62 @@ namespace libtorrent
 		return m_paused || m_ses.is_paused();
 	}
 
+	namespace
+	{
+		bool more_recently_used(cached_piece_info const& lhs
+			, cached_piece_info const& rhs)
+		{ return lhs.last_use > rhs.last_use; }
+	}
+
+	void torrent::update_suggested_pieces()
+	{
+		m_suggested_pieces.clear();
+		if (!m_owning_storage.get() || is_paused() || !valid_metadata()) return;
+
+		std::vector<cached_piece_info> cache;
+		m_ses.m_disk_thread.get_cache_info(info_hash(), cache);
+		// only pieces we have can be suggested. Write cache
+		// pieces are still being downloaded
+		cache.erase(std::remove_if(cache.begin(), cache.end()
+			, boost::bind(&cached_piece_info::kind, _1) != cached_piece_info::read_cache)
+			, cache.end());
+		if (cache.empty()) return;
+
+		int num = (std::min)(int(cache.size()), int(max_suggested_pieces));
+		std::partial_sort(cache.begin(), cache.begin() + num, cache.end()
+			, &more_recently_used);
+		for (int i = 0; i < num; ++i)
+		{
+			if (!have_piece(cache[i].piece)) continue;
+			m_suggested_pieces.push_back(cache[i].piece);
+		}
+
+		for (peer_iterator i = m_connections.begin()
+			, end(m_connections.end()); i != end; ++i)
+		{
+			peer_connection* p = *i;
+			for (std::vector<int>::const_iterator k = m_suggested_pieces.begin()
+				, end2(m_suggested_pieces.end()); k != end2; ++k)
+				p->send_suggest(*k);
+		}
+	}
+
+	void torrent::clear_read_cache()
+	{
+		if (!m_owning_storage.get()) return;
+		TORRENT_ASSERT(m_storage);
+		m_storage->async_clear_read_cache();
+	}
+
 	void torrent::pause()
 	{
 		INVARIANT_CHECK;
 
 		if (m_paused) return;
+		m_need_save_resume_data = true;
 		bool checking_files = should_check_files();
 		m_paused = true;
+		state_updated();
 		if (!m_ses.is_paused())
 			do_pause();
 		if (checking_files && !should_check_files())
@@ -4683,18 +5517,19 @@ namespace libtorrent
 		}
 	}
 
-	void torrent::do_pause()
+	void torrent::do_pause(bool post_alert)
 	{
 		if (!is_paused()) return;
+		invalidate_seed_rank();
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::pause_hook)
+			, end(m_hooks.end(torrent_plugin::pause_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				if ((*i)->on_pause()) return;
+				if (m_hooks[k]->on_pause()) return;
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -4715,12 +5550,12 @@ namespace libtorrent
 		{
 			TORRENT_ASSERT(m_storage);
 			m_storage->async_release_files(
-				bind(&torrent::on_torrent_paused, shared_from_this(), _1, _2));
+				bind(&torrent::on_torrent_paused, shared_from_this(), _1, _2, post_alert));
 			m_storage->async_clear_read_cache();
 		}
 		else
 		{
-			if (alerts().should_post<torrent_paused_alert>())
+			if (post_alert && alerts().should_post<torrent_paused_alert>())
 				alerts().post_alert(torrent_paused_alert(get_handle()));
 		}
 
@@ -4733,35 +5568,40 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		if (!m_paused) return;
+		m_need_save_resume_data = true;
 		bool checking_files = should_check_files();
 		m_paused = false;
+		state_updated();
 		do_resume();
 		if (!checking_files && should_check_files())
 			queue_torrent_check();
 	}
 
-	void torrent::do_resume()
+	void torrent::do_resume(bool post_alert)
 	{
 		if (is_paused()) return;
 
+		m_ses.add_ticking_torrent(*this);
+
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::resume_hook)
+			, end(m_hooks.end(torrent_plugin::resume_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				if ((*i)->on_resume()) return;
+				if (m_hooks[k]->on_resume()) return;
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
 		}
 #endif
 
-		if (alerts().should_post<torrent_resumed_alert>())
+		if (post_alert && alerts().should_post<torrent_resumed_alert>())
 			alerts().post_alert(torrent_resumed_alert(get_handle()));
 
 		m_started = time_now();
+		invalidate_seed_rank();
 		clear_error();
 		start_announcing();
 	}
@@ -4824,6 +5664,12 @@ namespace libtorrent
 			m_lsd_announce_timer.expires_from_now(seconds(1), ec);
 			m_lsd_announce_timer.async_wait(
 				bind(&torrent::on_lsd_announce_disp, self, _1));
+
+#ifndef TORRENT_DISABLE_DHT
+			// newly started torrents are announced to the DHT
+			// ahead of the round robin
+			m_ses.prioritize_dht(self);
+#endif
 		}
 	}
 
@@ -4848,14 +5694,19 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		// the rates and transfer counters in the status change
+		// every second while there's anything going on
+		if (!m_connections.empty() || !m_stat.is_idle())
+			state_updated();
+
 #ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		for (int k = m_hooks.begin(torrent_plugin::tick_hook)
+			, end(m_hooks.end(torrent_plugin::tick_hook)); k < end; ++k)
 		{
 #ifndef BOOST_NO_EXCEPTIONS
 			try {
 #endif
-				(*i)->tick();
+				m_hooks[k]->tick();
 #ifndef BOOST_NO_EXCEPTIONS
 			} catch (std::exception&) {}
 #endif
@@ -4881,8 +5732,17 @@ namespace libtorrent
 					update_sparse_piece_prio(i, start, end);
 			}
 			m_policy.pulse();
+
+			if (settings().suggest_mode == session_settings::suggest_read_cache)
+				update_suggested_pieces();
+			else
+				m_suggested_pieces.clear();
+
+			if (m_share_mode) recalc_share_mode();
 		}
 
+		update_evicted_pieces();
+
 		if (is_paused())
 		{
 			// let the stats fade out to 0
@@ -4890,6 +5750,18 @@ namespace libtorrent
 			return;
 		}
 
+		if (m_seed_mode) verify_seed_pieces();
+
+#ifndef TORRENT_DISABLE_DHT
+		// a torrent without metadata and without peers to ask for
+		// it doesn't wait for the DHT round robin to come around.
+		// The first announce may have been sent before the DHT
+		// was bootstrapped
+		if (!valid_metadata() && m_announcing && m_connections.empty()
+			&& time_now() - m_last_dht_announce > minutes(1))
+			m_ses.prioritize_dht(shared_from_this());
+#endif
+
 		if (m_settings.rate_limit_ip_overhead)
 		{
 			int up_limit = m_bandwidth_channel[peer_connection::upload_channel].throttle();
@@ -4943,29 +5815,36 @@ namespace libtorrent
 		if (!is_finished() && !m_web_seeds.empty() && m_files_checked)
 		{
 			// keep trying web-seeds if there are any
-			// first find out which web seeds we are connected to
-			std::set<web_seed_entry> web_seeds;
+			// first count the connections to each web seed
+			int max_connections = (std::max)(settings().urlseed_max_connections, 1);
+			std::map<web_seed_entry, int> web_seeds;
 			for (peer_iterator i = m_connections.begin();
 				i != m_connections.end(); ++i)
 			{
 				web_peer_connection* p = dynamic_cast<web_peer_connection*>(*i);
-				if (p) web_seeds.insert(web_seed_entry(p->url(), web_seed_entry::url_seed));
+				if (p) ++web_seeds[web_seed_entry(p->url(), web_seed_entry::url_seed)];
 				http_seed_connection* s = dynamic_cast<http_seed_connection*>(*i);
-				if (s) web_seeds.insert(web_seed_entry(s->url(), web_seed_entry::http_seed));
+				if (s) ++web_seeds[web_seed_entry(s->url(), web_seed_entry::http_seed)];
 			}
 
+			// only one connection to a web seed is started at a time.
+			// m_resolving_web_seeds can't hold a seed more than once
 			for (std::set<web_seed_entry>::iterator i = m_resolving_web_seeds.begin()
 				, end(m_resolving_web_seeds.end()); i != end; ++i)
-				web_seeds.insert(web_seeds.begin(), *i);
+				web_seeds[*i] = max_connections;
 
-			// from the list of available web seeds, subtract the ones we are
-			// already connected to.
-			std::vector<web_seed_entry> not_connected_web_seeds;
-			std::set_difference(m_web_seeds.begin(), m_web_seeds.end(), web_seeds.begin()
-				, web_seeds.end(), std::back_inserter(not_connected_web_seeds));
+			std::vector<web_seed_entry> to_connect;
+			for (std::set<web_seed_entry>::iterator i = m_web_seeds.begin()
+				, end(m_web_seeds.end()); i != end; ++i)
+			{
+				std::map<web_seed_entry, int>::iterator j = web_seeds.find(*i);
+				if (j != web_seeds.end() && j->second >= max_connections) continue;
+				to_connect.push_back(*i);
+			}
 
-			// connect to all of those that we aren't connected to
-			std::for_each(not_connected_web_seeds.begin(), not_connected_web_seeds.end()
+			// open one more connection to those that have fewer
+			// than urlseed_max_connections
+			std::for_each(to_connect.begin(), to_connect.end()
 				, bind(&torrent::connect_to_url_seed, this, _1));
 		}
 		
@@ -5044,7 +5923,7 @@ namespace libtorrent
 				backup2.clear();
 				m_picker->add_blocks(i->piece, c.get_bitfield(), interesting_blocks
 					, backup1, backup2, 1, 0, c.peer_info_struct()
-					, ignore, piece_picker::fast, 0);
+					, ignore, piece_picker::fast, piece_picker::time_critical_mode);
 
 				std::vector<piece_block> const& rq = c.request_queue();
 
@@ -5062,15 +5941,42 @@ namespace libtorrent
 					added_request = true;
 				}
 
-				// TODO: if there's been long enough since we requested something
-				// from this piece, request one of the backup blocks (the one with
-				// the least number of requests to it) and update the last request
-				// timestamp
+				// every block has been requested. If the piece is late, or
+				// it's been longer than it usually takes to download a piece
+				// since we requested something from it, request the block
+				// with the fewest requests again, from this faster peer
+				if (interesting_blocks.empty() && !backup1.empty()
+					&& i->last_requested != min_time()
+					&& (now > i->deadline || now - i->last_requested
+						> m_average_piece_time + m_piece_time_deviation))
+				{
+					std::vector<pending_block> const& dq = c.download_queue();
+					piece_block const* best = 0;
+					int best_peers = INT_MAX;
+					for (std::vector<piece_block>::const_iterator k = backup1.begin()
+						, end(backup1.end()); k != end; ++k)
+					{
+						if (std::find_if(dq.begin(), dq.end(), has_block(*k)) != dq.end()
+							|| std::find(rq.begin(), rq.end(), *k) != rq.end())
+							continue;
+						int num_peers = m_picker->num_peers(*k);
+						if (num_peers >= best_peers) continue;
+						best = &*k;
+						best_peers = num_peers;
+					}
+					if (best)
+					{
+						c.add_request(*best, true);
+						added_request = true;
+					}
+				}
 
 				if (added_request)
 				{
 					peers_with_requests.insert(peers_with_requests.begin(), &c);
 					if (i->first_requested == min_time()) i->first_requested = now;
+					i->last_requested = now;
+					++i->peers;
 
 					if (!c.can_request_time_critical())
 					{
@@ -5170,7 +6076,10 @@ namespace libtorrent
 		// -1: disk failure
 		// -2: hash check failed
 
-		if (ret == -1)
+		// if the storage dropped the piece before it was hashed, it's
+		// downloaded again like after any other disk failure, but it
+		// doesn't stop the torrent
+		if (ret == -1 && j.error != error_code(errors::piece_evicted, libtorrent_category))
 		{
 			if (alerts().should_post<file_error_alert>())
 				alerts().post_alert(file_error_alert(j.error_file, get_handle(), j.str));
@@ -5180,6 +6089,60 @@ namespace libtorrent
 		f(ret);
 	}
 
+	void torrent::verify_seed_pieces()
+	{
+		TORRENT_ASSERT(m_seed_mode);
+		if (!m_storage || m_state != torrent_status::seeding) return;
+
+		// the jobs have a lower priority than the reads for peers,
+		// and the cursor makes them sweep the files sequentially
+		int num_pieces = m_torrent_file->num_pieces();
+		while (m_outstanding_verify < settings().seed_mode_background_hashes
+			&& m_verify_cursor < num_pieces)
+		{
+			int piece = m_verify_cursor++;
+			if (m_verified.get_bit(piece)) continue;
+			++m_outstanding_verify;
+			m_storage->async_hash(piece, bind(&torrent::on_seed_piece_verified
+				, shared_from_this(), _1, _2), -1);
+		}
+	}
+
+	void torrent::on_seed_piece_verified(int ret, disk_io_job const& j)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		TORRENT_ASSERT(m_outstanding_verify > 0);
+		--m_outstanding_verify;
+
+		// we may have left seed mode while the job was queued
+		if (!m_seed_mode) return;
+
+		if (ret == -1)
+		{
+			if (alerts().should_post<file_error_alert>())
+				alerts().post_alert(file_error_alert(j.error_file, get_handle(), j.str));
+			set_error(j.error, j.error_file);
+			pause();
+			return;
+		}
+
+		if (ret == -2)
+		{
+			// we turned out not to have this piece
+			leave_seed_mode(false);
+			return;
+		}
+
+		if (!m_verified.get_bit(j.piece)) verified(j.piece);
+		if (all_verified())
+		{
+			leave_seed_mode(true);
+			return;
+		}
+		if (!is_paused()) verify_seed_pieces();
+	}
+
 	const tcp::endpoint& torrent::current_tracker() const
 	{
 		return m_tracker_address;
@@ -5372,9 +6335,20 @@ namespace libtorrent
 		if (m_ses.m_alerts.should_post<state_changed_alert>())
 			m_ses.m_alerts.post_alert(state_changed_alert(get_handle(), s, m_state));
 		m_state = s;
+		state_updated();
+	}
+
+	void torrent::state_updated()
+	{
+		// pausing, resuming and finishing all change the seed rank
+		invalidate_seed_rank();
+		// aborted torrents may outlive their entry in the session,
+		// so they must not be added to its list
+		if (m_in_state_updates || m_abort) return;
+		m_ses.add_state_update(*this);
 	}
 
-	torrent_status torrent::status() const
+	torrent_status torrent::status(boost::uint32_t flags) const
 	{
 		INVARIANT_CHECK;
 
@@ -5382,9 +6356,12 @@ namespace libtorrent
 
 		torrent_status st;
 
+		st.info_hash = info_hash();
+
 		st.has_incoming = m_has_incoming;
 		if (m_error) st.error = m_error.message() + ": " + m_error_file;
 		st.seed_mode = m_seed_mode;
+		st.share_mode = m_share_mode;
 
 		if (m_last_scrape == min_time())
 		{
@@ -5468,6 +6445,8 @@ namespace libtorrent
 		st.uploads_limit = m_max_uploads;
 		st.num_connections = int(m_connections.size());
 		st.connections_limit = m_max_connections;
+		if ((flags & torrent_handle::query_cache_blocks) && m_owning_storage)
+			st.cache_blocks = m_ses.m_disk_thread.cached_blocks(m_owning_storage.get());
 		// if we don't have any metadata, stop here
 
 		st.state = m_state;
@@ -5488,7 +6467,7 @@ namespace libtorrent
 		else st.progress = st.total_wanted_done
 			/ static_cast<float>(st.total_wanted);
 
-		if (has_picker())
+		if (has_picker() && (flags & torrent_handle::query_pieces))
 		{
 			st.sparse_regions = m_picker->sparse_regions();
 			int num_pieces = m_picker->num_pieces();
@@ -5498,7 +6477,7 @@ namespace libtorrent
 		}
 		st.num_pieces = num_have();
 		st.num_seeds = num_seeds();
-		if (m_picker.get())
+		if (m_picker.get() && (flags & torrent_handle::query_distributed_copies))
 			st.distributed_copies = m_picker->distributed_copies();
 		else
 			st.distributed_copies = -1;
@@ -5527,6 +6506,13 @@ namespace libtorrent
 			, boost::bind(&peer_connection::is_seed, _1));
 	}
 
+	// when tracker requests are rate limited, the torrents
+	// with the fewest peers get to announce first
+	int torrent::tracker_request_priority() const
+	{
+		return -num_peers();
+	}
+
 	void torrent::tracker_request_timed_out(
 		tracker_request const& r)
 	{
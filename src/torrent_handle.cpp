@@ -46,6 +46,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/filesystem/convenience.hpp>
 #include <boost/optional.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -76,43 +80,37 @@ using libtorrent::aux::session_impl;
 
 #ifdef BOOST_NO_EXCEPTIONS
 
-#define TORRENT_FORWARD(call) \
+#define TORRENT_ASYNC_CALL(call) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
 	if (!t) return; \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	t->call
-	
-#define TORRENT_FORWARD_RETURN(call, def) \
+	async_call(t->session(), call)
+
+#define TORRENT_SYNC_CALL(call) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
-	if (!t) return def; \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	return t->call
+	if (!t) return; \
+	sync_call(t->session(), call)
 
-#define TORRENT_FORWARD_RETURN2(call, def) \
+#define TORRENT_SYNC_CALL_RET(type, call, def) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
 	if (!t) return def; \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	t->call
+	return sync_call_ret<type>(t->session(), call)
 
 #else
 
-#define TORRENT_FORWARD(call) \
+#define TORRENT_ASYNC_CALL(call) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
 	if (!t) throw_invalid_handle(); \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	t->call
-	
-#define TORRENT_FORWARD_RETURN(call, def) \
+	async_call(t->session(), call)
+
+#define TORRENT_SYNC_CALL(call) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
 	if (!t) throw_invalid_handle(); \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	return t->call
+	sync_call(t->session(), call)
 
-#define TORRENT_FORWARD_RETURN2(call, def) \
+#define TORRENT_SYNC_CALL_RET(type, call, def) \
 	boost::shared_ptr<torrent> t = m_torrent.lock(); \
 	if (!t) throw_invalid_handle(); \
-	session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-	t->call
+	return sync_call_ret<type>(t->session(), call)
 
 #endif
 
@@ -128,6 +126,121 @@ namespace libtorrent
 	}
 #endif
 
+	namespace
+	{
+		// the calls are run on the network thread, which owns the
+		// session. That way the calling thread never waits for the
+		// session mutex while the network thread is holding it, and
+		// the network thread only competes for it with other calls
+		// into the session
+
+		// the network thread is already holding the session mutex
+		// when it calls us, e.g. from a plugin
+		bool is_network_thread(session_impl const& ses)
+		{
+			return ses.m_thread && ses.m_thread->get_id() == boost::this_thread::get_id();
+		}
+
+		void run_locked(session_impl& ses, boost::function<void()> const& f)
+		{
+			session_impl::mutex_t::scoped_lock l(ses.m_mutex);
+			f();
+		}
+
+		// queues f to run on the network thread and returns right
+		// away. Calls are run in the order they were made, so a
+		// query made after a change will see the change
+		void async_call(session_impl& ses, boost::function<void()> const& f)
+		{
+			if (is_network_thread(ses))
+			{
+				f();
+				return;
+			}
+			ses.m_io_service.post(boost::bind(&run_locked, boost::ref(ses), f));
+		}
+
+		struct call_state
+		{
+			call_state(): done(false) {}
+			boost::mutex mutex;
+			boost::condition cond;
+			bool done;
+		};
+
+		void run_and_signal(session_impl& ses, boost::function<void()> const& f
+			, call_state& st)
+		{
+			run_locked(ses, f);
+			boost::mutex::scoped_lock l(st.mutex);
+			st.done = true;
+			st.cond.notify_all();
+		}
+
+		// runs f on the network thread and waits for it to complete
+		void sync_call(session_impl& ses, boost::function<void()> const& f)
+		{
+			if (is_network_thread(ses))
+			{
+				f();
+				return;
+			}
+			// once the session is shutting down, the network thread
+			// may stop running handlers before it gets to ours
+			if (ses.is_aborted())
+			{
+				run_locked(ses, f);
+				return;
+			}
+			call_state st;
+			boost::mutex::scoped_lock l(st.mutex);
+			ses.m_io_service.post(boost::bind(&run_and_signal
+				, boost::ref(ses), f, boost::ref(st)));
+			while (!st.done) st.cond.wait(l);
+		}
+
+		template <class R>
+		void assign_result(R& r, boost::function<R()> const& f) { r = f(); }
+
+		template <class R>
+		R sync_call_ret(session_impl& ses, boost::function<R()> const& f)
+		{
+			R r;
+			sync_call(ses, boost::bind(&assign_result<R>, boost::ref(r), f));
+			return r;
+		}
+
+		void queue_up(boost::shared_ptr<torrent> const& t)
+		{
+			t->set_queue_position(t->queue_position() == 0
+				? t->queue_position() : t->queue_position() - 1);
+		}
+
+		void queue_down(boost::shared_ptr<torrent> const& t)
+		{
+			t->set_queue_position(t->queue_position() + 1);
+		}
+
+		void add_peer(boost::shared_ptr<torrent> const& t, tcp::endpoint const& adr
+			, int source)
+		{
+			peer_id id;
+			std::fill(id.begin(), id.end(), 0);
+			t->get_policy().add_peer(adr, id, source, 0);
+		}
+
+		sha1_hash torrent_info_hash(boost::shared_ptr<torrent> const& t)
+		{ return t->torrent_file().info_hash(); }
+
+#ifndef TORRENT_NO_DEPRECATE
+		void write_full_resume_data(boost::shared_ptr<torrent> const& t, entry& ret)
+		{
+			t->write_resume_data(ret);
+			t->filesystem().write_resume_data(ret);
+		}
+#endif
+	}
+
 #ifdef TORRENT_DEBUG
 
 	void torrent_handle::check_invariant() const
@@ -139,86 +252,132 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 		const static sha1_hash empty;
-		TORRENT_FORWARD_RETURN(torrent_file().info_hash(), empty);
+		TORRENT_SYNC_CALL_RET(sha1_hash, bind(&torrent_info_hash, t), empty);
 	}
 
 	int torrent_handle::max_uploads() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(max_uploads(), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::max_uploads, t), 0);
 	}
 
 	void torrent_handle::set_max_uploads(int max_uploads) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(max_uploads >= 2 || max_uploads == -1);
-		TORRENT_FORWARD(set_max_uploads(max_uploads));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_max_uploads, t, max_uploads));
 	}
 
 	void torrent_handle::use_interface(const char* net_interface) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(use_interface(net_interface));
+		TORRENT_SYNC_CALL(bind(&torrent::use_interface, t, net_interface));
 	}
 
 	int torrent_handle::max_connections() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(max_connections(), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::max_connections, t), 0);
 	}
 
 	void torrent_handle::set_max_connections(int max_connections) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(max_connections >= 2 || max_connections == -1);
-		TORRENT_FORWARD(set_max_connections(max_connections));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_max_connections, t, max_connections));
+	}
+
+	int torrent_handle::cache_limit() const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::cache_limit, t), -1);
+	}
+
+	void torrent_handle::set_cache_limit(int blocks) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASSERT(blocks >= -1);
+		TORRENT_ASYNC_CALL(bind(&torrent::set_cache_limit, t, blocks));
+	}
+
+	int torrent_handle::cache_reservation() const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::cache_reservation, t), 0);
+	}
+
+	void torrent_handle::set_cache_reservation(int blocks) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASSERT(blocks >= 0);
+		TORRENT_ASYNC_CALL(bind(&torrent::set_cache_reservation, t, blocks));
+	}
+
+	int torrent_handle::io_class() const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::io_class, t), normal_io_class);
+	}
+
+	void torrent_handle::set_io_class(int c) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASSERT(c >= 0 && c < num_io_classes);
+		TORRENT_ASYNC_CALL(bind(&torrent::set_io_class, t, c));
 	}
 
 	void torrent_handle::set_peer_upload_limit(tcp::endpoint ip, int limit) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(limit >= -1);
-		TORRENT_FORWARD(set_peer_upload_limit(ip, limit));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_peer_upload_limit, t, ip, limit));
 	}
 
 	void torrent_handle::set_peer_download_limit(tcp::endpoint ip, int limit) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(limit >= -1);
-		TORRENT_FORWARD(set_peer_download_limit(ip, limit));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_peer_download_limit, t, ip, limit));
 	}
 
 	void torrent_handle::set_upload_limit(int limit) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(limit >= -1);
-		TORRENT_FORWARD(set_upload_limit(limit));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_upload_limit, t, limit));
 	}
 
 	int torrent_handle::upload_limit() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(upload_limit(), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::upload_limit, t), 0);
+	}
+
+	void torrent_handle::set_bandwidth_class(int c) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASSERT(c >= -1);
+		TORRENT_ASYNC_CALL(bind(&torrent::set_bandwidth_class, t, c));
 	}
 
 	void torrent_handle::set_download_limit(int limit) const
 	{
 		INVARIANT_CHECK;
 		TORRENT_ASSERT(limit >= -1);
-		TORRENT_FORWARD(set_download_limit(limit));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_download_limit, t, limit));
 	}
 
 	int torrent_handle::download_limit() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(download_limit(), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::download_limit, t), 0);
 	}
 
 	void torrent_handle::move_storage(
 		fs::path const& save_path) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(move_storage(save_path));
+		TORRENT_ASYNC_CALL(bind(&torrent::move_storage, t, save_path));
 	}
 
 #ifndef BOOST_FILESYSTEM_NARROW_ONLY
@@ -228,7 +387,7 @@ namespace libtorrent
 		INVARIANT_CHECK;
 		std::string utf8;
 		wchar_utf8(save_path.string(), utf8);
-		TORRENT_FORWARD(move_storage(utf8));
+		TORRENT_ASYNC_CALL(bind(&torrent::move_storage, t, utf8));
 	}
 
 	void torrent_handle::rename_file(int index, fs::wpath const& new_name) const
@@ -236,14 +395,14 @@ namespace libtorrent
 		INVARIANT_CHECK;
 		std::string utf8;
 		wchar_utf8(new_name.string(), utf8);
-		TORRENT_FORWARD(rename_file(index, utf8));
+		TORRENT_ASYNC_CALL(bind(&torrent::rename_file, t, index, utf8));
 	}
 #endif
 
 	void torrent_handle::rename_file(int index, fs::path const& new_name) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(rename_file(index, new_name.string()));
+		TORRENT_ASYNC_CALL(bind(&torrent::rename_file, t, index, new_name.string()));
 	}
 
 	void torrent_handle::add_extension(
@@ -251,212 +410,227 @@ namespace libtorrent
 		, void* userdata)
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(add_extension(ext, userdata));
+		void (torrent::*fun)(boost::function<boost::shared_ptr<torrent_plugin>(torrent*, void*)> const&
+			, void*) = &torrent::add_extension;
+		TORRENT_SYNC_CALL(bind(fun, t, ext, userdata));
 	}
 
 	bool torrent_handle::has_metadata() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(valid_metadata(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::valid_metadata, t), false);
 	}
 
 	bool torrent_handle::set_metadata(char const* metadata, int size) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(set_metadata(metadata, size), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::set_metadata, t, metadata, size), false);
 	}
 
 	bool torrent_handle::is_seed() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_seed(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_seed, t), false);
 	}
 
 	bool torrent_handle::is_finished() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_finished(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_finished, t), false);
 	}
 
 	bool torrent_handle::is_paused() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_torrent_paused(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_torrent_paused, t), false);
 	}
 
 	void torrent_handle::pause() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(pause());
+		TORRENT_ASYNC_CALL(bind(&torrent::pause, t));
 	}
 
 	void torrent_handle::save_resume_data() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(save_resume_data());
+		TORRENT_ASYNC_CALL(bind(&torrent::save_resume_data, t));
 	}
 
 	void torrent_handle::force_recheck() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(force_recheck());
+		TORRENT_ASYNC_CALL(bind(&torrent::force_recheck, t));
 	}
 
 	void torrent_handle::resume() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(resume());
+		TORRENT_ASYNC_CALL(bind(&torrent::resume, t));
+	}
+
+	bool torrent_handle::need_save_resume_data() const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::need_save_resume_data, t), false);
 	}
 
 	bool torrent_handle::is_auto_managed() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_auto_managed(), true);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_auto_managed, t), true);
 	}
 
 	void torrent_handle::auto_managed(bool m) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(auto_managed(m));
+		TORRENT_ASYNC_CALL(bind(&torrent::auto_managed, t, m));
 	}
 
 	int torrent_handle::queue_position() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(queue_position(), -1);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::queue_position, t), -1);
 	}
 
 	void torrent_handle::queue_position_up() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_queue_position(t->queue_position() == 0
-			? t->queue_position() : t->queue_position() - 1));
+		TORRENT_ASYNC_CALL(bind(&queue_up, t));
 	}
 
 	void torrent_handle::queue_position_down() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_queue_position(t->queue_position() + 1));
+		TORRENT_ASYNC_CALL(bind(&queue_down, t));
 	}
 
 	void torrent_handle::queue_position_top() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_queue_position(0));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_queue_position, t, 0));
 	}
 
 	void torrent_handle::queue_position_bottom() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_queue_position((std::numeric_limits<int>::max)()));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_queue_position, t, (std::numeric_limits<int>::max)()));
 	}
 
 	void torrent_handle::clear_error() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(clear_error());
+		TORRENT_ASYNC_CALL(bind(&torrent::clear_error, t));
 	}
 
 	void torrent_handle::set_tracker_login(std::string const& name
 		, std::string const& password) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_tracker_login(name, password));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_tracker_login, t, name, password));
 	}
 
 #ifndef TORRENT_NO_DEPRECATE
 	void torrent_handle::file_progress(std::vector<float>& progress) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(file_progress(progress));
+		void (torrent::*fun)(std::vector<float>&) const = &torrent::file_progress;
+		TORRENT_SYNC_CALL(bind(fun, t, boost::ref(progress)));
 	}
 #endif
 
 	void torrent_handle::file_progress(std::vector<size_type>& progress) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(file_progress(progress));
+		void (torrent::*fun)(std::vector<size_type>&) const = &torrent::file_progress;
+		TORRENT_SYNC_CALL(bind(fun, t, boost::ref(progress)));
 	}
 
-	torrent_status torrent_handle::status() const
+	torrent_status torrent_handle::status(boost::uint32_t flags) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(status(), torrent_status());
+		TORRENT_SYNC_CALL_RET(torrent_status, bind(&torrent::status, t, flags), torrent_status());
 	}
 
 	void torrent_handle::set_sequential_download(bool sd) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_sequential_download(sd));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_sequential_download, t, sd));
 	}
 
 	bool torrent_handle::is_sequential_download() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_sequential_download(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_sequential_download, t), false);
 	}
 
 	std::string torrent_handle::name() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(name(), "");
+		TORRENT_SYNC_CALL_RET(std::string, bind(&torrent::name, t), "");
 	}
 
 	void torrent_handle::piece_availability(std::vector<int>& avail) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(piece_availability(avail));
+		TORRENT_SYNC_CALL(bind(&torrent::piece_availability, t, boost::ref(avail)));
+	}
+
+	void torrent_handle::get_io_stats(torrent_io_stats& st, int flags) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL(bind(&torrent::get_io_stats, t, boost::ref(st), flags));
 	}
 
 	void torrent_handle::piece_priority(int index, int priority) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_piece_priority(index, priority));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_piece_priority, t, index, priority));
 	}
 
 	int torrent_handle::piece_priority(int index) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(piece_priority(index), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::piece_priority, t, index), 0);
 	}
 
 	void torrent_handle::prioritize_pieces(std::vector<int> const& pieces) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(prioritize_pieces(pieces));
+		TORRENT_ASYNC_CALL(bind(&torrent::prioritize_pieces, t, pieces));
 	}
 
 	std::vector<int> torrent_handle::piece_priorities() const
 	{
 		INVARIANT_CHECK;
 		std::vector<int> ret;
-		TORRENT_FORWARD_RETURN2(piece_priorities(ret), ret);
+		TORRENT_SYNC_CALL(bind(&torrent::piece_priorities, t, boost::ref(ret)));
 		return ret;
 	}
 
 	void torrent_handle::file_priority(int index, int priority) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_file_priority(index, priority));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_file_priority, t, index, priority));
 	}
 
 	int torrent_handle::file_priority(int index) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(file_priority(index), 0);
+		TORRENT_SYNC_CALL_RET(int, bind(&torrent::file_priority, t, index), 0);
 	}
 
 	void torrent_handle::prioritize_files(std::vector<int> const& files) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(prioritize_files(files));
+		TORRENT_ASYNC_CALL(bind(&torrent::prioritize_files, t, files));
 	}
 
 	std::vector<int> torrent_handle::file_priorities() const
 	{
 		INVARIANT_CHECK;
 		std::vector<int> ret;
-		TORRENT_FORWARD_RETURN2(file_priorities(ret), ret);
+		TORRENT_SYNC_CALL(bind(&torrent::file_priorities, t, boost::ref(ret)));
 		return ret;
 	}
 
@@ -466,33 +640,33 @@ namespace libtorrent
 	void torrent_handle::filter_piece(int index, bool filter) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(filter_piece(index, filter));
+		TORRENT_ASYNC_CALL(bind(&torrent::filter_piece, t, index, filter));
 	}
 
 	void torrent_handle::filter_pieces(std::vector<bool> const& pieces) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(filter_pieces(pieces));
+		TORRENT_ASYNC_CALL(bind(&torrent::filter_pieces, t, pieces));
 	}
 
 	bool torrent_handle::is_piece_filtered(int index) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(is_piece_filtered(index), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::is_piece_filtered, t, index), false);
 	}
 
 	std::vector<bool> torrent_handle::filtered_pieces() const
 	{
 		INVARIANT_CHECK;
 		std::vector<bool> ret;
-		TORRENT_FORWARD_RETURN2(filtered_pieces(ret), ret);
+		TORRENT_SYNC_CALL(bind(&torrent::filtered_pieces, t, boost::ref(ret)));
 		return ret;
 	}
 
 	void torrent_handle::filter_files(std::vector<bool> const& files) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(filter_files(files));
+		TORRENT_ASYNC_CALL(bind(&torrent::filter_files, t, files));
 	}
 
 // ============ end deprecation ===============
@@ -502,76 +676,82 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 		const static std::vector<announce_entry> empty;
-		TORRENT_FORWARD_RETURN(trackers(), empty);
+		TORRENT_SYNC_CALL_RET(std::vector<announce_entry>, bind(&torrent::trackers, t), empty);
 	}
 
 	void torrent_handle::add_url_seed(std::string const& url) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(add_web_seed(url, web_seed_entry::url_seed));
+		TORRENT_ASYNC_CALL(bind(&torrent::add_web_seed, t, url, web_seed_entry::url_seed));
 	}
 
 	void torrent_handle::remove_url_seed(std::string const& url) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(remove_web_seed(url, web_seed_entry::url_seed));
+		TORRENT_ASYNC_CALL(bind(&torrent::remove_web_seed, t, url, web_seed_entry::url_seed));
 	}
 
 	std::set<std::string> torrent_handle::url_seeds() const
 	{
 		INVARIANT_CHECK;
 		const static std::set<std::string> empty;
-		TORRENT_FORWARD_RETURN(web_seeds(web_seed_entry::url_seed), empty);
+		TORRENT_SYNC_CALL_RET(std::set<std::string>, bind(&torrent::web_seeds, t, web_seed_entry::url_seed), empty);
 	}
 
 	void torrent_handle::add_http_seed(std::string const& url) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(add_web_seed(url, web_seed_entry::http_seed));
+		TORRENT_ASYNC_CALL(bind(&torrent::add_web_seed, t, url, web_seed_entry::http_seed));
 	}
 
 	void torrent_handle::remove_http_seed(std::string const& url) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(remove_web_seed(url, web_seed_entry::http_seed));
+		TORRENT_ASYNC_CALL(bind(&torrent::remove_web_seed, t, url, web_seed_entry::http_seed));
 	}
 
 	std::set<std::string> torrent_handle::http_seeds() const
 	{
 		INVARIANT_CHECK;
 		const static std::set<std::string> empty;
-		TORRENT_FORWARD_RETURN(web_seeds(web_seed_entry::http_seed), empty);
+		TORRENT_SYNC_CALL_RET(std::set<std::string>, bind(&torrent::web_seeds, t, web_seed_entry::http_seed), empty);
 	}
 
 	void torrent_handle::replace_trackers(
 		std::vector<announce_entry> const& urls) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(replace_trackers(urls));
+		TORRENT_ASYNC_CALL(bind(&torrent::replace_trackers, t, urls));
 	}
 
 	void torrent_handle::add_tracker(announce_entry const& url) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(add_tracker(url));
+		TORRENT_ASYNC_CALL(bind(&torrent::add_tracker, t, url));
 	}
 
 	void torrent_handle::add_piece(int piece, char const* data, int flags) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(add_piece(piece, data, flags));
+		TORRENT_SYNC_CALL(bind(&torrent::add_piece, t, piece, data, flags));
 	}
 
 	void torrent_handle::read_piece(int piece) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(read_piece(piece));
+		TORRENT_ASYNC_CALL(bind(&torrent::read_piece, t, piece));
+	}
+
+	void torrent_handle::read_range(size_type offset, int size, int deadline) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASYNC_CALL(bind(&torrent::read_range, t, offset, size, deadline));
 	}
 
 	storage_interface* torrent_handle::get_storage_impl() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(get_storage(), 0);
+		TORRENT_SYNC_CALL_RET(storage_interface*, bind(&torrent::get_storage, t), 0);
 	}
 
 	torrent_info const& torrent_handle::get_torrent_info() const
@@ -587,8 +767,7 @@ namespace libtorrent
 #else
 			throw_invalid_handle();
 #endif
-		session_impl::mutex_t::scoped_lock l(t->session().m_mutex);
-		if (!t->valid_metadata())
+		if (!sync_call_ret<bool>(t->session(), bind(&torrent::valid_metadata, t)))
 #ifdef BOOST_NO_EXCEPTIONS
 			return empty;
 #else
@@ -609,9 +788,7 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		entry ret(entry::dictionary_t);
-		TORRENT_FORWARD_RETURN2(write_resume_data(ret), ret);
-		t->filesystem().write_resume_data(ret);
-
+		TORRENT_SYNC_CALL(bind(&write_full_resume_data, t, boost::ref(ret)));
 		return ret;
 	}
 #endif
@@ -619,7 +796,7 @@ namespace libtorrent
 	fs::path torrent_handle::save_path() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(save_path(), fs::path());
+		TORRENT_SYNC_CALL_RET(fs::path, bind(&torrent::save_path, t), fs::path());
 	}
 
 	void torrent_handle::connect_peer(tcp::endpoint const& adr, int source) const
@@ -633,42 +810,48 @@ namespace libtorrent
 #else
 			throw_invalid_handle();
 #endif
-		session_impl::mutex_t::scoped_lock l(t->session().m_mutex);
-		
-		peer_id id;
-		std::fill(id.begin(), id.end(), 0);
-		t->get_policy().add_peer(adr, id, source, 0);
+		async_call(t->session(), bind(&add_peer, t, adr, source));
 	}
 
 	void torrent_handle::force_reannounce(
 		boost::posix_time::time_duration duration) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(force_tracker_request(time_now() + seconds(duration.total_seconds())));
+		void (torrent::*fun)(ptime) = &torrent::force_tracker_request;
+		TORRENT_ASYNC_CALL(bind(fun, t, time_now() + seconds(duration.total_seconds())));
 	}
 
 	void torrent_handle::force_reannounce() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(force_tracker_request());
+		void (torrent::*fun)() = &torrent::force_tracker_request;
+		TORRENT_ASYNC_CALL(bind(fun, t));
 	}
 
 	void torrent_handle::scrape_tracker() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(scrape_tracker());
+		TORRENT_ASYNC_CALL(bind(&torrent::scrape_tracker, t));
 	}
 
 	bool torrent_handle::super_seeding() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(super_seeding(), false);
+		bool (torrent::*fun)() const = &torrent::super_seeding;
+		TORRENT_SYNC_CALL_RET(bool, bind(fun, t), false);
 	}
 
 	void torrent_handle::super_seeding(bool on) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(super_seeding(on));
+		void (torrent::*fun)(bool) = &torrent::super_seeding;
+		TORRENT_ASYNC_CALL(bind(fun, t, on));
+	}
+
+	void torrent_handle::set_share_mode(bool s) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASYNC_CALL(bind(&torrent::set_share_mode, t, s));
 	}
 
 	void torrent_handle::set_ratio(float ratio) const
@@ -678,45 +861,52 @@ namespace libtorrent
 		TORRENT_ASSERT(ratio >= 0.f);
 		if (ratio < 1.f && ratio > 0.f)
 			ratio = 1.f;
-		TORRENT_FORWARD(set_ratio(ratio));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_ratio, t, ratio));
 	}
 
 #ifndef TORRENT_DISABLE_RESOLVE_COUNTRIES
 	void torrent_handle::resolve_countries(bool r)
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(resolve_countries(r));
+		TORRENT_ASYNC_CALL(bind(&torrent::resolve_countries, t, r));
 	}
 
 	bool torrent_handle::resolve_countries() const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD_RETURN(resolving_countries(), false);
+		TORRENT_SYNC_CALL_RET(bool, bind(&torrent::resolving_countries, t), false);
 	}
 #endif
 
 	void torrent_handle::get_full_peer_list(std::vector<peer_list_entry>& v) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(get_full_peer_list(v));
+		TORRENT_SYNC_CALL(bind(&torrent::get_full_peer_list, t, boost::ref(v)));
 	}
 
-	void torrent_handle::get_peer_info(std::vector<peer_info>& v) const
+	void torrent_handle::get_peer_info(std::vector<peer_info>& v
+		, boost::uint32_t flags) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(get_peer_info(v));
+		TORRENT_SYNC_CALL(bind(&torrent::get_peer_info, t, boost::ref(v), flags));
 	}
 
 	void torrent_handle::get_download_queue(std::vector<partial_piece_info>& queue) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(get_download_queue(queue));
+		TORRENT_SYNC_CALL(bind(&torrent::get_download_queue, t, boost::ref(queue)));
+	}
+
+	void torrent_handle::get_download_queue(download_queue_snapshot& queue) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_SYNC_CALL(bind(&torrent::get_download_queue_snapshot, t, boost::ref(queue)));
 	}
 
 	void torrent_handle::set_piece_deadline(int index, time_duration deadline, int flags) const
 	{
 		INVARIANT_CHECK;
-		TORRENT_FORWARD(set_piece_deadline(index, deadline, flags));
+		TORRENT_ASYNC_CALL(bind(&torrent::set_piece_deadline, t, index, deadline, flags));
 	}
 
 }
@@ -42,6 +42,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iterator>
 #include <algorithm>
 #include <set>
+#include <list>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -50,6 +51,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -257,6 +259,37 @@ namespace libtorrent
 		return true;
 	}
 
+	// extracts the file entries from the info dictionary into target.
+	// name is the (sanitized) name of the torrent
+	bool extract_file_list(lazy_entry const& info, file_storage& target
+		, std::string const& name, error_code& ec)
+	{
+		lazy_entry const* i = info.dict_find_list("files");
+		if (i)
+		{
+			if (extract_files(*i, target, name)) return true;
+			ec = error_code(errors::torrent_file_parse_failed, libtorrent_category);
+			return false;
+		}
+
+		// if there's no list of files, there has to be a length
+		// field.
+		file_entry e;
+		e.path = name;
+		e.offset = 0;
+		e.size = info.dict_find_int_value("length", -1);
+		// bitcomet pad file
+		if (e.path.string().find("_____padding_file_") != std::string::npos)
+			e.pad_file = true;
+		if (e.size < 0)
+		{
+			ec = error_code(errors::torrent_invalid_length, libtorrent_category);
+			return false;
+		}
+		target.add_file(e);
+		return true;
+	}
+
 	int merkle_get_parent(int tree_node)
 	{
 		// node 0 doesn't have a parent
@@ -310,6 +343,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 		, m_merkle_first_leaf(0)
@@ -342,6 +376,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 		, m_merkle_first_leaf(0)
@@ -355,6 +390,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 		, m_merkle_first_leaf(0)
@@ -373,6 +409,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 	{
@@ -394,6 +431,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 		, m_merkle_first_leaf(0)
@@ -420,6 +458,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 	{
@@ -430,6 +469,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 		, m_merkle_first_leaf(0)
@@ -447,6 +487,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 	{
@@ -468,6 +509,7 @@ namespace libtorrent
 		: m_creation_date(pt::ptime(pt::not_a_date_time))
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 	{
@@ -496,6 +538,7 @@ namespace libtorrent
 		, m_creation_date(pt::second_clock::universal_time())
 		, m_multifile(false)
 		, m_private(false)
+		, m_files_released(false)
 		, m_info_section_size(0)
 		, m_piece_hashes(0)
 	{}
@@ -509,6 +552,190 @@ namespace libtorrent
 		m_orig_files.reset(new file_storage(m_files));
 	}
 
+	bool torrent_info::release_files()
+	{
+		if (m_files_released) return true;
+		// a torrent (or anyone else) holding on to this object
+		// may have iterators or references into the file list.
+		// Renamed files can't be restored from the info section
+		if (refcount() > 1 || m_orig_files || !m_info_section) return false;
+		std::vector<file_entry>().swap(m_files.m_files);
+		std::vector<size_type>().swap(m_files.m_file_offsets);
+		m_files_released = true;
+		return true;
+	}
+
+	void torrent_info::decode_files() const
+	{
+		TORRENT_ASSERT(m_files_released);
+		boost::shared_array<char> section = metadata();
+		lazy_entry info;
+		int ret = lazy_bdecode(section.get(), section.get()
+			+ m_info_section_size, info);
+		TORRENT_ASSERT(ret == 0);
+
+		// the info section was validated when it was first
+		// parsed, so this is not expected to fail
+		file_storage fs;
+		fs.set_piece_length(m_files.piece_length());
+		error_code ec;
+		if (ret == 0 && info.type() == lazy_entry::dict_t)
+			extract_file_list(info, fs, m_files.name(), ec);
+		TORRENT_ASSERT(!ec);
+		TORRENT_ASSERT(fs.total_size() == m_files.total_size());
+		m_files.m_files.swap(fs.m_files);
+		m_files.m_file_offsets.swap(fs.m_file_offsets);
+		m_files_released = false;
+	}
+
+	// the info section of a torrent_info whose piece hashes have been
+	// paged out. Pages of hashes are read from the file as they're
+	// needed and the most recently used ones are kept in memory
+	struct piece_hash_file : boost::noncopyable
+	{
+		enum { hashes_per_page = 512 };
+
+		piece_hash_file(fs::path const& p, int hashes_offset
+			, int num_pieces, int cache_pages)
+			: m_path(p)
+			, m_hashes_offset(hashes_offset)
+			, m_num_pieces(num_pieces)
+			, m_cache_pages((std::max)(cache_pages, 1))
+		{}
+
+		~piece_hash_file()
+		{
+			m_file.close();
+#ifndef BOOST_NO_EXCEPTIONS
+			try {
+#endif
+				fs::remove(m_path);
+#ifndef BOOST_NO_EXCEPTIONS
+			} catch (std::exception&) {}
+#endif
+		}
+
+		bool write(char const* section, int size, error_code& ec)
+		{
+			if (!m_file.open(m_path, file::read_write, ec)) return false;
+			file::iovec_t b = { (void*)section, size_t(size) };
+			if (m_file.writev(0, &b, 1, ec) != size)
+			{
+				if (!ec) ec = error_code(errors::file_too_short, libtorrent_category);
+				return false;
+			}
+			return true;
+		}
+
+		bool read(size_type offset, char* buf, int size) const
+		{
+			error_code ec;
+			file::iovec_t b = { buf, size_t(size) };
+			mutex_t::scoped_lock l(m_mutex);
+			return m_file.readv(offset, &b, 1, ec) == size && !ec;
+		}
+
+		// if the page can't be read, the hash is all zeros, which
+		// makes the piece fail its hash check
+		sha1_hash hash_for_piece(int index)
+		{
+			TORRENT_ASSERT(index >= 0 && index < m_num_pieces);
+			int page = index / hashes_per_page;
+			mutex_t::scoped_lock l(m_mutex);
+			std::list<hash_page>::iterator i = m_pages.begin();
+			for (; i != m_pages.end(); ++i)
+				if (i->index == page) break;
+
+			if (i != m_pages.end())
+			{
+				m_pages.splice(m_pages.begin(), m_pages, i);
+			}
+			else
+			{
+				if (int(m_pages.size()) >= m_cache_pages) m_pages.pop_back();
+				m_pages.push_front(hash_page());
+				hash_page& p = m_pages.front();
+				p.index = page;
+				int first = page * hashes_per_page;
+				int size = (std::min)(int(hashes_per_page), m_num_pieces - first) * 20;
+				p.hashes.resize(size);
+				error_code ec;
+				file::iovec_t b = { &p.hashes[0], size_t(size) };
+				if (m_file.readv(m_hashes_offset + size_type(first) * 20, &b, 1, ec) != size)
+				{
+					// don't keep the failed page
+					m_pages.pop_front();
+					sha1_hash h;
+					h.clear();
+					return h;
+				}
+			}
+			return sha1_hash(&m_pages.front().hashes[(index % hashes_per_page) * 20]);
+		}
+
+	private:
+
+		typedef boost::mutex mutex_t;
+
+		struct hash_page
+		{
+			int index;
+			std::vector<char> hashes;
+		};
+
+		fs::path m_path;
+		int m_hashes_offset;
+		int m_num_pieces;
+		int m_cache_pages;
+
+		// protects m_file and m_pages. The hashes are looked up by
+		// the disk threads and the network thread
+		mutable mutex_t m_mutex;
+		mutable file m_file;
+		// most recently used first
+		std::list<hash_page> m_pages;
+	};
+
+	bool torrent_info::page_out_piece_hashes(fs::path const& path, int cache_pages
+		, error_code& ec)
+	{
+		if (m_hash_file) return true;
+		if (!m_info_section || !m_piece_hashes || is_merkle_torrent())
+		{
+			ec = error_code(errors::torrent_missing_pieces, libtorrent_category);
+			return false;
+		}
+
+		boost::shared_ptr<piece_hash_file> f(new piece_hash_file(path
+			, int(m_piece_hashes - m_info_section.get()), m_files.num_pieces()
+			, cache_pages));
+		if (!f->write(m_info_section.get(), m_info_section_size, ec))
+			return false;
+
+		m_hash_file = f;
+		m_piece_hashes = 0;
+		m_info_section.reset();
+		m_info_dict.clear();
+		return true;
+	}
+
+	sha1_hash torrent_info::paged_hash_for_piece(int index) const
+	{
+		TORRENT_ASSERT(m_hash_file);
+		TORRENT_ASSERT(index >= 0);
+		TORRENT_ASSERT(index < m_files.num_pieces());
+		return m_hash_file->hash_for_piece(index);
+	}
+
+	boost::shared_array<char> torrent_info::load_info_section() const
+	{
+		TORRENT_ASSERT(m_hash_file);
+		boost::shared_array<char> ret(new char[m_info_section_size]);
+		if (!m_hash_file->read(0, ret.get(), m_info_section_size))
+			return boost::shared_array<char>();
+		return ret;
+	}
+
 	void torrent_info::swap(torrent_info& ti)
 	{
 		using std::swap;
@@ -523,9 +750,11 @@ namespace libtorrent
 		m_created_by.swap(ti.m_created_by);
 		swap(m_multifile, ti.m_multifile);
 		swap(m_private, ti.m_private);
+		swap(m_files_released, ti.m_files_released);
 		swap(m_info_section, ti.m_info_section);
 		swap(m_info_section_size, ti.m_info_section_size);
 		swap(m_piece_hashes, ti.m_piece_hashes);
+		m_hash_file.swap(ti.m_hash_file);
 		swap(m_info_dict, ti.m_info_dict);
 	}
 
@@ -605,35 +834,8 @@ namespace libtorrent
 		verify_encoding(name);
 	
 		// extract file list
-		lazy_entry const* i = info.dict_find_list("files");
-		if (i == 0)
-		{
-			// if there's no list of files, there has to be a length
-			// field.
-			file_entry e;
-			e.path = name;
-			e.offset = 0;
-			e.size = info.dict_find_int_value("length", -1);
-			// bitcomet pad file
-			if (e.path.string().find("_____padding_file_") != std::string::npos)
-				e.pad_file = true;
-			if (e.size < 0)
-			{
-				ec = error_code(errors::torrent_invalid_length, libtorrent_category);
-				return false;
-			}
-			m_files.add_file(e);
-			m_multifile = false;
-		}
-		else
-		{
-			if (!extract_files(*i, m_files, name))
-			{
-				ec = error_code(errors::torrent_file_parse_failed, libtorrent_category);
-				return false;
-			}
-			m_multifile = true;
-		}
+		if (!extract_file_list(info, m_files, name, ec)) return false;
+		m_multifile = info.dict_find_list("files") != 0;
 		m_files.set_name(name);
 
 		// extract sha-1 hashes for all pieces
@@ -684,73 +886,94 @@ namespace libtorrent
 		return true;
 	}
 
-	bool torrent_info::add_merkle_nodes(std::map<int, sha1_hash> const& subtree
+	namespace
+	{
+		sha1_hash const* find_merkle_node(merkle_node_list const& l, int n)
+		{
+			// the all-zero hash sorts first
+			merkle_node_list::const_iterator i = std::lower_bound(l.begin(), l.end()
+				, std::make_pair(n, sha1_hash(0)));
+			if (i == l.end() || i->first != n) return 0;
+			return &i->second;
+		}
+	}
+
+	bool torrent_info::add_merkle_nodes(merkle_node_list const& subtree
 		, int piece)
 	{
+		sha1_hash const zero(0);
 		int n = m_merkle_first_leaf + piece;
-		typedef std::map<int, sha1_hash>::const_iterator iter;
-		iter i = subtree.find(n);
-		if (i == subtree.end()) return false;
-		sha1_hash h = i->second;
-
-		// if the verification passes, these are the
-		// nodes to add to our tree
-		std::map<int, sha1_hash> to_add;
-
-		while (n > 0)
+		sha1_hash const* leaf = find_merkle_node(subtree, n);
+		// the peer may leave out the hashes if we already have them
+		if (leaf == 0) return m_merkle_tree[n] != zero;
+		sha1_hash h = *leaf;
+
+		// if the verification passes, these are the nodes to add
+		// to our tree. There are at most two per level
+		std::pair<int, sha1_hash> to_add[64];
+		int num_add = 0;
+
+		// walk towards the root until we reach a node we already
+		// have. Since every node in our tree has been verified, that
+		// node can be compared against instead of the root. For a
+		// piece next to one we already have, that's a level or two
+		// up, and siblings we already have don't have to be sent
+		while (m_merkle_tree[n] == zero)
 		{
+			// the root is always known
+			TORRENT_ASSERT(n > 0);
+			TORRENT_ASSERT(num_add + 2 <= int(sizeof(to_add) / sizeof(to_add[0])));
 			int sibling = merkle_get_sibling(n);
-			int parent = merkle_get_parent(n);
-			iter sibling_hash = subtree.find(sibling);
-			if (sibling_hash == subtree.end())
-				return false;
-			to_add[n] = h;
-			to_add[sibling] = sibling_hash->second;
+			sha1_hash const* sibling_hash = &m_merkle_tree[sibling];
+			if (*sibling_hash == zero)
+			{
+				sibling_hash = find_merkle_node(subtree, sibling);
+				if (sibling_hash == 0) return false;
+				to_add[num_add++] = std::make_pair(sibling, *sibling_hash);
+			}
+			to_add[num_add++] = std::make_pair(n, h);
 			hasher hs;
 			if (sibling < n)
 			{
-				hs.update((char const*)&sibling_hash->second[0], 20);
+				hs.update((char const*)&(*sibling_hash)[0], 20);
 				hs.update((char const*)&h[0], 20);
 			}
 			else
 			{
 				hs.update((char const*)&h[0], 20);
-				hs.update((char const*)&sibling_hash->second[0], 20);
+				hs.update((char const*)&(*sibling_hash)[0], 20);
 			}
 			h = hs.final();
-			n = parent;
+			n = merkle_get_parent(n);
 		}
-		if (h != m_merkle_tree[0]) return false;
+		if (h != m_merkle_tree[n]) return false;
 
-		// the nodes and piece hash matched the root-hash
-		// insert them into our tree
-
-		for (std::map<int, sha1_hash>::iterator i = to_add.begin()
-			, end(to_add.end()); i != end; ++i)
-		{
-			m_merkle_tree[i->first] = i->second;
-		}
+		// the nodes and piece hash matched a verified
+		// node, insert them into our tree
+		for (int i = 0; i < num_add; ++i)
+			m_merkle_tree[to_add[i].first] = to_add[i].second;
 		return true;
 	}
 
 	// builds a list of nodes that are required to verify
 	// the given piece
-	std::map<int, sha1_hash> torrent_info::build_merkle_list(int piece) const
+	merkle_node_list torrent_info::build_merkle_list(int piece) const
 	{
-		std::map<int, sha1_hash> ret;
+		merkle_node_list ret;
 		int n = m_merkle_first_leaf + piece;
-		ret[n] = m_merkle_tree[n];
-		ret[0] = m_merkle_tree[0];
+		ret.push_back(std::make_pair(0, m_merkle_tree[0]));
+		ret.push_back(std::make_pair(n, m_merkle_tree[n]));
 		while (n > 0)
 		{
 			int sibling = merkle_get_sibling(n);
 			int parent = merkle_get_parent(n);
-			ret[sibling] = m_merkle_tree[sibling];
+			ret.push_back(std::make_pair(sibling, m_merkle_tree[sibling]));
 			// we cannot build the tree path if one
 			// of the nodes in the tree is missing
 			TORRENT_ASSERT(m_merkle_tree[sibling] != sha1_hash(0));
 			n = parent;
 		}
+		std::sort(ret.begin(), ret.end());
 		return ret;
 	}
 
@@ -925,6 +1148,7 @@ namespace libtorrent
 		os << "number of pieces: " << num_pieces() << "\n";
 		os << "piece length: " << piece_length() << "\n";
 		os << "files:\n";
+		load_files();
 		for (file_storage::iterator i = m_files.begin(); i != m_files.end(); ++i)
 			os << "  " << std::setw(11) << i->size << "  " << i->path.string() << "\n";
 	}
@@ -0,0 +1,135 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/trace.hpp"
+#include <cstdio>
+#include <climits>
+
+namespace libtorrent
+{
+	trace_buffer::trace_buffer()
+		: m_next(0)
+		, m_wrapped(false)
+		, m_size(0)
+		, m_epoch(time_now_hires())
+	{}
+
+	void trace_buffer::resize(int size)
+	{
+		if (size < 0) size = 0;
+		mutex_t::scoped_lock l(m_mutex);
+		if (size == int(m_events.size())) return;
+		// changing the size drops the recorded events. It's
+		// only expected to happen when tracing is turned on or off
+		std::vector<trace_event>().swap(m_events);
+		m_events.resize(size);
+		m_next = 0;
+		m_wrapped = false;
+		m_size = size;
+	}
+
+	void trace_buffer::record(char const* category, char const* name
+		, ptime start, boost::int64_t duration, int thread
+		, char const* name0, int arg0, char const* name1, int arg1
+		, char const* name2, int arg2)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		// the buffer may have been disabled since m_size was checked
+		if (m_events.empty()) return;
+		trace_event& e = m_events[m_next];
+		e.category = category;
+		e.name = name;
+		e.start = total_microseconds(start - m_epoch);
+		e.duration = duration > INT_MAX ? INT_MAX : boost::int32_t(duration);
+		e.thread = thread;
+		e.arg_name[0] = name0;
+		e.arg[0] = arg0;
+		e.arg_name[1] = name1;
+		e.arg[1] = arg1;
+		e.arg_name[2] = name2;
+		e.arg[2] = arg2;
+		if (++m_next == int(m_events.size()))
+		{
+			m_next = 0;
+			m_wrapped = true;
+		}
+	}
+
+	void trace_buffer::get_events(std::vector<trace_event>& ret) const
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		if (m_wrapped)
+		{
+			ret.insert(ret.end(), m_events.begin() + m_next, m_events.end());
+		}
+		ret.insert(ret.end(), m_events.begin(), m_events.begin() + m_next);
+	}
+
+	std::string chrome_trace(std::vector<trace_event> const& events)
+	{
+		std::string ret = "{\"traceEvents\":[";
+		char buf[300];
+		for (std::vector<trace_event>::const_iterator i = events.begin()
+			, end(events.end()); i != end; ++i)
+		{
+			if (i != events.begin()) ret += ",\n";
+			if (i->duration >= 0)
+			{
+				snprintf(buf, sizeof(buf), "{\"cat\":\"%s\",\"name\":\"%s\""
+					",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%d,\"pid\":0,\"tid\":%d"
+					, i->category, i->name, i->start, int(i->duration), i->thread);
+			}
+			else
+			{
+				snprintf(buf, sizeof(buf), "{\"cat\":\"%s\",\"name\":\"%s\""
+					",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRId64 ",\"pid\":0,\"tid\":%d"
+					, i->category, i->name, i->start, i->thread);
+			}
+			ret += buf;
+			ret += ",\"args\":{";
+			bool first = true;
+			for (int k = 0; k < 3; ++k)
+			{
+				if (i->arg_name[k] == 0) continue;
+				snprintf(buf, sizeof(buf), "%s\"%s\":%d"
+					, first ? "" : ",", i->arg_name[k], i->arg[k]);
+				first = false;
+				ret += buf;
+			}
+			ret += "}}";
+		}
+		ret += "]}\n";
+		return ret;
+	}
+}
+
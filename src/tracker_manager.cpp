@@ -40,6 +40,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/tracker_manager.hpp"
 #include "libtorrent/http_tracker_connection.hpp"
 #include "libtorrent/udp_tracker_connection.hpp"
+#include "libtorrent/http_connection.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/torrent.hpp"
@@ -138,6 +139,7 @@ namespace libtorrent
 		, m_requester(r)
 		, m_man(man)
 		, m_req(req)
+		, m_request_start(time_now_hires())
 	{}
 
 	boost::shared_ptr<request_callback> tracker_connection::requester()
@@ -162,6 +164,11 @@ namespace libtorrent
 		m_man.received_bytes(bytes);
 	}
 
+	void tracker_connection::response_received()
+	{
+		m_man.record_round_trip(time_now_hires() - m_request_start);
+	}
+
 	void tracker_connection::fail_timeout()
 	{
 		boost::shared_ptr<request_callback> cb = requester();
@@ -193,6 +200,116 @@ namespace libtorrent
 		m_ses.m_stat.received_tracker_bytes(bytes);
 	}
 
+	void tracker_manager::record_round_trip(time_duration rtt)
+	{
+		aux::session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+		m_ses.m_latency.tracker_round_trip.add(rtt);
+	}
+
+	bool tracker_manager::get_udp_connection_id(udp::endpoint const& ep
+		, boost::int64_t& id) const
+	{
+		mutex_t::scoped_lock l(m_mutex);
+
+		udp_conns_t::const_iterator i = m_udp_conns.find(ep);
+		if (i == m_udp_conns.end()) return false;
+		if (i->second.expires < time_now()) return false;
+		id = i->second.connection_id;
+		return true;
+	}
+
+	void tracker_manager::set_udp_connection_id(udp::endpoint const& ep
+		, boost::int64_t id)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+
+		ptime now = time_now();
+		// drop the ids that have expired, the trackers
+		// won't accept them anyway
+		for (udp_conns_t::iterator i = m_udp_conns.begin();
+			i != m_udp_conns.end();)
+		{
+			if (i->second.expires < now) m_udp_conns.erase(i++);
+			else ++i;
+		}
+
+		udp_connection_id& c = m_udp_conns[ep];
+		c.connection_id = id;
+		// the id is valid for one minute after the tracker sent it.
+		// Leave some margin for the time the request spends in flight
+		c.expires = now + seconds(50);
+	}
+
+	resolver& tracker_manager::host_resolver()
+	{
+		return m_ses.m_host_resolver;
+	}
+
+	void tracker_manager::remove_udp_connection_id(udp::endpoint const& ep)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		m_udp_conns.erase(ep);
+	}
+
+	namespace
+	{
+		enum
+		{
+			// idle tracker connections are closed after this many
+			// seconds, most servers time them out soon after that
+			max_http_idle_time = 30,
+			max_idle_http_connections = 32
+		};
+	}
+
+	boost::shared_ptr<http_connection> tracker_manager::get_http_connection(
+		std::string const& host)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+
+		ptime now = time_now();
+		boost::shared_ptr<http_connection> ret;
+		for (std::list<idle_http_connection>::iterator i
+			= m_idle_http_connections.begin(); i != m_idle_http_connections.end();)
+		{
+			if (now - i->idle_since > seconds(max_http_idle_time)
+				|| !i->connection->keep_alive())
+			{
+				i->connection->close();
+				m_idle_http_connections.erase(i++);
+				continue;
+			}
+			if (!ret && i->host == host)
+			{
+				ret = i->connection;
+				m_idle_http_connections.erase(i++);
+				continue;
+			}
+			++i;
+		}
+		return ret;
+	}
+
+	void tracker_manager::release_http_connection(std::string const& host
+		, boost::shared_ptr<http_connection> const& c)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+
+		if (m_abort || !c->keep_alive()
+			|| int(m_idle_http_connections.size()) >= max_idle_http_connections)
+		{
+			c->close();
+			return;
+		}
+		// the handlers keep the previous owner alive
+		c->set_handlers(http_handler());
+		idle_http_connection ic;
+		ic.host = host;
+		ic.connection = c;
+		ic.idle_since = time_now();
+		m_idle_http_connections.push_back(ic);
+	}
+
 	void tracker_manager::remove_request(tracker_connection const* c)
 	{
 		mutex_t::scoped_lock l(m_mutex);
@@ -222,6 +339,73 @@ namespace libtorrent
 		if (m_abort && req.event != tracker_request::stopped)
 			return;
 
+		// stopped events are never held back, they have to go out
+		// before the session shuts down
+		int rate = m_ses.settings().tracker_requests_per_second;
+		if (rate > 0 && req.event != tracker_request::stopped
+			&& (m_request_quota < 1.f || !m_queued_requests.empty()))
+		{
+			// started and completed events go before regular
+			// announces, which go before scrapes
+			boost::shared_ptr<request_callback> cb = c.lock();
+			int prio = cb ? cb->tracker_request_priority() : 0;
+			if (req.kind == tracker_request::scrape_request)
+				prio -= 2000000;
+			else if (req.event != tracker_request::none)
+				prio += 1000000;
+
+			queued_request q;
+			q.ios = &ios;
+			q.cc = &cc;
+			q.req = req;
+			q.auth = auth;
+			q.callback = c;
+			m_queued_requests.insert(std::make_pair(prio, q));
+			return;
+		}
+		if (rate > 0 && req.event != tracker_request::stopped)
+			m_request_quota -= 1.f;
+
+		start_request(ios, cc, req, auth, c);
+	}
+
+	void tracker_manager::tick(time_duration elapsed)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+
+		int rate = m_ses.settings().tracker_requests_per_second;
+		if (rate <= 0)
+		{
+			// the limit was turned off
+			while (!m_queued_requests.empty() && !m_abort)
+			{
+				queued_request q = m_queued_requests.begin()->second;
+				m_queued_requests.erase(m_queued_requests.begin());
+				start_request(*q.ios, *q.cc, q.req, q.auth, q.callback);
+			}
+			return;
+		}
+
+		// allow bursts of up to one second worth of requests
+		m_request_quota += rate * total_microseconds(elapsed) / 1000000.f;
+		if (m_request_quota > rate) m_request_quota = float(rate);
+
+		while (!m_queued_requests.empty() && m_request_quota >= 1.f && !m_abort)
+		{
+			queued_request q = m_queued_requests.begin()->second;
+			m_queued_requests.erase(m_queued_requests.begin());
+			m_request_quota -= 1.f;
+			start_request(*q.ios, *q.cc, q.req, q.auth, q.callback);
+		}
+	}
+
+	void tracker_manager::start_request(
+		io_service& ios
+		, connection_queue& cc
+		, tracker_request const& req
+		, std::string const& auth
+		, boost::weak_ptr<request_callback> c)
+	{
 		std::string protocol = req.url.substr(0, req.url.find(':'));
 
 		boost::intrusive_ptr<tracker_connection> con;
@@ -264,6 +448,7 @@ namespace libtorrent
 		mutex_t::scoped_lock l(m_mutex);
 
 		m_abort = true;
+		m_queued_requests.clear();
 		tracker_connections_t keep_connections;
 
 		while (!m_connections.empty())
@@ -292,6 +477,11 @@ namespace libtorrent
 		}
 
 		std::swap(m_connections, keep_connections);
+
+		for (std::list<idle_http_connection>::iterator i
+			= m_idle_http_connections.begin(); i != m_idle_http_connections.end(); ++i)
+			i->connection->close();
+		m_idle_http_connections.clear();
 	}
 	
 	bool tracker_manager::empty() const
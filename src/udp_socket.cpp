@@ -57,6 +57,8 @@ udp_socket::udp_socket(asio::io_service& ios, udp_socket::callback_t const& c
 	, m_connection_ticket(-1)
 	, m_cc(cc)
 	, m_resolver(ios)
+	, m_retry_timer(ios)
+	, m_retry_delay(0)
 	, m_tunnel_packets(false)
 	, m_abort(false)
 {
@@ -111,6 +113,20 @@ void udp_socket::send(udp::endpoint const& ep, char const* p, int len, error_cod
 #endif
 }
 
+namespace
+{
+	// errors that don't stop us from listening on the socket
+	bool is_recoverable(error_code const& e)
+	{
+		return e == asio::error::host_unreachable
+			|| e == asio::error::fault
+			|| e == asio::error::connection_reset
+			|| e == asio::error::connection_refused
+			|| e == asio::error::connection_aborted
+			|| e == asio::error::message_size;
+	}
+}
+
 void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_transferred)
 {
 	TORRENT_ASSERT(m_magic == 0x1337);
@@ -157,12 +173,7 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 		l.lock();
 
 		// don't stop listening on recoverable errors
-		if (e != asio::error::host_unreachable
-			&& e != asio::error::fault
-			&& e != asio::error::connection_reset
-			&& e != asio::error::connection_refused
-			&& e != asio::error::connection_aborted
-			&& e != asio::error::message_size)
+		if (!is_recoverable(e))
 		{
 			if (m_outstanding == 0)
 			{
@@ -181,11 +192,15 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 		if (s == &m_ipv4_sock)
 #endif
 			s->async_receive_from(asio::buffer(m_v4_buf, sizeof(m_v4_buf))
-				, m_v4_ep, boost::bind(&udp_socket::on_read, this, s, _1, _2));
+				, m_v4_ep, make_allocating_handler(
+					boost::bind(&udp_socket::on_read, this, s, _1, _2)
+					, m_v4_read_storage));
 #if TORRENT_USE_IPV6
 		else
 			s->async_receive_from(asio::buffer(m_v6_buf, sizeof(m_v6_buf))
-				, m_v6_ep, boost::bind(&udp_socket::on_read, this, s, _1, _2));
+				, m_v6_ep, make_allocating_handler(
+					boost::bind(&udp_socket::on_read, this, s, _1, _2)
+					, m_v6_read_storage));
 #endif
 
 		++m_outstanding;
@@ -220,10 +235,13 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 		} catch(std::exception&) {}
 #endif
 
+		drain(s, m_v4_buf, sizeof(m_v4_buf), m_v4_ep, l);
 		if (m_abort) return;
 
 		s->async_receive_from(asio::buffer(m_v4_buf, sizeof(m_v4_buf))
-			, m_v4_ep, boost::bind(&udp_socket::on_read, this, s, _1, _2));
+			, m_v4_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, s, _1, _2)
+				, m_v4_read_storage));
 	}
 #if TORRENT_USE_IPV6
 	else
@@ -248,10 +266,13 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 #endif
 		l.lock();
 
+		drain(s, m_v6_buf, sizeof(m_v6_buf), m_v6_ep, l);
 		if (m_abort) return;
 
 		s->async_receive_from(asio::buffer(m_v6_buf, sizeof(m_v6_buf))
-			, m_v6_ep, boost::bind(&udp_socket::on_read, this, s, _1, _2));
+			, m_v6_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, s, _1, _2)
+				, m_v6_read_storage));
 	}
 #endif
 	++m_outstanding;
@@ -260,6 +281,38 @@ void udp_socket::on_read(udp::socket* s, error_code const& e, std::size_t bytes_
 #endif
 }
 
+void udp_socket::drain(udp::socket* s, char* buf, int size
+	, udp::endpoint& ep, mutex_t::scoped_lock& l)
+{
+	// the number of packets to read before going back to the
+	// reactor, to give the other sockets a chance
+	const int max_batch = 32;
+
+	for (int i = 0; i < max_batch && !m_abort && m_callback; ++i)
+	{
+		error_code ec;
+		std::size_t len = s->receive_from(asio::buffer(buf, size), ep, 0, ec);
+		if (ec == asio::error::would_block || ec == asio::error::try_again) return;
+		// the next async_receive_from() will report this one
+		if (ec && !is_recoverable(ec)) return;
+
+		l.unlock();
+#ifndef BOOST_NO_EXCEPTIONS
+		try {
+#endif
+		if (ec)
+			m_callback(ec, ep, 0, 0);
+		else if (m_tunnel_packets && ep == m_proxy_addr)
+			unwrap(ec, buf, len);
+		else
+			m_callback(ec, ep, buf, len);
+#ifndef BOOST_NO_EXCEPTIONS
+		} catch(std::exception&) {}
+#endif
+		l.lock();
+	}
+}
+
 void udp_socket::wrap(udp::endpoint const& ep, char const* p, int len, error_code& ec)
 {
 	CHECK_MAGIC;
@@ -338,6 +391,7 @@ void udp_socket::close()
 	m_ipv6_sock.close(ec);
 #endif
 	m_socks5_sock.close(ec);
+	m_retry_timer.cancel(ec);
 	m_resolver.cancel();
 	m_abort = true;
 	if (m_connection_ticket >= 0)
@@ -355,6 +409,18 @@ void udp_socket::close()
 	}
 }
 
+namespace
+{
+	// drain() relies on receive_from() not blocking. The
+	// asynchronous operations work the same either way
+	void set_non_blocking(udp::socket& s)
+	{
+		udp::socket::non_blocking_io ioc(true);
+		error_code ec;
+		s.io_control(ioc, ec);
+	}
+}
+
 void udp_socket::bind(udp::endpoint const& ep, error_code& ec)
 {
 	CHECK_MAGIC;
@@ -371,8 +437,11 @@ void udp_socket::bind(udp::endpoint const& ep, error_code& ec)
 		if (ec) return;
 		m_ipv4_sock.bind(ep, ec);
 		if (ec) return;
+		set_non_blocking(m_ipv4_sock);
 		m_ipv4_sock.async_receive_from(asio::buffer(m_v4_buf, sizeof(m_v4_buf))
-			, m_v4_ep, boost::bind(&udp_socket::on_read, this, &m_ipv4_sock, _1, _2));
+			, m_v4_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, &m_ipv4_sock, _1, _2)
+				, m_v4_read_storage));
 	}
 #if TORRENT_USE_IPV6
 	else
@@ -381,8 +450,11 @@ void udp_socket::bind(udp::endpoint const& ep, error_code& ec)
 		if (ec) return;
 		m_ipv6_sock.bind(ep, ec);
 		if (ec) return;
+		set_non_blocking(m_ipv6_sock);
 		m_ipv6_sock.async_receive_from(asio::buffer(m_v6_buf, sizeof(m_v6_buf))
-			, m_v6_ep, boost::bind(&udp_socket::on_read, this, &m_ipv6_sock, _1, _2));
+			, m_v6_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, &m_ipv6_sock, _1, _2)
+				, m_v6_read_storage));
 	}
 #endif
 	++m_outstanding;
@@ -408,8 +480,11 @@ void udp_socket::bind(int port)
 	if (!ec)
 	{
 		m_ipv4_sock.bind(udp::endpoint(address_v4::any(), port), ec);
+		set_non_blocking(m_ipv4_sock);
 		m_ipv4_sock.async_receive_from(asio::buffer(m_v4_buf, sizeof(m_v4_buf))
-			, m_v4_ep, boost::bind(&udp_socket::on_read, this, &m_ipv4_sock, _1, _2));
+			, m_v4_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, &m_ipv4_sock, _1, _2)
+				, m_v4_read_storage));
 		++m_outstanding;
 #ifdef TORRENT_DEBUG
 		m_started = true;
@@ -421,8 +496,11 @@ void udp_socket::bind(int port)
 	{
 		m_ipv6_sock.set_option(v6only(true), ec);
 		m_ipv6_sock.bind(udp::endpoint(address_v6::any(), port), ec);
+		set_non_blocking(m_ipv6_sock);
 		m_ipv6_sock.async_receive_from(asio::buffer(m_v6_buf, sizeof(m_v6_buf))
-			, m_v6_ep, boost::bind(&udp_socket::on_read, this, &m_ipv6_sock, _1, _2));
+			, m_v6_ep, make_allocating_handler(
+				boost::bind(&udp_socket::on_read, this, &m_ipv6_sock, _1, _2)
+				, m_v6_read_storage));
 		++m_outstanding;
 #ifdef TORRENT_DEBUG
 		m_started = true;
@@ -439,26 +517,70 @@ void udp_socket::set_proxy_settings(proxy_settings const& ps)
 
 	error_code ec;
 	m_socks5_sock.close(ec);
+	m_retry_timer.cancel(ec);
+	m_retry_delay = 0;
 	m_tunnel_packets = false;
 	
 	m_proxy_settings = ps;
 
 	if (ps.type == proxy_settings::socks5
 		|| ps.type == proxy_settings::socks5_pw)
-	{
-		// connect to socks5 server and open up the UDP tunnel
-		tcp::resolver::query q(ps.hostname, to_string(ps.port).elems);
-		m_resolver.async_resolve(q, boost::bind(
-			&udp_socket::on_name_lookup, this, _1, _2));
-	}
+		connect_socks5();
 }
 
-void udp_socket::on_name_lookup(error_code const& e, tcp::resolver::iterator i)
+void udp_socket::connect_socks5()
+{
+	// connect to socks5 server and open up the UDP tunnel
+	tcp::resolver::query q(m_proxy_settings.hostname
+		, to_string(m_proxy_settings.port).elems);
+	m_resolver.async_resolve(q, boost::bind(
+		&udp_socket::on_name_lookup, this, _1, _2));
+}
+
+void udp_socket::socks5_failed(error_code const& e)
+{
+	// the socket was closed by set_proxy_settings() or close()
+	if (e == asio::error::operation_aborted) return;
+	if (m_abort) return;
+
+	// packets keep being sent to the old UDP relay until the
+	// new association is up. Sending them directly would
+	// bypass the proxy. The first retry is immediate, after
+	// that the delay doubles up to a minute
+	error_code ec;
+	m_socks5_sock.close(ec);
+	m_retry_timer.expires_from_now(seconds(m_retry_delay), ec);
+	m_retry_timer.async_wait(boost::bind(&udp_socket::on_retry_socks5, this, _1));
+	m_retry_delay = (std::min)((std::max)(m_retry_delay * 2, 1), 60);
+}
+
+void udp_socket::on_retry_socks5(error_code const& e)
 {
 	if (e) return;
 	CHECK_MAGIC;
+	mutex_t::scoped_lock l(m_mutex);	
+	if (m_abort) return;
+	if (m_proxy_settings.type != proxy_settings::socks5
+		&& m_proxy_settings.type != proxy_settings::socks5_pw) return;
+	connect_socks5();
+}
+
+void udp_socket::hung_up(error_code const& e)
+{
+	CHECK_MAGIC;
+	mutex_t::scoped_lock l(m_mutex);	
+	// the proxy never sends anything on the control connection,
+	// any completion means it's gone, and the UDP association
+	// with it
+	socks5_failed(e ? e : error_code(asio::error::connection_reset));
+}
+
+void udp_socket::on_name_lookup(error_code const& e, tcp::resolver::iterator i)
+{
+	CHECK_MAGIC;
 
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	m_proxy_addr.address(i->endpoint().address());
 	m_proxy_addr.port(i->endpoint().port());
@@ -475,6 +597,7 @@ void udp_socket::on_timeout()
 	error_code ec;
 	m_socks5_sock.close(ec);
 	m_connection_ticket = -1;
+	socks5_failed(asio::error::timed_out);
 }
 
 void udp_socket::on_connect(int ticket)
@@ -485,6 +608,8 @@ void udp_socket::on_connect(int ticket)
 	m_connection_ticket = ticket;
 	error_code ec;
 	m_socks5_sock.open(m_proxy_addr.address().is_v4()?tcp::v4():tcp::v6(), ec);
+	// the UDP association only lasts as long as this connection
+	m_socks5_sock.set_option(tcp::socket::keep_alive(true), ec);
 	m_socks5_sock.async_connect(tcp::endpoint(m_proxy_addr.address(), m_proxy_addr.port())
 		, boost::bind(&udp_socket::on_connected, this, _1));
 }
@@ -496,7 +621,7 @@ void udp_socket::on_connected(error_code const& e)
 	mutex_t::scoped_lock l(m_mutex);	
 	m_cc.done(m_connection_ticket);
 	m_connection_ticket = -1;
-	if (e) return;
+	if (e) { socks5_failed(e); return; }
 
 	using namespace libtorrent::detail;
 
@@ -522,9 +647,8 @@ void udp_socket::on_connected(error_code const& e)
 void udp_socket::handshake1(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
-
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	asio::async_read(m_socks5_sock, asio::buffer(m_tmp_buf, 2)
 		, boost::bind(&udp_socket::handshake2, this, _1));
@@ -533,17 +657,16 @@ void udp_socket::handshake1(error_code const& e)
 void udp_socket::handshake2(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
+	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	using namespace libtorrent::detail;
 
-	mutex_t::scoped_lock l(m_mutex);	
-
 	char* p = &m_tmp_buf[0];
 	int version = read_uint8(p);
 	int method = read_uint8(p);
 
-	if (version < 5) return;
+	if (version < 5) { socks5_failed(asio::error::operation_not_supported); return; }
 
 	if (method == 0)
 	{
@@ -579,9 +702,8 @@ void udp_socket::handshake2(error_code const& e)
 void udp_socket::handshake3(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
-
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	asio::async_read(m_socks5_sock, asio::buffer(m_tmp_buf, 2)
 		, boost::bind(&udp_socket::handshake4, this, _1));
@@ -590,9 +712,8 @@ void udp_socket::handshake3(error_code const& e)
 void udp_socket::handshake4(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
-
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	using namespace libtorrent::detail;
 
@@ -600,8 +721,11 @@ void udp_socket::handshake4(error_code const& e)
 	int version = read_uint8(p);
 	int status = read_uint8(p);
 
-	if (version != 1) return;
-	if (status != 0) return;
+	if (version != 1 || status != 0)
+	{
+		socks5_failed(asio::error::operation_not_supported);
+		return;
+	}
 
 	socks_forward_udp();
 }
@@ -629,9 +753,8 @@ void udp_socket::socks_forward_udp()
 void udp_socket::connect1(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
-
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	asio::async_read(m_socks5_sock, asio::buffer(m_tmp_buf, 10)
 		, boost::bind(&udp_socket::connect2, this, _1));
@@ -640,9 +763,8 @@ void udp_socket::connect1(error_code const& e)
 void udp_socket::connect2(error_code const& e)
 {
 	CHECK_MAGIC;
-	if (e) return;
-
 	mutex_t::scoped_lock l(m_mutex);	
+	if (e) { socks5_failed(e); return; }
 
 	using namespace libtorrent::detail;
 
@@ -652,8 +774,11 @@ void udp_socket::connect2(error_code const& e)
 	read_uint8(p); // RESERVED
 	int atyp = read_uint8(p); // address type
 
-	if (version != 5) return;
-	if (status != 0) return;
+	if (version != 5 || status != 0)
+	{
+		socks5_failed(asio::error::operation_not_supported);
+		return;
+	}
 
 	if (atyp == 1)
 	{
@@ -667,6 +792,10 @@ void udp_socket::connect2(error_code const& e)
 	}
 	
 	m_tunnel_packets = true;
+	m_retry_delay = 0;
+
+	asio::async_read(m_socks5_sock, asio::buffer(m_tmp_buf, 1)
+		, boost::bind(&udp_socket::hung_up, this, _1));
 }
 
 rate_limited_udp_socket::rate_limited_udp_socket(io_service& ios
@@ -80,12 +80,14 @@ namespace libtorrent
 		, proxy_settings const& proxy)
 		: tracker_connection(man, req, ios, c)
 		, m_man(man)
-		, m_name_lookup(ios)
 		, m_socket(ios, boost::bind(&udp_tracker_connection::on_receive, self(), _1, _2, _3, _4), cc)
+		, m_port(0)
 		, m_transaction_id(0)
 		, m_connection_id(0)
 		, m_ses(ses)
 		, m_attempts(0)
+		, m_cached_connection_id(false)
+		, m_abort(false)
 		, m_state(action_error)
 	{
 		m_socket.set_proxy_settings(proxy);
@@ -109,10 +111,9 @@ namespace libtorrent
 		
 		session_settings const& settings = m_ses.settings();
 
-		udp::resolver::query q(hostname, to_string(port).elems);
-		m_name_lookup.async_resolve(q
-			, boost::bind(
-			&udp_tracker_connection::name_lookup, self(), _1, _2));
+		m_port = port;
+		m_man.host_resolver().async_resolve(hostname
+			, boost::bind(&udp_tracker_connection::name_lookup, self(), _1, _2));
 		set_timeout(tracker_req().event == tracker_request::stopped
 			? settings.stop_tracker_timeout
 			: settings.tracker_completion_timeout
@@ -124,10 +125,10 @@ namespace libtorrent
 	}
 
 	void udp_tracker_connection::name_lookup(error_code const& error
-		, udp::resolver::iterator i)
+		, std::vector<address> const& addresses)
 	{
-		if (error == asio::error::operation_aborted) return;
-		if (error || i == udp::resolver::iterator())
+		if (m_abort || error == asio::error::operation_aborted) return;
+		if (error || addresses.empty())
 		{
 			fail(-1, error.message().c_str());
 			return;
@@ -143,8 +144,9 @@ namespace libtorrent
 		// we're listening on. To make sure the tracker get our
 		// correct listening address.
 
-		std::transform(i, udp::resolver::iterator(), std::back_inserter(m_endpoints)
-			, boost::bind(&udp::resolver::iterator::value_type::endpoint, _1));
+		for (std::vector<address>::const_iterator i = addresses.begin()
+			, end(addresses.end()); i != end; ++i)
+			m_endpoints.push_back(udp::endpoint(*i, m_port));
 
 		// remove endpoints that are filtered by the IP filter
 		for (std::list<udp::endpoint>::iterator i = m_endpoints.begin();
@@ -206,6 +208,18 @@ namespace libtorrent
 				return;
 			}
 		}
+
+		// if another request to this tracker connected recently,
+		// skip the connect and send the request right away
+		if (m_man.get_udp_connection_id(m_target, m_connection_id))
+		{
+			m_cached_connection_id = true;
+			if (tracker_req().kind == tracker_request::announce_request)
+				send_udp_announce();
+			else if (tracker_req().kind == tracker_request::scrape_request)
+				send_udp_scrape();
+			return;
+		}
 		send_udp_connect();
 	}
 
@@ -217,16 +231,16 @@ namespace libtorrent
 		snprintf(msg, 200, "*** UDP_TRACKER [ timed out url: %s ]", tracker_req().url.c_str());
 		if (cb) cb->debug_log(msg);
 #endif
+		m_abort = true;
 		m_socket.close();
-		m_name_lookup.cancel();
 		fail_timeout();
 	}
 
 	void udp_tracker_connection::close()
 	{
 		error_code ec;
+		m_abort = true;
 		m_socket.close();
-		m_name_lookup.cancel();
 		tracker_connection::close();
 	}
 
@@ -277,6 +291,16 @@ namespace libtorrent
 
 		if (action == action_error)
 		{
+			if (m_cached_connection_id)
+			{
+				// the tracker may have rejected the shared connection
+				// id. Forget it and try again with a connect of our own
+				m_man.remove_udp_connection_id(m_target);
+				m_cached_connection_id = false;
+				m_transaction_id = 0;
+				send_udp_connect();
+				return;
+			}
 			fail(-1, std::string(ptr, size - 8).c_str());
 			return;
 		}
@@ -321,6 +345,7 @@ namespace libtorrent
 		m_transaction_id = 0;
 		m_attempts = 0;
 		m_connection_id = detail::read_int64(buf);
+		m_man.set_udp_connection_id(m_target, m_connection_id);
 
 		if (tracker_req().kind == tracker_request::announce_request)
 			send_udp_announce();
@@ -455,6 +480,7 @@ namespace libtorrent
 			, std::back_inserter(ip_list)
 			, boost::bind(&udp::endpoint::address, _1));
 
+		response_received();
 		cb->tracker_response(tracker_req(), m_target.address(), ip_list
 			, peer_list, interval, complete, incomplete, address());
 
@@ -505,6 +531,7 @@ namespace libtorrent
 			return;
 		}
 		
+		response_received();
 		cb->tracker_scrape_response(tracker_req()
 			, complete, incomplete, downloaded);
 
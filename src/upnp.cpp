@@ -279,7 +279,7 @@ void upnp::resend_request(error_code const& e)
 				if (d.upnp_connection) d.upnp_connection->close();
 				d.upnp_connection.reset(new http_connection(m_io_service
 					, m_cc, bind(&upnp::on_upnp_xml, self(), _1, _2
-					, boost::ref(d), _5)));
+					, boost::ref(d), _3, _4, _5)));
 				d.upnp_connection->get(d.url, seconds(30), 1);
 #ifndef BOOST_NO_EXCEPTIONS
 			}
@@ -539,7 +539,7 @@ void upnp::on_reply(udp::endpoint const& from, char* buffer
 					if (d.upnp_connection) d.upnp_connection->close();
 					d.upnp_connection.reset(new http_connection(m_io_service
 						, m_cc, bind(&upnp::on_upnp_xml, self(), _1, _2
-						, boost::ref(d), _5)));
+						, boost::ref(d), _3, _4, _5)));
 					d.upnp_connection->get(d.url, seconds(30), 1);
 #ifndef BOOST_NO_EXCEPTIONS
 				}
@@ -681,7 +681,7 @@ void upnp::update_map(rootdevice& d, int i)
 		if (d.upnp_connection) d.upnp_connection->close();
 		d.upnp_connection.reset(new http_connection(m_io_service
 			, m_cc, bind(&upnp::on_upnp_map_response, self(), _1, _2
-			, boost::ref(d), i, _5), true
+			, boost::ref(d), i, _3, _4, _5), true
 			, bind(&upnp::create_port_mapping, self(), _1, boost::ref(d), i)));
 
 		d.upnp_connection->start(d.hostname, to_string(d.port).elems
@@ -692,7 +692,7 @@ void upnp::update_map(rootdevice& d, int i)
 		if (d.upnp_connection) d.upnp_connection->close();
 		d.upnp_connection.reset(new http_connection(m_io_service
 			, m_cc, bind(&upnp::on_upnp_unmap_response, self(), _1, _2
-			, boost::ref(d), i, _5), true
+			, boost::ref(d), i, _3, _4, _5), true
 			, bind(&upnp::delete_port_mapping, self(), boost::ref(d), i)));
 		d.upnp_connection->start(d.hostname, to_string(d.port).elems
 			, seconds(10), 1);
@@ -757,8 +757,9 @@ namespace
 
 struct parse_state
 {
-	parse_state(): in_service(false) {}
-	void reset(char const* st)
+	parse_state(): in_service(false), fallback_service_type(0)
+		, in_fallback_service(false) {}
+	void reset(char const* st, char const* fallback = 0)
 	{
 		in_service = false;
 		service_type = st;
@@ -766,6 +767,9 @@ struct parse_state
 		control_url.clear();
 		model.clear();
 		url_base.clear();
+		fallback_service_type = fallback;
+		fallback_control_url.clear();
+		in_fallback_service = false;
 	}
 	bool in_service;
 	std::list<std::string> tag_stack;
@@ -773,6 +777,13 @@ struct parse_state
 	char const* service_type;
 	std::string model;
 	std::string url_base;
+	// the control url of the fallback service is recorded
+	// in the same pass, so that the device description
+	// doesn't have to be parsed again if service_type
+	// isn't found
+	char const* fallback_service_type;
+	std::string fallback_control_url;
+	bool in_fallback_service;
 	bool top_tags(const char* str1, const char* str2)
 	{
 		std::list<std::string>::reverse_iterator i = tag_stack.rbegin();
@@ -799,8 +810,11 @@ void find_control_url(int type, char const* string, parse_state& state)
 	{
 		if (!state.tag_stack.empty())
 		{
-			if (state.in_service && state.tag_stack.back() == "service")
+			if (state.tag_stack.back() == "service")
+			{
 				state.in_service = false;
+				state.in_fallback_service = false;
+			}
 			state.tag_stack.pop_back();
 		}
 	}
@@ -808,15 +822,23 @@ void find_control_url(int type, char const* string, parse_state& state)
 	{
 		if (state.tag_stack.empty()) return;
 //		std::cout << " " << string << std::endl;
-		if (!state.in_service && state.top_tags("service", "servicetype"))
+		if (!state.in_service && !state.in_fallback_service
+			&& state.top_tags("service", "servicetype"))
 		{
 			if (string_equal_nocase(string, state.service_type))
 				state.in_service = true;
+			else if (state.fallback_service_type
+				&& string_equal_nocase(string, state.fallback_service_type))
+				state.in_fallback_service = true;
 		}
 		else if (state.in_service && state.top_tags("service", "controlurl"))
 		{
 			state.control_url = string;
 		}
+		else if (state.in_fallback_service && state.top_tags("service", "controlurl"))
+		{
+			state.fallback_control_url = string;
+		}
 		else if (state.model.empty() && state.top_tags("device", "modelname"))
 		{
 			state.model = string;
@@ -830,7 +852,7 @@ void find_control_url(int type, char const* string, parse_state& state)
 
 void upnp::on_upnp_xml(error_code const& e
 	, libtorrent::http_parser const& p, rootdevice& d
-	, http_connection& c)
+	, char const* data, int size, http_connection& c)
 {
 	mutex_t::scoped_lock l(m_mutex);
 
@@ -871,37 +893,32 @@ void upnp::on_upnp_xml(error_code const& e
 		return;
 	}
 
+	// look for the WAN IP connection, and for a PPP
+	// connection in case there isn't one. Both are found
+	// in a single pass over the device description
 	parse_state s;
-	s.reset("urn:schemas-upnp-org:service:WANIPConnection:1");
-	xml_parse((char*)p.get_body().begin, (char*)p.get_body().end
+	s.reset("urn:schemas-upnp-org:service:WANIPConnection:1"
+		, "urn:schemas-upnp-org:service:WANPPPConnection:1");
+	xml_parse((char*)data, (char*)data + size
 		, bind(&find_control_url, _1, _2, boost::ref(s)));
-	if (!s.control_url.empty())
+	if (s.control_url.empty() && !s.fallback_control_url.empty())
 	{
-		d.service_namespace = s.service_type;
-		if (!s.model.empty()) m_model = s.model;
+		s.control_url.swap(s.fallback_control_url);
+		s.service_type = s.fallback_service_type;
 	}
-	else
+
+	if (s.control_url.empty())
 	{
-		// we didn't find the WAN IP connection, look for
-		// a PPP connection
-		s.reset("urn:schemas-upnp-org:service:WANPPPConnection:1");
-		xml_parse((char*)p.get_body().begin, (char*)p.get_body().end
-			, bind(&find_control_url, _1, _2, boost::ref(s)));
-		if (!s.control_url.empty())
-		{
-			d.service_namespace = s.service_type;
-			if (!s.model.empty()) m_model = s.model;
-		}
-		else
-		{
-			char msg[200];
-			snprintf(msg, sizeof(msg), "could not find a port mapping interface in response from: %s"
-				, d.url.c_str());
-			log(msg);
-			d.disabled = true;
-			return;
-		}
+		char msg[200];
+		snprintf(msg, sizeof(msg), "could not find a port mapping interface in response from: %s"
+			, d.url.c_str());
+		log(msg);
+		d.disabled = true;
+		return;
 	}
+
+	d.service_namespace = s.service_type;
+	if (!s.model.empty()) m_model = s.model;
 	
 	if (!s.url_base.empty() && s.control_url.substr(7) != "http://")
 	{
@@ -1025,7 +1042,7 @@ namespace
 
 void upnp::on_upnp_map_response(error_code const& e
 	, libtorrent::http_parser const& p, rootdevice& d, int mapping
-	, http_connection& c)
+	, char const* data, int size, http_connection& c)
 {
 	mutex_t::scoped_lock l(m_mutex);
 
@@ -1076,7 +1093,7 @@ void upnp::on_upnp_map_response(error_code const& e
 	// since those might contain valid UPnP error codes
 
 	error_code_parse_state s;
-	xml_parse((char*)p.get_body().begin, (char*)p.get_body().end
+	xml_parse((char*)data, (char*)data + size
 		, bind(&find_error_code, _1, _2, boost::ref(s)));
 
 	if (s.error_code != -1)
@@ -1129,7 +1146,7 @@ void upnp::on_upnp_map_response(error_code const& e
 
 	char msg[200];
 	snprintf(msg, sizeof(msg), "map response: %s"
-		, std::string(p.get_body().begin, p.get_body().end).c_str());
+		, std::string(data, data + size).c_str());
 	log(msg);
 
 	if (s.error_code == -1)
@@ -1177,7 +1194,7 @@ void upnp::return_error(int mapping, int code)
 
 void upnp::on_upnp_unmap_response(error_code const& e
 	, libtorrent::http_parser const& p, rootdevice& d, int mapping
-	, http_connection& c)
+	, char const* data, int size, http_connection& c)
 {
 	mutex_t::scoped_lock l(m_mutex);
 
@@ -1208,7 +1225,7 @@ void upnp::on_upnp_unmap_response(error_code const& e
 	{
 		char msg[200];
 		snprintf(msg, sizeof(msg), "unmap response: %s"
-			, std::string(p.get_body().begin, p.get_body().end).c_str());
+			, std::string(data, data + size).c_str());
 		log(msg);
 	}
 
@@ -1224,6 +1241,11 @@ void upnp::on_expire(error_code const& e)
 	ptime now = time_now();
 	ptime next_expire = max_time();
 
+	// mappings that are due within this window are refreshed
+	// together with the ones that have expired, to not wake up
+	// separately for each mapping and device
+	ptime refresh_until = now + seconds(60);
+
 	mutex_t::scoped_lock l(m_mutex);
 
 	for (std::set<rootdevice>::iterator i = m_devices.begin()
@@ -1233,10 +1255,10 @@ void upnp::on_expire(error_code const& e)
 		TORRENT_ASSERT(d.magic == 1337);
 		for (int m = 0; m < num_mappings(); ++m)
 		{
-			if (d.mapping[m].expires != max_time())
+			if (d.mapping[m].expires == max_time())
 				continue;
 
-			if (d.mapping[m].expires < now)
+			if (d.mapping[m].expires < refresh_until)
 			{
 				d.mapping[m].expires = max_time();
 				update_map(d, m);
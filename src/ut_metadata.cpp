@@ -37,6 +37,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -66,7 +67,11 @@ namespace libtorrent { namespace
 		return (numerator + denominator - 1) / denominator;
 	}
 
-	void nop(char*) {}
+	// used as the destructor of reply cache buffers appended to a
+	// send buffer. userdata is a heap allocated reference to the
+	// cache, held until the send buffer is done with it
+	void release_reply_cache(char*, void* userdata, int)
+	{ delete static_cast<boost::shared_array<char>*>(userdata); }
 
 	struct ut_metadata_plugin : torrent_plugin
 	{
@@ -77,6 +82,12 @@ namespace libtorrent { namespace
 		{
 		}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << files_checked_hook) | (1 << new_connection_hook)
+				| (1 << piece_pass_hook);
+		}
+
 		virtual void on_files_checked()
 		{
 			// if the torrent is a seed, copy the metadata from
@@ -88,6 +99,24 @@ namespace libtorrent { namespace
 		virtual boost::shared_ptr<peer_plugin> new_connection(
 			peer_connection* pc);
 		
+		int num_metadata_pieces() const
+		{ return div_round_up(metadata().left(), 16 * 1024); }
+
+		// returns the reply to a request for a piece of the metadata,
+		// the bencoded message header followed by the piece. The
+		// replies for all pieces are encoded once, the first time one
+		// is requested, and shared by every peer
+		buffer::const_interval metadata_reply(int piece)
+		{
+			TORRENT_ASSERT(piece >= 0 && piece < num_metadata_pieces());
+			if (!m_reply_cache) build_reply_cache();
+			return buffer::const_interval(m_reply_cache.get() + m_reply_offset[piece]
+				, m_reply_cache.get() + m_reply_offset[piece + 1]);
+		}
+
+		boost::shared_array<char> const& reply_cache() const
+		{ return m_reply_cache; }
+
 		buffer::const_interval metadata() const
 		{
 			TORRENT_ASSERT(m_torrent.valid_metadata());
@@ -147,6 +176,15 @@ namespace libtorrent { namespace
 		// we should request.
 		int metadata_request();
 
+		// called when a request that was returned by
+		// metadata_request() won't be answered
+		void cancel_request(int piece)
+		{
+			if (piece < 0 || piece >= int(m_requested_metadata.size())) return;
+			int& r = m_requested_metadata[piece];
+			if (r > 0 && r != (std::numeric_limits<int>::max)()) --r;
+		}
+
 		// this is called from the peer_connection for
 		// each piece of metadata it receives
 		void metadata_progress(int total_size, int received)
@@ -172,8 +210,49 @@ namespace libtorrent { namespace
 		}
 
 	private:
+
+		void build_reply_cache()
+		{
+			buffer::const_interval buf = metadata();
+			int num_pieces = num_metadata_pieces();
+
+			std::vector<std::string> headers(num_pieces);
+			int total_size = buf.left();
+			for (int i = 0; i < num_pieces; ++i)
+			{
+				entry e;
+				e["msg_type"] = 1;
+				e["piece"] = i;
+				e["total_size"] = buf.left();
+				bencode(std::back_inserter(headers[i]), e);
+				total_size += headers[i].size();
+			}
+
+			m_reply_cache.reset(new char[total_size]);
+			m_reply_offset.resize(num_pieces + 1);
+			char* ptr = m_reply_cache.get();
+			for (int i = 0; i < num_pieces; ++i)
+			{
+				m_reply_offset[i] = ptr - m_reply_cache.get();
+				std::memcpy(ptr, headers[i].c_str(), headers[i].size());
+				ptr += headers[i].size();
+				int offset = i * 16 * 1024;
+				int size = (std::min)(int(buf.left()) - offset, 16 * 1024);
+				std::memcpy(ptr, buf.begin + offset, size);
+				ptr += size;
+			}
+			m_reply_offset[num_pieces] = ptr - m_reply_cache.get();
+			TORRENT_ASSERT(m_reply_offset[num_pieces] == total_size);
+		}
+
 		torrent& m_torrent;
 
+		// the replies to metadata requests, built by
+		// build_reply_cache(). The reply for piece i is in
+		// the range [m_reply_offset[i], m_reply_offset[i+1])
+		boost::shared_array<char> m_reply_cache;
+		std::vector<int> m_reply_offset;
+
 		// this buffer is filled with the info-section of
 		// the metadata file while downloading it from
 		// peers, and while sending it.
@@ -201,6 +280,12 @@ namespace libtorrent { namespace
 			, m_tp(tp)
 		{}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << extended_hook) | (1 << tick_hook)
+				| (1 << disconnect_hook);
+		}
+
 		// can add entries to the extension handshake
 		virtual void add_handshake(entry& h)
 		{
@@ -225,6 +310,7 @@ namespace libtorrent { namespace
 			int metadata_size = h.dict_find_int_value("metadata_size");
 			if (metadata_size > 0)
 				m_tp.metadata_size(metadata_size);
+			maybe_request();
 			return true;
 		}
 
@@ -241,39 +327,45 @@ namespace libtorrent { namespace
 			// abort if the peer doesn't support the metadata extension
 			if (m_message_index == 0) return;
 
-			entry e;
-			e["msg_type"] = type;
-			e["piece"] = piece;
-
-			char const* metadata = 0;
-			int metadata_piece_size = 0;
+			namespace io = detail;
+			char msg[200];
+			char* header = msg;
 
 			if (type == 1)
 			{
 				TORRENT_ASSERT(m_pc.associated_torrent().lock()->valid_metadata());
-				e["total_size"] = m_tp.metadata().left();
-				int offset = piece * 16 * 1024;
-				metadata = m_tp.metadata().begin + offset;
-				metadata_piece_size = (std::min)(
-					int(m_tp.metadata().left() - offset), 16 * 1024);
-				TORRENT_ASSERT(metadata_piece_size > 0);
-				TORRENT_ASSERT(offset >= 0);
-				TORRENT_ASSERT(offset + metadata_piece_size <= int(m_tp.metadata().left()));
+				buffer::const_interval reply = m_tp.metadata_reply(piece);
+				io::write_uint32(2 + reply.left(), header);
+				io::write_uint8(bt_peer_connection::msg_extended, header);
+				io::write_uint8(m_message_index, header);
+				m_pc.send_buffer(msg, 6);
+#ifndef TORRENT_DISABLE_ENCRYPTION
+				// RC4 encrypts the send buffer in place, the
+				// shared reply has to be copied
+				if (m_pc.rc4_encrypted())
+				{
+					m_pc.send_buffer(reply.begin, reply.left());
+					return;
+				}
+#endif
+				m_pc.append_send_buffer(const_cast<char*>(reply.begin), reply.left()
+					, &release_reply_cache
+					, new boost::shared_array<char>(m_tp.reply_cache()));
+				m_pc.setup_send();
+				return;
 			}
 
-			char msg[200];
-			char* header = msg;
+			entry e;
+			e["msg_type"] = type;
+			e["piece"] = piece;
+
 			char* p = &msg[6];
 			int len = bencode(p, e);
-			int total_size = 2 + len + metadata_piece_size;
-			namespace io = detail;
-			io::write_uint32(total_size, header);
+			io::write_uint32(2 + len, header);
 			io::write_uint8(bt_peer_connection::msg_extended, header);
 			io::write_uint8(m_message_index, header);
 
 			m_pc.send_buffer(msg, len + 6);
-			if (metadata_piece_size) m_pc.append_send_buffer(
-				(char*)metadata, metadata_piece_size, &nop);
 		}
 
 		virtual bool on_extended(int length
@@ -310,7 +402,8 @@ namespace libtorrent { namespace
 			{
 			case 0: // request
 				{
-					if (!m_torrent.valid_metadata())
+					if (!m_torrent.valid_metadata()
+						|| piece < 0 || piece >= m_tp.num_metadata_pieces())
 					{
 						write_metadata_packet(2, piece);
 						return true;
@@ -331,6 +424,8 @@ namespace libtorrent { namespace
 					entry const* total_size = msg.find_key("total_size");
 					m_tp.received_metadata(body.begin + len, body.left() - len, piece
 						, (total_size && total_size->type() == entry::int_t) ? total_size->integer() : 0);
+					// keep the requests to this peer going
+					maybe_request();
 				}
 				break;
 			case 2: // have no data
@@ -341,6 +436,7 @@ namespace libtorrent { namespace
 					// unwanted piece?
 					if (i == m_sent_requests.end()) return true;
 					m_sent_requests.erase(i);
+					m_tp.cancel_request(piece);
 				}
 				break;
 			default:
@@ -355,16 +451,41 @@ namespace libtorrent { namespace
 
 		virtual void tick()
 		{
-			// if we don't have any metadata, and this peer
-			// supports the request metadata extension
-			// and we aren't currently waiting for a request
-			// reply. Then, send a request for some metadata.
-			if (!m_torrent.valid_metadata()
+			maybe_request();
+		}
+
+		virtual void on_disconnect()
+		{
+			// let other peers be asked for the pieces
+			// this one won't send
+			for (std::vector<int>::iterator i = m_sent_requests.begin()
+				, end(m_sent_requests.end()); i != end; ++i)
+				m_tp.cancel_request(*i);
+			m_sent_requests.clear();
+		}
+
+		// if we don't have any metadata, and this peer
+		// supports the request metadata extension
+		// and we aren't waiting for two request replies.
+		// Then, send a request for some metadata. This is
+		// done as soon as a reply arrives, so that every peer
+		// that has the metadata is kept busy with its own pieces
+		void maybe_request()
+		{
+			while (!m_torrent.valid_metadata()
 				&& m_message_index != 0
 				&& m_sent_requests.size() < 2
 				&& has_metadata())
 			{
 				int piece = m_tp.metadata_request();
+				if (std::find(m_sent_requests.begin(), m_sent_requests.end()
+					, piece) != m_sent_requests.end())
+				{
+					// all the pieces that are left have already
+					// been requested from this peer
+					m_tp.cancel_request(piece);
+					break;
+				}
 				m_sent_requests.push_back(piece);
 				write_metadata_packet(0, piece);
 			}
@@ -415,8 +536,12 @@ namespace libtorrent { namespace
 			return 0;
 		}
 
+		// the pieces we have are marked with the max int, they're
+		// only picked if we have them all, which can't happen
+		// while the metadata is still requested
 		int piece = i - m_requested_metadata.begin();
-		m_requested_metadata[piece] = piece;
+		TORRENT_ASSERT(*i != (std::numeric_limits<int>::max)());
+		++m_requested_metadata[piece];
 		return piece;
 	}
 
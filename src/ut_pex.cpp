@@ -75,6 +75,11 @@ namespace libtorrent { namespace
 	{
 		ut_pex_plugin(torrent& t): m_torrent(t), m_1_minute(55), m_peers_in_message(0) {}
 	
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << new_connection_hook) | (1 << tick_hook);
+		}
+
 		virtual boost::shared_ptr<peer_plugin> new_connection(peer_connection* pc);
 
 		std::vector<char>& get_ut_pex_msg()
@@ -87,108 +92,161 @@ namespace libtorrent { namespace
 			return m_peers_in_message;
 		}
 
+		// called by the peer plugins when a connection that may be
+		// sent in pex messages is established, and when it's closed.
+		// The changes since the last message are logged, so that the
+		// next message is built from the log instead of by comparing
+		// all connections against the previous message
+		void peer_added(bt_peer_connection* p)
+		{
+			tcp::endpoint const& remote = p->remote();
+			for (std::vector<logged_peer>::iterator i = m_log.begin()
+				, end(m_log.end()); i != end; ++i)
+			{
+				if (i->peer != 0 || i->remote != remote) continue;
+				// it was dropped since the last message, and
+				// reconnected. As far as the other peers know
+				// it never went away
+				m_log.erase(i);
+				return;
+			}
+			m_log.push_back(logged_peer(remote, p));
+		}
+
+		void peer_dropped(bt_peer_connection* p)
+		{
+			for (std::vector<logged_peer>::iterator i = m_log.begin()
+				, end(m_log.end()); i != end; ++i)
+			{
+				if (i->peer != p) continue;
+				// it was never sent in a message, there's
+				// nothing to drop
+				m_log.erase(i);
+				return;
+			}
+			m_log.push_back(logged_peer(p->remote(), 0));
+		}
+
 		// the second tick of the torrent
 		// each minute the new lists of "added" + "added.f" and "dropped"
-		// are calculated here and the pex message is created
+		// are created from the log and the pex message is created
 		// each peer connection will use this message
-		// max_peer_entries limits the packet size
+		// max_peer_entries limits the number of added peers, the
+		// rest are left in the log for the next message
 		virtual void tick()
 		{
 			if (++m_1_minute < 60) return;
 
 			m_1_minute = 0;
+			m_peers_in_message = 0;
+			m_ut_pex_msg.clear();
+			if (m_log.empty()) return;
 
-			entry pex;
-			std::string& pla = pex["added"].string();
-			std::string& pld = pex["dropped"].string();
-			std::string& plf = pex["added.f"].string();
+			std::string pla, pld, plf;
 			std::back_insert_iterator<std::string> pla_out(pla);
 			std::back_insert_iterator<std::string> pld_out(pld);
 			std::back_insert_iterator<std::string> plf_out(plf);
 #if TORRENT_USE_IPV6
-			std::string& pla6 = pex["added6"].string();
-			std::string& pld6 = pex["dropped6"].string();
-			std::string& plf6 = pex["added6.f"].string();
+			std::string pla6, pld6, plf6;
 			std::back_insert_iterator<std::string> pla6_out(pla6);
 			std::back_insert_iterator<std::string> pld6_out(pld6);
 			std::back_insert_iterator<std::string> plf6_out(plf6);
 #endif
 
-			std::set<tcp::endpoint> dropped;
-			m_old_peers.swap(dropped);
-
-			m_peers_in_message = 0;
+			std::vector<logged_peer> left;
 			int num_added = 0;
-			for (torrent::peer_iterator i = m_torrent.begin()
-				, end(m_torrent.end()); i != end; ++i)
+			for (std::vector<logged_peer>::const_iterator i = m_log.begin()
+				, end(m_log.end()); i != end; ++i)
 			{
-				peer_connection* peer = *i;
-				if (!send_peer(*peer)) continue;
-
-				tcp::endpoint const& remote = peer->remote();
-				m_old_peers.insert(remote);
-
-				std::set<tcp::endpoint>::iterator di = dropped.find(remote);
-				if (di == dropped.end())
+				tcp::endpoint const& remote = i->remote;
+				if (i->peer == 0)
 				{
-					// don't write too big of a package
-					if (num_added >= max_peer_entries) break;
-
-					// only send proper bittorrent peers
-					bt_peer_connection* p = dynamic_cast<bt_peer_connection*>(peer);
-					if (!p) continue;
-
-					// no supported flags to set yet
-					// 0x01 - peer supports encryption
-					// 0x02 - peer is a seed
-					int flags = p->is_seed() ? 2 : 0;
-#ifndef TORRENT_DISABLE_ENCRYPTION
-					flags |= p->supports_encryption() ? 1 : 0;
-#endif
-					// i->first was added since the last time
 					if (remote.address().is_v4())
-					{
-						detail::write_endpoint(remote, pla_out);
-						detail::write_uint8(flags, plf_out);
-					}
+						detail::write_endpoint(remote, pld_out);
 #if TORRENT_USE_IPV6
 					else
-					{
-						detail::write_endpoint(remote, pla6_out);
-						detail::write_uint8(flags, plf6_out);
-					}
+						detail::write_endpoint(remote, pld6_out);
 #endif
-					++num_added;
 					++m_peers_in_message;
+					continue;
 				}
-				else
+
+				// don't write too big of a package
+				if (num_added >= max_peer_entries)
 				{
-					// this was in the previous message
-					// so, it wasn't dropped
-					dropped.erase(di);
+					left.push_back(*i);
+					continue;
 				}
-			}
 
-			for (std::set<tcp::endpoint>::const_iterator i = dropped.begin()
-				, end(dropped.end()); i != end; ++i)
-			{	
-				if (i->address().is_v4())
-					detail::write_endpoint(*i, pld_out);
+				// no supported flags to set yet
+				// 0x01 - peer supports encryption
+				// 0x02 - peer is a seed
+				int flags = i->peer->is_seed() ? 2 : 0;
+#ifndef TORRENT_DISABLE_ENCRYPTION
+				flags |= i->peer->supports_encryption() ? 1 : 0;
+#endif
+				if (remote.address().is_v4())
+				{
+					detail::write_endpoint(remote, pla_out);
+					detail::write_uint8(flags, plf_out);
+				}
 #if TORRENT_USE_IPV6
 				else
-					detail::write_endpoint(*i, pld6_out);
+				{
+					detail::write_endpoint(remote, pla6_out);
+					detail::write_uint8(flags, plf6_out);
+				}
 #endif
+				++num_added;
 				++m_peers_in_message;
 			}
+			m_log.swap(left);
 
-			m_ut_pex_msg.clear();
-			bencode(std::back_inserter(m_ut_pex_msg), pex);
+			// the keys and string lengths take less than 100 bytes
+			int size = 100 + pla.size() + plf.size() + pld.size();
+#if TORRENT_USE_IPV6
+			size += pla6.size() + plf6.size() + pld6.size();
+#endif
+			m_ut_pex_msg.reserve(size);
+			bencode_writer<std::back_insert_iterator<std::vector<char> > > w(
+				std::back_inserter(m_ut_pex_msg));
+			// keys in sorted order
+			w.begin_dict();
+			w.write_key("added");
+			w.write_string(pla);
+			w.write_key("added.f");
+			w.write_string(plf);
+#if TORRENT_USE_IPV6
+			w.write_key("added6");
+			w.write_string(pla6);
+			w.write_key("added6.f");
+			w.write_string(plf6);
+#endif
+			w.write_key("dropped");
+			w.write_string(pld);
+#if TORRENT_USE_IPV6
+			w.write_key("dropped6");
+			w.write_string(pld6);
+#endif
+			w.end();
 		}
 
 	private:
 		torrent& m_torrent;
 
-		std::set<tcp::endpoint> m_old_peers;
+		struct logged_peer
+		{
+			logged_peer(tcp::endpoint const& ep, bt_peer_connection* p)
+				: remote(ep), peer(p) {}
+			tcp::endpoint remote;
+			// the connection, if the peer was added. 0 if it
+			// was dropped
+			bt_peer_connection* peer;
+		};
+
+		// the peers added and dropped since the last message,
+		// in the order it happened
+		std::vector<logged_peer> m_log;
 		int m_1_minute;
 		std::vector<char> m_ut_pex_msg;
 		int m_peers_in_message;
@@ -204,8 +262,34 @@ namespace libtorrent { namespace
 			, m_1_minute(55)
 			, m_message_index(0)
 			, m_first_time(true)
+			, m_logged(false)
 		{}
 
+		virtual boost::uint32_t implemented_hooks() const
+		{
+			return (1 << extended_hook) | (1 << tick_hook)
+				| (1 << disconnect_hook);
+		}
+
+		virtual bool on_handshake(char const* reserved_bits)
+		{
+			// every peer we can send to others is logged, whether
+			// it supports pex itself or not
+			if (send_peer(m_pc))
+			{
+				m_tp.peer_added(static_cast<bt_peer_connection*>(&m_pc));
+				m_logged = true;
+			}
+			return true;
+		}
+
+		virtual void on_disconnect()
+		{
+			if (!m_logged) return;
+			m_tp.peer_dropped(static_cast<bt_peer_connection*>(&m_pc));
+			m_logged = false;
+		}
+
 		virtual void add_handshake(entry& h)
 		{
 			entry& messages = h["m"];
@@ -214,13 +298,16 @@ namespace libtorrent { namespace
 
 		virtual bool on_extension_handshake(lazy_entry const& h)
 		{
+			// this plugin is kept even if the peer doesn't support
+			// pex, to tell the torrent's log when it disconnects.
+			// m_message_index is left at 0 in that case
 			m_message_index = 0;
-			if (h.type() != lazy_entry::dict_t) return false;
+			if (h.type() != lazy_entry::dict_t) return true;
 			lazy_entry const* messages = h.dict_find("m");
-			if (!messages || messages->type() != lazy_entry::dict_t) return false;
+			if (!messages || messages->type() != lazy_entry::dict_t) return true;
 
 			int index = messages->dict_find_int_value(extension_name, -1);
-			if (index == -1) return false;
+			if (index == -1) return true;
 			m_message_index = index;
 			return true;
 		}
@@ -259,16 +346,17 @@ namespace libtorrent { namespace
 				char const* in = p->string_ptr();
 				char const* fin = pf->string_ptr();
 
-				peer_id pid(0);
-				policy& p = m_torrent.get_policy();
+				std::vector<policy::peer_entry_t> peers;
+				peers.reserve(num_peers);
 				for (int i = 0; i < num_peers; ++i)
 				{
 					tcp::endpoint adr = detail::read_v4_endpoint<tcp::endpoint>(in);
 					char flags = *fin++;
 					// ignore local addresses unless the peer is local to us
 					if (is_local(adr.address()) && !is_local(m_pc.remote().address())) continue;
-					p.add_peer(adr, pid, peer_info::pex, flags);
+					peers.push_back(policy::peer_entry_t(adr, flags));
 				} 
+				m_torrent.get_policy().add_peers(peers, peer_info::pex);
 			}
 
 #if TORRENT_USE_IPV6
@@ -284,16 +372,17 @@ namespace libtorrent { namespace
 				char const* in = p6->string_ptr();
 				char const* fin = p6f->string_ptr();
 
-				peer_id pid(0);
-				policy& p = m_torrent.get_policy();
+				std::vector<policy::peer_entry_t> peers;
+				peers.reserve(num_peers);
 				for (int i = 0; i < num_peers; ++i)
 				{
 					tcp::endpoint adr = detail::read_v6_endpoint<tcp::endpoint>(in);
 					char flags = *fin++;
 					// ignore local addresses unless the peer is local to us
 					if (is_local(adr.address()) && !is_local(m_pc.remote().address())) continue;
-					p.add_peer(adr, pid, peer_info::pex, flags);
+					peers.push_back(policy::peer_entry_t(adr, flags));
 				} 
+				m_torrent.get_policy().add_peers(peers, peer_info::pex);
 			}
 #endif
 			return true;
@@ -341,18 +430,12 @@ namespace libtorrent { namespace
 
 		void send_ut_peer_list()
 		{
-			entry pex;
-			// leave the dropped string empty
-			pex["dropped"].string();
-			std::string& pla = pex["added"].string();
-			std::string& plf = pex["added.f"].string();
+			std::string pla, plf;
 			std::back_insert_iterator<std::string> pla_out(pla);
 			std::back_insert_iterator<std::string> plf_out(plf);
 
 #if TORRENT_USE_IPV6
-			pex["dropped6"].string();
-			std::string& pla6 = pex["added6"].string();
-			std::string& plf6 = pex["added6.f"].string();
+			std::string pla6, plf6;
 			std::back_insert_iterator<std::string> pla6_out(pla6);
 			std::back_insert_iterator<std::string> plf6_out(plf6);
 #endif
@@ -395,7 +478,27 @@ namespace libtorrent { namespace
 				++num_added;
 			}
 			std::vector<char> pex_msg;
-			bencode(std::back_inserter(pex_msg), pex);
+			bencode_writer<std::back_insert_iterator<std::vector<char> > > w(
+				std::back_inserter(pex_msg));
+			// leave the dropped strings empty. keys in sorted order
+			w.begin_dict();
+			w.write_key("added");
+			w.write_string(pla);
+			w.write_key("added.f");
+			w.write_string(plf);
+#if TORRENT_USE_IPV6
+			w.write_key("added6");
+			w.write_string(pla6);
+			w.write_key("added6.f");
+			w.write_string(plf6);
+#endif
+			w.write_key("dropped");
+			w.write_string(0, 0);
+#if TORRENT_USE_IPV6
+			w.write_key("dropped6");
+			w.write_string(0, 0);
+#endif
+			w.end();
 
 			buffer::interval i = m_pc.allocate_send_buffer(6 + pex_msg.size());
 
@@ -420,6 +523,10 @@ namespace libtorrent { namespace
 		// it is used to know if a diff message or a full
 		// message should be sent.
 		bool m_first_time;
+
+		// true if this peer has been added to the
+		// torrent's log, see ut_pex_plugin::peer_added()
+		bool m_logged;
 	};
 
 	boost::shared_ptr<peer_plugin> ut_pex_plugin::new_connection(peer_connection* pc)
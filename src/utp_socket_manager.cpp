@@ -0,0 +1,210 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/utp_socket_manager.hpp"
+#include "libtorrent/utp_stream.hpp"
+#include "libtorrent/udp_socket.hpp"
+#include "libtorrent/io.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+namespace libtorrent
+{
+
+	utp_socket_manager::utp_socket_manager(session_settings const& s
+		, udp_socket& sock, incoming_utp_callback_t cb)
+		: m_sett(s)
+		, m_sock(sock)
+		, m_cb(cb)
+	{}
+
+	utp_socket_manager::~utp_socket_manager()
+	{
+		for (socket_map_t::iterator i = m_utp_sockets.begin()
+			, end(m_utp_sockets.end()); i != end; ++i)
+			delete_utp_impl(i->second);
+		for (std::vector<utp_socket_impl*>::iterator i = m_unconnected.begin()
+			, end(m_unconnected.end()); i != end; ++i)
+			delete_utp_impl(*i);
+	}
+
+	void utp_socket_manager::tick(ptime now)
+	{
+		for (socket_map_t::iterator i = m_utp_sockets.begin()
+			, end(m_utp_sockets.end()); i != end;)
+		{
+			tick_utp_impl(i->second, now);
+			if (should_delete(i->second))
+			{
+				delete_utp_impl(i->second);
+				m_utp_sockets.erase(i++);
+				continue;
+			}
+			++i;
+		}
+
+		for (std::vector<utp_socket_impl*>::iterator i = m_unconnected.begin();
+			i != m_unconnected.end();)
+		{
+			if (should_delete(*i))
+			{
+				delete_utp_impl(*i);
+				i = m_unconnected.erase(i);
+				continue;
+			}
+			++i;
+		}
+	}
+
+	void utp_socket_manager::send_packet(udp::endpoint const& ep
+		, char const* p, int len, error_code& ec)
+	{
+		// this bypasses the rate limit of the DHT socket. uTP
+		// has its own congestion control and the peer
+		// connections are rate limited
+		m_sock.send(ep, p, len, ec);
+	}
+
+	bool utp_socket_manager::incoming_packet(char const* p, int size
+		, udp::endpoint const& ep)
+	{
+		if (size < utp_header_size) return false;
+
+		int version = p[0] & 0xf;
+		int type = (p[0] >> 4) & 0xf;
+		if (version != 1 || type >= NUM_TYPES) return false;
+
+		char const* ptr = p + 2;
+		boost::uint16_t id = detail::read_uint16(ptr);
+		ptr = p + 16;
+		boost::uint16_t seq_nr = detail::read_uint16(ptr);
+
+		ptime now = time_now_hires();
+
+		// the SYN carries the id the other end receives on,
+		// the socket we set up for it receives on the next one
+		boost::uint16_t recv_id = type == ST_SYN ? id + 1 : id;
+
+		std::pair<socket_map_t::iterator, socket_map_t::iterator> r
+			= m_utp_sockets.equal_range(recv_id);
+		for (; r.first != r.second; ++r.first)
+		{
+			utp_socket_impl* s = r.first->second;
+			if (!utp_match(s, ep, recv_id)) continue;
+			bool ret = utp_incoming_packet(s, p, size, ep, now);
+			if (should_delete(s))
+			{
+				delete_utp_impl(s);
+				m_utp_sockets.erase(r.first);
+			}
+			return ret;
+		}
+
+		// packets for sockets we don't know about are dropped.
+		// They may belong to a connection we just closed
+		if (type != ST_SYN) return true;
+
+		if (!m_sett.enable_incoming_utp)
+		{
+			send_reset(ep, id, seq_nr);
+			return true;
+		}
+
+		boost::shared_ptr<socket_type> c(new socket_type(m_sock.get_io_service()));
+		c->instantiate<utp_stream>(m_sock.get_io_service());
+		utp_stream* str = c->get<utp_stream>();
+		utp_socket_impl* impl = construct_utp_impl(recv_id, id, str, this);
+		str->set_impl(impl);
+		m_utp_sockets.insert(std::make_pair(recv_id, impl));
+		utp_incoming_packet(impl, p, size, ep, now);
+
+		// if the connection isn't accepted, the socket is
+		// closed as c goes out of scope
+		m_cb(c);
+		return true;
+	}
+
+	void utp_socket_manager::send_reset(udp::endpoint const& ep
+		, boost::uint16_t id, boost::uint16_t ack_nr)
+	{
+		using namespace detail;
+		char buf[utp_header_size];
+		char* ptr = buf;
+		write_uint8((ST_RESET << 4) | 1, ptr);
+		write_uint8(0, ptr);
+		write_uint16(id, ptr);
+		write_uint32(0, ptr);
+		write_uint32(0, ptr);
+		write_uint32(0, ptr);
+		write_uint16(std::rand(), ptr);
+		write_uint16(ack_nr, ptr);
+		error_code ec;
+		send_packet(ep, buf, utp_header_size, ec);
+	}
+
+	utp_socket_impl* utp_socket_manager::new_utp_socket(utp_stream* str)
+	{
+		utp_socket_impl* impl = construct_utp_impl(0, 0, str, this);
+		m_unconnected.push_back(impl);
+		return impl;
+	}
+
+	void utp_socket_manager::add_socket(boost::uint16_t id, utp_socket_impl* s)
+	{
+		std::vector<utp_socket_impl*>::iterator i = std::find(
+			m_unconnected.begin(), m_unconnected.end(), s);
+		if (i != m_unconnected.end()) m_unconnected.erase(i);
+		m_utp_sockets.insert(std::make_pair(id, s));
+	}
+
+	boost::uint16_t utp_socket_manager::new_connection_id(udp::endpoint const& ep)
+	{
+		boost::uint16_t id;
+		do
+		{
+			id = std::rand();
+		} while (m_utp_sockets.find(id) != m_utp_sockets.end());
+		return id;
+	}
+
+	int utp_socket_manager::local_port() const
+	{
+		return m_sock.local_port();
+	}
+
+	io_service& utp_socket_manager::get_io_service()
+	{
+		return m_sock.get_io_service();
+	}
+}
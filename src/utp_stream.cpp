@@ -0,0 +1,971 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/utp_stream.hpp"
+#include "libtorrent/utp_socket_manager.hpp"
+#include "libtorrent/io.hpp"
+#include <boost/cstdint.hpp>
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+
+namespace libtorrent
+{
+	namespace
+	{
+		enum
+		{
+			// the largest packet we send, header included.
+			// This fits in the MTU of most links, with some
+			// room for tunnels
+			utp_mtu = 1400,
+			// the payload of a full packet
+			max_payload = utp_mtu - utp_header_size,
+			// the queuing delay LEDBAT aims for, in microseconds
+			target_delay = 100000,
+			// the most the congestion window grows per round trip
+			max_cwnd_increase = 3000,
+			// the receive window we advertise
+			receive_window = 256 * 1024,
+			// the number of packets buffered out of order
+			max_reorder = 512
+		};
+
+		enum
+		{
+			UTP_STATE_NONE,
+			UTP_STATE_SYN_SENT,
+			UTP_STATE_CONNECTED,
+			// we've sent a FIN and wait for everything to be acked
+			UTP_STATE_FIN_SENT,
+			// the socket failed, but the stream is still attached
+			UTP_STATE_ERROR_WAIT,
+			UTP_STATE_DELETE
+		};
+
+		boost::uint32_t timestamp_micro(ptime now)
+		{
+			return boost::uint32_t(total_microseconds(now - min_time()));
+		}
+
+		// a packet we have sent or are about to send
+		struct packet
+		{
+			ptime send_time;
+			int num_transmissions;
+			int payload;
+			int type;
+			boost::uint16_t seq_nr;
+			char buf[utp_mtu];
+		};
+
+		// a packet received out of order
+		struct in_packet
+		{
+			int type;
+			std::vector<char> payload;
+		};
+	}
+
+	struct utp_socket_impl
+	{
+		utp_socket_impl(boost::uint16_t recv_id, boost::uint16_t send_id
+			, utp_stream* userdata, utp_socket_manager* sm)
+			: m_sm(sm)
+			, m_userdata(userdata)
+			, m_num_sent(0)
+			, m_bytes_in_flight(0)
+			, m_send_buffer_size(0)
+			, m_receive_offset(0)
+			, m_receive_buffer_size(0)
+			, m_cwnd(boost::int64_t(utp_mtu * 2) << 16)
+			, m_adv_wnd(utp_mtu)
+			, m_reply_micro(0)
+			, m_base_delay_rotate(time_now())
+			, m_timeout(max_time())
+			, m_rtt(-1)
+			, m_rtt_var(0)
+			, m_rto(1000)
+			, m_recv_id(recv_id)
+			, m_send_id(send_id)
+			, m_seq_nr(std::rand() & 0xffff)
+			, m_ack_nr(0)
+			, m_duplicate_acks(0)
+			, m_state(UTP_STATE_NONE)
+			, m_eof(false)
+			, m_need_ack(false)
+		{
+			m_acked_seq_nr = m_seq_nr - 1;
+			m_base_delay[0] = m_base_delay[1] = 0xffffffff;
+		}
+
+		~utp_socket_impl();
+
+		bool incoming_packet(char const* buf, int size
+			, udp::endpoint const& ep, ptime const& receive_time);
+		void tick(ptime const& now);
+		void connect(udp::endpoint const& ep);
+		void detach();
+
+		void maybe_trigger_read_callback();
+		void maybe_trigger_write_callback();
+		std::size_t read_into_buffers();
+		std::size_t fill_write();
+
+	private:
+
+		void send_pkt(ptime const& now);
+		void transmit(packet* p, ptime const& now);
+		void send_state(ptime const& now);
+		void ack_packets(boost::uint16_t ack_nr, boost::uint32_t delay
+			, bool duplicate_ack, ptime const& now);
+		void do_ledbat(int acked_bytes, boost::uint32_t delay, bool window_full);
+		void update_rtt(int sample);
+		void incoming_data(int type, boost::uint16_t seq_nr, char const* buf, int size);
+		void consume(int type, char const* buf, int size);
+		void set_error(error_code const& ec);
+		void clear_buffers();
+		int send_buffer_limit() const;
+		boost::uint32_t receive_window_left() const;
+
+	public:
+
+		utp_socket_manager* m_sm;
+		utp_stream* m_userdata;
+		udp::endpoint m_remote_address;
+
+		// the packets that haven't been acked yet, ordered by
+		// sequence number. The first m_num_sent of them have
+		// been sent, the rest are waiting for the windows to open
+		std::deque<packet*> m_outbuf;
+		int m_num_sent;
+		int m_bytes_in_flight;
+
+		// the payload bytes in m_outbuf
+		int m_send_buffer_size;
+
+		// packets received out of order. The first one has
+		// the sequence number m_ack_nr + 2
+		std::deque<in_packet*> m_inbuf;
+
+		// in order payload that the stream hasn't read yet.
+		// m_receive_offset is where the first buffer starts
+		std::deque<std::vector<char> > m_receive_buffer;
+		int m_receive_offset;
+		int m_receive_buffer_size;
+
+		// the congestion window in bytes, as 48.16 fixed point
+		boost::int64_t m_cwnd;
+
+		// the receive window the other end advertised
+		int m_adv_wnd;
+
+		// the time it took for the last packet to get here,
+		// according to the clocks at both ends. It's echoed
+		// back to the other end in all packets we send
+		boost::uint32_t m_reply_micro;
+
+		// the lowest delays seen in the current and the last
+		// minute. The lower of the two is the base delay
+		boost::uint32_t m_base_delay[2];
+		ptime m_base_delay_rotate;
+
+		// when the oldest packet in flight times out
+		ptime m_timeout;
+
+		// the round trip time, its mean deviation and the
+		// retransmit timeout, in milliseconds
+		int m_rtt;
+		int m_rtt_var;
+		int m_rto;
+
+		error_code m_error;
+
+		boost::uint16_t m_recv_id;
+		boost::uint16_t m_send_id;
+
+		// the sequence number of the next packet we send
+		boost::uint16_t m_seq_nr;
+
+		// the last sequence number the other end acked
+		boost::uint16_t m_acked_seq_nr;
+
+		// the last sequence number we received in order
+		boost::uint16_t m_ack_nr;
+
+		int m_duplicate_acks;
+		int m_state;
+
+		// set when the other end's FIN has been received
+		// in order
+		bool m_eof;
+
+		// set when we have received something that needs to
+		// be acked. Data packets carry the ack, so this is
+		// only sent on its own if there is nothing else to send
+		bool m_need_ack;
+	};
+
+	utp_socket_impl* construct_utp_impl(boost::uint16_t recv_id
+		, boost::uint16_t send_id, utp_stream* userdata
+		, utp_socket_manager* sm)
+	{
+		return new utp_socket_impl(recv_id, send_id, userdata, sm);
+	}
+
+	void delete_utp_impl(utp_socket_impl* s)
+	{
+		delete s;
+	}
+
+	bool should_delete(utp_socket_impl* s)
+	{
+		return s->m_state == UTP_STATE_DELETE;
+	}
+
+	void tick_utp_impl(utp_socket_impl* s, ptime const& now)
+	{
+		s->tick(now);
+	}
+
+	bool utp_incoming_packet(utp_socket_impl* s, char const* p
+		, int size, udp::endpoint const& ep, ptime const& receive_time)
+	{
+		return s->incoming_packet(p, size, ep, receive_time);
+	}
+
+	bool utp_match(utp_socket_impl* s, udp::endpoint const& ep, boost::uint16_t id)
+	{
+		return s->m_recv_id == id && s->m_remote_address == ep;
+	}
+
+	udp::endpoint utp_remote_endpoint(utp_socket_impl* s)
+	{
+		return s->m_remote_address;
+	}
+
+	boost::uint16_t utp_receive_id(utp_socket_impl* s)
+	{
+		return s->m_recv_id;
+	}
+
+	void utp_detach(utp_socket_impl* s)
+	{
+		s->detach();
+	}
+
+	// ============ utp_stream ============
+
+	utp_stream::utp_stream(io_service& io_service)
+		: m_impl(0)
+		, m_io_service(io_service)
+		, m_open(true)
+	{}
+
+	utp_stream::~utp_stream()
+	{
+		close();
+	}
+
+	void utp_stream::set_impl(utp_socket_impl* impl)
+	{
+		TORRENT_ASSERT(m_impl == 0);
+		m_impl = impl;
+	}
+
+	void utp_stream::close()
+	{
+		cancel_handlers(asio::error::operation_aborted);
+		m_open = false;
+		if (!m_impl) return;
+		utp_detach(m_impl);
+		m_impl = 0;
+	}
+
+	utp_stream::endpoint_type utp_stream::local_endpoint(error_code& ec) const
+	{
+		if (!m_impl)
+		{
+			ec = asio::error::not_connected;
+			return endpoint_type();
+		}
+		return endpoint_type(address_v4::any(), m_impl->m_sm->local_port());
+	}
+
+	utp_stream::endpoint_type utp_stream::remote_endpoint(error_code& ec) const
+	{
+		if (!m_impl)
+		{
+			ec = asio::error::not_connected;
+			return endpoint_type();
+		}
+		udp::endpoint ep = utp_remote_endpoint(m_impl);
+		return endpoint_type(ep.address(), ep.port());
+	}
+
+	void utp_stream::do_connect(endpoint_type const& ep)
+	{
+		TORRENT_ASSERT(m_impl);
+		m_impl->connect(udp::endpoint(ep.address(), ep.port()));
+	}
+
+	void utp_stream::add_read_buffer(void* buf, std::size_t len)
+	{
+		if (len == 0) return;
+		m_read_buffer.push_back(iovec_t(buf, len));
+	}
+
+	void utp_stream::add_write_buffer(void const* buf, std::size_t len)
+	{
+		if (len == 0) return;
+		m_write_buffer.push_back(iovec_t(const_cast<void*>(buf), len));
+	}
+
+	void utp_stream::set_read_handler()
+	{
+		TORRENT_ASSERT(m_impl);
+		m_impl->maybe_trigger_read_callback();
+	}
+
+	void utp_stream::set_write_handler()
+	{
+		TORRENT_ASSERT(m_impl);
+		m_impl->maybe_trigger_write_callback();
+	}
+
+	std::size_t utp_stream::do_read_some(error_code& ec)
+	{
+		TORRENT_ASSERT(m_impl);
+		std::size_t ret = m_impl->read_into_buffers();
+		m_read_buffer.clear();
+		if (ret > 0) return ret;
+
+		if (m_impl->m_error) ec = m_impl->m_error;
+		else if (m_impl->m_eof) ec = asio::error::eof;
+		else ec = asio::error::would_block;
+		return 0;
+	}
+
+	void utp_stream::on_read(std::size_t bytes_transferred, error_code const& ec)
+	{
+		TORRENT_ASSERT(m_read_handler);
+		m_io_service.post(boost::bind<void>(m_read_handler, ec, bytes_transferred));
+		m_read_handler.clear();
+		m_read_buffer.clear();
+	}
+
+	void utp_stream::on_write(std::size_t bytes_transferred, error_code const& ec)
+	{
+		TORRENT_ASSERT(m_write_handler);
+		m_io_service.post(boost::bind<void>(m_write_handler, ec, bytes_transferred));
+		m_write_handler.clear();
+		m_write_buffer.clear();
+	}
+
+	void utp_stream::on_connect(error_code const& ec)
+	{
+		TORRENT_ASSERT(m_connect_handler);
+		m_io_service.post(boost::bind<void>(m_connect_handler, ec));
+		m_connect_handler.clear();
+	}
+
+	void utp_stream::cancel_handlers(error_code const& ec)
+	{
+		if (m_read_handler) on_read(0, ec);
+		if (m_write_handler) on_write(0, ec);
+		if (m_connect_handler) on_connect(ec);
+	}
+
+	// ============ utp_socket_impl ============
+
+	utp_socket_impl::~utp_socket_impl()
+	{
+		// the manager is going away with the stream still
+		// attached. It's closed from now on
+		if (m_userdata)
+		{
+			m_userdata->m_impl = 0;
+			m_userdata->m_open = false;
+		}
+		clear_buffers();
+	}
+
+	void utp_socket_impl::clear_buffers()
+	{
+		for (std::deque<packet*>::iterator i = m_outbuf.begin()
+			, end(m_outbuf.end()); i != end; ++i)
+			delete *i;
+		m_outbuf.clear();
+		for (std::deque<in_packet*>::iterator i = m_inbuf.begin()
+			, end(m_inbuf.end()); i != end; ++i)
+			delete *i;
+		m_inbuf.clear();
+		m_num_sent = 0;
+		m_bytes_in_flight = 0;
+		m_send_buffer_size = 0;
+	}
+
+	void utp_socket_impl::connect(udp::endpoint const& ep)
+	{
+		TORRENT_ASSERT(m_state == UTP_STATE_NONE);
+		m_remote_address = ep;
+		m_recv_id = m_sm->new_connection_id(ep);
+		m_send_id = m_recv_id + 1;
+		m_sm->add_socket(m_recv_id, this);
+
+		packet* p = new packet;
+		p->num_transmissions = 0;
+		p->payload = 0;
+		p->type = ST_SYN;
+		p->seq_nr = m_seq_nr++;
+		m_outbuf.push_back(p);
+		m_state = UTP_STATE_SYN_SENT;
+		send_pkt(time_now_hires());
+	}
+
+	// called when the stream is closed. Anything that's
+	// still in the send buffer is delivered before the FIN
+	void utp_socket_impl::detach()
+	{
+		m_userdata = 0;
+		if (m_state != UTP_STATE_CONNECTED)
+		{
+			m_state = UTP_STATE_DELETE;
+			return;
+		}
+
+		packet* p = new packet;
+		p->num_transmissions = 0;
+		p->payload = 0;
+		p->type = ST_FIN;
+		p->seq_nr = m_seq_nr++;
+		m_outbuf.push_back(p);
+		m_state = UTP_STATE_FIN_SENT;
+		send_pkt(time_now_hires());
+
+		// the other end has closed already, and won't be
+		// around to ack our FIN
+		if (m_eof && m_outbuf.size() == 1) m_state = UTP_STATE_DELETE;
+	}
+
+	void utp_socket_impl::set_error(error_code const& ec)
+	{
+		m_error = ec;
+		clear_buffers();
+		if (m_userdata)
+		{
+			m_userdata->cancel_handlers(ec);
+			m_state = UTP_STATE_ERROR_WAIT;
+		}
+		else
+		{
+			m_state = UTP_STATE_DELETE;
+		}
+	}
+
+	int utp_socket_impl::send_buffer_limit() const
+	{
+		// keep enough data queued to fill the window twice over
+		return (std::max)(int(m_cwnd >> 16) * 2, 64 * 1024);
+	}
+
+	boost::uint32_t utp_socket_impl::receive_window_left() const
+	{
+		if (m_receive_buffer_size >= receive_window) return 0;
+		return receive_window - m_receive_buffer_size;
+	}
+
+	// copies received data into the stream's read buffers
+	std::size_t utp_socket_impl::read_into_buffers()
+	{
+		TORRENT_ASSERT(m_userdata);
+		std::size_t ret = 0;
+		bool window_closed = receive_window_left() < max_payload;
+		std::vector<utp_stream::iovec_t>& rb = m_userdata->m_read_buffer;
+		for (std::vector<utp_stream::iovec_t>::iterator i = rb.begin()
+			, end(rb.end()); i != end && !m_receive_buffer.empty(); ++i)
+		{
+			char* buf = (char*)i->buf;
+			std::size_t len = i->len;
+			while (len > 0 && !m_receive_buffer.empty())
+			{
+				std::vector<char>& b = m_receive_buffer.front();
+				std::size_t n = (std::min)(len, b.size() - m_receive_offset);
+				std::memcpy(buf, &b[m_receive_offset], n);
+				buf += n;
+				len -= n;
+				ret += n;
+				m_receive_offset += n;
+				m_receive_buffer_size -= n;
+				if (m_receive_offset == int(b.size()))
+				{
+					m_receive_buffer.pop_front();
+					m_receive_offset = 0;
+				}
+			}
+		}
+
+		// the other end has stopped sending because our window
+		// was full. Let it know there's room again
+		if (window_closed && receive_window_left() >= max_payload
+			&& m_state == UTP_STATE_CONNECTED)
+			send_state(time_now_hires());
+		return ret;
+	}
+
+	// moves data from the stream's write buffers into packets.
+	// Returns the number of bytes taken
+	std::size_t utp_socket_impl::fill_write()
+	{
+		TORRENT_ASSERT(m_userdata);
+		std::size_t ret = 0;
+		std::vector<utp_stream::iovec_t>& wb = m_userdata->m_write_buffer;
+		for (std::vector<utp_stream::iovec_t>::iterator i = wb.begin()
+			, end(wb.end()); i != end; ++i)
+		{
+			char const* buf = (char const*)i->buf;
+			int len = i->len;
+			while (len > 0)
+			{
+				int space = send_buffer_limit() - m_send_buffer_size;
+				if (space <= 0) return ret;
+
+				// fill up the last packet if it hasn't been sent yet
+				packet* p = 0;
+				if (int(m_outbuf.size()) > m_num_sent
+					&& m_outbuf.back()->type == ST_DATA
+					&& m_outbuf.back()->payload < max_payload)
+				{
+					p = m_outbuf.back();
+				}
+				else
+				{
+					p = new packet;
+					p->num_transmissions = 0;
+					p->payload = 0;
+					p->type = ST_DATA;
+					p->seq_nr = m_seq_nr++;
+					m_outbuf.push_back(p);
+				}
+				int n = (std::min)((std::min)(len, int(max_payload) - p->payload), space);
+				std::memcpy(p->buf + utp_header_size + p->payload, buf, n);
+				p->payload += n;
+				m_send_buffer_size += n;
+				buf += n;
+				len -= n;
+				ret += n;
+			}
+		}
+		return ret;
+	}
+
+	void utp_socket_impl::maybe_trigger_read_callback()
+	{
+		if (!m_userdata || !m_userdata->m_read_handler) return;
+
+		if (m_receive_buffer_size == 0)
+		{
+			if (m_error) m_userdata->on_read(0, m_error);
+			else if (m_eof) m_userdata->on_read(0, asio::error::eof);
+			return;
+		}
+
+		// a null_buffers read just waits for there to be something
+		if (m_userdata->m_read_buffer.empty())
+		{
+			m_userdata->on_read(0, error_code());
+			return;
+		}
+
+		std::size_t n = read_into_buffers();
+		m_userdata->on_read(n, error_code());
+	}
+
+	void utp_socket_impl::maybe_trigger_write_callback()
+	{
+		if (!m_userdata || !m_userdata->m_write_handler) return;
+
+		if (m_error)
+		{
+			m_userdata->on_write(0, m_error);
+			return;
+		}
+		if (m_state != UTP_STATE_CONNECTED) return;
+
+		// a null_buffers write just waits for room
+		if (m_userdata->m_write_buffer.empty())
+		{
+			if (m_send_buffer_size < send_buffer_limit())
+				m_userdata->on_write(0, error_code());
+			return;
+		}
+
+		std::size_t n = fill_write();
+		if (n == 0) return;
+		m_userdata->on_write(n, error_code());
+		send_pkt(time_now_hires());
+	}
+
+	// sends as many of the queued packets as the congestion
+	// window and the other end's receive window allow
+	void utp_socket_impl::send_pkt(ptime const& now)
+	{
+		int window = (std::min)(int(m_cwnd >> 16), m_adv_wnd);
+		while (m_num_sent < int(m_outbuf.size()))
+		{
+			packet* p = m_outbuf[m_num_sent];
+
+			// don't send a partial packet while there's data in
+			// flight, more may be written to it (Nagle)
+			if (p->type == ST_DATA
+				&& p->payload < max_payload
+				&& m_bytes_in_flight > 0
+				&& m_num_sent + 1 == int(m_outbuf.size()))
+				break;
+
+			// always allow one packet in flight, otherwise a
+			// closed window would never open again
+			if (m_bytes_in_flight > 0
+				&& m_bytes_in_flight + p->payload > window)
+				break;
+
+			transmit(p, now);
+			if (m_num_sent == 0) m_timeout = now + milliseconds(m_rto);
+			m_bytes_in_flight += p->payload;
+			++m_num_sent;
+		}
+
+		if (m_need_ack) send_state(now);
+	}
+
+	void utp_socket_impl::transmit(packet* p, ptime const& now)
+	{
+		using namespace detail;
+		char* ptr = p->buf;
+		write_uint8((p->type << 4) | 1, ptr);
+		write_uint8(0, ptr);
+		// the SYN carries the id we receive on
+		write_uint16(p->type == ST_SYN ? m_recv_id : m_send_id, ptr);
+		write_uint32(timestamp_micro(now), ptr);
+		write_uint32(m_reply_micro, ptr);
+		write_uint32(receive_window_left(), ptr);
+		write_uint16(p->seq_nr, ptr);
+		write_uint16(m_ack_nr, ptr);
+
+		error_code ec;
+		m_sm->send_packet(m_remote_address, p->buf, utp_header_size + p->payload, ec);
+		// if sending failed, the packet is treated as lost
+		++p->num_transmissions;
+		p->send_time = now;
+		m_need_ack = false;
+	}
+
+	// sends an ack without any payload. It carries the sequence
+	// number of the next packet, but doesn't use it up
+	void utp_socket_impl::send_state(ptime const& now)
+	{
+		using namespace detail;
+		char buf[utp_header_size];
+		char* ptr = buf;
+		write_uint8((ST_STATE << 4) | 1, ptr);
+		write_uint8(0, ptr);
+		write_uint16(m_send_id, ptr);
+		write_uint32(timestamp_micro(now), ptr);
+		write_uint32(m_reply_micro, ptr);
+		write_uint32(receive_window_left(), ptr);
+		write_uint16(m_seq_nr, ptr);
+		write_uint16(m_ack_nr, ptr);
+
+		error_code ec;
+		m_sm->send_packet(m_remote_address, buf, utp_header_size, ec);
+		m_need_ack = false;
+	}
+
+	bool utp_socket_impl::incoming_packet(char const* buf, int size
+		, udp::endpoint const& ep, ptime const& receive_time)
+	{
+		using namespace detail;
+		char const* ptr = buf;
+		int type = read_uint8(ptr) >> 4;
+		int extension = read_uint8(ptr);
+		read_uint16(ptr);
+		boost::uint32_t timestamp = read_uint32(ptr);
+		boost::uint32_t timestamp_diff = read_uint32(ptr);
+		boost::uint32_t wnd_size = read_uint32(ptr);
+		boost::uint16_t seq_nr = read_uint16(ptr);
+		boost::uint16_t ack_nr = read_uint16(ptr);
+
+		// skip the extension headers. Selective acks
+		// are not supported, so they are all ignored
+		while (extension != 0)
+		{
+			if (ptr - buf + 2 > size) return true;
+			extension = read_uint8(ptr);
+			int len = read_uint8(ptr);
+			if (ptr - buf + len > size) return true;
+			ptr += len;
+		}
+
+		if (m_state == UTP_STATE_DELETE) return true;
+
+		m_reply_micro = timestamp_micro(receive_time) - timestamp;
+		m_adv_wnd = (std::min)(wnd_size, boost::uint32_t(INT_MAX));
+
+		if (type == ST_RESET)
+		{
+			if (m_state == UTP_STATE_FIN_SENT) m_state = UTP_STATE_DELETE;
+			else if (m_state == UTP_STATE_SYN_SENT) set_error(asio::error::connection_refused);
+			else set_error(asio::error::connection_reset);
+			return true;
+		}
+
+		if (type == ST_SYN)
+		{
+			if (m_state == UTP_STATE_NONE)
+			{
+				// this is a new incoming connection
+				m_remote_address = ep;
+				m_ack_nr = seq_nr;
+				m_state = UTP_STATE_CONNECTED;
+			}
+			// if this is a resent SYN, our ack was lost
+			send_state(receive_time);
+			return true;
+		}
+
+		if (m_state == UTP_STATE_NONE || m_state == UTP_STATE_ERROR_WAIT)
+			return true;
+
+		int payload = size - (ptr - buf);
+		ack_packets(ack_nr, timestamp_diff, type == ST_STATE && payload == 0
+			, receive_time);
+		if (m_state == UTP_STATE_ERROR_WAIT || m_state == UTP_STATE_DELETE)
+			return true;
+
+		if (m_state == UTP_STATE_SYN_SENT)
+		{
+			// the SYN is acked when the send buffer is empty
+			if (type != ST_STATE || !m_outbuf.empty()) return true;
+			m_ack_nr = seq_nr - 1;
+			m_state = UTP_STATE_CONNECTED;
+			if (m_userdata && m_userdata->m_connect_handler)
+				m_userdata->on_connect(error_code());
+		}
+
+		if (type == ST_DATA || type == ST_FIN)
+			incoming_data(type, seq_nr, ptr, payload);
+
+		send_pkt(receive_time);
+
+		// the acks may have made room in the send buffer
+		maybe_trigger_write_callback();
+
+		if (m_state == UTP_STATE_FIN_SENT && m_outbuf.empty())
+			m_state = UTP_STATE_DELETE;
+		return true;
+	}
+
+	void utp_socket_impl::ack_packets(boost::uint16_t ack_nr, boost::uint32_t delay
+		, bool duplicate_ack, ptime const& now)
+	{
+		boost::uint16_t acked = ack_nr - m_acked_seq_nr;
+
+		// an old ack, or one for packets we haven't sent
+		if (acked > m_num_sent) return;
+
+		if (acked == 0)
+		{
+			if (!duplicate_ack || m_num_sent == 0) return;
+			if (++m_duplicate_acks != 3) return;
+
+			// the packet after the one that was acked three
+			// times is most likely lost. Resend it right away
+			transmit(m_outbuf.front(), now);
+			m_cwnd = (std::max)(m_cwnd / 2, boost::int64_t(utp_mtu) << 16);
+			return;
+		}
+		m_duplicate_acks = 0;
+
+		bool window_full = m_bytes_in_flight + max_payload
+			>= (std::min)(int(m_cwnd >> 16), m_adv_wnd);
+		int acked_bytes = 0;
+		int sample = -1;
+		for (int i = 0; i < acked; ++i)
+		{
+			packet* p = m_outbuf.front();
+			m_outbuf.pop_front();
+			--m_num_sent;
+			m_bytes_in_flight -= p->payload;
+			m_send_buffer_size -= p->payload;
+			acked_bytes += p->payload;
+			// resent packets can't tell which transmission was acked
+			if (p->num_transmissions == 1)
+				sample = total_milliseconds(now - p->send_time);
+			delete p;
+		}
+		m_acked_seq_nr = ack_nr;
+
+		if (sample >= 0) update_rtt(sample);
+		do_ledbat(acked_bytes, delay, window_full);
+		m_timeout = now + milliseconds(m_rto);
+	}
+
+	void utp_socket_impl::update_rtt(int sample)
+	{
+		if (m_rtt < 0)
+		{
+			m_rtt = sample;
+			m_rtt_var = sample / 2;
+		}
+		else
+		{
+			int delta = m_rtt - sample;
+			m_rtt_var += (std::abs(delta) - m_rtt_var) / 4;
+			m_rtt += (sample - m_rtt) / 8;
+		}
+		m_rto = (std::max)(m_rtt + m_rtt_var * 4, 500);
+	}
+
+	// LEDBAT. The window grows by up to max_cwnd_increase
+	// bytes per round trip while the queuing delay is below
+	// target, and shrinks in proportion when it's above
+	void utp_socket_impl::do_ledbat(int acked_bytes, boost::uint32_t delay
+		, bool window_full)
+	{
+		// the other end hasn't measured our delay yet
+		if (acked_bytes == 0 || delay == 0) return;
+
+		if (delay < m_base_delay[0]) m_base_delay[0] = delay;
+		boost::uint32_t base_delay = (std::min)(m_base_delay[0], m_base_delay[1]);
+
+		boost::int64_t off_target = target_delay - boost::int64_t(delay - base_delay);
+		if (off_target < -target_delay) off_target = -target_delay;
+
+		// don't grow the window when we're not using it
+		if (off_target > 0 && !window_full) return;
+
+		boost::int64_t window = (std::max)(m_cwnd >> 16, boost::int64_t(1));
+		m_cwnd += (boost::int64_t(max_cwnd_increase) << 16) * acked_bytes / window
+			* off_target / target_delay;
+		if (m_cwnd < (boost::int64_t(utp_mtu) << 16))
+			m_cwnd = boost::int64_t(utp_mtu) << 16;
+	}
+
+	void utp_socket_impl::incoming_data(int type, boost::uint16_t seq_nr
+		, char const* buf, int size)
+	{
+		m_need_ack = true;
+		if (m_eof) return;
+
+		boost::uint16_t offset = seq_nr - m_ack_nr;
+		// we have this one already
+		if (offset == 0 || offset > 0x8000) return;
+
+		if (offset > 1)
+		{
+			if (offset - 2 >= max_reorder) return;
+			if (int(m_inbuf.size()) <= offset - 2) m_inbuf.resize(offset - 1, 0);
+			in_packet*& p = m_inbuf[offset - 2];
+			if (p) return;
+			p = new in_packet;
+			p->type = type;
+			p->payload.assign(buf, buf + size);
+			return;
+		}
+
+		m_ack_nr = seq_nr;
+		consume(type, buf, size);
+
+		// deliver the packets that were waiting for this one
+		while (!m_inbuf.empty() && !m_eof)
+		{
+			in_packet* p = m_inbuf.front();
+			m_inbuf.pop_front();
+			if (p == 0) break;
+			++m_ack_nr;
+			consume(p->type, p->payload.empty() ? 0 : &p->payload[0], p->payload.size());
+			delete p;
+		}
+
+		maybe_trigger_read_callback();
+	}
+
+	void utp_socket_impl::consume(int type, char const* buf, int size)
+	{
+		if (type == ST_FIN)
+		{
+			m_eof = true;
+			for (std::deque<in_packet*>::iterator i = m_inbuf.begin()
+				, end(m_inbuf.end()); i != end; ++i)
+				delete *i;
+			m_inbuf.clear();
+			return;
+		}
+		if (size == 0) return;
+		m_receive_buffer.push_back(std::vector<char>(buf, buf + size));
+		m_receive_buffer_size += size;
+	}
+
+	void utp_socket_impl::tick(ptime const& now)
+	{
+		if (m_state == UTP_STATE_DELETE) return;
+
+		if (now - m_base_delay_rotate > minutes(1))
+		{
+			m_base_delay[1] = m_base_delay[0];
+			m_base_delay[0] = 0xffffffff;
+			m_base_delay_rotate = now;
+		}
+
+		if (m_num_sent == 0 || now < m_timeout) return;
+
+		packet* p = m_outbuf.front();
+		if (p->num_transmissions >= (p->type == ST_SYN ? 3 : 6))
+		{
+			if (m_state == UTP_STATE_FIN_SENT) m_state = UTP_STATE_DELETE;
+			else set_error(asio::error::timed_out);
+			return;
+		}
+
+		// the oldest packet timed out. Assume the network is
+		// congested and start over with a minimal window
+		m_rto = (std::min)(m_rto * 2, 60000);
+		m_cwnd = boost::int64_t(utp_mtu) << 16;
+		m_duplicate_acks = 0;
+		transmit(p, now);
+		m_timeout = now + milliseconds(m_rto);
+	}
+}
@@ -65,6 +65,8 @@ namespace libtorrent
 		: peer_connection(ses, t, s, remote, peerinfo)
 		, m_url(url)
 		, m_first_request(true)
+		, m_piece(ses, 0)
+		, m_piece_size(0)
 		, m_range_pos(0)
 		, m_block_pos(0)
 	{
@@ -312,6 +314,57 @@ namespace libtorrent
 		}
 	}
 
+	bool web_peer_connection::append_to_piece(char const* buf, int size)
+	{
+		if (!m_piece)
+		{
+			m_piece.reset(m_ses.allocate_disk_buffer("receive buffer"));
+			if (!m_piece)
+			{
+				disconnect("out of memory");
+				return false;
+			}
+		}
+		TORRENT_ASSERT(m_piece_size + size <= m_ses.m_disk_thread.block_size());
+		std::memcpy(m_piece.get() + m_piece_size, buf, size);
+		m_piece_size += size;
+		return true;
+	}
+
+	void web_peer_connection::on_receive_disk_buffer(torrent& t, int bytes_transferred)
+	{
+		m_statistics.received_bytes(bytes_transferred, 0);
+		incoming_piece_fragment(bytes_transferred);
+		m_range_pos += bytes_transferred;
+		m_block_pos += bytes_transferred;
+		if (!packet_finished()) return;
+
+		peer_request front_request = m_requests.front();
+		TORRENT_ASSERT(m_block_pos == front_request.length);
+
+		disk_buffer_holder holder(m_ses, release_disk_receive_buffer());
+		incoming_piece(front_request, holder);
+		m_requests.pop_front();
+		if (associated_torrent().expired()) return;
+		m_block_pos = 0;
+		m_received_body += front_request.length;
+		reset_recv_buffer(t.block_size() + 1024);
+
+		size_type range_size = m_parser.content_length();
+		if (m_parser.status_code() == 206)
+		{
+			std::pair<size_type, size_type> range = m_parser.content_range();
+			range_size = range.second - range.first + 1;
+		}
+		TORRENT_ASSERT(m_received_body <= range_size);
+		if (m_received_body < range_size) return;
+
+		m_file_requests.pop_front();
+		m_parser.reset();
+		m_body_start = 0;
+		m_received_body = 0;
+	}
+
 	void web_peer_connection::on_receive(error_code const& error
 		, std::size_t bytes_transferred)
 	{
@@ -330,6 +383,12 @@ namespace libtorrent
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
 		TORRENT_ASSERT(t);
 
+		if (has_disk_receive_buffer())
+		{
+			on_receive_disk_buffer(*t, bytes_transferred);
+			return;
+		}
+
 		for (;;)
 		{
 			buffer::const_interval recv_buffer = receive_buffer();
@@ -562,13 +621,13 @@ namespace libtorrent
 			// 3. the start of a block
 			// in that order, these parts are parsed.
 
-			bool range_overlaps_request = re > fs + int(m_piece.size());
+			bool range_overlaps_request = re > fs + m_piece_size;
 
 			if (!range_overlaps_request)
 			{
 				m_statistics.received_bytes(0, bytes_transferred);
 				// this means the end of the incoming request ends _before_ the
-				// first expected byte (fs + m_piece.size())
+				// first expected byte (fs + m_piece_size)
 				disconnect("invalid range in HTTP response", 2);
 				return;
 			}
@@ -585,27 +644,26 @@ namespace libtorrent
 				// (if it completed) call incoming_piece() with
 				// m_piece as buffer.
 				
-				int piece_size = int(m_piece.size());
-				int copy_size = (std::min)((std::min)(front_request.length - piece_size
+				int copy_size = (std::min)((std::min)(front_request.length - m_piece_size
 					, recv_buffer.left()), int(range_end - range_start - m_received_body));
-				m_piece.resize(piece_size + copy_size);
 				TORRENT_ASSERT(copy_size > 0);
-				std::memcpy(&m_piece[0] + piece_size, recv_buffer.begin, copy_size);
-				TORRENT_ASSERT(int(m_piece.size()) <= front_request.length);
+				if (!append_to_piece(recv_buffer.begin, copy_size)) return;
 				recv_buffer.begin += copy_size;
 				m_received_body += copy_size;
 				m_body_start += copy_size;
 				TORRENT_ASSERT(m_received_body <= range_end - range_start);
-				TORRENT_ASSERT(int(m_piece.size()) <= front_request.length);
-				if (int(m_piece.size()) == front_request.length)
+				TORRENT_ASSERT(m_piece_size <= front_request.length);
+				if (m_piece_size == front_request.length)
 				{
 					// each call to incoming_piece() may result in us becoming
 					// a seed. If we become a seed, all seeds we're connected to
 					// will be disconnected, including this web seed. We need to
 					// check for the disconnect condition after the call.
 
-					incoming_piece(front_request, &m_piece[0]);
+					incoming_piece(front_request, m_piece);
 					m_requests.pop_front();
+					m_piece.reset();
+					m_piece_size = 0;
 					if (associated_torrent().expired()) return;
 					TORRENT_ASSERT(m_block_pos == front_request.length);
 					m_block_pos = 0;
@@ -613,8 +671,6 @@ namespace libtorrent
 					m_body_start = 0;
 					recv_buffer = receive_buffer();
 					TORRENT_ASSERT(m_received_body <= range_end - range_start);
-					m_piece.clear();
-					TORRENT_ASSERT(m_piece.empty());
 				}
 			}
 
@@ -642,19 +698,17 @@ namespace libtorrent
 			if (!m_requests.empty())
 			{
 				range_overlaps_request = in_range.start + in_range.length
-					> m_requests.front().start + int(m_piece.size());
+					> m_requests.front().start + m_piece_size;
 
 				if (in_range.start + in_range.length < m_requests.front().start + m_requests.front().length
 					&& (m_received_body + recv_buffer.left() >= range_end - range_start))
 				{
-					int piece_size = int(m_piece.size());
-					int copy_size = (std::min)((std::min)(m_requests.front().length - piece_size
+					int copy_size = (std::min)((std::min)(m_requests.front().length - m_piece_size
 						, recv_buffer.left()), int(range_end - range_start - m_received_body));
 					TORRENT_ASSERT(copy_size >= 0);
 					if (copy_size > 0)
 					{
-						m_piece.resize(piece_size + copy_size);
-						std::memcpy(&m_piece[0] + piece_size, recv_buffer.begin, copy_size);
+						if (!append_to_piece(recv_buffer.begin, copy_size)) return;
 						recv_buffer.begin += copy_size;
 						m_received_body += copy_size;
 						m_body_start += copy_size;
@@ -675,7 +729,23 @@ namespace libtorrent
 				m_received_body = 0;
 				continue;
 			}
-			if (bytes_transferred == 0) break;
+			if (bytes_transferred > 0) continue;
+
+			// everything that was received has been accounted for. If
+			// the next block is all in this response, receive the
+			// rest of it directly into a disk buffer rather than into
+			// the receive buffer and then copying it out
+			if (!m_requests.empty()
+				&& m_piece_size == 0
+				&& range_contains(in_range, m_requests.front(), info.piece_length())
+				&& recv_buffer.left() < m_requests.front().length)
+			{
+				TORRENT_ASSERT(m_block_pos == recv_buffer.left());
+				cut_receive_buffer(m_body_start, m_requests.front().length);
+				m_body_start = 0;
+				move_to_disk_receive_buffer();
+			}
+			break;
 		}
 		TORRENT_ASSERT(bytes_transferred == 0);
 	}
@@ -0,0 +1,550 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// feeds a dht_tracker with queries from many spoofed sources at a
+// controlled rate and reports the query throughput, the time it takes
+// to handle each query, the memory used by the stored peers and how
+// the ban table treats flooding nodes. Unlike dht_flood.py it calls
+// the node directly, so the numbers don't depend on the network stack.
+// Like swarm_benchmark, it's not part of the test suite.
+//
+// The sources are spread over 127.0.0.0/8, which Linux routes to the
+// loopback interface, so the replies go to a socket in this process
+// and are counted without any traffic leaving the machine
+
+#include "libtorrent/aux_/session_impl.hpp"
+#include "libtorrent/kademlia/dht_tracker.hpp"
+#include "libtorrent/udp_socket.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/session_status.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/bind.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "setup_transfer.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	enum query_type { ping, find_node, get_peers, announce_peer, num_query_types };
+
+	char const* query_names[] = { "ping", "find_node", "get_peers", "announce_peer" };
+
+	struct options
+	{
+		options()
+			: num_queries(200000)
+			, rate(0)
+			, num_torrents(10000)
+			, num_flooders(100)
+			, flood_queries(100)
+		{
+			// the query mix, in percent
+			mix[ping] = 10;
+			mix[find_node] = 30;
+			mix[get_peers] = 40;
+			mix[announce_peer] = 20;
+		}
+
+		int num_queries;
+		// queries per second, 0 means as fast as possible
+		int rate;
+		// the number of info-hashes get_peers and
+		// announce_peer are spread over
+		int num_torrents;
+		// the number of nodes in the flood test, and the
+		// number of queries each of them sends
+		int num_flooders;
+		int flood_queries;
+		int mix[num_query_types];
+	};
+
+	void print_usage(char const* name)
+	{
+		std::cerr << "usage: " << name << " [options]\n\n"
+			"   -n <queries>     number of queries in the mixed test (200000)\n"
+			"   -r <rate>        queries per second (as fast as possible)\n"
+			"   -t <torrents>    number of info-hashes (10000)\n"
+			"   -f <nodes>       number of flooding nodes (100)\n"
+			"   -q <queries>     number of queries per flooding node (100)\n"
+			"   -m <p,f,g,a>     percentage of ping, find_node, get_peers\n"
+			"                    and announce_peer queries (10,30,40,20)\n";
+	}
+
+	bool parse_options(int argc, char* argv[], options& o)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (argv[i][0] != '-' || std::strlen(argv[i]) != 2 || i + 1 >= argc)
+				return false;
+			char const* arg = argv[i + 1];
+			switch (argv[i][1])
+			{
+				case 'n': o.num_queries = std::atoi(arg); break;
+				case 'r': o.rate = std::atoi(arg); break;
+				case 't': o.num_torrents = std::atoi(arg); break;
+				case 'f': o.num_flooders = std::atoi(arg); break;
+				case 'q': o.flood_queries = std::atoi(arg); break;
+				case 'm':
+					if (std::sscanf(arg, "%d,%d,%d,%d", &o.mix[ping], &o.mix[find_node]
+						, &o.mix[get_peers], &o.mix[announce_peer]) != 4)
+						return false;
+					break;
+				default: return false;
+			}
+			++i;
+		}
+		int total = 0;
+		for (int i = 0; i < num_query_types; ++i)
+		{
+			if (o.mix[i] < 0) return false;
+			total += o.mix[i];
+		}
+		return o.num_queries > 0 && o.rate >= 0 && o.num_torrents > 0
+			&& o.num_flooders >= 0 && o.flood_queries > 0 && total > 0;
+	}
+
+	// the CPU time this process has used, in microseconds
+	boost::int64_t cpu_time()
+	{
+#ifndef _WIN32
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return (boost::int64_t(ru.ru_utime.tv_sec) + ru.ru_stime.tv_sec) * 1000000
+			+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+		return 0;
+#endif
+	}
+
+	// the resident set size of this process in bytes, or 0
+	// if it's not known on this platform
+	boost::int64_t resident_memory()
+	{
+#ifdef __linux__
+		FILE* f = std::fopen("/proc/self/statm", "r");
+		if (f == 0) return 0;
+		long size = 0;
+		long resident = 0;
+		int n = std::fscanf(f, "%ld %ld", &size, &resident);
+		std::fclose(f);
+		if (n != 2) return 0;
+		return boost::int64_t(resident) * 4096;
+#else
+		return 0;
+#endif
+	}
+
+	std::string random_string(int len)
+	{
+		std::string ret(len, 0);
+		for (int i = 0; i < len; ++i) ret[i] = char(std::rand());
+		return ret;
+	}
+
+	address_v4 random_source()
+	{
+		// 127.0.0.1 is left out, it's where the node itself is
+		unsigned long a;
+		do { a = (127ul << 24) | ((std::rand() & 0xfff) << 12) | (std::rand() & 0xfff); }
+		while (a == 0x7f000001);
+		return address_v4(a);
+	}
+
+	void nop(error_code const&, udp::endpoint const&, char const*, int) {}
+
+	// a token handed out in a get_peers reply, which lets the
+	// same source announce to the same info-hash
+	struct write_token
+	{
+		udp::endpoint ep;
+		std::string info_hash;
+		std::string token;
+	};
+
+	// what's recorded of every query that's been sent, it's
+	// looked up by the transaction id of the reply
+	struct sent_query
+	{
+		udp::endpoint ep;
+		int type;
+		int flooder;
+		std::string info_hash;
+	};
+
+	struct benchmark
+	{
+		benchmark(options const& o_, dht::dht_tracker& dht_
+			, udp::socket& replies_, io_service& ios_)
+			: o(o_), dht(dht_), replies(replies_), ios(ios_)
+			, source_port(replies_.local_endpoint().port())
+		{
+			for (int i = 0; i < o.num_torrents; ++i)
+				info_hashes.push_back(random_string(20));
+			clear();
+		}
+
+		void clear()
+		{
+			queries.clear();
+			std::memset(sent, 0, sizeof(sent));
+			std::memset(answered, 0, sizeof(answered));
+			errors = 0;
+			for (int i = 0; i < num_query_types; ++i) latency[i].clear();
+			flooder_replies.assign(o.num_flooders, 0);
+		}
+
+		// builds a query from the source ep and passes it to the node
+		void send(int type, udp::endpoint const& ep, int flooder = -1
+			, write_token const* t = 0)
+		{
+			entry e;
+			e["y"] = "q";
+			e["q"] = query_names[type];
+			char tid[4];
+			char* ptr = tid;
+			detail::write_uint32(boost::uint32_t(queries.size()), ptr);
+			e["t"] = std::string(tid, 4);
+			entry& a = e["a"];
+			a["id"] = random_string(20);
+
+			sent_query q;
+			q.ep = ep;
+			q.type = type;
+			q.flooder = flooder;
+			switch (type)
+			{
+				case find_node:
+					a["target"] = random_string(20);
+					break;
+				case get_peers:
+					q.info_hash = info_hashes[std::rand() % info_hashes.size()];
+					a["info_hash"] = q.info_hash;
+					break;
+				case announce_peer:
+					a["info_hash"] = t->info_hash;
+					a["port"] = entry::integer_type(1 + std::rand() % 65535);
+					a["token"] = t->token;
+					break;
+				default: break;
+			}
+			queries.push_back(q);
+
+			buf.clear();
+			bencode(std::back_inserter(buf), e);
+
+			ptime start = time_now_hires();
+			dht.on_receive(ep, &buf[0], int(buf.size()));
+			latency[type].add(time_now_hires() - start);
+			++sent[type];
+		}
+
+		// reads all the replies that have arrived so far
+		void drain()
+		{
+			error_code ec;
+			// lets the socket's rate limiter refill its quota
+			ios.poll(ec);
+			char packet[1500];
+			while (replies.available(ec) > 0 && !ec)
+			{
+				udp::endpoint from;
+				int len = int(replies.receive_from(asio::buffer(packet
+					, sizeof(packet)), from, 0, ec));
+				if (ec || len <= 0) break;
+
+				lazy_entry e;
+				if (lazy_bdecode(packet, packet + len, e) != 0) continue;
+				if (e.type() != lazy_entry::dict_t) continue;
+				std::string tid = e.dict_find_string_value("t");
+				if (tid.size() != 4) continue;
+				char const* ptr = tid.c_str();
+				boost::uint32_t index = detail::read_uint32(ptr);
+				if (index >= queries.size()) continue;
+				sent_query const& q = queries[index];
+
+				if (e.dict_find_string_value("y") != "r")
+				{
+					++errors;
+					continue;
+				}
+				++answered[q.type];
+				if (q.flooder >= 0) ++flooder_replies[q.flooder];
+
+				lazy_entry const* r = e.dict_find_dict("r");
+				if (q.type != get_peers || r == 0) continue;
+				write_token t;
+				t.token = r->dict_find_string_value("token");
+				if (t.token.empty()) continue;
+				t.ep = q.ep;
+				t.info_hash = q.info_hash;
+				tokens.push_back(t);
+			}
+		}
+
+		// waits until it's time to send query number i
+		void pace(ptime start, int i)
+		{
+			if (o.rate == 0) return;
+			ptime due = start + microsec(boost::int64_t(i) * 1000000 / o.rate);
+			while (time_now_hires() < due) {}
+		}
+
+		int pick_type()
+		{
+			int total = 0;
+			for (int i = 0; i < num_query_types; ++i) total += o.mix[i];
+			int r = std::rand() % total;
+			for (int i = 0; i < num_query_types; ++i)
+			{
+				if (r < o.mix[i]) return i;
+				r -= o.mix[i];
+			}
+			return ping;
+		}
+
+		void print_results(time_duration elapsed, boost::int64_t cpu)
+		{
+			int total = 0;
+			for (int i = 0; i < num_query_types; ++i) total += sent[i];
+			double seconds = total_microseconds(elapsed) / 1000000.0;
+			if (seconds <= 0) seconds = 0.000001;
+			std::printf("%d queries in %.2f s, %.0f queries/s, %.0f queries per CPU second\n"
+				, total, seconds, total / seconds
+				, cpu > 0 ? total / (cpu / 1000000.0) : 0.0);
+			std::printf("%-14s %9s %9s %8s %8s %8s %8s\n", "query", "sent"
+				, "answered", "mean", "p50", "p99", "max");
+			for (int i = 0; i < num_query_types; ++i)
+			{
+				std::printf("%-14s %9d %9d %8lld %8lld %8lld %8lld\n", query_names[i]
+					, sent[i], answered[i], (long long)latency[i].mean()
+					, (long long)latency[i].percentile(0.5)
+					, (long long)latency[i].percentile(0.99)
+					, (long long)latency[i].max_value);
+			}
+			if (errors) std::printf("%d error replies\n", errors);
+		}
+
+		options const& o;
+		dht::dht_tracker& dht;
+		udp::socket& replies;
+		io_service& ios;
+		int source_port;
+
+		std::vector<std::string> info_hashes;
+		std::vector<sent_query> queries;
+		std::vector<write_token> tokens;
+		std::vector<char> buf;
+
+		int sent[num_query_types];
+		int answered[num_query_types];
+		int errors;
+		latency_histogram latency[num_query_types];
+		std::vector<int> flooder_replies;
+	};
+
+	// every query comes from a new source, so none of them are banned.
+	// announce_peer queries are sent from the sources that got a
+	// token in a get_peers reply
+	void run_mixed(benchmark& b)
+	{
+		b.clear();
+		boost::int64_t memory = resident_memory();
+		boost::int64_t cpu = cpu_time();
+		ptime start = time_now_hires();
+		for (int i = 0; i < b.o.num_queries; ++i)
+		{
+			b.pace(start, i);
+			int type = b.pick_type();
+			if (type == announce_peer && b.tokens.empty()) type = get_peers;
+			if (type == announce_peer)
+			{
+				int k = std::rand() % b.tokens.size();
+				write_token t = b.tokens[k];
+				b.tokens[k] = b.tokens.back();
+				b.tokens.pop_back();
+				b.send(type, t.ep, -1, &t);
+			}
+			else
+			{
+				b.send(type, udp::endpoint(random_source(), b.source_port));
+			}
+			if ((i & 63) == 63) b.drain();
+		}
+		time_duration elapsed = time_now_hires() - start;
+		cpu = cpu_time() - cpu;
+		b.drain();
+
+		std::printf("\nmixed queries from new sources\n");
+		b.print_results(elapsed, cpu);
+
+		session_status st;
+		b.dht.dht_status(st);
+		std::printf("stored torrents: %d, memory growth: %lld kiB, routing table nodes: %d\n"
+			, st.dht_torrents, (long long)(resident_memory() - memory) / 1024
+			, st.dht_nodes);
+	}
+
+	// num_flooders nodes each send flood_queries get_peers queries
+	// as fast as they can, interleaved with the same number of queries
+	// from new sources. The flooders should be banned after 20 queries,
+	// unless the other sources push them out of the ban table
+	void run_flood(benchmark& b)
+	{
+		if (b.o.num_flooders == 0) return;
+		b.clear();
+		std::vector<udp::endpoint> flooders;
+		for (int i = 0; i < b.o.num_flooders; ++i)
+			flooders.push_back(udp::endpoint(random_source(), b.source_port));
+
+		boost::int64_t cpu = cpu_time();
+		ptime start = time_now_hires();
+		int n = 0;
+		int background = 0;
+		for (int k = 0; k < b.o.flood_queries; ++k)
+		{
+			for (int i = 0; i < b.o.num_flooders; ++i)
+			{
+				b.pace(start, n++);
+				b.send(get_peers, flooders[i], i);
+				b.pace(start, n++);
+				b.send(get_peers, udp::endpoint(random_source(), b.source_port));
+				++background;
+				if ((n & 63) == 0) b.drain();
+			}
+		}
+		time_duration elapsed = time_now_hires() - start;
+		cpu = cpu_time() - cpu;
+		b.drain();
+
+		int flooder_answered = 0;
+		int most = 0;
+		for (int i = 0; i < b.o.num_flooders; ++i)
+		{
+			flooder_answered += b.flooder_replies[i];
+			if (b.flooder_replies[i] > most) most = b.flooder_replies[i];
+		}
+		int total_answered = b.answered[get_peers];
+
+		std::printf("\n%d flooding nodes, %d queries each\n"
+			, b.o.num_flooders, b.o.flood_queries);
+		b.print_results(elapsed, cpu);
+		std::printf("flooders answered: %.1f queries per node (most: %d)\n"
+			"other sources answered: %d of %d\n"
+			, flooder_answered / double(b.o.num_flooders), most
+			, total_answered - flooder_answered, background);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	options o;
+	if (!parse_options(argc, argv, o))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	std::srand(1);
+
+	// the node needs a session for its alerts, but none of the
+	// session's own sockets or its DHT are used
+	aux::session_impl ses(std::make_pair(0, 0), fingerprint("LT", 0, 0, 0, 0), "0.0.0.0"
+#if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
+		, "."
+#endif
+		);
+
+	// the io_service is only polled between batches of queries, to
+	// run the rate limiter of the node's socket. The node isn't started,
+	// so it doesn't bootstrap or refresh its routing table
+	io_service ios;
+	connection_queue cq(ios);
+	error_code ec;
+	rate_limited_udp_socket sock(ios, &nop, cq);
+	sock.bind(udp::endpoint(address_v4::loopback(), 0), ec);
+	if (ec)
+	{
+		std::fprintf(stderr, "failed to bind the node's socket: %s\n", ec.message().c_str());
+		return 1;
+	}
+	sock.set_rate_limit(100 * 1024 * 1024);
+
+	udp::socket replies(ios);
+	replies.open(udp::v4(), ec);
+	if (!ec) replies.bind(udp::endpoint(address_v4::any(), 0), ec);
+	if (!ec) replies.set_option(udp::socket::receive_buffer_size(4 * 1024 * 1024), ec);
+	if (ec)
+	{
+		std::fprintf(stderr, "failed to bind the reply socket: %s\n", ec.message().c_str());
+		return 1;
+	}
+
+	// the socket starts out with a small send quota. Wait until
+	// its first tick to raise it to the rate limit
+	test_sleep(1100);
+	ios.poll(ec);
+
+	dht_settings settings;
+	boost::intrusive_ptr<dht::dht_tracker> dht = new dht::dht_tracker(ses, sock, settings);
+
+	std::printf("%d torrents, mix: ping %d%% find_node %d%% get_peers %d%% announce_peer %d%%\n"
+		"latencies are in microseconds\n"
+		, o.num_torrents, o.mix[ping], o.mix[find_node], o.mix[get_peers]
+		, o.mix[announce_peer]);
+
+	benchmark b(o, *dht, replies, ios);
+	run_mixed(b);
+	run_flood(b);
+
+	dht->stop();
+	sock.close();
+	return 0;
+}
@@ -0,0 +1,425 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// drives piece_manager and disk_io_thread directly with synthetic
+// workloads against real files, for a range of disk cache settings.
+// Like swarm_benchmark it's not part of the test suite
+
+#include "libtorrent/storage.hpp"
+#include "libtorrent/disk_io_thread.hpp"
+#include "libtorrent/file_pool.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+using namespace libtorrent;
+using boost::filesystem::path;
+using boost::filesystem::remove_all;
+using boost::filesystem::create_directories;
+
+namespace
+{
+	int const block_size = 16 * 1024;
+
+	struct options
+	{
+		options()
+			: total_size(256)
+			, piece_size(256 * 1024)
+			, queue_depth(32)
+			, num_reads(0)
+			, disk_threads(1)
+			, save_path("./disk_io_benchmark")
+		{}
+
+		// in MiB
+		int total_size;
+		int piece_size;
+		// the number of jobs kept outstanding
+		int queue_depth;
+		// the number of random block reads. 0 means as
+		// many as there are blocks
+		int num_reads;
+		int disk_threads;
+		path save_path;
+	};
+
+	void print_usage(char const* name)
+	{
+		std::cerr << "usage: " << name << " [options]\n\n"
+			"   -s <size>       size of the torrent in MiB (256)\n"
+			"   -p <size>       piece size in kiB (256)\n"
+			"   -q <depth>      number of outstanding jobs (32)\n"
+			"   -r <reads>      number of random block reads (one per block)\n"
+			"   -t <threads>    number of disk threads (1)\n"
+			"   -d <path>       directory to put the files in (./disk_io_benchmark)\n";
+	}
+
+	bool parse_options(int argc, char* argv[], options& o)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (argv[i][0] != '-' || std::strlen(argv[i]) != 2 || i + 1 >= argc)
+				return false;
+			char const* arg = argv[i + 1];
+			switch (argv[i][1])
+			{
+				case 's': o.total_size = std::atoi(arg); break;
+				case 'p': o.piece_size = std::atoi(arg) * 1024; break;
+				case 'q': o.queue_depth = std::atoi(arg); break;
+				case 'r': o.num_reads = std::atoi(arg); break;
+				case 't': o.disk_threads = std::atoi(arg); break;
+				case 'd': o.save_path = arg; break;
+				default: return false;
+			}
+			++i;
+		}
+		return o.total_size > 0 && o.piece_size >= block_size
+			&& o.piece_size % block_size == 0 && o.queue_depth > 0
+			&& o.disk_threads > 0;
+	}
+
+	// the content of every block is a function of its position, so
+	// the torrent's hashes can be computed up front and the check
+	// workload can verify what the write workload wrote
+	void fill_block(char* buf, int piece, int block)
+	{
+		boost::uint32_t state = piece * 7919 + block * 104729 + 1;
+		for (int i = 0; i < block_size; ++i)
+		{
+			state = state * 1664525 + 1013904223;
+			buf[i] = char(state >> 24);
+		}
+	}
+
+	boost::intrusive_ptr<torrent_info> make_torrent(options const& o)
+	{
+		file_storage fs;
+		fs.add_file(path("disk_io_benchmark/file"), size_type(o.total_size) * 1024 * 1024);
+		libtorrent::create_torrent t(fs, o.piece_size);
+
+		int const blocks_per_piece = o.piece_size / block_size;
+		std::vector<char> buf(block_size);
+		for (int i = 0; i < t.num_pieces(); ++i)
+		{
+			hasher h;
+			for (int k = 0; k < blocks_per_piece; ++k)
+			{
+				fill_block(&buf[0], i, k);
+				h.update(&buf[0], block_size);
+			}
+			t.set_hash(i, h.final());
+		}
+
+		std::vector<char> torrent;
+		bencode(std::back_inserter(torrent), t.generate());
+		return boost::intrusive_ptr<torrent_info>(new torrent_info(&torrent[0], torrent.size()));
+	}
+
+	struct workload
+	{
+		workload(io_service& ios_, disk_io_thread& io_, piece_manager& pm_)
+			: ios(ios_), io(io_), pm(pm_), outstanding(0), failed(0)
+		{}
+
+		io_service& ios;
+		disk_io_thread& io;
+		piece_manager& pm;
+		int outstanding;
+		int failed;
+		latency_histogram latency;
+	};
+
+	void on_job(int ret, disk_io_job const& j, workload* w, ptime issued)
+	{
+		--w->outstanding;
+		w->latency.add(time_now_hires() - issued);
+		if (ret < 0) ++w->failed;
+		if (j.action == disk_io_job::read && j.buffer)
+		{
+			if (j.cached_buffer) w->io.reclaim_buffer(j.buffer);
+			else w->io.free_buffer(j.buffer);
+		}
+	}
+
+	void on_done(int ret, disk_io_job const& j, bool* done, int* result)
+	{
+		// check_files reports its progress with -1
+		if (j.action == disk_io_job::check_files && ret == -1) return;
+		*result = ret;
+		*done = true;
+	}
+
+	void wait_for(io_service& ios, bool const& done)
+	{
+		error_code ec;
+		while (!done)
+		{
+			ios.reset();
+			ios.run_one(ec);
+		}
+	}
+
+	// lets the outstanding jobs drain below the queue depth
+	void wait_for_slot(workload& w, int depth)
+	{
+		error_code ec;
+		while (w.outstanding >= depth)
+		{
+			w.ios.reset();
+			w.ios.run_one(ec);
+		}
+	}
+
+	int check_files(io_service& ios, piece_manager& pm)
+	{
+		bool done = false;
+		int ret = 0;
+		lazy_entry empty;
+		pm.async_check_fastresume(&empty, boost::bind(&on_done, _1, _2, &done, &ret));
+		wait_for(ios, done);
+		if (ret != piece_manager::need_full_check) return ret;
+		done = false;
+		pm.async_check_files(boost::bind(&on_done, _1, _2, &done, &ret));
+		wait_for(ios, done);
+		return ret;
+	}
+
+	void release_files(io_service& ios, piece_manager& pm)
+	{
+		bool done = false;
+		int ret = 0;
+		pm.async_release_files(boost::bind(&on_done, _1, _2, &done, &ret));
+		wait_for(ios, done);
+	}
+
+	void clear_read_cache(io_service& ios, piece_manager& pm)
+	{
+		bool done = false;
+		int ret = 0;
+		pm.async_clear_read_cache(boost::bind(&on_done, _1, _2, &done, &ret));
+		wait_for(ios, done);
+	}
+
+	void print_result(char const* config, char const* name, int jobs
+		, size_type bytes, time_duration elapsed, latency_histogram const& h
+		, int failed)
+	{
+		double seconds = total_microseconds(elapsed) / 1000000.0;
+		if (seconds <= 0) seconds = 0.000001;
+		std::printf("%-22s %-6s %9.1f %9.0f %8lld %8lld %8lld %8lld%s\n"
+			, config, name, bytes / 1024.0 / 1024.0 / seconds, jobs / seconds
+			, (long long)h.percentile(0.5), (long long)h.percentile(0.99)
+			, (long long)h.percentile(0.999), (long long)h.max_value
+			, failed ? " (errors)" : "");
+	}
+
+	// downloads the torrent in order, the way a fast peer would
+	void write_sequential(options const& o, char const* config
+		, workload& w, torrent_info const& ti)
+	{
+		int const blocks_per_piece = o.piece_size / block_size;
+		int jobs = 0;
+		ptime start = time_now_hires();
+		for (int i = 0; i < ti.num_pieces(); ++i)
+		{
+			for (int k = 0; k < blocks_per_piece; ++k)
+			{
+				wait_for_slot(w, o.queue_depth);
+				disk_buffer_holder buf(w.io, w.io.allocate_buffer("send buffer"));
+				fill_block(buf.get(), i, k);
+				peer_request r;
+				r.piece = i;
+				r.start = k * block_size;
+				r.length = block_size;
+				++w.outstanding;
+				w.pm.async_write(r, buf, boost::bind(&on_job, _1, _2, &w, time_now_hires()));
+				++jobs;
+			}
+		}
+		wait_for_slot(w, 1);
+		// the write isn't done until it's been flushed from the cache
+		release_files(w.ios, w.pm);
+		print_result(config, "write", jobs, size_type(jobs) * block_size
+			, time_now_hires() - start, w.latency, w.failed);
+	}
+
+	// reads random blocks, the way a seed serving many peers would
+	void read_random(options const& o, char const* config
+		, workload& w, torrent_info const& ti)
+	{
+		int const blocks_per_piece = o.piece_size / block_size;
+		int const num_blocks = ti.num_pieces() * blocks_per_piece;
+		int const num_reads = o.num_reads > 0 ? o.num_reads : num_blocks;
+		std::srand(1);
+		ptime start = time_now_hires();
+		for (int i = 0; i < num_reads; ++i)
+		{
+			wait_for_slot(w, o.queue_depth);
+			int block = std::rand() % num_blocks;
+			peer_request r;
+			r.piece = block / blocks_per_piece;
+			r.start = (block % blocks_per_piece) * block_size;
+			r.length = block_size;
+			++w.outstanding;
+			w.pm.async_read(r, boost::bind(&on_job, _1, _2, &w, time_now_hires()));
+		}
+		wait_for_slot(w, 1);
+		print_result(config, "read", num_reads, size_type(num_reads) * block_size
+			, time_now_hires() - start, w.latency, w.failed);
+	}
+
+	void run_config(options const& o, char const* config
+		, session_settings const& s
+		, boost::intrusive_ptr<torrent_info> ti)
+	{
+		remove_all(o.save_path / "disk_io_benchmark");
+
+		file_pool fp;
+		io_service ios;
+		disk_io_thread io(ios, block_size, o.disk_threads);
+
+		bool done = false;
+		int ret = 0;
+		disk_io_job j;
+		j.buffer = (char*)&s;
+		j.action = disk_io_job::update_settings;
+		io.add_job(j, boost::bind(&on_done, _1, _2, &done, &ret));
+		wait_for(ios, done);
+
+		boost::shared_ptr<int> dummy(new int);
+		{
+			boost::intrusive_ptr<piece_manager> pm = new piece_manager(dummy, ti
+				, o.save_path, fp, io, default_storage_constructor, storage_mode_sparse);
+			check_files(ios, *pm);
+
+			workload writes(ios, io, *pm);
+			write_sequential(o, config, writes, *ti);
+
+			clear_read_cache(ios, *pm);
+			workload reads(ios, io, *pm);
+			read_random(o, config, reads, *ti);
+			release_files(ios, *pm);
+		}
+
+		// hash check everything that was written, with a new
+		// storage so nothing is cached
+		{
+			boost::intrusive_ptr<piece_manager> pm = new piece_manager(dummy, ti
+				, o.save_path, fp, io, default_storage_constructor, storage_mode_sparse);
+			ptime start = time_now_hires();
+			int check_ret = check_files(ios, *pm);
+			latency_histogram h;
+			time_duration elapsed = time_now_hires() - start;
+			h.add(elapsed);
+			print_result(config, "check", ti->num_pieces(), ti->total_size()
+				, elapsed, h, check_ret != 0);
+			release_files(ios, *pm);
+		}
+
+		io.join();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	options o;
+	if (!parse_options(argc, argv, o))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	create_directories(o.save_path);
+	boost::intrusive_ptr<torrent_info> ti = make_torrent(o);
+
+	// every setting is varied on its own, keeping the others
+	// at their default
+	std::vector<std::pair<std::string, session_settings> > configs;
+	session_settings def;
+	configs.push_back(std::make_pair(std::string("default"), def));
+
+	session_settings s = def;
+	s.cache_size = 64;
+	configs.push_back(std::make_pair(std::string("cache_size=64"), s));
+	s = def;
+	s.cache_size = 8192;
+	configs.push_back(std::make_pair(std::string("cache_size=8192"), s));
+	s = def;
+	s.read_cache_line_size = 4;
+	configs.push_back(std::make_pair(std::string("read_cache_line=4"), s));
+	s = def;
+	s.read_cache_line_size = 64;
+	configs.push_back(std::make_pair(std::string("read_cache_line=64"), s));
+	s = def;
+	s.disk_cache_algorithm = session_settings::lru;
+	configs.push_back(std::make_pair(std::string("algorithm=lru"), s));
+	s = def;
+	s.disk_cache_algorithm = session_settings::two_queue;
+	configs.push_back(std::make_pair(std::string("algorithm=two_queue"), s));
+	s = def;
+	s.coalesce_reads = true;
+	s.coalesce_writes = true;
+	configs.push_back(std::make_pair(std::string("coalesce"), s));
+	s = def;
+	s.disk_io_read_mode = session_settings::disable_os_cache;
+	s.disk_io_write_mode = session_settings::disable_os_cache;
+	configs.push_back(std::make_pair(std::string("no_os_cache"), s));
+
+	std::printf("%d MiB, %d kiB pieces, queue depth %d, %d disk threads\n"
+		"latencies are in microseconds\n\n"
+		, o.total_size, o.piece_size / 1024, o.queue_depth, o.disk_threads);
+	std::printf("%-22s %-6s %9s %9s %8s %8s %8s %8s\n", "config", "job"
+		, "MiB/s", "IOPS", "p50", "p99", "p99.9", "max");
+
+	for (std::vector<std::pair<std::string, session_settings> >::iterator i
+		= configs.begin(), end(configs.end()); i != end; ++i)
+		run_config(o, i->first.c_str(), i->second, ti);
+
+	remove_all(o.save_path / "disk_io_benchmark");
+	return 0;
+}
+
@@ -0,0 +1,765 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// connects to a session over loopback and streams synthetic peer
+// messages to it, to time how fast bt_peer_connection parses and
+// handles them: handshakes with bitfields, HAVE storms, request
+// pipelines, piece pipelines and peer exchange messages, in plaintext
+// and RC4 encrypted. The stream for each workload is built (and
+// encrypted) before the clock starts, and it ends with a request the
+// session always rejects, so the workload is done when that reject
+// comes back. Like swarm_benchmark, it's not part of the test suite
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/ip_filter.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/time.hpp"
+#ifndef TORRENT_DISABLE_ENCRYPTION
+#include "libtorrent/pe_crypto.hpp"
+#endif
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "setup_transfer.hpp"
+
+using namespace libtorrent;
+using boost::filesystem::path;
+using boost::filesystem::remove_all;
+using boost::filesystem::create_directories;
+
+namespace
+{
+	int const block_size = 16 * 1024;
+	int const piece_size = 256 * 1024;
+
+	enum
+	{
+		msg_bitfield = 5,
+		msg_request = 6,
+		msg_piece = 7,
+		msg_reject_request = 16,
+		msg_extended = 20
+	};
+
+	struct options
+	{
+		options()
+			: total_size(32)
+			, num_handshakes(200)
+			, num_haves(200000)
+			, num_requests(200000)
+			, num_pex(20000)
+			, save_path("./peer_wire_benchmark")
+		{}
+
+		// the size of the torrents, in MiB
+		int total_size;
+		int num_handshakes;
+		int num_haves;
+		int num_requests;
+		int num_pex;
+		path save_path;
+	};
+
+	void print_usage(char const* name)
+	{
+		std::cerr << "usage: " << name << " [options]\n\n"
+			"   -s <size>       size of the torrent in MiB, all of it is sent\n"
+			"                   in the piece workload (32)\n"
+			"   -c <count>      number of handshakes (200)\n"
+			"   -h <count>      number of HAVE messages (200000)\n"
+			"   -r <count>      number of requests (200000)\n"
+			"   -x <count>      number of peer exchange messages (20000)\n"
+			"   -d <path>       directory to put the files in (./peer_wire_benchmark)\n";
+	}
+
+	bool parse_options(int argc, char* argv[], options& o)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (argv[i][0] != '-' || std::strlen(argv[i]) != 2 || i + 1 >= argc)
+				return false;
+			char const* arg = argv[i + 1];
+			switch (argv[i][1])
+			{
+				case 's': o.total_size = std::atoi(arg); break;
+				case 'c': o.num_handshakes = std::atoi(arg); break;
+				case 'h': o.num_haves = std::atoi(arg); break;
+				case 'r': o.num_requests = std::atoi(arg); break;
+				case 'x': o.num_pex = std::atoi(arg); break;
+				case 'd': o.save_path = arg; break;
+				default: return false;
+			}
+			++i;
+		}
+		return o.total_size > 0 && o.num_handshakes >= 0 && o.num_haves >= 0
+			&& o.num_requests >= 0 && o.num_pex >= 0;
+	}
+
+	// the CPU time this process has used, in microseconds
+	boost::int64_t cpu_time()
+	{
+#ifndef _WIN32
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return (boost::int64_t(ru.ru_utime.tv_sec) + ru.ru_stime.tv_sec) * 1000000
+			+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+		return 0;
+#endif
+	}
+
+	// the content of every block is a function of the torrent and its
+	// position, so the piece workload can send data that passes the
+	// hash check without keeping the files around
+	void fill_block(char* buf, int torrent, int piece, int block)
+	{
+		boost::uint32_t state = torrent * 15485863 + piece * 7919 + block * 104729 + 1;
+		for (int i = 0; i < block_size; ++i)
+		{
+			state = state * 1664525 + 1013904223;
+			buf[i] = char(state >> 24);
+		}
+	}
+
+	boost::intrusive_ptr<torrent_info> make_torrent(options const& o, int index)
+	{
+		file_storage fs;
+		char name[100];
+		snprintf(name, sizeof(name), "peer_wire_%d", index);
+		fs.add_file(path(name), size_type(o.total_size) * 1024 * 1024);
+		libtorrent::create_torrent t(fs, piece_size);
+
+		int const blocks_per_piece = piece_size / block_size;
+		std::vector<char> buf(block_size);
+		for (int i = 0; i < t.num_pieces(); ++i)
+		{
+			hasher h;
+			for (int k = 0; k < blocks_per_piece; ++k)
+			{
+				fill_block(&buf[0], index, i, k);
+				h.update(&buf[0], block_size);
+			}
+			t.set_hash(i, h.final());
+		}
+
+		std::vector<char> torrent;
+		bencode(std::back_inserter(torrent), t.generate());
+		return boost::intrusive_ptr<torrent_info>(new torrent_info(&torrent[0], torrent.size()));
+	}
+
+	// appends messages to a stream
+	struct message_writer
+	{
+		message_writer(std::vector<char>& b): buf(b), out(std::back_inserter(b)) {}
+
+		void header(int len, int id)
+		{
+			detail::write_uint32(len + 1, out);
+			detail::write_uint8(id, out);
+		}
+
+		void handshake(sha1_hash const& info_hash)
+		{
+			static char const protocol[] = "\x13" "BitTorrent protocol";
+			buf.insert(buf.end(), protocol, protocol + 20);
+			char reserved[8] = {0, 0, 0, 0, 0, 0x10, 0, 0x04};
+			buf.insert(buf.end(), reserved, reserved + 8);
+			buf.insert(buf.end(), info_hash.begin(), info_hash.end());
+			// every connection gets its own peer id, the session
+			// drops connections with the same id as another one
+			for (int i = 0; i < 20; ++i) buf.push_back(char(std::rand()));
+		}
+
+		void extended(int ext_id, entry const& e)
+		{
+			std::vector<char> body;
+			bencode(std::back_inserter(body), e);
+			header(1 + body.size(), msg_extended);
+			detail::write_uint8(ext_id, out);
+			buf.insert(buf.end(), body.begin(), body.end());
+		}
+
+		void extension_handshake()
+		{
+			entry e;
+			e["m"]["ut_pex"] = 1;
+			e["v"] = "peer_wire_benchmark";
+			extended(0, e);
+		}
+
+		void bitfield(int num_pieces)
+		{
+			int bytes = (num_pieces + 7) / 8;
+			header(bytes, msg_bitfield);
+			buf.insert(buf.end(), bytes, char(0xff));
+			// the spare bits at the end have to be clear
+			if (num_pieces & 7)
+				buf.back() = char(0xff << (8 - (num_pieces & 7)));
+		}
+
+		void have(int piece)
+		{
+			header(4, 4);
+			detail::write_uint32(piece, out);
+		}
+
+		void request(int piece, int start, int length)
+		{
+			header(12, msg_request);
+			detail::write_uint32(piece, out);
+			detail::write_uint32(start, out);
+			detail::write_uint32(length, out);
+		}
+
+		// the session rejects this request, since it's not at a block
+		// boundary and we're not interested. It's always the last
+		// message of a workload
+		void sentinel() { request(0, 1, 1); }
+
+		void piece(int torrent, int piece, int block)
+		{
+			header(8 + block_size, msg_piece);
+			detail::write_uint32(piece, out);
+			detail::write_uint32(block * block_size, out);
+			buf.resize(buf.size() + block_size);
+			fill_block(&buf[buf.size() - block_size], torrent, piece, block);
+		}
+
+		std::vector<char>& buf;
+		std::back_insert_iterator<std::vector<char> > out;
+	};
+
+	// a connection to the session. It reads and parses everything the
+	// session sends from its own thread, looking for the session's
+	// extension handshake and the reject of the sentinel request
+	struct connection
+	{
+		connection(io_service& ios)
+			: sock(ios), sent(0), ut_pex(0), got_extensions(false)
+			, done(false), failed(false)
+		{}
+
+		~connection()
+		{
+			// shutting down the socket wakes up the reader
+			error_code ec;
+			sock.shutdown(tcp::socket::shutdown_both, ec);
+			sock.close(ec);
+			if (reader) reader->join();
+		}
+
+		bool connect(int port, sha1_hash const& info_hash, bool encrypted)
+		{
+			error_code ec;
+			sock.connect(tcp::endpoint(address_v4::loopback(), port), ec);
+			if (ec) return false;
+
+			std::vector<char> out;
+			message_writer w(out);
+			w.handshake(info_hash);
+			w.extension_handshake();
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			if (encrypted)
+			{
+				if (!encrypted_handshake(info_hash)) return false;
+				rc4->encrypt(&out[0], out.size());
+			}
+#endif
+			asio::write(sock, asio::buffer(out), asio::transfer_all(), ec);
+			if (ec) return false;
+			sent += out.size();
+
+			reader.reset(new boost::thread(boost::bind(&connection::read_loop, this)));
+			return true;
+		}
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// the initiating side of the obfuscated handshake. The BitTorrent
+		// handshake is sent as part of the payload stream instead of as
+		// the initial payload, so len(IA) is 0
+		bool encrypted_handshake(sha1_hash const& info_hash)
+		{
+			error_code ec;
+			dh_key_exchange dh;
+			if (!dh.good()) return false;
+			std::vector<char> out(dh.get_local_key(), dh.get_local_key() + 96);
+			out.resize(96 + std::rand() % 512);
+			asio::write(sock, asio::buffer(out), asio::transfer_all(), ec);
+			if (ec) return false;
+
+			char remote_key[96];
+			asio::read(sock, asio::buffer(remote_key), asio::transfer_all(), ec);
+			if (ec || dh.compute_secret(remote_key) != 0) return false;
+			char const* secret = dh.get_secret();
+
+			hasher h;
+			h.update("req1", 4);
+			h.update(secret, 96);
+			sha1_hash sync_hash = h.final();
+			h.reset();
+			h.update("req2", 4);
+			h.update((char const*)&info_hash[0], 20);
+			sha1_hash skey_hash = h.final();
+			h.reset();
+			h.update("req3", 4);
+			h.update(secret, 96);
+			sha1_hash obfuscated = h.final();
+			obfuscated ^= skey_hash;
+
+			h.reset();
+			h.update("keyA", 4);
+			h.update(secret, 96);
+			h.update((char const*)&info_hash[0], 20);
+			sha1_hash local_key = h.final();
+			h.reset();
+			h.update("keyB", 4);
+			h.update(secret, 96);
+			h.update((char const*)&info_hash[0], 20);
+			sha1_hash remote_key_hash = h.final();
+			rc4.reset(new RC4_handler(local_key, remote_key_hash));
+
+			// vc, crypto_provide (RC4 only), len(pad C), len(IA)
+			out.clear();
+			out.insert(out.end(), sync_hash.begin(), sync_hash.end());
+			out.insert(out.end(), obfuscated.begin(), obfuscated.end());
+			char crypto[8 + 4 + 2 + 2] = {0};
+			crypto[11] = 0x02;
+			rc4->encrypt(crypto, sizeof(crypto));
+			out.insert(out.end(), crypto, crypto + sizeof(crypto));
+			asio::write(sock, asio::buffer(out), asio::transfer_all(), ec);
+			if (ec) return false;
+
+			// the session's verification constant is somewhere in the
+			// first 512 + 8 bytes after its key. Find it by what 8 zero
+			// bytes encrypt to
+			char vc[8] = {0};
+			RC4_handler probe(local_key, remote_key_hash);
+			probe.decrypt(vc, 8);
+			std::vector<char> in;
+			int vc_pos = -1;
+			while (vc_pos < 0)
+			{
+				char buf[512];
+				std::size_t n = sock.read_some(asio::buffer(buf), ec);
+				if (ec) return false;
+				in.insert(in.end(), buf, buf + n);
+				std::vector<char>::iterator i = std::search(in.begin(), in.end(), vc, vc + 8);
+				if (i != in.end()) vc_pos = i - in.begin();
+				else if (in.size() > 512 + 8) return false;
+			}
+			in.erase(in.begin(), in.begin() + vc_pos);
+			rc4->decrypt(&in[0], in.size());
+
+			// vc, crypto_select, len(pad D), pad D
+			while (in.size() < 14 || in.size() < 14 + std::size_t(
+				(boost::uint8_t(in[12]) << 8) | boost::uint8_t(in[13])))
+			{
+				char buf[512];
+				std::size_t n = sock.read_some(asio::buffer(buf), ec);
+				if (ec) return false;
+				rc4->decrypt(buf, n);
+				in.insert(in.end(), buf, buf + n);
+			}
+			if (in[11] != 0x02) return false;
+			int pad_len = (boost::uint8_t(in[12]) << 8) | boost::uint8_t(in[13]);
+			pending.assign(in.begin() + 14 + pad_len, in.end());
+			return true;
+		}
+#endif
+
+		void read_loop()
+		{
+			bool handshake = true;
+			error_code ec;
+			for (;;)
+			{
+				// messages are handled as soon as they're complete
+				std::size_t pos = 0;
+				for (;;)
+				{
+					if (handshake)
+					{
+						if (pending.size() - pos < 68) break;
+						pos += 68;
+						handshake = false;
+						continue;
+					}
+					if (pending.size() - pos < 4) break;
+					char const* ptr = &pending[pos];
+					std::size_t len = detail::read_uint32(ptr);
+					if (pending.size() - pos - 4 < len) break;
+					if (len > 0) on_message(ptr, int(len));
+					pos += 4 + len;
+				}
+				pending.erase(pending.begin(), pending.begin() + pos);
+
+				char buf[16 * 1024];
+				std::size_t n = sock.read_some(asio::buffer(buf), ec);
+				if (ec) break;
+#ifndef TORRENT_DISABLE_ENCRYPTION
+				if (rc4) rc4->decrypt(buf, n);
+#endif
+				pending.insert(pending.end(), buf, buf + n);
+			}
+			boost::mutex::scoped_lock l(mutex);
+			failed = true;
+			signal.notify_all();
+		}
+
+		void on_message(char const* ptr, int len)
+		{
+			int id = detail::read_uint8(ptr);
+			if (id == msg_extended && len > 2 && *ptr == 0)
+			{
+				lazy_entry e;
+				if (lazy_bdecode(ptr + 1, ptr + len - 1, e) != 0) return;
+				if (e.type() != lazy_entry::dict_t) return;
+				lazy_entry const* m = e.dict_find_dict("m");
+				boost::mutex::scoped_lock l(mutex);
+				if (m) ut_pex = int(m->dict_find_int_value("ut_pex", 0));
+				got_extensions = true;
+				signal.notify_all();
+			}
+			else if (id == msg_reject_request && len == 13)
+			{
+				detail::read_uint32(ptr);
+				int start = detail::read_uint32(ptr);
+				int length = detail::read_uint32(ptr);
+				if (start != 1 || length != 1) return;
+				boost::mutex::scoped_lock l(mutex);
+				done = true;
+				signal.notify_all();
+			}
+		}
+
+		// waits until the flag is set or the connection fails
+		bool wait_for(bool const& flag)
+		{
+			boost::mutex::scoped_lock l(mutex);
+			while (!flag && !failed)
+			{
+				if (!signal.timed_wait(l, boost::get_system_time()
+					+ boost::posix_time::seconds(60)))
+					return false;
+			}
+			return flag;
+		}
+
+		bool send(std::vector<char>& out)
+		{
+#ifndef TORRENT_DISABLE_ENCRYPTION
+			if (rc4) rc4->encrypt(&out[0], out.size());
+#endif
+			error_code ec;
+			asio::write(sock, asio::buffer(out), asio::transfer_all(), ec);
+			sent += out.size();
+			return !ec;
+		}
+
+		tcp::socket sock;
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// the encryption and decryption keys are used by different
+		// threads, but they don't share any state
+		boost::scoped_ptr<RC4_handler> rc4;
+#endif
+		boost::scoped_ptr<boost::thread> reader;
+		// the number of BitTorrent protocol bytes written
+		size_type sent;
+		// what's been received but not parsed yet
+		std::vector<char> pending;
+
+		boost::mutex mutex;
+		boost::condition signal;
+		int ut_pex;
+		bool got_extensions;
+		bool done;
+		bool failed;
+	};
+
+	void print_result(char const* name, bool encrypted, int messages
+		, size_type bytes, time_duration elapsed, boost::int64_t cpu, bool failed)
+	{
+		double seconds = total_microseconds(elapsed) / 1000000.0;
+		if (seconds <= 0) seconds = 0.000001;
+		std::printf("%-10s %-9s %9d %12.0f %9.1f %12.0f%s\n", name
+			, encrypted ? "rc4" : "plaintext", messages, messages / seconds
+			, bytes / 1024.0 / 1024.0 / seconds
+			, cpu > 0 ? messages / (cpu / 1000000.0) : 0.0
+			, failed ? " (failed)" : "");
+	}
+
+	struct workload
+	{
+		char const* name;
+		// appends the messages to the stream and returns how many
+		void (*build)(options const& o, int torrent, int num_pieces
+			, int ut_pex, message_writer& w, int& messages);
+	};
+
+	void build_haves(options const& o, int, int num_pieces, int, message_writer& w
+		, int& messages)
+	{
+		for (int i = 0; i < o.num_haves; ++i) w.have(std::rand() % num_pieces);
+		messages = o.num_haves;
+	}
+
+	// requests for pieces the session doesn't have, which it rejects
+	void build_requests(options const& o, int, int num_pieces, int, message_writer& w
+		, int& messages)
+	{
+		int const blocks_per_piece = piece_size / block_size;
+		for (int i = 0; i < o.num_requests; ++i)
+		{
+			int block = i % (num_pieces * blocks_per_piece);
+			w.request(block / blocks_per_piece
+				, (block % blocks_per_piece) * block_size, block_size);
+		}
+		messages = o.num_requests;
+	}
+
+	// all of the torrent, in order. The session didn't request any of
+	// it, but it hashes and writes it anyway
+	void build_pieces(options const&, int torrent, int num_pieces, int
+		, message_writer& w, int& messages)
+	{
+		int const blocks_per_piece = piece_size / block_size;
+		for (int i = 0; i < num_pieces; ++i)
+			for (int k = 0; k < blocks_per_piece; ++k)
+				w.piece(torrent, i, k);
+		messages = num_pieces * blocks_per_piece;
+	}
+
+	// peer exchange messages with 50 peers each. The peers are in
+	// 198.18.0.0/15, which the session's IP filter blocks, so it
+	// doesn't try to connect to them
+	void build_pex(options const& o, int, int, int ut_pex, message_writer& w
+		, int& messages)
+	{
+		if (ut_pex == 0)
+		{
+			messages = 0;
+			return;
+		}
+		for (int i = 0; i < o.num_pex; ++i)
+		{
+			std::string peers;
+			for (int k = 0; k < 50; ++k)
+			{
+				peers += char(198);
+				peers += char(18 + (std::rand() & 1));
+				peers += char(std::rand());
+				peers += char(std::rand());
+				peers += char(std::rand());
+				peers += char(std::rand());
+			}
+			entry e;
+			e["added"] = peers;
+			e["added.f"] = std::string(50, 0);
+			w.extended(ut_pex, e);
+		}
+		messages = o.num_pex;
+	}
+
+	// waits for the torrent to be ready to accept peers
+	bool wait_for_torrent(torrent_handle const& h)
+	{
+		for (int i = 0; i < 300; ++i)
+		{
+			torrent_status st = h.status();
+			if (st.state == torrent_status::downloading
+				|| st.state == torrent_status::finished
+				|| st.state == torrent_status::seeding)
+				return true;
+			test_sleep(100);
+		}
+		return false;
+	}
+
+	torrent_handle add_torrent(session& ses, options const& o
+		, boost::intrusive_ptr<torrent_info> ti)
+	{
+		add_torrent_params p;
+		p.ti = ti;
+		p.save_path = o.save_path;
+		p.paused = false;
+		p.auto_managed = false;
+		return ses.add_torrent(p);
+	}
+
+	// opens and closes connections, each sending a handshake, an
+	// extension handshake and a bitfield
+	void run_handshakes(options const& o, session& ses, io_service& ios
+		, int index, bool encrypted)
+	{
+		if (o.num_handshakes == 0) return;
+		boost::intrusive_ptr<torrent_info> ti = make_torrent(o, index);
+		torrent_handle h = add_torrent(ses, o, ti);
+		if (!wait_for_torrent(h)) return;
+
+		int completed = 0;
+		size_type bytes = 0;
+		boost::int64_t cpu = cpu_time();
+		ptime start = time_now_hires();
+		for (int i = 0; i < o.num_handshakes; ++i)
+		{
+			connection c(ios);
+			if (!c.connect(ses.listen_port(), ti->info_hash(), encrypted)) break;
+			std::vector<char> out;
+			message_writer w(out);
+			w.bitfield(ti->num_pieces());
+			w.sentinel();
+			bool ok = c.send(out) && c.wait_for(c.done);
+			bytes += c.sent;
+			if (!ok) break;
+			++completed;
+		}
+		time_duration elapsed = time_now_hires() - start;
+		print_result("handshake", encrypted, completed, bytes, elapsed
+			, cpu_time() - cpu, completed < o.num_handshakes);
+		ses.remove_torrent(h, session::delete_files);
+	}
+
+	void run_workload(options const& o, session& ses, io_service& ios
+		, int index, bool encrypted, workload const& wl)
+	{
+		boost::intrusive_ptr<torrent_info> ti = make_torrent(o, index);
+		torrent_handle h = add_torrent(ses, o, ti);
+		if (!wait_for_torrent(h)) return;
+
+		connection c(ios);
+		if (!c.connect(ses.listen_port(), ti->info_hash(), encrypted)
+			|| !c.wait_for(c.got_extensions))
+		{
+			print_result(wl.name, encrypted, 0, 0, seconds(1), 0, true);
+			ses.remove_torrent(h, session::delete_files);
+			return;
+		}
+
+		std::vector<char> out;
+		message_writer w(out);
+		int messages = 0;
+		wl.build(o, index, ti->num_pieces(), c.ut_pex, w, messages);
+		w.sentinel();
+		size_type bytes = out.size();
+
+		boost::int64_t cpu = cpu_time();
+		ptime start = time_now_hires();
+		bool ok = c.send(out) && c.wait_for(c.done);
+		time_duration elapsed = time_now_hires() - start;
+		print_result(wl.name, encrypted, messages, bytes, elapsed
+			, cpu_time() - cpu, !ok);
+		ses.remove_torrent(h, session::delete_files);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	options o;
+	if (!parse_options(argc, argv, o))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	std::srand(1);
+
+	try { remove_all(o.save_path); } catch (std::exception&) {}
+	create_directories(o.save_path);
+
+	session ses(fingerprint("LT", 0, 1, 0, 0), std::make_pair(48100, 48200)
+		, "127.0.0.1", session::add_default_plugins);
+	session_settings s;
+	s.allow_multiple_connections_per_ip = true;
+	ses.set_settings(s);
+
+	ip_filter f;
+	f.add_rule(address_v4::from_string("198.18.0.0")
+		, address_v4::from_string("198.19.255.255"), ip_filter::blocked);
+	ses.set_ip_filter(f);
+
+	io_service ios;
+
+	workload const workloads[] =
+	{
+		{ "have", &build_haves },
+		{ "request", &build_requests },
+		{ "piece", &build_pieces },
+		{ "pex", &build_pex }
+	};
+
+	std::printf("%d MiB torrents, %d kiB pieces\n", o.total_size, piece_size / 1024);
+	std::printf("%-10s %-9s %9s %12s %9s %12s\n", "workload", "stream"
+		, "messages", "messages/s", "MiB/s", "per CPU s");
+
+	int index = 0;
+	for (int e = 0; e < 2; ++e)
+	{
+		bool encrypted = e == 1;
+#ifdef TORRENT_DISABLE_ENCRYPTION
+		if (encrypted) break;
+#endif
+		run_handshakes(o, ses, ios, index++, encrypted);
+		for (int i = 0; i < int(sizeof(workloads) / sizeof(workloads[0])); ++i)
+			run_workload(o, ses, ios, index++, encrypted, workloads[i]);
+	}
+
+	try { remove_all(o.save_path); } catch (std::exception&) {}
+	return 0;
+}
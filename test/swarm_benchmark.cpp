@@ -0,0 +1,344 @@
+/*
+
+Copyright (c) 2009, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// runs a swarm of sessions over loopback and reports how fast all
+// of them complete, to compare changes to the bandwidth manager,
+// the piece picker and the unchoker. It doesn't run as part of the
+// test suite since it takes a while and its results only mean
+// something relative to another run on the same machine
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "setup_transfer.hpp"
+
+using namespace libtorrent;
+using boost::filesystem::path;
+using boost::filesystem::remove_all;
+using boost::filesystem::create_directories;
+
+namespace
+{
+	struct options
+	{
+		options()
+			: num_sessions(5)
+			, num_torrents(1)
+			, piece_size(64 * 1024)
+			, num_pieces(256)
+			, upload_rate(0)
+			, download_rate(0)
+			, timeout(300)
+			, seed(0)
+		{}
+
+		int num_sessions;
+		int num_torrents;
+		int piece_size;
+		int num_pieces;
+		// per session limits, in bytes per second. 0 means unlimited
+		int upload_rate;
+		int download_rate;
+		// seconds to wait for the swarm to complete
+		int timeout;
+		// seeds the content of the torrents
+		int seed;
+	};
+
+	void print_usage(char const* name)
+	{
+		std::cerr << "usage: " << name << " [options]\n\n"
+			"   -n <sessions>       number of sessions, one of which is the seed (5)\n"
+			"   -t <torrents>       number of torrents (1)\n"
+			"   -p <piece size>     piece size in kiB (64)\n"
+			"   -c <pieces>         number of pieces per torrent (256)\n"
+			"   -u <rate>           upload rate limit per session in kiB/s (unlimited)\n"
+			"   -d <rate>           download rate limit per session in kiB/s (unlimited)\n"
+			"   -T <seconds>        give up after this many seconds (300)\n"
+			"   -s <seed>           seeds the torrent contents (0)\n";
+	}
+
+	// the CPU time this process has used, in microseconds
+	boost::int64_t cpu_time()
+	{
+#ifndef _WIN32
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return (boost::int64_t(ru.ru_utime.tv_sec) + ru.ru_stime.tv_sec) * 1000000
+			+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+		return 0;
+#endif
+	}
+
+	// the resident set size of this process in bytes, or 0
+	// if it's not known on this platform
+	boost::int64_t resident_memory()
+	{
+#ifdef __linux__
+		FILE* f = std::fopen("/proc/self/statm", "r");
+		if (f == 0) return 0;
+		long size = 0;
+		long resident = 0;
+		int n = std::fscanf(f, "%ld %ld", &size, &resident);
+		std::fclose(f);
+		if (n != 2) return 0;
+		return boost::int64_t(resident) * 4096;
+#else
+		return 0;
+#endif
+	}
+
+	// creates a torrent with one file and writes the file to
+	// save_path. The content depends on index and the seed, to
+	// give every torrent its own info-hash
+	boost::intrusive_ptr<torrent_info> make_torrent(options const& o
+		, int index, path const& save_path)
+	{
+		file_storage fs;
+		char name[100];
+		snprintf(name, sizeof(name), "swarm_%d", index);
+		size_type total_size = size_type(o.piece_size) * o.num_pieces;
+		fs.add_file(path(name), total_size);
+		libtorrent::create_torrent t(fs, o.piece_size);
+
+		boost::filesystem::ofstream file(save_path / name, std::ios_base::binary);
+		std::vector<char> piece(o.piece_size);
+		// a linear congruential generator, so the content is the
+		// same for every run with the same seed
+		boost::uint32_t state = boost::uint32_t(o.seed) * 7919 + index * 104729 + 1;
+		for (int i = 0; i < o.num_pieces; ++i)
+		{
+			for (int k = 0; k < o.piece_size; ++k)
+			{
+				state = state * 1664525 + 1013904223;
+				piece[k] = char(state >> 24);
+			}
+			t.set_hash(i, hasher(&piece[0], piece.size()).final());
+			file.write(&piece[0], piece.size());
+		}
+
+		std::vector<char> buf;
+		bencode(std::back_inserter(buf), t.generate());
+		return boost::intrusive_ptr<torrent_info>(new torrent_info(&buf[0], buf.size()));
+	}
+
+	bool parse_options(int argc, char* argv[], options& o)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (argv[i][0] != '-' || std::strlen(argv[i]) != 2 || i + 1 >= argc)
+				return false;
+			int value = std::atoi(argv[i + 1]);
+			switch (argv[i][1])
+			{
+				case 'n': o.num_sessions = value; break;
+				case 't': o.num_torrents = value; break;
+				case 'p': o.piece_size = value * 1024; break;
+				case 'c': o.num_pieces = value; break;
+				case 'u': o.upload_rate = value * 1024; break;
+				case 'd': o.download_rate = value * 1024; break;
+				case 'T': o.timeout = value; break;
+				case 's': o.seed = value; break;
+				default: return false;
+			}
+			++i;
+		}
+		return o.num_sessions >= 2 && o.num_torrents >= 1
+			&& o.piece_size >= 16 * 1024 && o.num_pieces >= 1;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	options o;
+	if (!parse_options(argc, argv, o))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	std::srand(o.seed);
+
+	path root("./swarm_benchmark");
+	try { remove_all(root); } catch (std::exception&) {}
+
+	std::vector<boost::intrusive_ptr<torrent_info> > torrents;
+	create_directories(root / "session_0");
+	for (int i = 0; i < o.num_torrents; ++i)
+		torrents.push_back(make_torrent(o, i, root / "session_0"));
+
+	boost::int64_t base_memory = resident_memory();
+
+	session_settings settings;
+	settings.allow_multiple_connections_per_ip = true;
+	settings.ignore_limits_on_local_network = false;
+
+	std::vector<boost::shared_ptr<session> > sessions;
+	std::vector<int> ports;
+	for (int i = 0; i < o.num_sessions; ++i)
+	{
+		int port = 48000 + i * 20;
+		boost::shared_ptr<session> s(new session(fingerprint("LT", 0, 1, 0, 0)
+			, std::make_pair(port, port + 20), "0.0.0.0", 0));
+		s->set_settings(settings);
+		if (o.upload_rate > 0) s->set_upload_rate_limit(o.upload_rate);
+		if (o.download_rate > 0) s->set_download_rate_limit(o.download_rate);
+		s->set_alert_mask(alert::error_notification);
+		sessions.push_back(s);
+		ports.push_back(s->listen_port());
+		create_directories(root / ("session_" + boost::lexical_cast<std::string>(i)));
+	}
+
+	// handles[session][torrent]
+	std::vector<std::vector<torrent_handle> > handles(o.num_sessions);
+	for (int i = 0; i < o.num_sessions; ++i)
+	{
+		for (int t = 0; t < o.num_torrents; ++t)
+		{
+			add_torrent_params p;
+			p.ti = torrents[t];
+			p.save_path = root / ("session_" + boost::lexical_cast<std::string>(i));
+			p.paused = false;
+			p.auto_managed = false;
+			p.seed_mode = i == 0;
+			handles[i].push_back(sessions[i]->add_torrent(p));
+		}
+	}
+
+	ptime start = time_now_hires();
+	boost::int64_t start_cpu = cpu_time();
+
+	for (int i = 1; i < o.num_sessions; ++i)
+	{
+		for (int t = 0; t < o.num_torrents; ++t)
+		{
+			for (int k = 0; k < i; ++k)
+				handles[i][t].connect_peer(tcp::endpoint(
+					address::from_string("127.0.0.1"), ports[k]));
+		}
+	}
+
+	int const num_downloads = (o.num_sessions - 1) * o.num_torrents;
+	// the time each download completed, in milliseconds
+	std::vector<boost::int64_t> completed;
+	std::vector<bool> done(o.num_sessions * o.num_torrents, false);
+	int max_peers = 0;
+	boost::int64_t peak_memory = base_memory;
+
+	while (int(completed.size()) < num_downloads
+		&& total_seconds(time_now_hires() - start) < o.timeout)
+	{
+		test_sleep(100);
+		boost::int64_t now = total_milliseconds(time_now_hires() - start);
+
+		int num_peers = 0;
+		for (int i = 0; i < o.num_sessions; ++i)
+		{
+			num_peers += sessions[i]->status().num_peers;
+			std::auto_ptr<alert> a = sessions[i]->pop_alert();
+			for (; a.get(); a = sessions[i]->pop_alert())
+				std::cerr << "session " << i << ": " << a->message() << "\n";
+
+			if (i == 0) continue;
+			for (int t = 0; t < o.num_torrents; ++t)
+			{
+				if (done[i * o.num_torrents + t]) continue;
+				if (!handles[i][t].is_seed()) continue;
+				done[i * o.num_torrents + t] = true;
+				completed.push_back(now);
+			}
+		}
+		if (num_peers > max_peers) max_peers = num_peers;
+		boost::int64_t mem = resident_memory();
+		if (mem > peak_memory) peak_memory = mem;
+	}
+
+	boost::int64_t elapsed = total_milliseconds(time_now_hires() - start);
+	boost::int64_t cpu = cpu_time() - start_cpu;
+
+	size_type downloaded = 0;
+	for (int i = 1; i < o.num_sessions; ++i)
+		for (int t = 0; t < o.num_torrents; ++t)
+			downloaded += handles[i][t].status().total_payload_download;
+
+	double gigabytes = downloaded / double(1024 * 1024 * 1024);
+	std::printf("sessions: %d torrents: %d size: %d kiB\n", o.num_sessions
+		, o.num_torrents, int(size_type(o.piece_size) * o.num_pieces / 1024));
+	std::printf("completed: %d / %d in %.2f s\n", int(completed.size())
+		, num_downloads, elapsed / 1000.0);
+	if (!completed.empty())
+	{
+		std::printf("time to complete: first: %.2f s last: %.2f s\n"
+			, completed.front() / 1000.0, completed.back() / 1000.0);
+	}
+	std::printf("payload throughput: %.2f MiB/s\n"
+		, elapsed > 0 ? downloaded / 1024.0 / 1024.0 / (elapsed / 1000.0) : 0.0);
+	if (gigabytes > 0 && cpu > 0)
+		std::printf("CPU per GiB: %.2f s\n", cpu / 1000000.0 / gigabytes);
+	if (max_peers > 0 && peak_memory > 0)
+	{
+		std::printf("memory per peer: %.1f kiB (%d peers)\n"
+			, (peak_memory - base_memory) / 1024.0 / max_peers, max_peers);
+	}
+
+	// destruct the sessions in parallel
+	std::vector<session_proxy> proxies;
+	for (int i = 0; i < o.num_sessions; ++i)
+		proxies.push_back(sessions[i]->abort());
+	sessions.clear();
+	proxies.clear();
+
+	try { remove_all(root); } catch (std::exception&) {}
+	return int(completed.size()) == num_downloads ? 0 : 1;
+}
+
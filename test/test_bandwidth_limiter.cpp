@@ -321,6 +321,61 @@ void test_torrents(int num, int limit1, int limit2, int global_limit)
 	TEST_CHECK(close_to(sum, limit2, 1000));
 }
 
+// two torrents in their own classes, nested in a common parent
+// class. The one whose class isn't limited should end up with
+// whatever the other one can't use of the parent's limit
+void test_nested_classes(int num, int parent_limit, int limit2)
+{
+	std::cerr << "\ntest nested classes " << num
+		<< " p: " << parent_limit
+		<< " l2: " << limit2 << std::endl;
+	bandwidth_manager<peer_connection> manager(0);
+	global_bwc.throttle(0);
+
+	bandwidth_channel p;
+	bandwidth_channel c1;
+	bandwidth_channel c2;
+	p.throttle(parent_limit);
+	c2.throttle(limit2);
+	c1.parent = &p;
+	c2.parent = &p;
+
+	bandwidth_channel t1;
+	bandwidth_channel t2;
+	t1.parent = &c1;
+	t2.parent = &c2;
+
+	connections_t v1;
+	spawn_connections(v1, manager, t1, num, "t1p");
+	connections_t v2;
+	spawn_connections(v2, manager, t2, num, "t2p");
+	connections_t v;
+	std::copy(v1.begin(), v1.end(), std::back_inserter(v));
+	std::copy(v2.begin(), v2.end(), std::back_inserter(v));
+	run_test(v, manager);
+
+	float sum1 = 0.f;
+	for (connections_t::iterator i = v1.begin()
+		, end(v1.end()); i != end; ++i)
+	{
+		sum1 += (*i)->m_quota;
+	}
+	sum1 /= sample_time;
+	float sum2 = 0.f;
+	for (connections_t::iterator i = v2.begin()
+		, end(v2.end()); i != end; ++i)
+	{
+		sum2 += (*i)->m_quota;
+	}
+	sum2 /= sample_time;
+
+	std::cerr << sum1 << " target: " << (parent_limit - limit2) << std::endl;
+	std::cerr << sum2 << " target: " << limit2 << std::endl;
+	TEST_CHECK(close_to(sum2, limit2, 1000));
+	TEST_CHECK(close_to(sum1 + sum2, parent_limit, 1000));
+	TEST_CHECK(close_to(p.total_used() / sample_time, parent_limit, 1000));
+}
+
 void test_torrents_variable_rate(int num, int limit, int global_limit)
 {
 	std::cerr << "\ntest torrents variable rate" << num
@@ -470,6 +525,8 @@ int test_main()
 	test_torrents(5, 6000, 5000, 4000);
 	test_torrents(5, 20000, 20000, 30000);
 	test_torrents_variable_rate(5, 6000, 3000);
+	test_nested_classes(3, 10000, 2000);
+	test_nested_classes(5, 40000, 10000);
 	test_torrents_variable_rate(5, 20000, 30000);
 	test_single_peer(40000, true);
 	test_single_peer(40000, false);
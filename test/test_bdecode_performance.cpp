@@ -1,6 +1,7 @@
 #include "libtorrent/lazy_entry.hpp"
 #include <boost/lexical_cast.hpp>
 #include <iostream>
+#include <string>
 
 #include "test.hpp"
 #include "libtorrent/time.hpp"
@@ -22,6 +23,54 @@ int test_main()
 	ptime stop(time_now());
 
 	std::cout << "done in " << total_milliseconds(stop - start) / 100. << " seconds per million message" << std::endl;
+
+	// a tracker response with a non-compact peer list, which is one
+	// dictionary per peer
+	std::string buf = "d8:intervali1800e5:peersl";
+	for (int i = 0; i < 200; ++i)
+		buf += "d2:ip10:10.0.0.1234:porti6881e7:peer id20:aaaaaaaaaaaaaaaaaaaae";
+	buf += "ee";
+
+	start = time_now();
+	for (int i = 0; i < 1000; ++i)
+	{
+		lazy_entry e;
+		int ret = lazy_bdecode(&buf[0], &buf[0] + buf.size(), e);
+		TEST_CHECK(ret == 0);
+	}
+	stop = time_now();
+	std::cout << "peer list: " << total_microseconds(stop - start) / 1000
+		<< " us per message" << std::endl;
+
+	lazy_entry_arena arena;
+	start = time_now();
+	for (int i = 0; i < 1000; ++i)
+	{
+		lazy_entry e;
+		int ret = lazy_bdecode(&buf[0], &buf[0] + buf.size(), e, arena);
+		TEST_CHECK(ret == 0);
+		arena.reset();
+	}
+	stop = time_now();
+	std::cout << "peer list (arena): " << total_microseconds(stop - start) / 1000
+		<< " us per message" << std::endl;
+
+	// make sure the tree decoded into the arena is the same
+	lazy_entry e1;
+	lazy_entry e2;
+	lazy_bdecode(&buf[0], &buf[0] + buf.size(), e1);
+	lazy_bdecode(&buf[0], &buf[0] + buf.size(), e2, arena);
+	TEST_CHECK(e2.type() == lazy_entry::dict_t);
+	TEST_CHECK(e2.dict_find_int_value("interval") == 1800);
+	lazy_entry const* peers = e2.dict_find_list("peers");
+	TEST_CHECK(peers && peers->list_size() == 200);
+	if (peers && peers->list_size() == 200)
+	{
+		lazy_entry const* p = peers->list_at(199);
+		TEST_CHECK(p->dict_find_string_value("ip") == "10.0.0.1234");
+		TEST_CHECK(p->dict_find_int_value("port") == 6881);
+	}
+	TEST_CHECK(print_entry(e1) == print_entry(e2));
 	return 0;
 }
 
@@ -59,6 +59,26 @@ int test_main()
 {
 	using namespace libtorrent;
 
+	// ** swapping and assignment **
+	{
+		entry e1("spam");
+		entry e2(entry::dictionary_t);
+		e2["foo"] = 3;
+		e2["bar"] = "baz";
+		e1.swap(e2);
+		TEST_CHECK(e1.type() == entry::dictionary_t);
+		TEST_CHECK(e1["foo"].integer() == 3);
+		TEST_CHECK(e2.string() == "spam");
+		TEST_CHECK(encode(e1) == "d3:bar3:baz3:fooi3ee");
+
+		// assigning an entry to itself, or a part of itself
+		e1 = e1;
+		TEST_CHECK(encode(e1) == "d3:bar3:baz3:fooi3ee");
+		e1["sub"]["x"] = 1;
+		e1 = e1["sub"];
+		TEST_CHECK(encode(e1) == "d1:xi1ee");
+	}
+
 	// ** strings **
 	{	
 		entry e("spam");
@@ -181,6 +201,43 @@ int test_main()
 		TORRENT_ASSERT(e.dict_find("c")->string_length() == 3);
 		TORRENT_ASSERT(e.dict_find_string_value("X") == "0123456789");
 	}
+
+	{
+		char const* valid[] = { "i12453e", "i-1e", "0:", "26:abcdefghijklmnopqrstuvwxyz"
+			, "le", "de", "li12453e3:aaae", "d1:ald1:bi1eeee"
+			, "d1:ai12453e1:b3:aaa1:c3:bbb1:X10:0123456789e" };
+		for (int i = 0; i < int(sizeof(valid)/sizeof(valid[0])); ++i)
+			TEST_CHECK(lazy_bdecode_validate(valid[i], valid[i] + std::strlen(valid[i])) == 0);
+
+		char const* invalid[] = { "", "i12453", "ie", "i1x2e", "4:abc", "l", "e"
+			, "li1e", "d1:ae", "di1ei2ee", "dlei1ee", "d1:a" };
+		for (int i = 0; i < int(sizeof(invalid)/sizeof(invalid[0])); ++i)
+			TEST_CHECK(lazy_bdecode_validate(invalid[i], invalid[i] + std::strlen(invalid[i])) != 0);
+
+		std::string buf;
+		bencode_writer<std::back_insert_iterator<std::string> > w(std::back_inserter(buf));
+		w.begin_dict();
+		w.write_key("a");
+		w.write_int(-12);
+		w.write_key("b");
+		w.begin_list();
+		w.write_string("foo");
+		w.write_entry(entry("bar"));
+		w.end();
+		w.write_key("c");
+		w.begin_dict();
+		w.end();
+		w.end();
+		TEST_CHECK(buf == "d1:ai-12e1:bl3:foo3:bare1:cdee");
+		TEST_CHECK(w.bytes_written() == int(buf.size()));
+		TEST_CHECK(lazy_bdecode_validate(&buf[0], &buf[0] + buf.size()) == 0);
+	}
+
+	{
+		char b[] = "lllleeee";
+		TEST_CHECK(lazy_bdecode_validate(b, b + sizeof(b)-1, 3) != 0);
+		TEST_CHECK(lazy_bdecode_validate(b, b + sizeof(b)-1, 4) == 0);
+	}
 	return 0;
 }
 
@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <utility>
 #include <set>
+#include <string>
 
 #include "libtorrent/buffer.hpp"
 #include "libtorrent/chained_buffer.hpp"
@@ -169,7 +170,7 @@ void test_buffer()
 
 std::set<char*> buffer_list;
 
-void free_buffer(char* m)
+void free_buffer(char* m, void*, int)
 {
 	std::set<char*>::iterator i = buffer_list.find(m);
 	TEST_CHECK(i != buffer_list.end());
@@ -203,12 +204,20 @@ bool compare_chained_buffer(chained_buffer& b, char const* mem, int size)
 {
 	if (size == 0) return true;
 	std::vector<char> flat(size);
-	std::list<libtorrent::asio::const_buffer> const& iovec2 = b.build_iovec(size);
+	std::vector<libtorrent::asio::const_buffer> const& iovec2 = b.build_iovec(size);
 	int copied = copy_buffers(iovec2, &flat[0]);
 	TEST_CHECK(copied == size);
 	return std::memcmp(&flat[0], mem, size) == 0;
 }
 
+struct collect_ranges
+{
+	collect_ranges(std::string& s, int& n): str(s), num(n) {}
+	void operator()(char* buf, int size) const { str.append(buf, size); ++num; }
+	std::string& str;
+	int& num;
+};
+
 void test_chained_buffer()
 {
 	char data[] = "foobar";
@@ -223,7 +232,7 @@ void test_chained_buffer()
 
 		char* b1 = allocate_buffer(512);
 		std::memcpy(b1, data, 6);
-		b.append_buffer(b1, 512, 6, (void(*)(char*))&free_buffer);
+		b.append_buffer(b1, 512, 6, &free_buffer, 0);
 		TEST_CHECK(buffer_list.size() == 1);
 
 		TEST_CHECK(b.capacity() == 512);
@@ -252,12 +261,12 @@ void test_chained_buffer()
 
 		char* b2 = allocate_buffer(512);
 		std::memcpy(b2, data, 6);
-		b.append_buffer(b2, 512, 6, (void(*)(char*))&free_buffer);
+		b.append_buffer(b2, 512, 6, &free_buffer, 0);
 		TEST_CHECK(buffer_list.size() == 2);
 
 		char* b3 = allocate_buffer(512);
 		std::memcpy(b3, data, 6);
-		b.append_buffer(b3, 512, 6, (void(*)(char*))&free_buffer);
+		b.append_buffer(b3, 512, 6, &free_buffer, 0);
 		TEST_CHECK(buffer_list.size() == 3);
 
 		TEST_CHECK(b.capacity() == 512 * 3);
@@ -292,7 +301,7 @@ void test_chained_buffer()
 		char* b4 = allocate_buffer(20);
 		std::memcpy(b4, data, 6);
 		std::memcpy(b4 + 6, data, 6);
-		b.append_buffer(b4, 20, 12, (void(*)(char*))&free_buffer);
+		b.append_buffer(b4, 20, 12, &free_buffer, 0);
 		TEST_CHECK(b.space_in_last_buffer() == 8);
 
 		ret = b.append(data, 6);
@@ -306,12 +315,90 @@ void test_chained_buffer()
 		
 		char* b5 = allocate_buffer(20);
 		std::memcpy(b4, data, 6);
-		b.append_buffer(b5, 20, 6, (void(*)(char*))&free_buffer);
+		b.append_buffer(b5, 20, 6, &free_buffer, 0);
 
 		b.pop_front(22);
 		TEST_CHECK(b.size() == 5);
 	}
 	TEST_CHECK(buffer_list.empty());
+
+	// the inline buffer
+	{
+		chained_buffer b;
+		char* i1 = b.allocate_inline(6);
+		TEST_CHECK(i1 != 0);
+		std::memcpy(i1, data, 6);
+		TEST_CHECK(b.size() == 6);
+		TEST_CHECK(b.capacity() == chained_buffer::inline_size);
+		TEST_CHECK(b.space_in_last_buffer() == chained_buffer::inline_size - 6);
+		// it can only be in the chain once
+		TEST_CHECK(b.allocate_inline(6) == 0);
+		TEST_CHECK(b.append(data, 6));
+		TEST_CHECK(compare_chained_buffer(b, "foobarfoobar", 12));
+		TEST_CHECK(b.allocate_inline(chained_buffer::inline_size + 1) == 0);
+		b.pop_front(12);
+		TEST_CHECK(b.empty());
+		TEST_CHECK(b.capacity() == 0);
+		TEST_CHECK(b.allocate_inline(3) != 0);
+		TEST_CHECK(buffer_list.empty());
+	}
+
+	// visiting the end of the chain
+	{
+		chained_buffer b;
+		char* b1 = allocate_buffer(512);
+		std::memcpy(b1, data, 6);
+		b.append_buffer(b1, 512, 6, &free_buffer, 0);
+		char* b2 = allocate_buffer(512);
+		std::memcpy(b2, data, 6);
+		b.append_buffer(b2, 512, 6, &free_buffer, 0);
+		b.pop_front(2);
+
+		std::string tail;
+		int ranges = 0;
+		b.for_each_tail(10, collect_ranges(tail, ranges));
+		TEST_CHECK(tail == "obarfoobar");
+
+		tail.clear();
+		ranges = 0;
+		b.for_each_tail(8, collect_ranges(tail, ranges));
+		TEST_CHECK(tail == "arfoobar");
+		TEST_CHECK(ranges == 2);
+
+		tail.clear();
+		ranges = 0;
+		b.for_each_tail(4, collect_ranges(tail, ranges));
+		TEST_CHECK(tail == "obar");
+		TEST_CHECK(ranges == 1);
+
+		tail.clear();
+		ranges = 0;
+		b.for_each_tail(0, collect_ranges(tail, ranges));
+		TEST_CHECK(ranges == 0);
+	}
+
+	// the ring of buffers grows and wraps around
+	{
+		chained_buffer b;
+		for (int round = 0; round < 3; ++round)
+		{
+			for (int i = 0; i < 20; ++i)
+			{
+				char* m = allocate_buffer(6);
+				std::memcpy(m, data, 6);
+				b.append_buffer(m, 6, 6, &free_buffer, 0);
+			}
+			TEST_CHECK(b.size() == 20 * 6);
+			TEST_CHECK(compare_chained_buffer(b, "foobarfoobarfoobar", 18));
+			b.pop_front(15 * 6 + 3);
+			TEST_CHECK(b.size() == 5 * 6 - 3);
+			TEST_CHECK(compare_chained_buffer(b, "barfoobar", 9));
+			b.pop_front(5 * 6 - 3);
+			TEST_CHECK(b.empty());
+			TEST_CHECK(buffer_list.empty());
+		}
+	}
+	TEST_CHECK(buffer_list.empty());
 }
 
 int test_main()
@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/ip_filter.hpp"
 #include <boost/utility.hpp>
+#include <cstdlib>
 
 #include "test.hpp"
 
@@ -208,6 +209,81 @@ int test_main()
 
 	}	
 
+	// adding rules in bulk must give the same filter as adding
+	// them one at a time, and compiling must not change it
+	{
+		std::srand(10);
+		std::vector<ip_range<address_v4> > rules;
+		ip_filter f;
+		f.add_rule(IP("10.0.0.0"), IP("10.0.0.255"), ip_filter::blocked);
+		ip_filter bulk(f);
+		ip_filter seq(f);
+		for (int i = 0; i < 500; ++i)
+		{
+			// keep the addresses in a small range to get
+			// lots of overlapping rules
+			unsigned long a = 0x0a000000 + std::rand() % 0x400;
+			unsigned long b = 0x0a000000 + std::rand() % 0x400;
+			if (a > b) std::swap(a, b);
+			ip_range<address_v4> r = { address_v4(a), address_v4(b), std::rand() % 3 };
+			rules.push_back(r);
+			seq.add_rule(r.first, r.last, r.flags);
+		}
+		ip_range<address_v4> last = { IP4("255.0.0.0"), IP4("255.255.255.255"), 1 };
+		rules.push_back(last);
+		seq.add_rule(last.first, last.last, last.flags);
+		bulk.add_rules(rules);
+
+		std::vector<ip_range<address_v4> > r1 = boost::get<0>(seq.export_filter());
+		std::vector<ip_range<address_v4> > r2 = boost::get<0>(bulk.export_filter());
+		TEST_CHECK(r1.size() == r2.size());
+		TEST_CHECK(r1.size() == r2.size()
+			&& std::equal(r1.begin(), r1.end(), r2.begin(), &compare<address_v4>));
+		test_rules_invariant(r2, bulk);
+
+		ip_filter compiled(seq);
+		compiled.compile();
+		for (int i = 0; i < 2000; ++i)
+		{
+			address_v4 a(0x0a000000 + std::rand() % 0x500);
+			TEST_CHECK(compiled.access(a) == seq.access(a));
+		}
+		TEST_CHECK(compiled.access(IP("255.1.2.3")) == 1);
+		TEST_CHECK(compiled.access(IP("9.255.255.255")) == 0);
+
+		// adding a rule to a compiled filter turns it back into a tree
+		compiled.add_rule(IP("10.0.0.0"), IP("10.0.4.255"), ip_filter::blocked);
+		seq.add_rule(IP("10.0.0.0"), IP("10.0.4.255"), ip_filter::blocked);
+		r1 = boost::get<0>(seq.export_filter());
+		r2 = boost::get<0>(compiled.export_filter());
+		TEST_CHECK(r1.size() == r2.size()
+			&& std::equal(r1.begin(), r1.end(), r2.begin(), &compare<address_v4>));
+	}
+
+	// diff() returns only the ranges that became blocked
+	{
+		ip_filter f1;
+		f1.add_rule(IP("10.0.0.0"), IP("10.0.0.255"), ip_filter::blocked);
+		ip_filter f2;
+		f2.add_rule(IP("10.0.0.128"), IP("10.0.1.255"), ip_filter::blocked);
+		f2.add_rule(IP("20.0.0.0"), IP("20.0.0.1"), ip_filter::blocked);
+		f2.compile();
+
+		std::vector<ip_range<address_v4> > range = boost::get<0>(f2.diff(f1));
+		ip_range<address_v4> expected[] =
+		{
+			{IP4("10.0.1.0"), IP4("10.0.1.255"), ip_filter::blocked}
+			, {IP4("20.0.0.0"), IP4("20.0.0.1"), ip_filter::blocked}
+		};
+		TEST_CHECK(range.size() == 2);
+		TEST_CHECK(range.size() == 2
+			&& std::equal(range.begin(), range.end(), expected, &compare<address_v4>));
+
+		TEST_CHECK(boost::get<0>(f1.diff(f1)).empty());
+		TEST_CHECK(boost::get<0>(f1.diff(f2)).size() == 1);
+		TEST_CHECK(boost::get<0>(f1.diff(ip_filter())).size() == 1);
+	}
+
 	port_filter pf;
 
 	// default contructed port filter should allow any port
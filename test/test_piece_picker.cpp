@@ -593,6 +593,17 @@ int test_main()
 	bool filter_comp[] = {true, false, false, false, false, false, false};
 	TEST_CHECK(std::equal(filter.begin(), filter.end(), filter_comp));
 
+	// test setting the priorities of a range of pieces
+	std::vector<int> range_prios(3, 0);
+	range_prios[2] = 7;
+	TEST_CHECK(p->set_piece_priorities(2, range_prios));
+	TEST_CHECK(p->num_filtered() == 2);
+	TEST_CHECK(!p->set_piece_priorities(2, range_prios));
+	p->piece_priorities(prios);
+	int range_prio_comp[] = {0, 6, 0, 0, 7, 2, 1};
+	TEST_CHECK(std::equal(prios.begin(), prios.end(), range_prio_comp));
+	TEST_CHECK(test_pick(p) == 4);
+
 // ========================================================
 
 	// test restore_piece
@@ -806,6 +817,64 @@ int test_main()
 	p->dec_refcount(bits);
 	TEST_CHECK(test_pick(p) == 0);
 
+	// queued changes that cancel out don't change anything
+	p = setup_picker("1233333", "     * ", "", "");
+	p->inc_refcount(0);
+	p->inc_refcount(0);
+	p->dec_refcount(0);
+	p->dec_refcount(0);
+	TEST_CHECK(test_pick(p) == 0);
+	p->inc_refcount(0);
+	p->inc_refcount(0);
+	TEST_CHECK(test_pick(p) == 1);
+	std::vector<int> avail;
+	p->get_availability(avail);
+	TEST_CHECK(avail[0] == 3);
+
+// ========================================================
+
+	// test peers that have almost all pieces
+	print_title("test near-seed refcounts");
+	p = setup_picker("111111111111", "            ", "", "");
+	bitfield near_seed(12, true);
+	near_seed.clear_bit(3);
+	p->inc_refcount(near_seed);
+	p->get_availability(avail);
+	TEST_CHECK(avail[0] == 2);
+	TEST_CHECK(avail[3] == 1);
+	TEST_CHECK(avail[11] == 2);
+	// the peer that had piece 3 loses it
+	p->dec_refcount(3);
+	p->get_availability(avail);
+	TEST_CHECK(avail[3] == 0);
+	TEST_CHECK(avail[4] == 2);
+	p->dec_refcount(near_seed);
+	p->get_availability(avail);
+	TEST_CHECK(avail[3] == 0);
+	TEST_CHECK(avail[4] == 1);
+
+	// a missing piece nobody else has is counted per piece
+	p = setup_picker("111011111111", "            ", "", "");
+	p->inc_refcount(near_seed);
+	p->get_availability(avail);
+	TEST_CHECK(avail[3] == 0);
+	TEST_CHECK(avail[0] == 2);
+	p->dec_refcount(near_seed);
+	p->get_availability(avail);
+	TEST_CHECK(avail[3] == 0);
+	TEST_CHECK(avail[0] == 1);
+
+// ========================================================
+
+	// test end-game mode
+	print_title("test end-game mode");
+	p = setup_picker("1111111", "*****  ", "1111110", "");
+	TEST_CHECK(!p->is_end_game());
+	p->mark_as_downloading(piece_block(5, 0), &peer_struct, piece_picker::fast);
+	TEST_CHECK(p->is_end_game());
+	p->abort_download(piece_block(5, 0));
+	TEST_CHECK(!p->is_end_game());
+
 // ========================================================
 	
 	// test unverified_blocks, marking blocks and get_downloader
@@ -0,0 +1,107 @@
+#include "libtorrent/piece_picker.hpp"
+#include "libtorrent/bitfield.hpp"
+#include <boost/cstdint.hpp>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include "test.hpp"
+#include "libtorrent/time.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	const int blocks_per_piece = 4;
+
+	void print_rate(char const* name, ptime start, ptime stop, int num)
+	{
+		boost::int64_t ns = total_microseconds(stop - start) * 1000;
+		std::cout << "   " << name << ": " << (num > 0 ? ns / num : 0)
+			<< " ns" << std::endl;
+	}
+
+	void run_benchmark(int num_pieces, int num_peers)
+	{
+		std::cout << num_pieces << " pieces, " << num_peers << " peers" << std::endl;
+
+		std::srand(num_pieces);
+		std::vector<bitfield> peers(num_peers);
+		for (int i = 0; i < num_peers; ++i)
+		{
+			bitfield& b = peers[i];
+			// every tenth peer is almost a seed, the rest
+			// have between 5% and 50% of the pieces
+			int percent = (i % 10 == 0) ? 95 : 5 + std::rand() % 46;
+			b.resize(num_pieces, false);
+			for (int k = 0; k < num_pieces; ++k)
+				if (std::rand() % 100 < percent) b.set_bit(k);
+		}
+
+		piece_picker p;
+		p.init(blocks_per_piece, num_pieces * blocks_per_piece);
+
+		ptime start = time_now();
+		for (int i = 0; i < num_peers; ++i)
+			p.inc_refcount(peers[i]);
+		ptime stop = time_now();
+		print_rate("inc_refcount(bitfield)", start, stop, num_peers);
+
+		const int num_haves = 100000;
+		std::vector<int> haves(num_haves);
+		for (int i = 0; i < num_haves; ++i)
+			haves[i] = std::rand() % num_pieces;
+
+		start = time_now();
+		for (int i = 0; i < num_haves; ++i)
+			p.inc_refcount(haves[i]);
+		stop = time_now();
+		print_rate("inc_refcount(index)", start, stop, num_haves);
+
+		std::vector<int> const empty_vector;
+		std::vector<piece_block> picked;
+		// the first pick rebuilds the piece list
+		p.pick_pieces(peers[0], picked, 16, 0, 0, piece_picker::fast
+			, piece_picker::rarest_first, empty_vector);
+
+		const int num_picks = 1000;
+		start = time_now();
+		for (int i = 0; i < num_picks; ++i)
+		{
+			picked.clear();
+			p.pick_pieces(peers[i % num_peers], picked, 16, 0, 0
+				, piece_picker::fast, piece_picker::rarest_first, empty_vector);
+		}
+		stop = time_now();
+		print_rate("pick_pieces", start, stop, num_picks);
+
+		const int num_finished = (std::min)(num_pieces / 2, 100000);
+		int peer_struct;
+		start = time_now();
+		for (int i = 0; i < num_finished; ++i)
+		{
+			for (int k = 0; k < blocks_per_piece; ++k)
+				p.mark_as_finished(piece_block(i * 2, k), &peer_struct);
+		}
+		stop = time_now();
+		print_rate("mark_as_finished", start, stop, num_finished * blocks_per_piece);
+
+		start = time_now();
+		for (int i = 0; i < num_finished; ++i)
+			p.we_have(i * 2);
+		stop = time_now();
+		print_rate("we_have", start, stop, num_finished);
+
+		TEST_CHECK(p.num_have() == num_finished);
+	}
+}
+
+int test_main()
+{
+	using namespace libtorrent;
+
+	run_benchmark(10000, 2000);
+	run_benchmark(100000, 1000);
+	run_benchmark(1000000, 100);
+	return 0;
+}
@@ -41,6 +41,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/escape_string.hpp"
 #include "libtorrent/broadcast_socket.hpp"
 #include "libtorrent/identify_client.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/gzip.hpp"
+#include "libtorrent/block_math.hpp"
 #ifndef TORRENT_DISABLE_DHT
 #include "libtorrent/kademlia/node_id.hpp"
 #include "libtorrent/kademlia/routing_table.hpp"
@@ -331,8 +334,9 @@ char upnp_xml2[] =
 
 struct parse_state
 {
-	parse_state(): in_service(false) {}
-	void reset(char const* st)
+	parse_state(): in_service(false), fallback_service_type(0)
+		, in_fallback_service(false) {}
+	void reset(char const* st, char const* fallback = 0)
 	{
 		in_service = false;
 		service_type = st;
@@ -340,6 +344,9 @@ struct parse_state
 		control_url.clear();
 		model.clear();
 		url_base.clear();
+		fallback_service_type = fallback;
+		fallback_control_url.clear();
+		in_fallback_service = false;
 	}
 	bool in_service;
 	std::list<std::string> tag_stack;
@@ -347,6 +354,9 @@ struct parse_state
 	char const* service_type;
 	std::string model;
 	std::string url_base;
+	char const* fallback_service_type;
+	std::string fallback_control_url;
+	bool in_fallback_service;
 };
 
 void find_control_url(int type, char const* string, parse_state& state);
@@ -591,6 +601,34 @@ int test_main()
 	TEST_CHECK(received == make_tuple(5, int(strlen(web_seed_response) - 5), false));
 	TEST_CHECK(parser.content_range() == (std::pair<size_type, size_type>(0, 4)));
 	TEST_CHECK(parser.content_length() == 5);
+
+	// test incremental gzip inflating. The stream is fed one
+	// byte at a time, splitting the header and trailer too
+	char const gzipped[] = "\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\xff\xcb\x48"
+		"\xcd\xc9\xc9\x57\x48\xaf\xca\x2c\x50\x28\x2e\x29\x4a\x4d\xcc\xd5"
+		"\x51\xc8\x40\x17\x02\x00\x69\x68\xb6\x83\x24\x00\x00\x00";
+	char const inflated[] = "hello gzip stream, hello gzip stream";
+	{
+		gzip_inflater inflater;
+		std::vector<char> out;
+		std::string error;
+		bool failed = false;
+		for (int i = 0; i < int(sizeof(gzipped)) - 1; ++i)
+			failed |= inflater.decode(gzipped + i, 1, out, 1000, error);
+		TEST_CHECK(!failed);
+		TEST_CHECK(inflater.finished());
+		TEST_CHECK(std::string(out.begin(), out.end()) == inflated);
+	}
+
+	{
+		// the output may not grow past the maximum size
+		gzip_inflater inflater;
+		std::vector<char> out;
+		std::string error;
+		TEST_CHECK(inflater.decode(gzipped, sizeof(gzipped) - 1, out, 10, error));
+		TEST_CHECK(out.size() == 10);
+	}
+
 	// test xml parser
 
 	char xml1[] = "<a>foo<b/>bar</a>";
@@ -652,6 +690,20 @@ int test_main()
 	TEST_CHECK(xml_s.control_url == "/upnp/control/WANPPPConn1");
 	TEST_CHECK(xml_s.model == "Wireless-G ADSL Home Gateway");
 
+	// the PPP connection is found as the fallback in the same pass
+	xml_s.reset("urn:schemas-upnp-org:service:WANIPConnection:1"
+		, "urn:schemas-upnp-org:service:WANPPPConnection:1");
+	xml_parse((char*)upnp_xml2, (char*)upnp_xml2 + sizeof(upnp_xml2)
+		, bind(&find_control_url, _1, _2, boost::ref(xml_s)));
+	TEST_CHECK(xml_s.control_url.empty());
+	TEST_CHECK(xml_s.fallback_control_url == "/upnp/control/WANPPPConn1");
+
+	xml_s.reset("urn:schemas-upnp-org:service:WANIPConnection:1"
+		, "urn:schemas-upnp-org:service:WANPPPConnection:1");
+	xml_parse((char*)upnp_xml, (char*)upnp_xml + sizeof(upnp_xml)
+		, bind(&find_control_url, _1, _2, boost::ref(xml_s)));
+	TEST_CHECK(xml_s.control_url == "/WANIPConnection");
+
 	// test network functions
 
 	error_code ec;
@@ -887,6 +939,105 @@ int test_main()
 	test1.set_bit(1);
 	test1.resize(1);
 	TEST_CHECK(test1.count() == 1);
+
+	bitfield test2(200, false);
+	TEST_CHECK(test2.find_first_set(0) == -1);
+	test2.set_bit(3);
+	test2.set_bit(150);
+	test2.set_bit(199);
+	TEST_CHECK(test2.find_first_set(0) == 3);
+	TEST_CHECK(test2.find_first_set(3) == 3);
+	TEST_CHECK(test2.find_first_set(4) == 150);
+	TEST_CHECK(test2.find_first_set(151) == 199);
+	TEST_CHECK(test2.find_first_set(200) == -1);
+	TEST_CHECK(test2.count() == 3);
+	test2.set_all();
+	TEST_CHECK(test2.count() == 200);
+	TEST_CHECK(test2.find_first_clear(0) == -1);
+	test2.clear_bit(70);
+	test2.clear_bit(198);
+	TEST_CHECK(test2.find_first_clear(0) == 70);
+	TEST_CHECK(test2.find_first_clear(71) == 198);
+	TEST_CHECK(test2.find_first_clear(199) == -1);
+
+	// growing past the inline storage keeps the bits
+	bitfield test3(100, false);
+	test3.set_bit(5);
+	test3.set_bit(99);
+	test3.resize(1000, false);
+	TEST_CHECK(test3.count() == 2);
+	TEST_CHECK(test3.get_bit(5));
+	TEST_CHECK(test3.get_bit(99));
+	test3.set_bit(900);
+	bitfield test4(test3);
+	TEST_CHECK(test4 == test3);
+	test4.clear_bit(5);
+	TEST_CHECK(test4 != test3);
+
+	// bulk operations
+	bitfield test5(1000, false);
+	test5.set_bit(5);
+	test5.set_bit(500);
+	test3 &= test5;
+	TEST_CHECK(test3.count() == 1);
+	TEST_CHECK(test3.get_bit(5));
+	test3 |= test4;
+	TEST_CHECK(test3.count() == 3);
+	test3.andnot(test5);
+	TEST_CHECK(test3.count() == 2);
+	TEST_CHECK(test3.find_first_set(0) == 99);
+	test5.set_all();
+	TEST_CHECK(test5.count() == 1000);
+
+	// test latency_histogram
+	for (int i = 0; i < latency_histogram::num_buckets - 1; ++i)
+	{
+		TEST_CHECK(latency_histogram::bucket_index(
+			latency_histogram::bucket_start(i)) == i);
+		TEST_CHECK(latency_histogram::bucket_index(
+			latency_histogram::bucket_start(i + 1) - 1) == i);
+	}
+	TEST_CHECK(latency_histogram::bucket_index(boost::int64_t(1) << 40)
+		== latency_histogram::num_buckets - 1);
+
+	latency_histogram lh;
+	TEST_CHECK(lh.percentile(0.5) == 0);
+	for (int i = 1; i <= 1000; ++i) lh.add(boost::int64_t(i));
+	TEST_CHECK(lh.samples == 1000);
+	TEST_CHECK(lh.mean() == 500);
+	TEST_CHECK(lh.max_value == 1000);
+	// 500 is in the bucket 448 - 511
+	TEST_CHECK(lh.percentile(0.5) == 511);
+	TEST_CHECK(lh.percentile(1.0) == 1000);
+	latency_histogram lh2;
+	lh2.add(boost::int64_t(1) << 40);
+	lh.merge(lh2);
+	TEST_CHECK(lh.samples == 1001);
+	TEST_CHECK(lh.percentile(1.0) == boost::int64_t(1) << 40);
+
+	// test block_math, with a power of two size and with one
+	// that falls back to dividing
+	block_math bm;
+	TEST_CHECK(bm.size() == 16 * 1024);
+	TEST_CHECK(bm.index(0) == 0);
+	TEST_CHECK(bm.index(16 * 1024 - 1) == 0);
+	TEST_CHECK(bm.index(16 * 1024) == 1);
+	TEST_CHECK(bm.index(size_type(16 * 1024) * 200000) == 200000);
+	TEST_CHECK(bm.remainder(16 * 1024 + 5) == 5);
+	TEST_CHECK(bm.count(0) == 0);
+	TEST_CHECK(bm.count(1) == 1);
+	TEST_CHECK(bm.count(32 * 1024) == 2);
+	TEST_CHECK(bm.count(32 * 1024 + 1) == 3);
+	TEST_CHECK(bm.start(3) == 48 * 1024);
+	TEST_CHECK(bm.aligned(48 * 1024));
+	TEST_CHECK(!bm.aligned(48 * 1024 + 1));
+
+	bm.set_size(1000);
+	TEST_CHECK(bm.index(2999) == 2);
+	TEST_CHECK(bm.remainder(2999) == 999);
+	TEST_CHECK(bm.count(2001) == 3);
+	TEST_CHECK(bm.start(3) == 3000);
+	TEST_CHECK(!bm.aligned(1024));
 	return 0;
 }
 
@@ -0,0 +1,130 @@
+/*
+
+Copyright (c) 2010, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/resume_journal.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/hasher.hpp"
+#include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+#include <string>
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	sha1_hash torrent_hash(int i)
+	{
+		std::string s = boost::lexical_cast<std::string>(i);
+		return hasher(s.c_str(), s.size()).final();
+	}
+
+	entry resume_data(int i, int version)
+	{
+		entry e;
+		e["file-format"] = "libtorrent resume file";
+		e["version"] = version;
+		e["pieces"] = std::string(100 + i, 'a' + version % 26);
+		return e;
+	}
+
+	bool check_record(resume_journal& j, int i, int version)
+	{
+		std::vector<char> buf;
+		error_code ec;
+		if (!j.read(torrent_hash(i), buf, ec)) return false;
+		std::vector<char> expected;
+		bencode(std::back_inserter(expected), resume_data(i, version));
+		return buf == expected;
+	}
+}
+
+int test_main()
+{
+	fs::path p = "resume_journal_test.dat";
+	remove(p);
+	remove(fs::path("resume_journal_test.dat.tmp"));
+
+	error_code ec;
+	{
+		resume_journal j(p);
+		TEST_CHECK(j.open(ec));
+		for (int i = 0; i < 10; ++i)
+			TEST_CHECK(j.append(torrent_hash(i), resume_data(i, 0), ec));
+		// the second version of the first five replaces the first
+		for (int i = 0; i < 5; ++i)
+			TEST_CHECK(j.append(torrent_hash(i), resume_data(i, 1), ec));
+		TEST_CHECK(j.remove(torrent_hash(9), ec));
+		TEST_CHECK(j.num_torrents() == 9);
+	}
+
+	// the journal is indexed again when it's opened
+	{
+		resume_journal j(p);
+		TEST_CHECK(j.open(ec));
+		TEST_CHECK(j.num_torrents() == 9);
+		for (int i = 0; i < 9; ++i)
+			TEST_CHECK(check_record(j, i, i < 5 ? 1 : 0));
+		std::vector<char> buf;
+		TEST_CHECK(!j.read(torrent_hash(9), buf, ec));
+		TEST_CHECK(!ec);
+
+		size_type size = j.size();
+		TEST_CHECK(j.compact(ec));
+		TEST_CHECK(j.size() < size);
+		TEST_CHECK(j.num_torrents() == 9);
+		for (int i = 0; i < 9; ++i)
+			TEST_CHECK(check_record(j, i, i < 5 ? 1 : 0));
+		TEST_CHECK(j.size() == file_size(p));
+	}
+
+	// a record cut short at the end is dropped
+	{
+		size_type size = file_size(p);
+		file f(p, file::read_write, ec);
+		TEST_CHECK(!ec);
+		f.set_size(size - 10, ec);
+		f.close();
+
+		resume_journal j(p);
+		TEST_CHECK(j.open(ec));
+		TEST_CHECK(j.num_torrents() == 8);
+		TEST_CHECK(j.append(torrent_hash(20), resume_data(20, 2), ec));
+		TEST_CHECK(check_record(j, 20, 2));
+	}
+
+	remove(p);
+	return 0;
+}
+
@@ -329,7 +329,7 @@ namespace
 
 void test_check_files(path const& test_path
 	, libtorrent::storage_mode_t storage_mode
-	, bool unbuffered)
+	, bool unbuffered, int disk_threads = 1)
 {
 	boost::intrusive_ptr<torrent_info> info;
 
@@ -366,7 +366,8 @@ void test_check_files(path const& test_path
 
 	file_pool fp;
 	libtorrent::asio::io_service ios;
-	disk_io_thread io(ios);
+	disk_io_thread io(ios, 16 * 1024, disk_threads);
+	TEST_CHECK(io.num_threads() == disk_threads);
 	boost::shared_ptr<int> dummy(new int);
 	boost::intrusive_ptr<piece_manager> pm = new piece_manager(dummy, info
 		, test_path, fp, io, default_storage_constructor, storage_mode);
@@ -417,6 +418,27 @@ void run_test(path const& test_path, bool unbuffered)
 	const int last_file_size = 4 * piece_size - fs.total_size();
 	fs.add_file("temp_storage/test7.tmp", last_file_size);
 
+	// the empty files are skipped when mapping offsets to files
+	TEST_CHECK(fs.file_at_offset(0) == fs.begin());
+	TEST_CHECK(fs.file_at_offset(17) == fs.begin() + 1);
+	TEST_CHECK(fs.file_at_offset(17 + 612) == fs.begin() + 4);
+	TEST_CHECK(fs.file_at_offset(fs.total_size()) == fs.end());
+
+	std::vector<file_slice> slices = fs.map_block(0, 17 + 600, 20);
+	TEST_CHECK(slices.size() == 2);
+	TEST_CHECK(slices.size() == 2 && slices[0].file_index == 1
+		&& slices[0].offset == 600 && slices[0].size == 12);
+	TEST_CHECK(slices.size() == 2 && slices[1].file_index == 4
+		&& slices[1].offset == 0 && slices[1].size == 8);
+
+	// slice_iterator walks the same slices without allocating
+	file_storage::slice_iterator si(fs, 0, 17 + 600, 20);
+	TEST_CHECK(!si.done() && si->file_index == 1 && si->size == 12);
+	++si;
+	TEST_CHECK(!si.done() && si->file_index == 4 && si->offset == 0);
+	++si;
+	TEST_CHECK(si.done());
+
 	libtorrent::create_torrent t(fs, piece_size, -1, 0);
 	t.set_hash(0, hasher(piece0, piece_size).final());
 	t.set_hash(1, hasher(piece1, piece_size).final());
@@ -487,6 +509,7 @@ void run_test(path const& test_path, bool unbuffered)
 	std::cerr << "=== test 6 ===" << std::endl;
 	test_check_files(test_path, storage_mode_sparse, unbuffered);
 	test_check_files(test_path, storage_mode_compact, unbuffered);
+	test_check_files(test_path, storage_mode_sparse, unbuffered, 3);
 }
 
 void test_fastresume(path const& test_path)
@@ -625,6 +648,80 @@ void test_rename_file_in_fastresume(path const& test_path)
 	remove_all(test_path / "tmp2");
 }
 
+void test_ram_storage()
+{
+	// 8 pieces of 256 kiB, and room for 4 of them
+	const int ram_piece_size = 256 * 1024;
+	file_storage fs;
+	fs.add_file("temp_storage/test1.tmp", 8 * ram_piece_size);
+	fs.set_piece_length(ram_piece_size);
+	fs.set_num_pieces(8);
+
+	session_settings set;
+	set.ram_storage_size = 1;
+
+	file_pool fp;
+	disk_buffer_pool dp(16 * 1024);
+	boost::scoped_ptr<storage_interface> s(
+		ram_storage_constructor(fs, initial_path<path>(), fp));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+	TEST_CHECK(!s->initialize(false));
+	TEST_CHECK(!s->has_any_file());
+
+	std::vector<char> buf(ram_piece_size);
+	for (int i = 0; i < 4; ++i)
+	{
+		std::fill(buf.begin(), buf.end(), char(i));
+		TEST_CHECK(s->write(&buf[0], i, 0, ram_piece_size) == ram_piece_size);
+	}
+
+	// a slot that hasn't been written can't be read
+	TEST_CHECK(s->read(&buf[0], 5, 0, 16 * 1024) == -1);
+	TEST_CHECK(s->error() == error_code(errors::piece_evicted, libtorrent_category));
+	s->clear_error();
+
+	// reading slot 0 makes slot 1 the least recently used one
+	TEST_CHECK(s->read(&buf[0], 0, 100, 16 * 1024) == 16 * 1024);
+	TEST_CHECK(buf[0] == 0);
+
+	std::vector<int> dropped;
+	s->dropped_slots(dropped);
+	TEST_CHECK(dropped.empty());
+
+	std::fill(buf.begin(), buf.end(), char(4));
+	TEST_CHECK(s->write(&buf[0], 4, 0, ram_piece_size) == ram_piece_size);
+
+	s->dropped_slots(dropped);
+	TEST_CHECK(dropped.size() == 1 && dropped[0] == 1);
+	TEST_CHECK(s->read(&buf[0], 1, 0, 16 * 1024) == -1);
+	s->clear_error();
+	TEST_CHECK(s->read(&buf[0], 4, ram_piece_size - 10, 10) == 10);
+	TEST_CHECK(buf[0] == 4);
+	TEST_CHECK(s->read(&buf[0], 0, 0, 10) == 10);
+	TEST_CHECK(buf[0] == 0);
+
+	// they're only reported once
+	dropped.clear();
+	s->dropped_slots(dropped);
+	TEST_CHECK(dropped.empty());
+
+	// slots that are partly written are never dropped. Writing all
+	// but the last block of three slots pushes out three complete
+	// ones, and keeps the one that was used last
+	for (int i = 5; i < 8; ++i)
+	{
+		for (int offset = 0; offset < ram_piece_size - 16 * 1024; offset += 16 * 1024)
+			TEST_CHECK(s->write(&buf[0], i, offset, 16 * 1024) == 16 * 1024);
+	}
+	s->dropped_slots(dropped);
+	TEST_CHECK(dropped.size() == 3);
+	TEST_CHECK(std::find(dropped.begin(), dropped.end(), 0) == dropped.end());
+	for (int i = 5; i < 8; ++i)
+		TEST_CHECK(s->read(&buf[0], i, 0, 16 * 1024) == 16 * 1024);
+	TEST_CHECK(s->read(&buf[0], 0, 0, 16 * 1024) == 16 * 1024);
+}
+
 int test_main()
 {
 	// initialize test pieces
@@ -656,6 +753,8 @@ int test_main()
 	std::for_each(test_paths.begin(), test_paths.end(), bind(&run_test, _1, true));
 	std::for_each(test_paths.begin(), test_paths.end(), bind(&run_test, _1, false));
 
+	test_ram_storage();
+
 	return 0;
 }
 
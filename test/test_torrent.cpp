@@ -37,6 +37,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/alert_types.hpp"
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <cstring>
 
 #include "test.hpp"
 #include "setup_transfer.hpp"
@@ -153,6 +154,24 @@ int test_main()
 		boost::intrusive_ptr<torrent_info> info(new torrent_info(&tmp[0], tmp.size()));
 		TEST_CHECK(info->num_pieces() > 0);
 
+		// the file list is decoded again on demand once released
+		TEST_CHECK(info->release_files());
+		TEST_CHECK(info->total_size() == 3 * file_size);
+		TEST_CHECK(info->num_files() == 3);
+		TEST_CHECK(info->file_at(2).offset == 2 * file_size);
+		TEST_CHECK(info->file_at(1).path == "test_torrent_dir2/tmp2");
+
+		// the hashes are read back from the file once paged out
+		boost::shared_array<char> section = info->metadata();
+		error_code ec;
+		TEST_CHECK(info->page_out_piece_hashes("test_torrent.hashes", 2, ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(info->piece_hashes_paged_out());
+		for (int i = 0; i < info->num_pieces(); ++i)
+			TEST_CHECK(info->hash_for_piece(i) == ph);
+		TEST_CHECK(std::memcmp(info->metadata().get(), section.get()
+			, info->metadata_size()) == 0);
+
 		test_running_torrent(info, file_size);
 	}
 